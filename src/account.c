@@ -8,6 +8,13 @@
 #include <time.h>
 #include <arpa/inet.h>
 #include "logging.h" 
+#include "account_alloc.h"
+#include "account_cache.h"
+#include "account_store.h"
+#include "account_validate.h"
+#include "ip_index.h"
+#include "login_span.h"
+#include "password_hash.h"
 #include <ctype.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -41,6 +48,13 @@ bool hex_to_bytes(const char *hex, uint8_t *out) {
   return true;
 }
 
+bool generate_hash(const char *plaintext_password, char *hash, size_t hash_length) {
+  // salted PBKDF2-HMAC-SHA256 at the configured cost, which the hash records
+  // unless it is the legacy 1000 iterations (see password_hash.h)
+  return password_hash_create(plaintext_password, hash, hash_length);
+}
+
+
 /**
  * Create a new account with the specified parameters.
  *
@@ -51,92 +65,11 @@ bool hex_to_bytes(const char *hex, uint8_t *out) {
  * On success, returns a pointer to the newly created account structure.
  * On error, returns NULL and logs an error message.
  */
-bool validate_email(const char *email) {
-  const char *at_ptr = NULL;
-  //Ensures emails exceeding character length are invalidated first before iterating through each character
-  if (strlen(email) >= EMAIL_LENGTH) {
-    log_message(LOG_WARN,"Invalid email: The number of characters exceeds maximum limit.");
-    return false;
-  }
-  //Checks for spaces,non-printable characters & returns false
-  for(size_t i = 0; email[i] != '\0'; i++) {
-    if(email[i] < 32 || email[i] > 126 || email[i] == ' ') {
-      log_message(LOG_WARN,"Invalid email: contains non-printable characters or spaces");
-      return false;
-    }
-  }
-  return true;
-}
-
-//Validate birthdate function
-bool validate_birthdate(const char *birthdate) {
-  if (strlen(birthdate) != BIRTHDATE_LENGTH) {
-    log_message(LOG_WARN,"Invalid birthdate: length is not 10 characters and in YYYY-MM-DD format");
-    return false;
-  }
-  if (birthdate[4] != '-' || birthdate[7] != '-') { //Invalidates birthdates with missing dashes
-    log_message(LOG_WARN,"Invalid birthdate: dashes are missing from supplied birthdate");
-    return false;
-  }
-  for (int i = 0; i < 10; i++) {
-    if (i == 4 || i == 7) continue;
-    if (!isdigit(birthdate[i])) { //Ensures that all characters are digits, excluding dashes
-      log_message(LOG_WARN,"Invalid birthdate: contains non-digit characters");
-      return false;
-    }
-  }
-  return true;
-}
-
-bool generate_hash(const char *plaintext_password, char *hash, size_t hash_length) {
-  unsigned char salt[16];
-  unsigned char hash_buffer[16];
-
-  //Generates a random salt to ensure every password hash is unique - prevents rainbow table attacks
-  if (RAND_bytes(salt, sizeof(salt)) != 1) {
-    log_message(LOG_ERROR,"Failed to generate random salt.");
-    return false;
-  }
-
-  //Hash the password using PBKDF2 with HMAC-SHA256
-  //We could increase the iterations here**** eg(10,000)
-  if (PKCS5_PBKDF2_HMAC(plaintext_password, strlen(plaintext_password),salt,sizeof(salt),1000, EVP_sha256(),16,hash_buffer) != 1) {
-    log_message(LOG_ERROR,"Failed to hash password.");
-    return false;
-  }
-
-  //Converts salt,hash into a 2 character hexadecimal string and combines using ':' as the seperator
-  char combined_hex[2 * (16 + 16) + 2];
-  char *write_ptr = combined_hex;
-
-  for (size_t i = 0; i < sizeof(salt); i++) {
-    snprintf(write_ptr,3,"%02x",salt[i]);
-    write_ptr += 2; //Use of snprintf prevents buffer overflow ensuring safe writing to the buffer
-  }
-
-  *write_ptr++ = ':';
-  for (size_t i = 0; i < sizeof(hash_buffer); i++) {
-    snprintf(write_ptr,3,"%02x",hash_buffer[i]);
-    write_ptr += 2;
-  }
-
-  *write_ptr = '\0'; //Null-terminate the hash string
-
-  if (strlen(combined_hex) >= hash_length) {
-    log_message(LOG_ERROR,"Combined hash exceeds hash buffer size");
-    return false;
-  }
-  strncpy(hash,combined_hex,hash_length); //Copy the combined hash into the provided buffer safely after confirming buffer size
-
-  return true;
-}
-
-
 account_t *account_create(const char *userid, const char *plaintext_password,
                           const char *email, const char *birthdate)
 {
-  // Uses the the struct and dynamically allocates it using malloc
-  account_t *new_user = malloc(sizeof(account_t));
+  // Allocates the struct from the account slab cache (or malloc, see account_alloc.h)
+  account_t *new_user = account_alloc();
   //Allocate memory for the new account and check that it was successful to avoid memory leaks
   if (new_user == NULL) {
    log_message(LOG_ERROR,"Memory allocation for the new user account has failed");
@@ -144,21 +77,27 @@ account_t *account_create(const char *userid, const char *plaintext_password,
    }
   if(!validate_email(email) || !validate_birthdate(birthdate)) {
    log_message(LOG_ERROR,"Validation Error:Invalid email or birthdate.");
-   free(new_user); //Free allocated memory to prevent memory leaks for failed cases
+   account_release(new_user); //Free allocated memory to prevent memory leaks for failed cases
    return NULL;
   }
 
-  if(strlen(userid) >= USER_ID_LENGTH) {
+  if(!validate_userid(userid)) {
    log_message(LOG_ERROR,"Validation Error: User id supplied exceeds maximum length");
-   free(new_user);
+   account_release(new_user);
    return NULL;
 
   }
+  // emails are unique among stored accounts; checked before the costly hash
+  if (account_store_email_in_use(email)) {
+   log_message(LOG_ERROR,"Validation Error: Email is already in use.");
+   account_release(new_user);
+   return NULL;
+  }
   //Generate encoded password hash
   char hash_buffer[HASH_LENGTH]; //Use a buffer to store the hash safely; prevents buffer overflow
   if (!generate_hash(plaintext_password,hash_buffer,sizeof(hash_buffer))) {
       log_message(LOG_ERROR,"Failed to generate password hash.");
-      free(new_user);
+      account_release(new_user);
       return NULL;
   }
   //Strncpy copies the string into the new_user struct and ensures that the string is null-terminated
@@ -176,6 +115,7 @@ account_t *account_create(const char *userid, const char *plaintext_password,
   new_user->password_hash[HASH_LENGTH - 1] = '\0';
 
   //Set the other default fields to 0
+  new_user->account_id = 0;
   new_user->unban_time = 0;
   new_user->expiration_time = 0;
   new_user->login_count = 0;
@@ -188,7 +128,7 @@ account_t *account_create(const char *userid, const char *plaintext_password,
 
 void account_free(account_t *acc) {
      if(acc != NULL) {
-      free(acc);
+      account_release(acc);
      }
 }
 
@@ -207,6 +147,22 @@ bool account_validate_password(const account_t *acc, const char *plaintext_passw
     return false;
   }
 
+  // hashes wrapped by the rehash migration (see password_hash.h)
+  if (password_hash_is_wrapped(acc->password_hash)) {
+    log_message(LOG_DEBUG, "[ account_validate_password() ] checking wrapped hash\n");
+    return password_hash_verify_wrapped(acc->password_hash, plaintext_password);
+  }
+  // hashes made at a calibrated cost, which they record
+  if (password_hash_is_pbkdf2(acc->password_hash)) {
+    log_message(LOG_DEBUG, "[ account_validate_password() ] checking $p2$ hash\n");
+    return password_hash_verify_pbkdf2(acc->password_hash, plaintext_password);
+  }
+  // memory-hard hashes
+  if (password_hash_is_scrypt(acc->password_hash)) {
+    log_message(LOG_DEBUG, "[ account_validate_password() ] checking scrypt hash\n");
+    return password_hash_verify_scrypt(acc->password_hash, plaintext_password);
+  }
+
   // for reading the correct passcode off the struct
   char salt_hex[33], hash_hex[33];
   // unvalidated passcode is SHA256(plaintext_passcode)
@@ -235,7 +191,9 @@ bool account_validate_password(const account_t *acc, const char *plaintext_passw
   hex_to_bytes(hash_hex, validated_password);
 
   log_message(LOG_DEBUG, "[ account_validate_password() ] computing SHA256() of plaintext_password\n");
-  PKCS5_PBKDF2_HMAC(plaintext_password, strlen(plaintext_password), salt, sizeof(salt), 1000, EVP_sha256(), 16, unvalidated_password);
+  uint64_t span_start = login_span_start();
+  PKCS5_PBKDF2_HMAC(plaintext_password, strlen(plaintext_password), salt, sizeof(salt), PASSWORD_HASH_LEGACY_ITERATIONS, EVP_sha256(), 16, unvalidated_password);
+  login_span_end("pbkdf2", span_start);
 
   if (CRYPTO_memcmp(validated_password, unvalidated_password, sizeof(validated_password)) == 0) {
     log_message(LOG_DEBUG, "[ account_validate_password() ] correct password\n");
@@ -252,9 +210,6 @@ bool account_update_password(account_t *acc, const char *new_plaintext_password)
 
   log_message(LOG_DEBUG, "\n[ account_update_password() ] starting\n");
 
-  unsigned char salt[16];
-  unsigned char hash[16];
-
   if (acc == NULL){
     // acc arguement is null
     log_message(LOG_DEBUG, "[ account_update_password() ] ERROR: acc is NULL\n");
@@ -267,42 +222,18 @@ bool account_update_password(account_t *acc, const char *new_plaintext_password)
     return false;
   }
 
-  if (RAND_bytes(salt, sizeof(salt))){
-    // successfully created a salt
-    // source: https://docs.openssl.org/1.0.2/man3/RAND_bytes/
-
-    log_message(LOG_DEBUG, "[ account_update_password() ] successfully created a salt\n");
-  }
-  else {
-    // error created a salt using RAND_bytes()
-    // source: https://docs.openssl.org/1.0.2/man3/RAND_bytes/
-
-    log_message(LOG_DEBUG, "[ account_update_password() ] ERROR: RAND_bytes() function failed\n");
+  log_message(LOG_DEBUG, "[ account_update_password() ] computing hash\n");
+  // fresh salt, current cost (see password_hash.h); the old hash is kept on failure
+  char new_hash[HASH_LENGTH];
+  if (!password_hash_create(new_plaintext_password, new_hash, sizeof(new_hash))) {
+    log_message(LOG_DEBUG, "[ account_update_password() ] ERROR: hashing failed\n");
     return false;
   }
-  
-  log_message(LOG_DEBUG, "[ account_update_password() ] computing SHA256() hash\n");
-  PKCS5_PBKDF2_HMAC(new_plaintext_password, strlen(new_plaintext_password), salt, sizeof(salt), 1000, EVP_sha256(), 16, hash);
-
-  // convert salt to a hex string ended with a ':'
-  // get the fist part of the password_hash address and edit each byte
-  char *pointer_password_hash = acc->password_hash;
-  for (size_t index = 0; index < sizeof(salt); index++) {
-    pointer_password_hash += sprintf(pointer_password_hash, "%02x", salt[index]);
-  }
-
-  // now adding the semi colon to split into salt:hash
-  *pointer_password_hash++ = ':';
-
-  // convert hash to a hex string 
-  for (size_t index = 0; index < sizeof(hash); index++)
-    pointer_password_hash += sprintf(pointer_password_hash, "%02x", hash[index]);
-
-  // null terminate the entire hash
-  *pointer_password_hash = '\0';
+  memcpy(acc->password_hash, new_hash, strlen(new_hash) + 1);
 
   log_message(LOG_DEBUG, "[ account_update_password() ] full computed hash with salt = ");
   log_message(LOG_DEBUG, "%s\n", acc->password_hash);  // use 16 for 128-bit hash
+  account_cache_invalidate(acc->userid);
   return true;
 }
 
@@ -313,6 +244,7 @@ void account_record_login_success(account_t *acc, ip4_addr_t ip) {
   acc->login_fail_count = 0;
   acc->last_login_time = time(NULL);
   acc->last_ip = ip;
+  ip_index_note_login(acc->userid, ip);
   // Log the successful login
   log_message(LOG_INFO, "User %s login SUCCESS from IP: %u", acc->userid, ip);
 }
@@ -343,6 +275,7 @@ void account_set_unban_time(account_t *acc, time_t t) {
 	}
 
 	acc->unban_time = time(NULL) + t; //rewrites unban_time to be current time + whatever extra ban time specified as t
+	account_cache_invalidate(acc->userid);
 	log_message(LOG_INFO, "User %s successfully banned for %ld seconds, set to expire at %ld",acc->userid, t, acc->unban_time); //log message with length of ban and when it expires
 }
 
@@ -353,6 +286,7 @@ void account_set_expiration_time(account_t *acc, time_t t) {
 	}
 
 	acc->expiration_time = time(NULL) + t; //rewrites expiration_time to be current time + extra time specified in t
+	account_cache_invalidate(acc->userid);
 	log_message(LOG_INFO, "User %s's expiration time changed to %ld",acc->userid, acc->expiration_time); //log message with new expiration date
 }
 
@@ -361,8 +295,14 @@ void account_set_email(account_t *acc, const char *new_email) {
     log_message(LOG_WARN,"Failed to set email, for USER ID: %s - invalid email: %s ",acc->userid,new_email);
     return;
   }
+  account_t owner;
+  if (account_store_lookup_email(new_email, &owner) && strcmp(owner.userid, acc->userid) != 0) {
+    log_message(LOG_WARN,"Failed to set email, for USER ID: %s - email already in use: %s ",acc->userid,new_email);
+    return;
+  }
   strncpy(acc->email,new_email,EMAIL_LENGTH - 1);
   acc->email[EMAIL_LENGTH - 1] = '\0';
+  account_cache_invalidate(acc->userid);
   log_message(LOG_INFO,"The email address for USER ID: %s, has been changed to %s", acc->userid,acc->email);
 }
 
@@ -0,0 +1,119 @@
+#include "account_alloc.h"
+
+#include <stdlib.h>
+
+#ifndef ACCOUNT_USE_MALLOC
+
+#include "logging.h"
+#include "slab.h"
+
+#include <pthread.h>
+
+// accounts per slab: about 128 KiB of account_t per slab
+#define ACCOUNTS_PER_SLAB (131072 / sizeof(account_t))
+
+static slab_cache_t *account_cache = NULL;
+static pthread_once_t account_cache_once = PTHREAD_ONCE_INIT;
+
+static void create_account_cache(void)
+{
+  account_cache = slab_cache_create("account_t", sizeof(account_t), ACCOUNTS_PER_SLAB);
+  if (!account_cache) {
+    log_message(LOG_ERROR, "Failed to create account slab cache; falling back to malloc");
+  }
+}
+
+/**
+ * Returns the account slab cache, creating it on first use, or NULL if it
+ * could not be created (in which case malloc is used instead).
+ *
+ * Every account is released the same way it was allocated, because the
+ * cache is created at most once and never destroyed.
+ */
+static slab_cache_t *get_account_cache(void)
+{
+  pthread_once(&account_cache_once, create_account_cache);
+  return account_cache;
+}
+
+account_t *account_alloc(void)
+{
+  slab_cache_t *cache = get_account_cache();
+  return cache ? slab_alloc(cache) : malloc(sizeof(account_t));
+}
+
+void account_release(account_t *acc)
+{
+  slab_cache_t *cache = get_account_cache();
+  if (cache) {
+    slab_free(cache, acc);
+  }
+  else {
+    free(acc);
+  }
+}
+
+size_t account_alloc_bulk(account_t **accounts, size_t n)
+{
+  slab_cache_t *cache = get_account_cache();
+  if (cache) {
+    return slab_alloc_bulk(cache, (void **) accounts, n);
+  }
+  size_t done = 0;
+  while (done < n && (accounts[done] = malloc(sizeof(account_t))) != NULL) {
+    done++;
+  }
+  return done;
+}
+
+void account_release_bulk(account_t **accounts, size_t n)
+{
+  slab_cache_t *cache = get_account_cache();
+  if (cache) {
+    slab_free_bulk(cache, (void **) accounts, n);
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    free(accounts[i]);
+  }
+}
+
+bool account_alloc_uses_slab(void)
+{
+  return get_account_cache() != NULL;
+}
+
+#else // ACCOUNT_USE_MALLOC
+
+account_t *account_alloc(void)
+{
+  return malloc(sizeof(account_t));
+}
+
+void account_release(account_t *acc)
+{
+  free(acc);
+}
+
+size_t account_alloc_bulk(account_t **accounts, size_t n)
+{
+  size_t done = 0;
+  while (done < n && (accounts[done] = malloc(sizeof(account_t))) != NULL) {
+    done++;
+  }
+  return done;
+}
+
+void account_release_bulk(account_t **accounts, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    free(accounts[i]);
+  }
+}
+
+bool account_alloc_uses_slab(void)
+{
+  return false;
+}
+
+#endif // ACCOUNT_USE_MALLOC
@@ -0,0 +1,36 @@
+#ifndef ACCOUNT_ALLOC_H
+#define ACCOUNT_ALLOC_H
+
+/**
+ * @file account_alloc.h
+ * @brief Allocation of account_t structures.
+ *
+ * account_create() and account_free() obtain their memory here. By default
+ * accounts come from a dedicated slab cache (see slab.h), which packs them
+ * densely and makes allocation and free near constant-time. Compiling with
+ * -DACCOUNT_USE_MALLOC switches back to plain malloc()/free(), e.g. for use
+ * with memory checkers that track individual heap blocks.
+ */
+
+#include "account.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// allocate memory for one account (uninitialised). returns NULL on failure.
+account_t *account_alloc(void);
+
+// release memory obtained from account_alloc or account_alloc_bulk.
+// NULL is ignored.
+void account_release(account_t *acc);
+
+// allocate up to n accounts into accounts[]; returns how many were allocated.
+size_t account_alloc_bulk(account_t **accounts, size_t n);
+
+// release n accounts at once; NULL entries are ignored.
+void account_release_bulk(account_t **accounts, size_t n);
+
+// whether accounts are allocated from the slab cache (false with ACCOUNT_USE_MALLOC)
+bool account_alloc_uses_slab(void);
+
+#endif // ACCOUNT_ALLOC_H
@@ -0,0 +1,477 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_cache.h"
+#include "account_store.h"
+#include "db_backend.h"
+#include "logging.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CACHE_SHARD_BITS 4
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS)
+#define GENERATION_SLOTS 64
+#define MAX_FREQ 3
+#define SMALL_PERCENT 10        // share of the budget for the small queue
+#define DATA_COST (sizeof(cache_entry_t) + sizeof(account_t))
+#define GHOST_COST (sizeof(cache_entry_t))
+
+enum { QUEUE_SMALL, QUEUE_MAIN, QUEUE_GHOST, QUEUE_COUNT };
+
+typedef struct cache_entry {
+  struct cache_entry *chain;    // next in the same bucket
+  struct cache_entry *newer;    // neighbours in the entry's queue
+  struct cache_entry *older;
+  uint64_t hash;
+  account_t *acc;               // NULL for a ghost
+  uint64_t expires_ms;          // 0 = never
+  atomic_uint freq;             // hits since entering or last passing through its queue
+  int queue;
+} cache_entry_t;
+
+typedef struct {
+  cache_entry_t *newest;
+  cache_entry_t *oldest;
+  size_t count;
+} fifo_t;
+
+typedef struct {
+  pthread_rwlock_t lock;
+  cache_entry_t **buckets;      // NULL while the cache is disabled
+  size_t nbuckets;              // a power of two
+  fifo_t queues[QUEUE_COUNT];
+  size_t bytes;
+  size_t budget;
+  size_t ghost_limit;
+  unsigned int ttl_ms;
+  // bumped by invalidations, so a lookup that fetched from the backend
+  // meanwhile can tell its result may be stale
+  uint64_t generations[GENERATION_SLOTS];
+} cache_shard_t;
+
+static cache_shard_t shards[CACHE_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool enabled = false;
+static bool hook_added = false;      // guarded by config_mutex
+
+static _Atomic uint64_t hits = 0;
+static _Atomic uint64_t misses = 0;
+static _Atomic uint64_t expired = 0;
+static _Atomic uint64_t evictions = 0;
+static _Atomic uint64_t invalidations = 0;
+
+static void init_shards(void)
+{
+  for (size_t i = 0; i < CACHE_SHARDS; i++) {
+    pthread_rwlock_init(&shards[i].lock, NULL);
+  }
+}
+
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static cache_shard_t *shard_for(uint64_t hash)
+{
+  return &shards[hash >> (64 - CACHE_SHARD_BITS)];
+}
+
+static void fifo_push(fifo_t *fifo, cache_entry_t *e)
+{
+  e->older = fifo->newest;
+  e->newer = NULL;
+  if (fifo->newest) {
+    fifo->newest->newer = e;
+  }
+  else {
+    fifo->oldest = e;
+  }
+  fifo->newest = e;
+  fifo->count++;
+}
+
+static void fifo_unlink(fifo_t *fifo, cache_entry_t *e)
+{
+  if (e->newer) {
+    e->newer->older = e->older;
+  }
+  else {
+    fifo->newest = e->older;
+  }
+  if (e->older) {
+    e->older->newer = e->newer;
+  }
+  else {
+    fifo->oldest = e->newer;
+  }
+  fifo->count--;
+}
+
+/**
+ * Finds the cached account for key or, with ghost set, the ghost for its
+ * hash. Caller holds the shard's lock.
+ */
+static cache_entry_t *find(const cache_shard_t *shard, const userid_key_t *key, bool ghost)
+{
+  if (!shard->buckets) {
+    return NULL;
+  }
+  for (cache_entry_t *e = shard->buckets[key->hash & (shard->nbuckets - 1)]; e; e = e->chain) {
+    if (e->hash == key->hash
+        && (ghost ? !e->acc : e->acc && userid_key_matches(key, e->acc->userid))) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Removes e from its bucket and queue and frees it. Caller holds the
+ * shard's write lock.
+ */
+static void drop(cache_shard_t *shard, cache_entry_t *e)
+{
+  cache_entry_t **link = &shard->buckets[e->hash & (shard->nbuckets - 1)];
+  while (*link != e) {
+    link = &(*link)->chain;
+  }
+  *link = e->chain;
+  fifo_unlink(&shard->queues[e->queue], e);
+  shard->bytes -= e->acc ? DATA_COST : GHOST_COST;
+  free(e->acc);
+  free(e);
+}
+
+/**
+ * Evicts the oldest account in the small queue, unless it was hit more
+ * than once there, in which case it moves to the main queue instead.
+ */
+static void evict_small(cache_shard_t *shard)
+{
+  fifo_t *small = &shard->queues[QUEUE_SMALL];
+  cache_entry_t *e = small->oldest;
+  fifo_unlink(small, e);
+  if (atomic_load_explicit(&e->freq, memory_order_relaxed) > 1) {
+    atomic_store_explicit(&e->freq, 0, memory_order_relaxed);
+    e->queue = QUEUE_MAIN;
+    fifo_push(&shard->queues[QUEUE_MAIN], e);
+    return;
+  }
+  // keep just the hash, as a ghost
+  free(e->acc);
+  e->acc = NULL;
+  shard->bytes -= DATA_COST - GHOST_COST;
+  e->queue = QUEUE_GHOST;
+  fifo_push(&shard->queues[QUEUE_GHOST], e);
+  atomic_fetch_add_explicit(&evictions, 1, memory_order_relaxed);
+  while (shard->queues[QUEUE_GHOST].count > shard->ghost_limit) {
+    drop(shard, shard->queues[QUEUE_GHOST].oldest);
+  }
+}
+
+/**
+ * Evicts the oldest account in the main queue that has not been hit since
+ * it last got here, giving each one passed over another round.
+ */
+static void evict_main(cache_shard_t *shard)
+{
+  fifo_t *main_queue = &shard->queues[QUEUE_MAIN];
+  for (;;) {
+    cache_entry_t *e = main_queue->oldest;
+    unsigned int freq = atomic_load_explicit(&e->freq, memory_order_relaxed);
+    if (freq == 0) {
+      drop(shard, e);
+      atomic_fetch_add_explicit(&evictions, 1, memory_order_relaxed);
+      return;
+    }
+    atomic_store_explicit(&e->freq, freq - 1, memory_order_relaxed);
+    fifo_unlink(main_queue, e);
+    fifo_push(main_queue, e);
+  }
+}
+
+/**
+ * Frees some memory in the shard. Returns false if there is nothing left
+ * to free. Caller holds the shard's write lock.
+ */
+static bool evict_one(cache_shard_t *shard)
+{
+  size_t small_bytes = shard->queues[QUEUE_SMALL].count * DATA_COST;
+  if (shard->queues[QUEUE_SMALL].count > 0
+      && (small_bytes > shard->budget / 100 * SMALL_PERCENT
+          || shard->queues[QUEUE_MAIN].count == 0)) {
+    evict_small(shard);
+  }
+  else if (shard->queues[QUEUE_MAIN].count > 0) {
+    evict_main(shard);
+  }
+  else if (shard->queues[QUEUE_GHOST].count > 0) {
+    drop(shard, shard->queues[QUEUE_GHOST].oldest);
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Caches a copy of acc, the account for key. Caller holds the shard's write
+ * lock.
+ */
+static void insert(cache_shard_t *shard, const userid_key_t *key, const account_t *acc,
+                   uint64_t now)
+{
+  uint64_t expires = shard->ttl_ms ? now + shard->ttl_ms : 0;
+  cache_entry_t *e = find(shard, key, false);
+  if (e) {
+    *e->acc = *acc;
+    e->expires_ms = expires;
+    return;
+  }
+  // seen recently enough to have a ghost: it belongs in the main queue
+  cache_entry_t *ghost = find(shard, key, true);
+  int queue = ghost ? QUEUE_MAIN : QUEUE_SMALL;
+  if (ghost) {
+    drop(shard, ghost);
+  }
+  while (shard->bytes + DATA_COST > shard->budget) {
+    if (!evict_one(shard)) {
+      return;
+    }
+  }
+  e = malloc(sizeof(*e));
+  account_t *copy = malloc(sizeof(*copy));
+  if (!e || !copy) {
+    free(e);
+    free(copy);
+    return;
+  }
+  *copy = *acc;
+  e->hash = key->hash;
+  e->acc = copy;
+  e->expires_ms = expires;
+  atomic_init(&e->freq, 0);
+  e->queue = queue;
+  size_t b = key->hash & (shard->nbuckets - 1);
+  e->chain = shard->buckets[b];
+  shard->buckets[b] = e;
+  fifo_push(&shard->queues[queue], e);
+  shard->bytes += DATA_COST;
+}
+
+/**
+ * Frees everything cached in the shard. Caller holds its write lock.
+ */
+static void empty_shard(cache_shard_t *shard)
+{
+  for (int q = 0; q < QUEUE_COUNT; q++) {
+    while (shard->queues[q].oldest) {
+      drop(shard, shard->queues[q].oldest);
+    }
+  }
+}
+
+static void invalidate_on_change(account_store_op_t op, uint64_t sequence,
+                                 const account_t *acc, void *arg)
+{
+  (void) sequence;
+  (void) arg;
+  if (op != ACCOUNT_STORE_INSERT) {
+    account_cache_invalidate(acc->userid);
+  }
+}
+
+bool account_cache_configure(const account_cache_options_t *opts)
+{
+  pthread_once(&shards_once, init_shards);
+  pthread_mutex_lock(&config_mutex);
+  atomic_store(&enabled, false);
+  size_t budget = opts ? opts->max_bytes / CACHE_SHARDS : 0;
+  // enough buckets for the most entries the budget allows
+  size_t nbuckets = 16;
+  while (budget > 0 && nbuckets < budget / DATA_COST) {
+    nbuckets *= 2;
+  }
+  bool ok = true;
+  for (size_t i = 0; i < CACHE_SHARDS; i++) {
+    cache_shard_t *shard = &shards[i];
+    pthread_rwlock_wrlock(&shard->lock);
+    if (shard->buckets) {
+      empty_shard(shard);
+      free(shard->buckets);
+      shard->buckets = NULL;
+    }
+    for (size_t g = 0; g < GENERATION_SLOTS; g++) {
+      shard->generations[g]++;
+    }
+    if (ok && budget > 0) {
+      shard->buckets = calloc(nbuckets, sizeof(*shard->buckets));
+      ok = shard->buckets != NULL;
+      shard->nbuckets = nbuckets;
+      shard->budget = budget;
+      shard->ghost_limit = budget / DATA_COST;
+    }
+    shard->ttl_ms = opts ? opts->ttl_ms : 0;
+    pthread_rwlock_unlock(&shard->lock);
+  }
+  if (!ok) {
+    log_message(LOG_ERROR, "Memory allocation for account cache has failed");
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+      pthread_rwlock_wrlock(&shards[i].lock);
+      free(shards[i].buckets);
+      shards[i].buckets = NULL;
+      pthread_rwlock_unlock(&shards[i].lock);
+    }
+  }
+
+  bool want_hook = ok && budget > 0;
+  if (want_hook && !hook_added) {
+    hook_added = account_store_add_hook(invalidate_on_change, NULL);
+    ok = hook_added;
+  }
+  else if (!want_hook && hook_added) {
+    account_store_remove_hook(invalidate_on_change, NULL);
+    hook_added = false;
+  }
+  atomic_store(&enabled, ok && budget > 0);
+  pthread_mutex_unlock(&config_mutex);
+  return ok;
+}
+
+bool account_cache_lookup(const char *userid, account_t *acc)
+{
+  userid_key_t key;
+  return userid_key_init(&key, userid) && account_cache_lookup_key(&key, acc);
+}
+
+bool account_cache_lookup_key(const userid_key_t *key, account_t *acc)
+{
+  account_cache_miss_t miss;
+  if (account_cache_probe_key(key, acc, &miss)) {
+    return true;
+  }
+  if (!key || !acc || key->len == USER_ID_LENGTH) {
+    return false;
+  }
+  bool found = db_backend_lookup_key(key, acc);
+  account_cache_fill(key, &miss, found, acc);
+  return found;
+}
+
+bool account_cache_probe_key(const userid_key_t *key, account_t *acc, account_cache_miss_t *miss)
+{
+  *miss = (account_cache_miss_t) { 0 };
+  if (!key || !acc || key->len == USER_ID_LENGTH || !atomic_load(&enabled)) {
+    return false;
+  }
+  cache_shard_t *shard = shard_for(key->hash);
+  uint64_t now = now_ms();
+
+  pthread_rwlock_rdlock(&shard->lock);
+  cache_entry_t *e = find(shard, key, false);
+  bool stale = e && e->expires_ms != 0 && now >= e->expires_ms;
+  if (e && !stale) {
+    *acc = *e->acc;
+    unsigned int freq = atomic_load_explicit(&e->freq, memory_order_relaxed);
+    while (freq < MAX_FREQ
+           && !atomic_compare_exchange_weak_explicit(&e->freq, &freq, freq + 1,
+                                                     memory_order_relaxed,
+                                                     memory_order_relaxed)) {
+      continue;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    atomic_fetch_add_explicit(&hits, 1, memory_order_relaxed);
+    return true;
+  }
+  miss->generation = shard->generations[key->hash % GENERATION_SLOTS];
+  pthread_rwlock_unlock(&shard->lock);
+  miss->now_ms = now;
+  miss->stale = stale;
+  miss->cacheable = true;
+
+  atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+  if (stale) {
+    atomic_fetch_add_explicit(&expired, 1, memory_order_relaxed);
+  }
+  return false;
+}
+
+void account_cache_fill(const userid_key_t *key, const account_cache_miss_t *miss, bool found,
+                        const account_t *acc)
+{
+  if (!miss->cacheable) {
+    return;
+  }
+  cache_shard_t *shard = shard_for(key->hash);
+  pthread_rwlock_wrlock(&shard->lock);
+  // skipped if the account changed (or the cache was reconfigured) meanwhile
+  if (shard->buckets && shard->generations[key->hash % GENERATION_SLOTS] == miss->generation) {
+    cache_entry_t *e;
+    if (found) {
+      insert(shard, key, acc, miss->now_ms);
+    }
+    else if (miss->stale && (e = find(shard, key, false)) != NULL) {
+      drop(shard, e);
+    }
+  }
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+void account_cache_invalidate(const char *userid)
+{
+  userid_key_t key;
+  if (!atomic_load(&enabled) || !userid_key_init(&key, userid)) {
+    return;
+  }
+  cache_shard_t *shard = shard_for(key.hash);
+  pthread_rwlock_wrlock(&shard->lock);
+  shard->generations[key.hash % GENERATION_SLOTS]++;
+  cache_entry_t *e = find(shard, &key, false);
+  if (e) {
+    drop(shard, e);
+    atomic_fetch_add_explicit(&invalidations, 1, memory_order_relaxed);
+  }
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+void account_cache_clear(void)
+{
+  pthread_once(&shards_once, init_shards);
+  for (size_t i = 0; i < CACHE_SHARDS; i++) {
+    pthread_rwlock_wrlock(&shards[i].lock);
+    if (shards[i].buckets) {
+      empty_shard(&shards[i]);
+      for (size_t g = 0; g < GENERATION_SLOTS; g++) {
+        shards[i].generations[g]++;
+      }
+    }
+    pthread_rwlock_unlock(&shards[i].lock);
+  }
+}
+
+void account_cache_get_stats(account_cache_stats_t *stats)
+{
+  if (!stats) {
+    return;
+  }
+  pthread_once(&shards_once, init_shards);
+  memset(stats, 0, sizeof(*stats));
+  stats->hits = atomic_load(&hits);
+  stats->misses = atomic_load(&misses);
+  stats->expired = atomic_load(&expired);
+  stats->evictions = atomic_load(&evictions);
+  stats->invalidations = atomic_load(&invalidations);
+  for (size_t i = 0; i < CACHE_SHARDS; i++) {
+    pthread_rwlock_rdlock(&shards[i].lock);
+    stats->entries += shards[i].queues[QUEUE_SMALL].count + shards[i].queues[QUEUE_MAIN].count;
+    stats->bytes += shards[i].bytes;
+    pthread_rwlock_unlock(&shards[i].lock);
+  }
+}
@@ -0,0 +1,87 @@
+#ifndef ACCOUNT_CACHE_H
+#define ACCOUNT_CACHE_H
+
+/**
+ * @file account_cache.h
+ * @brief In-process read-through cache in front of the account database.
+ *
+ * handle_login() looks accounts up through account_cache_lookup(), which
+ * answers from the cache when it can and otherwise asks the backend (see
+ * db_backend.h) and keeps the result. The cache is off (every lookup goes
+ * to the backend) until account_cache_configure() gives it a memory budget.
+ *
+ * Eviction follows S3-FIFO: new accounts enter a small FIFO queue taking
+ * about a tenth of the budget, and only those hit again before reaching its
+ * end move on to the main FIFO; the rest are evicted, leaving just their
+ * hash in a "ghost" queue so that an account coming back soon after goes
+ * straight to the main queue. Accounts at the end of the main queue that
+ * have been hit since they were last there get another pass. A burst of
+ * one-off lookups (e.g. a credential-stuffing scan) therefore only churns
+ * the small queue, and hits only bump a counter, so they need no more than
+ * a shard's read lock.
+ *
+ * Entries expire after the configured TTL. The account.c functions that
+ * change an account (account_set_* and account_update_password) invalidate
+ * its entry, as do any change made through the account store and
+ * db_backend_record_login(), so that the next lookup fetches it afresh. A
+ * lookup that raced with an invalidation, or with reconfiguring the cache,
+ * does not cache what it fetched.
+ */
+
+#include "account.h"
+#include "userid_key.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  size_t max_bytes;          // memory budget for entries (0 = disable the cache)
+  unsigned int ttl_ms;       // lifetime of an entry (0 = until evicted or invalidated)
+} account_cache_options_t;
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;           // lookups that went to the backend, including expired entries
+  uint64_t expired;          // entries found past their TTL
+  uint64_t evictions;        // entries evicted to stay within the budget
+  uint64_t invalidations;    // entries dropped because the account changed
+  size_t entries;
+  size_t bytes;              // memory charged against max_bytes, including ghosts
+} account_cache_stats_t;
+
+// what account_cache_fill() needs to know about a miss
+typedef struct {
+  uint64_t generation;       // of the account's invalidation slot at the miss
+  uint64_t now_ms;
+  bool stale;                // an expired entry is still cached
+  bool cacheable;            // the cache was on, and the key valid
+} account_cache_miss_t;
+
+// (re)configure the cache, dropping everything cached. returns false
+// (after logging) if memory for it could not be allocated, leaving it off.
+bool account_cache_configure(const account_cache_options_t *opts);
+
+// look up userid through the cache, as db_backend_lookup()
+bool account_cache_lookup(const char *userid, account_t *acc);
+
+// as account_cache_lookup(), for a userid already made into a key
+bool account_cache_lookup_key(const userid_key_t *key, account_t *acc);
+
+// the two halves of account_cache_lookup_key(), for callers fetching from
+// the backend themselves (e.g. asynchronously): look key up in the cache
+// only, returning true on a hit; on a miss, fill in miss, fetch the account,
+// then pass the outcome to account_cache_fill() to keep it
+bool account_cache_probe_key(const userid_key_t *key, account_t *acc, account_cache_miss_t *miss);
+void account_cache_fill(const userid_key_t *key, const account_cache_miss_t *miss, bool found,
+                        const account_t *acc);
+
+// drop any cached copy of the account with the given userid
+void account_cache_invalidate(const char *userid);
+
+// drop every cached account, keeping the configuration
+void account_cache_clear(void);
+
+void account_cache_get_stats(account_cache_stats_t *stats);
+
+#endif // ACCOUNT_CACHE_H
@@ -0,0 +1,386 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_checkpoint.h"
+#include "account_alloc.h"
+#include "account_codec.h"
+#include "account_store.h"
+#include "crc32.h"
+#include "logging.h"
+#include "thread_pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC "ACKP"
+#define CHECKPOINT_VERSION 1
+#define HEADER_SIZE 32          // magic, version, sequence, count, nblocks, crc
+#define BLOCK_HEADER_SIZE 12    // payload length, account count, payload crc
+#define BLOCK_SIZE (64 * 1024)  // payload bytes per block, at most
+
+/**
+ * One shard's worth of encoded blocks, built under the shard's read lock
+ * and written out after it is released.
+ */
+typedef struct {
+  unsigned char *data;
+  size_t len;
+  size_t cap;
+  size_t block_start;     // offset of the open block's header, if block_count > 0
+  uint32_t block_count;   // accounts in the open block
+  uint64_t accounts;      // accounts encoded in all blocks so far
+  uint32_t blocks;        // blocks finished so far
+  bool failed;
+} encoder_t;
+
+typedef struct {
+  const unsigned char *block;
+  atomic_bool *failed;
+} load_task_t;
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++) {
+    p[i] = (unsigned char) (v >> (8 * i));
+  }
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+  for (int i = 0; i < 8; i++) {
+    p[i] = (unsigned char) (v >> (8 * i));
+  }
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    v |= (uint32_t) p[i] << (8 * i);
+  }
+  return v;
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++) {
+    v |= (uint64_t) p[i] << (8 * i);
+  }
+  return v;
+}
+
+static bool write_all(int fd, const unsigned char *data, size_t len)
+{
+  while (len > 0) {
+    ssize_t result = write(fd, data, len);
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += result;
+    len -= (size_t) result;
+  }
+  return true;
+}
+
+/**
+ * Fills in the header of the open block, if it has any accounts.
+ */
+static void finish_block(encoder_t *enc)
+{
+  if (enc->block_count == 0) {
+    return;
+  }
+  unsigned char *header = enc->data + enc->block_start;
+  size_t payload_len = enc->len - enc->block_start - BLOCK_HEADER_SIZE;
+  put_u32(header, (uint32_t) payload_len);
+  put_u32(header + 4, enc->block_count);
+  put_u32(header + 8, crc32_compute(header + BLOCK_HEADER_SIZE, payload_len));
+  enc->blocks++;
+  enc->block_count = 0;
+}
+
+static bool encode_account(const account_t *acc, void *arg)
+{
+  encoder_t *enc = arg;
+  if (enc->block_count > 0
+      && enc->len - enc->block_start - BLOCK_HEADER_SIZE + ACCOUNT_CODEC_MAX_SIZE > BLOCK_SIZE) {
+    finish_block(enc);
+  }
+  size_t needed = BLOCK_HEADER_SIZE + ACCOUNT_CODEC_MAX_SIZE;
+  if (enc->len + needed > enc->cap) {
+    size_t cap = enc->cap ? enc->cap * 2 : BLOCK_SIZE + needed;
+    unsigned char *data = realloc(enc->data, cap);
+    if (!data) {
+      log_message(LOG_ERROR, "Memory allocation for account checkpoint has failed");
+      enc->failed = true;
+      return false;
+    }
+    enc->data = data;
+    enc->cap = cap;
+  }
+  if (enc->block_count == 0) {
+    enc->block_start = enc->len;
+    enc->len += BLOCK_HEADER_SIZE;
+  }
+  enc->len += account_codec_encode(acc, enc->data + enc->len);
+  enc->block_count++;
+  enc->accounts++;
+  return true;
+}
+
+/**
+ * Writes the snapshot's accounts to fd after room for the file header,
+ * then fills the header in. Returns false (after logging) on failure.
+ */
+static bool write_snapshot(int fd, const char *path, uint64_t sequence)
+{
+  unsigned char header[HEADER_SIZE] = { 0 };
+  if (!write_all(fd, header, sizeof(header))) {
+    log_message(LOG_ERROR, "Failed to write account checkpoint %s: %s", path, strerror(errno));
+    return false;
+  }
+  encoder_t enc = { 0 };
+  bool ok = true;
+  for (size_t s = 0; ok && s < ACCOUNT_STORE_SHARDS; s++) {
+    ok = account_store_snapshot_foreach_in_shard(s, encode_account, &enc) && !enc.failed;
+    finish_block(&enc);
+    if (ok && !write_all(fd, enc.data, enc.len)) {
+      log_message(LOG_ERROR, "Failed to write account checkpoint %s: %s", path, strerror(errno));
+      ok = false;
+    }
+    enc.len = 0;
+  }
+  free(enc.data);
+  if (!ok) {
+    return false;
+  }
+
+  memcpy(header, CHECKPOINT_MAGIC, 4);
+  put_u32(header + 4, CHECKPOINT_VERSION);
+  put_u64(header + 8, sequence);
+  put_u64(header + 16, enc.accounts);
+  put_u32(header + 24, enc.blocks);
+  put_u32(header + 28, crc32_compute(header, 28));
+  if (pwrite(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header) || fsync(fd) == -1) {
+    log_message(LOG_ERROR, "Failed to write account checkpoint %s: %s", path, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool account_checkpoint_write(const char *path, uint64_t *sequence)
+{
+  if (!path) {
+    return false;
+  }
+  char tmp_path[4096];
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) {
+    log_message(LOG_ERROR, "Account checkpoint path is too long");
+    return false;
+  }
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    log_message(LOG_ERROR, "Failed to create %s: %s", tmp_path, strerror(errno));
+    return false;
+  }
+
+  uint64_t snapshot_sequence;
+  if (!account_store_snapshot_begin(&snapshot_sequence)) {
+    close(fd);
+    unlink(tmp_path);
+    return false;
+  }
+  bool ok = write_snapshot(fd, tmp_path, snapshot_sequence);
+  if (!account_store_snapshot_end()) {
+    log_message(LOG_ERROR, "Account checkpoint %s may be inconsistent; discarding it", path);
+    ok = false;
+  }
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(tmp_path, path) == -1) {
+    if (ok) {
+      log_message(LOG_ERROR, "Failed to rename %s: %s", tmp_path, strerror(errno));
+    }
+    unlink(tmp_path);
+    return false;
+  }
+  if (sequence) {
+    *sequence = snapshot_sequence;
+  }
+  return true;
+}
+
+/**
+ * Decodes one (already checked) block and inserts its accounts.
+ */
+static void load_block(void *arg)
+{
+  load_task_t *task = arg;
+  uint32_t payload_len = get_u32(task->block);
+  uint32_t count = get_u32(task->block + 4);
+  const unsigned char *p = task->block + BLOCK_HEADER_SIZE;
+  const unsigned char *end = p + payload_len;
+  for (uint32_t i = 0; i < count && !atomic_load(task->failed); i++) {
+    account_t *acc = account_alloc();
+    if (!acc) {
+      log_message(LOG_ERROR, "Memory allocation for account has failed");
+      atomic_store(task->failed, true);
+      return;
+    }
+    size_t used = account_codec_decode(p, (size_t) (end - p), acc);
+    if (used == 0) {
+      log_message(LOG_ERROR, "Account checkpoint has a malformed account record");
+      account_release(acc);
+      atomic_store(task->failed, true);
+      return;
+    }
+    p += used;
+    if (!account_store_insert(acc)) {
+      account_release(acc);
+      atomic_store(task->failed, true);
+      return;
+    }
+  }
+  if (p != end) {
+    log_message(LOG_ERROR, "Account checkpoint block has trailing bytes");
+    atomic_store(task->failed, true);
+  }
+}
+
+/**
+ * Checks the header and every block's CRC of the len-byte checkpoint at
+ * data, and fills tasks[] (room for the header's block count) with where
+ * the blocks start. Returns the number of blocks, or -1 (after logging) if
+ * the file is malformed or corrupt.
+ */
+static long check_checkpoint(const unsigned char *data, size_t len, const char *path,
+                             load_task_t **tasks_out)
+{
+  *tasks_out = NULL;
+  if (len < HEADER_SIZE || memcmp(data, CHECKPOINT_MAGIC, 4) != 0
+      || get_u32(data + 28) != crc32_compute(data, 28)) {
+    log_message(LOG_ERROR, "%s is not an account checkpoint, or its header is corrupt", path);
+    return -1;
+  }
+  if (get_u32(data + 4) != CHECKPOINT_VERSION) {
+    log_message(LOG_ERROR, "Account checkpoint %s has unsupported version %u",
+                path, get_u32(data + 4));
+    return -1;
+  }
+  uint64_t count = get_u64(data + 16);
+  uint32_t nblocks = get_u32(data + 24);
+  load_task_t *tasks = nblocks ? calloc(nblocks, sizeof(*tasks)) : NULL;
+  if (nblocks && !tasks) {
+    log_message(LOG_ERROR, "Memory allocation for account checkpoint has failed");
+    return -1;
+  }
+
+  size_t offset = HEADER_SIZE;
+  uint64_t seen = 0;
+  for (uint32_t b = 0; b < nblocks; b++) {
+    if (len - offset < BLOCK_HEADER_SIZE
+        || len - offset - BLOCK_HEADER_SIZE < get_u32(data + offset)) {
+      log_message(LOG_ERROR, "Account checkpoint %s is truncated", path);
+      free(tasks);
+      return -1;
+    }
+    uint32_t payload_len = get_u32(data + offset);
+    if (crc32_compute(data + offset + BLOCK_HEADER_SIZE, payload_len)
+        != get_u32(data + offset + 8)) {
+      log_message(LOG_ERROR, "Account checkpoint %s is corrupt (block %u)", path, b);
+      free(tasks);
+      return -1;
+    }
+    tasks[b].block = data + offset;
+    seen += get_u32(data + offset + 4);
+    offset += BLOCK_HEADER_SIZE + payload_len;
+  }
+  if (offset != len || seen != count) {
+    log_message(LOG_ERROR, "Account checkpoint %s is inconsistent with its header", path);
+    free(tasks);
+    return -1;
+  }
+  *tasks_out = tasks;
+  return (long) nblocks;
+}
+
+bool account_checkpoint_load(const char *path, unsigned int threads, uint64_t *sequence)
+{
+  if (!path) {
+    return false;
+  }
+  if (account_store_count() != 0) {
+    log_message(LOG_ERROR, "Account checkpoint can only be loaded into an empty store");
+    return false;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    log_message(LOG_ERROR, "Failed to open account checkpoint %s: %s", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < HEADER_SIZE) {
+    log_message(LOG_ERROR, "%s is not an account checkpoint", path);
+    close(fd);
+    return false;
+  }
+  size_t len = (size_t) st.st_size;
+  unsigned char *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    log_message(LOG_ERROR, "Failed to map account checkpoint %s: %s", path, strerror(errno));
+    return false;
+  }
+  posix_madvise(data, len, POSIX_MADV_SEQUENTIAL);
+
+  load_task_t *tasks;
+  long nblocks = check_checkpoint(data, len, path, &tasks);
+  atomic_bool failed = nblocks < 0;
+  if (nblocks > 0) {
+    for (long b = 0; b < nblocks; b++) {
+      tasks[b].failed = &failed;
+    }
+    thread_pool_t *pool = nblocks > 1 && threads != 1 ? thread_pool_create(threads) : NULL;
+    if (pool) {
+      thread_pool_group_t group;
+      thread_pool_group_init(&group);
+      for (long b = 0; b < nblocks; b++) {
+        if (!thread_pool_submit(pool, &group, load_block, &tasks[b])) {
+          load_block(&tasks[b]);
+        }
+      }
+      thread_pool_group_wait(&group);
+      thread_pool_group_destroy(&group);
+      thread_pool_destroy(pool);
+    }
+    else {
+      for (long b = 0; b < nblocks; b++) {
+        load_block(&tasks[b]);
+      }
+    }
+  }
+  free(tasks);
+
+  bool ok = !atomic_load(&failed);
+  if (ok) {
+    uint64_t checkpoint_sequence = get_u64(data + 8);
+    account_store_advance_sequence(checkpoint_sequence);
+    if (sequence) {
+      *sequence = checkpoint_sequence;
+    }
+  }
+  else {
+    account_store_clear();
+  }
+  munmap(data, len);
+  return ok;
+}
@@ -0,0 +1,38 @@
+#ifndef ACCOUNT_CHECKPOINT_H
+#define ACCOUNT_CHECKPOINT_H
+
+/**
+ * @file account_checkpoint.h
+ * @brief Compact, checksummed checkpoints of the account store.
+ *
+ * A checkpoint is written from a snapshot of the store (see
+ * account_store_snapshot_begin()), so logins carry on while it is taken:
+ * each shard is encoded in memory under its read lock, and written out with
+ * no lock held. Accounts are stored with account_codec.h in blocks of up to
+ * 64 KiB, each with its own CRC-32, after a header giving the store
+ * sequence number the snapshot was taken at. The file is written next to
+ * its destination, synced and renamed into place, so a crash leaves either
+ * the old or the new checkpoint.
+ *
+ * Loading maps the file, checks every CRC before touching the store, and
+ * then decodes blocks in parallel straight from the mapping. Together with
+ * account_journal.h, loading a checkpoint and replaying the journal after
+ * its sequence number restores the store as it was at shutdown.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// write a checkpoint of the store to path, setting *sequence (if not NULL)
+// to the store sequence number it is consistent with. fails (after
+// logging) if another snapshot is active or on I/O errors.
+bool account_checkpoint_write(const char *path, uint64_t *sequence);
+
+// load the checkpoint at path into the store, which must be empty, using
+// up to threads threads (0 = number of online CPUs), and set *sequence (if
+// not NULL) to its sequence number. the store's sequence is advanced past
+// it. fails (after logging), leaving the store empty, if the file is
+// missing, malformed or corrupt.
+bool account_checkpoint_load(const char *path, unsigned int threads, uint64_t *sequence);
+
+#endif // ACCOUNT_CHECKPOINT_H
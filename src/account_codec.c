@@ -0,0 +1,110 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_codec.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static unsigned char *put_u32(unsigned char *p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++) {
+    p[i] = (unsigned char) (v >> (8 * i));
+  }
+  return p + 4;
+}
+
+static unsigned char *put_u64(unsigned char *p, uint64_t v)
+{
+  for (int i = 0; i < 8; i++) {
+    p[i] = (unsigned char) (v >> (8 * i));
+  }
+  return p + 8;
+}
+
+static unsigned char *put_string(unsigned char *p, const char *s, size_t max)
+{
+  size_t len = strnlen(s, max);
+  *p++ = (unsigned char) len;
+  memcpy(p, s, len);
+  return p + len;
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    v |= (uint32_t) p[i] << (8 * i);
+  }
+  return v;
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++) {
+    v |= (uint64_t) p[i] << (8 * i);
+  }
+  return v;
+}
+
+/**
+ * Decodes a length-prefixed string into dest (of size max). Returns the
+ * position after it, or NULL if it is too long or runs past end.
+ */
+static const unsigned char *get_string(const unsigned char *p, const unsigned char *end,
+                                       char *dest, size_t max)
+{
+  if (p >= end || *p > max || (size_t) (end - p - 1) < *p) {
+    return NULL;
+  }
+  size_t len = *p++;
+  memcpy(dest, p, len);
+  return p + len;
+}
+
+size_t account_codec_encode(const account_t *acc, unsigned char *out)
+{
+  unsigned char *p = out;
+  p = put_u64(p, (uint64_t) acc->account_id);
+  p = put_string(p, acc->userid, USER_ID_LENGTH);
+  p = put_string(p, acc->password_hash, HASH_LENGTH);
+  p = put_string(p, acc->email, EMAIL_LENGTH);
+  memcpy(p, acc->birthdate, BIRTHDATE_LENGTH);
+  p += BIRTHDATE_LENGTH;
+  p = put_u64(p, (uint64_t) acc->unban_time);
+  p = put_u64(p, (uint64_t) acc->expiration_time);
+  p = put_u32(p, acc->login_count);
+  p = put_u32(p, acc->login_fail_count);
+  p = put_u64(p, (uint64_t) acc->last_login_time);
+  p = put_u32(p, acc->last_ip);
+  return (size_t) (p - out);
+}
+
+size_t account_codec_decode(const unsigned char *in, size_t len, account_t *acc)
+{
+  const unsigned char *end = in + len;
+  const unsigned char *p = in;
+  memset(acc, 0, sizeof(*acc));
+  if (len < 8) {
+    return 0;
+  }
+  acc->account_id = (int64_t) get_u64(p);
+  p += 8;
+  p = get_string(p, end, acc->userid, USER_ID_LENGTH);
+  p = p ? get_string(p, end, acc->password_hash, HASH_LENGTH - 1) : NULL;
+  p = p ? get_string(p, end, acc->email, EMAIL_LENGTH) : NULL;
+  // the fixed-size rest: birthdate, 3 64-bit and 3 32-bit numbers
+  if (!p || (size_t) (end - p) < BIRTHDATE_LENGTH + 3 * 8 + 3 * 4) {
+    return 0;
+  }
+  memcpy(acc->birthdate, p, BIRTHDATE_LENGTH);
+  p += BIRTHDATE_LENGTH;
+  acc->unban_time = (time_t) get_u64(p);
+  acc->expiration_time = (time_t) get_u64(p + 8);
+  acc->login_count = get_u32(p + 16);
+  acc->login_fail_count = get_u32(p + 20);
+  acc->last_login_time = (time_t) get_u64(p + 24);
+  acc->last_ip = get_u32(p + 32);
+  p += 36;
+  return (size_t) (p - in);
+}
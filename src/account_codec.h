@@ -0,0 +1,29 @@
+#ifndef ACCOUNT_CODEC_H
+#define ACCOUNT_CODEC_H
+
+/**
+ * @file account_codec.h
+ * @brief Compact, portable binary encoding of account_t for files.
+ *
+ * Strings are stored as a length byte followed by their characters (no
+ * padding or terminator), the birthdate as its BIRTHDATE_LENGTH bytes, and
+ * numbers as fixed-width little-endian integers. Decoding gives the same
+ * account_t, with unused string bytes zeroed.
+ */
+
+#include "account.h"
+
+#include <stddef.h>
+
+#define ACCOUNT_CODEC_MAX_SIZE \
+  (3 + USER_ID_LENGTH + HASH_LENGTH + EMAIL_LENGTH + BIRTHDATE_LENGTH + 4 * 8 + 3 * 4)
+
+// encode acc into out (at least ACCOUNT_CODEC_MAX_SIZE bytes).
+// returns the number of bytes written.
+size_t account_codec_encode(const account_t *acc, unsigned char *out);
+
+// decode an account from the len bytes at in. returns the number of bytes
+// used, or 0 if they do not start with a well-formed encoding.
+size_t account_codec_decode(const unsigned char *in, size_t len, account_t *acc);
+
+#endif // ACCOUNT_CODEC_H
@@ -0,0 +1,752 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_dataset.h"
+#include "account_cache.h"
+#include "account_store.h"
+#include "logging.h"
+#include "userid_filter.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_SLOTS 16
+#define NO_SLOT SIZE_MAX
+// retired items are looked at for freeing once this many have built up
+#define RECLAIM_BATCH 64
+
+/**
+ * Something taken out of the live dataset, waiting for the lookups that
+ * might still be reading it to finish. Embedded first in what it retires.
+ */
+typedef struct retired {
+  struct retired *next;
+  uint64_t epoch;                    // global epoch when it was retired
+  void (*free_fn)(struct retired *);
+} retired_t;
+
+typedef struct {
+  retired_t retired;
+  account_t acc;                     // never changed once installed
+} entry_t;
+
+typedef struct {
+  _Atomic uint64_t hash;             // of the entry's userid
+  _Atomic(entry_t *) entry;          // NULL = never used, &tombstone = removed
+} slot_t;
+
+typedef struct {
+  retired_t retired;
+  slot_t *slots;
+  size_t mask;                       // slots - 1
+  size_t used;                       // slots not NULL
+  _Atomic size_t count;              // slots holding accounts
+  uint64_t number;
+} version_t;
+
+/**
+ * One thread's announcement of the epoch its current lookup started in.
+ */
+typedef struct reader {
+  _Atomic uint64_t epoch;            // 0 = not looking anything up
+  atomic_bool in_use;                // owned by a live thread
+  struct reader *next;               // immutable once published
+} reader_t;
+
+typedef enum {
+  CHANGE_LOGIN,
+  CHANGE_UPDATE,
+  CHANGE_REMOVE
+} change_op_t;
+
+typedef struct {
+  change_op_t op;
+  account_t acc;
+} change_t;
+
+typedef enum {
+  APPLIED,
+  NOT_FOUND,
+  NO_MEMORY
+} apply_result_t;
+
+struct account_dataset_build {
+  version_t *version;                // private to the builder until published
+  atomic_bool failed;
+};
+
+static entry_t tombstone;
+
+static _Atomic(version_t *) current = NULL;
+// starts at 1 so that a reader's 0 can mean idle
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(reader_t *) reader_list = NULL;
+static _Thread_local reader_t *local_reader = NULL;
+static pthread_key_t reader_key;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// serializes changes, builds and reclaiming, and guards what follows
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static retired_t *retired_list = NULL;
+static size_t retired_count = 0;
+static account_dataset_build_t *building = NULL;
+static change_t *changes = NULL;
+static size_t nchanges = 0;
+static size_t changes_allocated = 0;
+
+static _Atomic uint64_t reloads = 0;
+static _Atomic uint64_t carried = 0;
+static _Atomic uint64_t retired = 0;
+static _Atomic uint64_t reclaimed = 0;
+
+static void release_reader(void *arg)
+{
+  reader_t *reader = arg;
+  atomic_store(&reader->epoch, 0);
+  atomic_store_explicit(&reader->in_use, false, memory_order_release);
+}
+
+static void init_readers(void)
+{
+  pthread_key_create(&reader_key, release_reader);
+}
+
+/**
+ * Returns this thread's reader record, claiming a released one or
+ * allocating and publishing a new one on first use. Returns NULL if memory
+ * is exhausted.
+ */
+static reader_t *thread_reader(void)
+{
+  if (local_reader) {
+    return local_reader;
+  }
+  pthread_once(&init_once, init_readers);
+
+  reader_t *reader = atomic_load_explicit(&reader_list, memory_order_acquire);
+  for (; reader; reader = reader->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&reader->in_use, &expected, true)) {
+      break;
+    }
+  }
+  if (!reader) {
+    reader = calloc(1, sizeof(*reader));
+    if (!reader) {
+      return NULL;
+    }
+    atomic_store_explicit(&reader->in_use, true, memory_order_relaxed);
+    reader->next = atomic_load_explicit(&reader_list, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&reader_list, &reader->next, reader,
+                                                  memory_order_release,
+                                                  memory_order_relaxed)) {
+      continue;
+    }
+  }
+  pthread_setspecific(reader_key, reader);
+  local_reader = reader;
+  return reader;
+}
+
+/**
+ * Announces that this thread is about to read the dataset. The
+ * announcement and the loads of the version and its slots that follow are
+ * all sequentially consistent, as are the stores that unlink things and
+ * the loads in reclaim_locked() that read announcements, so either a
+ * writer sees this one or this thread sees what the writer unlinked gone.
+ */
+static reader_t *read_begin(void)
+{
+  reader_t *reader = thread_reader();
+  if (reader) {
+    atomic_store(&reader->epoch, atomic_load(&global_epoch));
+  }
+  return reader;
+}
+
+static void read_end(reader_t *reader)
+{
+  atomic_store(&reader->epoch, 0);
+}
+
+/**
+ * Frees every retired item that was retired before the oldest epoch still
+ * announced. Call with write_lock held.
+ */
+static size_t reclaim_locked(void)
+{
+  uint64_t oldest = UINT64_MAX;
+  reader_t *reader = atomic_load_explicit(&reader_list, memory_order_acquire);
+  for (; reader; reader = reader->next) {
+    uint64_t epoch = atomic_load(&reader->epoch);
+    if (epoch != 0 && epoch < oldest) {
+      oldest = epoch;
+    }
+  }
+
+  size_t freed = 0;
+  retired_t **link = &retired_list;
+  while (*link) {
+    retired_t *item = *link;
+    if (item->epoch < oldest) {
+      *link = item->next;
+      item->free_fn(item);
+      freed++;
+    } else {
+      link = &item->next;
+    }
+  }
+  retired_count -= freed;
+  atomic_fetch_add_explicit(&reclaimed, freed, memory_order_relaxed);
+  return freed;
+}
+
+/**
+ * Queues item, already unlinked from the live dataset, to be freed once no
+ * lookup can be reading it: a lookup that announced the epoch current now,
+ * or an earlier one, may have found it. Call with write_lock held.
+ */
+static void retire(retired_t *item, void (*free_fn)(retired_t *))
+{
+  item->epoch = atomic_fetch_add(&global_epoch, 1);
+  item->free_fn = free_fn;
+  item->next = retired_list;
+  retired_list = item;
+  atomic_fetch_add_explicit(&retired, 1, memory_order_relaxed);
+  if (++retired_count >= RECLAIM_BATCH) {
+    reclaim_locked();
+  }
+}
+
+static void free_entry(retired_t *item)
+{
+  free(item);
+}
+
+// frees a version's table but not its accounts (which it has handed on)
+static void free_version_shell(retired_t *item)
+{
+  version_t *version = (version_t *) item;
+  free(version->slots);
+  free(version);
+}
+
+static void free_version(retired_t *item)
+{
+  version_t *version = (version_t *) item;
+  for (size_t i = 0; i <= version->mask; i++) {
+    entry_t *entry = atomic_load_explicit(&version->slots[i].entry, memory_order_relaxed);
+    if (entry && entry != &tombstone) {
+      free(entry);
+    }
+  }
+  free_version_shell(item);
+}
+
+/**
+ * Disposes of an entry taken out of a version: one lookups may be reading
+ * is retired, one in a build's private version freed at once.
+ */
+static void dispose(entry_t *entry, bool live)
+{
+  if (live) {
+    retire(&entry->retired, free_entry);
+  } else {
+    free(entry);
+  }
+}
+
+// slots for count accounts, leaving at least half of them empty
+static size_t capacity_for(size_t count)
+{
+  size_t capacity = MIN_SLOTS;
+  while (capacity / 2 < count) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+static version_t *new_version(size_t capacity, uint64_t number)
+{
+  version_t *version = calloc(1, sizeof(*version));
+  if (!version) {
+    return NULL;
+  }
+  version->slots = calloc(capacity, sizeof(*version->slots));
+  if (!version->slots) {
+    free(version);
+    return NULL;
+  }
+  version->mask = capacity - 1;
+  version->number = number;
+  return version;
+}
+
+/**
+ * Returns the slot holding key's account, setting *found to its entry, or
+ * NO_SLOT. If free_slot is not NULL, it is set to where the account would
+ * be placed: the first removed slot on its probe sequence, else the empty
+ * slot that ended it.
+ */
+static size_t find_slot(version_t *version, const userid_key_t *key, entry_t **found,
+                        size_t *free_slot)
+{
+  size_t place = NO_SLOT;
+  for (size_t i = key->hash & version->mask;; i = (i + 1) & version->mask) {
+    entry_t *entry = atomic_load(&version->slots[i].entry);
+    if (!entry) {
+      if (free_slot) {
+        *free_slot = place == NO_SLOT ? i : place;
+      }
+      return NO_SLOT;
+    }
+    if (entry == &tombstone) {
+      if (place == NO_SLOT) {
+        place = i;
+      }
+    } else if (atomic_load_explicit(&version->slots[i].hash, memory_order_relaxed) == key->hash
+               && userid_key_matches(key, entry->acc.userid)) {
+      *found = entry;
+      return i;
+    }
+  }
+}
+
+/**
+ * Returns a copy of version, sized for its accounts, holding the same
+ * entries (the copy takes them over). Returns NULL if memory runs out.
+ */
+static version_t *grow(version_t *version)
+{
+  size_t count = atomic_load_explicit(&version->count, memory_order_relaxed);
+  version_t *grown = new_version(capacity_for(count + 1), version->number);
+  if (!grown) {
+    return NULL;
+  }
+  for (size_t i = 0; i <= version->mask; i++) {
+    entry_t *entry = atomic_load_explicit(&version->slots[i].entry, memory_order_relaxed);
+    if (!entry || entry == &tombstone) {
+      continue;
+    }
+    uint64_t hash = atomic_load_explicit(&version->slots[i].hash, memory_order_relaxed);
+    size_t j = hash & grown->mask;
+    while (atomic_load_explicit(&grown->slots[j].entry, memory_order_relaxed)) {
+      j = (j + 1) & grown->mask;
+    }
+    atomic_store_explicit(&grown->slots[j].hash, hash, memory_order_relaxed);
+    atomic_store_explicit(&grown->slots[j].entry, entry, memory_order_relaxed);
+    grown->used++;
+  }
+  atomic_store_explicit(&grown->count, count, memory_order_relaxed);
+  return grown;
+}
+
+static void copy_login_counters(account_t *to, const account_t *from)
+{
+  to->login_count = from->login_count;
+  to->login_fail_count = from->login_fail_count;
+  to->last_login_time = from->last_login_time;
+  to->last_ip = from->last_ip;
+}
+
+/**
+ * Applies one change to *versionp. A live version is being read, so what
+ * the change takes out of it is retired, and if it must grow its grown copy
+ * is published in its place; a build's private version is changed
+ * directly.
+ */
+static apply_result_t apply(version_t **versionp, change_op_t op, const account_t *acc,
+                            bool live)
+{
+  userid_key_t key;
+  if (!userid_key_init(&key, acc->userid)) {
+    return NOT_FOUND;
+  }
+  version_t *version = *versionp;
+  entry_t *old = NULL;
+  size_t free_slot;
+  size_t i = find_slot(version, &key, &old, &free_slot);
+  if (i == NO_SLOT && op != CHANGE_UPDATE) {
+    return NOT_FOUND;
+  }
+  if (op == CHANGE_REMOVE) {
+    atomic_store(&version->slots[i].entry, &tombstone);
+    atomic_fetch_sub_explicit(&version->count, 1, memory_order_relaxed);
+    dispose(old, live);
+    return APPLIED;
+  }
+
+  entry_t *entry = malloc(sizeof(*entry));
+  if (!entry) {
+    return NO_MEMORY;
+  }
+  if (op == CHANGE_LOGIN) {
+    entry->acc = old->acc;
+    copy_login_counters(&entry->acc, acc);
+  } else {
+    entry->acc = *acc;
+  }
+  if (i != NO_SLOT) {
+    atomic_store(&version->slots[i].entry, entry);
+    dispose(old, live);
+    return APPLIED;
+  }
+
+  bool fresh = atomic_load_explicit(&version->slots[free_slot].entry,
+                                    memory_order_relaxed) == NULL;
+  if (fresh && (version->used + 1) * 4 > (version->mask + 1) * 3) {
+    version_t *grown = grow(version);
+    if (!grown) {
+      free(entry);
+      return NO_MEMORY;
+    }
+    if (live) {
+      atomic_store(&current, grown);
+      retire(&version->retired, free_version_shell);
+    } else {
+      free_version_shell(&version->retired);
+    }
+    *versionp = version = grown;
+    find_slot(version, &key, &old, &free_slot);
+    fresh = true;
+  }
+  if (fresh) {
+    version->used++;
+  }
+  atomic_store_explicit(&version->slots[free_slot].hash, key.hash, memory_order_relaxed);
+  atomic_store(&version->slots[free_slot].entry, entry);
+  atomic_fetch_add_explicit(&version->count, 1, memory_order_relaxed);
+  return APPLIED;
+}
+
+/**
+ * Keeps a change made to the live dataset for replay onto the dataset
+ * being built, if there is one. If memory runs out the build is marked as
+ * failed, as committing it would lose the change. Call with write_lock
+ * held.
+ */
+static void log_change(change_op_t op, const account_t *acc)
+{
+  if (!building) {
+    return;
+  }
+  if (nchanges == changes_allocated) {
+    size_t allocated = changes_allocated ? changes_allocated * 2 : 64;
+    change_t *grown = realloc(changes, allocated * sizeof(*changes));
+    if (!grown) {
+      log_message(LOG_ERROR, "Out of memory logging account changes during a reload");
+      atomic_store(&building->failed, true);
+      return;
+    }
+    changes = grown;
+    changes_allocated = allocated;
+  }
+  changes[nchanges].op = op;
+  changes[nchanges].acc = *acc;
+  nchanges++;
+}
+
+/**
+ * Applies a change to the live dataset, creating the empty first version
+ * if need be, and logs it for any build in progress.
+ */
+static apply_result_t change_live(change_op_t op, const account_t *acc)
+{
+  pthread_mutex_lock(&write_lock);
+  version_t *version = atomic_load(&current);
+  if (!version) {
+    version = new_version(MIN_SLOTS, 0);
+    if (!version) {
+      pthread_mutex_unlock(&write_lock);
+      return NO_MEMORY;
+    }
+    atomic_store(&current, version);
+  }
+  apply_result_t result = apply(&version, op, acc, true);
+  if (result == APPLIED) {
+    log_change(op, acc);
+  }
+  pthread_mutex_unlock(&write_lock);
+  return result;
+}
+
+bool account_dataset_lookup(const char *userid, account_t *acc)
+{
+  userid_key_t key;
+  return userid_key_init(&key, userid) && account_dataset_lookup_key(&key, acc);
+}
+
+bool account_dataset_lookup_key(const userid_key_t *key, account_t *acc)
+{
+  if (!key || !acc) {
+    return false;
+  }
+  reader_t *reader = read_begin();
+  if (!reader) {
+    log_message(LOG_ERROR, "Out of memory looking up account %s", key->str);
+    return false;
+  }
+  bool found = false;
+  version_t *version = atomic_load(&current);
+  entry_t *entry;
+  if (version && find_slot(version, key, &entry, NULL) != NO_SLOT) {
+    *acc = entry->acc;
+    found = true;
+  }
+  read_end(reader);
+  return found;
+}
+
+bool account_dataset_update(const account_t *acc)
+{
+  userid_key_t key;
+  if (!acc || !userid_key_init(&key, acc->userid)) {
+    log_message(LOG_ERROR, "Account to store has no valid userid");
+    return false;
+  }
+  if (change_live(CHANGE_UPDATE, acc) != APPLIED) {
+    log_message(LOG_ERROR, "Out of memory storing account %s", acc->userid);
+    return false;
+  }
+  account_cache_invalidate(acc->userid);
+  userid_filter_add(acc->userid);
+  return true;
+}
+
+bool account_dataset_remove(const char *userid)
+{
+  account_t acc;
+  memset(&acc, 0, sizeof(acc));
+  if (!userid || strlen(userid) >= USER_ID_LENGTH) {
+    return false;
+  }
+  strcpy(acc.userid, userid);
+  if (change_live(CHANGE_REMOVE, &acc) != APPLIED) {
+    return false;
+  }
+  account_cache_invalidate(userid);
+  return true;
+}
+
+void account_dataset_record_login(const account_t *acc)
+{
+  if (acc && change_live(CHANGE_LOGIN, acc) == NO_MEMORY) {
+    log_message(LOG_ERROR, "Failed to record login for account %s", acc->userid);
+  }
+}
+
+size_t account_dataset_count(void)
+{
+  reader_t *reader = read_begin();
+  if (!reader) {
+    return 0;
+  }
+  version_t *version = atomic_load(&current);
+  size_t count = version ? atomic_load_explicit(&version->count, memory_order_relaxed) : 0;
+  read_end(reader);
+  return count;
+}
+
+account_dataset_build_t *account_dataset_build_begin(size_t expected)
+{
+  account_dataset_build_t *build = calloc(1, sizeof(*build));
+  if (!build || !(build->version = new_version(capacity_for(expected), 0))) {
+    log_message(LOG_ERROR, "Out of memory starting an account dataset build");
+    free(build);
+    return NULL;
+  }
+  pthread_mutex_lock(&write_lock);
+  bool busy = building != NULL;
+  if (!busy) {
+    building = build;
+    nchanges = 0;
+  }
+  pthread_mutex_unlock(&write_lock);
+  if (busy) {
+    log_message(LOG_ERROR, "An account dataset build is already in progress");
+    free_version(&build->version->retired);
+    free(build);
+    return NULL;
+  }
+  return build;
+}
+
+bool account_dataset_build_add(account_dataset_build_t *build, const account_t *acc)
+{
+  if (!build || !acc) {
+    return false;
+  }
+  apply_result_t result = apply(&build->version, CHANGE_UPDATE, acc, false);
+  if (result == APPLIED) {
+    userid_filter_add(acc->userid);
+    return true;
+  }
+  if (result == NOT_FOUND) {
+    log_message(LOG_ERROR, "Account to add to the new dataset has no valid userid");
+  } else {
+    log_message(LOG_ERROR, "Out of memory adding account %s to the new dataset", acc->userid);
+  }
+  atomic_store(&build->failed, true);
+  return false;
+}
+
+static bool add_visit(const account_t *acc, void *arg)
+{
+  account_dataset_build_add(arg, acc);
+  return true;
+}
+
+bool account_dataset_build_add_store(account_dataset_build_t *build)
+{
+  if (!build) {
+    return false;
+  }
+  account_store_foreach(add_visit, build);
+  return !atomic_load(&build->failed);
+}
+
+/**
+ * Stops logging changes for build and discards those logged. Call with
+ * write_lock held.
+ */
+static void end_build_locked(account_dataset_build_t *build)
+{
+  if (building == build) {
+    building = NULL;
+    free(changes);
+    changes = NULL;
+    nchanges = 0;
+    changes_allocated = 0;
+  }
+}
+
+static void free_build(account_dataset_build_t *build)
+{
+  free_version(&build->version->retired);
+  free(build);
+}
+
+bool account_dataset_build_commit(account_dataset_build_t *build)
+{
+  if (!build) {
+    return false;
+  }
+  pthread_mutex_lock(&write_lock);
+  bool ok = building == build && !atomic_load(&build->failed);
+  size_t replayed = 0;
+  for (size_t i = 0; ok && i < nchanges; i++) {
+    apply_result_t result = apply(&build->version, changes[i].op, &changes[i].acc, false);
+    ok = result != NO_MEMORY;
+    replayed += result == APPLIED;
+  }
+  if (!ok) {
+    end_build_locked(build);
+    pthread_mutex_unlock(&write_lock);
+    log_message(LOG_ERROR, "Account dataset build failed; keeping the current dataset");
+    free_build(build);
+    return false;
+  }
+
+  version_t *old = atomic_load(&current);
+  build->version->number = (old ? old->number : 0) + 1;
+  atomic_store(&current, build->version);
+  if (old) {
+    retire(&old->retired, free_version);
+  }
+  atomic_fetch_add_explicit(&carried, replayed, memory_order_relaxed);
+  atomic_fetch_add_explicit(&reloads, 1, memory_order_relaxed);
+  end_build_locked(build);
+  reclaim_locked();
+  pthread_mutex_unlock(&write_lock);
+
+  // cached accounts may come from the old dataset
+  account_cache_clear();
+  free(build);
+  return true;
+}
+
+void account_dataset_build_abort(account_dataset_build_t *build)
+{
+  if (!build) {
+    return;
+  }
+  pthread_mutex_lock(&write_lock);
+  end_build_locked(build);
+  pthread_mutex_unlock(&write_lock);
+  free_build(build);
+}
+
+size_t account_dataset_reclaim(void)
+{
+  pthread_mutex_lock(&write_lock);
+  size_t freed = reclaim_locked();
+  pthread_mutex_unlock(&write_lock);
+  return freed;
+}
+
+void account_dataset_get_stats(account_dataset_stats_t *stats)
+{
+  if (!stats) {
+    return;
+  }
+  reader_t *reader = read_begin();
+  version_t *version = reader ? atomic_load(&current) : NULL;
+  stats->version = version ? version->number : 0;
+  stats->count = version ? atomic_load_explicit(&version->count, memory_order_relaxed) : 0;
+  if (reader) {
+    read_end(reader);
+  }
+  stats->reloads = atomic_load(&reloads);
+  stats->carried = atomic_load(&carried);
+  stats->retired = atomic_load(&retired);
+  stats->reclaimed = atomic_load(&reclaimed);
+  stats->readers = 0;
+  reader_t *r = atomic_load_explicit(&reader_list, memory_order_acquire);
+  for (; r; r = r->next) {
+    stats->readers++;
+  }
+}
+
+static bool backend_lookup(void *arg, const userid_key_t *key, account_t *acc)
+{
+  (void) arg;
+  return account_dataset_lookup_key(key, acc);
+}
+
+static void backend_record_login(void *arg, const account_t *acc)
+{
+  (void) arg;
+  account_dataset_record_login(acc);
+}
+
+static bool backend_foreach_userid(void *arg, db_userid_fn fn, void *ctx)
+{
+  (void) arg;
+  reader_t *reader = read_begin();
+  if (!reader) {
+    log_message(LOG_ERROR, "Out of memory listing the account dataset");
+    return false;
+  }
+  bool complete = true;
+  version_t *version = atomic_load(&current);
+  for (size_t i = 0; complete && version && i <= version->mask; i++) {
+    entry_t *entry = atomic_load(&version->slots[i].entry);
+    if (entry && entry != &tombstone) {
+      complete = fn(entry->acc.userid, ctx);
+    }
+  }
+  read_end(reader);
+  return complete;
+}
+
+void account_dataset_backend(db_backend_t *backend)
+{
+  if (backend) {
+    backend->lookup = backend_lookup;
+    backend->record_login = backend_record_login;
+    backend->lookup_async = NULL;
+    backend->foreach_userid = backend_foreach_userid;
+    backend->arg = NULL;
+  }
+}
@@ -0,0 +1,110 @@
+#ifndef ACCOUNT_DATASET_H
+#define ACCOUNT_DATASET_H
+
+/**
+ * @file account_dataset.h
+ * @brief A read-optimized account dataset that can be replaced while serving.
+ *
+ * The dataset is one version of a flat open-addressing table of accounts,
+ * published through a single atomic pointer. Lookups take no lock and never
+ * wait: a lookup announces the epoch it started in, copies the account out
+ * of whichever version it finds, and withdraws its announcement. Changes
+ * (record_login counters, updates, removals) are serialized by a mutex but
+ * never modify an account in place; each installs a changed copy with an
+ * atomic store, so readers see either the old account or the new one.
+ *
+ * A refreshed dataset (after bulk bans, expirations or an import, say) is
+ * built in the background with account_dataset_build_begin() and _add(),
+ * then published by account_dataset_build_commit() in one pointer swap,
+ * without restarting anything. Changes made to the live dataset while the
+ * new one is being built are logged and replayed onto it just before the
+ * swap, so none is lost: a recorded login carries over its counters, an
+ * update or removal is applied as it was.
+ *
+ * Anything a change or a swap takes out of the live dataset (accounts,
+ * whole versions) is retired rather than freed, and freed only once every
+ * lookup that could still be reading it has finished, i.e. once no thread
+ * announces an epoch from before it was retired.
+ *
+ * The dataset can serve handle_login() as a backend:
+ *
+ *   db_backend_t backend;
+ *   account_dataset_backend(&backend);
+ *   db_backend_set(&backend);
+ */
+
+#include "account.h"
+#include "db_backend.h"
+#include "userid_key.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct account_dataset_build account_dataset_build_t;
+
+typedef struct {
+  uint64_t version;            // number of the current dataset (0 = the
+                               // empty one there is at the start)
+  size_t count;                // accounts in it
+  uint64_t reloads;            // datasets published by a commit
+  uint64_t carried;            // changes replayed onto a new dataset
+  uint64_t retired;            // accounts and versions retired
+  uint64_t reclaimed;          // of those, freed
+  size_t readers;              // per-thread reader records allocated: the
+                               // most threads that have held one at once
+} account_dataset_stats_t;
+
+// look userid up in the current dataset. never blocks.
+bool account_dataset_lookup(const char *userid, account_t *acc);
+
+// as account_dataset_lookup(), for a userid already made into a key
+bool account_dataset_lookup_key(const userid_key_t *key, account_t *acc);
+
+// insert acc (copied) into the current dataset, or replace the account
+// with its userid. returns false (after logging) if memory runs out or acc
+// has no valid userid.
+bool account_dataset_update(const account_t *acc);
+
+// remove the account with the given userid. returns false if there is none.
+bool account_dataset_remove(const char *userid);
+
+// keep acc's login counters (count, fail count, last login time and IP) in
+// the stored account with its userid, leaving the rest as it is
+void account_dataset_record_login(const account_t *acc);
+
+size_t account_dataset_count(void);
+
+// start building a new dataset, sized for about expected accounts (0 = a
+// few). from now until the commit or abort, changes to the current
+// dataset are also logged for replay. only one build can be in progress;
+// returns NULL (after logging) if another is, or memory runs out.
+account_dataset_build_t *account_dataset_build_begin(size_t expected);
+
+// add acc (copied) to the dataset being built, replacing any account with
+// its userid there. returns false (after logging) if memory runs out or
+// acc has no valid userid; the commit will then fail.
+bool account_dataset_build_add(account_dataset_build_t *build, const account_t *acc);
+
+// add every account in the account store to the dataset being built
+bool account_dataset_build_add_store(account_dataset_build_t *build);
+
+// replay the changes logged since the build began onto the new dataset,
+// publish it in place of the current one and retire the old one. build is
+// freed whether or not this succeeds; it fails (after logging, leaving the
+// current dataset in place) if an earlier step of the build failed.
+bool account_dataset_build_commit(account_dataset_build_t *build);
+
+// discard a build and stop logging changes for it. NULL is ignored.
+void account_dataset_build_abort(account_dataset_build_t *build);
+
+// free whatever retired memory no lookup can still be reading. this also
+// happens as changes are made; returns the number of items freed.
+size_t account_dataset_reclaim(void);
+
+void account_dataset_get_stats(account_dataset_stats_t *stats);
+
+// fill in backend to look accounts up in, and record logins to, the dataset
+void account_dataset_backend(db_backend_t *backend);
+
+#endif // ACCOUNT_DATASET_H
@@ -0,0 +1,653 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_export.h"
+#include "account_store.h"
+#include "logging.h"
+#include "thread_pool.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OUTPUT_BUFFER_SIZE 65536
+#define CHUNK_ACCOUNTS 512       // accounts formatted per pool task
+#define WINDOW_ACCOUNTS 4096     // accounts selected from an array at a time
+#define TZ_CACHE_SLOTS 512       // power of two
+#define SECONDS_PER_DAY 86400
+#define TIME_TEXT_LENGTH 19      // YYYY-MM-DD HH:MM:SS
+
+// the fast time formatting path covers years 1000 to 9999 (in UTC, with a
+// day's margin either side for the local offset); strftime() does the rest
+#define FAST_TIME_MIN INT64_C(-30610137600)
+#define FAST_TIME_MAX INT64_C(253402214400)
+
+/**
+ * An output buffer. With a file descriptor it is written out whenever it
+ * fills up; without one (fd == -1) it grows instead.
+ */
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  int fd;
+  bool failed;
+} out_t;
+
+/**
+ * One day (UTC) of cached local time offset. If the offset is the same at
+ * the start and end of the day, it is the same throughout (offsets don't
+ * change twice in a day), and is uniform.
+ */
+typedef struct {
+  uint64_t generation;
+  int64_t day;
+  int32_t offset;
+  bool uniform;
+} tz_slot_t;
+
+typedef struct {
+  const account_t *const *accounts;
+  size_t count;
+  uint64_t first_index;          // position of accounts[0] in the export
+  account_export_format_t format;
+  uint64_t generation;
+  out_t out;
+} chunk_t;
+
+typedef struct {
+  account_export_format_t format;
+  out_t out;
+  uint64_t generation;
+  uint64_t exported;
+  thread_pool_t *pool;
+  chunk_t *chunks;
+  size_t nchunks;
+} exporter_t;
+
+// each export starts a new generation, so that offsets cached by an earlier
+// export (perhaps under another TZ) are not used
+static atomic_uint_fast64_t export_generation = 0;
+static _Thread_local tz_slot_t tz_cache[TZ_CACHE_SLOTS];
+
+static const char csv_header[] =
+  "userid,email,birthdate,account_id,login_count,login_fail_count,last_login_time,last_ip\n";
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+  while (len > 0) {
+    ssize_t result = write(fd, data, len);
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_message(LOG_ERROR, "Account export: write() failed: %s", strerror(errno));
+      return false;
+    }
+    data += result;
+    len -= (size_t) result;
+  }
+  return true;
+}
+
+static bool out_init(out_t *out, int fd)
+{
+  out->data = malloc(OUTPUT_BUFFER_SIZE);
+  out->len = 0;
+  out->cap = out->data ? OUTPUT_BUFFER_SIZE : 0;
+  out->fd = fd;
+  out->failed = !out->data;
+  return out->data != NULL;
+}
+
+static void out_flush(out_t *out)
+{
+  if (!out->failed && out->len > 0 && !write_all(out->fd, out->data, out->len)) {
+    out->failed = true;
+  }
+  out->len = 0;
+}
+
+static void out_bytes(out_t *out, const char *bytes, size_t n)
+{
+  if (out->failed) {
+    return;
+  }
+  if (out->len + n > out->cap) {
+    if (out->fd >= 0) {
+      out_flush(out);
+      if (n > out->cap) {
+        out->failed = !write_all(out->fd, bytes, n);
+        return;
+      }
+    }
+    else {
+      size_t cap = out->cap * 2 > out->len + n ? out->cap * 2 : out->len + n;
+      char *data = realloc(out->data, cap);
+      if (!data) {
+        log_message(LOG_ERROR, "Memory allocation for account export has failed");
+        out->failed = true;
+        return;
+      }
+      out->data = data;
+      out->cap = cap;
+    }
+  }
+  memcpy(out->data + out->len, bytes, n);
+  out->len += n;
+}
+
+static void out_str(out_t *out, const char *s)
+{
+  out_bytes(out, s, strlen(s));
+}
+
+static void out_u64(out_t *out, uint64_t value)
+{
+  char digits[20];
+  size_t i = sizeof(digits);
+  do {
+    digits[--i] = (char) ('0' + value % 10);
+    value /= 10;
+  } while (value > 0);
+  out_bytes(out, digits + i, sizeof(digits) - i);
+}
+
+static void out_i64(out_t *out, int64_t value)
+{
+  if (value < 0) {
+    out_bytes(out, "-", 1);
+    out_u64(out, (uint64_t) 0 - (uint64_t) value);
+  }
+  else {
+    out_u64(out, (uint64_t) value);
+  }
+}
+
+/**
+ * Writes ip as inet_ntop() would: its bytes, in memory order, as a dotted
+ * quad.
+ */
+static void out_ip(out_t *out, ip4_addr_t ip)
+{
+  unsigned char bytes[4];
+  memcpy(bytes, &ip, sizeof(bytes));
+  for (int i = 0; i < 4; i++) {
+    if (i > 0) {
+      out_bytes(out, ".", 1);
+    }
+    out_u64(out, bytes[i]);
+  }
+}
+
+static int64_t floor_div(int64_t a, int64_t b)
+{
+  int64_t q = a / b;
+  return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+// days since 1970-01-01 of a proleptic Gregorian date
+static int64_t days_from_civil(int64_t y, unsigned int m, unsigned int d)
+{
+  y -= m <= 2;
+  int64_t era = (y >= 0 ? y : y - 399) / 400;
+  unsigned int yoe = (unsigned int) (y - era * 400);
+  unsigned int doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  unsigned int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (int64_t) doe - 719468;
+}
+
+static void civil_from_days(int64_t z, int64_t *y, unsigned int *m, unsigned int *d)
+{
+  z += 719468;
+  int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  unsigned int doe = (unsigned int) (z - era * 146097);
+  unsigned int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  unsigned int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  unsigned int mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = (int64_t) yoe + era * 400 + (*m <= 2);
+}
+
+static bool local_offset(time_t t, int32_t *offset)
+{
+  struct tm tm;
+  if (!localtime_r(&t, &tm)) {
+    return false;
+  }
+  int64_t local = days_from_civil((int64_t) tm.tm_year + 1900, (unsigned int) tm.tm_mon + 1,
+                                  (unsigned int) tm.tm_mday) * SECONDS_PER_DAY
+                  + tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+  *offset = (int32_t) (local - (int64_t) t);
+  return true;
+}
+
+static bool cached_offset(time_t t, uint64_t generation, int32_t *offset)
+{
+  int64_t day = floor_div((int64_t) t, SECONDS_PER_DAY);
+  tz_slot_t *slot = &tz_cache[(uint64_t) day & (TZ_CACHE_SLOTS - 1)];
+  if (slot->generation != generation || slot->day != day) {
+    int32_t start, end;
+    if (!local_offset((time_t) (day * SECONDS_PER_DAY), &start)
+        || !local_offset((time_t) (day * SECONDS_PER_DAY + SECONDS_PER_DAY - 1), &end)) {
+      return local_offset(t, offset);
+    }
+    slot->generation = generation;
+    slot->day = day;
+    slot->offset = start;
+    slot->uniform = start == end;
+  }
+  if (!slot->uniform) {
+    return local_offset(t, offset);
+  }
+  *offset = slot->offset;
+  return true;
+}
+
+static void put_digits(char *p, unsigned int value, int width)
+{
+  for (int i = width - 1; i >= 0; i--) {
+    p[i] = (char) ('0' + value % 10);
+    value /= 10;
+  }
+}
+
+/**
+ * Formats t as local "YYYY-MM-DD HH:MM:SS", like account_print_summary().
+ * Returns the length written to buf, or 0 if t cannot be converted.
+ */
+static size_t format_time(time_t t, uint64_t generation, char buf[64])
+{
+  int32_t offset;
+  if ((int64_t) t >= FAST_TIME_MIN && (int64_t) t < FAST_TIME_MAX
+      && cached_offset(t, generation, &offset)) {
+    int64_t local = (int64_t) t + offset;
+    int64_t day = floor_div(local, SECONDS_PER_DAY);
+    unsigned int secs = (unsigned int) (local - day * SECONDS_PER_DAY);
+    int64_t year;
+    unsigned int month, mday;
+    civil_from_days(day, &year, &month, &mday);
+    if (year >= 1000 && year <= 9999) {
+      put_digits(buf, (unsigned int) year, 4);
+      buf[4] = '-';
+      put_digits(buf + 5, month, 2);
+      buf[7] = '-';
+      put_digits(buf + 8, mday, 2);
+      buf[10] = ' ';
+      put_digits(buf + 11, secs / 3600, 2);
+      buf[13] = ':';
+      put_digits(buf + 14, secs / 60 % 60, 2);
+      buf[16] = ':';
+      put_digits(buf + 17, secs % 60, 2);
+      return TIME_TEXT_LENGTH;
+    }
+  }
+  struct tm tm;
+  if (!localtime_r(&t, &tm)) {
+    return 0;
+  }
+  return strftime(buf, 64, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+static void out_csv_field(out_t *out, const char *s, size_t len)
+{
+  bool quote = false;
+  for (size_t i = 0; i < len && !quote; i++) {
+    quote = s[i] == ',' || s[i] == '"' || s[i] == '\r' || s[i] == '\n';
+  }
+  if (!quote) {
+    out_bytes(out, s, len);
+    return;
+  }
+  out_bytes(out, "\"", 1);
+  const char *end = s + len;
+  while (s < end) {
+    const char *quote = memchr(s, '"', (size_t) (end - s));
+    size_t n = quote ? (size_t) (quote - s) + 1 : (size_t) (end - s);
+    out_bytes(out, s, n);
+    if (quote) {
+      out_bytes(out, "\"", 1);
+    }
+    s += n;
+  }
+  out_bytes(out, "\"", 1);
+}
+
+static void out_json_string(out_t *out, const char *s, size_t len)
+{
+  static const char hex[] = "0123456789abcdef";
+  out_bytes(out, "\"", 1);
+  size_t start = 0;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = (unsigned char) s[i];
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    out_bytes(out, s + start, i - start);
+    if (c == '"' || c == '\\') {
+      char escaped[2] = { '\\', (char) c };
+      out_bytes(out, escaped, 2);
+    }
+    else {
+      char escaped[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+      out_bytes(out, escaped, 6);
+    }
+    start = i + 1;
+  }
+  out_bytes(out, s + start, len - start);
+  out_bytes(out, "\"", 1);
+}
+
+static void format_summary(out_t *out, const account_t *acc, uint64_t generation)
+{
+  char timebuf[64];
+  size_t time_len = format_time(acc->last_login_time, generation, timebuf);
+  out_str(out, "User ID: ");
+  out_bytes(out, acc->userid, strnlen(acc->userid, USER_ID_LENGTH));
+  out_str(out, "\nEmail: ");
+  out_bytes(out, acc->email, strnlen(acc->email, EMAIL_LENGTH));
+  out_str(out, "\nLogin Count: ");
+  out_u64(out, acc->login_count);
+  out_str(out, "\nLogin Fail Count: ");
+  out_u64(out, acc->login_fail_count);
+  out_str(out, "\nLast Login Time: ");
+  if (time_len) {
+    out_bytes(out, timebuf, time_len);
+  }
+  else {
+    out_str(out, "N/A");
+  }
+  out_str(out, "\nLast IP: ");
+  out_ip(out, acc->last_ip);
+  out_str(out, "\n");
+}
+
+static void format_csv(out_t *out, const account_t *acc, uint64_t generation)
+{
+  char timebuf[64];
+  size_t time_len = format_time(acc->last_login_time, generation, timebuf);
+  out_csv_field(out, acc->userid, strnlen(acc->userid, USER_ID_LENGTH));
+  out_bytes(out, ",", 1);
+  out_csv_field(out, acc->email, strnlen(acc->email, EMAIL_LENGTH));
+  out_bytes(out, ",", 1);
+  out_csv_field(out, acc->birthdate, strnlen(acc->birthdate, BIRTHDATE_LENGTH));
+  out_bytes(out, ",", 1);
+  out_i64(out, acc->account_id);
+  out_bytes(out, ",", 1);
+  out_u64(out, acc->login_count);
+  out_bytes(out, ",", 1);
+  out_u64(out, acc->login_fail_count);
+  out_bytes(out, ",", 1);
+  out_bytes(out, timebuf, time_len);
+  out_bytes(out, ",", 1);
+  out_ip(out, acc->last_ip);
+  out_bytes(out, "\n", 1);
+}
+
+static void format_json(out_t *out, const account_t *acc, uint64_t index, uint64_t generation)
+{
+  char timebuf[64];
+  size_t time_len = format_time(acc->last_login_time, generation, timebuf);
+  out_str(out, index == 0 ? "\n  {\"userid\": " : ",\n  {\"userid\": ");
+  out_json_string(out, acc->userid, strnlen(acc->userid, USER_ID_LENGTH));
+  out_str(out, ", \"email\": ");
+  out_json_string(out, acc->email, strnlen(acc->email, EMAIL_LENGTH));
+  out_str(out, ", \"birthdate\": ");
+  out_json_string(out, acc->birthdate, strnlen(acc->birthdate, BIRTHDATE_LENGTH));
+  out_str(out, ", \"account_id\": ");
+  out_i64(out, acc->account_id);
+  out_str(out, ", \"login_count\": ");
+  out_u64(out, acc->login_count);
+  out_str(out, ", \"login_fail_count\": ");
+  out_u64(out, acc->login_fail_count);
+  out_str(out, ", \"last_login_time\": ");
+  if (time_len) {
+    out_json_string(out, timebuf, time_len);
+  }
+  else {
+    out_str(out, "null");
+  }
+  out_str(out, ", \"last_ip\": \"");
+  out_ip(out, acc->last_ip);
+  out_str(out, "\"}");
+}
+
+static void format_account(out_t *out, const account_t *acc, account_export_format_t format,
+                           uint64_t index, uint64_t generation)
+{
+  switch (format) {
+    case ACCOUNT_EXPORT_SUMMARY:
+      format_summary(out, acc, generation);
+      break;
+    case ACCOUNT_EXPORT_CSV:
+      format_csv(out, acc, generation);
+      break;
+    case ACCOUNT_EXPORT_JSON:
+      format_json(out, acc, index, generation);
+      break;
+  }
+}
+
+static void format_chunk(void *arg)
+{
+  chunk_t *chunk = arg;
+  chunk->out.len = 0;
+  for (size_t i = 0; i < chunk->count; i++) {
+    format_account(&chunk->out, chunk->accounts[i], chunk->format, chunk->first_index + i,
+                   chunk->generation);
+  }
+}
+
+static bool exporter_begin(exporter_t *ex, int fd, const account_export_options_t *opts)
+{
+  memset(ex, 0, sizeof(*ex));
+  ex->format = opts->format;
+  if (ex->format != ACCOUNT_EXPORT_SUMMARY && ex->format != ACCOUNT_EXPORT_CSV
+      && ex->format != ACCOUNT_EXPORT_JSON) {
+    log_message(LOG_ERROR, "Account export: unknown format %d", (int) ex->format);
+    return false;
+  }
+  tzset();
+  ex->generation = atomic_fetch_add(&export_generation, 1) + 1;
+  if (!out_init(&ex->out, fd)) {
+    log_message(LOG_ERROR, "Memory allocation for account export has failed");
+    return false;
+  }
+  if (opts->threads > 1) {
+    ex->nchunks = (size_t) opts->threads * 2;
+    ex->chunks = calloc(ex->nchunks, sizeof(*ex->chunks));
+    ex->pool = ex->chunks ? thread_pool_create(opts->threads) : NULL;
+    for (size_t i = 0; ex->pool && i < ex->nchunks; i++) {
+      if (!out_init(&ex->chunks[i].out, -1)) {
+        thread_pool_destroy(ex->pool);
+        ex->pool = NULL;
+      }
+    }
+    if (!ex->pool) {
+      log_message(LOG_WARN, "Account export: formatting on the calling thread only");
+    }
+  }
+  if (ex->format == ACCOUNT_EXPORT_CSV) {
+    out_bytes(&ex->out, csv_header, sizeof(csv_header) - 1);
+  }
+  else if (ex->format == ACCOUNT_EXPORT_JSON) {
+    out_bytes(&ex->out, "[", 1);
+  }
+  return true;
+}
+
+/**
+ * Formats and writes the selected accounts, in parallel windows of chunks
+ * if there is a pool.
+ */
+static void exporter_add(exporter_t *ex, const account_t *const *accounts, size_t count)
+{
+  if (!ex->pool) {
+    for (size_t i = 0; i < count && !ex->out.failed; i++) {
+      format_account(&ex->out, accounts[i], ex->format, ex->exported++, ex->generation);
+    }
+    return;
+  }
+  while (count > 0 && !ex->out.failed) {
+    thread_pool_group_t group;
+    thread_pool_group_init(&group);
+    size_t used = 0;
+    for (; used < ex->nchunks && count > 0; used++) {
+      chunk_t *chunk = &ex->chunks[used];
+      chunk->accounts = accounts;
+      chunk->count = count < CHUNK_ACCOUNTS ? count : CHUNK_ACCOUNTS;
+      chunk->first_index = ex->exported;
+      chunk->format = ex->format;
+      chunk->generation = ex->generation;
+      if (!thread_pool_submit(ex->pool, &group, format_chunk, chunk)) {
+        format_chunk(chunk);
+      }
+      accounts += chunk->count;
+      count -= chunk->count;
+      ex->exported += chunk->count;
+    }
+    thread_pool_group_wait(&group);
+    thread_pool_group_destroy(&group);
+    for (size_t i = 0; i < used; i++) {
+      if (ex->chunks[i].out.failed) {
+        ex->out.failed = true;
+      }
+      out_bytes(&ex->out, ex->chunks[i].out.data, ex->chunks[i].out.len);
+    }
+  }
+}
+
+static bool exporter_end(exporter_t *ex, uint64_t *exported)
+{
+  if (ex->format == ACCOUNT_EXPORT_JSON) {
+    out_str(&ex->out, ex->exported ? "\n]\n" : "]\n");
+  }
+  out_flush(&ex->out);
+  bool ok = !ex->out.failed;
+  thread_pool_destroy(ex->pool);
+  for (size_t i = 0; ex->chunks && i < ex->nchunks; i++) {
+    free(ex->chunks[i].out.data);
+  }
+  free(ex->chunks);
+  free(ex->out.data);
+  if (exported) {
+    *exported = ex->exported;
+  }
+  log_message(LOG_INFO, "Account export: %llu accounts written%s",
+              (unsigned long long) ex->exported, ok ? "" : " before an error");
+  return ok;
+}
+
+bool account_export_array(const account_t *accounts, size_t count, int fd,
+                          const account_export_options_t *opts, uint64_t *exported)
+{
+  account_export_options_t defaults = { ACCOUNT_EXPORT_SUMMARY, NULL, NULL, 0 };
+  if (!opts) {
+    opts = &defaults;
+  }
+  if (exported) {
+    *exported = 0;
+  }
+  if ((!accounts && count > 0) || fd < 0) {
+    return false;
+  }
+  const account_t **selected = malloc(WINDOW_ACCOUNTS * sizeof(*selected));
+  if (!selected) {
+    log_message(LOG_ERROR, "Memory allocation for account export has failed");
+    return false;
+  }
+  exporter_t ex;
+  if (!exporter_begin(&ex, fd, opts)) {
+    free(selected);
+    return false;
+  }
+  for (size_t start = 0; start < count && !ex.out.failed; start += WINDOW_ACCOUNTS) {
+    size_t end = count - start < WINDOW_ACCOUNTS ? count : start + WINDOW_ACCOUNTS;
+    size_t n = 0;
+    for (size_t i = start; i < end; i++) {
+      if (!opts->filter || opts->filter(&accounts[i], opts->filter_arg)) {
+        selected[n++] = &accounts[i];
+      }
+    }
+    exporter_add(&ex, selected, n);
+  }
+  free(selected);
+  return exporter_end(&ex, exported);
+}
+
+typedef struct {
+  const account_export_options_t *opts;
+  account_t *copies;
+  size_t count;
+  size_t capacity;
+  bool out_of_memory;
+} shard_copy_t;
+
+static bool copy_selected(const account_t *acc, void *arg)
+{
+  shard_copy_t *copy = arg;
+  if (copy->opts->filter && !copy->opts->filter(acc, copy->opts->filter_arg)) {
+    return true;
+  }
+  if (copy->count == copy->capacity) {
+    size_t capacity = copy->capacity ? copy->capacity * 2 : 256;
+    account_t *copies = realloc(copy->copies, capacity * sizeof(*copies));
+    if (!copies) {
+      copy->out_of_memory = true;
+      return false;
+    }
+    copy->copies = copies;
+    copy->capacity = capacity;
+  }
+  copy->copies[copy->count++] = *acc;
+  return true;
+}
+
+bool account_export_store(int fd, const account_export_options_t *opts, uint64_t *exported)
+{
+  account_export_options_t defaults = { ACCOUNT_EXPORT_SUMMARY, NULL, NULL, 0 };
+  if (!opts) {
+    opts = &defaults;
+  }
+  if (exported) {
+    *exported = 0;
+  }
+  if (fd < 0) {
+    return false;
+  }
+  exporter_t ex;
+  if (!exporter_begin(&ex, fd, opts)) {
+    return false;
+  }
+
+  // copy out one shard at a time so the store is not locked while we write
+  shard_copy_t copy = { opts, NULL, 0, 0, false };
+  const account_t **selected = NULL;
+  size_t selected_cap = 0;
+  for (size_t s = 0; s < ACCOUNT_STORE_SHARDS && !ex.out.failed; s++) {
+    copy.count = 0;
+    account_store_foreach_in_shard(s, copy_selected, &copy);
+    if (copy.count > selected_cap) {
+      const account_t **grown = realloc(selected, copy.capacity * sizeof(*grown));
+      if (grown) {
+        selected = grown;
+        selected_cap = copy.capacity;
+      }
+    }
+    if (copy.out_of_memory || copy.count > selected_cap) {
+      log_message(LOG_ERROR, "Memory allocation for account export has failed");
+      ex.out.failed = true;
+      break;
+    }
+    for (size_t i = 0; i < copy.count; i++) {
+      selected[i] = &copy.copies[i];
+    }
+    exporter_add(&ex, selected, copy.count);
+  }
+  free(selected);
+  free(copy.copies);
+  return exporter_end(&ex, exported);
+}
@@ -0,0 +1,62 @@
+#ifndef ACCOUNT_EXPORT_H
+#define ACCOUNT_EXPORT_H
+
+/**
+ * @file account_export.h
+ * @brief Streaming bulk export of accounts.
+ *
+ * Writes many accounts to a file descriptor in one of three formats:
+ *
+ * - ACCOUNT_EXPORT_SUMMARY: exactly what account_print_summary() writes,
+ *   one account after another.
+ * - ACCOUNT_EXPORT_CSV: a header line, then one line per account with the
+ *   columns userid, email, birthdate, account_id, login_count,
+ *   login_fail_count, last_login_time and last_ip. Fields containing
+ *   commas, quotes or line breaks are quoted.
+ * - ACCOUNT_EXPORT_JSON: an array with one object per account, using the
+ *   same names as the CSV columns.
+ *
+ * Times are local times in the summary's "YYYY-MM-DD HH:MM:SS" form and IP
+ * addresses are dotted quads. Password hashes are never exported.
+ *
+ * Output is collected in 64 KiB buffers and written with few large
+ * write() calls. Optionally, accounts are formatted in chunks on a thread
+ * pool; chunks are still written in order.
+ */
+
+#include "account.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+  ACCOUNT_EXPORT_SUMMARY,
+  ACCOUNT_EXPORT_CSV,
+  ACCOUNT_EXPORT_JSON
+} account_export_format_t;
+
+// selects the accounts to export; return true to include acc. Called from
+// the exporting thread only, with the store's shard read-locked when
+// exporting the store (so it must not call into the store).
+typedef bool (*account_export_filter_fn)(const account_t *acc, void *arg);
+
+typedef struct {
+  account_export_format_t format;
+  account_export_filter_fn filter;   // NULL = export every account
+  void *filter_arg;
+  unsigned int threads;              // formatting threads (0 or 1 = the calling thread)
+} account_export_options_t;
+
+// export the selected accounts among accounts[0..count) to fd. opts may be
+// NULL for a summary of every account. If exported is not NULL it is set
+// to the number of accounts written. returns false on a write or
+// allocation error (after logging).
+bool account_export_array(const account_t *accounts, size_t count, int fd,
+                          const account_export_options_t *opts, uint64_t *exported);
+
+// export the selected accounts in the account store (in no particular
+// order), as account_export_array() does
+bool account_export_store(int fd, const account_export_options_t *opts, uint64_t *exported);
+
+#endif // ACCOUNT_EXPORT_H
@@ -0,0 +1,406 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_import.h"
+#include "account.h"
+#include "account_store.h"
+#include "account_validate.h"
+#include "logging.h"
+#include "thread_pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// rows hashed per pool task
+#define ROWS_PER_TASK 32
+#define READ_BUFFER_SIZE 65536
+
+typedef struct {
+  uint64_t line_no;
+  const char *reject;          // why the row was rejected, or NULL
+  size_t password_offset;      // into the batch's password arena
+  account_t *acc;              // created by the hashing task
+  char userid[USER_ID_LENGTH];
+  char email[EMAIL_LENGTH];
+  char birthdate[BIRTHDATE_LENGTH + 1];
+} import_row_t;
+
+typedef struct import_batch import_batch_t;
+
+typedef struct {
+  import_batch_t *batch;
+  size_t begin;
+  size_t end;
+} hash_task_t;
+
+struct import_batch {
+  import_row_t *rows;
+  size_t count;
+  char *passwords;             // null-terminated passwords, back to back
+  size_t passwords_len;
+  size_t passwords_cap;
+  hash_task_t *tasks;
+  thread_pool_group_t group;
+};
+
+typedef struct {
+  int fd;
+  bool eof;
+  size_t pos;
+  size_t len;
+  uint64_t line_no;
+  char buf[READ_BUFFER_SIZE];
+  char line[ACCOUNT_IMPORT_MAX_LINE + 1];
+} line_reader_t;
+
+/**
+ * Reads the next line (without its newline) into reader->line.
+ *
+ * Returns 1 if a line was read, 0 at end of input, -1 on read error. Lines
+ * longer than ACCOUNT_IMPORT_MAX_LINE are consumed in full and reported by
+ * setting *too_long.
+ */
+static int next_line(line_reader_t *reader, size_t *len, bool *too_long)
+{
+  size_t n = 0;
+  bool any = false;
+  *too_long = false;
+  for (;;) {
+    if (reader->pos == reader->len) {
+      if (reader->eof) {
+        break;
+      }
+      ssize_t result = read(reader->fd, reader->buf, sizeof(reader->buf));
+      if (result == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        log_message(LOG_ERROR, "Call to read() failed during account import: %s", strerror(errno));
+        return -1;
+      }
+      reader->pos = 0;
+      reader->len = (size_t) result;
+      if (result == 0) {
+        reader->eof = true;
+        break;
+      }
+    }
+    any = true;
+    char *start = reader->buf + reader->pos;
+    char *newline = memchr(start, '\n', reader->len - reader->pos);
+    size_t chunk = newline ? (size_t) (newline - start) : reader->len - reader->pos;
+    if (n + chunk > ACCOUNT_IMPORT_MAX_LINE) {
+      *too_long = true;
+    }
+    else {
+      memcpy(reader->line + n, start, chunk);
+      n += chunk;
+    }
+    reader->pos += chunk + (newline ? 1 : 0);
+    if (newline) {
+      break;
+    }
+  }
+  if (!any) {
+    return 0;
+  }
+  if (n > 0 && reader->line[n - 1] == '\r') {
+    n--;
+  }
+  reader->line[n] = '\0';
+  reader->line_no++;
+  *len = n;
+  return 1;
+}
+
+/**
+ * Appends a password to the batch's arena. Returns false if memory is
+ * exhausted.
+ */
+static bool store_password(import_batch_t *batch, const char *password, size_t len,
+                           size_t *offset)
+{
+  if (batch->passwords_len + len + 1 > batch->passwords_cap) {
+    size_t cap = batch->passwords_cap ? batch->passwords_cap : 65536;
+    while (cap < batch->passwords_len + len + 1) {
+      cap *= 2;
+    }
+    char *passwords = realloc(batch->passwords, cap);
+    if (!passwords) {
+      return false;
+    }
+    batch->passwords = passwords;
+    batch->passwords_cap = cap;
+  }
+  *offset = batch->passwords_len;
+  memcpy(batch->passwords + batch->passwords_len, password, len);
+  batch->passwords[batch->passwords_len + len] = '\0';
+  batch->passwords_len += len + 1;
+  return true;
+}
+
+/**
+ * Splits a line into its fields and validates them, filling in row.
+ * Modifies line. Returns false only if memory is exhausted.
+ */
+static bool parse_row(import_batch_t *batch, import_row_t *row, char *line, size_t len)
+{
+  char *first = memchr(line, ',', len);
+  char *last = strrchr(line, ',');
+  char *second_last = NULL;
+  if (first && last > first) {
+    *last = '\0';
+    second_last = strrchr(line, ',');
+  }
+  if (!first || !second_last || second_last == first) {
+    row->reject = "expected userid,password,email,birthdate";
+    return true;
+  }
+  *first = '\0';
+  *second_last = '\0';
+  const char *userid = line;
+  const char *password = first + 1;
+  const char *email = second_last + 1;
+  const char *birthdate = last + 1;
+
+  size_t userid_len = (size_t) (first - line);
+  if (userid_len == 0 || userid_len >= USER_ID_LENGTH) {
+    row->reject = "userid is empty or too long";
+    return true;
+  }
+  if (!validate_email_span(email, (size_t) (last - email))) {
+    row->reject = "invalid email";
+    return true;
+  }
+  if (!validate_birthdate_span(birthdate, len - (size_t) (birthdate - line))) {
+    row->reject = "invalid birthdate";
+    return true;
+  }
+  memcpy(row->userid, userid, userid_len + 1);
+  strcpy(row->email, email);
+  strcpy(row->birthdate, birthdate);
+  return store_password(batch, password, (size_t) (second_last - password), &row->password_offset);
+}
+
+/**
+ * Reads up to batch_size rows into batch. Returns false on a read error or
+ * memory exhaustion; rows read before the failure are kept.
+ */
+static bool fill_batch(line_reader_t *reader, import_batch_t *batch, size_t batch_size,
+                       account_import_report_t *report)
+{
+  batch->count = 0;
+  batch->passwords_len = 0;
+  while (batch->count < batch_size) {
+    size_t len;
+    bool too_long;
+    int status = next_line(reader, &len, &too_long);
+    if (status <= 0) {
+      return status == 0;
+    }
+    report->lines++;
+    if (!too_long && (len == 0 || reader->line[0] == '#')) {
+      continue;
+    }
+    import_row_t *row = &batch->rows[batch->count++];
+    row->line_no = reader->line_no;
+    row->reject = NULL;
+    row->acc = NULL;
+    if (too_long) {
+      row->reject = "line too long";
+    }
+    else if (!parse_row(batch, row, reader->line, len)) {
+      log_message(LOG_ERROR, "Memory allocation for account import has failed");
+      batch->count--;
+      return false;
+    }
+  }
+  return true;
+}
+
+static void hash_rows(void *arg)
+{
+  hash_task_t *task = arg;
+  import_batch_t *batch = task->batch;
+  for (size_t i = task->begin; i < task->end; i++) {
+    import_row_t *row = &batch->rows[i];
+    if (row->reject) {
+      continue;
+    }
+    row->acc = account_create(row->userid, batch->passwords + row->password_offset,
+                              row->email, row->birthdate);
+    if (!row->acc) {
+      // account_create() refuses an email some stored account has
+      row->reject = account_store_email_in_use(row->email) ? "duplicate email"
+                                                           : "account creation failed";
+    }
+  }
+}
+
+static void submit_batch(thread_pool_t *pool, import_batch_t *batch)
+{
+  size_t ntasks = 0;
+  for (size_t begin = 0; begin < batch->count; begin += ROWS_PER_TASK) {
+    hash_task_t *task = &batch->tasks[ntasks++];
+    task->batch = batch;
+    task->begin = begin;
+    task->end = begin + ROWS_PER_TASK < batch->count ? begin + ROWS_PER_TASK : batch->count;
+    if (!thread_pool_submit(pool, &batch->group, hash_rows, task)) {
+      hash_rows(task); // couldn't queue it; do it here instead
+    }
+  }
+}
+
+/**
+ * Inserts a hashed batch into the store in input order and reports rejects.
+ */
+static void commit_batch(import_batch_t *batch, int reject_fd, account_import_report_t *report)
+{
+  for (size_t i = 0; i < batch->count; i++) {
+    import_row_t *row = &batch->rows[i];
+    if (!row->reject && !account_store_insert(row->acc)) {
+      // the store refuses an account whose userid or email is taken
+      row->reject = account_store_contains(row->acc->userid) ? "duplicate userid"
+                    : account_store_email_in_use(row->acc->email) ? "duplicate email"
+                    : "not stored";
+      account_free(row->acc);
+    }
+    if (row->reject) {
+      report->rejected++;
+      if (reject_fd >= 0) {
+        dprintf(reject_fd, "line %llu: %s\n", (unsigned long long) row->line_no, row->reject);
+      }
+    }
+    else {
+      report->imported++;
+    }
+  }
+  // wipe plaintext passwords as soon as they are no longer needed
+  if (batch->passwords) {
+    memset(batch->passwords, 0, batch->passwords_len);
+  }
+}
+
+static bool batch_init(import_batch_t *batch, size_t batch_size)
+{
+  memset(batch, 0, sizeof(*batch));
+  batch->rows = malloc(batch_size * sizeof(import_row_t));
+  batch->tasks = malloc((batch_size / ROWS_PER_TASK + 1) * sizeof(hash_task_t));
+  thread_pool_group_init(&batch->group);
+  return batch->rows && batch->tasks;
+}
+
+static void batch_destroy(import_batch_t *batch)
+{
+  if (batch->passwords) {
+    memset(batch->passwords, 0, batch->passwords_cap);
+  }
+  free(batch->passwords);
+  free(batch->rows);
+  free(batch->tasks);
+  thread_pool_group_destroy(&batch->group);
+}
+
+bool account_import_fd(int fd, const account_import_options_t *opts,
+                       account_import_report_t *report)
+{
+  account_import_options_t defaults = { 0, 0, -1 };
+  if (!opts) {
+    opts = &defaults;
+  }
+  if (fd < 0 || !report) {
+    return false;
+  }
+  memset(report, 0, sizeof(*report));
+  size_t batch_size = opts->batch_size ? opts->batch_size : ACCOUNT_IMPORT_DEFAULT_BATCH;
+
+  line_reader_t *reader = malloc(sizeof(*reader));
+  import_batch_t batches[2];
+  bool batches_ok = batch_init(&batches[0], batch_size);
+  batches_ok = batch_init(&batches[1], batch_size) && batches_ok;
+  thread_pool_t *pool = batches_ok && reader ? thread_pool_create(opts->threads) : NULL;
+  if (!pool) {
+    log_message(LOG_ERROR, "Failed to set up account import");
+    batch_destroy(&batches[0]);
+    batch_destroy(&batches[1]);
+    free(reader);
+    return false;
+  }
+  reader->fd = fd;
+  reader->eof = false;
+  reader->pos = 0;
+  reader->len = 0;
+  reader->line_no = 0;
+
+  // double buffering: parse the next batch while the current one hashes
+  bool ok = fill_batch(reader, &batches[0], batch_size, report);
+  submit_batch(pool, &batches[0]);
+  int current = 0;
+  while (batches[current].count > 0) {
+    int next = 1 - current;
+    batches[next].count = 0;
+    if (ok) {
+      ok = fill_batch(reader, &batches[next], batch_size, report);
+      submit_batch(pool, &batches[next]);
+    }
+    thread_pool_group_wait(&batches[current].group);
+    commit_batch(&batches[current], opts->reject_fd, report);
+    current = next;
+  }
+  thread_pool_group_wait(&batches[current].group);
+
+  thread_pool_destroy(pool);
+  batch_destroy(&batches[0]);
+  batch_destroy(&batches[1]);
+  free(reader);
+  log_message(LOG_INFO, "Account import: %llu lines, %llu imported, %llu rejected",
+              (unsigned long long) report->lines, (unsigned long long) report->imported,
+              (unsigned long long) report->rejected);
+  return ok;
+}
+
+bool account_import_file(const char *path, const account_import_options_t *opts,
+                         account_import_report_t *report)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    log_message(LOG_ERROR, "Failed to open %s for import: %s", path, strerror(errno));
+    return false;
+  }
+  bool ok = account_import_fd(fd, opts, report);
+  close(fd);
+  return ok;
+}
+
+#ifdef ACCOUNT_IMPORT_MAIN
+
+/**
+ * Bulk import tool.
+ *
+ * Usage: app FILE [THREADS]
+ *
+ * Imports FILE into the account store, writing rejected rows to stderr and
+ * a summary to stdout.
+ */
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    dprintf(STDERR_FILENO, "usage: %s FILE [THREADS]\n", argv[0]);
+    return 2;
+  }
+  account_import_options_t opts = {
+    .threads = argc > 2 ? (unsigned int) strtoul(argv[2], NULL, 10) : 0,
+    .batch_size = 0,
+    .reject_fd = STDERR_FILENO
+  };
+  account_import_report_t report = { 0 };
+  bool ok = account_import_file(argv[1], &opts, &report);
+  dprintf(STDOUT_FILENO, "%llu lines, %llu imported, %llu rejected\n",
+          (unsigned long long) report.lines, (unsigned long long) report.imported,
+          (unsigned long long) report.rejected);
+  return ok ? 0 : 1;
+}
+
+#endif // ACCOUNT_IMPORT_MAIN
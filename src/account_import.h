@@ -0,0 +1,55 @@
+#ifndef ACCOUNT_IMPORT_H
+#define ACCOUNT_IMPORT_H
+
+/**
+ * @file account_import.h
+ * @brief Parallel streaming bulk import of accounts into the account store.
+ *
+ * Input is text with one account per line:
+ *
+ *   userid,password,email,birthdate
+ *
+ * The userid ends at the first comma and the email and birthdate are the
+ * last two fields, so passwords may themselves contain commas. Blank lines
+ * and lines starting with '#' are ignored.
+ *
+ * The input is read in fixed-size batches. While one batch is being hashed
+ * on a work-stealing thread pool, the next is parsed and validated with the
+ * same rules as account_create(); finished batches are inserted into the
+ * account store in input order. At most two batches are held at once, so
+ * memory use does not depend on the size of the input.
+ *
+ * Rejected rows are reported with their line numbers.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  unsigned int threads;   // hashing threads (0 = number of online CPUs)
+  size_t batch_size;      // rows per batch (0 = ACCOUNT_IMPORT_DEFAULT_BATCH)
+  int reject_fd;          // rejected rows are written here as "line N: reason" (-1 = don't)
+} account_import_options_t;
+
+typedef struct {
+  uint64_t lines;         // input lines read
+  uint64_t imported;      // accounts inserted into the store
+  uint64_t rejected;      // rows rejected (malformed, invalid, duplicate, ...)
+} account_import_report_t;
+
+#define ACCOUNT_IMPORT_DEFAULT_BATCH 4096
+#define ACCOUNT_IMPORT_MAX_LINE 4096
+
+// import accounts read from fd until end of file. opts may be NULL for
+// defaults. returns false (after logging) if reading fails or resources run
+// out; rows already imported stay imported. Rejected rows do not make the
+// import fail.
+bool account_import_fd(int fd, const account_import_options_t *opts,
+                       account_import_report_t *report);
+
+// open path and import it with account_import_fd()
+bool account_import_file(const char *path, const account_import_options_t *opts,
+                         account_import_report_t *report);
+
+#endif // ACCOUNT_IMPORT_H
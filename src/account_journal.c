@@ -0,0 +1,600 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_journal.h"
+#include "account_alloc.h"
+#include "account_codec.h"
+#include "account_store.h"
+#include "crc32.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "AJNL"
+#define JOURNAL_VERSION 1
+#define HEADER_SIZE 8                   // magic, version
+#define RECORD_HEADER_SIZE 8            // body length, body crc
+#define BODY_PREFIX_SIZE 9              // sequence, op
+#define MAX_RECORD_SIZE (RECORD_HEADER_SIZE + BODY_PREFIX_SIZE + ACCOUNT_CODEC_MAX_SIZE)
+#define BUFFER_SIZE (64 * 1024)
+
+// called for each intact record; returns false to stop the scan
+typedef bool (*record_visit_fn)(const unsigned char *record, size_t len, uint64_t sequence,
+                                account_store_op_t op, void *arg);
+
+typedef struct {
+  int fd;
+  uint64_t after_sequence;
+  unsigned char *buffer;
+  size_t len;
+  bool failed;
+} copy_state_t;
+
+typedef struct {
+  uint64_t after_sequence;
+  uint64_t applied;
+  uint64_t last_sequence;
+  bool failed;
+} replay_state_t;
+
+// the open journal. The store's hook only appends records to
+// journal_buffer, under journal_mutex, which is never held across I/O; the
+// writer thread takes the buffered records and writes them out under
+// file_mutex, which guards journal_fd. compact_mutex keeps compactions
+// from overlapping.
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t compact_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_work = PTHREAD_COND_INITIALIZER;   // for the writer
+static pthread_cond_t journal_done = PTHREAD_COND_INITIALIZER;   // a sync finished
+static pthread_t journal_writer;
+static bool journal_open;
+static bool journal_stopping;
+static int journal_fd = -1;
+static char journal_path[4096];
+static unsigned char *journal_buffer;
+static size_t journal_capacity;
+static size_t journal_buffered;
+static uint64_t journal_syncs_requested;
+static uint64_t journal_syncs_done;
+static bool journal_failed;
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++) {
+    p[i] = (unsigned char) (v >> (8 * i));
+  }
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+  for (int i = 0; i < 8; i++) {
+    p[i] = (unsigned char) (v >> (8 * i));
+  }
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    v |= (uint32_t) p[i] << (8 * i);
+  }
+  return v;
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++) {
+    v |= (uint64_t) p[i] << (8 * i);
+  }
+  return v;
+}
+
+static bool write_all(int fd, const unsigned char *data, size_t len)
+{
+  while (len > 0) {
+    ssize_t result = write(fd, data, len);
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += result;
+    len -= (size_t) result;
+  }
+  return true;
+}
+
+/**
+ * Walks the records of the len-byte journal at data, stopping at the first
+ * one that is torn or corrupt. Returns the offset just past the last intact
+ * record visited.
+ */
+static size_t scan_records(const unsigned char *data, size_t len, record_visit_fn fn, void *arg)
+{
+  size_t offset = HEADER_SIZE;
+  while (len - offset >= RECORD_HEADER_SIZE) {
+    const unsigned char *record = data + offset;
+    uint32_t body_len = get_u32(record);
+    if (body_len < BODY_PREFIX_SIZE || body_len > MAX_RECORD_SIZE - RECORD_HEADER_SIZE
+        || len - offset - RECORD_HEADER_SIZE < body_len
+        || crc32_compute(record + RECORD_HEADER_SIZE, body_len) != get_u32(record + 4)) {
+      break;
+    }
+    const unsigned char *body = record + RECORD_HEADER_SIZE;
+    if (body[8] > ACCOUNT_STORE_REMOVE) {
+      break;
+    }
+    if (!fn(record, RECORD_HEADER_SIZE + body_len, get_u64(body),
+            (account_store_op_t) body[8], arg)) {
+      break;
+    }
+    offset += RECORD_HEADER_SIZE + body_len;
+  }
+  return offset;
+}
+
+/**
+ * Maps the file open as fd, or its first len bytes if len is not 0, for
+ * reading. Returns NULL (after logging) on failure or if it is not a
+ * journal; *len is set to the length mapped.
+ */
+static unsigned char *map_journal(int fd, const char *path, size_t *len)
+{
+  if (*len == 0) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      log_message(LOG_ERROR, "Failed to stat account journal %s: %s", path, strerror(errno));
+      return NULL;
+    }
+    *len = (size_t) st.st_size;
+  }
+  if (*len < HEADER_SIZE) {
+    log_message(LOG_ERROR, "%s is not an account journal", path);
+    return NULL;
+  }
+  unsigned char *data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    log_message(LOG_ERROR, "Failed to map account journal %s: %s", path, strerror(errno));
+    return NULL;
+  }
+  if (memcmp(data, JOURNAL_MAGIC, 4) != 0 || get_u32(data + 4) != JOURNAL_VERSION) {
+    log_message(LOG_ERROR, "%s is not an account journal, or has an unsupported version", path);
+    munmap(data, *len);
+    return NULL;
+  }
+  posix_madvise(data, *len, POSIX_MADV_SEQUENTIAL);
+  return data;
+}
+
+static bool write_header(int fd)
+{
+  unsigned char header[HEADER_SIZE];
+  memcpy(header, JOURNAL_MAGIC, 4);
+  put_u32(header + 4, JOURNAL_VERSION);
+  return write_all(fd, header, sizeof(header));
+}
+
+/**
+ * Records that the journal has lost a record, logging the first time.
+ * Caller holds journal_mutex.
+ */
+static void fail_locked(const char *what, int error)
+{
+  if (!journal_failed) {
+    log_message(LOG_ERROR, "Failed to %s account journal %s: %s", what, journal_path,
+                strerror(error));
+  }
+  journal_failed = true;
+}
+
+/**
+ * The store's hook: encodes the change into the buffer, growing it if the
+ * writer has fallen behind, and wakes the writer once a buffer's worth is
+ * waiting. Runs under the store's shard lock, so does no I/O.
+ */
+static void record_change(account_store_op_t op, uint64_t sequence, const account_t *acc,
+                          void *arg)
+{
+  (void) arg;
+  pthread_mutex_lock(&journal_mutex);
+  if (journal_open && journal_buffered + MAX_RECORD_SIZE > journal_capacity) {
+    size_t capacity = journal_capacity < BUFFER_SIZE ? BUFFER_SIZE : journal_capacity * 2;
+    unsigned char *buffer = realloc(journal_buffer, capacity);
+    if (buffer) {
+      journal_buffer = buffer;
+      journal_capacity = capacity;
+    }
+    else {
+      fail_locked("buffer a record for", ENOMEM);
+    }
+  }
+  if (journal_open && journal_buffered + MAX_RECORD_SIZE <= journal_capacity) {
+    unsigned char *record = journal_buffer + journal_buffered;
+    unsigned char *body = record + RECORD_HEADER_SIZE;
+    put_u64(body, sequence);
+    body[8] = (unsigned char) op;
+    size_t body_len = BODY_PREFIX_SIZE + account_codec_encode(acc, body + BODY_PREFIX_SIZE);
+    put_u32(record, (uint32_t) body_len);
+    put_u32(record + 4, crc32_compute(body, body_len));
+    size_t before = journal_buffered;
+    journal_buffered += RECORD_HEADER_SIZE + body_len;
+    if (before < BUFFER_SIZE && journal_buffered >= BUFFER_SIZE) {
+      pthread_cond_signal(&journal_work);
+    }
+  }
+  pthread_mutex_unlock(&journal_mutex);
+}
+
+/**
+ * The writer thread: swaps the hook's buffer for its own empty one, then
+ * writes the records out (and syncs, if asked) without journal_mutex.
+ */
+static void *write_journal(void *arg)
+{
+  (void) arg;
+  unsigned char *batch = NULL;
+  size_t batch_capacity = 0;
+  pthread_mutex_lock(&journal_mutex);
+  for (;;) {
+    while (!journal_stopping && journal_buffered < BUFFER_SIZE
+           && journal_syncs_done == journal_syncs_requested) {
+      pthread_cond_wait(&journal_work, &journal_mutex);
+    }
+    uint64_t syncs = journal_syncs_requested;
+    bool sync = syncs != journal_syncs_done;
+    if (journal_stopping && journal_buffered == 0 && !sync) {
+      break;
+    }
+    unsigned char *full = journal_buffer;
+    size_t full_capacity = journal_capacity;
+    size_t len = journal_buffered;
+    journal_buffer = batch;
+    journal_capacity = batch_capacity;
+    journal_buffered = 0;
+    batch = full;
+    batch_capacity = full_capacity;
+    pthread_mutex_unlock(&journal_mutex);
+
+    pthread_mutex_lock(&file_mutex);
+    bool written = write_all(journal_fd, batch, len);
+    int write_error = errno;
+    bool synced = !written || !sync || fsync(journal_fd) == 0;
+    int sync_error = errno;
+    pthread_mutex_unlock(&file_mutex);
+
+    pthread_mutex_lock(&journal_mutex);
+    if (!written) {
+      fail_locked("write", write_error);
+    }
+    else if (!synced) {
+      fail_locked("sync", sync_error);
+    }
+    journal_syncs_done = syncs;
+    pthread_cond_broadcast(&journal_done);
+  }
+  pthread_mutex_unlock(&journal_mutex);
+  free(batch);
+  return NULL;
+}
+
+static bool count_record(const unsigned char *record, size_t len, uint64_t sequence,
+                         account_store_op_t op, void *arg)
+{
+  (void) record;
+  (void) len;
+  (void) sequence;
+  (void) op;
+  (void) arg;
+  return true;
+}
+
+/**
+ * Stops the writer (once it has written what is buffered), if it was
+ * started, and closes the journal. Returns whether the close succeeded.
+ */
+static bool stop_journal(bool writer_started)
+{
+  pthread_mutex_lock(&journal_mutex);
+  journal_stopping = true;
+  pthread_cond_signal(&journal_work);
+  pthread_mutex_unlock(&journal_mutex);
+  if (writer_started) {
+    pthread_join(journal_writer, NULL);
+  }
+  pthread_mutex_lock(&file_mutex);
+  bool ok = close(journal_fd) == 0;
+  journal_fd = -1;
+  pthread_mutex_unlock(&file_mutex);
+  pthread_mutex_lock(&journal_mutex);
+  journal_open = false;
+  free(journal_buffer);
+  journal_buffer = NULL;
+  journal_capacity = 0;
+  journal_buffered = 0;
+  pthread_mutex_unlock(&journal_mutex);
+  return ok;
+}
+
+bool account_journal_open(const char *path)
+{
+  if (!path || strlen(path) >= sizeof(journal_path)) {
+    log_message(LOG_ERROR, "Account journal path is missing or too long");
+    return false;
+  }
+  pthread_mutex_lock(&journal_mutex);
+  bool already_open = journal_open;
+  pthread_mutex_unlock(&journal_mutex);
+  if (already_open) {
+    log_message(LOG_ERROR, "An account journal is already open");
+    return false;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+  if (fd == -1) {
+    log_message(LOG_ERROR, "Failed to open account journal %s: %s", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0;
+  if (ok && st.st_size == 0) {
+    ok = write_header(fd);
+  }
+  else if (ok) {
+    // drop a torn record left at the end by a crash
+    size_t len = 0;
+    unsigned char *data = map_journal(fd, path, &len);
+    ok = data != NULL;
+    if (ok) {
+      size_t intact = scan_records(data, len, count_record, NULL);
+      munmap(data, len);
+      if (intact < len) {
+        log_message(LOG_WARN, "Account journal %s: discarding %zu bytes of torn records",
+                    path, len - intact);
+        ok = ftruncate(fd, (off_t) intact) == 0;
+      }
+    }
+  }
+  unsigned char *buffer = ok ? malloc(BUFFER_SIZE) : NULL;
+  if (!buffer) {
+    if (ok) {
+      log_message(LOG_ERROR, "Memory allocation for account journal has failed");
+    }
+    close(fd);
+    return false;
+  }
+
+  pthread_mutex_lock(&file_mutex);
+  journal_fd = fd;
+  pthread_mutex_unlock(&file_mutex);
+  pthread_mutex_lock(&journal_mutex);
+  journal_open = true;
+  journal_stopping = false;
+  strcpy(journal_path, path);
+  journal_buffer = buffer;
+  journal_capacity = BUFFER_SIZE;
+  journal_buffered = 0;
+  journal_syncs_requested = journal_syncs_done = 0;
+  journal_failed = false;
+  pthread_mutex_unlock(&journal_mutex);
+  if (pthread_create(&journal_writer, NULL, write_journal, NULL) != 0) {
+    log_message(LOG_ERROR, "Failed to start the account journal writer");
+    stop_journal(false);
+    return false;
+  }
+  if (!account_store_add_hook(record_change, NULL)) {
+    stop_journal(true);
+    return false;
+  }
+  return true;
+}
+
+bool account_journal_sync(void)
+{
+  pthread_mutex_lock(&journal_mutex);
+  bool ok = journal_open;
+  if (ok) {
+    // the writer takes everything buffered so far before it syncs
+    uint64_t sync = ++journal_syncs_requested;
+    pthread_cond_signal(&journal_work);
+    while (journal_syncs_done < sync && !journal_failed) {
+      pthread_cond_wait(&journal_done, &journal_mutex);
+    }
+    ok = !journal_failed;
+  }
+  pthread_mutex_unlock(&journal_mutex);
+  return ok;
+}
+
+bool account_journal_close(void)
+{
+  account_store_remove_hook(record_change, NULL);
+  bool ok = account_journal_sync();
+  pthread_mutex_lock(&journal_mutex);
+  bool was_open = journal_open;
+  pthread_mutex_unlock(&journal_mutex);
+  return was_open ? stop_journal(true) && ok : ok;
+}
+
+static bool apply_record(const unsigned char *record, size_t len, uint64_t sequence,
+                         account_store_op_t op, void *arg)
+{
+  replay_state_t *state = arg;
+  if (sequence <= state->after_sequence) {
+    return true;
+  }
+  const unsigned char *encoded = record + RECORD_HEADER_SIZE + BODY_PREFIX_SIZE;
+  size_t encoded_len = len - RECORD_HEADER_SIZE - BODY_PREFIX_SIZE;
+  account_t acc;
+  if (account_codec_decode(encoded, encoded_len, &acc) != encoded_len) {
+    log_message(LOG_ERROR, "Account journal has a malformed record (sequence %llu)",
+                (unsigned long long) sequence);
+    state->failed = true;
+    return false;
+  }
+  if (op == ACCOUNT_STORE_REMOVE) {
+    account_store_remove(acc.userid);
+  }
+  else if (!account_store_update(&acc)) {
+    account_t *copy = account_alloc();
+    if (!copy) {
+      log_message(LOG_ERROR, "Memory allocation for account has failed");
+      state->failed = true;
+      return false;
+    }
+    *copy = acc;
+    if (!account_store_insert(copy)) {
+      account_release(copy);
+      state->failed = true;
+      return false;
+    }
+  }
+  state->applied++;
+  if (sequence > state->last_sequence) {
+    state->last_sequence = sequence;
+  }
+  return true;
+}
+
+bool account_journal_replay(const char *path, uint64_t after_sequence, uint64_t *applied)
+{
+  if (applied) {
+    *applied = 0;
+  }
+  if (!path) {
+    return false;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT) {
+      return true;
+    }
+    log_message(LOG_ERROR, "Failed to open account journal %s: %s", path, strerror(errno));
+    return false;
+  }
+  size_t len = 0;
+  unsigned char *data = map_journal(fd, path, &len);
+  close(fd);
+  if (!data) {
+    return false;
+  }
+  replay_state_t state = { .after_sequence = after_sequence };
+  scan_records(data, len, apply_record, &state);
+  munmap(data, len);
+  account_store_advance_sequence(state.last_sequence);
+  if (applied) {
+    *applied = state.applied;
+  }
+  return !state.failed;
+}
+
+static bool copy_record(const unsigned char *record, size_t len, uint64_t sequence,
+                        account_store_op_t op, void *arg)
+{
+  (void) op;
+  copy_state_t *state = arg;
+  if (sequence <= state->after_sequence) {
+    return true;
+  }
+  if (state->len + len > BUFFER_SIZE) {
+    state->failed = state->failed || !write_all(state->fd, state->buffer, state->len);
+    state->len = 0;
+  }
+  memcpy(state->buffer + state->len, record, len);
+  state->len += len;
+  return !state->failed;
+}
+
+/**
+ * Copies the journal's bytes from offset start to its end into fd.
+ * Caller holds file_mutex.
+ */
+static bool copy_tail_locked(int fd, off_t start, unsigned char *buffer)
+{
+  for (;;) {
+    ssize_t n = pread(journal_fd, buffer, BUFFER_SIZE, start);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n == 0;
+    }
+    if (!write_all(fd, buffer, (size_t) n)) {
+      return false;
+    }
+    start += n;
+  }
+}
+
+bool account_journal_compact(uint64_t sequence)
+{
+  pthread_mutex_lock(&compact_mutex);
+  pthread_mutex_lock(&journal_mutex);
+  bool open_now = journal_open;
+  char path[sizeof(journal_path)];
+  strcpy(path, journal_path);
+  pthread_mutex_unlock(&journal_mutex);
+  if (!open_now) {
+    pthread_mutex_unlock(&compact_mutex);
+    log_message(LOG_ERROR, "No account journal is open to compact");
+    return false;
+  }
+  // note where the file ends now; what the writer adds after this is copied
+  // across as is at the end, with the file locked. records still buffered
+  // then go to the new file.
+  pthread_mutex_lock(&file_mutex);
+  off_t end = lseek(journal_fd, 0, SEEK_END);
+  int read_fd = open(path, O_RDONLY);
+  pthread_mutex_unlock(&file_mutex);
+
+  char tmp_path[sizeof(journal_path) + sizeof(".tmp")];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+  copy_state_t state = { .fd = fd, .after_sequence = sequence, .buffer = malloc(BUFFER_SIZE) };
+  size_t len = (size_t) (end > 0 ? end : 0);
+  unsigned char *data = read_fd != -1 && fd != -1 && state.buffer
+                        ? map_journal(read_fd, path, &len) : NULL;
+  bool ok = data != NULL && write_header(fd);
+  if (ok) {
+    scan_records(data, len, copy_record, &state);
+    ok = !state.failed && write_all(fd, state.buffer, state.len);
+  }
+  if (data) {
+    munmap(data, len);
+  }
+  if (read_fd != -1) {
+    close(read_fd);
+  }
+
+  // only the writer waits meanwhile; store changes keep being buffered
+  pthread_mutex_lock(&file_mutex);
+  if (ok) {
+    ok = copy_tail_locked(fd, end, state.buffer) && fsync(fd) == 0
+         && rename(tmp_path, path) == 0;
+  }
+  if (ok) {
+    close(journal_fd);
+    journal_fd = fd;
+  }
+  pthread_mutex_unlock(&file_mutex);
+  pthread_mutex_unlock(&compact_mutex);
+
+  if (!ok) {
+    log_message(LOG_ERROR, "Failed to compact account journal %s: %s", path, strerror(errno));
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp_path);
+    }
+  }
+  free(state.buffer);
+  return ok;
+}
@@ -0,0 +1,59 @@
+#ifndef ACCOUNT_JOURNAL_H
+#define ACCOUNT_JOURNAL_H
+
+/**
+ * @file account_journal.h
+ * @brief Append-only journal of account store changes, for restarts.
+ *
+ * While open, the journal receives every change to the account store
+ * through its mutation hook, and appends a record of it: the change's
+ * store sequence number, whether it was an insert, update or removal, and
+ * the account (encoded with account_codec.h), framed by a length and a
+ * CRC-32. The hook only buffers records in memory; a writer thread writes
+ * them to the file when the buffer fills, or at account_journal_sync(), so
+ * store changes never wait for the disk. Callers choose how often to sync,
+ * trading the changes a crash can lose against fsync() cost.
+ *
+ * The restart path is:
+ *
+ *   account_checkpoint_load(checkpoint, 0, &seq);
+ *   account_journal_replay(journal, seq, NULL);
+ *   account_journal_open(journal);
+ *
+ * and, from time to time while running,
+ *
+ *   account_checkpoint_write(checkpoint, &seq);
+ *   account_journal_compact(seq);
+ *
+ * which drops records the new checkpoint already covers. A torn record at
+ * the end of the file (from a crash mid-write) fails its CRC; replay stops
+ * there and open truncates it away.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// open (creating if need be) the journal at path and start recording store
+// changes to it. only one journal can be open at a time. replay the
+// journal first, since changes made by replaying would be recorded again.
+bool account_journal_open(const char *path);
+
+// write buffered records and fsync() the journal. returns false if any
+// record since the journal was opened could not be written.
+bool account_journal_sync(void);
+
+// stop recording, sync and close the journal. returns as account_journal_sync().
+bool account_journal_close(void);
+
+// apply the changes recorded in the journal at path with sequence numbers
+// after after_sequence to the store, in order, and advance the store
+// sequence past them. *applied (if not NULL) is set to the number of
+// records applied. a missing journal is treated as empty.
+bool account_journal_replay(const char *path, uint64_t after_sequence, uint64_t *applied);
+
+// rewrite the open journal without the records with sequence numbers up to
+// sequence (e.g. those covered by a checkpoint). changes keep being
+// recorded meanwhile, though not written until it finishes.
+bool account_journal_compact(uint64_t sequence);
+
+#endif // ACCOUNT_JOURNAL_H
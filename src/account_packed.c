@@ -0,0 +1,805 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_packed.h"
+#include "logging.h"
+#include "userid_filter.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the longest a record can be: every field at its longest
+#define RECORD_MAX_SIZE \
+  (1 + 1 + USER_ID_LENGTH + 10 + 1 + EMAIL_LENGTH + 5 + 1 + HASH_LENGTH + BIRTHDATE_LENGTH \
+   + 2 * 5 + 3 * 10 + 4)
+
+#define MIN_SLOTS 16
+#define MIN_DOMAIN_SLOTS 16
+
+// the salt and digest at the end of every password hash format
+#define TAIL_BYTES 16
+#define TAIL_HEX_LENGTH (2 * TAIL_BYTES)
+#define TAIL_LENGTH (2 * TAIL_HEX_LENGTH + 1)
+
+// record flags: which optional fields follow, and how some are packed
+#define HAS_UNBAN_TIME 0x01
+#define HAS_EXPIRATION_TIME 0x02
+#define HAS_LAST_LOGIN_TIME 0x04
+#define HAS_LAST_IP 0x08
+#define HAS_DOMAIN 0x10
+#define HASH_PACKED 0x20
+#define BIRTHDATE_PACKED 0x40
+
+/**
+ * A record is, in order:
+ *
+ *   flags byte
+ *   userid: length byte, characters
+ *   account_id: zigzag varint
+ *   email before its last '@': length byte, characters
+ *   [HAS_DOMAIN] domain number: varint
+ *   password hash: [HASH_PACKED] length byte, text before the tail,
+ *                  salt and digest bytes; else length byte, characters
+ *   birthdate: [BIRTHDATE_PACKED] day number as varint; else its bytes
+ *   login_count, login_fail_count: varints
+ *   [HAS_UNBAN_TIME] [HAS_EXPIRATION_TIME] [HAS_LAST_LOGIN_TIME]
+ *       time - epoch: zigzag varints
+ *   [HAS_LAST_IP] last_ip: 4 bytes as stored
+ *
+ * The userid comes first so that the index can compare it in place.
+ */
+struct account_packed {
+  pthread_rwlock_t lock;
+  int64_t epoch;
+  // userid index: open addressing with linear probing, NULL = empty
+  unsigned char **slots;
+  size_t nslots;                 // a power of two
+  size_t count;
+  size_t record_bytes;
+  size_t verbatim_hashes;
+  // domain dictionary: domain numbers are indexes into domains, found
+  // by name through domain_slots (number + 1, 0 = empty)
+  char **domains;
+  size_t ndomains;
+  size_t domains_allocated;
+  size_t domain_bytes;
+  uint32_t *domain_slots;
+  size_t ndomain_slots;          // a power of two
+};
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v)
+{
+  while (v >= 0x80) {
+    *p++ = (unsigned char) (v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (unsigned char) v;
+  return p;
+}
+
+static const unsigned char *get_varint(const unsigned char *p, uint64_t *v)
+{
+  uint64_t result = 0;
+  for (unsigned int shift = 0;; shift += 7) {
+    unsigned char byte = *p++;
+    result |= (uint64_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  *v = result;
+  return p;
+}
+
+/**
+ * Maps a signed difference to an unsigned one with small magnitudes
+ * small, so that it makes a short varint either way.
+ */
+static uint64_t zigzag(uint64_t v)
+{
+  return (v << 1) ^ (0 - (v >> 63));
+}
+
+static uint64_t unzigzag(uint64_t v)
+{
+  return (v >> 1) ^ (0 - (v & 1));
+}
+
+static unsigned char *put_string(unsigned char *p, const char *s, size_t len)
+{
+  *p++ = (unsigned char) len;
+  memcpy(p, s, len);
+  return p + len;
+}
+
+static int lower_hex_digit(char c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+/**
+ * Decodes the "<salt hex>:<digest hex>" tail at hex into 2 * TAIL_BYTES
+ * bytes. Only lowercase is accepted, as only it is written back.
+ */
+static bool decode_tail(const char *hex, unsigned char *out)
+{
+  if (hex[TAIL_HEX_LENGTH] != ':') {
+    return false;
+  }
+  for (size_t i = 0; i < 2 * TAIL_BYTES; i++) {
+    const char *digits = hex + 2 * i + (i >= TAIL_BYTES);
+    int hi = lower_hex_digit(digits[0]);
+    int lo = lower_hex_digit(digits[1]);
+    if (hi < 0 || lo < 0) {
+      return false;
+    }
+    out[i] = (unsigned char) (hi << 4 | lo);
+  }
+  return true;
+}
+
+static void encode_tail(const unsigned char *bytes, char *out)
+{
+  static const char digits[] = "0123456789abcdef";
+  for (size_t i = 0; i < 2 * TAIL_BYTES; i++) {
+    char *hex = out + 2 * i + (i >= TAIL_BYTES);
+    hex[0] = digits[bytes[i] >> 4];
+    hex[1] = digits[bytes[i] & 0xf];
+  }
+  out[TAIL_HEX_LENGTH] = ':';
+}
+
+static bool is_digits(const char *s, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    if (s[i] < '0' || s[i] > '9') {
+      return false;
+    }
+  }
+  return true;
+}
+
+static unsigned int digits_value(const char *s, size_t n)
+{
+  unsigned int v = 0;
+  for (size_t i = 0; i < n; i++) {
+    v = v * 10 + (unsigned int) (s[i] - '0');
+  }
+  return v;
+}
+
+/**
+ * Numbers a YYYY-MM-DD birthdate by month and day (31 days to every
+ * month, so that the number maps back exactly). Returns false if it is not
+ * of that form.
+ */
+static bool birthdate_day(const char *birthdate, uint64_t *day)
+{
+  if (!is_digits(birthdate, 4) || birthdate[4] != '-' || !is_digits(birthdate + 5, 2)
+      || birthdate[7] != '-' || !is_digits(birthdate + 8, 2)) {
+    return false;
+  }
+  unsigned int month = digits_value(birthdate + 5, 2);
+  unsigned int mday = digits_value(birthdate + 8, 2);
+  if (month < 1 || month > 12 || mday < 1 || mday > 31) {
+    return false;
+  }
+  *day = ((uint64_t) digits_value(birthdate, 4) * 12 + (month - 1)) * 31 + (mday - 1);
+  return true;
+}
+
+static void put_digits(char *out, unsigned int v, size_t n)
+{
+  for (size_t i = n; i-- > 0; v /= 10) {
+    out[i] = (char) ('0' + v % 10);
+  }
+}
+
+static void day_birthdate(uint64_t day, char *birthdate)
+{
+  put_digits(birthdate, (unsigned int) (day / 31 / 12), 4);
+  birthdate[4] = '-';
+  put_digits(birthdate + 5, (unsigned int) (day / 31 % 12 + 1), 2);
+  birthdate[7] = '-';
+  put_digits(birthdate + 8, (unsigned int) (day % 31 + 1), 2);
+}
+
+static uint64_t string_hash(const char *s, size_t len)
+{
+  return userid_key_hash(s, len);
+}
+
+/**
+ * Returns the number of domain, adding it to the dictionary if need be,
+ * or -1 if memory runs out. Caller holds the write lock.
+ */
+static long long domain_number(account_packed_t *table, const char *domain, size_t len)
+{
+  size_t mask = table->ndomain_slots - 1;
+  size_t i = string_hash(domain, len) & mask;
+  for (; table->domain_slots[i] != 0; i = (i + 1) & mask) {
+    const char *known = table->domains[table->domain_slots[i] - 1];
+    if (strlen(known) == len && memcmp(known, domain, len) == 0) {
+      return table->domain_slots[i] - 1;
+    }
+  }
+  if (table->ndomains == table->domains_allocated) {
+    size_t allocated = table->domains_allocated ? 2 * table->domains_allocated : 16;
+    char **domains = realloc(table->domains, allocated * sizeof(*domains));
+    if (!domains) {
+      return -1;
+    }
+    table->domains = domains;
+    table->domains_allocated = allocated;
+  }
+  char *copy = malloc(len + 1);
+  if (!copy) {
+    return -1;
+  }
+  memcpy(copy, domain, len);
+  copy[len] = '\0';
+  if (2 * (table->ndomains + 1) > table->ndomain_slots) {
+    size_t count = 2 * table->ndomain_slots;
+    uint32_t *slots = calloc(count, sizeof(*slots));
+    if (!slots) {
+      free(copy);
+      return -1;
+    }
+    for (size_t n = 0; n < table->ndomains; n++) {
+      const char *known = table->domains[n];
+      size_t j = string_hash(known, strlen(known)) & (count - 1);
+      while (slots[j] != 0) {
+        j = (j + 1) & (count - 1);
+      }
+      slots[j] = (uint32_t) n + 1;
+    }
+    free(table->domain_slots);
+    table->domain_slots = slots;
+    table->ndomain_slots = count;
+    mask = count - 1;
+    i = string_hash(domain, len) & mask;
+    while (table->domain_slots[i] != 0) {
+      i = (i + 1) & mask;
+    }
+  }
+  size_t number = table->ndomains++;
+  table->domains[number] = copy;
+  table->domain_slots[i] = (uint32_t) number + 1;
+  table->domain_bytes += len + 1;
+  return (long long) number;
+}
+
+/**
+ * Encodes acc into out (RECORD_MAX_SIZE bytes). Returns the record's
+ * length, or 0 if the dictionary could not take its domain. Caller holds
+ * the write lock.
+ */
+static size_t encode(account_packed_t *table, const account_t *acc, unsigned char *out)
+{
+  unsigned char flags = 0;
+  unsigned char *p = out + 1;
+  p = put_string(p, acc->userid, strnlen(acc->userid, USER_ID_LENGTH));
+  p = put_varint(p, zigzag((uint64_t) acc->account_id));
+
+  size_t email_len = strnlen(acc->email, EMAIL_LENGTH);
+  const char *at = NULL;
+  for (size_t i = email_len; i-- > 0;) {
+    if (acc->email[i] == '@') {
+      at = acc->email + i;
+      break;
+    }
+  }
+  if (at) {
+    size_t local_len = (size_t) (at - acc->email);
+    long long domain = domain_number(table, at + 1, email_len - local_len - 1);
+    if (domain < 0) {
+      return 0;
+    }
+    flags |= HAS_DOMAIN;
+    p = put_string(p, acc->email, local_len);
+    p = put_varint(p, (uint64_t) domain);
+  }
+  else {
+    p = put_string(p, acc->email, email_len);
+  }
+
+  size_t hash_len = strnlen(acc->password_hash, HASH_LENGTH - 1);
+  size_t prefix_len = hash_len >= TAIL_LENGTH ? hash_len - TAIL_LENGTH : 0;
+  if (hash_len >= TAIL_LENGTH && decode_tail(acc->password_hash + prefix_len, p + 1 + prefix_len)) {
+    flags |= HASH_PACKED;
+    p = put_string(p, acc->password_hash, prefix_len);
+    p += 2 * TAIL_BYTES;
+  }
+  else {
+    p = put_string(p, acc->password_hash, hash_len);
+  }
+
+  uint64_t day;
+  if (birthdate_day(acc->birthdate, &day)) {
+    flags |= BIRTHDATE_PACKED;
+    p = put_varint(p, day);
+  }
+  else {
+    memcpy(p, acc->birthdate, BIRTHDATE_LENGTH);
+    p += BIRTHDATE_LENGTH;
+  }
+
+  p = put_varint(p, acc->login_count);
+  p = put_varint(p, acc->login_fail_count);
+  const time_t times[] = { acc->unban_time, acc->expiration_time, acc->last_login_time };
+  const unsigned char time_flags[] = { HAS_UNBAN_TIME, HAS_EXPIRATION_TIME, HAS_LAST_LOGIN_TIME };
+  for (size_t i = 0; i < 3; i++) {
+    if (times[i] != 0) {
+      flags |= time_flags[i];
+      p = put_varint(p, zigzag((uint64_t) times[i] - (uint64_t) table->epoch));
+    }
+  }
+  if (acc->last_ip != 0) {
+    flags |= HAS_LAST_IP;
+    memcpy(p, &acc->last_ip, sizeof(acc->last_ip));
+    p += sizeof(acc->last_ip);
+  }
+  out[0] = flags;
+  return (size_t) (p - out);
+}
+
+/**
+ * Decodes record into acc, and returns the record's length. Caller holds
+ * the lock.
+ */
+static size_t decode(const account_packed_t *table, const unsigned char *record, account_t *acc)
+{
+  memset(acc, 0, sizeof(*acc));
+  unsigned char flags = record[0];
+  const unsigned char *p = record + 1;
+  uint64_t v;
+  memcpy(acc->userid, p + 1, *p);
+  p += 1 + *p;
+  p = get_varint(p, &v);
+  acc->account_id = (int64_t) unzigzag(v);
+
+  size_t local_len = *p;
+  memcpy(acc->email, p + 1, local_len);
+  p += 1 + local_len;
+  if (flags & HAS_DOMAIN) {
+    p = get_varint(p, &v);
+    const char *domain = table->domains[v];
+    acc->email[local_len] = '@';
+    // fits, as it did when the account was packed
+    memcpy(acc->email + local_len + 1, domain, strnlen(domain, EMAIL_LENGTH - local_len - 1));
+  }
+
+  size_t hash_len = *p;
+  memcpy(acc->password_hash, p + 1, hash_len);
+  p += 1 + hash_len;
+  if (flags & HASH_PACKED) {
+    encode_tail(p, acc->password_hash + hash_len);
+    p += 2 * TAIL_BYTES;
+  }
+
+  if (flags & BIRTHDATE_PACKED) {
+    p = get_varint(p, &v);
+    day_birthdate(v, acc->birthdate);
+  }
+  else {
+    memcpy(acc->birthdate, p, BIRTHDATE_LENGTH);
+    p += BIRTHDATE_LENGTH;
+  }
+
+  p = get_varint(p, &v);
+  acc->login_count = (unsigned int) v;
+  p = get_varint(p, &v);
+  acc->login_fail_count = (unsigned int) v;
+  time_t *times[] = { &acc->unban_time, &acc->expiration_time, &acc->last_login_time };
+  const unsigned char time_flags[] = { HAS_UNBAN_TIME, HAS_EXPIRATION_TIME, HAS_LAST_LOGIN_TIME };
+  for (size_t i = 0; i < 3; i++) {
+    if (flags & time_flags[i]) {
+      p = get_varint(p, &v);
+      *times[i] = (time_t) (unzigzag(v) + (uint64_t) table->epoch);
+    }
+  }
+  if (flags & HAS_LAST_IP) {
+    memcpy(&acc->last_ip, p, sizeof(acc->last_ip));
+    p += sizeof(acc->last_ip);
+  }
+  return (size_t) (p - record);
+}
+
+static bool hash_is_verbatim(const unsigned char *record)
+{
+  return !(record[0] & HASH_PACKED);
+}
+
+static uint64_t record_hash(const unsigned char *record)
+{
+  return string_hash((const char *) record + 2, record[1]);
+}
+
+static bool record_matches(const unsigned char *record, const userid_key_t *key)
+{
+  return record[1] == key->len && memcmp(record + 2, key->str, key->len) == 0;
+}
+
+/**
+ * Returns the slot holding key's record, or the empty slot where it would
+ * go.
+ */
+static size_t find_slot(const account_packed_t *table, const userid_key_t *key)
+{
+  size_t mask = table->nslots - 1;
+  size_t i = key->hash & mask;
+  while (table->slots[i] && !record_matches(table->slots[i], key)) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static bool grow_slots(account_packed_t *table)
+{
+  size_t count = 2 * table->nslots;
+  unsigned char **slots = calloc(count, sizeof(*slots));
+  if (!slots) {
+    return false;
+  }
+  for (size_t i = 0; i < table->nslots; i++) {
+    if (table->slots[i]) {
+      size_t j = record_hash(table->slots[i]) & (count - 1);
+      while (slots[j]) {
+        j = (j + 1) & (count - 1);
+      }
+      slots[j] = table->slots[i];
+    }
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->nslots = count;
+  return true;
+}
+
+/**
+ * Frees the record in slot i and closes the gap, moving up any record
+ * further along its probe sequence that could fill it. Caller holds the
+ * write lock.
+ */
+static void remove_slot(account_packed_t *table, size_t i)
+{
+  account_t scratch;
+  table->record_bytes -= decode(table, table->slots[i], &scratch);
+  table->verbatim_hashes -= hash_is_verbatim(table->slots[i]);
+  free(table->slots[i]);
+  table->slots[i] = NULL;
+  table->count--;
+  size_t mask = table->nslots - 1;
+  for (size_t j = (i + 1) & mask; table->slots[j]; j = (j + 1) & mask) {
+    size_t home = record_hash(table->slots[j]) & mask;
+    // the record may move to i if i lies between its home and j
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      table->slots[i] = table->slots[j];
+      table->slots[j] = NULL;
+      i = j;
+    }
+  }
+}
+
+account_packed_t *account_packed_create(const account_packed_options_t *opts)
+{
+  account_packed_t *table = calloc(1, sizeof(*table));
+  if (!table) {
+    log_message(LOG_ERROR, "Memory allocation for packed account table has failed");
+    return NULL;
+  }
+  table->epoch = opts && opts->epoch ? (int64_t) opts->epoch : (int64_t) time(NULL);
+  size_t capacity = opts ? opts->capacity : 0;
+  table->nslots = MIN_SLOTS;
+  while (table->nslots / 4 * 3 < capacity) {
+    table->nslots *= 2;
+  }
+  table->ndomain_slots = MIN_DOMAIN_SLOTS;
+  table->slots = calloc(table->nslots, sizeof(*table->slots));
+  table->domain_slots = calloc(table->ndomain_slots, sizeof(*table->domain_slots));
+  if (!table->slots || !table->domain_slots
+      || pthread_rwlock_init(&table->lock, NULL) != 0) {
+    log_message(LOG_ERROR, "Memory allocation for packed account table has failed");
+    free(table->slots);
+    free(table->domain_slots);
+    free(table);
+    return NULL;
+  }
+  return table;
+}
+
+void account_packed_destroy(account_packed_t *table)
+{
+  if (!table) {
+    return;
+  }
+  for (size_t i = 0; i < table->nslots; i++) {
+    free(table->slots[i]);
+  }
+  for (size_t i = 0; i < table->ndomains; i++) {
+    free(table->domains[i]);
+  }
+  free(table->slots);
+  free(table->domains);
+  free(table->domain_slots);
+  pthread_rwlock_destroy(&table->lock);
+  free(table);
+}
+
+/**
+ * Packs acc into the slot for key, replacing what is there. Caller holds
+ * the write lock.
+ */
+static bool put_locked(account_packed_t *table, const userid_key_t *key, const account_t *acc)
+{
+  unsigned char buffer[RECORD_MAX_SIZE];
+  size_t len = encode(table, acc, buffer);
+  unsigned char *record = len ? malloc(len) : NULL;
+  if (!record) {
+    return false;
+  }
+  memcpy(record, buffer, len);
+  size_t i = find_slot(table, key);
+  if (table->slots[i]) {
+    account_t scratch;
+    table->record_bytes -= decode(table, table->slots[i], &scratch);
+    table->verbatim_hashes -= hash_is_verbatim(table->slots[i]);
+    free(table->slots[i]);
+  }
+  else {
+    // keep the index at most three quarters full
+    if ((table->count + 1) > table->nslots / 4 * 3) {
+      if (!grow_slots(table)) {
+        free(record);
+        return false;
+      }
+      i = find_slot(table, key);
+    }
+    table->count++;
+  }
+  table->slots[i] = record;
+  table->record_bytes += len;
+  table->verbatim_hashes += hash_is_verbatim(record);
+  return true;
+}
+
+bool account_packed_put(account_packed_t *table, const account_t *acc)
+{
+  userid_key_t key;
+  if (!table || !acc || !userid_key_init(&key, acc->userid)) {
+    return false;
+  }
+  pthread_rwlock_wrlock(&table->lock);
+  bool ok = put_locked(table, &key, acc);
+  pthread_rwlock_unlock(&table->lock);
+  if (!ok) {
+    log_message(LOG_ERROR, "Memory allocation for packed account %s has failed", acc->userid);
+  } else {
+    userid_filter_add(acc->userid);
+  }
+  return ok;
+}
+
+bool account_packed_get_key(account_packed_t *table, const userid_key_t *key, account_t *acc)
+{
+  if (!table || !key || !acc) {
+    return false;
+  }
+  pthread_rwlock_rdlock(&table->lock);
+  const unsigned char *record = table->slots[find_slot(table, key)];
+  if (record) {
+    decode(table, record, acc);
+  }
+  pthread_rwlock_unlock(&table->lock);
+  return record != NULL;
+}
+
+bool account_packed_get(account_packed_t *table, const char *userid, account_t *acc)
+{
+  userid_key_t key;
+  return userid_key_init(&key, userid) && account_packed_get_key(table, &key, acc);
+}
+
+bool account_packed_remove(account_packed_t *table, const char *userid)
+{
+  userid_key_t key;
+  if (!table || !userid_key_init(&key, userid)) {
+    return false;
+  }
+  pthread_rwlock_wrlock(&table->lock);
+  size_t i = find_slot(table, &key);
+  bool found = table->slots[i] != NULL;
+  if (found) {
+    remove_slot(table, i);
+  }
+  pthread_rwlock_unlock(&table->lock);
+  return found;
+}
+
+size_t account_packed_count(account_packed_t *table)
+{
+  if (!table) {
+    return 0;
+  }
+  pthread_rwlock_rdlock(&table->lock);
+  size_t count = table->count;
+  pthread_rwlock_unlock(&table->lock);
+  return count;
+}
+
+bool account_packed_foreach(account_packed_t *table, account_store_visit_fn fn, void *arg)
+{
+  if (!table || !fn) {
+    return false;
+  }
+  bool more = true;
+  pthread_rwlock_rdlock(&table->lock);
+  for (size_t i = 0; i < table->nslots && more; i++) {
+    if (table->slots[i]) {
+      account_t acc;
+      decode(table, table->slots[i], &acc);
+      more = fn(&acc, arg);
+    }
+  }
+  pthread_rwlock_unlock(&table->lock);
+  return more;
+}
+
+static bool put_visit(const account_t *acc, void *arg)
+{
+  return account_packed_put(arg, acc);
+}
+
+bool account_packed_load_store(account_packed_t *table)
+{
+  return table && account_store_foreach(put_visit, table);
+}
+
+void account_packed_get_stats(account_packed_t *table, account_packed_stats_t *stats)
+{
+  if (!table || !stats) {
+    return;
+  }
+  pthread_rwlock_rdlock(&table->lock);
+  stats->count = table->count;
+  stats->record_bytes = table->record_bytes;
+  stats->index_bytes = table->nslots * sizeof(*table->slots);
+  stats->dictionary_bytes = table->domain_bytes
+                            + table->domains_allocated * sizeof(*table->domains)
+                            + table->ndomain_slots * sizeof(*table->domain_slots);
+  stats->domains = table->ndomains;
+  stats->verbatim_hashes = table->verbatim_hashes;
+  pthread_rwlock_unlock(&table->lock);
+}
+
+static bool backend_lookup(void *arg, const userid_key_t *key, account_t *acc)
+{
+  return account_packed_get_key(arg, key, acc);
+}
+
+/**
+ * Keeps the login counters handle_login() passes, and the rest of the
+ * account as stored, in case it has changed since the lookup.
+ */
+static void backend_record_login(void *arg, const account_t *acc)
+{
+  account_packed_t *table = arg;
+  userid_key_t key;
+  if (!userid_key_init(&key, acc->userid)) {
+    return;
+  }
+  pthread_rwlock_wrlock(&table->lock);
+  const unsigned char *record = table->slots[find_slot(table, &key)];
+  bool ok = true;
+  if (record) {
+    account_t stored;
+    decode(table, record, &stored);
+    stored.login_count = acc->login_count;
+    stored.login_fail_count = acc->login_fail_count;
+    stored.last_login_time = acc->last_login_time;
+    stored.last_ip = acc->last_ip;
+    ok = put_locked(table, &key, &stored);
+  }
+  pthread_rwlock_unlock(&table->lock);
+  if (!ok) {
+    log_message(LOG_ERROR, "Failed to record login for packed account %s", acc->userid);
+  }
+}
+
+typedef struct {
+  db_userid_fn fn;
+  void *ctx;
+} userid_walk_t;
+
+static bool userid_visit(const account_t *acc, void *arg)
+{
+  userid_walk_t *walk = arg;
+  return walk->fn(acc->userid, walk->ctx);
+}
+
+static bool backend_foreach_userid(void *arg, db_userid_fn fn, void *ctx)
+{
+  userid_walk_t walk = { fn, ctx };
+  return account_packed_foreach(arg, userid_visit, &walk);
+}
+
+void account_packed_backend(account_packed_t *table, db_backend_t *backend)
+{
+  if (backend) {
+    backend->lookup = backend_lookup;
+    backend->record_login = backend_record_login;
+    backend->lookup_async = NULL;
+    backend->foreach_userid = backend_foreach_userid;
+    backend->arg = table;
+  }
+}
+
+#ifdef ACCOUNT_PACKED_MAIN
+
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/**
+ * Packed memory tool.
+ *
+ * Usage: app ACCOUNTS
+ *
+ * Packs ACCOUNTS generated accounts (random salts and digests, emails at a
+ * handful of domains, recent logins) and reports the bytes per account
+ * against sizeof(account_t), after checking that each decodes unchanged.
+ */
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    dprintf(STDERR_FILENO, "usage: %s ACCOUNTS\n", argv[0]);
+    return 2;
+  }
+  unsigned long accounts = strtoul(argv[1], NULL, 10);
+  static const char *domains[] = { "example.com", "gmail.com", "student.uwa.edu.au",
+                                   "outlook.com", "yahoo.com" };
+  account_packed_options_t opts = { .capacity = accounts };
+  account_packed_t *table = account_packed_create(&opts);
+  if (!table) {
+    return 1;
+  }
+  time_t now = time(NULL);
+  for (unsigned long i = 0; i < accounts; i++) {
+    account_t acc = { .account_id = (int64_t) i + 1, .login_count = (unsigned int) (i % 50),
+                      .last_login_time = now - (time_t) (i % 86400), .last_ip = 0x0100000a };
+    snprintf(acc.userid, sizeof(acc.userid), "user%lu", i);
+    snprintf(acc.email, sizeof(acc.email), "user%lu@%s", i, domains[i % 5]);
+    memcpy(acc.birthdate, "1990-01-01", BIRTHDATE_LENGTH);
+    unsigned char bytes[2 * TAIL_BYTES];
+    RAND_bytes(bytes, sizeof(bytes));
+    encode_tail(bytes, acc.password_hash);
+    account_t decoded;
+    if (!account_packed_put(table, &acc) || !account_packed_get(table, acc.userid, &decoded)
+        || memcmp(&acc, &decoded, sizeof(acc)) != 0) {
+      dprintf(STDERR_FILENO, "%s: account %s did not round-trip\n", argv[0], acc.userid);
+      account_packed_destroy(table);
+      return 1;
+    }
+  }
+  account_packed_stats_t stats;
+  account_packed_get_stats(table, &stats);
+  size_t total = stats.record_bytes + stats.index_bytes + stats.dictionary_bytes;
+  double per_account = accounts ? (double) total / (double) accounts : 0;
+  dprintf(STDOUT_FILENO,
+          "accounts %zu  records %zu B  index %zu B  dictionary %zu B (%zu domains)\n"
+          "per account: packed %.1f B, account_t %zu B (%.1fx smaller)\n",
+          stats.count, stats.record_bytes, stats.index_bytes, stats.dictionary_bytes,
+          stats.domains, per_account, sizeof(account_t),
+          per_account > 0 ? (double) sizeof(account_t) / per_account : 0);
+  account_packed_destroy(table);
+  return 0;
+}
+
+#endif // ACCOUNT_PACKED_MAIN
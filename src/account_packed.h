@@ -0,0 +1,101 @@
+#ifndef ACCOUNT_PACKED_H
+#define ACCOUNT_PACKED_H
+
+/**
+ * @file account_packed.h
+ * @brief Accounts held packed in memory, decoded to account_t on demand.
+ *
+ * An account_t takes about 400 bytes whatever it holds: its strings are
+ * padded out to their maximum lengths and its password hash is kept as
+ * hex. A packed table holds each account as one variable-length record
+ * instead, which with its index entry typically takes a quarter of the
+ * space or less:
+ *
+ * - the userid, and the part of the email before its last '@', as a
+ *   length byte and their characters;
+ * - the email's domain as a number in a dictionary of the table's domains
+ *   (which are few, and shared by many accounts);
+ * - the password hash as the text before its "<salt hex>:<digest hex>"
+ *   tail and the salt and digest as 32 binary bytes (any hash not ending
+ *   in such a tail, in lowercase, is kept as it is);
+ * - the birthdate as a day number, if it is a valid YYYY-MM-DD date;
+ * - numbers as variable-length integers, and the times as differences
+ *   from the table's epoch, so that recent times are short;
+ * - nothing at all for a zero time or address.
+ *
+ * Decoding gives back exactly the account_t stored (with unused string
+ * bytes zeroed), so a packed table can stand in for the store where memory
+ * matters more than the few hundred nanoseconds a decode costs. Lookups
+ * and changes are safe from any thread (a read-write lock guards the
+ * table), and the table can serve handle_login() as a backend:
+ *
+ *   db_backend_t backend;
+ *   account_packed_backend(table, &backend);
+ *   db_backend_set(&backend);
+ *
+ * Built with -DACCOUNT_PACKED_MAIN, account_packed.c has a main() that
+ * reports the memory per account for generated accounts (see README.md).
+ */
+
+#include "account.h"
+#include "account_store.h"
+#include "db_backend.h"
+#include "userid_key.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+typedef struct account_packed account_packed_t;
+
+typedef struct {
+  time_t epoch;                // times are stored relative to this (0 = now)
+  size_t capacity;             // accounts to make room for (0 = a few)
+} account_packed_options_t;
+
+typedef struct {
+  size_t count;                // accounts
+  size_t record_bytes;         // in their records (not counting malloc's
+                               // own overhead per record)
+  size_t index_bytes;          // in the userid index
+  size_t dictionary_bytes;     // in the domain dictionary
+  size_t domains;
+  size_t verbatim_hashes;      // password hashes not in a packable form
+} account_packed_stats_t;
+
+// make an empty table. opts may be NULL. returns NULL (after logging) if
+// memory runs out.
+account_packed_t *account_packed_create(const account_packed_options_t *opts);
+
+// free a table and its accounts. NULL is ignored.
+void account_packed_destroy(account_packed_t *table);
+
+// store a packed copy of acc, replacing any account with its userid.
+// returns false (after logging) if memory runs out or acc has no valid
+// userid.
+bool account_packed_put(account_packed_t *table, const account_t *acc);
+
+// decode the account with the given userid into acc
+bool account_packed_get(account_packed_t *table, const char *userid, account_t *acc);
+
+// as account_packed_get(), for a userid already made into a key
+bool account_packed_get_key(account_packed_t *table, const userid_key_t *key, account_t *acc);
+
+bool account_packed_remove(account_packed_t *table, const char *userid);
+
+size_t account_packed_count(account_packed_t *table);
+
+// decode each account in turn and call fn on it, with the table read-
+// locked, until fn returns false. returns false if fn stopped the walk.
+bool account_packed_foreach(account_packed_t *table, account_store_visit_fn fn, void *arg);
+
+// put every account in the account store into table. returns false if
+// memory ran out partway.
+bool account_packed_load_store(account_packed_t *table);
+
+void account_packed_get_stats(account_packed_t *table, account_packed_stats_t *stats);
+
+// fill in backend to look accounts up in, and record logins to, table
+void account_packed_backend(account_packed_t *table, db_backend_t *backend);
+
+#endif // ACCOUNT_PACKED_H
@@ -0,0 +1,788 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_store.h"
+#include "logging.h"
+#include "userid_key.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_BUCKETS 16
+#define SHARD_BITS 6
+
+typedef struct store_entry {
+  struct store_entry *next;
+  uint64_t hash;
+  uint64_t version;         // sequence number of the last change
+  account_t *acc;
+} store_entry_t;
+
+typedef struct {
+  pthread_rwlock_t lock;
+  store_entry_t **buckets;
+  size_t nbuckets;          // always a power of two
+  size_t count;
+  account_t *preserved;     // snapshot's copies of accounts changed since it began
+  size_t npreserved;
+  size_t preserved_cap;
+} store_shard_t;
+
+/**
+ * An entry in the email index: which account has an email. The index is
+ * sharded like the accounts, by the hash of the normalised email, and its
+ * locks are only ever taken after an account shard's (or alone), one at a
+ * time.
+ */
+typedef struct email_entry {
+  struct email_entry *next;
+  uint64_t hash;
+  char email[EMAIL_LENGTH];      // normalised
+  char userid[USER_ID_LENGTH];
+} email_entry_t;
+
+typedef struct {
+  pthread_rwlock_t lock;
+  email_entry_t **buckets;
+  size_t nbuckets;               // always a power of two
+  size_t count;
+} email_shard_t;
+
+static store_shard_t shards[ACCOUNT_STORE_SHARDS];
+static email_shard_t email_shards[ACCOUNT_STORE_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+static atomic_size_t total_count = 0;
+static _Atomic int64_t next_account_id = 1;
+
+// every change gets the next sequence number, taken under its shard's lock
+static _Atomic uint64_t store_sequence = 0;
+
+// the snapshot and the mutation hooks only change while every shard is
+// write-locked, so holding any shard's lock is enough to read them
+static bool snapshot_active = false;
+static uint64_t snapshot_sequence;
+static atomic_bool snapshot_failed = false;
+static struct {
+  account_store_hook_fn fn;
+  void *arg;
+} hooks[ACCOUNT_STORE_MAX_HOOKS];
+static size_t nhooks = 0;
+
+static void init_shards(void)
+{
+  for (size_t i = 0; i < ACCOUNT_STORE_SHARDS; i++) {
+    pthread_rwlock_init(&shards[i].lock, NULL);
+    pthread_rwlock_init(&email_shards[i].lock, NULL);
+  }
+}
+
+static store_shard_t *shard_for(uint64_t hash)
+{
+  pthread_once(&shards_once, init_shards);
+  return &shards[hash >> (64 - SHARD_BITS)];
+}
+
+/**
+ * Returns the link pointing at the entry for key in shard, or at the
+ * terminating NULL of its bucket chain if there is none. Caller holds the
+ * shard's lock.
+ */
+static store_entry_t **find_link(store_shard_t *shard, const userid_key_t *key)
+{
+  if (shard->nbuckets == 0) {
+    return NULL;
+  }
+  store_entry_t **link = &shard->buckets[key->hash & (shard->nbuckets - 1)];
+  for (; *link; link = &(*link)->next) {
+    if ((*link)->hash == key->hash && userid_key_matches(key, (*link)->acc->userid)) {
+      break;
+    }
+  }
+  return link;
+}
+
+static void lock_all_shards(void)
+{
+  pthread_once(&shards_once, init_shards);
+  for (size_t i = 0; i < ACCOUNT_STORE_SHARDS; i++) {
+    pthread_rwlock_wrlock(&shards[i].lock);
+  }
+}
+
+static void unlock_all_shards(void)
+{
+  for (size_t i = ACCOUNT_STORE_SHARDS; i-- > 0;) {
+    pthread_rwlock_unlock(&shards[i].lock);
+  }
+}
+
+/**
+ * Whether the active snapshot (if any) still sees entry as it is now, and
+ * so needs a copy before it changes. Caller holds the shard's lock.
+ */
+static bool snapshot_needs_copy(const store_entry_t *entry)
+{
+  return snapshot_active && entry->version <= snapshot_sequence;
+}
+
+/**
+ * Keeps before, the contents of an entry about to change, for the active
+ * snapshot. Caller holds the shard's write lock.
+ */
+static void preserve_for_snapshot(store_shard_t *shard, const account_t *before)
+{
+  if (shard->npreserved == shard->preserved_cap) {
+    size_t cap = shard->preserved_cap ? shard->preserved_cap * 2 : 16;
+    account_t *preserved = realloc(shard->preserved, cap * sizeof(*preserved));
+    if (!preserved) {
+      log_message(LOG_ERROR, "Memory allocation for account store snapshot has failed");
+      atomic_store(&snapshot_failed, true);
+      return;
+    }
+    shard->preserved = preserved;
+    shard->preserved_cap = cap;
+  }
+  shard->preserved[shard->npreserved++] = *before;
+}
+
+/**
+ * Records a change to entry: gives it the next sequence number and tells
+ * the mutation hooks. Caller holds the shard's write lock.
+ */
+static void note_change(store_entry_t *entry, account_store_op_t op)
+{
+  entry->version = atomic_fetch_add(&store_sequence, 1) + 1;
+  for (size_t i = 0; i < nhooks; i++) {
+    hooks[i].fn(op, entry->version, entry->acc, hooks[i].arg);
+  }
+}
+
+/**
+ * Doubles the bucket array of a shard (or creates it). Caller holds the
+ * shard's write lock. On allocation failure the shard keeps its old array.
+ */
+static void grow_shard(store_shard_t *shard)
+{
+  size_t nbuckets = shard->nbuckets ? shard->nbuckets * 2 : INITIAL_BUCKETS;
+  store_entry_t **buckets = calloc(nbuckets, sizeof(*buckets));
+  if (!buckets) {
+    log_message(LOG_WARN, "Account store could not grow a shard to %zu buckets", nbuckets);
+    return;
+  }
+  for (size_t i = 0; i < shard->nbuckets; i++) {
+    store_entry_t *entry = shard->buckets[i];
+    while (entry) {
+      store_entry_t *next = entry->next;
+      store_entry_t **bucket = &buckets[entry->hash & (nbuckets - 1)];
+      entry->next = *bucket;
+      *bucket = entry;
+      entry = next;
+    }
+  }
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->nbuckets = nbuckets;
+}
+
+/**
+ * Copies email into out (EMAIL_LENGTH bytes) in the form the index keys
+ * it by: lower case, as mail domains are case-insensitive and providers
+ * treat local parts so too. Returns false for an empty email or one not
+ * null-terminated within EMAIL_LENGTH bytes, which are not indexed.
+ */
+static bool normalise_email(const char *email, char *out, size_t *len)
+{
+  if (!email) {
+    return false;
+  }
+  size_t n = strnlen(email, EMAIL_LENGTH);
+  if (n == 0 || n == EMAIL_LENGTH) {
+    return false;
+  }
+  for (size_t i = 0; i < n; i++) {
+    out[i] = (char) tolower((unsigned char) email[i]);
+  }
+  memset(out + n, 0, EMAIL_LENGTH - n);
+  *len = n;
+  return true;
+}
+
+static email_shard_t *email_shard_for(uint64_t hash)
+{
+  pthread_once(&shards_once, init_shards);
+  return &email_shards[hash >> (64 - SHARD_BITS)];
+}
+
+/**
+ * Returns the link pointing at the index entry for the normalised email,
+ * or at the terminating NULL of its bucket chain (or NULL if the shard has
+ * no buckets). Caller holds the shard's lock.
+ */
+static email_entry_t **find_email_link(email_shard_t *shard, const char *email, uint64_t hash)
+{
+  if (shard->nbuckets == 0) {
+    return NULL;
+  }
+  email_entry_t **link = &shard->buckets[hash & (shard->nbuckets - 1)];
+  for (; *link; link = &(*link)->next) {
+    if ((*link)->hash == hash && strcmp((*link)->email, email) == 0) {
+      break;
+    }
+  }
+  return link;
+}
+
+/**
+ * As grow_shard(), for a shard of the email index.
+ */
+static void grow_email_shard(email_shard_t *shard)
+{
+  size_t nbuckets = shard->nbuckets ? shard->nbuckets * 2 : INITIAL_BUCKETS;
+  email_entry_t **buckets = calloc(nbuckets, sizeof(*buckets));
+  if (!buckets) {
+    log_message(LOG_WARN, "Account store could not grow the email index to %zu buckets",
+                nbuckets);
+    return;
+  }
+  for (size_t i = 0; i < shard->nbuckets; i++) {
+    email_entry_t *entry = shard->buckets[i];
+    while (entry) {
+      email_entry_t *next = entry->next;
+      email_entry_t **bucket = &buckets[entry->hash & (nbuckets - 1)];
+      entry->next = *bucket;
+      *bucket = entry;
+      entry = next;
+    }
+  }
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->nbuckets = nbuckets;
+}
+
+/**
+ * Records that userid has email. Returns false (after logging) if another
+ * account has it or memory runs out. An empty email is not indexed, and so
+ * is never refused.
+ */
+static bool claim_email(const char *email, const char *userid)
+{
+  char norm[EMAIL_LENGTH];
+  size_t len;
+  if (!normalise_email(email, norm, &len)) {
+    return true;
+  }
+  uint64_t hash = userid_key_hash(norm, len);
+  email_shard_t *shard = email_shard_for(hash);
+  pthread_rwlock_wrlock(&shard->lock);
+  if (shard->count >= shard->nbuckets) {
+    grow_email_shard(shard);
+  }
+  email_entry_t **link = find_email_link(shard, norm, hash);
+  bool ok = link && (!*link || strcmp((*link)->userid, userid) == 0);
+  if (ok && !*link) {
+    email_entry_t *entry = malloc(sizeof(*entry));
+    if (entry) {
+      entry->next = NULL;
+      entry->hash = hash;
+      memcpy(entry->email, norm, sizeof(entry->email));
+      strncpy(entry->userid, userid, sizeof(entry->userid) - 1);
+      entry->userid[sizeof(entry->userid) - 1] = '\0';
+      *link = entry;
+      shard->count++;
+    }
+    else {
+      log_message(LOG_ERROR, "Memory allocation for email index entry has failed");
+      ok = false;
+    }
+  }
+  else if (!ok && link) {
+    log_message(LOG_WARN, "Account store: email %s is already used by another account", email);
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  return ok;
+}
+
+/**
+ * Forgets that userid has email, if it is indexed as having it.
+ */
+static void release_email(const char *email, const char *userid)
+{
+  char norm[EMAIL_LENGTH];
+  size_t len;
+  if (!normalise_email(email, norm, &len)) {
+    return;
+  }
+  uint64_t hash = userid_key_hash(norm, len);
+  email_shard_t *shard = email_shard_for(hash);
+  pthread_rwlock_wrlock(&shard->lock);
+  email_entry_t **link = find_email_link(shard, norm, hash);
+  email_entry_t *entry = link ? *link : NULL;
+  if (entry && strcmp(entry->userid, userid) == 0) {
+    *link = entry->next;
+    shard->count--;
+    free(entry);
+  }
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+/**
+ * Moves userid's entry in the email index from before to after, emails
+ * that may differ only in case. Returns false, leaving the index as it
+ * was, if another account has after.
+ */
+static bool change_email(const char *before, const char *after, const char *userid)
+{
+  char old_norm[EMAIL_LENGTH], new_norm[EMAIL_LENGTH];
+  size_t old_len, new_len;
+  bool had = normalise_email(before, old_norm, &old_len);
+  bool has = normalise_email(after, new_norm, &new_len);
+  if (had == has && (!has || strcmp(old_norm, new_norm) == 0)) {
+    return true;
+  }
+  if (!claim_email(after, userid)) {
+    return false;
+  }
+  release_email(before, userid);
+  return true;
+}
+
+/**
+ * Copies the userid indexed as having email into userid (USER_ID_LENGTH
+ * bytes). Returns false if no account has it.
+ */
+static bool email_owner(const char *email, char *userid)
+{
+  char norm[EMAIL_LENGTH];
+  size_t len;
+  if (!normalise_email(email, norm, &len)) {
+    return false;
+  }
+  uint64_t hash = userid_key_hash(norm, len);
+  email_shard_t *shard = email_shard_for(hash);
+  pthread_rwlock_rdlock(&shard->lock);
+  email_entry_t **link = find_email_link(shard, norm, hash);
+  bool found = link && *link;
+  if (found) {
+    memcpy(userid, (*link)->userid, USER_ID_LENGTH);
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  return found;
+}
+
+bool account_store_insert(account_t *acc)
+{
+  if (!acc) {
+    return false;
+  }
+  userid_key_t key;
+  if (!userid_key_init(&key, acc->userid)) {
+    log_message(LOG_ERROR, "Account store: userid is not null-terminated");
+    return false;
+  }
+  store_entry_t *entry = malloc(sizeof(*entry));
+  if (!entry) {
+    log_message(LOG_ERROR, "Memory allocation for account store entry has failed");
+    return false;
+  }
+
+  store_shard_t *shard = shard_for(key.hash);
+  pthread_rwlock_wrlock(&shard->lock);
+  if (shard->count >= shard->nbuckets) {
+    grow_shard(shard);
+  }
+  store_entry_t **link = find_link(shard, &key);
+  if (!link) {
+    pthread_rwlock_unlock(&shard->lock);
+    free(entry);
+    log_message(LOG_ERROR, "Account store has no buckets for user %s", acc->userid);
+    return false;
+  }
+  if (*link) {
+    pthread_rwlock_unlock(&shard->lock);
+    free(entry);
+    log_message(LOG_WARN, "Account store: user %s already exists", acc->userid);
+    return false;
+  }
+  if (!claim_email(acc->email, acc->userid)) {
+    pthread_rwlock_unlock(&shard->lock);
+    free(entry);
+    return false;
+  }
+
+  if (acc->account_id == 0) {
+    acc->account_id = atomic_fetch_add(&next_account_id, 1);
+  }
+  else {
+    // keep assigned ids ahead of any id inserted explicitly
+    int64_t next = atomic_load(&next_account_id);
+    while (next <= acc->account_id
+           && !atomic_compare_exchange_weak(&next_account_id, &next, acc->account_id + 1)) {
+      continue;
+    }
+  }
+  entry->hash = key.hash;
+  entry->acc = acc;
+  entry->next = NULL;
+  note_change(entry, ACCOUNT_STORE_INSERT);
+  *link = entry;
+  shard->count++;
+  atomic_fetch_add(&total_count, 1);
+  pthread_rwlock_unlock(&shard->lock);
+  return true;
+}
+
+bool account_store_lookup(const char *userid, account_t *result)
+{
+  userid_key_t key;
+  return userid_key_init(&key, userid) && account_store_lookup_key(&key, result);
+}
+
+bool account_store_lookup_key(const userid_key_t *key, account_t *result)
+{
+  if (!key || !result || key->len == USER_ID_LENGTH) {
+    return false;
+  }
+  store_shard_t *shard = shard_for(key->hash);
+  pthread_rwlock_rdlock(&shard->lock);
+  store_entry_t **link = find_link(shard, key);
+  bool found = link && *link;
+  if (found) {
+    *result = *(*link)->acc;
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  return found;
+}
+
+bool account_store_contains(const char *userid)
+{
+  if (!userid) {
+    return false;
+  }
+  userid_key_t key;
+  if (!userid_key_init(&key, userid)) {
+    return false;
+  }
+  store_shard_t *shard = shard_for(key.hash);
+  pthread_rwlock_rdlock(&shard->lock);
+  store_entry_t **link = find_link(shard, &key);
+  bool found = link && *link;
+  pthread_rwlock_unlock(&shard->lock);
+  return found;
+}
+
+bool account_store_update(const account_t *acc)
+{
+  if (!acc) {
+    return false;
+  }
+  userid_key_t key;
+  if (!userid_key_init(&key, acc->userid)) {
+    return false;
+  }
+  store_shard_t *shard = shard_for(key.hash);
+  pthread_rwlock_wrlock(&shard->lock);
+  store_entry_t **link = find_link(shard, &key);
+  bool found = link && *link;
+  bool updated = false;
+  if (found && (*link)->acc == acc) {
+    // its old email and any snapshot's copy of it are already overwritten
+    log_message(LOG_ERROR, "Account store: user %s was updated in place", acc->userid);
+  }
+  else if (found && change_email((*link)->acc->email, acc->email, acc->userid)) {
+    if (snapshot_needs_copy(*link)) {
+      preserve_for_snapshot(shard, (*link)->acc);
+    }
+    *(*link)->acc = *acc;
+    note_change(*link, ACCOUNT_STORE_UPDATE);
+    updated = true;
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  return updated;
+}
+
+bool account_store_modify(const char *userid, account_store_modify_fn fn, void *arg)
+{
+  if (!userid || !fn) {
+    return false;
+  }
+  userid_key_t key;
+  if (!userid_key_init(&key, userid)) {
+    return false;
+  }
+  store_shard_t *shard = shard_for(key.hash);
+  pthread_rwlock_wrlock(&shard->lock);
+  store_entry_t **link = find_link(shard, &key);
+  bool changed = false;
+  if (link && *link) {
+    store_entry_t *entry = *link;
+    bool keep = snapshot_needs_copy(entry);
+    account_t before = *entry->acc;
+    changed = fn(entry->acc, arg);
+    if (changed && !change_email(before.email, entry->acc->email, before.userid)) {
+      // taking another account's email: keep none of the change
+      *entry->acc = before;
+      changed = false;
+    }
+    if (changed) {
+      if (keep) {
+        preserve_for_snapshot(shard, &before);
+      }
+      note_change(entry, ACCOUNT_STORE_UPDATE);
+    }
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  return changed;
+}
+
+bool account_store_remove(const char *userid)
+{
+  if (!userid) {
+    return false;
+  }
+  userid_key_t key;
+  if (!userid_key_init(&key, userid)) {
+    return false;
+  }
+  store_shard_t *shard = shard_for(key.hash);
+  pthread_rwlock_wrlock(&shard->lock);
+  store_entry_t **link = find_link(shard, &key);
+  store_entry_t *entry = link ? *link : NULL;
+  if (entry) {
+    if (snapshot_needs_copy(entry)) {
+      preserve_for_snapshot(shard, entry->acc);
+    }
+    note_change(entry, ACCOUNT_STORE_REMOVE);
+    *link = entry->next;
+    shard->count--;
+    atomic_fetch_sub(&total_count, 1);
+  }
+  if (entry) {
+    release_email(entry->acc->email, entry->acc->userid);
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  if (!entry) {
+    return false;
+  }
+  account_free(entry->acc);
+  free(entry);
+  return true;
+}
+
+bool account_store_lookup_email(const char *email, account_t *result)
+{
+  char userid[USER_ID_LENGTH];
+  char wanted[EMAIL_LENGTH], found[EMAIL_LENGTH];
+  size_t len;
+  if (!result || !email_owner(email, userid) || !account_store_lookup(userid, result)) {
+    return false;
+  }
+  // the email may have changed hands between the two lookups
+  return normalise_email(email, wanted, &len) && normalise_email(result->email, found, &len)
+         && strcmp(wanted, found) == 0;
+}
+
+bool account_store_email_in_use(const char *email)
+{
+  char userid[USER_ID_LENGTH];
+  return email_owner(email, userid);
+}
+
+size_t account_store_count(void)
+{
+  return atomic_load(&total_count);
+}
+
+size_t account_store_shard_of(uint64_t hash)
+{
+  return (size_t) (hash >> (64 - SHARD_BITS));
+}
+
+bool account_store_foreach_in_shard(size_t s, account_store_visit_fn fn, void *arg)
+{
+  if (s >= ACCOUNT_STORE_SHARDS) {
+    return false;
+  }
+  pthread_once(&shards_once, init_shards);
+  store_shard_t *shard = &shards[s];
+  pthread_rwlock_rdlock(&shard->lock);
+  for (size_t b = 0; b < shard->nbuckets; b++) {
+    for (store_entry_t *entry = shard->buckets[b]; entry; entry = entry->next) {
+      if (!fn(entry->acc, arg)) {
+        pthread_rwlock_unlock(&shard->lock);
+        return false;
+      }
+    }
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  return true;
+}
+
+bool account_store_foreach(account_store_visit_fn fn, void *arg)
+{
+  for (size_t s = 0; s < ACCOUNT_STORE_SHARDS; s++) {
+    if (!account_store_foreach_in_shard(s, fn, arg)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void account_store_clear(void)
+{
+  pthread_once(&shards_once, init_shards);
+  for (size_t s = 0; s < ACCOUNT_STORE_SHARDS; s++) {
+    store_shard_t *shard = &shards[s];
+    pthread_rwlock_wrlock(&shard->lock);
+    for (size_t b = 0; b < shard->nbuckets; b++) {
+      store_entry_t *entry = shard->buckets[b];
+      while (entry) {
+        store_entry_t *next = entry->next;
+        if (snapshot_needs_copy(entry)) {
+          preserve_for_snapshot(shard, entry->acc);
+        }
+        note_change(entry, ACCOUNT_STORE_REMOVE);
+        account_free(entry->acc);
+        free(entry);
+        entry = next;
+      }
+    }
+    free(shard->buckets);
+    shard->buckets = NULL;
+    shard->nbuckets = 0;
+    atomic_fetch_sub(&total_count, shard->count);
+    shard->count = 0;
+    pthread_rwlock_unlock(&shard->lock);
+  }
+  for (size_t s = 0; s < ACCOUNT_STORE_SHARDS; s++) {
+    email_shard_t *shard = &email_shards[s];
+    pthread_rwlock_wrlock(&shard->lock);
+    for (size_t b = 0; b < shard->nbuckets; b++) {
+      email_entry_t *entry = shard->buckets[b];
+      while (entry) {
+        email_entry_t *next = entry->next;
+        free(entry);
+        entry = next;
+      }
+    }
+    free(shard->buckets);
+    shard->buckets = NULL;
+    shard->nbuckets = 0;
+    shard->count = 0;
+    pthread_rwlock_unlock(&shard->lock);
+  }
+}
+
+uint64_t account_store_sequence(void)
+{
+  return atomic_load(&store_sequence);
+}
+
+void account_store_advance_sequence(uint64_t sequence)
+{
+  uint64_t current = atomic_load(&store_sequence);
+  while (current < sequence
+         && !atomic_compare_exchange_weak(&store_sequence, &current, sequence)) {
+    continue;
+  }
+}
+
+bool account_store_add_hook(account_store_hook_fn fn, void *arg)
+{
+  if (!fn) {
+    return false;
+  }
+  lock_all_shards();
+  bool added = nhooks < ACCOUNT_STORE_MAX_HOOKS;
+  if (added) {
+    hooks[nhooks].fn = fn;
+    hooks[nhooks].arg = arg;
+    nhooks++;
+  }
+  unlock_all_shards();
+  if (!added) {
+    log_message(LOG_ERROR, "Account store: too many mutation hooks");
+  }
+  return added;
+}
+
+void account_store_remove_hook(account_store_hook_fn fn, void *arg)
+{
+  lock_all_shards();
+  for (size_t i = 0; i < nhooks; i++) {
+    if (hooks[i].fn == fn && hooks[i].arg == arg) {
+      memmove(&hooks[i], &hooks[i + 1], (nhooks - i - 1) * sizeof(hooks[0]));
+      nhooks--;
+      break;
+    }
+  }
+  unlock_all_shards();
+}
+
+bool account_store_snapshot_begin(uint64_t *sequence)
+{
+  lock_all_shards();
+  bool started = !snapshot_active;
+  if (started) {
+    snapshot_active = true;
+    snapshot_sequence = atomic_load(&store_sequence);
+    atomic_store(&snapshot_failed, false);
+    if (sequence) {
+      *sequence = snapshot_sequence;
+    }
+  }
+  unlock_all_shards();
+  if (!started) {
+    log_message(LOG_WARN, "Account store: a snapshot is already active");
+  }
+  return started;
+}
+
+bool account_store_snapshot_foreach_in_shard(size_t s, account_store_visit_fn fn, void *arg)
+{
+  if (s >= ACCOUNT_STORE_SHARDS) {
+    return false;
+  }
+  pthread_once(&shards_once, init_shards);
+  store_shard_t *shard = &shards[s];
+  pthread_rwlock_rdlock(&shard->lock);
+  bool more = snapshot_active;
+  for (size_t b = 0; more && b < shard->nbuckets; b++) {
+    for (store_entry_t *entry = shard->buckets[b]; more && entry; entry = entry->next) {
+      if (entry->version <= snapshot_sequence) {
+        more = fn(entry->acc, arg);
+      }
+    }
+  }
+  for (size_t i = 0; more && i < shard->npreserved; i++) {
+    more = fn(&shard->preserved[i], arg);
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  return more;
+}
+
+bool account_store_snapshot_foreach(account_store_visit_fn fn, void *arg)
+{
+  for (size_t s = 0; s < ACCOUNT_STORE_SHARDS; s++) {
+    if (!account_store_snapshot_foreach_in_shard(s, fn, arg)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool account_store_snapshot_end(void)
+{
+  lock_all_shards();
+  bool was_active = snapshot_active;
+  snapshot_active = false;
+  for (size_t s = 0; s < ACCOUNT_STORE_SHARDS; s++) {
+    free(shards[s].preserved);
+    shards[s].preserved = NULL;
+    shards[s].npreserved = 0;
+    shards[s].preserved_cap = 0;
+  }
+  unlock_all_shards();
+  return was_active && !atomic_load(&snapshot_failed);
+}
@@ -0,0 +1,154 @@
+#ifndef ACCOUNT_STORE_H
+#define ACCOUNT_STORE_H
+
+/**
+ * @file account_store.h
+ * @brief In-memory account store, the default lookup backend.
+ *
+ * Accounts are kept in a hash table keyed by userid, split into
+ * independently locked shards so that concurrent handle_login() lookups
+ * (which take a shard's lock for reading) and mutations (which take it for
+ * writing) on different accounts don't contend.
+ *
+ * While no other backend is installed (see db_backend.h), handle_login()
+ * looks accounts up here first, then with account_lookup_by_userid().
+ *
+ * The store owns the account_t structures inserted into it; callers get
+ * copies from lookups and write changes back with account_store_update().
+ *
+ * Accounts are also indexed by email, compared without regard to case, so
+ * that they can be found by email as cheaply as by userid. No two accounts
+ * in the store may have the same email: inserts and updates that would
+ * give an account another's email are refused. Accounts with an empty
+ * email are not indexed.
+ *
+ * Every change is numbered from a store-wide sequence, and is passed to
+ * any hooks (e.g. a journal) as it happens. A point-in-time snapshot can be
+ * read while the store keeps changing: while it is active, the first change
+ * to an account keeps a copy of the account as it was for the snapshot
+ * (copy-on-write), so taking and reading one never blocks lookups for more
+ * than a moment.
+ */
+
+#include "account.h"
+#include "userid_key.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ACCOUNT_STORE_SHARDS 64
+#define ACCOUNT_STORE_MAX_HOOKS 4
+
+// called for each account by account_store_foreach(); return false to stop
+typedef bool (*account_store_visit_fn)(const account_t *acc, void *arg);
+
+typedef enum {
+  ACCOUNT_STORE_INSERT,
+  ACCOUNT_STORE_UPDATE,
+  ACCOUNT_STORE_REMOVE
+} account_store_op_t;
+
+// called for every change, with the shard's write lock held, with the
+// change's sequence number and the account as it is after the change (or
+// just before removal). must be quick and must not call into the store.
+typedef void (*account_store_hook_fn)(account_store_op_t op, uint64_t sequence,
+                                      const account_t *acc, void *arg);
+
+// called by account_store_modify() with the stored account; returns whether
+// it changed it
+typedef bool (*account_store_modify_fn)(account_t *acc, void *arg);
+
+// add an account (e.g. from account_create()). On success the store takes
+// ownership of acc and, if its account_id is 0, assigns the next free id.
+// Returns false, leaving acc with the caller, if the userid already exists
+// or another account has its email.
+bool account_store_insert(account_t *acc);
+
+// copy the account with the given userid into result.
+// returns false if there is no such account.
+bool account_store_lookup(const char *userid, account_t *result);
+
+// as account_store_lookup(), for a userid already made into a key
+bool account_store_lookup_key(const userid_key_t *key, account_t *result);
+
+// whether an account with the given userid exists
+bool account_store_contains(const char *userid);
+
+// copy the account with the given email (in any case) into result.
+// returns false if there is no such account.
+bool account_store_lookup_email(const char *email, account_t *result);
+
+// whether some account has the given email (in any case)
+bool account_store_email_in_use(const char *email);
+
+// overwrite the stored account having acc->userid with the contents of acc,
+// which must be a copy (e.g. from account_store_lookup()), not the stored
+// account itself. returns false if there is no such account, acc is the
+// stored account, or another account has acc->email.
+bool account_store_update(const account_t *acc);
+
+// call fn on the stored account with the given userid while holding its
+// shard's write lock, so that checking and changing it is atomic. fn must be
+// quick and must not change the userid or call into the store. returns
+// false if there is no such account, otherwise what fn returned; a change
+// giving the account another account's email is undone, returning false.
+bool account_store_modify(const char *userid, account_store_modify_fn fn, void *arg);
+
+// remove and free the account with the given userid.
+// returns false if there is no such account.
+bool account_store_remove(const char *userid);
+
+// number of accounts in the store
+size_t account_store_count(void);
+
+// call fn for every account, one shard at a time with that shard read-locked.
+// fn must not modify the store. returns false if fn stopped the walk early.
+bool account_store_foreach(account_store_visit_fn fn, void *arg);
+
+// the shard holding accounts whose userids hash (userid_key_hash()) to
+// hash: its top bits, so each shard holds one contiguous range of hashes
+size_t account_store_shard_of(uint64_t hash);
+
+// like account_store_foreach(), but only for the accounts in shard
+// (0 <= shard < ACCOUNT_STORE_SHARDS)
+bool account_store_foreach_in_shard(size_t shard, account_store_visit_fn fn, void *arg);
+
+// remove and free every account
+void account_store_clear(void);
+
+// the sequence number of the latest change (0 if there has been none)
+uint64_t account_store_sequence(void);
+
+// make sure later changes are numbered after sequence (e.g. after restoring
+// a checkpoint and replaying a journal)
+void account_store_advance_sequence(uint64_t sequence);
+
+// add a hook to be called for every change, after those already added.
+// returns false (after logging) if ACCOUNT_STORE_MAX_HOOKS are already set.
+bool account_store_add_hook(account_store_hook_fn fn, void *arg);
+
+// remove a hook added with the same fn and arg. once this returns, the
+// hook is not running and will not be called again.
+void account_store_remove_hook(account_store_hook_fn fn, void *arg);
+
+// start a snapshot of the store as it is now, setting *sequence (if not
+// NULL) to the sequence number of the last change it includes. returns
+// false if a snapshot is already active; only one can be at a time.
+bool account_store_snapshot_begin(uint64_t *sequence);
+
+// call fn for every account in the active snapshot, a shard at a time with
+// that shard read-locked. returns false if fn stopped the walk early or no
+// snapshot is active.
+bool account_store_snapshot_foreach(account_store_visit_fn fn, void *arg);
+
+// as account_store_snapshot_foreach(), for one shard (0 to ACCOUNT_STORE_SHARDS - 1)
+bool account_store_snapshot_foreach_in_shard(size_t shard, account_store_visit_fn fn,
+                                             void *arg);
+
+// end the active snapshot and free its copies. returns false if there was
+// none, or if memory ran out to keep a copy (so the snapshot may have seen
+// changes made after it began).
+bool account_store_snapshot_end(void);
+
+#endif // ACCOUNT_STORE_H
@@ -0,0 +1,195 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "account_validate.h"
+#include "account.h"
+#include "logging.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// SWAR ("SIMD within a register"): test the 8 bytes of a uint64_t at once
+#define ONES  UINT64_C(0x0101010101010101)
+#define HIGHS UINT64_C(0x8080808080808080)
+#define LOW_NIBBLES  UINT64_C(0x0f0f0f0f0f0f0f0f)
+#define HIGH_NIBBLES UINT64_C(0xf0f0f0f0f0f0f0f0)
+
+typedef enum {
+  FIELD_OK,
+  EMAIL_TOO_LONG,
+  EMAIL_UNPRINTABLE,
+  BIRTHDATE_BAD_LENGTH,
+  BIRTHDATE_NO_DASHES,
+  BIRTHDATE_NOT_DIGITS
+} field_status_t;
+
+static uint64_t load_word(const char *p)
+{
+  uint64_t w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+/**
+ * Builds a word whose byte i (in memory order) is bytes[i], so that masks
+ * line up with load_word() whatever the byte order.
+ */
+static uint64_t word_of(const unsigned char bytes[8])
+{
+  uint64_t w;
+  memcpy(&w, bytes, sizeof(w));
+  return w;
+}
+
+/**
+ * Whether any byte of w is outside '!'..'~' (i.e. a control character,
+ * space, DEL or non-ASCII).
+ */
+static bool has_unprintable(uint64_t w)
+{
+  uint64_t below = (w - ONES * '!') & ~w;      // some byte < '!'
+  uint64_t above = (w + ONES * (127 - '~')) | w; // some byte > '~'
+  return ((below | above) & HIGHS) != 0;
+}
+
+/**
+ * Returns a word with a non-zero byte wherever w does not hold '0'..'9'.
+ */
+static uint64_t non_digits(uint64_t w)
+{
+  uint64_t wrong_high = (w & HIGH_NIBBLES) ^ (ONES * 0x30);
+  uint64_t low_over_9 = ((w & LOW_NIBBLES) + ONES * 6) & (ONES * 0x10);
+  return wrong_high | low_over_9;
+}
+
+static field_status_t check_email(const char *email, size_t len)
+{
+  if (len >= EMAIL_LENGTH) {
+    return EMAIL_TOO_LONG;
+  }
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    if (has_unprintable(load_word(email + i))) {
+      return EMAIL_UNPRINTABLE;
+    }
+  }
+  if (i < len) {
+    char tail[8];
+    memset(tail, 'a', sizeof(tail));
+    memcpy(tail, email + i, len - i);
+    if (has_unprintable(load_word(tail))) {
+      return EMAIL_UNPRINTABLE;
+    }
+  }
+  return FIELD_OK;
+}
+
+static field_status_t check_birthdate(const char *birthdate, size_t len)
+{
+  static const unsigned char dash_positions[8] = { 0, 0, 0, 0, 0xff, 0, 0, 0xff };
+  static const unsigned char dashes[8] = { 0, 0, 0, 0, '-', 0, 0, '-' };
+  // YYYY-MM- in the first word; the second word is bytes 2-9, ending in DD
+  static const unsigned char first_digits[8] = { 0xff, 0xff, 0xff, 0xff, 0, 0xff, 0xff, 0 };
+  static const unsigned char last_digits[8] = { 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+  if (len != BIRTHDATE_LENGTH) {
+    return BIRTHDATE_BAD_LENGTH;
+  }
+  uint64_t first = load_word(birthdate);
+  uint64_t last = load_word(birthdate + BIRTHDATE_LENGTH - 8);
+  if ((first & word_of(dash_positions)) != word_of(dashes)) {
+    return BIRTHDATE_NO_DASHES;
+  }
+  if ((non_digits(first) & word_of(first_digits)) || (non_digits(last) & word_of(last_digits))) {
+    return BIRTHDATE_NOT_DIGITS;
+  }
+  return FIELD_OK;
+}
+
+/**
+ * As check_email(), for a null-terminated email. strnlen() stops at
+ * EMAIL_LENGTH, which is already too long.
+ */
+static field_status_t check_email_str(const char *email)
+{
+  return check_email(email, strnlen(email, EMAIL_LENGTH));
+}
+
+/**
+ * As check_birthdate(), for a null-terminated birthdate, looking at no more
+ * than BIRTHDATE_LENGTH + 1 bytes.
+ */
+static field_status_t check_birthdate_str(const char *birthdate)
+{
+  return check_birthdate(birthdate, strnlen(birthdate, BIRTHDATE_LENGTH + 1));
+}
+
+static bool log_status(field_status_t status)
+{
+  switch (status) {
+    case FIELD_OK:
+      return true;
+    case EMAIL_TOO_LONG:
+      log_message(LOG_WARN,"Invalid email: The number of characters exceeds maximum limit.");
+      break;
+    case EMAIL_UNPRINTABLE:
+      log_message(LOG_WARN,"Invalid email: contains non-printable characters or spaces");
+      break;
+    case BIRTHDATE_BAD_LENGTH:
+      log_message(LOG_WARN,"Invalid birthdate: length is not 10 characters and in YYYY-MM-DD format");
+      break;
+    case BIRTHDATE_NO_DASHES:
+      log_message(LOG_WARN,"Invalid birthdate: dashes are missing from supplied birthdate");
+      break;
+    case BIRTHDATE_NOT_DIGITS:
+      log_message(LOG_WARN,"Invalid birthdate: contains non-digit characters");
+      break;
+  }
+  return false;
+}
+
+bool validate_email(const char *email)
+{
+  return log_status(check_email_str(email));
+}
+
+bool validate_email_span(const char *email, size_t len)
+{
+  return log_status(check_email(email, len));
+}
+
+bool validate_birthdate(const char *birthdate)
+{
+  return log_status(check_birthdate_str(birthdate));
+}
+
+bool validate_birthdate_span(const char *birthdate, size_t len)
+{
+  return log_status(check_birthdate(birthdate, len));
+}
+
+bool validate_userid(const char *userid)
+{
+  return strnlen(userid, USER_ID_LENGTH) < USER_ID_LENGTH;
+}
+
+size_t validate_account_fields_batch(const account_fields_t *records, size_t count,
+                                     unsigned char *invalid)
+{
+  size_t valid = 0;
+  for (size_t i = 0; i < count; i++) {
+    const account_fields_t *r = &records[i];
+    unsigned char bits = 0;
+    if (!r->userid || !validate_userid(r->userid)) {
+      bits |= ACCOUNT_FIELD_USERID;
+    }
+    if (!r->email || check_email_str(r->email) != FIELD_OK) {
+      bits |= ACCOUNT_FIELD_EMAIL;
+    }
+    if (!r->birthdate || check_birthdate_str(r->birthdate) != FIELD_OK) {
+      bits |= ACCOUNT_FIELD_BIRTHDATE;
+    }
+    invalid[i] = bits;
+    valid += bits == 0;
+  }
+  return valid;
+}
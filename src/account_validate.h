@@ -0,0 +1,53 @@
+#ifndef ACCOUNT_VALIDATE_H
+#define ACCOUNT_VALIDATE_H
+
+/**
+ * @file account_validate.h
+ * @brief Validation of account fields, as applied by account_create().
+ *
+ * Rules:
+ *
+ * - userid: fewer than USER_ID_LENGTH characters.
+ * - email: fewer than EMAIL_LENGTH characters, each printable ASCII other
+ *   than space ('!' to '~').
+ * - birthdate: exactly BIRTHDATE_LENGTH characters in the form YYYY-MM-DD,
+ *   where Y, M and D are digits.
+ *
+ * Each field is checked eight bytes at a time, looking at no more than the
+ * field's maximum length. The null-terminated forms (and the batch) find the
+ * length with strnlen(), bounded by that maximum, and then use the same
+ * checks as the _span forms (where an embedded null is invalid).
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// check an email address, logging a warning that says why if it is invalid
+bool validate_email(const char *email);
+bool validate_email_span(const char *email, size_t len);
+
+// check a birthdate, logging a warning that says why if it is invalid
+bool validate_birthdate(const char *birthdate);
+bool validate_birthdate_span(const char *birthdate, size_t len);
+
+// whether userid is short enough to store (does not log)
+bool validate_userid(const char *userid);
+
+typedef struct {
+  const char *userid;
+  const char *email;
+  const char *birthdate;
+} account_fields_t;
+
+// bits set in the results of validate_account_fields_batch()
+#define ACCOUNT_FIELD_USERID    0x1
+#define ACCOUNT_FIELD_EMAIL     0x2
+#define ACCOUNT_FIELD_BIRTHDATE 0x4
+
+// validate count records without logging. invalid[i] is set to the
+// ACCOUNT_FIELD_* bits of the fields of records[i] that are invalid (0 if
+// all are valid). returns the number of fully valid records.
+size_t validate_account_fields_batch(const account_fields_t *records, size_t count,
+                                     unsigned char *invalid);
+
+#endif // ACCOUNT_VALIDATE_H
@@ -0,0 +1,976 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "audit_log.h"
+#include "crc32.h"
+#include "logging.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SEGMENT_MAGIC 0x474f4c41u   // "ALOG"
+#define SEGMENT_VERSION 1u
+#define HEADER_SIZE 4096
+// slots a thread claims at a time
+#define CLAIM_SLOTS 32
+#define MAX_SEGMENT_EVENTS (1u << 24)
+#define SEGMENT_NAME_FORMAT "audit-%016" PRIx64 ".seg"
+#define SEGMENT_NAME_LENGTH (6 + 16 + 4)
+// room for the directory, a '/' and a segment name
+#define MAX_PATH_LENGTH 4096
+
+/**
+ * One slot. check is the CRC-32 of the bytes before it, stored last (with
+ * release ordering), so a slot whose check does not match holds no event.
+ */
+typedef struct {
+  int64_t time;
+  uint32_t ip;
+  uint8_t result;
+  uint8_t userid_len;
+  uint16_t reserved;
+  char userid[USER_ID_LENGTH];
+  uint8_t padding[8];
+  _Atomic uint32_t check;
+} event_t;
+
+_Static_assert(sizeof(event_t) == AUDIT_LOG_EVENT_SIZE, "audit event size");
+
+/**
+ * The start of a segment file, followed (at HEADER_SIZE) by capacity slots
+ * and, once sealed, the index: a 64-bit posting count n, n userid postings,
+ * n IP postings, then the fences of each.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+  uint32_t event_size;
+  _Atomic uint32_t claimed;        // slots handed out (may run past capacity)
+  _Atomic uint32_t sealed;         // set once everything below is written
+  uint32_t events;
+  uint32_t index_crc;
+  int64_t min_time;
+  int64_t max_time;
+  uint64_t index_offset;
+  uint64_t index_bytes;
+} segment_header_t;
+
+typedef struct {
+  uint32_t key;                    // crc32 of the userid, or the IP in host order
+  uint32_t slot;
+} posting_t;
+
+typedef struct segment {
+  segment_header_t *header;
+  event_t *events;
+  size_t mapped;
+  int fd;
+  uint64_t serial;                 // never reused in this process
+  struct segment *next;            // in the sealing queue
+} segment_t;
+
+// open, close, rotation and sync; also serialises drain_writers()
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool log_open = false;
+static _Atomic(segment_t *) current = NULL;
+static char log_dir[MAX_PATH_LENGTH];
+static uint32_t segment_events;
+static time_t retention;
+static uint64_t next_sequence;
+static _Atomic uint64_t next_serial = 1;
+
+// writers in progress, counted on the side writer_epoch's parity picks
+static _Atomic uint64_t writer_epoch = 0;
+static _Atomic uint64_t writers[2];
+
+static pthread_mutex_t seal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t seal_cond = PTHREAD_COND_INITIALIZER;
+static segment_t *seal_head = NULL;
+static segment_t **seal_tail = &seal_head;
+static bool sealer_stop = false;
+static pthread_t sealer;
+
+static _Atomic uint64_t appended = 0;
+static _Atomic uint64_t dropped = 0;
+static _Atomic uint64_t sealed = 0;
+static _Atomic uint64_t expired = 0;
+
+// the slots this thread has claimed in segment serial
+static _Thread_local struct {
+  uint64_t serial;
+  uint32_t next;
+  uint32_t end;
+} claim;
+
+/**
+ * Counts the calling thread as a writer, on the side of the epoch current
+ * once it is counted, and returns the side.
+ */
+static unsigned int enter_writer(void)
+{
+  for (;;) {
+    uint64_t epoch = atomic_load(&writer_epoch);
+    atomic_fetch_add(&writers[epoch & 1], 1);
+    if (atomic_load(&writer_epoch) == epoch) {
+      return (unsigned int) (epoch & 1);
+    }
+    atomic_fetch_sub(&writers[epoch & 1], 1);
+  }
+}
+
+static void leave_writer(unsigned int side)
+{
+  atomic_fetch_sub(&writers[side], 1);
+}
+
+/**
+ * Waits until no writer can still be using a segment that was replaced as
+ * current before the call: new writers count on the other side, so the
+ * old side only drains. Caller holds log_mutex.
+ */
+static void drain_writers(void)
+{
+  uint64_t epoch = atomic_fetch_add(&writer_epoch, 1);
+  while (atomic_load(&writers[epoch & 1]) != 0) {
+    sched_yield();
+  }
+}
+
+/**
+ * Returns false (after logging) if the path would not fit in
+ * MAX_PATH_LENGTH bytes.
+ */
+static bool segment_path(char *path, const char *dir, uint64_t sequence)
+{
+  int n = snprintf(path, MAX_PATH_LENGTH, "%s/" SEGMENT_NAME_FORMAT, dir, sequence);
+  if (n < 0 || n >= MAX_PATH_LENGTH) {
+    log_message(LOG_ERROR, "Audit log segment path in %s is too long", dir);
+    return false;
+  }
+  return true;
+}
+
+static size_t slots_size(uint32_t capacity)
+{
+  return HEADER_SIZE + (size_t) capacity * AUDIT_LOG_EVENT_SIZE;
+}
+
+static void unmap_segment(segment_t *seg)
+{
+  munmap(seg->header, seg->mapped);
+  if (seg->fd != -1) {
+    close(seg->fd);
+  }
+  free(seg);
+}
+
+/**
+ * Maps the segment file at path, checking that it is one. Keeps the file
+ * open if writable (for sealing). Returns NULL if it cannot be used.
+ */
+static segment_t *map_segment(const char *path, bool writable)
+{
+  int fd = open(path, writable ? O_RDWR : O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || (size_t) st.st_size < HEADER_SIZE) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return NULL;
+  }
+  size_t size = (size_t) st.st_size;
+  void *mapping = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                       fd, 0);
+  segment_t *seg = mapping == MAP_FAILED ? NULL : calloc(1, sizeof(*seg));
+  if (!seg) {
+    if (mapping != MAP_FAILED) {
+      munmap(mapping, size);
+    }
+    close(fd);
+    return NULL;
+  }
+  seg->header = mapping;
+  seg->events = (event_t *) ((char *) mapping + HEADER_SIZE);
+  seg->mapped = size;
+  seg->fd = fd;
+  segment_header_t *h = seg->header;
+  if (h->magic != SEGMENT_MAGIC || h->version != SEGMENT_VERSION
+      || h->event_size != AUDIT_LOG_EVENT_SIZE || h->capacity == 0
+      || h->capacity > MAX_SEGMENT_EVENTS || slots_size(h->capacity) > size) {
+    log_message(LOG_WARN, "%s is not an audit log segment", path);
+    unmap_segment(seg);
+    return NULL;
+  }
+  if (!writable) {
+    close(fd);
+    seg->fd = -1;
+  }
+  return seg;
+}
+
+/**
+ * Creates the next segment file of the open log. Caller holds log_mutex.
+ * Returns NULL (after logging) on failure.
+ */
+static segment_t *create_segment(void)
+{
+  char path[MAX_PATH_LENGTH];
+  if (!segment_path(path, log_dir, next_sequence)) {
+    return NULL;
+  }
+  size_t size = slots_size(segment_events);
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1 || ftruncate(fd, (off_t) size) == -1) {
+    log_message(LOG_ERROR, "Cannot create audit log segment %s: %s", path, strerror(errno));
+    if (fd != -1) {
+      close(fd);
+      unlink(path);
+    }
+    return NULL;
+  }
+  void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  segment_t *seg = mapping == MAP_FAILED ? NULL : calloc(1, sizeof(*seg));
+  if (!seg) {
+    log_message(LOG_ERROR, "Cannot map audit log segment %s", path);
+    if (mapping != MAP_FAILED) {
+      munmap(mapping, size);
+    }
+    close(fd);
+    unlink(path);
+    return NULL;
+  }
+  next_sequence++;
+  seg->header = mapping;
+  seg->events = (event_t *) ((char *) mapping + HEADER_SIZE);
+  seg->mapped = size;
+  seg->fd = fd;
+  seg->serial = atomic_fetch_add(&next_serial, 1);
+  seg->header->version = SEGMENT_VERSION;
+  seg->header->capacity = segment_events;
+  seg->header->event_size = AUDIT_LOG_EVENT_SIZE;
+  // the file is zero-filled, so nothing is claimed or sealed
+  seg->header->magic = SEGMENT_MAGIC;
+  return seg;
+}
+
+static uint32_t event_check(const event_t *event)
+{
+  return crc32_compute(event, offsetof(event_t, check));
+}
+
+static bool event_is_valid(const event_t *event)
+{
+  uint32_t check = atomic_load_explicit(&event->check, memory_order_acquire);
+  return check == event_check(event) && event->userid_len <= USER_ID_LENGTH
+         && event->result <= LOGIN_FAIL_INTERNAL_ERROR;
+}
+
+static uint32_t userid_key(const char *userid, size_t len)
+{
+  return crc32_compute(userid, len);
+}
+
+static int compare_postings(const void *a, const void *b)
+{
+  const posting_t *x = a;
+  const posting_t *y = b;
+  if (x->key != y->key) {
+    return x->key < y->key ? -1 : 1;
+  }
+  return (x->slot > y->slot) - (x->slot < y->slot);
+}
+
+static size_t fence_count(size_t postings)
+{
+  return (postings + AUDIT_LOG_FENCE_STRIDE - 1) / AUDIT_LOG_FENCE_STRIDE;
+}
+
+static size_t index_size(size_t postings)
+{
+  return sizeof(uint64_t) + 2 * postings * sizeof(posting_t)
+         + 2 * fence_count(postings) * sizeof(uint32_t);
+}
+
+/**
+ * Builds the index of a segment no writer is using, writes it after the
+ * slots and marks the segment sealed. The segment is unmapped and freed
+ * either way. Returns false (after logging) if the index cannot be made,
+ * leaving the segment to be scanned in full by queries.
+ */
+static bool seal_segment(segment_t *seg)
+{
+  segment_header_t *h = seg->header;
+  uint32_t slots = atomic_load(&h->claimed);
+  if (slots > h->capacity) {
+    slots = h->capacity;
+  }
+  size_t n = 0;
+  for (uint32_t i = 0; i < slots; i++) {
+    n += event_is_valid(&seg->events[i]);
+  }
+  size_t size = index_size(n);
+  unsigned char *index = malloc(size);
+  if (!index) {
+    log_message(LOG_ERROR, "Memory allocation for audit log index has failed");
+    unmap_segment(seg);
+    return false;
+  }
+  uint64_t count = n;
+  memcpy(index, &count, sizeof(count));
+  posting_t *by_user = (posting_t *) (index + sizeof(uint64_t));
+  posting_t *by_ip = by_user + n;
+  uint32_t *user_fence = (uint32_t *) (by_ip + n);
+  uint32_t *ip_fence = user_fence + fence_count(n);
+  int64_t min_time = INT64_MAX;
+  int64_t max_time = INT64_MIN;
+  size_t j = 0;
+  for (uint32_t i = 0; i < slots; i++) {
+    const event_t *event = &seg->events[i];
+    if (!event_is_valid(event)) {
+      continue;
+    }
+    by_user[j] = (posting_t) { userid_key(event->userid, event->userid_len), i };
+    by_ip[j] = (posting_t) { ntohl(event->ip), i };
+    min_time = event->time < min_time ? event->time : min_time;
+    max_time = event->time > max_time ? event->time : max_time;
+    j++;
+  }
+  qsort(by_user, n, sizeof(*by_user), compare_postings);
+  qsort(by_ip, n, sizeof(*by_ip), compare_postings);
+  for (size_t f = 0; f < fence_count(n); f++) {
+    user_fence[f] = by_user[f * AUDIT_LOG_FENCE_STRIDE].key;
+    ip_fence[f] = by_ip[f * AUDIT_LOG_FENCE_STRIDE].key;
+  }
+
+  uint64_t offset = slots_size(h->capacity);
+  bool ok = false;
+  ssize_t written = pwrite(seg->fd, index, size, (off_t) offset);
+  if (written != (ssize_t) size) {
+    log_message(LOG_ERROR, "Failed to write audit log index: %s",
+                written == -1 ? strerror(errno) : "short write");
+  }
+  else {
+    h->events = (uint32_t) n;
+    h->index_crc = crc32_compute(index, size);
+    h->min_time = n ? min_time : 0;
+    h->max_time = n ? max_time : 0;
+    h->index_offset = offset;
+    h->index_bytes = size;
+    // the index and header reach the disk before the segment says it is sealed
+    ok = msync(h, seg->mapped, MS_SYNC) == 0 && fsync(seg->fd) == 0;
+    if (ok) {
+      atomic_store(&h->sealed, 1);
+      msync(h, HEADER_SIZE, MS_SYNC);
+      atomic_fetch_add(&sealed, 1);
+    }
+  }
+  free(index);
+  unmap_segment(seg);
+  return ok;
+}
+
+static void *sealer_main(void *arg)
+{
+  (void) arg;
+  pthread_mutex_lock(&seal_mutex);
+  for (;;) {
+    while (!seal_head && !sealer_stop) {
+      pthread_cond_wait(&seal_cond, &seal_mutex);
+    }
+    segment_t *seg = seal_head;
+    if (!seg) {
+      break;
+    }
+    seal_head = seg->next;
+    if (!seal_head) {
+      seal_tail = &seal_head;
+    }
+    pthread_mutex_unlock(&seal_mutex);
+    seal_segment(seg);
+    audit_log_expire(log_dir, time(NULL) - retention);
+    pthread_mutex_lock(&seal_mutex);
+  }
+  pthread_mutex_unlock(&seal_mutex);
+  return NULL;
+}
+
+static void queue_for_sealing(segment_t *seg)
+{
+  pthread_mutex_lock(&seal_mutex);
+  seg->next = NULL;
+  *seal_tail = seg;
+  seal_tail = &seg->next;
+  pthread_cond_signal(&seal_cond);
+  pthread_mutex_unlock(&seal_mutex);
+}
+
+/**
+ * Replaces the full current segment (if it is still the one with serial)
+ * with a new one, and hands it to the sealer once its writers are done.
+ */
+static void rotate(uint64_t serial)
+{
+  pthread_mutex_lock(&log_mutex);
+  segment_t *full = atomic_load(&current);
+  if (full && full->serial == serial) {
+    segment_t *fresh = create_segment();
+    if (!fresh) {
+      log_message(LOG_ERROR, "Audit log stopped: no new segment could be created");
+    }
+    atomic_store(&current, fresh);
+    drain_writers();
+    queue_for_sealing(full);
+  }
+  pthread_mutex_unlock(&log_mutex);
+}
+
+void audit_log_record(const char *userid, login_result_t result, ip4_addr_t client_ip,
+                      time_t login_time)
+{
+  if (!atomic_load_explicit(&log_open, memory_order_relaxed)) {
+    return;
+  }
+  event_t event;
+  memset(&event, 0, sizeof(event));
+  event.time = (int64_t) login_time;
+  event.ip = client_ip;
+  event.result = (uint8_t) result;
+  event.userid_len = (uint8_t) (userid ? strnlen(userid, USER_ID_LENGTH) : 0);
+  memcpy(event.userid, userid ? userid : "", event.userid_len);
+  uint32_t check = event_check(&event);
+
+  // a few tries, in case the segment fills and is replaced meanwhile
+  for (int attempt = 0; attempt < 4; attempt++) {
+    unsigned int side = enter_writer();
+    segment_t *seg = atomic_load(&current);
+    if (!seg) {
+      leave_writer(side);
+      break;
+    }
+    uint32_t slot;
+    if (claim.serial == seg->serial && claim.next < claim.end) {
+      slot = claim.next++;
+    }
+    else {
+      uint32_t capacity = seg->header->capacity;
+      uint32_t first = atomic_fetch_add(&seg->header->claimed, CLAIM_SLOTS);
+      if (first >= capacity) {
+        uint64_t serial = seg->serial;
+        leave_writer(side);
+        rotate(serial);
+        continue;
+      }
+      claim.serial = seg->serial;
+      claim.next = first + 1;
+      claim.end = capacity - first < CLAIM_SLOTS ? capacity : first + CLAIM_SLOTS;
+      slot = first;
+    }
+    event_t *dest = &seg->events[slot];
+    memcpy(dest, &event, offsetof(event_t, check));
+    atomic_store_explicit(&dest->check, check, memory_order_release);
+    leave_writer(side);
+    atomic_fetch_add_explicit(&appended, 1, memory_order_relaxed);
+    return;
+  }
+  atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+}
+
+static int compare_sequences(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Lists the sequence numbers of the segments in dir, in order, into a
+ * malloc()ed array. Returns false if dir cannot be read.
+ */
+static bool list_segments(const char *dir, uint64_t **sequences, size_t *count)
+{
+  *sequences = NULL;
+  *count = 0;
+  DIR *d = opendir(dir);
+  if (!d) {
+    return false;
+  }
+  size_t allocated = 0;
+  bool ok = true;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    uint64_t sequence;
+    char rest[2];
+    if (strlen(entry->d_name) != SEGMENT_NAME_LENGTH
+        || sscanf(entry->d_name, "audit-%16" SCNx64 ".se%1s", &sequence, rest) != 2
+        || rest[0] != 'g') {
+      continue;
+    }
+    if (*count == allocated) {
+      allocated = allocated ? 2 * allocated : 64;
+      uint64_t *grown = realloc(*sequences, allocated * sizeof(**sequences));
+      if (!grown) {
+        ok = false;
+        break;
+      }
+      *sequences = grown;
+    }
+    (*sequences)[(*count)++] = sequence;
+  }
+  closedir(d);
+  if (!ok) {
+    free(*sequences);
+    *sequences = NULL;
+    *count = 0;
+    return false;
+  }
+  if (*count > 0) {
+    qsort(*sequences, *count, sizeof(**sequences), compare_sequences);
+  }
+  return true;
+}
+
+size_t audit_log_expire(const char *dir, time_t before)
+{
+  uint64_t *sequences;
+  size_t count;
+  size_t deleted = 0;
+  if (!dir || !list_segments(dir, &sequences, &count)) {
+    return 0;
+  }
+  for (size_t i = 0; i < count; i++) {
+    char path[MAX_PATH_LENGTH];
+    segment_t *seg = segment_path(path, dir, sequences[i]) ? map_segment(path, false) : NULL;
+    if (!seg) {
+      continue;
+    }
+    bool old = atomic_load(&seg->header->sealed) && seg->header->max_time < (int64_t) before;
+    unmap_segment(seg);
+    if (old && unlink(path) == 0) {
+      deleted++;
+    }
+  }
+  free(sequences);
+  atomic_fetch_add(&expired, deleted);
+  return deleted;
+}
+
+/**
+ * Seals the segments in the log directory that a crash left unsealed, and
+ * sets next_sequence past the last. Caller holds log_mutex.
+ */
+static bool recover_segments(void)
+{
+  uint64_t *sequences;
+  size_t count;
+  if (!list_segments(log_dir, &sequences, &count)) {
+    log_message(LOG_ERROR, "Cannot read audit log directory %s: %s", log_dir, strerror(errno));
+    return false;
+  }
+  next_sequence = count ? sequences[count - 1] + 1 : 0;
+  for (size_t i = 0; i < count; i++) {
+    char path[MAX_PATH_LENGTH];
+    segment_t *seg = segment_path(path, log_dir, sequences[i]) ? map_segment(path, true) : NULL;
+    if (seg && !atomic_load(&seg->header->sealed)) {
+      log_message(LOG_INFO, "Sealing audit log segment %s", path);
+      seal_segment(seg);
+    }
+    else if (seg) {
+      unmap_segment(seg);
+    }
+  }
+  free(sequences);
+  return true;
+}
+
+bool audit_log_open(const char *dir, const audit_log_options_t *opts)
+{
+  uint32_t events = opts && opts->segment_events ? opts->segment_events
+                                                 : AUDIT_LOG_DEFAULT_SEGMENT_EVENTS;
+  if (!dir || strlen(dir) + 1 + SEGMENT_NAME_LENGTH >= MAX_PATH_LENGTH
+      || events > MAX_SEGMENT_EVENTS) {
+    log_message(LOG_ERROR, "Invalid audit log directory or segment size");
+    return false;
+  }
+  pthread_mutex_lock(&log_mutex);
+  if (atomic_load(&log_open)) {
+    pthread_mutex_unlock(&log_mutex);
+    log_message(LOG_ERROR, "The audit log is already open");
+    return false;
+  }
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+    pthread_mutex_unlock(&log_mutex);
+    log_message(LOG_ERROR, "Cannot create audit log directory %s: %s", dir, strerror(errno));
+    return false;
+  }
+  snprintf(log_dir, sizeof(log_dir), "%s", dir);
+  segment_events = events;
+  retention = opts && opts->retention ? opts->retention : AUDIT_LOG_DEFAULT_RETENTION;
+  segment_t *seg = NULL;
+  bool ok = recover_segments();
+  if (ok) {
+    audit_log_expire(log_dir, time(NULL) - retention);
+    seg = create_segment();
+    ok = seg != NULL;
+  }
+  if (ok) {
+    sealer_stop = false;
+    ok = pthread_create(&sealer, NULL, sealer_main, NULL) == 0;
+    if (!ok) {
+      log_message(LOG_ERROR, "Cannot start the audit log sealer thread");
+      char path[MAX_PATH_LENGTH];
+      if (segment_path(path, log_dir, next_sequence - 1)) {
+        unlink(path);
+      }
+      unmap_segment(seg);
+    }
+  }
+  if (ok) {
+    atomic_store(&current, seg);
+    atomic_store(&log_open, true);
+  }
+  pthread_mutex_unlock(&log_mutex);
+  return ok;
+}
+
+bool audit_log_close(void)
+{
+  pthread_mutex_lock(&log_mutex);
+  if (!atomic_load(&log_open)) {
+    pthread_mutex_unlock(&log_mutex);
+    return false;
+  }
+  atomic_store(&log_open, false);
+  segment_t *seg = atomic_load(&current);
+  atomic_store(&current, NULL);
+  drain_writers();
+  if (seg) {
+    queue_for_sealing(seg);
+  }
+  pthread_mutex_lock(&seal_mutex);
+  sealer_stop = true;
+  pthread_cond_signal(&seal_cond);
+  pthread_mutex_unlock(&seal_mutex);
+  pthread_join(sealer, NULL);
+  pthread_mutex_unlock(&log_mutex);
+  return true;
+}
+
+bool audit_log_is_open(void)
+{
+  return atomic_load(&log_open);
+}
+
+bool audit_log_sync(void)
+{
+  pthread_mutex_lock(&log_mutex);
+  segment_t *seg = atomic_load(&current);
+  bool ok = seg && msync(seg->header, seg->mapped, MS_SYNC) == 0;
+  pthread_mutex_unlock(&log_mutex);
+  return ok;
+}
+
+static bool event_matches(const event_t *event, const audit_query_t *q, size_t userid_len,
+                          uint32_t ip_mask)
+{
+  return (!q->userid
+          || (event->userid_len == userid_len && memcmp(event->userid, q->userid, userid_len) == 0))
+         && ((ntohl(event->ip) ^ ntohl(q->ip)) & ip_mask) == 0
+         && (q->from == 0 || event->time >= (int64_t) q->from)
+         && (q->to == 0 || event->time <= (int64_t) q->to);
+}
+
+static int compare_slots(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a;
+  uint32_t y = *(const uint32_t *) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * The first of n sorted postings with a key of at least key: the fence
+ * narrows the search to one stretch of AUDIT_LOG_FENCE_STRIDE postings.
+ */
+static size_t lower_bound(const posting_t *postings, const uint32_t *fence, size_t n, uint32_t key)
+{
+  size_t lo = 0;
+  size_t hi = fence_count(n);
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (fence[mid] < key) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  size_t i = lo ? (lo - 1) * AUDIT_LOG_FENCE_STRIDE : 0;
+  while (i < n && postings[i].key < key) {
+    i++;
+  }
+  return i;
+}
+
+/**
+ * The slots of the events in a sealed segment with keys from lo to hi in
+ * the userid (by_ip false) or IP index, in order, as a malloc()ed array.
+ * Returns false if memory runs out.
+ */
+static bool index_slots(const segment_t *seg, bool by_ip, uint32_t lo, uint32_t hi,
+                        uint32_t **slots, size_t *count)
+{
+  const unsigned char *index = (const unsigned char *) seg->header + seg->header->index_offset;
+  uint64_t n;
+  memcpy(&n, index, sizeof(n));
+  const posting_t *postings = (const posting_t *) (index + sizeof(uint64_t)) + (by_ip ? n : 0);
+  const uint32_t *fence = (const uint32_t *) ((const posting_t *) (index + sizeof(uint64_t)) + 2 * n)
+                          + (by_ip ? fence_count(n) : 0);
+  size_t first = lower_bound(postings, fence, n, lo);
+  size_t last = first;
+  while (last < n && postings[last].key <= hi) {
+    last++;
+  }
+  *count = last - first;
+  *slots = malloc((*count ? *count : 1) * sizeof(**slots));
+  if (!*slots) {
+    return false;
+  }
+  for (size_t i = first; i < last; i++) {
+    (*slots)[i - first] = postings[i].slot;
+  }
+  qsort(*slots, *count, sizeof(**slots), compare_slots);
+  return true;
+}
+
+/**
+ * Whether a sealed segment's index is intact, so that queries can use it.
+ */
+static bool index_is_usable(const segment_t *seg)
+{
+  const segment_header_t *h = seg->header;
+  if (!atomic_load(&h->sealed) || h->index_offset < slots_size(h->capacity)
+      || h->index_offset > seg->mapped || seg->mapped - h->index_offset < h->index_bytes
+      || h->index_bytes != index_size(h->events)) {
+    return false;
+  }
+  return crc32_compute((const char *) h + h->index_offset, h->index_bytes) == h->index_crc;
+}
+
+/**
+ * Runs query over one segment, through its index if it has one that
+ * helps. Returns false if fn stopped the walk.
+ */
+static bool query_segment(const segment_t *seg, const audit_query_t *q, audit_log_visit_fn fn,
+                          void *arg)
+{
+  const segment_header_t *h = seg->header;
+  size_t userid_len = q->userid ? strnlen(q->userid, USER_ID_LENGTH + 1) : 0;
+  uint32_t ip_mask = q->ip_prefix_len ? UINT32_MAX << (32 - q->ip_prefix_len) : 0;
+  uint32_t *slots = NULL;
+  size_t count = h->capacity;
+  if (userid_len > USER_ID_LENGTH) {
+    return true;
+  }
+  if (index_is_usable(seg)) {
+    if (h->events == 0 || (q->from && h->max_time < (int64_t) q->from)
+        || (q->to && h->min_time > (int64_t) q->to)) {
+      return true;
+    }
+    bool indexed = true;
+    if (q->userid) {
+      uint32_t key = userid_key(q->userid, userid_len);
+      indexed = index_slots(seg, false, key, key, &slots, &count);
+    }
+    else if (q->ip_prefix_len) {
+      uint32_t lo = ntohl(q->ip) & ip_mask;
+      indexed = index_slots(seg, true, lo, lo | ~ip_mask, &slots, &count);
+    }
+    if (!indexed) {
+      // out of memory: scan instead
+      count = h->capacity;
+    }
+  }
+  else {
+    uint32_t claimed = atomic_load(&h->claimed);
+    count = claimed < h->capacity ? claimed : h->capacity;
+  }
+
+  bool more = true;
+  for (size_t i = 0; i < count && more; i++) {
+    const event_t *event = &seg->events[slots ? slots[i] : i];
+    if (!event_is_valid(event) || !event_matches(event, q, userid_len, ip_mask)) {
+      continue;
+    }
+    audit_event_t found = {
+      .time = (time_t) event->time, .ip = event->ip, .result = (login_result_t) event->result
+    };
+    memcpy(found.userid, event->userid, event->userid_len);
+    found.userid[event->userid_len] = '\0';
+    more = fn(&found, arg);
+  }
+  free(slots);
+  return more;
+}
+
+bool audit_log_query(const char *dir, const audit_query_t *query, audit_log_visit_fn fn,
+                     void *arg)
+{
+  uint64_t *sequences;
+  size_t count;
+  if (!dir || !query || !fn || query->ip_prefix_len > 32
+      || strlen(dir) + 1 + SEGMENT_NAME_LENGTH >= MAX_PATH_LENGTH
+      || !list_segments(dir, &sequences, &count)) {
+    return false;
+  }
+  bool more = true;
+  for (size_t i = 0; i < count && more; i++) {
+    char path[MAX_PATH_LENGTH];
+    segment_t *seg = segment_path(path, dir, sequences[i]) ? map_segment(path, false) : NULL;
+    if (seg) {
+      more = query_segment(seg, query, fn, arg);
+      unmap_segment(seg);
+    }
+  }
+  free(sequences);
+  return more;
+}
+
+void audit_log_get_stats(audit_log_stats_t *stats)
+{
+  if (!stats) {
+    return;
+  }
+  stats->appended = atomic_load(&appended);
+  stats->dropped = atomic_load(&dropped);
+  stats->sealed = atomic_load(&sealed);
+  stats->expired = atomic_load(&expired);
+}
+
+#ifdef AUDIT_LOG_MAIN
+
+#include "ip_index.h"
+#include "login_stats.h"
+
+typedef struct {
+  audit_event_t event;
+  size_t order;                      // found before those with a higher one
+} found_event_t;
+
+typedef struct {
+  found_event_t *events;
+  size_t count;
+  size_t cap;
+  bool out_of_memory;
+} found_events_t;
+
+static bool collect_event(const audit_event_t *event, void *arg)
+{
+  found_events_t *found = arg;
+  if (found->count == found->cap) {
+    size_t cap = found->cap ? found->cap * 2 : 1024;
+    found_event_t *events = realloc(found->events, cap * sizeof(*events));
+    if (!events) {
+      found->out_of_memory = true;
+      return false;
+    }
+    found->events = events;
+    found->cap = cap;
+  }
+  found->events[found->count] = (found_event_t) { *event, found->count };
+  found->count++;
+  return true;
+}
+
+/**
+ * Orders events by time, and those at the same time in the order found.
+ */
+static int compare_events(const void *a, const void *b)
+{
+  const found_event_t *x = a;
+  const found_event_t *y = b;
+  if (x->event.time != y->event.time) {
+    return (x->event.time > y->event.time) - (x->event.time < y->event.time);
+  }
+  return (x->order > y->order) - (x->order < y->order);
+}
+
+static void print_event(const audit_event_t *event)
+{
+  char when[32];
+  char ip[INET_ADDRSTRLEN];
+  struct tm tm;
+  struct in_addr addr = { .s_addr = event->ip };
+  strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&event->time, &tm));
+  inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+  dprintf(STDOUT_FILENO, "%s %s %s %s\n", when, ip, login_result_name(event->result),
+          event->userid);
+}
+
+/**
+ * Audit log query tool.
+ *
+ * Usage: app DIR [user USERID] [ip ADDRESS[/LEN]] [from TIME] [to TIME]
+ *
+ * Prints the login attempts in the audit log in DIR that match every
+ * condition given, oldest first, one per line: the time (UTC), client IP,
+ * result and userid. TIMEs are in seconds since the epoch.
+ */
+int main(int argc, char **argv)
+{
+  if (argc < 2 || argc % 2 != 0) {
+    dprintf(STDERR_FILENO,
+            "usage: %s DIR [user USERID] [ip ADDRESS[/LEN]] [from TIME] [to TIME]\n", argv[0]);
+    return 2;
+  }
+  audit_query_t query = { 0 };
+  for (int i = 2; i < argc; i += 2) {
+    if (strcmp(argv[i], "user") == 0) {
+      query.userid = argv[i + 1];
+    }
+    else if (strcmp(argv[i], "ip") == 0) {
+      if (!ip_index_parse_cidr(argv[i + 1], &query.ip, &query.ip_prefix_len)) {
+        dprintf(STDERR_FILENO, "%s: bad address %s\n", argv[0], argv[i + 1]);
+        return 2;
+      }
+    }
+    else if (strcmp(argv[i], "from") == 0) {
+      query.from = (time_t) strtoll(argv[i + 1], NULL, 10);
+    }
+    else if (strcmp(argv[i], "to") == 0) {
+      query.to = (time_t) strtoll(argv[i + 1], NULL, 10);
+    }
+    else {
+      dprintf(STDERR_FILENO, "%s: unknown condition %s\n", argv[0], argv[i]);
+      return 2;
+    }
+  }
+  // a query finds events in slot order, which threads claim in runs, so
+  // they are put in time order here
+  found_events_t found = { NULL, 0, 0, false };
+  if (!audit_log_query(argv[1], &query, collect_event, &found)) {
+    dprintf(STDERR_FILENO, "%s: %s %s\n", argv[0],
+            found.out_of_memory ? "out of memory reading" : "cannot read", argv[1]);
+    free(found.events);
+    return 1;
+  }
+  qsort(found.events, found.count, sizeof(*found.events), compare_events);
+  for (size_t i = 0; i < found.count; i++) {
+    print_event(&found.events[i].event);
+  }
+  free(found.events);
+  return 0;
+}
+
+#endif // AUDIT_LOG_MAIN
@@ -0,0 +1,110 @@
+#ifndef AUDIT_LOG_H
+#define AUDIT_LOG_H
+
+/**
+ * @file audit_log.h
+ * @brief Append-only binary audit log of login attempts, with indexed queries.
+ *
+ * While the log is open, every handle_login() appends one fixed-width
+ * event (userid, client IP, login time and result) to the current
+ * segment, a file of AUDIT_LOG_EVENT_SIZE-byte slots mapped into memory.
+ * Appending takes no lock: each thread claims a run of slots at a time
+ * with one atomic add, fills them in place and marks each complete with
+ * its CRC-32, written last. A slot with a wrong CRC (unused, or torn by a
+ * crash) is not an event, so readers skip it.
+ *
+ * A full segment is replaced by a fresh one and sealed in the background:
+ * its events get two indexes, by userid and by IP, each a sorted array of
+ * (key, slot) postings with a sparse fence of every AUDIT_LOG_FENCE_STRIDE
+ * th key, so that a lookup binary-searches the small fence and reads one
+ * stretch of postings. Sealing also records the segment's time range, so
+ * queries skip segments outside the window they ask for, and deletes
+ * segments whose events are all older than the retention period.
+ * Segments left unsealed by a crash are sealed when the log is next opened.
+ *
+ * Segment files are named audit-<sequence>.seg, in hex, so that their
+ * names sort in the order they were written. Their contents are in host
+ * byte order.
+ *
+ * Built with -DAUDIT_LOG_MAIN, audit_log.c has a main() that queries a log
+ * directory (see README.md).
+ */
+
+#include "account.h"
+#include "login.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define AUDIT_LOG_EVENT_SIZE 128
+#define AUDIT_LOG_DEFAULT_SEGMENT_EVENTS 65536
+#define AUDIT_LOG_DEFAULT_RETENTION (90 * 24 * 60 * 60)
+#define AUDIT_LOG_FENCE_STRIDE 64
+
+typedef struct {
+  uint32_t segment_events;     // slots per segment (0 = AUDIT_LOG_DEFAULT_SEGMENT_EVENTS)
+  time_t retention;            // seconds events are kept (0 = AUDIT_LOG_DEFAULT_RETENTION)
+} audit_log_options_t;
+
+typedef struct {
+  time_t time;
+  ip4_addr_t ip;
+  login_result_t result;
+  char userid[USER_ID_LENGTH + 1];  // null-terminated
+} audit_event_t;
+
+typedef struct {
+  const char *userid;          // only this user's events (NULL = anyone's)
+  ip4_addr_t ip;               // only events from ip/ip_prefix_len
+  unsigned int ip_prefix_len;  // (0 = from anywhere)
+  time_t from;                 // only events at or after from (0 = any)
+  time_t to;                   // and at or before to (0 = any)
+} audit_query_t;
+
+typedef struct {
+  uint64_t appended;
+  uint64_t dropped;            // not appended: the log could not take them
+  uint64_t sealed;             // segments sealed
+  uint64_t expired;            // segments deleted after the retention period
+} audit_log_stats_t;
+
+// called for each event a query finds, segment by segment, in the order of
+// their slots. threads claim slots in runs, so this is only roughly the
+// order of their times. return false to stop
+typedef bool (*audit_log_visit_fn)(const audit_event_t *event, void *arg);
+
+// start appending login attempts to segments in dir, creating it if need
+// be. opts may be NULL. returns false (after logging) if the log is already
+// open or dir cannot be used.
+bool audit_log_open(const char *dir, const audit_log_options_t *opts);
+
+// stop appending, seal the current segment and wait for sealing to
+// finish. returns false if the log was not open.
+bool audit_log_close(void);
+
+// whether the log is open
+bool audit_log_is_open(void);
+
+// append an event. does nothing if the log is not open. safe to call from
+// any thread.
+void audit_log_record(const char *userid, login_result_t result, ip4_addr_t client_ip,
+                      time_t login_time);
+
+// flush the current segment's events to disk
+bool audit_log_sync(void);
+
+// call fn for every event in the log in dir that matches query, whether
+// or not this process has the log open. returns false if fn stopped the
+// walk or dir cannot be read.
+bool audit_log_query(const char *dir, const audit_query_t *query, audit_log_visit_fn fn,
+                     void *arg);
+
+// delete the sealed segments in dir whose events all happened before
+// before. returns the number deleted.
+size_t audit_log_expire(const char *dir, time_t before);
+
+void audit_log_get_stats(audit_log_stats_t *stats);
+
+#endif // AUDIT_LOG_H
@@ -0,0 +1,51 @@
+#include "crc32.h"
+
+#include <pthread.h>
+
+#define POLYNOMIAL 0xedb88320u   // reflected 0x04c11db7
+
+// slicing-by-8: tables[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t tables[8][256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void init_tables(void)
+{
+  for (uint32_t b = 0; b < 256; b++) {
+    uint32_t crc = b;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (POLYNOMIAL & (0u - (crc & 1)));
+    }
+    tables[0][b] = crc;
+  }
+  for (uint32_t b = 0; b < 256; b++) {
+    for (int k = 1; k < 8; k++) {
+      tables[k][b] = (tables[k - 1][b] >> 8) ^ tables[0][tables[k - 1][b] & 0xff];
+    }
+  }
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+  pthread_once(&tables_once, init_tables);
+  const unsigned char *p = data;
+  crc = ~crc;
+  while (len >= 8) {
+    // assemble little-endian words by hand so this works on any byte order
+    uint32_t lo = crc ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16
+                         | (uint32_t) p[3] << 24);
+    crc = tables[7][lo & 0xff] ^ tables[6][(lo >> 8) & 0xff]
+          ^ tables[5][(lo >> 16) & 0xff] ^ tables[4][lo >> 24]
+          ^ tables[3][p[4]] ^ tables[2][p[5]] ^ tables[1][p[6]] ^ tables[0][p[7]];
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0) {
+    crc = (crc >> 8) ^ tables[0][(crc ^ *p++) & 0xff];
+  }
+  return ~crc;
+}
+
+uint32_t crc32_compute(const void *data, size_t len)
+{
+  return crc32_update(0, data, len);
+}
@@ -0,0 +1,19 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+/**
+ * @file crc32.h
+ * @brief CRC-32 (IEEE 802.3, as used by zlib and PNG) for on-disk formats.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the CRC of len bytes at data
+uint32_t crc32_compute(const void *data, size_t len);
+
+// continue a CRC: crc32_update(crc32_compute(a, n), b, m) is the CRC of a
+// followed by b. The CRC of nothing is 0.
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+#endif // CRC32_H
@@ -0,0 +1,96 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "db_backend.h"
+#include "account_cache.h"
+#include "account_store.h"
+#include "db.h"
+
+#include <pthread.h>
+#include <stddef.h>
+
+static pthread_rwlock_t backend_lock = PTHREAD_RWLOCK_INITIALIZER;
+static db_backend_t backend;
+static bool backend_set = false;
+
+/**
+ * The default backend: the in-memory account store, then db.h.
+ */
+static bool default_lookup(const userid_key_t *key, account_t *acc)
+{
+  return account_store_lookup_key(key, acc) || account_lookup_by_userid(key->str, acc);
+}
+
+static bool keep_login_counters(account_t *stored, void *arg)
+{
+  const account_t *acc = arg;
+  stored->login_count = acc->login_count;
+  stored->login_fail_count = acc->login_fail_count;
+  stored->last_login_time = acc->last_login_time;
+  stored->last_ip = acc->last_ip;
+  return true;
+}
+
+void db_backend_set(const db_backend_t *new_backend)
+{
+  pthread_rwlock_wrlock(&backend_lock);
+  backend_set = new_backend != NULL && new_backend->lookup != NULL;
+  if (backend_set) {
+    backend = *new_backend;
+  }
+  pthread_rwlock_unlock(&backend_lock);
+}
+
+bool db_backend_lookup(const char *userid, account_t *acc)
+{
+  userid_key_t key;
+  return userid_key_init(&key, userid) && db_backend_lookup_key(&key, acc);
+}
+
+bool db_backend_lookup_key(const userid_key_t *key, account_t *acc)
+{
+  pthread_rwlock_rdlock(&backend_lock);
+  bool found = backend_set ? backend.lookup(backend.arg, key, acc) : default_lookup(key, acc);
+  pthread_rwlock_unlock(&backend_lock);
+  return found;
+}
+
+void db_backend_lookup_async(const userid_key_t *key, account_t *acc, db_lookup_done_fn done,
+                             void *ctx)
+{
+  pthread_rwlock_rdlock(&backend_lock);
+  if (backend_set && backend.lookup_async) {
+    backend.lookup_async(backend.arg, key, acc, done, ctx);
+    pthread_rwlock_unlock(&backend_lock);
+    return;
+  }
+  bool found = backend_set ? backend.lookup(backend.arg, key, acc) : default_lookup(key, acc);
+  pthread_rwlock_unlock(&backend_lock);
+  done(ctx, found);
+}
+
+bool db_backend_foreach_userid(db_userid_fn fn, void *ctx)
+{
+  pthread_rwlock_rdlock(&backend_lock);
+  // the default backend falls back to db.h, which cannot be listed
+  bool complete = backend_set && backend.foreach_userid &&
+                  backend.foreach_userid(backend.arg, fn, ctx);
+  pthread_rwlock_unlock(&backend_lock);
+  return complete;
+}
+
+void db_backend_record_login(const account_t *acc)
+{
+  pthread_rwlock_rdlock(&backend_lock);
+  if (backend_set && acc) {
+    if (backend.record_login) {
+      backend.record_login(backend.arg, acc);
+    }
+    // the store invalidates its accounts as it changes them; others don't
+    account_cache_invalidate(acc->userid);
+  }
+  else if (acc) {
+    // db.h accounts have nowhere to keep counters; only stored ones do
+    account_store_modify(acc->userid, keep_login_counters, (void *) acc);
+  }
+  pthread_rwlock_unlock(&backend_lock);
+}
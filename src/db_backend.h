@@ -0,0 +1,74 @@
+#ifndef DB_BACKEND_H
+#define DB_BACKEND_H
+
+/**
+ * @file db_backend.h
+ * @brief Pluggable account database behind the db.h interface.
+ *
+ * By default accounts are looked up in the in-memory account store (see
+ * account_store.h), then, failing that, with account_lookup_by_userid()
+ * from db.h. Another backend (e.g. db_sqlite.h) can be installed at run time;
+ * lookups in progress finish against the old one. A backend can also take
+ * the login counters handle_login() records, to write them back, and list
+ * the user IDs it holds, for userid_filter.h.
+ *
+ * A backend whose lookups involve a round trip (a remote database, say)
+ * can also look accounts up asynchronously, letting one thread keep many
+ * lookups in flight (see login_async.h). Such a backend must complete
+ * every lookup it has started, even after it has been replaced.
+ */
+
+#include "account.h"
+#include "userid_key.h"
+
+#include <stdbool.h>
+
+// called once an asynchronous lookup has filled in acc (found) or not
+typedef void (*db_lookup_done_fn)(void *ctx, bool found);
+
+// called with each userid a backend holds; return false to stop early
+typedef bool (*db_userid_fn)(const char *userid, void *ctx);
+
+typedef struct {
+  // as account_lookup_by_userid(), for key->str
+  bool (*lookup)(void *arg, const userid_key_t *key, account_t *acc);
+  // persist acc's login counters after a login attempt (NULL = don't)
+  void (*record_login)(void *arg, const account_t *acc);
+  // start looking key up, calling done(ctx, found) once acc is filled in,
+  // from any thread and possibly before returning (NULL = lookups are
+  // synchronous only)
+  void (*lookup_async)(void *arg, const userid_key_t *key, account_t *acc,
+                       db_lookup_done_fn done, void *ctx);
+  // call fn(userid, ctx) for every account the backend holds, returning
+  // false if they could not all be listed (NULL = the backend cannot list
+  // its accounts)
+  bool (*foreach_userid)(void *arg, db_userid_fn fn, void *ctx);
+  void *arg;
+} db_backend_t;
+
+// use backend (copied) for lookups from now on; NULL restores the default
+void db_backend_set(const db_backend_t *backend);
+
+// look userid up in the current backend
+bool db_backend_lookup(const char *userid, account_t *acc);
+
+// as db_backend_lookup(), for a userid already made into a key
+bool db_backend_lookup_key(const userid_key_t *key, account_t *acc);
+
+// look key up in the current backend, asynchronously if it can, else
+// synchronously before returning, then call done(ctx, found). key and acc
+// must stay valid until done is called.
+void db_backend_lookup_async(const userid_key_t *key, account_t *acc, db_lookup_done_fn done,
+                             void *ctx);
+
+// call fn(userid, ctx) for every account in the current backend. returns
+// false if the backend cannot list them all (as the default one cannot,
+// since it falls back to db.h), or if fn stopped the walk.
+bool db_backend_foreach_userid(db_userid_fn fn, void *ctx);
+
+// pass acc's login counters to the current backend, if it keeps them (the
+// default backend writes them back to the account store), and drop any
+// cached copy of the account
+void db_backend_record_login(const account_t *acc);
+
+#endif // DB_BACKEND_H
@@ -0,0 +1,267 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "db_sim.h"
+#include "account_store.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+  uint64_t due_ns;
+  const userid_key_t *key;
+  account_t *acc;
+  db_lookup_done_fn done;
+  void *ctx;
+} pending_t;
+
+struct db_sim {
+  unsigned int latency_us;
+  unsigned int jitter_us;
+  _Atomic uint64_t sequence;   // drives the jitter
+  _Atomic uint64_t lookups;
+  _Atomic uint64_t async_lookups;
+
+  pthread_mutex_t mutex;       // protects everything below
+  pthread_cond_t wake;         // the earliest lookup changed, or stopping
+  pending_t *heap;             // min-heap by due_ns
+  size_t count;
+  size_t capacity;
+  size_t max_in_flight;
+  bool stopping;
+  pthread_t timer;
+};
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Nanoseconds until a lookup made now completes.
+ */
+static uint64_t delay_ns(db_sim_t *sim)
+{
+  uint64_t delay = (uint64_t) sim->latency_us * 1000u;
+  if (sim->jitter_us) {
+    // splitmix64 of a counter: cheap, and uniform enough for a benchmark
+    uint64_t z = atomic_fetch_add_explicit(&sim->sequence, 1, memory_order_relaxed)
+                 + UINT64_C(0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    z ^= z >> 31;
+    delay += z % ((uint64_t) sim->jitter_us * 1000u + 1);
+  }
+  return delay;
+}
+
+static void heap_push(db_sim_t *sim, pending_t item)
+{
+  size_t i = sim->count++;
+  while (i > 0 && sim->heap[(i - 1) / 2].due_ns > item.due_ns) {
+    sim->heap[i] = sim->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  sim->heap[i] = item;
+}
+
+static pending_t heap_pop(db_sim_t *sim)
+{
+  pending_t top = sim->heap[0];
+  pending_t last = sim->heap[--sim->count];
+  size_t i = 0;
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= sim->count) {
+      break;
+    }
+    if (child + 1 < sim->count && sim->heap[child + 1].due_ns < sim->heap[child].due_ns) {
+      child++;
+    }
+    if (sim->heap[child].due_ns >= last.due_ns) {
+      break;
+    }
+    sim->heap[i] = sim->heap[child];
+    i = child;
+  }
+  if (sim->count > 0) {
+    sim->heap[i] = last;
+  }
+  return top;
+}
+
+/**
+ * Completes asynchronous lookups as they fall due; once stopping, completes
+ * the rest without waiting and exits.
+ */
+static void *timer_main(void *arg)
+{
+  db_sim_t *sim = arg;
+  pthread_mutex_lock(&sim->mutex);
+  for (;;) {
+    if (sim->count == 0) {
+      if (sim->stopping) {
+        break;
+      }
+      pthread_cond_wait(&sim->wake, &sim->mutex);
+      continue;
+    }
+    uint64_t due = sim->heap[0].due_ns;
+    if (!sim->stopping && due > now_ns()) {
+      struct timespec deadline = {
+        .tv_sec = (time_t) (due / 1000000000u), .tv_nsec = (long) (due % 1000000000u)
+      };
+      pthread_cond_timedwait(&sim->wake, &sim->mutex, &deadline);
+      continue;
+    }
+    pending_t item = heap_pop(sim);
+    pthread_mutex_unlock(&sim->mutex);
+    bool found = account_store_lookup_key(item.key, item.acc);
+    item.done(item.ctx, found);
+    pthread_mutex_lock(&sim->mutex);
+  }
+  pthread_mutex_unlock(&sim->mutex);
+  return NULL;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+  struct timespec ts = { .tv_sec = (time_t) (ns / 1000000000u), .tv_nsec = (long) (ns % 1000000000u) };
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    continue;
+  }
+}
+
+static bool sim_lookup(void *arg, const userid_key_t *key, account_t *acc)
+{
+  db_sim_t *sim = arg;
+  atomic_fetch_add_explicit(&sim->lookups, 1, memory_order_relaxed);
+  sleep_ns(delay_ns(sim));
+  return account_store_lookup_key(key, acc);
+}
+
+static void sim_lookup_async(void *arg, const userid_key_t *key, account_t *acc,
+                             db_lookup_done_fn done, void *ctx)
+{
+  db_sim_t *sim = arg;
+  atomic_fetch_add_explicit(&sim->async_lookups, 1, memory_order_relaxed);
+  pending_t item = { .due_ns = now_ns() + delay_ns(sim), .key = key, .acc = acc,
+                     .done = done, .ctx = ctx };
+
+  pthread_mutex_lock(&sim->mutex);
+  if (sim->count == sim->capacity) {
+    size_t capacity = sim->capacity ? sim->capacity * 2 : 64;
+    pending_t *heap = realloc(sim->heap, capacity * sizeof(*heap));
+    if (!heap) {
+      pthread_mutex_unlock(&sim->mutex);
+      log_message(LOG_ERROR, "Memory allocation for simulated lookup has failed");
+      // complete it now rather than lose it
+      done(ctx, account_store_lookup_key(key, acc));
+      return;
+    }
+    sim->heap = heap;
+    sim->capacity = capacity;
+  }
+  heap_push(sim, item);
+  if (sim->count > sim->max_in_flight) {
+    sim->max_in_flight = sim->count;
+  }
+  // only a new earliest lookup changes how long the timer must sleep
+  if (sim->heap[0].due_ns == item.due_ns) {
+    pthread_cond_signal(&sim->wake);
+  }
+  pthread_mutex_unlock(&sim->mutex);
+}
+
+db_sim_t *db_sim_create(const db_sim_options_t *opts)
+{
+  db_sim_t *sim = calloc(1, sizeof(*sim));
+  if (!sim) {
+    log_message(LOG_ERROR, "Memory allocation for simulated backend has failed");
+    return NULL;
+  }
+  if (opts) {
+    sim->latency_us = opts->latency_us;
+    sim->jitter_us = opts->jitter_us;
+  }
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&sim->mutex, NULL);
+  pthread_cond_init(&sim->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  int err = pthread_create(&sim->timer, NULL, timer_main, sim);
+  if (err != 0) {
+    log_message(LOG_ERROR, "Failed to start simulated backend timer: %s", strerror(err));
+    pthread_cond_destroy(&sim->wake);
+    pthread_mutex_destroy(&sim->mutex);
+    free(sim);
+    return NULL;
+  }
+  return sim;
+}
+
+void db_sim_destroy(db_sim_t *sim)
+{
+  if (!sim) {
+    return;
+  }
+  pthread_mutex_lock(&sim->mutex);
+  sim->stopping = true;
+  pthread_cond_signal(&sim->wake);
+  pthread_mutex_unlock(&sim->mutex);
+  pthread_join(sim->timer, NULL);
+  pthread_cond_destroy(&sim->wake);
+  pthread_mutex_destroy(&sim->mutex);
+  free(sim->heap);
+  free(sim);
+}
+
+typedef struct {
+  db_userid_fn fn;
+  void *ctx;
+} userid_walk_t;
+
+static bool userid_visit(const account_t *acc, void *arg)
+{
+  userid_walk_t *walk = arg;
+  return walk->fn(acc->userid, walk->ctx);
+}
+
+static bool sim_foreach_userid(void *arg, db_userid_fn fn, void *ctx)
+{
+  (void) arg;
+  userid_walk_t walk = { fn, ctx };
+  return account_store_foreach(userid_visit, &walk);
+}
+
+void db_sim_backend(db_sim_t *sim, db_backend_t *backend)
+{
+  if (backend) {
+    backend->lookup = sim_lookup;
+    backend->record_login = NULL;
+    backend->lookup_async = sim_lookup_async;
+    backend->foreach_userid = sim_foreach_userid;
+    backend->arg = sim;
+  }
+}
+
+void db_sim_get_stats(db_sim_t *sim, db_sim_stats_t *stats)
+{
+  if (!sim || !stats) {
+    return;
+  }
+  stats->lookups = atomic_load(&sim->lookups);
+  stats->async_lookups = atomic_load(&sim->async_lookups);
+  pthread_mutex_lock(&sim->mutex);
+  stats->in_flight = sim->count;
+  stats->max_in_flight = sim->max_in_flight;
+  pthread_mutex_unlock(&sim->mutex);
+}
@@ -0,0 +1,54 @@
+#ifndef DB_SIM_H
+#define DB_SIM_H
+
+/**
+ * @file db_sim.h
+ * @brief Account backend with simulated latency, for benchmarking.
+ *
+ * Serves accounts from the account store (see account_store.h), but only
+ * after a delay standing in for the round trip to a remote database:
+ * latency_us, plus up to jitter_us more chosen at random per lookup.
+ * Synchronous lookups sleep through the delay. Asynchronous lookups are
+ * queued by when they fall due and completed by a timer thread, so any
+ * number can be in flight at once, as over a pipelined connection.
+ *
+ * Install it as the backend like any other:
+ *
+ *   db_backend_t backend;
+ *   db_sim_backend(sim, &backend);
+ *   db_backend_set(&backend);
+ */
+
+#include "db_backend.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct db_sim db_sim_t;
+
+typedef struct {
+  unsigned int latency_us;   // delay before every lookup completes
+  unsigned int jitter_us;    // up to this much more, uniformly at random
+} db_sim_options_t;
+
+typedef struct {
+  uint64_t lookups;          // synchronous
+  uint64_t async_lookups;
+  size_t in_flight;          // asynchronous lookups not yet completed
+  size_t max_in_flight;
+} db_sim_stats_t;
+
+// start a simulated backend. opts may be NULL for no delay. returns NULL
+// (after logging) on failure.
+db_sim_t *db_sim_create(const db_sim_options_t *opts);
+
+// complete the lookups still in flight, then stop. NULL is ignored. sim
+// must no longer be the installed backend.
+void db_sim_destroy(db_sim_t *sim);
+
+// fill in backend to look accounts up through sim
+void db_sim_backend(db_sim_t *sim, db_backend_t *backend);
+
+void db_sim_get_stats(db_sim_t *sim, db_sim_stats_t *stats);
+
+#endif // DB_SIM_H
@@ -0,0 +1,656 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "db_sqlite.h"
+#include "logging.h"
+#include "thread_pool.h"
+#include "userid_filter.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BUSY_TIMEOUT_MS 5000
+
+static const char *const schema_sql =
+  "CREATE TABLE IF NOT EXISTS accounts ("
+  " userid TEXT PRIMARY KEY NOT NULL,"
+  " account_id INTEGER NOT NULL,"
+  " password_hash TEXT NOT NULL,"
+  " email TEXT NOT NULL,"
+  " birthdate TEXT NOT NULL,"
+  " unban_time INTEGER NOT NULL DEFAULT 0,"
+  " expiration_time INTEGER NOT NULL DEFAULT 0,"
+  " login_count INTEGER NOT NULL DEFAULT 0,"
+  " login_fail_count INTEGER NOT NULL DEFAULT 0,"
+  " last_login_time INTEGER NOT NULL DEFAULT 0,"
+  " last_ip INTEGER NOT NULL DEFAULT 0"
+  ") WITHOUT ROWID";
+
+static const char *const lookup_sql =
+  "SELECT account_id, password_hash, email, birthdate, unban_time, expiration_time,"
+  " login_count, login_fail_count, last_login_time, last_ip"
+  " FROM accounts WHERE userid = ?1";
+
+static const char *const insert_sql =
+  "INSERT OR REPLACE INTO accounts (userid, account_id, password_hash, email, birthdate,"
+  " unban_time, expiration_time, login_count, login_fail_count, last_login_time, last_ip)"
+  " VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11)";
+
+static const char *const update_login_sql =
+  "UPDATE accounts SET login_count = ?2, login_fail_count = ?3, last_login_time = ?4,"
+  " last_ip = ?5 WHERE userid = ?1";
+
+static const char *const count_sql = "SELECT count(*) FROM accounts";
+
+static const char *const userids_sql = "SELECT userid FROM accounts";
+
+typedef struct {
+  sqlite3 *db;
+  sqlite3_stmt *lookup;
+  sqlite3_stmt *insert;
+  sqlite3_stmt *update_login;
+  sqlite3_stmt *count;
+} db_conn_t;
+
+typedef struct {
+  char userid[USER_ID_LENGTH];
+  unsigned int login_count;
+  unsigned int login_fail_count;
+  time_t last_login_time;
+  ip4_addr_t last_ip;
+} login_update_t;
+
+typedef struct {
+  login_update_t *items;
+  size_t count;
+  size_t cap;
+} update_list_t;
+
+struct db_sqlite {
+  db_conn_t *conns;
+  unsigned int nconns;
+  db_conn_t **idle;               // connections not in use
+  unsigned int nidle;
+  pthread_mutex_t pool_mutex;
+  pthread_cond_t pool_available;
+
+  unsigned int batch_size;
+  pthread_mutex_t pending_mutex;
+  update_list_t pending;          // guarded by pending_mutex
+  pthread_mutex_t flush_mutex;    // one batch written at a time
+  update_list_t writing;          // being written; count guarded by pending_mutex
+
+  unsigned int flush_interval_ms;
+  pthread_t flusher;
+  bool flusher_started;
+  pthread_mutex_t flusher_mutex;
+  pthread_cond_t flusher_wake;
+  bool flusher_stop;              // guarded by flusher_mutex
+
+  _Atomic uint64_t lookups;
+  _Atomic uint64_t found;
+  _Atomic uint64_t logins_recorded;
+  _Atomic uint64_t logins_written;
+  _Atomic uint64_t batches_written;
+  _Atomic uint64_t pool_waits;
+};
+
+static bool exec_sql(sqlite3 *db, const char *sql)
+{
+  char *error = NULL;
+  if (sqlite3_exec(db, sql, NULL, NULL, &error) != SQLITE_OK) {
+    log_message(LOG_ERROR, "SQLite: %s failed: %s", sql, error ? error : sqlite3_errmsg(db));
+    sqlite3_free(error);
+    return false;
+  }
+  return true;
+}
+
+static bool prepare(sqlite3 *db, const char *sql, sqlite3_stmt **stmt)
+{
+  if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL) != SQLITE_OK) {
+    log_message(LOG_ERROR, "SQLite: preparing \"%s\" failed: %s", sql, sqlite3_errmsg(db));
+    return false;
+  }
+  return true;
+}
+
+static void close_conn(db_conn_t *conn)
+{
+  sqlite3_finalize(conn->lookup);
+  sqlite3_finalize(conn->insert);
+  sqlite3_finalize(conn->update_login);
+  sqlite3_finalize(conn->count);
+  sqlite3_close(conn->db);
+  memset(conn, 0, sizeof(*conn));
+}
+
+/**
+ * Opens one pooled connection; the first also sets up the database.
+ */
+static bool open_conn(db_conn_t *conn, const char *path, bool first)
+{
+  memset(conn, 0, sizeof(*conn));
+  // each connection is used by one thread at a time, so needs no mutex
+  int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX;
+  if (sqlite3_open_v2(path, &conn->db, flags, NULL) != SQLITE_OK) {
+    log_message(LOG_ERROR, "SQLite: failed to open %s: %s", path,
+                conn->db ? sqlite3_errmsg(conn->db) : "out of memory");
+    sqlite3_close(conn->db);
+    conn->db = NULL;
+    return false;
+  }
+  sqlite3_busy_timeout(conn->db, BUSY_TIMEOUT_MS);
+  bool ok = (!first || (exec_sql(conn->db, "PRAGMA journal_mode=WAL")
+                        && exec_sql(conn->db, schema_sql)))
+            && exec_sql(conn->db, "PRAGMA synchronous=NORMAL")
+            && prepare(conn->db, lookup_sql, &conn->lookup)
+            && prepare(conn->db, insert_sql, &conn->insert)
+            && prepare(conn->db, update_login_sql, &conn->update_login)
+            && prepare(conn->db, count_sql, &conn->count);
+  if (!ok) {
+    close_conn(conn);
+  }
+  return ok;
+}
+
+static db_conn_t *acquire(db_sqlite_t *db)
+{
+  pthread_mutex_lock(&db->pool_mutex);
+  if (db->nidle == 0) {
+    atomic_fetch_add_explicit(&db->pool_waits, 1, memory_order_relaxed);
+    while (db->nidle == 0) {
+      pthread_cond_wait(&db->pool_available, &db->pool_mutex);
+    }
+  }
+  db_conn_t *conn = db->idle[--db->nidle];
+  pthread_mutex_unlock(&db->pool_mutex);
+  return conn;
+}
+
+static void release(db_sqlite_t *db, db_conn_t *conn)
+{
+  pthread_mutex_lock(&db->pool_mutex);
+  db->idle[db->nidle++] = conn;
+  pthread_cond_signal(&db->pool_available);
+  pthread_mutex_unlock(&db->pool_mutex);
+}
+
+static void bind_userid(sqlite3_stmt *stmt, const char *userid)
+{
+  sqlite3_bind_text(stmt, 1, userid, (int) strnlen(userid, USER_ID_LENGTH), SQLITE_STATIC);
+}
+
+static void copy_text(sqlite3_stmt *stmt, int col, char *dest, size_t size)
+{
+  const unsigned char *text = sqlite3_column_text(stmt, col);
+  size_t len = text ? (size_t) sqlite3_column_bytes(stmt, col) : 0;
+  if (len > size - 1) {
+    len = size - 1;
+  }
+  memcpy(dest, text, len);
+  dest[len] = '\0';
+}
+
+static const login_update_t *find_update(const update_list_t *list, const userid_key_t *key)
+{
+  for (size_t i = list->count; i-- > 0;) {
+    if (userid_key_matches(key, list->items[i].userid)) {
+      return &list->items[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Finds the newest login update for key not yet committed. Checked
+ * before reading the row: an update no longer queued or being written by
+ * then has been committed, so the row read afterwards includes it.
+ */
+static bool find_unwritten_update(db_sqlite_t *db, const userid_key_t *key,
+                                  login_update_t *update)
+{
+  pthread_mutex_lock(&db->pending_mutex);
+  const login_update_t *found = find_update(&db->pending, key);
+  if (!found) {
+    found = find_update(&db->writing, key);
+  }
+  if (found) {
+    *update = *found;
+  }
+  pthread_mutex_unlock(&db->pending_mutex);
+  return found != NULL;
+}
+
+static void *flusher_main(void *arg)
+{
+  db_sqlite_t *db = arg;
+  pthread_mutex_lock(&db->flusher_mutex);
+  while (!db->flusher_stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += db->flush_interval_ms / 1000;
+    deadline.tv_nsec += (long) (db->flush_interval_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&db->flusher_wake, &db->flusher_mutex, &deadline);
+    if (!db->flusher_stop) {
+      pthread_mutex_unlock(&db->flusher_mutex);
+      db_sqlite_flush(db);
+      pthread_mutex_lock(&db->flusher_mutex);
+    }
+  }
+  pthread_mutex_unlock(&db->flusher_mutex);
+  return NULL;
+}
+
+db_sqlite_t *db_sqlite_open(const char *path, const db_sqlite_options_t *opts)
+{
+  if (!path) {
+    return NULL;
+  }
+  db_sqlite_options_t defaults = { 0 };
+  if (!opts) {
+    opts = &defaults;
+  }
+  db_sqlite_t *db = calloc(1, sizeof(*db));
+  unsigned int nconns = opts->connections ? opts->connections : thread_pool_cpu_count();
+  if (db) {
+    db->conns = calloc(nconns, sizeof(*db->conns));
+    db->idle = calloc(nconns, sizeof(*db->idle));
+  }
+  if (!db || !db->conns || !db->idle) {
+    log_message(LOG_ERROR, "Memory allocation for SQLite database has failed");
+    if (db) {
+      free(db->conns);
+      free(db->idle);
+      free(db);
+    }
+    return NULL;
+  }
+  for (unsigned int i = 0; i < nconns; i++) {
+    if (!open_conn(&db->conns[i], path, i == 0)) {
+      for (unsigned int j = 0; j < i; j++) {
+        close_conn(&db->conns[j]);
+      }
+      free(db->conns);
+      free(db->idle);
+      free(db);
+      return NULL;
+    }
+    db->idle[db->nidle++] = &db->conns[i];
+  }
+  db->nconns = nconns;
+  db->batch_size = opts->batch_size ? opts->batch_size : DB_SQLITE_DEFAULT_BATCH;
+  db->flush_interval_ms = opts->flush_interval_ms;
+  pthread_mutex_init(&db->pool_mutex, NULL);
+  pthread_cond_init(&db->pool_available, NULL);
+  pthread_mutex_init(&db->pending_mutex, NULL);
+  pthread_mutex_init(&db->flush_mutex, NULL);
+  pthread_mutex_init(&db->flusher_mutex, NULL);
+  pthread_cond_init(&db->flusher_wake, NULL);
+  if (db->flush_interval_ms > 0) {
+    db->flusher_started = pthread_create(&db->flusher, NULL, flusher_main, db) == 0;
+    if (!db->flusher_started) {
+      log_message(LOG_WARN, "SQLite: failed to start flusher thread; "
+                  "login updates will be written in batches only");
+    }
+  }
+  return db;
+}
+
+bool db_sqlite_close(db_sqlite_t *db)
+{
+  if (!db) {
+    return true;
+  }
+  if (db->flusher_started) {
+    pthread_mutex_lock(&db->flusher_mutex);
+    db->flusher_stop = true;
+    pthread_cond_signal(&db->flusher_wake);
+    pthread_mutex_unlock(&db->flusher_mutex);
+    pthread_join(db->flusher, NULL);
+  }
+  bool ok = db_sqlite_flush(db);
+  for (unsigned int i = 0; i < db->nconns; i++) {
+    close_conn(&db->conns[i]);
+  }
+  pthread_mutex_destroy(&db->pool_mutex);
+  pthread_cond_destroy(&db->pool_available);
+  pthread_mutex_destroy(&db->pending_mutex);
+  pthread_mutex_destroy(&db->flush_mutex);
+  pthread_mutex_destroy(&db->flusher_mutex);
+  pthread_cond_destroy(&db->flusher_wake);
+  free(db->pending.items);
+  free(db->writing.items);
+  free(db->conns);
+  free(db->idle);
+  free(db);
+  return ok;
+}
+
+static bool lookup_key(db_sqlite_t *db, const userid_key_t *key, account_t *acc)
+{
+  atomic_fetch_add_explicit(&db->lookups, 1, memory_order_relaxed);
+  // logins recorded but not yet written take precedence over the row, so
+  // that a login is never counted from stale counters
+  login_update_t update = { 0 };
+  bool updated = find_unwritten_update(db, key, &update);
+  db_conn_t *conn = acquire(db);
+  sqlite3_stmt *stmt = conn->lookup;
+  sqlite3_bind_text(stmt, 1, key->str, (int) key->len, SQLITE_STATIC);
+  int rc = sqlite3_step(stmt);
+  bool found = rc == SQLITE_ROW;
+  if (found) {
+    memset(acc, 0, sizeof(*acc));
+    memcpy(acc->userid, key->str, key->len);
+    acc->account_id = sqlite3_column_int64(stmt, 0);
+    copy_text(stmt, 1, acc->password_hash, sizeof(acc->password_hash));
+    copy_text(stmt, 2, acc->email, sizeof(acc->email));
+    const void *birthdate = sqlite3_column_blob(stmt, 3);
+    size_t birthdate_len = birthdate ? (size_t) sqlite3_column_bytes(stmt, 3) : 0;
+    memcpy(acc->birthdate, birthdate,
+           birthdate_len < BIRTHDATE_LENGTH ? birthdate_len : BIRTHDATE_LENGTH);
+    acc->unban_time = (time_t) sqlite3_column_int64(stmt, 4);
+    acc->expiration_time = (time_t) sqlite3_column_int64(stmt, 5);
+    acc->login_count = (unsigned int) sqlite3_column_int64(stmt, 6);
+    acc->login_fail_count = (unsigned int) sqlite3_column_int64(stmt, 7);
+    acc->last_login_time = (time_t) sqlite3_column_int64(stmt, 8);
+    acc->last_ip = (ip4_addr_t) sqlite3_column_int64(stmt, 9);
+    if (updated) {
+      acc->login_count = update.login_count;
+      acc->login_fail_count = update.login_fail_count;
+      acc->last_login_time = update.last_login_time;
+      acc->last_ip = update.last_ip;
+    }
+  }
+  else if (rc != SQLITE_DONE) {
+    log_message(LOG_ERROR, "SQLite: lookup of %s failed: %s", key->str, sqlite3_errmsg(conn->db));
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  release(db, conn);
+  if (found) {
+    atomic_fetch_add_explicit(&db->found, 1, memory_order_relaxed);
+  }
+  return found;
+}
+
+bool db_sqlite_lookup(db_sqlite_t *db, const char *userid, account_t *acc)
+{
+  userid_key_t key;
+  return db && acc && userid_key_init(&key, userid) && lookup_key(db, &key, acc);
+}
+
+bool db_sqlite_insert(db_sqlite_t *db, const account_t *accounts, size_t n)
+{
+  if (!db || (!accounts && n > 0)) {
+    return false;
+  }
+  db_conn_t *conn = acquire(db);
+  bool ok = exec_sql(conn->db, "BEGIN IMMEDIATE");
+  sqlite3_stmt *stmt = conn->insert;
+  for (size_t i = 0; ok && i < n; i++) {
+    const account_t *acc = &accounts[i];
+    bind_userid(stmt, acc->userid);
+    sqlite3_bind_int64(stmt, 2, acc->account_id);
+    sqlite3_bind_text(stmt, 3, acc->password_hash,
+                      (int) strnlen(acc->password_hash, HASH_LENGTH), SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, acc->email, (int) strnlen(acc->email, EMAIL_LENGTH),
+                      SQLITE_STATIC);
+    sqlite3_bind_blob(stmt, 5, acc->birthdate, BIRTHDATE_LENGTH, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 6, (sqlite3_int64) acc->unban_time);
+    sqlite3_bind_int64(stmt, 7, (sqlite3_int64) acc->expiration_time);
+    sqlite3_bind_int64(stmt, 8, acc->login_count);
+    sqlite3_bind_int64(stmt, 9, acc->login_fail_count);
+    sqlite3_bind_int64(stmt, 10, (sqlite3_int64) acc->last_login_time);
+    sqlite3_bind_int64(stmt, 11, acc->last_ip);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+      log_message(LOG_ERROR, "SQLite: insert of %s failed: %s", acc->userid,
+                  sqlite3_errmsg(conn->db));
+      ok = false;
+    }
+    sqlite3_reset(stmt);
+  }
+  sqlite3_clear_bindings(stmt);
+  ok = ok ? exec_sql(conn->db, "COMMIT") : (exec_sql(conn->db, "ROLLBACK"), false);
+  release(db, conn);
+  for (size_t i = 0; ok && i < n; i++) {
+    userid_filter_add(accounts[i].userid);
+  }
+  return ok;
+}
+
+void db_sqlite_record_login(db_sqlite_t *db, const account_t *acc)
+{
+  if (!db || !acc) {
+    return;
+  }
+  pthread_mutex_lock(&db->pending_mutex);
+  update_list_t *pending = &db->pending;
+  if (pending->count == pending->cap) {
+    size_t cap = pending->cap ? pending->cap * 2 : db->batch_size;
+    login_update_t *items = realloc(pending->items, cap * sizeof(*items));
+    if (!items) {
+      pthread_mutex_unlock(&db->pending_mutex);
+      log_message(LOG_ERROR, "Memory allocation for login update of %s has failed", acc->userid);
+      return;
+    }
+    pending->items = items;
+    pending->cap = cap;
+  }
+  login_update_t *update = &pending->items[pending->count++];
+  memcpy(update->userid, acc->userid, USER_ID_LENGTH);
+  update->login_count = acc->login_count;
+  update->login_fail_count = acc->login_fail_count;
+  update->last_login_time = acc->last_login_time;
+  update->last_ip = acc->last_ip;
+  bool full = pending->count >= db->batch_size;
+  pthread_mutex_unlock(&db->pending_mutex);
+  atomic_fetch_add_explicit(&db->logins_recorded, 1, memory_order_relaxed);
+  if (full) {
+    db_sqlite_flush(db);
+  }
+}
+
+bool db_sqlite_flush(db_sqlite_t *db)
+{
+  if (!db) {
+    return false;
+  }
+  pthread_mutex_lock(&db->flush_mutex);
+  // take the queued updates, leaving an empty list for new ones. lookups
+  // still see them in db->writing until they are committed.
+  pthread_mutex_lock(&db->pending_mutex);
+  update_list_t batch = db->pending;
+  db->pending = db->writing;
+  db->writing = batch;
+  pthread_mutex_unlock(&db->pending_mutex);
+
+  bool ok = true;
+  if (batch.count > 0) {
+    db_conn_t *conn = acquire(db);
+    sqlite3_stmt *stmt = conn->update_login;
+    ok = exec_sql(conn->db, "BEGIN IMMEDIATE");
+    for (size_t i = 0; ok && i < batch.count; i++) {
+      const login_update_t *update = &batch.items[i];
+      bind_userid(stmt, update->userid);
+      sqlite3_bind_int64(stmt, 2, update->login_count);
+      sqlite3_bind_int64(stmt, 3, update->login_fail_count);
+      sqlite3_bind_int64(stmt, 4, (sqlite3_int64) update->last_login_time);
+      sqlite3_bind_int64(stmt, 5, update->last_ip);
+      if (sqlite3_step(stmt) != SQLITE_DONE) {
+        log_message(LOG_ERROR, "SQLite: login update failed: %s", sqlite3_errmsg(conn->db));
+        ok = false;
+      }
+      sqlite3_reset(stmt);
+    }
+    sqlite3_clear_bindings(stmt);
+    ok = ok ? exec_sql(conn->db, "COMMIT") : (exec_sql(conn->db, "ROLLBACK"), false);
+    release(db, conn);
+    if (ok) {
+      atomic_fetch_add_explicit(&db->logins_written, batch.count, memory_order_relaxed);
+      atomic_fetch_add_explicit(&db->batches_written, 1, memory_order_relaxed);
+    }
+    else {
+      log_message(LOG_ERROR, "SQLite: %zu login updates were lost", batch.count);
+    }
+  }
+  pthread_mutex_lock(&db->pending_mutex);
+  db->writing.count = 0;
+  pthread_mutex_unlock(&db->pending_mutex);
+  pthread_mutex_unlock(&db->flush_mutex);
+  return ok;
+}
+
+int64_t db_sqlite_count(db_sqlite_t *db)
+{
+  if (!db) {
+    return -1;
+  }
+  db_conn_t *conn = acquire(db);
+  int64_t count = sqlite3_step(conn->count) == SQLITE_ROW
+                  ? sqlite3_column_int64(conn->count, 0) : -1;
+  sqlite3_reset(conn->count);
+  release(db, conn);
+  return count;
+}
+
+void db_sqlite_get_stats(db_sqlite_t *db, db_sqlite_stats_t *stats)
+{
+  if (!db || !stats) {
+    return;
+  }
+  stats->lookups = atomic_load(&db->lookups);
+  stats->found = atomic_load(&db->found);
+  stats->logins_recorded = atomic_load(&db->logins_recorded);
+  stats->logins_written = atomic_load(&db->logins_written);
+  stats->batches_written = atomic_load(&db->batches_written);
+  stats->pool_waits = atomic_load(&db->pool_waits);
+}
+
+static bool backend_lookup(void *arg, const userid_key_t *key, account_t *acc)
+{
+  return key->len < USER_ID_LENGTH && lookup_key(arg, key, acc);
+}
+
+static void backend_record_login(void *arg, const account_t *acc)
+{
+  db_sqlite_record_login(arg, acc);
+}
+
+static bool backend_foreach_userid(void *arg, db_userid_fn fn, void *ctx)
+{
+  db_conn_t *conn = acquire(arg);
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(conn->db, userids_sql, -1, &stmt, NULL) != SQLITE_OK) {
+    log_message(LOG_ERROR, "SQLite: preparing \"%s\" failed: %s", userids_sql,
+                sqlite3_errmsg(conn->db));
+    release(arg, conn);
+    return false;
+  }
+  bool complete = true;
+  int rc;
+  while (complete && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    char userid[USER_ID_LENGTH];
+    copy_text(stmt, 0, userid, sizeof(userid));
+    complete = fn(userid, ctx);
+  }
+  if (complete && rc != SQLITE_DONE) {
+    log_message(LOG_ERROR, "SQLite: listing userids failed: %s", sqlite3_errmsg(conn->db));
+    complete = false;
+  }
+  sqlite3_finalize(stmt);
+  release(arg, conn);
+  return complete;
+}
+
+void db_sqlite_backend(db_sqlite_t *db, db_backend_t *backend)
+{
+  if (backend) {
+    backend->lookup = backend_lookup;
+    backend->record_login = backend_record_login;
+    backend->lookup_async = NULL;
+    backend->foreach_userid = backend_foreach_userid;
+    backend->arg = db;
+  }
+}
+
+#ifdef DB_SEED_MAIN
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define SEED_BATCH 10000
+
+static double seconds_since(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Database seeding tool.
+ *
+ * Usage: app DB_PATH COUNT [PASSWORD]
+ *
+ * Adds accounts user0 .. user(COUNT-1) to the SQLite database at DB_PATH
+ * (creating it if need be), all with password PASSWORD (default
+ * "password"). The password is hashed once and the hash shared, since
+ * hashing millions of passwords would take far longer than inserting them.
+ */
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    dprintf(STDERR_FILENO, "usage: %s DB_PATH COUNT [PASSWORD]\n", argv[0]);
+    return 2;
+  }
+  unsigned long long count = strtoull(argv[2], NULL, 10);
+  const char *password = argc > 3 ? argv[3] : "password";
+  account_t *model = account_create("seed", password, "seed@example.com", "2000-01-01");
+  db_sqlite_options_t opts = { .connections = 1 };
+  db_sqlite_t *db = model ? db_sqlite_open(argv[1], &opts) : NULL;
+  account_t *batch = calloc(SEED_BATCH, sizeof(*batch));
+  if (!db || !batch) {
+    dprintf(STDERR_FILENO, "%s: failed to set up\n", argv[0]);
+    return 1;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  bool ok = true;
+  for (unsigned long long done = 0; ok && done < count;) {
+    size_t n = count - done < SEED_BATCH ? (size_t) (count - done) : SEED_BATCH;
+    for (size_t i = 0; i < n; i++) {
+      unsigned long long id = done + i;
+      account_t *acc = &batch[i];
+      *acc = *model;
+      acc->account_id = (int64_t) id + 1;
+      snprintf(acc->userid, sizeof(acc->userid), "user%llu", id);
+      snprintf(acc->email, sizeof(acc->email), "user%llu@example.com", id);
+      char birthdate[BIRTHDATE_LENGTH + 1];
+      snprintf(birthdate, sizeof(birthdate), "%04llu-%02llu-%02llu",
+               1950 + id % 50, 1 + id % 12, 1 + id % 28);
+      memcpy(acc->birthdate, birthdate, BIRTHDATE_LENGTH);
+    }
+    ok = db_sqlite_insert(db, batch, n);
+    done += n;
+  }
+  double elapsed = seconds_since(&start);
+  int64_t total = db_sqlite_count(db);
+  dprintf(STDOUT_FILENO, "%llu accounts added in %.1f s (%.0f/s); %lld in database\n",
+          count, elapsed, elapsed > 0 ? (double) count / elapsed : 0.0, (long long) total);
+  free(batch);
+  account_free(model);
+  ok = db_sqlite_close(db) && ok;
+  return ok ? 0 : 1;
+}
+
+#endif // DB_SEED_MAIN
@@ -0,0 +1,83 @@
+#ifndef DB_SQLITE_H
+#define DB_SQLITE_H
+
+/**
+ * @file db_sqlite.h
+ * @brief SQLite account database, for development and benchmarking.
+ *
+ * Accounts live in one table keyed by user ID (a WITHOUT ROWID table, so a
+ * lookup is a single B-tree search). The database runs in WAL mode, so
+ * lookups are not blocked by writes. Each of a pool of connections keeps
+ * its statements prepared; a thread takes a free connection for each
+ * operation, waiting if all are in use.
+ *
+ * Login counters recorded through db_sqlite_record_login() are queued and
+ * written in batches, a transaction per batch, when a batch fills, every
+ * flush_interval_ms, at db_sqlite_flush() and at close. Until then,
+ * lookups return the queued counters in place of those in the table.
+ *
+ * To serve handle_login(), install the database as the backend:
+ *
+ *   db_backend_t backend;
+ *   db_sqlite_backend(db, &backend);
+ *   db_backend_set(&backend);
+ *
+ * Built with -DDB_SEED_MAIN, db_sqlite.c has a main() that fills a
+ * database with generated accounts for benchmarks (see README.md).
+ */
+
+#include "account.h"
+#include "db_backend.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DB_SQLITE_DEFAULT_BATCH 256
+
+typedef struct db_sqlite db_sqlite_t;
+
+typedef struct {
+  unsigned int connections;        // pool size (0 = number of online CPUs)
+  unsigned int batch_size;         // login updates per write (0 = DB_SQLITE_DEFAULT_BATCH)
+  unsigned int flush_interval_ms;  // also write pending updates this often (0 = don't)
+} db_sqlite_options_t;
+
+typedef struct {
+  uint64_t lookups;
+  uint64_t found;
+  uint64_t logins_recorded;
+  uint64_t logins_written;
+  uint64_t batches_written;
+  uint64_t pool_waits;             // operations that had to wait for a connection
+} db_sqlite_stats_t;
+
+// open (creating if need be) the database at path. opts may be NULL for
+// defaults. returns NULL (after logging) on failure.
+db_sqlite_t *db_sqlite_open(const char *path, const db_sqlite_options_t *opts);
+
+// write pending login updates and close the database. NULL is ignored.
+bool db_sqlite_close(db_sqlite_t *db);
+
+// look up the account with the given userid, as account_lookup_by_userid()
+bool db_sqlite_lookup(db_sqlite_t *db, const char *userid, account_t *acc);
+
+// insert (or replace, by userid) n accounts in one transaction
+bool db_sqlite_insert(db_sqlite_t *db, const account_t *accounts, size_t n);
+
+// queue acc's login counters (login_count, login_fail_count,
+// last_login_time, last_ip) to be written with the next batch
+void db_sqlite_record_login(db_sqlite_t *db, const account_t *acc);
+
+// write all queued login updates now
+bool db_sqlite_flush(db_sqlite_t *db);
+
+// number of accounts in the database, or -1 on error
+int64_t db_sqlite_count(db_sqlite_t *db);
+
+void db_sqlite_get_stats(db_sqlite_t *db, db_sqlite_stats_t *stats);
+
+// fill in backend to look accounts up in, and record logins to, db
+void db_sqlite_backend(db_sqlite_t *db, db_backend_t *backend);
+
+#endif // DB_SQLITE_H
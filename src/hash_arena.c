@@ -0,0 +1,234 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE           // MAP_ANONYMOUS, MAP_HUGETLB and madvise()
+
+#include "hash_arena.h"
+#include "logging.h"
+#include "thread_pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CACHE_LINE 64
+#define HUGE_PAGE_BYTES ((size_t) 2 << 20)
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t returned = PTHREAD_COND_INITIALIZER;
+// guarded by mutex
+static unsigned char *base;
+static size_t arena_bytes;
+static size_t mapped_bytes;
+static unsigned int count;
+static bool *busy;
+static unsigned int in_use;
+static bool draining;           // configure() is waiting for arenas to come back
+static bool huge_pages;
+static unsigned int generation; // bumped by each configure(), so stale slots are ignored
+static uint64_t borrowed;
+static uint64_t waits;
+static uint64_t unpooled;
+
+// the arena this thread borrowed last, if it was from this generation
+static _Thread_local int last_slot = -1;
+static _Thread_local unsigned int last_generation;
+
+static size_t round_up(size_t n, size_t to)
+{
+  return (n + to - 1) / to * to;
+}
+
+/**
+ * Maps total bytes for the arenas, on explicit huge pages if asked and
+ * available, else advising transparent huge pages. Sets *huge to which.
+ */
+static void *map_arenas(size_t total, bool want_huge, bool *huge)
+{
+  *huge = false;
+#ifdef MAP_HUGETLB
+  if (want_huge) {
+    void *p = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      *huge = true;
+      return p;
+    }
+  }
+#endif
+  void *p = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return NULL;
+  }
+#ifdef MADV_HUGEPAGE
+  if (want_huge) {
+    madvise(p, total, MADV_HUGEPAGE);   // best effort: THP may be disabled
+  }
+#endif
+  return p;
+}
+
+bool hash_arena_configure(const hash_arena_options_t *opts)
+{
+  pthread_mutex_lock(&mutex);
+  while (draining) {
+    pthread_cond_wait(&returned, &mutex);
+  }
+  draining = true;
+  while (in_use > 0) {
+    pthread_cond_wait(&returned, &mutex);
+  }
+
+  if (base) {
+    munmap(base, mapped_bytes);
+  }
+  free(busy);
+  base = NULL;
+  busy = NULL;
+  count = 0;
+  arena_bytes = 0;
+  mapped_bytes = 0;
+  huge_pages = false;
+  generation++;
+
+  bool ok = true;
+  if (opts) {
+    unsigned int n = opts->arenas ? opts->arenas : thread_pool_cpu_count();
+    size_t page = opts->no_huge_pages ? (size_t) sysconf(_SC_PAGESIZE) : HUGE_PAGE_BYTES;
+    size_t size = round_up(opts->arena_bytes ? opts->arena_bytes : HASH_ARENA_DEFAULT_BYTES, page);
+    bool *flags = calloc(n, sizeof(bool));
+    unsigned char *p = NULL;
+    bool huge = false;
+    if (flags && size <= SIZE_MAX / n) {
+      p = map_arenas(size * n, !opts->no_huge_pages, &huge);
+    }
+    if (!p) {
+      log_message(LOG_ERROR, "Failed to map %u hash arenas of %zu bytes: %s", n, size,
+                  strerror(errno));
+      free(flags);
+      ok = false;
+    }
+    else {
+      // fault every page in now rather than on the first logins
+      memset(p, 0, size * n);
+      base = p;
+      busy = flags;
+      count = n;
+      arena_bytes = size;
+      mapped_bytes = size * n;
+      huge_pages = huge;
+      log_message(LOG_INFO, "Mapped %u hash arenas of %zu bytes%s", n, size,
+                  huge ? " on huge pages" : "");
+    }
+  }
+
+  draining = false;
+  pthread_cond_broadcast(&returned);
+  pthread_mutex_unlock(&mutex);
+  return ok;
+}
+
+/**
+ * Allocates bytes of memory of the borrower's own, rounded up to whole
+ * cache lines. Returns NULL (after logging) on failure.
+ */
+static void *allocate_own(size_t bytes)
+{
+  void *p = aligned_alloc(CACHE_LINE, round_up(bytes ? bytes : 1, CACHE_LINE));
+  if (!p) {
+    log_message(LOG_ERROR, "Failed to allocate %zu bytes for password hashing", bytes);
+  }
+  return p;
+}
+
+bool hash_arena_borrow(size_t bytes, hash_arena_t *arena)
+{
+  pthread_mutex_lock(&mutex);
+  bool waited = false;
+  while (draining || (count > 0 && in_use == count)) {
+    waited = true;
+    pthread_cond_wait(&returned, &mutex);
+  }
+  if (waited) {
+    waits++;
+  }
+
+  int slot = -1;
+  if (count > 0) {
+    if (last_slot >= 0 && last_generation == generation && !busy[last_slot]) {
+      slot = last_slot;
+    }
+    else {
+      for (unsigned int i = 0; i < count; i++) {
+        if (!busy[i]) {
+          slot = (int) i;
+          break;
+        }
+      }
+    }
+    busy[slot] = true;
+    in_use++;
+    borrowed++;
+    last_slot = slot;
+    last_generation = generation;
+  }
+  bool own = slot < 0 || bytes > arena_bytes;
+  if (own) {
+    unpooled++;
+  }
+  unsigned char *memory = slot >= 0 ? base + (size_t) slot * arena_bytes : NULL;
+  pthread_mutex_unlock(&mutex);
+
+  if (own) {
+    memory = allocate_own(bytes);
+    if (!memory) {
+      arena->slot = slot;
+      arena->memory = NULL;
+      hash_arena_return(arena);
+      return false;
+    }
+  }
+  arena->memory = memory;
+  arena->bytes = bytes;
+  arena->slot = slot;
+  return true;
+}
+
+void hash_arena_return(hash_arena_t *arena)
+{
+  if (!arena) {
+    return;
+  }
+  pthread_mutex_lock(&mutex);
+  // arenas cannot be remapped while one is lent out, so base is still good
+  bool own = arena->slot < 0 || arena->memory != base + (size_t) arena->slot * arena_bytes;
+  if (arena->slot >= 0) {
+    busy[arena->slot] = false;
+    in_use--;
+    pthread_cond_broadcast(&returned);
+  }
+  pthread_mutex_unlock(&mutex);
+  if (own) {
+    free(arena->memory);
+  }
+  arena->memory = NULL;
+  arena->slot = -1;
+}
+
+void hash_arena_get_stats(hash_arena_stats_t *stats)
+{
+  if (!stats) {
+    return;
+  }
+  pthread_mutex_lock(&mutex);
+  stats->borrowed = borrowed;
+  stats->waits = waits;
+  stats->unpooled = unpooled;
+  stats->arenas = count;
+  stats->in_use = in_use;
+  stats->arena_bytes = arena_bytes;
+  stats->bytes_mapped = mapped_bytes;
+  stats->huge_pages = huge_pages;
+  pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,75 @@
+#ifndef HASH_ARENA_H
+#define HASH_ARENA_H
+
+/**
+ * @file hash_arena.h
+ * @brief Preallocated working memory for memory-hard password hashing.
+ *
+ * A memory-hard hash (see scrypt.h) needs tens of megabytes for a few
+ * milliseconds. Allocating that per login churns the allocator (large
+ * blocks go straight to mmap() and back) and takes a page fault for every
+ * page touched; under load, the faults alone cost as much as the hashing.
+ *
+ * hash_arena_configure() instead maps a fixed number of equal arenas once,
+ * backed by huge pages where the system has them (explicit huge pages if
+ * reserved, otherwise transparent huge pages if enabled), and touches
+ * every page up front. Each hash borrows an arena and gives it back; when
+ * all are lent out, further hashes wait. The number of arenas therefore
+ * caps both the memory used for hashing and the number of memory-hard
+ * hashes in progress. A thread is given the arena it used last if that is
+ * free, so a worker keeps hashing in memory that is already in its cache
+ * and TLB and local to its NUMA node.
+ *
+ * Until arenas are configured, each borrowing allocates and frees memory
+ * of its own. A request for more than an arena holds still waits for an
+ * arena (so counts against the cap) but works in memory of its own, so
+ * hashes made with larger parameters than the arenas were sized for keep
+ * verifying.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_ARENA_DEFAULT_BYTES ((size_t) 33 << 20)   // scrypt with N = 2^15, r = 8
+
+typedef struct {
+  size_t arena_bytes;        // size of each arena (0 = HASH_ARENA_DEFAULT_BYTES)
+  unsigned int arenas;       // arenas, hence hashes in progress at once
+                             // (0 = number of online CPUs)
+  bool no_huge_pages;        // don't ask for huge pages
+} hash_arena_options_t;
+
+typedef struct {
+  void *memory;
+  size_t bytes;
+  int slot;                  // arena lent out, or -1 if memory is not an arena's
+} hash_arena_t;
+
+typedef struct {
+  uint64_t borrowed;         // arenas lent out
+  uint64_t waits;            // borrowings that had to wait for an arena
+  uint64_t unpooled;         // borrowings given memory of their own
+  unsigned int arenas;
+  unsigned int in_use;
+  size_t arena_bytes;
+  size_t bytes_mapped;       // memory held by the arenas
+  bool huge_pages;           // arenas are on explicit huge pages
+} hash_arena_stats_t;
+
+// (re)configure the arenas, or free them if opts is NULL, waiting for any
+// lent out to be returned first. returns false (after logging) if they
+// could not be mapped, leaving no arenas configured.
+bool hash_arena_configure(const hash_arena_options_t *opts);
+
+// borrow at least bytes of working memory (aligned to a cache line),
+// waiting for an arena if all are in use. returns false (after logging)
+// only if memory could not be allocated.
+bool hash_arena_borrow(size_t bytes, hash_arena_t *arena);
+
+// give back memory from hash_arena_borrow()
+void hash_arena_return(hash_arena_t *arena);
+
+void hash_arena_get_stats(hash_arena_stats_t *stats);
+
+#endif // HASH_ARENA_H
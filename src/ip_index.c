@@ -0,0 +1,512 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ip_index.h"
+#include "account_store.h"
+#include "logging.h"
+#include "userid_key.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_BUCKETS 1024
+
+struct ip_node;
+
+/**
+ * An indexed account: in the userid hash table, and on the list of its
+ * address's leaf.
+ */
+typedef struct ip_member {
+  struct ip_member *next_in_bucket;
+  struct ip_member *prev_at_ip;
+  struct ip_member *next_at_ip;
+  struct ip_node *leaf;
+  uint64_t hash;
+  char userid[USER_ID_LENGTH];
+} ip_member_t;
+
+/**
+ * A crit-bit tree node. Internal nodes have two children, whose keys all
+ * agree above bit and differ at it (the children are chosen by that bit);
+ * leaves have none, and hold one address and its accounts.
+ */
+typedef struct ip_node {
+  struct ip_node *child[2];
+  struct ip_node *parent;
+  unsigned int bit;              // internal: 31 = the most significant
+  uint32_t key;                  // leaf: the address, in host byte order
+  ip_member_t *members;          // leaf
+} ip_node_t;
+
+static atomic_bool index_enabled = false;
+static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// everything below is guarded by index_lock
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static ip_node_t *root = NULL;
+static ip_member_t **buckets = NULL;
+static size_t nbuckets = 0;          // a power of two
+static size_t naccounts = 0;
+static size_t naddresses = 0;
+static uint64_t moves = 0;
+static _Atomic uint64_t queries = 0;
+
+static bool is_leaf(const ip_node_t *node)
+{
+  return node->child[0] == NULL;
+}
+
+static ip_member_t **find_member_link(const char *userid, uint64_t hash)
+{
+  ip_member_t **link = &buckets[hash & (nbuckets - 1)];
+  for (; *link; link = &(*link)->next_in_bucket) {
+    if ((*link)->hash == hash && strcmp((*link)->userid, userid) == 0) {
+      break;
+    }
+  }
+  return link;
+}
+
+/**
+ * Doubles the userid hash table. On allocation failure it keeps its old
+ * size, and just gets slower.
+ */
+static void grow_buckets(void)
+{
+  size_t count = nbuckets * 2;
+  ip_member_t **grown = calloc(count, sizeof(*grown));
+  if (!grown) {
+    log_message(LOG_WARN, "IP index could not grow to %zu buckets", count);
+    return;
+  }
+  for (size_t i = 0; i < nbuckets; i++) {
+    ip_member_t *member = buckets[i];
+    while (member) {
+      ip_member_t *next = member->next_in_bucket;
+      ip_member_t **bucket = &grown[member->hash & (count - 1)];
+      member->next_in_bucket = *bucket;
+      *bucket = member;
+      member = next;
+    }
+  }
+  free(buckets);
+  buckets = grown;
+  nbuckets = count;
+}
+
+/**
+ * Returns the leaf for key, adding it to the tree if need be, or NULL if
+ * memory runs out.
+ */
+static ip_node_t *leaf_for(uint32_t key)
+{
+  ip_node_t *best = root;
+  while (best && !is_leaf(best)) {
+    best = best->child[(key >> best->bit) & 1];
+  }
+  if (best && best->key == key) {
+    return best;
+  }
+  ip_node_t *leaf = calloc(1, sizeof(*leaf));
+  ip_node_t *inner = best ? calloc(1, sizeof(*inner)) : NULL;
+  if (!leaf || (best && !inner)) {
+    free(leaf);
+    free(inner);
+    return NULL;
+  }
+  leaf->key = key;
+  naddresses++;
+  if (!best) {
+    root = leaf;
+    return leaf;
+  }
+
+  // the new leaf parts from its closest match at their first differing bit
+  uint32_t diff = best->key ^ key;
+  unsigned int bit = 31;
+  while (((diff >> bit) & 1) == 0) {
+    bit--;
+  }
+  ip_node_t *parent = NULL;
+  ip_node_t **link = &root;
+  while (!is_leaf(*link) && (*link)->bit > bit) {
+    parent = *link;
+    link = &(*link)->child[(key >> (*link)->bit) & 1];
+  }
+  unsigned int side = (key >> bit) & 1;
+  inner->bit = bit;
+  inner->parent = parent;
+  inner->child[side] = leaf;
+  inner->child[!side] = *link;
+  (*link)->parent = inner;
+  leaf->parent = inner;
+  *link = inner;
+  return leaf;
+}
+
+/**
+ * Removes an empty leaf, and the internal node above it.
+ */
+static void remove_leaf(ip_node_t *leaf)
+{
+  ip_node_t *parent = leaf->parent;
+  if (!parent) {
+    root = NULL;
+  }
+  else {
+    ip_node_t *sibling = parent->child[parent->child[0] == leaf];
+    ip_node_t *grandparent = parent->parent;
+    sibling->parent = grandparent;
+    if (!grandparent) {
+      root = sibling;
+    }
+    else {
+      grandparent->child[grandparent->child[1] == parent] = sibling;
+    }
+    free(parent);
+  }
+  free(leaf);
+  naddresses--;
+}
+
+static void unlink_from_leaf(ip_member_t *member)
+{
+  ip_node_t *leaf = member->leaf;
+  if (member->prev_at_ip) {
+    member->prev_at_ip->next_at_ip = member->next_at_ip;
+  }
+  else {
+    leaf->members = member->next_at_ip;
+  }
+  if (member->next_at_ip) {
+    member->next_at_ip->prev_at_ip = member->prev_at_ip;
+  }
+  member->leaf = NULL;
+  if (!leaf->members) {
+    remove_leaf(leaf);
+  }
+}
+
+static void link_to_leaf(ip_member_t *member, ip_node_t *leaf)
+{
+  member->leaf = leaf;
+  member->prev_at_ip = NULL;
+  member->next_at_ip = leaf->members;
+  if (leaf->members) {
+    leaf->members->prev_at_ip = member;
+  }
+  leaf->members = member;
+}
+
+static void forget_locked(const char *userid, uint64_t hash)
+{
+  if (nbuckets == 0) {
+    return;
+  }
+  ip_member_t **link = find_member_link(userid, hash);
+  ip_member_t *member = *link;
+  if (member) {
+    *link = member->next_in_bucket;
+    unlink_from_leaf(member);
+    naccounts--;
+    free(member);
+  }
+}
+
+/**
+ * Puts userid at key (host byte order), with the write lock held.
+ */
+static void place_locked(const char *userid, uint64_t hash, uint32_t key)
+{
+  if (nbuckets == 0) {
+    return;
+  }
+  ip_member_t **link = find_member_link(userid, hash);
+  ip_member_t *member = *link;
+  if (member && member->leaf->key == key) {
+    return;
+  }
+  ip_node_t *leaf = leaf_for(key);
+  if (!leaf) {
+    log_message(LOG_ERROR, "Memory allocation for IP index has failed");
+    forget_locked(userid, hash);
+    return;
+  }
+  if (member) {
+    // the old leaf may go with its last account; the new one is another node
+    unlink_from_leaf(member);
+    moves++;
+  }
+  else {
+    member = calloc(1, sizeof(*member));
+    if (!member) {
+      log_message(LOG_ERROR, "Memory allocation for IP index has failed");
+      if (!leaf->members) {
+        remove_leaf(leaf);
+      }
+      return;
+    }
+    member->hash = hash;
+    strncpy(member->userid, userid, sizeof(member->userid) - 1);
+    member->next_in_bucket = *link;
+    *link = member;
+    naccounts++;
+    if (naccounts > nbuckets) {
+      grow_buckets();
+    }
+  }
+  link_to_leaf(member, leaf);
+}
+
+static void note(const char *userid, ip4_addr_t ip)
+{
+  userid_key_t key;
+  if (!userid_key_init(&key, userid)) {
+    return;
+  }
+  if (ip == 0) {
+    pthread_rwlock_wrlock(&index_lock);
+    forget_locked(userid, key.hash);
+    pthread_rwlock_unlock(&index_lock);
+    return;
+  }
+  uint32_t host = ntohl(ip);
+  // usually the account is already there: check under the read lock
+  pthread_rwlock_rdlock(&index_lock);
+  bool unchanged = false;
+  if (nbuckets > 0) {
+    ip_member_t *member = *find_member_link(userid, key.hash);
+    unchanged = member && member->leaf->key == host;
+  }
+  pthread_rwlock_unlock(&index_lock);
+  if (!unchanged) {
+    pthread_rwlock_wrlock(&index_lock);
+    place_locked(userid, key.hash, host);
+    pthread_rwlock_unlock(&index_lock);
+  }
+}
+
+void ip_index_note_login(const char *userid, ip4_addr_t ip)
+{
+  if (atomic_load_explicit(&index_enabled, memory_order_relaxed)) {
+    note(userid, ip);
+  }
+}
+
+void ip_index_forget(const char *userid)
+{
+  userid_key_t key;
+  if (!atomic_load_explicit(&index_enabled, memory_order_relaxed)
+      || !userid_key_init(&key, userid)) {
+    return;
+  }
+  pthread_rwlock_wrlock(&index_lock);
+  forget_locked(userid, key.hash);
+  pthread_rwlock_unlock(&index_lock);
+}
+
+static void follow_store(account_store_op_t op, uint64_t sequence, const account_t *acc,
+                         void *arg)
+{
+  (void) sequence;
+  (void) arg;
+  note(acc->userid, op == ACCOUNT_STORE_REMOVE ? 0 : acc->last_ip);
+}
+
+static bool index_account(const account_t *acc, void *arg)
+{
+  (void) arg;
+  if (acc->last_ip != 0) {
+    note(acc->userid, acc->last_ip);
+  }
+  return true;
+}
+
+static void free_tree(ip_node_t *node)
+{
+  if (!node) {
+    return;
+  }
+  free_tree(node->child[0]);
+  free_tree(node->child[1]);
+  free(node);
+}
+
+/**
+ * Empties the index. Caller holds the write lock.
+ */
+static void clear_locked(void)
+{
+  for (size_t i = 0; i < nbuckets; i++) {
+    ip_member_t *member = buckets[i];
+    while (member) {
+      ip_member_t *next = member->next_in_bucket;
+      free(member);
+      member = next;
+    }
+  }
+  free(buckets);
+  buckets = NULL;
+  nbuckets = 0;
+  free_tree(root);
+  root = NULL;
+  naccounts = 0;
+  naddresses = 0;
+}
+
+bool ip_index_enable(void)
+{
+  pthread_mutex_lock(&config_mutex);
+  if (atomic_load(&index_enabled)) {
+    pthread_mutex_unlock(&config_mutex);
+    return true;
+  }
+  pthread_rwlock_wrlock(&index_lock);
+  buckets = calloc(INITIAL_BUCKETS, sizeof(*buckets));
+  nbuckets = buckets ? INITIAL_BUCKETS : 0;
+  pthread_rwlock_unlock(&index_lock);
+  // changes from here on reach the index through the hook, and the walk
+  // sees each account as it is when its shard is read
+  bool ok = buckets && account_store_add_hook(follow_store, NULL);
+  if (ok) {
+    atomic_store(&index_enabled, true);
+    account_store_foreach(index_account, NULL);
+  }
+  else {
+    log_message(LOG_ERROR, "Failed to enable the IP index");
+    pthread_rwlock_wrlock(&index_lock);
+    clear_locked();
+    pthread_rwlock_unlock(&index_lock);
+  }
+  pthread_mutex_unlock(&config_mutex);
+  return ok;
+}
+
+void ip_index_disable(void)
+{
+  pthread_mutex_lock(&config_mutex);
+  if (atomic_load(&index_enabled)) {
+    atomic_store(&index_enabled, false);
+    account_store_remove_hook(follow_store, NULL);
+    pthread_rwlock_wrlock(&index_lock);
+    clear_locked();
+    pthread_rwlock_unlock(&index_lock);
+  }
+  pthread_mutex_unlock(&config_mutex);
+}
+
+/**
+ * Visits every account in the subtree under node. Returns false if fn
+ * stopped.
+ */
+static bool visit_subtree(const ip_node_t *node, ip_index_visit_fn fn, void *arg)
+{
+  if (!is_leaf(node)) {
+    return visit_subtree(node->child[0], fn, arg) && visit_subtree(node->child[1], fn, arg);
+  }
+  ip4_addr_t ip = htonl(node->key);
+  for (const ip_member_t *member = node->members; member; member = member->next_at_ip) {
+    if (!fn(member->userid, ip, arg)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ip_index_query(ip4_addr_t prefix, unsigned int prefix_len, ip_index_visit_fn fn,
+                    void *arg)
+{
+  if (prefix_len > 32 || !fn || !atomic_load(&index_enabled)) {
+    return false;
+  }
+  atomic_fetch_add_explicit(&queries, 1, memory_order_relaxed);
+  uint32_t mask = prefix_len ? UINT32_MAX << (32 - prefix_len) : 0;
+  uint32_t want = ntohl(prefix) & mask;
+
+  pthread_rwlock_rdlock(&index_lock);
+  // descend while the node tells apart keys within the prefix: below that,
+  // every key in the subtree agrees on the prefix's bits
+  const ip_node_t *node = root;
+  while (node && !is_leaf(node) && node->bit >= 32 - prefix_len) {
+    node = node->child[(want >> node->bit) & 1];
+  }
+  bool more = true;
+  if (node) {
+    const ip_node_t *sample = node;
+    while (!is_leaf(sample)) {
+      sample = sample->child[0];
+    }
+    if ((sample->key & mask) == want) {
+      more = visit_subtree(node, fn, arg);
+    }
+  }
+  pthread_rwlock_unlock(&index_lock);
+  return more;
+}
+
+static bool count_visit(const char *userid, ip4_addr_t ip, void *arg)
+{
+  (void) userid;
+  (void) ip;
+  (*(size_t *) arg)++;
+  return true;
+}
+
+size_t ip_index_count(ip4_addr_t prefix, unsigned int prefix_len)
+{
+  size_t count = 0;
+  ip_index_query(prefix, prefix_len, count_visit, &count);
+  return count;
+}
+
+bool ip_index_parse_cidr(const char *text, ip4_addr_t *prefix, unsigned int *prefix_len)
+{
+  if (!text || !prefix || !prefix_len) {
+    return false;
+  }
+  char address[INET_ADDRSTRLEN];
+  const char *slash = strchr(text, '/');
+  size_t len = slash ? (size_t) (slash - text) : strlen(text);
+  if (len >= sizeof(address)) {
+    return false;
+  }
+  memcpy(address, text, len);
+  address[len] = '\0';
+  struct in_addr addr;
+  if (inet_pton(AF_INET, address, &addr) != 1) {
+    return false;
+  }
+  unsigned int bits = 32;
+  if (slash) {
+    const char *p = slash + 1;
+    if (*p < '0' || *p > '9') {
+      return false;
+    }
+    for (bits = 0; *p >= '0' && *p <= '9' && bits <= 32; p++) {
+      bits = bits * 10 + (unsigned int) (*p - '0');
+    }
+    if (*p != '\0' || bits > 32) {
+      return false;
+    }
+  }
+  *prefix = addr.s_addr;
+  *prefix_len = bits;
+  return true;
+}
+
+void ip_index_get_stats(ip_index_stats_t *stats)
+{
+  if (!stats) {
+    return;
+  }
+  pthread_rwlock_rdlock(&index_lock);
+  stats->enabled = atomic_load(&index_enabled);
+  stats->accounts = naccounts;
+  stats->addresses = naddresses;
+  stats->moves = moves;
+  pthread_rwlock_unlock(&index_lock);
+  stats->queries = atomic_load(&queries);
+}
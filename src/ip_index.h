@@ -0,0 +1,73 @@
+#ifndef IP_INDEX_H
+#define IP_INDEX_H
+
+/**
+ * @file ip_index.h
+ * @brief Index of accounts by last login address, for prefix queries.
+ *
+ * Answers "which accounts last logged in from this address, or from
+ * anywhere in this CIDR block?" without scanning every account. Accounts
+ * are kept in a crit-bit tree (a path-compressed binary radix tree) keyed
+ * by last_ip, one leaf per distinct address with the accounts at that
+ * address listed on it. A query walks down at most 32 levels to the
+ * subtree holding the block and then visits just that subtree's leaves,
+ * so it costs time in proportion to the prefix length and the number of
+ * accounts found.
+ *
+ * While enabled, the index follows the account store (through a hook) and
+ * every account_record_login_success(). A login from the address the
+ * account last used, the usual case, changes nothing and takes only the
+ * index's read lock; a disabled index costs one atomic load per login.
+ *
+ * An account whose last_ip is 0 has never logged in and is not indexed.
+ * Addresses, like account_t's last_ip, are in network byte order.
+ */
+
+#include "account.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// called for each account found by a query, with the index read-locked:
+// must be quick and must not call into the index or the store. return false to stop.
+typedef bool (*ip_index_visit_fn)(const char *userid, ip4_addr_t ip, void *arg);
+
+typedef struct {
+  bool enabled;
+  size_t accounts;          // accounts indexed
+  size_t addresses;         // distinct addresses among them
+  uint64_t moves;           // accounts moved to a new address
+  uint64_t queries;
+} ip_index_stats_t;
+
+// build the index from the account store and keep it up to date from now
+// on. returns false (after logging) if memory runs out, leaving it disabled.
+bool ip_index_enable(void);
+
+// stop following changes and free the index
+void ip_index_disable(void);
+
+// record that userid's last_ip is now ip (0 = none). does nothing while
+// the index is disabled.
+void ip_index_note_login(const char *userid, ip4_addr_t ip);
+
+// drop userid from the index
+void ip_index_forget(const char *userid);
+
+// call fn for every account whose last_ip has the first prefix_len bits
+// (0 to 32) of prefix. returns false if fn stopped the walk, the prefix
+// length is out of range or the index is disabled.
+bool ip_index_query(ip4_addr_t prefix, unsigned int prefix_len, ip_index_visit_fn fn,
+                    void *arg);
+
+// how many accounts ip_index_query() would visit
+size_t ip_index_count(ip4_addr_t prefix, unsigned int prefix_len);
+
+// parse "a.b.c.d" or "a.b.c.d/len" into a prefix and its length (32 for a
+// bare address). returns false if text is not one of those.
+bool ip_index_parse_cidr(const char *text, ip4_addr_t *prefix, unsigned int *prefix_len);
+
+void ip_index_get_stats(ip_index_stats_t *stats);
+
+#endif // IP_INDEX_H
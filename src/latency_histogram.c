@@ -0,0 +1,150 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "latency_histogram.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define HALF_SUB_BUCKETS (LATENCY_HISTOGRAM_SUB_BUCKETS / 2)
+// log2(HALF_SUB_BUCKETS): values with a most significant bit above this are
+// shifted down until they fit in the upper half of a sub-bucket range
+#define SUB_BUCKET_HALF_BITS 6
+
+/**
+ * Returns the index of the most significant set bit of a non-zero value.
+ */
+static unsigned int msb_index(uint64_t value)
+{
+#if defined(__GNUC__)
+  return 63u - (unsigned int) __builtin_clzll(value);
+#else
+  unsigned int index = 0;
+  while (value >>= 1) {
+    index++;
+  }
+  return index;
+#endif
+}
+
+void latency_histogram_init(latency_histogram_t *h)
+{
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+size_t latency_histogram_bucket_index(uint64_t value_ns)
+{
+  if (value_ns < LATENCY_HISTOGRAM_SUB_BUCKETS) {
+    return (size_t) value_ns;
+  }
+  unsigned int shift = msb_index(value_ns) - SUB_BUCKET_HALF_BITS;
+  return LATENCY_HISTOGRAM_SUB_BUCKETS
+         + (size_t) (shift - 1) * HALF_SUB_BUCKETS
+         + (size_t) ((value_ns >> shift) - HALF_SUB_BUCKETS);
+}
+
+uint64_t latency_histogram_bucket_low(size_t index)
+{
+  if (index < LATENCY_HISTOGRAM_SUB_BUCKETS) {
+    return (uint64_t) index;
+  }
+  size_t rel = index - LATENCY_HISTOGRAM_SUB_BUCKETS;
+  unsigned int shift = (unsigned int) (rel / HALF_SUB_BUCKETS) + 1;
+  uint64_t sub = HALF_SUB_BUCKETS + rel % HALF_SUB_BUCKETS;
+  return sub << shift;
+}
+
+uint64_t latency_histogram_bucket_high(size_t index)
+{
+  if (index < LATENCY_HISTOGRAM_SUB_BUCKETS) {
+    return (uint64_t) index;
+  }
+  unsigned int shift =
+    (unsigned int) ((index - LATENCY_HISTOGRAM_SUB_BUCKETS) / HALF_SUB_BUCKETS) + 1;
+  return latency_histogram_bucket_low(index) + ((UINT64_C(1) << shift) - 1);
+}
+
+void latency_histogram_record(latency_histogram_t *h, uint64_t value_ns)
+{
+  h->counts[latency_histogram_bucket_index(value_ns)]++;
+  h->total_count++;
+  h->sum += value_ns;
+  if (value_ns < h->min) {
+    h->min = value_ns;
+  }
+  if (value_ns > h->max) {
+    h->max = value_ns;
+  }
+}
+
+void latency_histogram_merge(latency_histogram_t *dst, const latency_histogram_t *src)
+{
+  if (src->total_count == 0) {
+    return;
+  }
+  for (size_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->total_count += src->total_count;
+  dst->sum += src->sum;
+  if (src->min < dst->min) {
+    dst->min = src->min;
+  }
+  if (src->max > dst->max) {
+    dst->max = src->max;
+  }
+}
+
+uint64_t latency_histogram_percentile(const latency_histogram_t *h, double percentile)
+{
+  if (h->total_count == 0) {
+    return 0;
+  }
+  if (percentile < 0.0) {
+    percentile = 0.0;
+  }
+  if (percentile > 100.0) {
+    percentile = 100.0;
+  }
+  // the rank of the value we want, counting from 1
+  uint64_t rank = (uint64_t) ((percentile / 100.0) * (double) h->total_count + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      uint64_t high = latency_histogram_bucket_high(i);
+      // never report beyond what was actually recorded
+      return high < h->max ? high : h->max;
+    }
+  }
+  return h->max;
+}
+
+uint64_t latency_histogram_mean(const latency_histogram_t *h)
+{
+  return h->total_count ? h->sum / h->total_count : 0;
+}
+
+bool latency_histogram_print(const latency_histogram_t *h, const char *label, int fd)
+{
+  if (!h || fd < 0) {
+    return false;
+  }
+  const double us = 1000.0;
+  int result = dprintf(fd,
+    "%-28s count=%-10llu min=%.1fus mean=%.1fus p50=%.1fus p90=%.1fus "
+    "p99=%.1fus p99.9=%.1fus max=%.1fus\n",
+    label ? label : "",
+    (unsigned long long) h->total_count,
+    h->total_count ? (double) h->min / us : 0.0,
+    (double) latency_histogram_mean(h) / us,
+    (double) latency_histogram_percentile(h, 50.0) / us,
+    (double) latency_histogram_percentile(h, 90.0) / us,
+    (double) latency_histogram_percentile(h, 99.0) / us,
+    (double) latency_histogram_percentile(h, 99.9) / us,
+    (double) h->max / us);
+  return result >= 0;
+}
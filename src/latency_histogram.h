@@ -0,0 +1,55 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+/**
+ * @file latency_histogram.h
+ * @brief HdrHistogram-style latency histogram.
+ *
+ * Values (nanoseconds) are recorded into log-linear buckets: every power
+ * of two is split into LATENCY_HISTOGRAM_SUB_BUCKETS / 2 linear sub-buckets,
+ * so any recorded value is reported with a relative error of at most 1/64
+ * (about 1.6%), across the full 64-bit range, in constant time and memory.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LATENCY_HISTOGRAM_SUB_BUCKETS 128
+#define LATENCY_HISTOGRAM_BUCKETS \
+  (LATENCY_HISTOGRAM_SUB_BUCKETS + 57 * (LATENCY_HISTOGRAM_SUB_BUCKETS / 2))
+
+typedef struct {
+  uint64_t counts[LATENCY_HISTOGRAM_BUCKETS];
+  uint64_t total_count;
+  uint64_t min;       // smallest recorded value (UINT64_MAX if empty)
+  uint64_t max;       // largest recorded value
+  uint64_t sum;       // sum of recorded values, for the mean
+} latency_histogram_t;
+
+// reset a histogram to the empty state
+void latency_histogram_init(latency_histogram_t *h);
+
+// record a single value, in nanoseconds
+void latency_histogram_record(latency_histogram_t *h, uint64_t value_ns);
+
+// add all counts in src into dst
+void latency_histogram_merge(latency_histogram_t *dst, const latency_histogram_t *src);
+
+// value at the given percentile (0.0 - 100.0); 0 if the histogram is empty.
+// The result is the highest value equivalent to the bucket holding the percentile.
+uint64_t latency_histogram_percentile(const latency_histogram_t *h, double percentile);
+
+// mean of recorded values; 0 if the histogram is empty
+uint64_t latency_histogram_mean(const latency_histogram_t *h);
+
+// bucket index a value is counted in, and the bounds of a bucket
+size_t latency_histogram_bucket_index(uint64_t value_ns);
+uint64_t latency_histogram_bucket_low(size_t index);
+uint64_t latency_histogram_bucket_high(size_t index);
+
+// write a one-line summary (count, min, mean, p50/p90/p99/p99.9, max; in
+// microseconds) prefixed with label to fd. returns true on success.
+bool latency_histogram_print(const latency_histogram_t *h, const char *label, int fd);
+
+#endif // LATENCY_HISTOGRAM_H
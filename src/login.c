@@ -1,11 +1,19 @@
 #include "login.h"
+#include "login_machine.h"
+#include "account_cache.h"
+#include "audit_log.h"
+#include "db_backend.h"
 #include "logging.h"
+#include "login_admission.h"
+#include "login_span.h"
+#include "login_stats.h"
+#include "login_trace.h"
+#include "userid_filter.h"
+#include "userid_key.h"
 
+#include <string.h>
 #include <unistd.h>
 
-// From stubs.c
-bool account_lookup_by_userid(const char *userid, account_t *acc);
-
 /**
  * Attempts to write() to the client file descriptor.
  * 
@@ -18,7 +26,7 @@ bool account_lookup_by_userid(const char *userid, account_t *acc);
  *                          to client
  * \param msg_size          The number of bytes required to store msg
  */
-int write_to_client(int client_output_fd, char *msg, size_t msg_size) 
+int write_to_client(int client_output_fd, const char *msg, size_t msg_size) 
 {
   ssize_t write_result = write(client_output_fd, msg, msg_size);
   
@@ -39,20 +47,32 @@ int write_to_client(int client_output_fd, char *msg, size_t msg_size)
   return 0;
 }
 
+/**
+ * Ends a stage that began at start, for login_stats and, if login is
+ * traced, as one of its spans. Returns the time, to start the next stage.
+ */
+static uint64_t stage_done(uint64_t login, login_stage_t stage, uint64_t start)
+{
+  uint64_t now = login_stats_stage_done(stage, start);
+  login_span_record(login, login_stage_name(stage), start, now);
+  return now;
+}
+
 /**
  * Handles sending of output to client, recording login result to account, 
  * logging a message containing the login result and userid of user who
  * made the login attempt. 
  * 
  * On success, records login result and returns the login_result_t 
- * specificed by login_result.
+ * specificed by login_result. A login_result of LOGIN_FAIL_INTERNAL_ERROR
+ * (a login shed by admission control) is not recorded against the account.
  * 
  * On failure, does NOT record login result, and returns 
  * LOGIN_FAIL_INTERNAL_ERROR.
  * 
  * Should be called after idenitfying the appropriate login_result_t to return.
  * 
- * \param userid            The null-terminated string containing the userid
+ * \param key               The userid, made into a key
  * \param acc               A poitner to a valid account_t struct
  * \param client_ip         IPv4 address of the client
  * \param client_output_fd  Open and writable file descriptor used to send 
@@ -61,102 +81,228 @@ int write_to_client(int client_output_fd, char *msg, size_t msg_size)
  * \param client_msg_size   The number of bytes required to store client_msg
  * \param login_result      A login_result_t specifying which login result value 
  *                          to return on wrte() success
- * \param log_msg           A string containing exactly one "%s" to insert the 
+ * \param log_msg           A string containing exactly one "%.*s" to insert the 
  *                          userid into
  * 
  */
-login_result_t handle_login_result(const char *userid, account_t *acc,
+login_result_t handle_login_result(const userid_key_t *key, account_t *acc,
                          ip4_addr_t client_ip, int client_output_fd,
-                         char* client_msg, size_t client_msg_size,
-                         login_result_t login_result, char* log_msg) 
+                         const char* client_msg, size_t client_msg_size,
+                         login_result_t login_result, const char* log_msg) 
 {
+  uint64_t respond_start = login_stats_now();
+  uint64_t span_start = login_span_start();
   if (write_to_client(client_output_fd, client_msg, client_msg_size)) {
-    log_message(LOG_INFO, "LOGIN FAILED INTERNAL ERROR: user_id: %s\n");
+    log_message(LOG_INFO, "LOGIN FAILED INTERNAL ERROR: user_id: %.*s\n",
+                (int) key->len, key->str);
+    stage_done(login_span_current(), LOGIN_STAGE_RESPOND, respond_start);
     return LOGIN_FAIL_INTERNAL_ERROR;
   }
+  span_start = login_span_end("write", span_start);
   
-  if (login_result == LOGIN_SUCCESS) {
-    account_record_login_success(acc, client_ip);
-  }
-  else {
-    account_record_login_failure(acc);
+  // a login shed before its password was checked is not an attempt
+  if (login_result != LOGIN_FAIL_INTERNAL_ERROR) {
+    if (login_result == LOGIN_SUCCESS) {
+      account_record_login_success(acc, client_ip);
+    }
+    else {
+      account_record_login_failure(acc);
+    }
+    if (login_result != LOGIN_FAIL_USER_NOT_FOUND) {
+      db_backend_record_login(acc);
+    }
   }
+  span_start = login_span_end("record", span_start);
   
-  log_message(LOG_INFO, log_msg, userid);
+  log_message(LOG_INFO, log_msg, (int) key->len, key->str);
+  login_span_end("log", span_start);
+  stage_done(login_span_current(), LOGIN_STAGE_RESPOND, respond_start);
   return login_result;
 }
 
-// Refer to login.h for documentation
-login_result_t handle_login(const char *userid, const char *password,
-                            ip4_addr_t client_ip, time_t login_time,
-                            int client_output_fd,
-                            login_session_data_t *session)
+/**
+ * Ends the login in m with the given result: the client is sent reply and
+ * log_msg (with one "%.*s" for the userid) is logged once m responds.
+ */
+static void conclude(login_machine_t *m, login_result_t result, const char *reply,
+                     const char *log_msg)
 {
-  account_t acc;
-  log_message(LOG_INFO, "ATTEMPTING LOGIN: userid = %s\n", userid);
-  /*
-    For defining client messages for all of the below:
+  m->result = result;
+  m->reply = reply;
+  m->log_msg = log_msg;
+  m->state = LOGIN_STATE_RESPOND;
+}
 
-    Init msg as a char array (NOT A CHAR POINTER) so it's size is defined 
-    at compile time enabling sizeof() to return it's number of bytes 
-    before passing.
-    
-    Size cannot be determined after passing as sizeof() cannot determine
-    size of array from a pointer to the array.
-  */ 
-  if (!account_lookup_by_userid(userid, &acc)) {
-    char msg[] = "Login failed. Incorrect username.";
-    size_t msg_size = sizeof(msg);
-    return handle_login_result(userid, &acc, client_ip, client_output_fd, 
-                              msg, msg_size, LOGIN_FAIL_USER_NOT_FOUND, 
-                              "LOGIN FAIL USER NOT FOUND: user_id = %s\n");
+bool login_machine_start(login_machine_t *m, const char *userid, const char *password,
+                         ip4_addr_t client_ip, time_t login_time, int client_output_fd,
+                         login_session_data_t *session)
+{
+  *m = (login_machine_t) {
+    .userid = userid, .password = password, .client_ip = client_ip,
+    .login_time = login_time, .client_output_fd = client_output_fd, .session = session,
+    .arrival = login_trace_now(), .start = login_stats_now(), .span = login_span_sample()
+  };
+  // measured and hashed once here; every later stage takes the key
+  bool valid = userid_key_init(&m->key, userid);
+  log_message(LOG_INFO, "ATTEMPTING LOGIN: userid = %.*s\n", (int) m->key.len, m->key.str);
+  // stage timestamps for login_stats; 0 when stats are disabled
+  m->stage_start = m->start;
+  // user IDs the filter rules out are not looked up at all
+  if (!valid || !userid_filter_may_contain_key(&m->key)) {
+    login_machine_lookup_done(m, false);
+    return false;
+  }
+  if (account_cache_probe_key(&m->key, &m->acc, &m->miss)) {
+    m->found = true;
+    m->stage_start = stage_done(m->span, LOGIN_STAGE_LOOKUP, m->stage_start);
+    m->state = LOGIN_STATE_CHECKS;
+    return false;
+  }
+  m->state = LOGIN_STATE_LOOKUP;
+  return true;
+}
+
+void login_machine_lookup_done(login_machine_t *m, bool found)
+{
+  account_cache_fill(&m->key, &m->miss, found, &m->acc);
+  m->found = found;
+  m->stage_start = stage_done(m->span, LOGIN_STAGE_LOOKUP, m->stage_start);
+  m->state = LOGIN_STATE_CHECKS;
+}
+
+/**
+ * Whether the account in m exists and may log in at all; if not, concludes
+ * the login with the reason.
+ */
+static bool account_may_log_in(login_machine_t *m)
+{
+  if (!m->found) {
+    conclude(m, LOGIN_FAIL_USER_NOT_FOUND, "Login failed. Incorrect username.",
+             "LOGIN FAIL USER NOT FOUND: user_id = %.*s\n");
+    return false;
   }
   log_message(LOG_DEBUG, "LOGIN USERID OK");
-  if (account_is_banned(&acc)) {
-    char msg[] = "Login failed. Account is banned."; 
-    size_t msg_size = sizeof(msg);
-    return handle_login_result(userid, &acc, client_ip, client_output_fd, 
-                              msg, msg_size, LOGIN_FAIL_ACCOUNT_BANNED, 
-                              "LOGIN FAIL ACCOUNT BANNED: user_id = %s\n");
+  if (account_is_banned(&m->acc)) {
+    conclude(m, LOGIN_FAIL_ACCOUNT_BANNED, "Login failed. Account is banned.",
+             "LOGIN FAIL ACCOUNT BANNED: user_id = %.*s\n");
+    return false;
   }
   log_message(LOG_DEBUG, "LOGIN BANNED OK");
-  if (account_is_expired(&acc)) {
-    char msg[] = "Login failed. Account has expired."; 
-    size_t msg_size = sizeof(msg);
-    return handle_login_result(userid, &acc, client_ip, client_output_fd, 
-                              msg, msg_size, LOGIN_FAIL_ACCOUNT_EXPIRED, 
-                              "LOGIN FAIL ACCOUNT EXPIRED: user_id = %s\n");
+  if (account_is_expired(&m->acc)) {
+    conclude(m, LOGIN_FAIL_ACCOUNT_EXPIRED, "Login failed. Account has expired.",
+             "LOGIN FAIL ACCOUNT EXPIRED: user_id = %.*s\n");
+    return false;
   }
   log_message(LOG_DEBUG, "LOGIN EXPIRED OK");
-  if (acc.login_fail_count > 10) {
-    char msg[] = "Login failed. Exceeded maximum failed login attempts."; 
-    size_t msg_size = sizeof(msg);
-    return handle_login_result(userid, &acc, client_ip, client_output_fd, 
-                              msg, msg_size, LOGIN_FAIL_IP_BANNED, 
-                              "LOGIN FAIL IP BANNED: user_id = %s\n");
+  if (m->acc.login_fail_count > 10) {
+    conclude(m, LOGIN_FAIL_IP_BANNED, "Login failed. Exceeded maximum failed login attempts.",
+             "LOGIN FAIL IP BANNED: user_id = %.*s\n");
+    return false;
   }
   log_message(LOG_DEBUG, "LOGIN ATTEMPTS OK");
-  if (!account_validate_password(&acc, password)) {
-    char msg[] = "Login failed. Incorrect password."; 
-    size_t msg_size = sizeof(msg);
-    return handle_login_result(userid, &acc, client_ip, client_output_fd, 
-                              msg, msg_size, LOGIN_FAIL_BAD_PASSWORD, 
-                              "LOGIN FAIL BAD PASSWORD: user_id = %s\n");
+  return true;
+}
+
+/**
+ * The CHECKS stage: whether the account exists and may log in at all. The
+ * stage is closed however the checks come out.
+ */
+static void run_checks(login_machine_t *m)
+{
+  bool may_log_in = account_may_log_in(m);
+  m->stage_start = stage_done(m->span, LOGIN_STAGE_CHECKS, m->stage_start);
+  if (may_log_in) {
+    m->state = LOGIN_STATE_HASH;
+  }
+}
+
+/**
+ * The HASH stage: check the password.
+ */
+static void run_hash(login_machine_t *m)
+{
+  // hashing is the expensive part: when it is saturated, wait for a turn
+  // or be turned away at once rather than queue without limit
+  bool admitted = login_admission_enter(m->client_ip);
+  m->stage_start = stage_done(m->span, LOGIN_STAGE_ADMIT, m->stage_start);
+  if (!admitted) {
+    conclude(m, LOGIN_FAIL_INTERNAL_ERROR, "Login failed. Server busy, please try again later.",
+             "LOGIN SHED, SERVER BUSY: user_id = %.*s\n");
+    return;
+  }
+  bool password_ok = account_validate_password(&m->acc, m->password);
+  login_admission_leave();
+  stage_done(m->span, LOGIN_STAGE_HASH, m->stage_start);
+  if (!password_ok) {
+    conclude(m, LOGIN_FAIL_BAD_PASSWORD, "Login failed. Incorrect password.",
+             "LOGIN FAIL BAD PASSWORD: user_id = %.*s\n");
+    return;
   }
   log_message(LOG_DEBUG, "LOGIN PASSWORD OK");
-  
-  char msg[] = "Login successful.";
-  size_t msg_size = sizeof(msg);
-  login_result_t login_result = handle_login_result(userid, &acc, client_ip, 
-                              client_output_fd, msg, msg_size, LOGIN_SUCCESS, 
-                              "LOGIN SUCCESS: user_id: %s\n");
-  
-  if (login_result == LOGIN_SUCCESS) { 
+  conclude(m, LOGIN_SUCCESS, "Login successful.", "LOGIN SUCCESS: user_id: %.*s\n");
+}
+
+/**
+ * The RESPOND stage: tell the client, record the result and, on success,
+ * fill in the session.
+ */
+static void respond(login_machine_t *m)
+{
+  // the reply is sent with its terminator, as it always has been
+  login_result_t login_result = handle_login_result(&m->key, &m->acc, m->client_ip,
+                                                    m->client_output_fd, m->reply,
+                                                    strlen(m->reply) + 1, m->result,
+                                                    m->log_msg);
+  if (login_result == LOGIN_SUCCESS) {
+    login_admission_note_success(m->client_ip);
     /* Conversion from long int to int here seems wrong but both types are 
     defined in the provided header files thus cannot be changed. */
-    session->account_id = (int) acc.account_id;     
-    session->session_start = login_time;
-    session->expiration_time = acc.expiration_time;
+    m->session->account_id = (int) m->acc.account_id;
+    m->session->session_start = m->login_time;
+    m->session->expiration_time = m->acc.expiration_time;
   }
-  return login_result;
+  m->result = login_result;
+  stage_done(m->span, LOGIN_STAGE_TOTAL, m->start);
+  login_stats_record_result(login_result);
+  login_trace_record(m->userid, login_result, m->client_ip, m->login_time, m->arrival);
+  audit_log_record(m->userid, login_result, m->client_ip, m->login_time);
+  m->state = LOGIN_STATE_DONE;
+}
+
+login_result_t login_machine_run(login_machine_t *m)
+{
+  // the steps inside the stages record their spans against the login
+  uint64_t outer = login_span_enter(m->span);
+  while (m->state != LOGIN_STATE_DONE) {
+    switch (m->state) {
+    case LOGIN_STATE_LOOKUP:
+      // nobody fetched the account for us: fetch it synchronously
+      login_machine_lookup_done(m, db_backend_lookup_key(&m->key, &m->acc));
+      break;
+    case LOGIN_STATE_CHECKS:
+      run_checks(m);
+      break;
+    case LOGIN_STATE_HASH:
+      run_hash(m);
+      break;
+    case LOGIN_STATE_RESPOND:
+      respond(m);
+      break;
+    case LOGIN_STATE_DONE:
+      break;
+    }
+  }
+  login_span_leave(outer);
+  return m->result;
+}
+
+// Refer to login.h for documentation
+login_result_t handle_login(const char *userid, const char *password,
+                            ip4_addr_t client_ip, time_t login_time,
+                            int client_output_fd,
+                            login_session_data_t *session)
+{
+  login_machine_t m;
+  login_machine_start(&m, userid, password, client_ip, login_time, client_output_fd, session);
+  return login_machine_run(&m);
 }
@@ -0,0 +1,328 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "login_admission.h"
+#include "logging.h"
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define RECENT_BITS 12
+#define RECENT_SLOTS (1u << RECENT_BITS)
+#define NS_PER_MS UINT64_C(1000000)
+
+enum { LANE_NORMAL, LANE_PRIORITY, LANE_COUNT };
+enum { WAITING, ADMITTED, SHED };
+
+typedef struct waiter {
+  struct waiter *next;
+  pthread_cond_t wake;
+  uint64_t enqueued_ns;
+  int state;
+} waiter_t;
+
+typedef struct {
+  waiter_t *head;
+  waiter_t *tail;
+} lane_t;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool enabled = false;
+// the rest guarded by mutex
+static unsigned int max_concurrent;
+static unsigned int max_queue;
+static uint64_t target_ns;
+static uint64_t interval_ns;
+static unsigned int in_flight;
+static unsigned int waiting;
+static lane_t lanes[LANE_COUNT];
+
+// CoDel state (RFC 8289)
+static uint64_t first_above_ns;   // when the wait will have been over target for an interval
+static bool dropping;
+static unsigned int drop_count;
+static uint64_t drop_next_ns;
+
+/*
+ * Recent successful logins, one per slot by hash of the IP address: the
+ * address in the high half and the time (in seconds, plus one so that 0
+ * means empty) in the low half. A collision just forgets a client early.
+ */
+static _Atomic uint64_t recent[RECENT_SLOTS];
+static atomic_uint recent_window_s;
+
+static _Atomic uint64_t admitted = 0;
+static _Atomic uint64_t admitted_priority = 0;
+static _Atomic uint64_t queued = 0;
+static _Atomic uint64_t shed_queue_full = 0;
+static _Atomic uint64_t shed_delay = 0;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static unsigned int recent_slot(ip4_addr_t ip)
+{
+  return (uint32_t) (ip * 2654435761u) >> (32 - RECENT_BITS);
+}
+
+static bool is_recent(ip4_addr_t ip, uint64_t now)
+{
+  uint64_t entry = atomic_load_explicit(&recent[recent_slot(ip)], memory_order_relaxed);
+  uint32_t stamp = (uint32_t) entry;
+  uint32_t now_s = (uint32_t) (now / 1000000000u) + 1;
+  return stamp != 0 && (ip4_addr_t) (entry >> 32) == ip
+         && now_s - stamp < atomic_load_explicit(&recent_window_s, memory_order_relaxed);
+}
+
+static uint64_t isqrt(uint64_t n)
+{
+  uint64_t x = n;
+  uint64_t y = (x + 1) / 2;
+  while (y < x) {
+    x = y;
+    y = (x + n / x) / 2;
+  }
+  return x;
+}
+
+static void push(lane_t *lane, waiter_t *w)
+{
+  w->next = NULL;
+  if (lane->tail) {
+    lane->tail->next = w;
+  }
+  else {
+    lane->head = w;
+  }
+  lane->tail = w;
+  waiting++;
+}
+
+static waiter_t *pop(lane_t *lane)
+{
+  waiter_t *w = lane->head;
+  if (w) {
+    lane->head = w->next;
+    if (!lane->head) {
+      lane->tail = NULL;
+    }
+    waiting--;
+  }
+  return w;
+}
+
+static void finish(waiter_t *w, int state)
+{
+  w->state = state;
+  pthread_cond_signal(&w->wake);
+}
+
+/**
+ * CoDel's decision for a waiter leaving the normal lane at now: whether to
+ * shed it. Caller holds the mutex.
+ */
+static bool should_shed(const waiter_t *w, uint64_t now)
+{
+  bool over = false;
+  if (now - w->enqueued_ns < target_ns) {
+    first_above_ns = 0;
+  }
+  else if (first_above_ns == 0) {
+    first_above_ns = now + interval_ns;
+  }
+  else if (now >= first_above_ns) {
+    over = true;
+  }
+
+  if (dropping) {
+    if (!over) {
+      dropping = false;
+      return false;
+    }
+    if (now >= drop_next_ns) {
+      drop_count++;
+      drop_next_ns += interval_ns / isqrt(drop_count);
+      return true;
+    }
+    return false;
+  }
+  if (over) {
+    dropping = true;
+    // pick up near the previous rate if shedding stopped only recently
+    drop_count = drop_count > 2 && now - drop_next_ns < 16 * interval_ns ? drop_count - 2 : 1;
+    drop_next_ns = now + interval_ns / isqrt(drop_count);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Admits waiters while there is room, priority lane first, shedding those
+ * CoDel says to. Caller holds the mutex.
+ */
+static void admit_waiters(void)
+{
+  uint64_t now = now_ns();
+  while (in_flight < max_concurrent) {
+    waiter_t *w = pop(&lanes[LANE_PRIORITY]);
+    if (w) {
+      atomic_fetch_add_explicit(&admitted_priority, 1, memory_order_relaxed);
+    }
+    else {
+      w = pop(&lanes[LANE_NORMAL]);
+      if (!w) {
+        // an empty queue is a good queue
+        first_above_ns = 0;
+        dropping = false;
+        return;
+      }
+      if (should_shed(w, now)) {
+        atomic_fetch_add_explicit(&shed_delay, 1, memory_order_relaxed);
+        finish(w, SHED);
+        continue;
+      }
+    }
+    in_flight++;
+    atomic_fetch_add_explicit(&admitted, 1, memory_order_relaxed);
+    finish(w, ADMITTED);
+  }
+}
+
+bool login_admission_configure(const login_admission_options_t *opts)
+{
+  login_admission_options_t resolved = { 0 };
+  if (opts) {
+    resolved = *opts;
+    if (resolved.max_concurrent == 0) {
+      resolved.max_concurrent = thread_pool_cpu_count();
+    }
+    if (resolved.max_queue == 0) {
+      resolved.max_queue = LOGIN_ADMISSION_DEFAULT_QUEUE;
+    }
+    if (resolved.target_ms == 0) {
+      resolved.target_ms = LOGIN_ADMISSION_DEFAULT_TARGET_MS;
+    }
+    if (resolved.interval_ms == 0) {
+      resolved.interval_ms = LOGIN_ADMISSION_DEFAULT_INTERVAL_MS;
+    }
+    if (resolved.recent_success_s == 0) {
+      resolved.recent_success_s = LOGIN_ADMISSION_DEFAULT_RECENT_S;
+    }
+    if (resolved.target_ms >= resolved.interval_ms) {
+      log_message(LOG_ERROR, "Login admission: target (%u ms) must be shorter than interval (%u ms)",
+                  resolved.target_ms, resolved.interval_ms);
+      return false;
+    }
+  }
+
+  pthread_mutex_lock(&mutex);
+  if (opts) {
+    max_concurrent = resolved.max_concurrent;
+    max_queue = resolved.max_queue;
+    target_ns = resolved.target_ms * NS_PER_MS;
+    interval_ns = resolved.interval_ms * NS_PER_MS;
+    atomic_store(&recent_window_s, resolved.recent_success_s);
+    first_above_ns = 0;
+    dropping = false;
+    drop_count = 0;
+    admit_waiters();
+  }
+  else {
+    // admit everyone waiting, and stop counting logins in flight
+    for (int lane = 0; lane < LANE_COUNT; lane++) {
+      waiter_t *w;
+      while ((w = pop(&lanes[lane])) != NULL) {
+        atomic_fetch_add_explicit(&admitted, 1, memory_order_relaxed);
+        finish(w, ADMITTED);
+      }
+    }
+    in_flight = 0;
+  }
+  atomic_store(&enabled, opts != NULL);
+  pthread_mutex_unlock(&mutex);
+  return true;
+}
+
+bool login_admission_enter(ip4_addr_t client_ip)
+{
+  if (!atomic_load(&enabled)) {
+    return true;
+  }
+  uint64_t now = now_ns();
+  bool priority = is_recent(client_ip, now);
+
+  pthread_mutex_lock(&mutex);
+  if (in_flight < max_concurrent && waiting == 0) {
+    in_flight++;
+    pthread_mutex_unlock(&mutex);
+    atomic_fetch_add_explicit(&admitted, 1, memory_order_relaxed);
+    return true;
+  }
+  if (waiting >= max_queue) {
+    pthread_mutex_unlock(&mutex);
+    atomic_fetch_add_explicit(&shed_queue_full, 1, memory_order_relaxed);
+    return false;
+  }
+  if (dropping && !priority) {
+    // the queue is standing: don't make this login wait only to be shed
+    pthread_mutex_unlock(&mutex);
+    atomic_fetch_add_explicit(&shed_delay, 1, memory_order_relaxed);
+    return false;
+  }
+  waiter_t w = { .enqueued_ns = now, .state = WAITING };
+  pthread_cond_init(&w.wake, NULL);
+  push(&lanes[priority ? LANE_PRIORITY : LANE_NORMAL], &w);
+  atomic_fetch_add_explicit(&queued, 1, memory_order_relaxed);
+  while (w.state == WAITING) {
+    pthread_cond_wait(&w.wake, &mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+  pthread_cond_destroy(&w.wake);
+  return w.state == ADMITTED;
+}
+
+void login_admission_leave(void)
+{
+  if (!atomic_load(&enabled)) {
+    return;
+  }
+  pthread_mutex_lock(&mutex);
+  // logins admitted before admission control was last turned on were
+  // never counted
+  if (in_flight > 0) {
+    in_flight--;
+  }
+  admit_waiters();
+  pthread_mutex_unlock(&mutex);
+}
+
+void login_admission_note_success(ip4_addr_t client_ip)
+{
+  if (!atomic_load(&enabled)) {
+    return;
+  }
+  uint32_t now_s = (uint32_t) (now_ns() / 1000000000u) + 1;
+  atomic_store_explicit(&recent[recent_slot(client_ip)], (uint64_t) client_ip << 32 | now_s,
+                        memory_order_relaxed);
+}
+
+void login_admission_get_stats(login_admission_stats_t *stats)
+{
+  if (!stats) {
+    return;
+  }
+  stats->admitted = atomic_load(&admitted);
+  stats->admitted_priority = atomic_load(&admitted_priority);
+  stats->queued = atomic_load(&queued);
+  stats->shed_queue_full = atomic_load(&shed_queue_full);
+  stats->shed_delay = atomic_load(&shed_delay);
+  pthread_mutex_lock(&mutex);
+  stats->in_flight = in_flight;
+  stats->waiting = waiting;
+  pthread_mutex_unlock(&mutex);
+}
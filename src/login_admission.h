@@ -0,0 +1,77 @@
+#ifndef LOGIN_ADMISSION_H
+#define LOGIN_ADMISSION_H
+
+/**
+ * @file login_admission.h
+ * @brief Admission control in front of password hashing in handle_login().
+ *
+ * Only max_concurrent logins hash a password at once; the rest wait in a
+ * bounded queue, and are shed (handle_login() answers them with
+ * LOGIN_FAIL_INTERNAL_ERROR and a "try again later" message, without
+ * counting a failed attempt against the account) rather than queueing
+ * without limit.
+ *
+ * The queue is managed CoDel-style: as long as waiting times stay under
+ * target_ms, or only exceed it briefly, everyone is served. Once they have
+ * stayed over the target for interval_ms the queue is standing rather than
+ * absorbing a burst, so waiters are shed, at a rate increasing with the
+ * square root of the number shed, until waiting times fall below the
+ * target again; new arrivals are shed at once meanwhile. Latency therefore
+ * stays near the target under overload instead of growing with the queue.
+ *
+ * Clients (by IP address) with a successful login in the last
+ * recent_success_s seconds queue in a priority lane, which is served
+ * first and only shed when the queue is full.
+ *
+ * Admission control is off (every login is admitted at once) until
+ * login_admission_configure() turns it on.
+ */
+
+#include "account.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LOGIN_ADMISSION_DEFAULT_QUEUE 64
+#define LOGIN_ADMISSION_DEFAULT_TARGET_MS 5
+#define LOGIN_ADMISSION_DEFAULT_INTERVAL_MS 100
+#define LOGIN_ADMISSION_DEFAULT_RECENT_S 600
+
+typedef struct {
+  unsigned int max_concurrent;    // logins hashing at once (0 = number of online CPUs)
+  unsigned int max_queue;         // waiting logins (0 = LOGIN_ADMISSION_DEFAULT_QUEUE)
+  unsigned int target_ms;         // acceptable wait (0 = LOGIN_ADMISSION_DEFAULT_TARGET_MS)
+  unsigned int interval_ms;       // how long over target before shedding
+                                  // (0 = LOGIN_ADMISSION_DEFAULT_INTERVAL_MS)
+  unsigned int recent_success_s;  // priority window (0 = LOGIN_ADMISSION_DEFAULT_RECENT_S)
+} login_admission_options_t;
+
+typedef struct {
+  uint64_t admitted;              // including those admitted without waiting
+  uint64_t admitted_priority;     // from the priority lane
+  uint64_t queued;                // admissions that had to wait
+  uint64_t shed_queue_full;
+  uint64_t shed_delay;            // shed by the CoDel controller
+  unsigned int in_flight;         // currently admitted
+  unsigned int waiting;           // currently queued
+} login_admission_stats_t;
+
+// turn admission control on with opts, or off if opts is NULL. waiting
+// logins are admitted (not shed) when it is reconfigured. returns false
+// (after logging) if opts is invalid, leaving the configuration unchanged.
+bool login_admission_configure(const login_admission_options_t *opts);
+
+// wait for a turn to hash a password for a login from client_ip. returns
+// false if the login is shed; otherwise login_admission_leave() must be
+// called once hashing is done.
+bool login_admission_enter(ip4_addr_t client_ip);
+
+// end a turn begun by a successful login_admission_enter()
+void login_admission_leave(void);
+
+// note a successful login from client_ip, giving it priority for a while
+void login_admission_note_success(ip4_addr_t client_ip);
+
+void login_admission_get_stats(login_admission_stats_t *stats);
+
+#endif // LOGIN_ADMISSION_H
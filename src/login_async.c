@@ -0,0 +1,360 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "login_async.h"
+#include "db_backend.h"
+#include "logging.h"
+#include "login_machine.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct op {
+  struct op *next;               // on the free list or the completion queue
+  struct login_async *owner;
+  login_machine_t machine;
+  bool found;                    // the lookup's outcome, set by whoever completed it
+  char userid[USER_ID_LENGTH + 1];
+  char *password;
+  login_async_done_fn done;
+  void *ctx;
+} op_t;
+
+struct login_async {
+  op_t *ops;
+  op_t *free_list;               // owner thread only
+  size_t in_flight;
+  uint64_t submitted;
+  uint64_t completed;
+  uint64_t rejected;
+
+  pthread_mutex_t mutex;         // protects the completion queue
+  pthread_cond_t ready;
+  op_t *queue_head;
+  op_t *queue_tail;
+};
+
+/**
+ * Puts op on la's completion queue, from any thread.
+ */
+static void complete(login_async_t *la, op_t *op)
+{
+  op->next = NULL;
+  pthread_mutex_lock(&la->mutex);
+  if (la->queue_tail) {
+    la->queue_tail->next = op;
+  }
+  else {
+    la->queue_head = op;
+  }
+  la->queue_tail = op;
+  pthread_cond_signal(&la->ready);
+  pthread_mutex_unlock(&la->mutex);
+}
+
+static void lookup_done(void *ctx, bool found)
+{
+  op_t *op = ctx;
+  op->found = found;
+  complete(op->owner, op);
+}
+
+login_async_t *login_async_create(const login_async_options_t *opts)
+{
+  unsigned int capacity = opts && opts->max_in_flight ? opts->max_in_flight
+                                                      : LOGIN_ASYNC_DEFAULT_IN_FLIGHT;
+  login_async_t *la = calloc(1, sizeof(*la));
+  op_t *ops = calloc(capacity, sizeof(*ops));
+  if (!la || !ops) {
+    log_message(LOG_ERROR, "Memory allocation for asynchronous logins has failed");
+    free(la);
+    free(ops);
+    return NULL;
+  }
+  la->ops = ops;
+  for (unsigned int i = capacity; i-- > 0;) {
+    ops[i].owner = la;
+    ops[i].next = la->free_list;
+    la->free_list = &ops[i];
+  }
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&la->mutex, NULL);
+  pthread_cond_init(&la->ready, &attr);
+  pthread_condattr_destroy(&attr);
+  return la;
+}
+
+void login_async_destroy(login_async_t *la)
+{
+  if (!la) {
+    return;
+  }
+  while (la->in_flight > 0) {
+    login_async_poll(la, -1);
+  }
+  pthread_cond_destroy(&la->ready);
+  pthread_mutex_destroy(&la->mutex);
+  free(la->ops);
+  free(la);
+}
+
+bool login_async_submit(login_async_t *la, const char *userid, const char *password,
+                        ip4_addr_t client_ip, time_t login_time, int client_output_fd,
+                        login_session_data_t *session, login_async_done_fn done, void *ctx)
+{
+  op_t *op = la->free_list;
+  if (!op) {
+    la->rejected++;
+    return false;
+  }
+  char *password_copy = strdup(password ? password : "");
+  if (!password_copy) {
+    log_message(LOG_ERROR, "Memory allocation for asynchronous login has failed");
+    return false;
+  }
+  la->free_list = op->next;
+  la->in_flight++;
+  la->submitted++;
+
+  // a userid too long to be valid stays too long (and so not found)
+  size_t len = userid ? strnlen(userid, USER_ID_LENGTH) : 0;
+  memcpy(op->userid, userid ? userid : "", len);
+  op->userid[len] = '\0';
+  op->password = password_copy;
+  op->done = done;
+  op->ctx = ctx;
+  op->found = false;
+
+  if (login_machine_start(&op->machine, userid ? op->userid : NULL, op->password, client_ip,
+                          login_time, client_output_fd, session)) {
+    db_backend_lookup_async(&op->machine.key, &op->machine.acc, lookup_done, op);
+  }
+  else {
+    // answered without a lookup: ready to run at the next poll
+    complete(la, op);
+  }
+  return true;
+}
+
+size_t login_async_poll(login_async_t *la, int timeout_ms)
+{
+  pthread_mutex_lock(&la->mutex);
+  if (!la->queue_head && la->in_flight > 0 && timeout_ms != 0) {
+    if (timeout_ms < 0) {
+      while (!la->queue_head) {
+        pthread_cond_wait(&la->ready, &la->mutex);
+      }
+    }
+    else {
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec += timeout_ms / 1000;
+      deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      while (!la->queue_head
+             && pthread_cond_timedwait(&la->ready, &la->mutex, &deadline) == 0) {
+        continue;
+      }
+    }
+  }
+  op_t *ready = la->queue_head;
+  la->queue_head = NULL;
+  la->queue_tail = NULL;
+  pthread_mutex_unlock(&la->mutex);
+
+  size_t finished = 0;
+  while (ready) {
+    op_t *op = ready;
+    ready = op->next;
+    if (op->machine.state == LOGIN_STATE_LOOKUP) {
+      login_machine_lookup_done(&op->machine, op->found);
+    }
+    login_result_t result = login_machine_run(&op->machine);
+    if (op->done) {
+      op->done(op->ctx, result);
+    }
+
+    free(op->password);
+    op->password = NULL;
+    op->next = la->free_list;
+    la->free_list = op;
+    la->in_flight--;
+    la->completed++;
+    finished++;
+  }
+  return finished;
+}
+
+size_t login_async_in_flight(const login_async_t *la)
+{
+  return la->in_flight;
+}
+
+void login_async_get_stats(const login_async_t *la, login_async_stats_t *stats)
+{
+  if (!la || !stats) {
+    return;
+  }
+  stats->submitted = la->submitted;
+  stats->completed = la->completed;
+  stats->rejected = la->rejected;
+  stats->in_flight = la->in_flight;
+}
+
+#ifdef LOGIN_ASYNC_BENCH_MAIN
+
+#include "account_alloc.h"
+#include "account_store.h"
+#include "db_sim.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+typedef struct {
+  unsigned long logins;
+  unsigned long accounts;
+  unsigned int first;
+  int fd;
+} sync_worker_t;
+
+static double seconds_since(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *sync_worker(void *arg)
+{
+  sync_worker_t *w = arg;
+  for (unsigned long i = 0; i < w->logins; i++) {
+    char userid[32];
+    snprintf(userid, sizeof(userid), "user%lu", (w->first + i) % w->accounts);
+    login_session_data_t session;
+    handle_login(userid, "password", 0x7f000001, time(NULL), w->fd, &session);
+  }
+  return NULL;
+}
+
+static void count_done(void *ctx, login_result_t result)
+{
+  (void) result;
+  (*(unsigned long *) ctx)++;
+}
+
+/**
+ * Asynchronous login benchmark.
+ *
+ * Usage: app ACCOUNTS LOGINS LATENCY_US [IN_FLIGHT [THREADS]]
+ *
+ * Stores ACCOUNTS accounts (user0 onwards, password "password") in the
+ * account store behind a db_sim backend taking LATENCY_US per lookup, then
+ * times LOGINS logins made with handle_login() on THREADS threads (default
+ * 1), and LOGINS more made on one thread through login_async with up to
+ * IN_FLIGHT (default LOGIN_ASYNC_DEFAULT_IN_FLIGHT) in flight.
+ */
+int main(int argc, char **argv)
+{
+  if (argc < 4) {
+    dprintf(STDERR_FILENO, "usage: %s ACCOUNTS LOGINS LATENCY_US [IN_FLIGHT [THREADS]]\n",
+            argv[0]);
+    return 2;
+  }
+  unsigned long accounts = strtoul(argv[1], NULL, 10);
+  unsigned long logins = strtoul(argv[2], NULL, 10);
+  db_sim_options_t sim_opts = { .latency_us = (unsigned int) strtoul(argv[3], NULL, 10) };
+  login_async_options_t async_opts = {
+    .max_in_flight = argc > 4 ? (unsigned int) strtoul(argv[4], NULL, 10) : 0
+  };
+  unsigned int threads = argc > 5 ? (unsigned int) strtoul(argv[5], NULL, 10) : 1;
+  if (accounts == 0 || threads == 0) {
+    dprintf(STDERR_FILENO, "%s: ACCOUNTS and THREADS must be positive\n", argv[0]);
+    return 2;
+  }
+  int fd = open("/dev/null", O_WRONLY);
+  account_t *model = account_create("bench", "password", "bench@example.com", "2000-01-01");
+  db_sim_t *sim = db_sim_create(&sim_opts);
+  login_async_t *la = login_async_create(&async_opts);
+  pthread_t *tids = calloc(threads, sizeof(*tids));
+  sync_worker_t *workers = calloc(threads, sizeof(*workers));
+  if (fd == -1 || !model || !sim || !la || !tids || !workers) {
+    dprintf(STDERR_FILENO, "%s: failed to set up\n", argv[0]);
+    return 1;
+  }
+  // the password is hashed once and the hash shared
+  for (unsigned long i = 0; i < accounts; i++) {
+    account_t *acc = account_alloc();
+    if (!acc) {
+      return 1;
+    }
+    *acc = *model;
+    acc->account_id = (int64_t) i + 1;
+    snprintf(acc->userid, sizeof(acc->userid), "user%lu", i);
+    snprintf(acc->email, sizeof(acc->email), "user%lu@example.com", i);
+    if (!account_store_insert(acc)) {
+      account_release(acc);
+      return 1;
+    }
+  }
+  db_backend_t backend;
+  db_sim_backend(sim, &backend);
+  db_backend_set(&backend);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned int t = 0; t < threads; t++) {
+    workers[t] = (sync_worker_t) {
+      .logins = logins / threads + (t < logins % threads), .accounts = accounts,
+      .first = (unsigned int) (t * (logins / threads)), .fd = fd
+    };
+    pthread_create(&tids[t], NULL, sync_worker, &workers[t]);
+  }
+  for (unsigned int t = 0; t < threads; t++) {
+    pthread_join(tids[t], NULL);
+  }
+  double sync_s = seconds_since(&start);
+
+  unsigned long finished = 0;
+  // sessions are filled in on this thread, one login at a time, and unused
+  login_session_data_t session;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  unsigned long submitted = 0;
+  while (finished < logins) {
+    while (submitted < logins) {
+      char userid[32];
+      snprintf(userid, sizeof(userid), "user%lu", submitted % accounts);
+      if (!login_async_submit(la, userid, "password", 0x7f000001, time(NULL), fd, &session,
+                              count_done, &finished)) {
+        break;
+      }
+      submitted++;
+    }
+    login_async_poll(la, -1);
+  }
+  double async_s = seconds_since(&start);
+
+  db_sim_stats_t stats;
+  db_sim_get_stats(sim, &stats);
+  dprintf(STDOUT_FILENO, "handle_login, %u thread(s): %lu logins in %.2f s (%.0f/s)\n",
+          threads, logins, sync_s, sync_s > 0 ? (double) logins / sync_s : 0.0);
+  dprintf(STDOUT_FILENO, "login_async, 1 thread: %lu logins in %.2f s (%.0f/s), "
+          "at most %zu lookups in flight\n",
+          logins, async_s, async_s > 0 ? (double) logins / async_s : 0.0, stats.max_in_flight);
+
+  login_async_destroy(la);
+  db_backend_set(NULL);
+  db_sim_destroy(sim);
+  account_free(model);
+  free(tids);
+  free(workers);
+  close(fd);
+  return 0;
+}
+
+#endif // LOGIN_ASYNC_BENCH_MAIN
@@ -0,0 +1,81 @@
+#ifndef LOGIN_ASYNC_H
+#define LOGIN_ASYNC_H
+
+/**
+ * @file login_async.h
+ * @brief Many logins in flight on one thread, with asynchronous lookups.
+ *
+ * handle_login() holds its thread for the whole backend round trip of the
+ * account lookup. A login_async_t instead starts each submitted login as a
+ * state machine (see login_machine.h) and suspends it at the lookup, which
+ * it hands to the backend with db_backend_lookup_async(). Lookups complete
+ * (on whatever thread the backend likes) onto a completion queue, and
+ * login_async_poll() resumes the logins found there, running their checks,
+ * password hash and response on the polling thread. One thread can thus
+ * keep hundreds of logins waiting on the backend while it hashes.
+ *
+ * With a backend that only looks up synchronously, each lookup is done
+ * during login_async_submit(), so nothing is gained but nothing breaks.
+ *
+ * A login_async_t belongs to one thread: submit, poll and destroy are
+ * not thread-safe against each other.
+ *
+ * Built with -DLOGIN_ASYNC_BENCH_MAIN, login_async.c has a main() that
+ * compares it with handle_login() against a simulated-latency backend (see
+ * README.md and db_sim.h).
+ */
+
+#include "account.h"
+#include "login.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LOGIN_ASYNC_DEFAULT_IN_FLIGHT 256
+
+typedef struct login_async login_async_t;
+
+// called from login_async_poll() when a login is done, after its session
+// (on success) has been filled in
+typedef void (*login_async_done_fn)(void *ctx, login_result_t result);
+
+typedef struct {
+  unsigned int max_in_flight;   // logins in progress at once
+                                // (0 = LOGIN_ASYNC_DEFAULT_IN_FLIGHT)
+} login_async_options_t;
+
+typedef struct {
+  uint64_t submitted;
+  uint64_t completed;
+  uint64_t rejected;            // submissions refused with max_in_flight in flight
+  size_t in_flight;
+} login_async_stats_t;
+
+// opts may be NULL for defaults. returns NULL (after logging) on failure.
+login_async_t *login_async_create(const login_async_options_t *opts);
+
+// finish every login in flight (calling their done functions), then free
+// la. NULL is ignored.
+void login_async_destroy(login_async_t *la);
+
+// start a login with the parameters of handle_login(). userid and
+// password are copied; session must stay valid until done is called.
+// returns false, starting nothing, if max_in_flight logins are in flight
+// (poll to make room) or memory runs out.
+bool login_async_submit(login_async_t *la, const char *userid, const char *password,
+                        ip4_addr_t client_ip, time_t login_time, int client_output_fd,
+                        login_session_data_t *session, login_async_done_fn done, void *ctx);
+
+// resume the logins whose lookups have completed, running each to the end,
+// after waiting up to timeout_ms (-1 = as long as it takes, 0 = not at all)
+// for one if there are none yet. returns how many logins finished.
+size_t login_async_poll(login_async_t *la, int timeout_ms);
+
+// logins submitted and not yet finished
+size_t login_async_in_flight(const login_async_t *la);
+
+void login_async_get_stats(const login_async_t *la, login_async_stats_t *stats);
+
+#endif // LOGIN_ASYNC_H
@@ -0,0 +1,78 @@
+#ifndef LOGIN_MACHINE_H
+#define LOGIN_MACHINE_H
+
+/**
+ * @file login_machine.h
+ * @brief handle_login() as a resumable state machine.
+ *
+ * A login passes through four stages: LOOKUP (fetch the account), CHECKS
+ * (ban, expiry and failed-attempt checks), HASH (check the password) and
+ * RESPOND (tell the client and record the result). Only the lookup waits
+ * on anything but the CPU, so that is where a login can be suspended:
+ * login_machine_start() runs up to the lookup, answering it from the
+ * account cache if it can, and otherwise leaves the machine in
+ * LOGIN_STATE_LOOKUP for the caller to fetch the account however it likes
+ * (see db_backend_lookup_async()) and hand it over with
+ * login_machine_lookup_done(). login_machine_run() then runs the remaining
+ * stages.
+ *
+ * handle_login() drives one machine with a synchronous lookup;
+ * login_async.h drives many from one thread with asynchronous ones.
+ */
+
+#include "account.h"
+#include "account_cache.h"
+#include "login.h"
+#include "userid_key.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef enum {
+  LOGIN_STATE_LOOKUP,
+  LOGIN_STATE_CHECKS,
+  LOGIN_STATE_HASH,
+  LOGIN_STATE_RESPOND,
+  LOGIN_STATE_DONE
+} login_state_t;
+
+typedef struct {
+  login_state_t state;
+  // handle_login()'s parameters, not copied
+  const char *userid;
+  const char *password;
+  ip4_addr_t client_ip;
+  time_t login_time;
+  int client_output_fd;
+  login_session_data_t *session;
+
+  userid_key_t key;
+  account_t acc;                 // filled in by the lookup
+  account_cache_miss_t miss;     // for keeping what the lookup fetched
+  bool found;
+  login_result_t result;         // once the state is LOGIN_STATE_RESPOND
+  const char *reply;             // for the client
+  const char *log_msg;           // with one "%.*s" for the userid
+  uint64_t arrival;              // login_trace_now() when the login began
+  uint64_t start;                // login_stats timestamps
+  uint64_t stage_start;
+  uint64_t span;                 // login_span id (0 = not traced)
+} login_machine_t;
+
+// begin a login, with the parameters of handle_login(), which must stay
+// valid until the login is done. returns true if the account must be
+// fetched: look m->key up in the backend into m->acc, then call
+// login_machine_lookup_done().
+bool login_machine_start(login_machine_t *m, const char *userid, const char *password,
+                         ip4_addr_t client_ip, time_t login_time, int client_output_fd,
+                         login_session_data_t *session);
+
+// resume a login after its lookup, found or not
+void login_machine_lookup_done(login_machine_t *m, bool found);
+
+// run the login's remaining stages (including a synchronous lookup, if it
+// is still waiting for one) and return its result, as handle_login()
+login_result_t login_machine_run(login_machine_t *m);
+
+#endif // LOGIN_MACHINE_H
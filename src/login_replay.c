@@ -0,0 +1,295 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "login_replay.h"
+#include "login_trace.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NS_PER_SEC 1000000000ULL
+#define LATE_THRESHOLD_NS 1000000ULL
+
+typedef struct {
+  login_trace_reader_t reader;
+  pthread_mutex_t mutex;
+  bool failed;
+  bool started;                  // first_arrival_us has been read
+  uint64_t first_arrival_us;
+  struct timespec start;
+  const login_replay_options_t *opts;
+} replay_state_t;
+
+typedef struct {
+  replay_state_t *state;
+  login_replay_report_t *report;
+  pthread_t thread;
+} replay_worker_t;
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+  return (uint64_t) ts->tv_sec * NS_PER_SEC + (uint64_t) ts->tv_nsec;
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return timespec_ns(&ts);
+}
+
+static void report_init(login_replay_report_t *report)
+{
+  report->requests = 0;
+  report->mismatches = 0;
+  report->late = 0;
+  report->elapsed_ns = 0;
+  latency_histogram_init(&report->all);
+  for (size_t i = 0; i < LOGIN_RESULT_COUNT; i++) {
+    latency_histogram_init(&report->by_result[i]);
+  }
+}
+
+static void report_merge(login_replay_report_t *dst, const login_replay_report_t *src)
+{
+  dst->requests += src->requests;
+  dst->mismatches += src->mismatches;
+  dst->late += src->late;
+  latency_histogram_merge(&dst->all, &src->all);
+  for (size_t i = 0; i < LOGIN_RESULT_COUNT; i++) {
+    latency_histogram_merge(&dst->by_result[i], &src->by_result[i]);
+  }
+}
+
+/**
+ * Sleeps until the absolute CLOCK_MONOTONIC time deadline_ns.
+ */
+static void sleep_until(uint64_t deadline_ns)
+{
+  struct timespec deadline = {
+    .tv_sec = (time_t) (deadline_ns / NS_PER_SEC),
+    .tv_nsec = (long) (deadline_ns % NS_PER_SEC)
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    continue;
+  }
+}
+
+/**
+ * Replay worker: takes records off the shared reader in order and replays
+ * each one at its scheduled time.
+ */
+static void *replay_worker(void *arg)
+{
+  replay_worker_t *worker = arg;
+  replay_state_t *state = worker->state;
+  const login_replay_options_t *opts = state->opts;
+  uint64_t start_ns = timespec_ns(&state->start);
+  login_trace_record_t record;
+
+  for (;;) {
+    pthread_mutex_lock(&state->mutex);
+    int status = state->failed ? 0 : login_trace_reader_next(&state->reader, &record);
+    if (status < 0) {
+      state->failed = true;
+    }
+    if (status > 0 && !state->started) {
+      state->first_arrival_us = record.arrival_us;
+      state->started = true;
+    }
+    // records are in completion order, so an overlapping login can have
+    // arrived before the first one read; it is due straight away
+    uint64_t offset_us = status > 0 && record.arrival_us > state->first_arrival_us
+                         ? record.arrival_us - state->first_arrival_us : 0;
+    pthread_mutex_unlock(&state->mutex);
+    if (status <= 0) {
+      break;
+    }
+
+    uint64_t begin_ns = now_ns();
+    if (opts->speed > 0) {
+      uint64_t scheduled_ns = start_ns + (uint64_t) ((double) offset_us * 1000.0 / opts->speed);
+      if (begin_ns < scheduled_ns) {
+        sleep_until(scheduled_ns);
+      }
+      else if (begin_ns - scheduled_ns > LATE_THRESHOLD_NS) {
+        worker->report->late++;
+      }
+      // measure from the schedule, not from when we got around to it
+      begin_ns = scheduled_ns;
+    }
+
+    const char *password = record.password_class == LOGIN_TRACE_PASSWORD_WRONG
+                           ? opts->wrong_password : opts->correct_password;
+    login_session_data_t session = { 0 };
+    login_result_t result = handle_login(record.userid, password, record.ip,
+                                         record.login_time, opts->client_output_fd,
+                                         &session);
+    uint64_t latency_ns = now_ns() - begin_ns;
+
+    worker->report->requests++;
+    if (result != record.result) {
+      worker->report->mismatches++;
+    }
+    latency_histogram_record(&worker->report->all, latency_ns);
+    if ((unsigned) result < LOGIN_RESULT_COUNT) {
+      latency_histogram_record(&worker->report->by_result[result], latency_ns);
+    }
+  }
+  return NULL;
+}
+
+bool login_replay_run(const char *trace_path, const login_replay_options_t *opts,
+                      login_replay_report_t *report)
+{
+  if (!trace_path || !opts || !report || !opts->correct_password || !opts->wrong_password) {
+    return false;
+  }
+  report_init(report);
+
+  replay_state_t *state = malloc(sizeof(*state));
+  if (!state) {
+    log_message(LOG_ERROR, "Memory allocation for login replay has failed");
+    return false;
+  }
+  if (!login_trace_reader_open(&state->reader, trace_path)) {
+    free(state);
+    return false;
+  }
+  pthread_mutex_init(&state->mutex, NULL);
+  state->failed = false;
+  state->started = false;
+  state->first_arrival_us = 0;
+  state->opts = opts;
+
+  unsigned int nthreads = opts->threads ? opts->threads : 1;
+  replay_worker_t *workers = calloc(nthreads, sizeof(*workers));
+  if (!workers) {
+    log_message(LOG_ERROR, "Memory allocation for login replay has failed");
+    login_trace_reader_close(&state->reader);
+    pthread_mutex_destroy(&state->mutex);
+    free(state);
+    return false;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &state->start);
+  unsigned int started = 0;
+  for (; started < nthreads; started++) {
+    workers[started].state = state;
+    workers[started].report = malloc(sizeof(login_replay_report_t));
+    if (!workers[started].report) {
+      break;
+    }
+    report_init(workers[started].report);
+    if (pthread_create(&workers[started].thread, NULL, replay_worker, &workers[started]) != 0) {
+      free(workers[started].report);
+      break;
+    }
+  }
+  if (started < nthreads) {
+    log_message(LOG_WARN, "Login replay started %u of %u threads", started, nthreads);
+  }
+  if (started == 0) {
+    // nothing could be started; replay on the calling thread instead
+    workers[0].report = report;
+    replay_worker(&workers[0]);
+  }
+
+  for (unsigned int i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+    report_merge(report, workers[i].report);
+    free(workers[i].report);
+  }
+  report->elapsed_ns = now_ns() - timespec_ns(&state->start);
+
+  bool ok = !state->failed;
+  free(workers);
+  login_trace_reader_close(&state->reader);
+  pthread_mutex_destroy(&state->mutex);
+  free(state);
+  return ok;
+}
+
+bool login_replay_print_report(const login_replay_report_t *report, int fd)
+{
+  if (!report || fd < 0) {
+    return false;
+  }
+  double seconds = (double) report->elapsed_ns / (double) NS_PER_SEC;
+  if (dprintf(fd, "Replayed %llu logins in %.3fs (%.1f/s), %llu result mismatches, %llu late starts\n",
+              (unsigned long long) report->requests, seconds,
+              seconds > 0 ? (double) report->requests / seconds : 0.0,
+              (unsigned long long) report->mismatches,
+              (unsigned long long) report->late) < 0) {
+    return false;
+  }
+  bool ok = latency_histogram_print(&report->all, "ALL", fd);
+  for (size_t i = 0; i < LOGIN_RESULT_COUNT; i++) {
+    if (report->by_result[i].total_count > 0) {
+      ok = latency_histogram_print(&report->by_result[i], login_result_name((login_result_t) i), fd) && ok;
+    }
+  }
+  return ok;
+}
+
+#ifdef LOGIN_REPLAY_MAIN
+
+#include "login_admission.h"
+
+#include <fcntl.h>
+
+/**
+ * Replay tool.
+ *
+ * Usage: app TRACE_FILE [SPEED [THREADS [PASSWORD [MAX_HASHING]]]]
+ *
+ * SPEED multiplies the recorded pace: 1 keeps the recorded gaps between
+ * arrivals, 2 halves them; 0 (the default) replays at maximum speed.
+ * PASSWORD is sent for records whose password was correct when recorded.
+ * MAX_HASHING, if given, turns on admission control (see
+ * login_admission.h) with that many logins hashing at once.
+ */
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    dprintf(STDERR_FILENO, "usage: %s TRACE_FILE [SPEED [THREADS [PASSWORD [MAX_HASHING]]]]\n",
+            argv[0]);
+    return 2;
+  }
+  login_replay_options_t opts = {
+    .speed = argc > 2 ? strtod(argv[2], NULL) : 0.0,
+    .threads = argc > 3 ? (unsigned int) strtoul(argv[3], NULL, 10) : 1,
+    .correct_password = argc > 4 ? argv[4] : "password",
+    .wrong_password = "\x01not-the-password",
+    .client_output_fd = open("/dev/null", O_WRONLY)
+  };
+  if (opts.client_output_fd == -1) {
+    log_message(LOG_ERROR, "Failed to open /dev/null for client output");
+    return 1;
+  }
+  if (argc > 5) {
+    login_admission_options_t admission = {
+      .max_concurrent = (unsigned int) strtoul(argv[5], NULL, 10)
+    };
+    if (!login_admission_configure(&admission)) {
+      return 1;
+    }
+  }
+
+  login_replay_report_t *report = malloc(sizeof(*report));
+  if (!report) {
+    log_message(LOG_ERROR, "Memory allocation for login replay has failed");
+    return 1;
+  }
+  bool ok = login_replay_run(argv[1], &opts, report);
+  login_replay_print_report(report, STDOUT_FILENO);
+  free(report);
+  close(opts.client_output_fd);
+  return ok ? 0 : 1;
+}
+
+#endif // LOGIN_REPLAY_MAIN
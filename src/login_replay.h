@@ -0,0 +1,53 @@
+#ifndef LOGIN_REPLAY_H
+#define LOGIN_REPLAY_H
+
+/**
+ * @file login_replay.h
+ * @brief Paced replay of recorded login traces.
+ *
+ * Drives handle_login() with the requests in a trace recorded by
+ * login_trace.h, either with the gaps between arrivals that were recorded
+ * (optionally sped up or slowed down) or as fast as possible, and reports
+ * latency distributions broken down by login_result_t.
+ *
+ * When paced, each request is scheduled at its recorded arrival time,
+ * relative to the first, and latency is measured from the time it was
+ * *scheduled* to start, so a stalled login path shows up as queueing delay in
+ * the following requests rather than being hidden (no coordinated omission).
+ * Bursts and lulls in the recorded traffic are reproduced as they happened.
+ */
+
+#include "latency_histogram.h"
+#include "login.h"
+#include "login_stats.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+  double speed;                  // multiple of the recorded pace (1 = the recorded
+                                 // gaps between arrivals); 0 = maximum speed
+  unsigned int threads;          // concurrent callers of handle_login (0 = 1)
+  const char *correct_password;  // sent for records whose password was correct
+  const char *wrong_password;    // sent for records whose password was wrong
+  int client_output_fd;          // descriptor handed to handle_login for client messages
+} login_replay_options_t;
+
+typedef struct {
+  uint64_t requests;
+  uint64_t mismatches;           // replayed results differing from the recorded ones
+  uint64_t late;                 // requests started more than 1ms after schedule
+  uint64_t elapsed_ns;
+  latency_histogram_t all;
+  latency_histogram_t by_result[LOGIN_RESULT_COUNT];
+} login_replay_report_t;
+
+// replay the trace at trace_path through handle_login and fill in report.
+// report is large (keep it off the stack). returns false on error.
+bool login_replay_run(const char *trace_path, const login_replay_options_t *opts,
+                      login_replay_report_t *report);
+
+// write a per-result latency report to fd. returns true on success.
+bool login_replay_print_report(const login_replay_report_t *report, int fd);
+
+#endif // LOGIN_REPLAY_H
@@ -0,0 +1,454 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "login_span.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+  uint64_t login;
+  const char *name;
+  uint64_t start_ns;
+  uint64_t end_ns;
+} span_t;
+
+/**
+ * One thread's spans: a ring of capacity spans, the newest at
+ * (written - 1) % capacity. The owning thread records and exporters read
+ * under the mutex, which is uncontended except during an export.
+ */
+typedef struct span_buffer {
+  pthread_mutex_t mutex;
+  span_t *spans;
+  size_t capacity;               // 0 until the first span, or after a resize
+  uint64_t written;
+  uint64_t overwritten;
+  unsigned int tid;              // the thread id in the trace
+  atomic_bool in_use;            // owned by a live thread
+  struct span_buffer *next;      // immutable once published
+} span_buffer_t;
+
+static atomic_uint sample_every = 0;
+static _Atomic size_t buffer_spans = LOGIN_SPAN_DEFAULT_BUFFER;
+static _Atomic uint64_t next_login = 0;
+static _Atomic(span_buffer_t *) buffer_list = NULL;
+static atomic_uint buffer_count = 0;
+static pthread_mutex_t configure_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local span_buffer_t *local_buffer = NULL;
+static _Thread_local uint64_t current_login = 0;
+static _Thread_local unsigned int until_sample = 0;
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Thread exit: hand the buffer, spans and all, to a later thread.
+ */
+static void release_buffer(void *buffer)
+{
+  atomic_store_explicit(&((span_buffer_t *) buffer)->in_use, false, memory_order_release);
+}
+
+static void create_buffer_key(void)
+{
+  pthread_key_create(&buffer_key, release_buffer);
+}
+
+/**
+ * Returns this thread's buffer, claiming a released one or publishing a
+ * new one on first use. Returns NULL if memory is exhausted.
+ */
+static span_buffer_t *thread_buffer(void)
+{
+  if (local_buffer) {
+    return local_buffer;
+  }
+  pthread_once(&buffer_key_once, create_buffer_key);
+
+  span_buffer_t *buffer = atomic_load_explicit(&buffer_list, memory_order_acquire);
+  for (; buffer; buffer = buffer->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&buffer->in_use, &expected, true)) {
+      break;
+    }
+  }
+  if (!buffer) {
+    buffer = calloc(1, sizeof(*buffer));
+    if (!buffer) {
+      return NULL;
+    }
+    pthread_mutex_init(&buffer->mutex, NULL);
+    buffer->tid = atomic_fetch_add(&buffer_count, 1) + 1;
+    atomic_store_explicit(&buffer->in_use, true, memory_order_relaxed);
+    buffer->next = atomic_load_explicit(&buffer_list, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&buffer_list, &buffer->next, buffer,
+                                                  memory_order_release, memory_order_relaxed)) {
+      continue;
+    }
+  }
+  pthread_setspecific(buffer_key, buffer);
+  local_buffer = buffer;
+  return buffer;
+}
+
+bool login_span_configure(const login_span_options_t *opts)
+{
+  unsigned int every = opts ? opts->sample_every : 0;
+  size_t spans = opts && opts->buffer_spans ? opts->buffer_spans : LOGIN_SPAN_DEFAULT_BUFFER;
+  if (spans > SIZE_MAX / sizeof(span_t)) {
+    log_message(LOG_ERROR, "Span buffers of %zu spans are too large", spans);
+    return false;
+  }
+  pthread_mutex_lock(&configure_mutex);
+  if (opts && spans != atomic_load(&buffer_spans)) {
+    atomic_store(&buffer_spans, spans);
+    // each buffer is reallocated at its next span
+    span_buffer_t *buffer = atomic_load_explicit(&buffer_list, memory_order_acquire);
+    for (; buffer; buffer = buffer->next) {
+      pthread_mutex_lock(&buffer->mutex);
+      free(buffer->spans);
+      buffer->spans = NULL;
+      buffer->capacity = 0;
+      buffer->written = 0;
+      pthread_mutex_unlock(&buffer->mutex);
+    }
+  }
+  atomic_store_explicit(&sample_every, every, memory_order_relaxed);
+  pthread_mutex_unlock(&configure_mutex);
+  return true;
+}
+
+uint64_t login_span_sample(void)
+{
+  unsigned int every = atomic_load_explicit(&sample_every, memory_order_relaxed);
+  if (every == 0) {
+    return 0;
+  }
+  if (until_sample == 0 || until_sample > every) {
+    until_sample = every;
+  }
+  if (--until_sample != 0) {
+    return 0;
+  }
+  return atomic_fetch_add_explicit(&next_login, 1, memory_order_relaxed) + 1;
+}
+
+uint64_t login_span_enter(uint64_t login)
+{
+  uint64_t previous = current_login;
+  current_login = login;
+  return previous;
+}
+
+void login_span_leave(uint64_t previous)
+{
+  current_login = previous;
+}
+
+uint64_t login_span_current(void)
+{
+  return current_login;
+}
+
+uint64_t login_span_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+uint64_t login_span_start(void)
+{
+  return current_login ? login_span_now() : 0;
+}
+
+uint64_t login_span_end(const char *name, uint64_t start_ns)
+{
+  if (start_ns == 0) {
+    return 0;
+  }
+  uint64_t now = login_span_now();
+  login_span_record(current_login, name, start_ns, now);
+  return now;
+}
+
+void login_span_record(uint64_t login, const char *name, uint64_t start_ns, uint64_t end_ns)
+{
+  if (login == 0 || start_ns == 0 || end_ns == 0) {
+    return;
+  }
+  span_buffer_t *buffer = thread_buffer();
+  if (!buffer) {
+    return;
+  }
+  pthread_mutex_lock(&buffer->mutex);
+  if (buffer->capacity == 0) {
+    size_t capacity = atomic_load(&buffer_spans);
+    buffer->spans = malloc(capacity * sizeof(span_t));
+    buffer->capacity = buffer->spans ? capacity : 0;
+  }
+  if (buffer->capacity > 0) {
+    if (buffer->written >= buffer->capacity) {
+      buffer->overwritten++;
+    }
+    buffer->spans[buffer->written % buffer->capacity] = (span_t) {
+      .login = login, .name = name, .start_ns = start_ns,
+      .end_ns = end_ns > start_ns ? end_ns : start_ns
+    };
+    buffer->written++;
+  }
+  pthread_mutex_unlock(&buffer->mutex);
+}
+
+/**
+ * Output for login_span_export(), written out whenever it fills.
+ */
+typedef struct {
+  int fd;
+  bool failed;
+  size_t len;
+  char buf[16384];
+} out_t;
+
+static void flush(out_t *out)
+{
+  size_t written = 0;
+  while (!out->failed && written < out->len) {
+    ssize_t n = write(out->fd, out->buf + written, out->len - written);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      log_message(LOG_ERROR, "Failed to write spans: %s", strerror(errno));
+      out->failed = true;
+      break;
+    }
+    written += (size_t) n;
+  }
+  out->len = 0;
+}
+
+static void emit_span(out_t *out, unsigned int tid, const span_t *span, bool first)
+{
+  char event[256];
+  uint64_t dur_ns = span->end_ns - span->start_ns;
+  int n = snprintf(event, sizeof(event),
+                   "%s\n{\"name\":\"%s\",\"cat\":\"login\",\"ph\":\"X\","
+                   "\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,\"pid\":%ld,\"tid\":%u,"
+                   "\"args\":{\"login\":%" PRIu64 "}}",
+                   first ? "" : ",", span->name, span->start_ns / 1000,
+                   (unsigned int) (span->start_ns % 1000), dur_ns / 1000,
+                   (unsigned int) (dur_ns % 1000), (long) getpid(), tid, span->login);
+  if (n <= 0 || (size_t) n >= sizeof(event)) {
+    return;
+  }
+  if (out->len + (size_t) n > sizeof(out->buf)) {
+    flush(out);
+  }
+  memcpy(out->buf + out->len, event, (size_t) n);
+  out->len += (size_t) n;
+}
+
+bool login_span_export(int fd, uint64_t from_ns, uint64_t to_ns)
+{
+  if (to_ns == 0) {
+    to_ns = login_span_now();
+  }
+  out_t *out = malloc(sizeof(*out));
+  size_t copy_capacity = 0;
+  span_t *copy = NULL;
+  if (!out) {
+    log_message(LOG_ERROR, "Memory allocation for span export has failed");
+    return false;
+  }
+  out->fd = fd;
+  out->failed = false;
+  out->len = 0;
+  static const char head[] = "{\"traceEvents\":[";
+  memcpy(out->buf, head, sizeof(head) - 1);
+  out->len = sizeof(head) - 1;
+
+  bool first = true;
+  span_buffer_t *buffer = atomic_load_explicit(&buffer_list, memory_order_acquire);
+  for (; buffer; buffer = buffer->next) {
+    // copied out so that the owner is not held up by the writes
+    pthread_mutex_lock(&buffer->mutex);
+    size_t count = buffer->written < buffer->capacity ? (size_t) buffer->written
+                                                      : buffer->capacity;
+    if (count > copy_capacity) {
+      span_t *grown = realloc(copy, count * sizeof(*copy));
+      if (!grown) {
+        pthread_mutex_unlock(&buffer->mutex);
+        log_message(LOG_ERROR, "Memory allocation for span export has failed");
+        out->failed = true;
+        break;
+      }
+      copy = grown;
+      copy_capacity = count;
+    }
+    // oldest first
+    uint64_t oldest = buffer->written - count;
+    for (size_t i = 0; i < count; i++) {
+      copy[i] = buffer->spans[(oldest + i) % buffer->capacity];
+    }
+    unsigned int tid = buffer->tid;
+    pthread_mutex_unlock(&buffer->mutex);
+
+    for (size_t i = 0; i < count; i++) {
+      if (copy[i].end_ns >= from_ns && copy[i].start_ns <= to_ns) {
+        emit_span(out, tid, &copy[i], first);
+        first = false;
+      }
+    }
+  }
+  static const char tail[] = "\n],\"displayTimeUnit\":\"ms\"}\n";
+  if (out->len + sizeof(tail) - 1 > sizeof(out->buf)) {
+    flush(out);
+  }
+  memcpy(out->buf + out->len, tail, sizeof(tail) - 1);
+  out->len += sizeof(tail) - 1;
+  flush(out);
+  bool ok = !out->failed;
+  free(copy);
+  free(out);
+  return ok;
+}
+
+void login_span_get_stats(login_span_stats_t *stats)
+{
+  if (!stats) {
+    return;
+  }
+  memset(stats, 0, sizeof(*stats));
+  stats->sampled = atomic_load(&next_login);
+  span_buffer_t *buffer = atomic_load_explicit(&buffer_list, memory_order_acquire);
+  for (; buffer; buffer = buffer->next) {
+    pthread_mutex_lock(&buffer->mutex);
+    stats->recorded += buffer->written;
+    stats->overwritten += buffer->overwritten;
+    pthread_mutex_unlock(&buffer->mutex);
+    stats->threads++;
+  }
+}
+
+#ifdef LOGIN_SPAN_MAIN
+
+#include "account.h"
+#include "account_alloc.h"
+#include "account_store.h"
+#include "login.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+
+typedef struct {
+  unsigned long logins;
+  unsigned long accounts;
+  unsigned long first;
+  int fd;
+} worker_t;
+
+static void *worker_main(void *arg)
+{
+  worker_t *w = arg;
+  for (unsigned long i = 0; i < w->logins; i++) {
+    char userid[32];
+    snprintf(userid, sizeof(userid), "user%lu", (w->first + i) % w->accounts);
+    // one in eight logins gets the password wrong
+    const char *password = (w->first + i) % 8 == 7 ? "wrong" : "password";
+    login_session_data_t session;
+    handle_login(userid, password, 0x7f000001, time(NULL), w->fd, &session);
+  }
+  return NULL;
+}
+
+/**
+ * Span export tool.
+ *
+ * Usage: app ACCOUNTS LOGINS SAMPLE_EVERY OUT [THREADS [WINDOW_MS]]
+ *
+ * Stores ACCOUNTS accounts (user0 onwards, password "password") in the
+ * account store, makes LOGINS logins with handle_login() on THREADS
+ * threads (default 1) tracing one in SAMPLE_EVERY, and writes the spans
+ * of the last WINDOW_MS milliseconds (default all of them) to the file OUT
+ * as Chrome trace JSON.
+ */
+int main(int argc, char **argv)
+{
+  if (argc < 5) {
+    dprintf(STDERR_FILENO,
+            "usage: %s ACCOUNTS LOGINS SAMPLE_EVERY OUT [THREADS [WINDOW_MS]]\n", argv[0]);
+    return 2;
+  }
+  unsigned long accounts = strtoul(argv[1], NULL, 10);
+  unsigned long logins = strtoul(argv[2], NULL, 10);
+  login_span_options_t opts = { .sample_every = (unsigned int) strtoul(argv[3], NULL, 10) };
+  unsigned int threads = argc > 5 ? (unsigned int) strtoul(argv[5], NULL, 10) : 1;
+  unsigned long window_ms = argc > 6 ? strtoul(argv[6], NULL, 10) : 0;
+  if (accounts == 0 || threads == 0) {
+    dprintf(STDERR_FILENO, "%s: ACCOUNTS and THREADS must be positive\n", argv[0]);
+    return 2;
+  }
+  int fd = open("/dev/null", O_WRONLY);
+  // log messages go to standard output, so the trace goes to a file
+  int out = open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  account_t *model = account_create("bench", "password", "bench@example.com", "2000-01-01");
+  pthread_t *tids = calloc(threads, sizeof(*tids));
+  worker_t *workers = calloc(threads, sizeof(*workers));
+  if (fd == -1 || out == -1 || !model || !tids || !workers || !login_span_configure(&opts)) {
+    dprintf(STDERR_FILENO, "%s: failed to set up\n", argv[0]);
+    return 1;
+  }
+  // the password is hashed once and the hash shared
+  for (unsigned long i = 0; i < accounts; i++) {
+    account_t *acc = account_alloc();
+    if (!acc) {
+      return 1;
+    }
+    *acc = *model;
+    acc->account_id = (int64_t) i + 1;
+    snprintf(acc->userid, sizeof(acc->userid), "user%lu", i);
+    snprintf(acc->email, sizeof(acc->email), "user%lu@example.com", i);
+    if (!account_store_insert(acc)) {
+      account_release(acc);
+      return 1;
+    }
+  }
+
+  for (unsigned int t = 0; t < threads; t++) {
+    workers[t] = (worker_t) {
+      .logins = logins / threads + (t < logins % threads), .accounts = accounts,
+      .first = t * (logins / threads), .fd = fd
+    };
+    pthread_create(&tids[t], NULL, worker_main, &workers[t]);
+  }
+  for (unsigned int t = 0; t < threads; t++) {
+    pthread_join(tids[t], NULL);
+  }
+
+  uint64_t now = login_span_now();
+  uint64_t window_ns = (uint64_t) window_ms * 1000000u;
+  uint64_t from = window_ms && window_ns < now ? now - window_ns : 0;
+  bool ok = login_span_export(out, from, now);
+  login_span_stats_t stats;
+  login_span_get_stats(&stats);
+  dprintf(STDERR_FILENO, "%" PRIu64 " logins traced, %" PRIu64 " spans (%" PRIu64
+          " overwritten) on %zu thread(s)\n",
+          stats.sampled, stats.recorded, stats.overwritten, stats.threads);
+
+  account_free(model);
+  free(tids);
+  free(workers);
+  close(fd);
+  ok = close(out) == 0 && ok;
+  return ok ? 0 : 1;
+}
+
+#endif // LOGIN_SPAN_MAIN
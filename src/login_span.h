@@ -0,0 +1,90 @@
+#ifndef LOGIN_SPAN_H
+#define LOGIN_SPAN_H
+
+/**
+ * @file login_span.h
+ * @brief Sampled per-login spans, exported as Chrome trace JSON.
+ *
+ * login_stats.h says how long each stage takes on the whole; spans say
+ * where one slow login's time went. While sampling is on, one login in
+ * sample_every (counted per thread) is traced: each of its stages, and
+ * the steps inside them that are instrumented (hashing, waiting for a hash
+ * arena, the client write, recording and logging), is kept as a named span
+ * in a ring buffer belonging to the thread that ran it. Logins that are not
+ * sampled cost one thread-local test per instrumented step, and with
+ * sampling off nothing is recorded at all.
+ *
+ * The stage spans reuse login_stats' clock readings, so they need its
+ * recording on (the default).
+ *
+ * login_span_export() writes the spans of a time window in the Chrome
+ * trace event format, which chrome://tracing and ui.perfetto.dev load:
+ * each span is a complete ("X") event on its thread, with the login it
+ * belongs to in args.login.
+ *
+ * Instrumented code brackets a step with login_span_start() and
+ * login_span_end(), which record against the login the thread is running
+ * (see login_span_enter()). Span names are kept by pointer and written
+ * unescaped, so must be string literals.
+ *
+ * Built with -DLOGIN_SPAN_MAIN, login_span.c has a main() that runs logins
+ * with sampling on and exports their spans (see README.md).
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOGIN_SPAN_DEFAULT_BUFFER 4096
+
+typedef struct {
+  unsigned int sample_every;   // trace one login in this many (0 = none)
+  size_t buffer_spans;         // spans kept per thread, the oldest dropped
+                               // first (0 = LOGIN_SPAN_DEFAULT_BUFFER)
+} login_span_options_t;
+
+typedef struct {
+  uint64_t sampled;            // logins traced
+  uint64_t recorded;           // spans recorded
+  uint64_t overwritten;        // spans dropped to make room
+  size_t threads;              // buffers
+} login_span_stats_t;
+
+// start sampling with opts, or stop if opts is NULL or its sample_every
+// is 0. spans already recorded are kept for export, unless buffer_spans
+// changes. returns false (after logging) if memory runs out.
+bool login_span_configure(const login_span_options_t *opts);
+
+// decide whether to trace a login starting now: returns its id, or 0
+uint64_t login_span_sample(void);
+
+// make login (0 = none) the one this thread's spans belong to, returning
+// the previous one for login_span_leave()
+uint64_t login_span_enter(uint64_t login);
+void login_span_leave(uint64_t previous);
+
+// the login this thread's spans belong to (0 = none)
+uint64_t login_span_current(void);
+
+// CLOCK_MONOTONIC time in nanoseconds, the clock spans are measured by
+uint64_t login_span_now(void);
+
+// the start of a span of the current login, or 0 if it is not traced
+uint64_t login_span_start(void);
+
+// record the span name of the current login from start_ns (from
+// login_span_start()) until now, and return now to start the next span.
+// does nothing and returns 0 if start_ns is 0.
+uint64_t login_span_end(const char *name, uint64_t start_ns);
+
+// record the span name of login from start_ns until end_ns. does nothing
+// if any of them is 0.
+void login_span_record(uint64_t login, const char *name, uint64_t start_ns, uint64_t end_ns);
+
+// write the spans overlapping [from_ns, to_ns] (to_ns 0 = now) to fd as
+// Chrome trace JSON. returns false if a write fails.
+bool login_span_export(int fd, uint64_t from_ns, uint64_t to_ns);
+
+void login_span_get_stats(login_span_stats_t *stats);
+
+#endif // LOGIN_SPAN_H
@@ -0,0 +1,340 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "login_stats.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_LINE 64
+
+/**
+ * Counters owned by one thread. Only the owning thread writes them, so
+ * increments are a relaxed load and store rather than a locked read-modify-
+ * write; aggregation may read them at any time.
+ */
+typedef struct stats_block {
+  _Atomic uint64_t results[LOGIN_RESULT_COUNT];
+  _Atomic uint64_t stage_count[LOGIN_STAGE_COUNT];
+  _Atomic uint64_t stage_sum_ns[LOGIN_STAGE_COUNT];
+  _Atomic uint64_t stage_max_ns[LOGIN_STAGE_COUNT];
+  _Atomic uint64_t stage_buckets[LOGIN_STAGE_COUNT][LOGIN_STATS_BUCKETS];
+  atomic_bool in_use;            // owned by a live thread
+  struct stats_block *next;      // immutable once published
+} stats_block_t;
+
+static atomic_bool stats_enabled = true;
+static _Atomic(stats_block_t *) block_list = NULL;
+static _Thread_local stats_block_t *local_block = NULL;
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static login_stats_shm_t *shm_segment = NULL;
+static char shm_segment_name[256];
+
+const char *login_result_name(login_result_t result)
+{
+  switch (result) {
+    case LOGIN_SUCCESS:              return "LOGIN_SUCCESS";
+    case LOGIN_FAIL_USER_NOT_FOUND:  return "LOGIN_FAIL_USER_NOT_FOUND";
+    case LOGIN_FAIL_BAD_PASSWORD:    return "LOGIN_FAIL_BAD_PASSWORD";
+    case LOGIN_FAIL_ACCOUNT_EXPIRED: return "LOGIN_FAIL_ACCOUNT_EXPIRED";
+    case LOGIN_FAIL_ACCOUNT_BANNED:  return "LOGIN_FAIL_ACCOUNT_BANNED";
+    case LOGIN_FAIL_IP_BANNED:       return "LOGIN_FAIL_IP_BANNED";
+    case LOGIN_FAIL_INTERNAL_ERROR:  return "LOGIN_FAIL_INTERNAL_ERROR";
+  }
+  return "UNKNOWN";
+}
+
+const char *login_stage_name(login_stage_t stage)
+{
+  switch (stage) {
+    case LOGIN_STAGE_LOOKUP:  return "lookup";
+    case LOGIN_STAGE_CHECKS:  return "checks";
+    case LOGIN_STAGE_ADMIT:   return "admit";
+    case LOGIN_STAGE_HASH:    return "hash";
+    case LOGIN_STAGE_RESPOND: return "respond";
+    case LOGIN_STAGE_TOTAL:   return "total";
+    case LOGIN_STAGE_COUNT:   break;
+  }
+  return "unknown";
+}
+
+/**
+ * Thread exit: hand the block back for reuse by a later thread. Its counts
+ * are kept, so totals never go backwards.
+ */
+static void release_block(void *block)
+{
+  atomic_store_explicit(&((stats_block_t *) block)->in_use, false, memory_order_release);
+}
+
+static void create_block_key(void)
+{
+  pthread_key_create(&block_key, release_block);
+}
+
+/**
+ * Returns this thread's counter block, claiming a released block or
+ * allocating and publishing a new one on first use. Returns NULL if memory is
+ * exhausted (the sample is then dropped).
+ */
+static stats_block_t *thread_block(void)
+{
+  if (local_block) {
+    return local_block;
+  }
+  pthread_once(&block_key_once, create_block_key);
+
+  stats_block_t *block = atomic_load_explicit(&block_list, memory_order_acquire);
+  for (; block; block = block->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&block->in_use, &expected, true)) {
+      break;
+    }
+  }
+  if (!block) {
+    // round the size up to a whole number of cache lines, as aligned_alloc requires
+    size_t size = (sizeof(stats_block_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    block = aligned_alloc(CACHE_LINE, size);
+    if (!block) {
+      return NULL;
+    }
+    memset(block, 0, size);
+    atomic_store_explicit(&block->in_use, true, memory_order_relaxed);
+    block->next = atomic_load_explicit(&block_list, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&block_list, &block->next, block,
+                                                  memory_order_release, memory_order_relaxed)) {
+      continue;
+    }
+  }
+  pthread_setspecific(block_key, block);
+  local_block = block;
+  return block;
+}
+
+// single-writer increment: no locked instruction needed
+static inline void counter_add(_Atomic uint64_t *counter, uint64_t amount)
+{
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+                        memory_order_relaxed);
+}
+
+static unsigned int bucket_for(uint64_t ns)
+{
+  unsigned int bucket = 0;
+  while (ns >>= 1) {
+    bucket++;
+  }
+  return bucket;
+}
+
+void login_stats_set_enabled(bool enabled)
+{
+  atomic_store_explicit(&stats_enabled, enabled, memory_order_relaxed);
+}
+
+bool login_stats_enabled(void)
+{
+  return atomic_load_explicit(&stats_enabled, memory_order_relaxed);
+}
+
+uint64_t login_stats_now(void)
+{
+  if (!login_stats_enabled()) {
+    return 0;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+uint64_t login_stats_stage_done(login_stage_t stage, uint64_t start_ns)
+{
+  if (start_ns == 0 || (unsigned) stage >= LOGIN_STAGE_COUNT) {
+    return 0;
+  }
+  uint64_t now = login_stats_now();
+  stats_block_t *block = thread_block();
+  if (now == 0 || !block) {
+    return now;
+  }
+  uint64_t elapsed = now > start_ns ? now - start_ns : 0;
+  counter_add(&block->stage_count[stage], 1);
+  counter_add(&block->stage_sum_ns[stage], elapsed);
+  counter_add(&block->stage_buckets[stage][bucket_for(elapsed)], 1);
+  if (elapsed > atomic_load_explicit(&block->stage_max_ns[stage], memory_order_relaxed)) {
+    atomic_store_explicit(&block->stage_max_ns[stage], elapsed, memory_order_relaxed);
+  }
+  return now;
+}
+
+void login_stats_record_result(login_result_t result)
+{
+  if (!login_stats_enabled() || (unsigned) result >= LOGIN_RESULT_COUNT) {
+    return;
+  }
+  stats_block_t *block = thread_block();
+  if (block) {
+    counter_add(&block->results[result], 1);
+  }
+}
+
+void login_stats_aggregate(login_stats_snapshot_t *out)
+{
+  memset(out, 0, sizeof(*out));
+  stats_block_t *block = atomic_load_explicit(&block_list, memory_order_acquire);
+  for (; block; block = block->next) {
+    for (size_t r = 0; r < LOGIN_RESULT_COUNT; r++) {
+      out->results[r] += atomic_load_explicit(&block->results[r], memory_order_relaxed);
+    }
+    for (size_t s = 0; s < LOGIN_STAGE_COUNT; s++) {
+      out->stage_count[s] += atomic_load_explicit(&block->stage_count[s], memory_order_relaxed);
+      out->stage_sum_ns[s] += atomic_load_explicit(&block->stage_sum_ns[s], memory_order_relaxed);
+      uint64_t max = atomic_load_explicit(&block->stage_max_ns[s], memory_order_relaxed);
+      if (max > out->stage_max_ns[s]) {
+        out->stage_max_ns[s] = max;
+      }
+      for (size_t b = 0; b < LOGIN_STATS_BUCKETS; b++) {
+        out->stage_buckets[s][b] += atomic_load_explicit(&block->stage_buckets[s][b],
+                                                         memory_order_relaxed);
+      }
+    }
+  }
+}
+
+uint64_t login_stats_percentile(const login_stats_snapshot_t *stats, login_stage_t stage,
+                                double percentile)
+{
+  if ((unsigned) stage >= LOGIN_STAGE_COUNT) {
+    return 0;
+  }
+  uint64_t total = 0;
+  for (size_t b = 0; b < LOGIN_STATS_BUCKETS; b++) {
+    total += stats->stage_buckets[stage][b];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t) (percentile / 100.0 * (double) total + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (size_t b = 0; b < LOGIN_STATS_BUCKETS; b++) {
+    seen += stats->stage_buckets[stage][b];
+    if (seen >= rank) {
+      // upper bound of the bucket, capped by the observed maximum
+      uint64_t high = b >= 63 ? UINT64_MAX : (UINT64_C(2) << b) - 1;
+      return high < stats->stage_max_ns[stage] ? high : stats->stage_max_ns[stage];
+    }
+  }
+  return stats->stage_max_ns[stage];
+}
+
+bool login_stats_dump(int fd)
+{
+  if (fd < 0) {
+    return false;
+  }
+  login_stats_snapshot_t *stats = malloc(sizeof(*stats));
+  if (!stats) {
+    log_message(LOG_ERROR, "Memory allocation for login stats has failed");
+    return false;
+  }
+  login_stats_aggregate(stats);
+
+  bool ok = dprintf(fd, "login results:\n") >= 0;
+  for (size_t r = 0; r < LOGIN_RESULT_COUNT && ok; r++) {
+    ok = dprintf(fd, "  %-28s %llu\n", login_result_name((login_result_t) r),
+                 (unsigned long long) stats->results[r]) >= 0;
+  }
+  ok = ok && dprintf(fd, "login stage latency (us, p50/p99 are bucket upper bounds):\n") >= 0;
+  for (size_t s = 0; s < LOGIN_STAGE_COUNT && ok; s++) {
+    uint64_t count = stats->stage_count[s];
+    ok = dprintf(fd, "  %-8s count=%-10llu mean=%.1f p50<=%.1f p99<=%.1f max=%.1f\n",
+                 login_stage_name((login_stage_t) s),
+                 (unsigned long long) count,
+                 count ? (double) stats->stage_sum_ns[s] / (double) count / 1000.0 : 0.0,
+                 (double) login_stats_percentile(stats, (login_stage_t) s, 50.0) / 1000.0,
+                 (double) login_stats_percentile(stats, (login_stage_t) s, 99.0) / 1000.0,
+                 (double) stats->stage_max_ns[s] / 1000.0) >= 0;
+  }
+  free(stats);
+  return ok;
+}
+
+/**
+ * Maps (creating if needed) the shared-memory object name. Called with
+ * shm_mutex held. Returns false and logs on failure.
+ */
+static bool map_shm_segment(const char *name)
+{
+  if (shm_segment && strcmp(shm_segment_name, name) == 0) {
+    return true;
+  }
+  if (strlen(name) >= sizeof(shm_segment_name)) {
+    log_message(LOG_ERROR, "Shared-memory name for login stats is too long");
+    return false;
+  }
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+  if (fd == -1) {
+    log_message(LOG_ERROR, "shm_open(%s) failed: %s", name, strerror(errno));
+    return false;
+  }
+  if (ftruncate(fd, sizeof(login_stats_shm_t)) == -1) {
+    log_message(LOG_ERROR, "ftruncate() of login stats segment failed: %s", strerror(errno));
+    close(fd);
+    return false;
+  }
+  void *mapping = mmap(NULL, sizeof(login_stats_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    log_message(LOG_ERROR, "mmap() of login stats segment failed: %s", strerror(errno));
+    return false;
+  }
+  if (shm_segment) {
+    munmap(shm_segment, sizeof(login_stats_shm_t));
+  }
+  shm_segment = mapping;
+  strcpy(shm_segment_name, name);
+  shm_segment->magic = LOGIN_STATS_SHM_MAGIC;
+  shm_segment->version = LOGIN_STATS_SHM_VERSION;
+  return true;
+}
+
+bool login_stats_publish_shm(const char *name)
+{
+  if (!name) {
+    return false;
+  }
+  login_stats_snapshot_t *stats = malloc(sizeof(*stats));
+  if (!stats) {
+    log_message(LOG_ERROR, "Memory allocation for login stats has failed");
+    return false;
+  }
+  login_stats_aggregate(stats);
+
+  pthread_mutex_lock(&shm_mutex);
+  bool ok = map_shm_segment(name);
+  if (ok) {
+    // seqlock: odd while the snapshot is being rewritten
+    shm_segment->seq++;
+    atomic_thread_fence(memory_order_release);
+    shm_segment->published_at = (int64_t) time(NULL);
+    memcpy(&shm_segment->stats, stats, sizeof(*stats));
+    atomic_thread_fence(memory_order_release);
+    shm_segment->seq++;
+  }
+  pthread_mutex_unlock(&shm_mutex);
+  free(stats);
+  return ok;
+}
@@ -0,0 +1,93 @@
+#ifndef LOGIN_STATS_H
+#define LOGIN_STATS_H
+
+/**
+ * @file login_stats.h
+ * @brief Always-on counters and per-stage latency histograms for handle_login.
+ *
+ * Each thread records into its own cache-aligned block of counters, using
+ * plain relaxed atomic loads and stores (no locked instructions, no shared
+ * cache lines), so recording costs a few nanoseconds plus the clock reads.
+ * Blocks are summed on demand by login_stats_aggregate(), and the totals can
+ * be written to a file descriptor or published in a POSIX shared-memory
+ * segment for external monitoring.
+ *
+ * Latency histograms have one bucket per power of two: bucket i counts
+ * durations d with 2^i <= d < 2^(i+1) nanoseconds (bucket 0 also counts 0).
+ */
+
+#include "login.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LOGIN_RESULT_COUNT (LOGIN_FAIL_INTERNAL_ERROR + 1)
+#define LOGIN_STATS_BUCKETS 64
+#define LOGIN_STATS_SHM_MAGIC 0x4c535453u // "LSTS"
+#define LOGIN_STATS_SHM_VERSION 2u
+
+typedef enum {
+  LOGIN_STAGE_LOOKUP = 0, // account_lookup_by_userid()
+  LOGIN_STAGE_CHECKS,     // ban, expiry and failed-attempt checks
+  LOGIN_STAGE_ADMIT,      // waiting for a turn to hash (see login_admission.h)
+  LOGIN_STAGE_HASH,       // account_validate_password()
+  LOGIN_STAGE_RESPOND,    // client write, login recording and logging
+  LOGIN_STAGE_TOTAL,      // the whole of handle_login()
+  LOGIN_STAGE_COUNT
+} login_stage_t;
+
+typedef struct {
+  uint64_t results[LOGIN_RESULT_COUNT];
+  uint64_t stage_count[LOGIN_STAGE_COUNT];
+  uint64_t stage_sum_ns[LOGIN_STAGE_COUNT];
+  uint64_t stage_max_ns[LOGIN_STAGE_COUNT];
+  uint64_t stage_buckets[LOGIN_STAGE_COUNT][LOGIN_STATS_BUCKETS];
+} login_stats_snapshot_t;
+
+/**
+ * Layout of the shared-memory segment written by login_stats_publish_shm().
+ * Readers should retry while seq is odd or changes across their copy.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  volatile uint64_t seq;
+  int64_t published_at;          // time(NULL) of the last publish
+  login_stats_snapshot_t stats;
+} login_stats_shm_t;
+
+// human-readable names
+const char *login_result_name(login_result_t result);
+const char *login_stage_name(login_stage_t stage);
+
+// turn recording on or off (on by default)
+void login_stats_set_enabled(bool enabled);
+bool login_stats_enabled(void);
+
+// current CLOCK_MONOTONIC time in nanoseconds, or 0 if recording is disabled
+uint64_t login_stats_now(void);
+
+// record the end of a stage that began at start_ns (as returned by
+// login_stats_now()). returns the current time, to start the next stage.
+// Does nothing and returns 0 if recording is disabled or start_ns is 0.
+uint64_t login_stats_stage_done(login_stage_t stage, uint64_t start_ns);
+
+// count one login with the given result
+void login_stats_record_result(login_result_t result);
+
+// sum the counters of all threads into out
+void login_stats_aggregate(login_stats_snapshot_t *out);
+
+// approximate percentile (0-100) of a stage's latency, from its buckets
+uint64_t login_stats_percentile(const login_stats_snapshot_t *stats, login_stage_t stage,
+                                double percentile);
+
+// write aggregated counters and stage latencies to fd in human-readable form.
+// returns true on success.
+bool login_stats_dump(int fd);
+
+// aggregate and publish the counters into the POSIX shared-memory object
+// name (e.g. "/login_stats"), creating it if needed. returns true on success.
+bool login_stats_publish_shm(const char *name);
+
+#endif // LOGIN_STATS_H
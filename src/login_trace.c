@@ -0,0 +1,343 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "login_trace.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC "LTRC"
+#define TRACE_VERSION 2u
+#define TRACE_HEADER_SIZE 16
+// varint(10) + ip(4) + varint(10) + class/result(1) + length(1) + userid
+#define TRACE_MAX_RECORD_SIZE (10 + 4 + 10 + 1 + 1 + LOGIN_TRACE_MAX_USERID)
+#define TRACE_BUFFER_SIZE 65536
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool trace_active = false;
+static int trace_fd = -1;
+static time_t trace_base_time;
+static uint64_t trace_start_ns;
+static uint64_t trace_last_arrival_us;
+static size_t trace_buffer_len;
+static unsigned char trace_buffer[TRACE_BUFFER_SIZE];
+
+/**
+ * Writes all of buf to fd, retrying on partial writes and EINTR.
+ *
+ * Returns true on success, false (after logging) on failure.
+ */
+static bool write_all(int fd, const unsigned char *buf, size_t len)
+{
+  size_t written = 0;
+  while (written < len) {
+    ssize_t result = write(fd, buf + written, len - written);
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_message(LOG_ERROR, "Call to write() failed while writing login trace.");
+      return false;
+    }
+    written += (size_t) result;
+  }
+  return true;
+}
+
+static uint64_t monotonic_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+static size_t put_varint(unsigned char *out, uint64_t value)
+{
+  size_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = (unsigned char) (value | 0x80);
+    value >>= 7;
+  }
+  out[n++] = (unsigned char) value;
+  return n;
+}
+
+static uint64_t zigzag_encode(int64_t value)
+{
+  return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t value)
+{
+  return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+static void put_u32(unsigned char *out, uint32_t value)
+{
+  out[0] = (unsigned char) value;
+  out[1] = (unsigned char) (value >> 8);
+  out[2] = (unsigned char) (value >> 16);
+  out[3] = (unsigned char) (value >> 24);
+}
+
+static uint32_t get_u32(const unsigned char *in)
+{
+  return (uint32_t) in[0] | (uint32_t) in[1] << 8
+         | (uint32_t) in[2] << 16 | (uint32_t) in[3] << 24;
+}
+
+bool login_trace_start(const char *path)
+{
+  if (!path) {
+    return false;
+  }
+  pthread_mutex_lock(&trace_mutex);
+  if (trace_fd != -1) {
+    pthread_mutex_unlock(&trace_mutex);
+    log_message(LOG_ERROR, "A login trace is already being recorded.");
+    return false;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    pthread_mutex_unlock(&trace_mutex);
+    log_message(LOG_ERROR, "Failed to create login trace file %s: %s", path, strerror(errno));
+    return false;
+  }
+
+  trace_base_time = time(NULL);
+  trace_start_ns = monotonic_ns();
+  trace_last_arrival_us = 0;
+
+  unsigned char header[TRACE_HEADER_SIZE];
+  memcpy(header, TRACE_MAGIC, 4);
+  put_u32(header + 4, TRACE_VERSION);
+  uint64_t base = (uint64_t) (int64_t) trace_base_time;
+  put_u32(header + 8, (uint32_t) base);
+  put_u32(header + 12, (uint32_t) (base >> 32));
+  if (!write_all(fd, header, sizeof(header))) {
+    close(fd);
+    pthread_mutex_unlock(&trace_mutex);
+    return false;
+  }
+
+  trace_fd = fd;
+  trace_buffer_len = 0;
+  atomic_store_explicit(&trace_active, true, memory_order_release);
+  pthread_mutex_unlock(&trace_mutex);
+  log_message(LOG_INFO, "Recording login trace to %s", path);
+  return true;
+}
+
+bool login_trace_stop(void)
+{
+  pthread_mutex_lock(&trace_mutex);
+  if (trace_fd == -1) {
+    pthread_mutex_unlock(&trace_mutex);
+    return false;
+  }
+  atomic_store_explicit(&trace_active, false, memory_order_release);
+  bool ok = write_all(trace_fd, trace_buffer, trace_buffer_len);
+  if (close(trace_fd) == -1) {
+    ok = false;
+  }
+  trace_fd = -1;
+  trace_buffer_len = 0;
+  pthread_mutex_unlock(&trace_mutex);
+  return ok;
+}
+
+bool login_trace_is_active(void)
+{
+  return atomic_load_explicit(&trace_active, memory_order_relaxed);
+}
+
+login_trace_password_class_t login_trace_classify(login_result_t result)
+{
+  switch (result) {
+    case LOGIN_SUCCESS:
+      return LOGIN_TRACE_PASSWORD_CORRECT;
+    case LOGIN_FAIL_BAD_PASSWORD:
+      return LOGIN_TRACE_PASSWORD_WRONG;
+    default:
+      return LOGIN_TRACE_PASSWORD_UNCHECKED;
+  }
+}
+
+uint64_t login_trace_now(void)
+{
+  return login_trace_is_active() ? monotonic_ns() : 0;
+}
+
+void login_trace_record(const char *userid, login_result_t result,
+                        ip4_addr_t client_ip, time_t login_time, uint64_t arrival_ns)
+{
+  if (!login_trace_is_active() || !userid) {
+    return;
+  }
+
+  // userid length, capped at what a record can hold
+  const char *end = memchr(userid, '\0', LOGIN_TRACE_MAX_USERID);
+  size_t userid_len = end ? (size_t) (end - userid) : LOGIN_TRACE_MAX_USERID;
+
+  pthread_mutex_lock(&trace_mutex);
+  if (trace_fd == -1) {
+    pthread_mutex_unlock(&trace_mutex);
+    return;
+  }
+  if (trace_buffer_len + TRACE_MAX_RECORD_SIZE > sizeof(trace_buffer)) {
+    if (!write_all(trace_fd, trace_buffer, trace_buffer_len)) {
+      log_message(LOG_ERROR, "Login trace flush failed; recording stopped.");
+      atomic_store_explicit(&trace_active, false, memory_order_release);
+      close(trace_fd);
+      trace_fd = -1;
+      pthread_mutex_unlock(&trace_mutex);
+      return;
+    }
+    trace_buffer_len = 0;
+  }
+
+  // a login that arrived before recording started counts from the start
+  uint64_t arrival_us = arrival_ns > trace_start_ns ? (arrival_ns - trace_start_ns) / 1000 : 0;
+
+  unsigned char *out = trace_buffer + trace_buffer_len;
+  size_t n = put_varint(out, zigzag_encode((int64_t) arrival_us
+                                           - (int64_t) trace_last_arrival_us));
+  put_u32(out + n, client_ip);
+  n += 4;
+  n += put_varint(out + n, zigzag_encode((int64_t) login_time - (int64_t) trace_base_time));
+  out[n++] = (unsigned char) (login_trace_classify(result) << 4 | ((unsigned) result & 0x0f));
+  out[n++] = (unsigned char) userid_len;
+  memcpy(out + n, userid, userid_len);
+  n += userid_len;
+
+  trace_buffer_len += n;
+  trace_last_arrival_us = arrival_us;
+  pthread_mutex_unlock(&trace_mutex);
+}
+
+/**
+ * Makes sure at least TRACE_MAX_RECORD_SIZE bytes are buffered, unless the
+ * end of the file is reached first.
+ *
+ * Returns false if a read fails.
+ */
+static bool reader_fill(login_trace_reader_t *reader)
+{
+  if (reader->len - reader->pos >= TRACE_MAX_RECORD_SIZE) {
+    return true;
+  }
+  memmove(reader->buf, reader->buf + reader->pos, reader->len - reader->pos);
+  reader->len -= reader->pos;
+  reader->pos = 0;
+  while (reader->len < sizeof(reader->buf)) {
+    ssize_t result = read(reader->fd, reader->buf + reader->len, sizeof(reader->buf) - reader->len);
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_message(LOG_ERROR, "Call to read() failed while reading login trace.");
+      return false;
+    }
+    if (result == 0) {
+      break;
+    }
+    reader->len += (size_t) result;
+  }
+  return true;
+}
+
+static bool get_varint(login_trace_reader_t *reader, uint64_t *value)
+{
+  uint64_t result = 0;
+  for (unsigned int shift = 0; shift < 64; shift += 7) {
+    if (reader->pos >= reader->len) {
+      return false;
+    }
+    unsigned char byte = reader->buf[reader->pos++];
+    result |= (uint64_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool login_trace_reader_open(login_trace_reader_t *reader, const char *path)
+{
+  memset(reader, 0, offsetof(login_trace_reader_t, buf));
+  reader->fd = open(path, O_RDONLY);
+  if (reader->fd == -1) {
+    log_message(LOG_ERROR, "Failed to open login trace %s: %s", path, strerror(errno));
+    return false;
+  }
+  if (!reader_fill(reader) || reader->len < TRACE_HEADER_SIZE
+      || memcmp(reader->buf, TRACE_MAGIC, 4) != 0
+      || get_u32(reader->buf + 4) != TRACE_VERSION) {
+    log_message(LOG_ERROR, "%s is not a version %u login trace", path, TRACE_VERSION);
+    login_trace_reader_close(reader);
+    return false;
+  }
+  uint64_t base = (uint64_t) get_u32(reader->buf + 8) | (uint64_t) get_u32(reader->buf + 12) << 32;
+  reader->base_time = (time_t) (int64_t) base;
+  reader->pos = TRACE_HEADER_SIZE;
+  return true;
+}
+
+int login_trace_reader_next(login_trace_reader_t *reader, login_trace_record_t *record)
+{
+  if (!reader_fill(reader)) {
+    return -1;
+  }
+  if (reader->pos == reader->len) {
+    return 0;
+  }
+
+  uint64_t arrival_delta;
+  uint64_t time_offset;
+  if (!get_varint(reader, &arrival_delta) || reader->len - reader->pos < 4) {
+    goto malformed;
+  }
+  record->ip = get_u32(reader->buf + reader->pos);
+  reader->pos += 4;
+  if (!get_varint(reader, &time_offset) || reader->len - reader->pos < 2) {
+    goto malformed;
+  }
+  unsigned char kind = reader->buf[reader->pos++];
+  size_t userid_len = reader->buf[reader->pos++];
+  if (reader->len - reader->pos < userid_len
+      || (kind >> 4) > LOGIN_TRACE_PASSWORD_WRONG
+      || (kind & 0x0f) > LOGIN_FAIL_INTERNAL_ERROR) {
+    goto malformed;
+  }
+
+  reader->arrival_us += zigzag_decode(arrival_delta);
+  if (reader->arrival_us < 0) {
+    goto malformed;
+  }
+  record->arrival_us = (uint64_t) reader->arrival_us;
+  record->login_time = (time_t) ((int64_t) reader->base_time + zigzag_decode(time_offset));
+  record->password_class = (login_trace_password_class_t) (kind >> 4);
+  record->result = (login_result_t) (kind & 0x0f);
+  record->userid_len = userid_len;
+  memcpy(record->userid, reader->buf + reader->pos, userid_len);
+  record->userid[userid_len] = '\0';
+  reader->pos += userid_len;
+  return 1;
+
+malformed:
+  log_message(LOG_ERROR, "Login trace is truncated or malformed.");
+  return -1;
+}
+
+void login_trace_reader_close(login_trace_reader_t *reader)
+{
+  if (reader->fd != -1) {
+    close(reader->fd);
+    reader->fd = -1;
+  }
+}
@@ -0,0 +1,104 @@
+#ifndef LOGIN_TRACE_H
+#define LOGIN_TRACE_H
+
+/**
+ * @file login_trace.h
+ * @brief Recording and reading of compact binary login traffic traces.
+ *
+ * While a trace is active, every handle_login() call appends one record
+ * (userid, password class, client IP, login time, arrival time and the
+ * observed result) to the trace file. The arrival time is taken when
+ * handle_login() is entered; the record is appended when it returns, so
+ * records are in completion order and overlapping logins' arrivals can go
+ * backwards. Traces are read back by the replay tool (see login_replay.h)
+ * to drive the login path with a realistic mix and timing of requests.
+ *
+ * File layout: a 16-byte header ("LTRC", u32 version, i64 base time) and a
+ * stream of variable-length records:
+ *
+ *   varint  zigzag-encoded arrival - the previous record's, in microseconds
+ *   u32     client IP (little endian)
+ *   varint  zigzag-encoded login_time - base time
+ *   u8      password class << 4 | login result
+ *   u8      userid length
+ *   ...     userid bytes (not null-terminated)
+ */
+
+#include "account.h"
+#include "login.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LOGIN_TRACE_MAX_USERID 255
+
+typedef enum {
+  LOGIN_TRACE_PASSWORD_UNCHECKED = 0, // request was decided before the password was checked
+  LOGIN_TRACE_PASSWORD_CORRECT,       // password verified successfully
+  LOGIN_TRACE_PASSWORD_WRONG          // password was checked and rejected
+} login_trace_password_class_t;
+
+typedef struct {
+  uint64_t arrival_us;          // arrival time, relative to the start of recording
+  time_t login_time;
+  ip4_addr_t ip;
+  login_trace_password_class_t password_class;
+  login_result_t result;        // result observed when the trace was recorded
+  size_t userid_len;
+  char userid[LOGIN_TRACE_MAX_USERID + 1]; // null-terminated
+} login_trace_record_t;
+
+typedef struct {
+  int fd;
+  time_t base_time;
+  int64_t arrival_us;           // running arrival time of the last record read
+  size_t pos;
+  size_t len;
+  unsigned char buf[65536];
+} login_trace_reader_t;
+
+////
+// Recording
+
+// start recording to a newly created (truncated) file at path.
+// returns false and logs an error if the file cannot be created or a trace is
+// already being recorded.
+bool login_trace_start(const char *path);
+
+// flush and close the active trace. returns false if there was no active trace
+// or the final flush failed.
+bool login_trace_stop(void);
+
+// whether a trace is being recorded
+bool login_trace_is_active(void);
+
+// classify a login result by what it says about the supplied password
+login_trace_password_class_t login_trace_classify(login_result_t result);
+
+// the arrival time to pass to login_trace_record() for a login starting
+// now: a CLOCK_MONOTONIC reading in nanoseconds, or 0 if no trace is active
+uint64_t login_trace_now(void);
+
+// append a record for a completed login attempt that arrived at arrival_ns
+// (from login_trace_now(); 0, or a time before recording started, counts as
+// the start). Does nothing if no trace is active. Safe to call from
+// multiple threads.
+void login_trace_record(const char *userid, login_result_t result,
+                        ip4_addr_t client_ip, time_t login_time, uint64_t arrival_ns);
+
+////
+// Reading
+
+// open a trace file for reading. returns false and logs an error on failure.
+bool login_trace_reader_open(login_trace_reader_t *reader, const char *path);
+
+// read the next record. returns 1 if a record was read, 0 at end of file, and
+// -1 (after logging an error) if the trace is malformed or a read fails.
+int login_trace_reader_next(login_trace_reader_t *reader, login_trace_record_t *record);
+
+// close a reader opened with login_trace_reader_open
+void login_trace_reader_close(login_trace_reader_t *reader);
+
+#endif // LOGIN_TRACE_H
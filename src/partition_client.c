@@ -0,0 +1,1358 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "partition_client.h"
+#include "account_codec.h"
+#include "account_store.h"
+#include "logging.h"
+#include "partition_server.h"
+#include "userid_filter.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MIN_READ_BUFFER (64 * 1024)
+// read buffers grown beyond this (by a scan) are freed after the call
+#define KEEP_READ_BUFFER (1024 * 1024)
+
+typedef struct {
+  unsigned char *data;
+  size_t len;
+  size_t cap;
+} buffer_t;
+
+typedef struct {
+  int fd;                            // -1 = not open
+  bool opened;                       // has been open before
+  pthread_mutex_t lock;              // held for a whole call
+  buffer_t out;                      // requests being sent
+  buffer_t in;                       // replies received
+  size_t in_pos;                     // start of the first unread reply
+} connection_t;
+
+typedef struct {
+  char *path;
+  connection_t *conns;
+} partition_t;
+
+struct partition_client {
+  pthread_rwlock_t lock;             // write-held only to change partitions
+  partition_t *partitions;           // those on ring, then dropped ones that
+                                     // still hold accounts
+  size_t count;                      // partitions on ring
+  size_t npartitions;                // including the dropped ones
+  partition_ring_t *ring;
+  pthread_mutex_t rebalance_lock;    // held by rebalancing and listing userids
+  // while a rebalance moves accounts (old_ring is set), the accounts of
+  // store shards before next_shard are with their owners on ring, and the
+  // rest with their owners on old_ring (whose partitions old_index maps to
+  // ours), except next_shard's while moving is set. calls to old owners
+  // hold their shard back from moving, counting in in_flight.
+  pthread_mutex_t migration_lock;
+  pthread_cond_t migration_changed;
+  partition_ring_t *old_ring;
+  size_t *old_index;
+  size_t next_shard;
+  bool moving;
+  unsigned int in_flight[ACCOUNT_STORE_SHARDS];
+  unsigned int connections;
+  unsigned int pipeline_depth;
+  unsigned int ring_points;
+  unsigned int scan_page;
+  _Atomic uint64_t requests;
+  _Atomic uint64_t round_trips;
+  _Atomic uint64_t reconnects;
+};
+
+/**
+ * One request of a batch, and what its reply said.
+ */
+typedef struct {
+  partition_op_t op;
+  size_t partition;                  // index of the partition to send it to
+  const char *userid;                // LOOKUP, REMOVE
+  const account_t *acc;              // PUT, RECORD_LOGIN
+  uint64_t shard;                    // SCAN
+  uint64_t start;                    // SCAN: first userid hash of the page
+  uint32_t limit;                    // SCAN: accounts per page
+  account_t *result;                 // LOOKUP: filled in if found
+  buffer_t *reply;                   // SCAN: the accounts are appended here
+  bool more;                         // SCAN: another page follows...
+  uint64_t next;                     // ... starting here
+  uint64_t count;                    // COUNT
+  partition_status_t status;         // PARTITION_ERROR if there was no reply
+  // set by route() while rebalancing
+  uint64_t hash;                     // of the userid
+  size_t store_shard;                // the account_store_shard_of() hash
+  bool pinned;                       // counted in in_flight[store_shard]
+  bool try_both;                     // LOOKUP of a moving account: if not
+  size_t old_owner;                  // found at partition, try here
+} request_t;
+
+static _Atomic unsigned int thread_counter = 0;
+static _Thread_local unsigned int thread_number = 0;
+
+static bool reserve(buffer_t *buf, size_t more)
+{
+  if (buf->cap - buf->len >= more) {
+    return true;
+  }
+  size_t cap = buf->cap ? buf->cap : 4096;
+  while (cap - buf->len < more) {
+    cap *= 2;
+  }
+  unsigned char *data = realloc(buf->data, cap);
+  if (!data) {
+    return false;
+  }
+  buf->data = data;
+  buf->cap = cap;
+  return true;
+}
+
+static bool send_all(int fd, const unsigned char *data, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= (size_t) n;
+  }
+  return true;
+}
+
+static bool init_partition(partition_t *partition, const char *path, unsigned int connections)
+{
+  partition->path = strdup(path);
+  partition->conns = calloc(connections, sizeof(*partition->conns));
+  if (!partition->path || !partition->conns) {
+    free(partition->path);
+    free(partition->conns);
+    return false;
+  }
+  for (unsigned int i = 0; i < connections; i++) {
+    partition->conns[i].fd = -1;
+    pthread_mutex_init(&partition->conns[i].lock, NULL);
+  }
+  return true;
+}
+
+static void free_partition(partition_t *partition, unsigned int connections)
+{
+  for (unsigned int i = 0; i < connections; i++) {
+    connection_t *conn = &partition->conns[i];
+    if (conn->fd >= 0) {
+      close(conn->fd);
+    }
+    free(conn->out.data);
+    free(conn->in.data);
+    pthread_mutex_destroy(&conn->lock);
+  }
+  free(partition->conns);
+  free(partition->path);
+}
+
+static void close_connection(connection_t *conn)
+{
+  if (conn->fd >= 0) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  conn->in.len = 0;
+  conn->in_pos = 0;
+  conn->out.len = 0;
+}
+
+static bool open_connection(partition_client_t *client, const partition_t *partition,
+                            connection_t *conn)
+{
+  if (conn->fd >= 0) {
+    return true;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(partition->path) >= sizeof(addr.sun_path)) {
+    log_message(LOG_ERROR, "Partition socket path %s is too long", partition->path);
+    return false;
+  }
+  strcpy(addr.sun_path, partition->path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    log_message(LOG_ERROR, "Failed to connect to partition %s: %s", partition->path,
+                strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  conn->fd = fd;
+  if (conn->opened) {
+    atomic_fetch_add_explicit(&client->reconnects, 1, memory_order_relaxed);
+  }
+  conn->opened = true;
+  return true;
+}
+
+/**
+ * Appends req's frame to out. Returns false if there is no memory for it.
+ */
+static bool encode_request(const request_t *req, buffer_t *out)
+{
+  if (!reserve(out, 5 + ACCOUNT_CODEC_MAX_SIZE)) {
+    return false;
+  }
+  size_t start = out->len;
+  unsigned char *p = out->data + start + 4;
+  *p++ = (unsigned char) req->op;
+  switch (req->op) {
+  case PARTITION_OP_LOOKUP:
+  case PARTITION_OP_REMOVE: {
+    size_t len = strlen(req->userid);
+    memcpy(p, req->userid, len);
+    p += len;
+    break;
+  }
+  case PARTITION_OP_PUT:
+  case PARTITION_OP_RECORD_LOGIN:
+    p += account_codec_encode(req->acc, p);
+    break;
+  case PARTITION_OP_SCAN:
+    memcpy(p, &req->shard, sizeof(req->shard));
+    p += sizeof(req->shard);
+    memcpy(p, &req->start, sizeof(req->start));
+    p += sizeof(req->start);
+    memcpy(p, &req->limit, sizeof(req->limit));
+    p += sizeof(req->limit);
+    break;
+  case PARTITION_OP_COUNT:
+    break;
+  }
+  uint32_t body = (uint32_t) (p - (out->data + start + 4));
+  memcpy(out->data + start, &body, sizeof(body));
+  out->len = start + 4 + body;
+  return true;
+}
+
+/**
+ * Reads the next reply on conn, setting *body and *len to it. The body
+ * stays valid until the next call. Returns false if the connection fails
+ * or the reply is malformed.
+ */
+static bool next_reply(connection_t *conn, const unsigned char **body, uint32_t *len)
+{
+  for (;;) {
+    size_t avail = conn->in.len - conn->in_pos;
+    size_t need = 4;
+    if (avail >= 4) {
+      memcpy(len, conn->in.data + conn->in_pos, sizeof(*len));
+      if (*len == 0 || *len > PARTITION_MAX_REPLY) {
+        return false;
+      }
+      if (avail - 4 >= *len) {
+        *body = conn->in.data + conn->in_pos + 4;
+        conn->in_pos += 4 + (size_t) *len;
+        return true;
+      }
+      need = 4 + (size_t) *len;
+    }
+    if (conn->in_pos > 0) {
+      memmove(conn->in.data, conn->in.data + conn->in_pos, avail);
+      conn->in.len = avail;
+      conn->in_pos = 0;
+    }
+    if (!reserve(&conn->in, need > MIN_READ_BUFFER ? need - avail : MIN_READ_BUFFER - avail)) {
+      return false;
+    }
+    ssize_t n = recv(conn->fd, conn->in.data + conn->in.len, conn->in.cap - conn->in.len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    conn->in.len += (size_t) n;
+  }
+}
+
+/**
+ * Fills in req's status and results from its reply. Returns false if the
+ * reply is malformed or there is no memory for its results.
+ */
+static bool decode_reply(request_t *req, const unsigned char *body, uint32_t len)
+{
+  req->status = (partition_status_t) body[0];
+  const unsigned char *result = body + 1;
+  size_t result_len = len - 1;
+  if (req->op == PARTITION_OP_LOOKUP && req->status == PARTITION_FOUND) {
+    return account_codec_decode(result, result_len, req->result) == result_len;
+  }
+  if (req->op == PARTITION_OP_SCAN && req->status == PARTITION_OK) {
+    size_t header = 1 + sizeof(req->next);
+    if (result_len < header || !reserve(req->reply, result_len - header)) {
+      return false;
+    }
+    req->more = result[0] != 0;
+    memcpy(&req->next, result + 1, sizeof(req->next));
+    if (result_len > header) {
+      memcpy(req->reply->data + req->reply->len, result + header, result_len - header);
+      req->reply->len += result_len - header;
+    }
+  }
+  if (req->op == PARTITION_OP_COUNT && req->status == PARTITION_OK) {
+    if (result_len != sizeof(req->count)) {
+      return false;
+    }
+    memcpy(&req->count, result, sizeof(req->count));
+  }
+  return true;
+}
+
+/**
+ * Sends each request to its partition and reads the replies, pipelining:
+ * requests are sent in windows of about pipeline_depth per partition, and
+ * all of a window's requests go out before any of its replies are read.
+ * Uses this thread's connection to each partition involved, locking them
+ * in partition order so that concurrent batches cannot deadlock. Call with
+ * client->lock held. Returns false (after logging) if a partition could not
+ * be reached; its requests are left with PARTITION_ERROR.
+ */
+static bool run_batch(partition_client_t *client, partition_t *partitions, size_t npartitions,
+                      request_t *reqs, size_t count)
+{
+  if (thread_number == 0) {
+    thread_number = atomic_fetch_add(&thread_counter, 1) + 1;
+  }
+  size_t slot = thread_number % client->connections;
+  bool *involved = calloc(npartitions, sizeof(*involved));
+  if (!involved) {
+    log_message(LOG_ERROR, "Out of memory sending partition requests");
+    return false;
+  }
+  size_t ninvolved = 0;
+  for (size_t i = 0; i < count; i++) {
+    reqs[i].status = PARTITION_ERROR;
+    ninvolved += !involved[reqs[i].partition];
+    involved[reqs[i].partition] = true;
+  }
+  for (size_t p = 0; p < npartitions; p++) {
+    if (involved[p]) {
+      pthread_mutex_lock(&partitions[p].conns[slot].lock);
+      open_connection(client, &partitions[p], &partitions[p].conns[slot]);
+    }
+  }
+
+  bool ok = true;
+  size_t window = (size_t) client->pipeline_depth * ninvolved;
+  for (size_t start = 0; start < count; start += window) {
+    size_t end = count - start < window ? count : start + window;
+    for (size_t p = 0; p < npartitions; p++) {
+      connection_t *conn = &partitions[p].conns[slot];
+      if (!involved[p] || conn->fd < 0) {
+        continue;
+      }
+      bool encoded = true;
+      for (size_t i = start; encoded && i < end; i++) {
+        encoded = reqs[i].partition != p || encode_request(&reqs[i], &conn->out);
+      }
+      if (conn->out.len > 0) {
+        if (!encoded || !send_all(conn->fd, conn->out.data, conn->out.len)) {
+          log_message(LOG_ERROR, "Failed to send requests to partition %s", partitions[p].path);
+          close_connection(conn);
+          continue;
+        }
+        conn->out.len = 0;
+        atomic_fetch_add_explicit(&client->round_trips, 1, memory_order_relaxed);
+      }
+    }
+    for (size_t p = 0; p < npartitions; p++) {
+      connection_t *conn = &partitions[p].conns[slot];
+      for (size_t i = start; involved[p] && conn->fd >= 0 && i < end; i++) {
+        const unsigned char *body;
+        uint32_t len;
+        if (reqs[i].partition == p
+            && (!next_reply(conn, &body, &len) || !decode_reply(&reqs[i], body, len))) {
+          log_message(LOG_ERROR, "Lost connection to partition %s", partitions[p].path);
+          reqs[i].status = PARTITION_ERROR;
+          close_connection(conn);
+        }
+      }
+    }
+  }
+
+  for (size_t p = 0; p < npartitions; p++) {
+    if (involved[p]) {
+      connection_t *conn = &partitions[p].conns[slot];
+      ok = ok && conn->fd >= 0;
+      if (conn->in.cap > KEEP_READ_BUFFER && conn->in_pos == conn->in.len) {
+        free(conn->in.data);
+        conn->in = (buffer_t) { NULL, 0, 0 };
+        conn->in_pos = 0;
+      }
+      pthread_mutex_unlock(&conn->lock);
+    }
+  }
+  free(involved);
+  atomic_fetch_add_explicit(&client->requests, count, memory_order_relaxed);
+  return ok;
+}
+
+/**
+ * Whether any of the requests changes an account in the store shard being
+ * moved. Caller holds client->migration_lock.
+ */
+static bool writes_moving_shard(const partition_client_t *client, const request_t *reqs,
+                                size_t count)
+{
+  for (size_t i = 0; client->moving && i < count; i++) {
+    if (reqs[i].store_shard == client->next_shard && reqs[i].op != PARTITION_OP_LOOKUP) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Picks the partition holding each request's account. While a
+ * rebalance is moving accounts, requests for store shards it has yet to
+ * move go to their old owners, holding the shard back until they finish;
+ * writes to the shard being moved wait until it has moved, and lookups in
+ * it are flagged to try both owners. Call with client->lock held. Returns
+ * whether a rebalance is under way.
+ */
+static bool route(partition_client_t *client, request_t *reqs, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    userid_key_t key;
+    const char *userid = reqs[i].acc ? reqs[i].acc->userid : reqs[i].userid;
+    userid_key_init(&key, userid);
+    reqs[i].hash = key.hash;
+    reqs[i].store_shard = account_store_shard_of(key.hash);
+    reqs[i].partition = partition_ring_owner(client->ring, key.hash);
+    reqs[i].pinned = false;
+    reqs[i].try_both = false;
+  }
+  pthread_mutex_lock(&client->migration_lock);
+  bool rebalancing = client->old_ring != NULL;
+  while (rebalancing && writes_moving_shard(client, reqs, count)) {
+    pthread_cond_wait(&client->migration_changed, &client->migration_lock);
+  }
+  for (size_t i = 0; rebalancing && i < count; i++) {
+    if (reqs[i].store_shard < client->next_shard) {
+      continue;
+    }
+    size_t old = client->old_index[partition_ring_owner(client->old_ring, reqs[i].hash)];
+    if (client->moving && reqs[i].store_shard == client->next_shard) {
+      reqs[i].old_owner = old;
+      reqs[i].try_both = old != reqs[i].partition;
+    } else {
+      reqs[i].partition = old;
+      reqs[i].pinned = true;
+      client->in_flight[reqs[i].store_shard]++;
+    }
+  }
+  pthread_mutex_unlock(&client->migration_lock);
+  return rebalancing;
+}
+
+/**
+ * Lets the shards that route() held back move once their requests are done.
+ */
+static void unpin(partition_client_t *client, const request_t *reqs, size_t count)
+{
+  pthread_mutex_lock(&client->migration_lock);
+  bool released = false;
+  for (size_t i = 0; i < count; i++) {
+    if (reqs[i].pinned) {
+      released |= --client->in_flight[reqs[i].store_shard] == 0;
+    }
+  }
+  if (released) {
+    pthread_cond_broadcast(&client->migration_changed);
+  }
+  pthread_mutex_unlock(&client->migration_lock);
+}
+
+/**
+ * Retries the flagged lookups of moving accounts that their new owner did
+ * not have: on the old owner, then on the new one again, as a rebalance
+ * puts an account on its new owner before removing the old copy, and may
+ * have moved it between the first two tries.
+ */
+static bool retry_lookups(partition_client_t *client, request_t *reqs, size_t count)
+{
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    n += reqs[i].try_both && reqs[i].status == PARTITION_NOT_FOUND;
+  }
+  if (n == 0) {
+    return true;
+  }
+  request_t *retries = malloc(n * sizeof(*retries));
+  size_t *index = malloc(n * sizeof(*index));
+  bool ok = retries && index;
+  for (int attempt = 0; ok && attempt < 2 && n > 0; attempt++) {
+    n = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (reqs[i].try_both && reqs[i].status == PARTITION_NOT_FOUND) {
+        retries[n] = reqs[i];
+        retries[n].partition = attempt == 0 ? reqs[i].old_owner : reqs[i].partition;
+        index[n++] = i;
+      }
+    }
+    ok = run_batch(client, client->partitions, client->npartitions, retries, n);
+    for (size_t j = 0; j < n; j++) {
+      reqs[index[j]].status = retries[j].status;
+    }
+  }
+  if (!retries || !index) {
+    log_message(LOG_ERROR, "Out of memory looking up moving accounts");
+  }
+  free(retries);
+  free(index);
+  return ok;
+}
+
+/**
+ * Runs a batch against the client's partitions, routing each request by
+ * its userid.
+ */
+static bool run(partition_client_t *client, request_t *reqs, size_t count)
+{
+  pthread_rwlock_rdlock(&client->lock);
+  bool rebalancing = route(client, reqs, count);
+  bool ok = run_batch(client, client->partitions, client->npartitions, reqs, count);
+  if (rebalancing) {
+    ok = retry_lookups(client, reqs, count) && ok;
+    unpin(client, reqs, count);
+  }
+  pthread_rwlock_unlock(&client->lock);
+  return ok;
+}
+
+static bool set_up_partitions(partition_t **partitions, const char *const *paths, size_t count,
+                              unsigned int connections)
+{
+  *partitions = calloc(count, sizeof(**partitions));
+  if (!*partitions) {
+    return false;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (!init_partition(&(*partitions)[i], paths[i], connections)) {
+      while (i-- > 0) {
+        free_partition(&(*partitions)[i], connections);
+      }
+      free(*partitions);
+      return false;
+    }
+  }
+  return true;
+}
+
+partition_client_t *partition_client_create(const char *const *paths, size_t count,
+                                            const partition_client_options_t *opts)
+{
+  if (!paths || count == 0) {
+    log_message(LOG_ERROR, "A partition client needs at least one partition");
+    return NULL;
+  }
+  if (opts && opts->pipeline_depth > PARTITION_CLIENT_MAX_PIPELINE_DEPTH) {
+    log_message(LOG_ERROR, "Partition pipeline depth %u is over the limit of %d",
+                opts->pipeline_depth, PARTITION_CLIENT_MAX_PIPELINE_DEPTH);
+    return NULL;
+  }
+  if (opts && opts->scan_page > PARTITION_MAX_SCAN_PAGE) {
+    log_message(LOG_ERROR, "Partition scan page of %u accounts is over the limit of %d",
+                opts->scan_page, PARTITION_MAX_SCAN_PAGE);
+    return NULL;
+  }
+  partition_client_t *client = calloc(1, sizeof(*client));
+  if (!client) {
+    log_message(LOG_ERROR, "Out of memory creating partition client");
+    return NULL;
+  }
+  client->connections = opts && opts->connections ? opts->connections
+                                                  : PARTITION_CLIENT_DEFAULT_CONNECTIONS;
+  client->pipeline_depth = opts && opts->pipeline_depth
+                               ? opts->pipeline_depth : PARTITION_CLIENT_DEFAULT_PIPELINE_DEPTH;
+  client->ring_points = opts ? opts->ring_points : 0;
+  client->scan_page = opts && opts->scan_page ? opts->scan_page
+                                              : PARTITION_CLIENT_DEFAULT_SCAN_PAGE;
+  client->ring = partition_ring_create(paths, count, client->ring_points);
+  if (!client->ring
+      || !set_up_partitions(&client->partitions, paths, count, client->connections)) {
+    log_message(LOG_ERROR, "Out of memory creating partition client");
+    partition_ring_destroy(client->ring);
+    free(client);
+    return NULL;
+  }
+  client->count = count;
+  client->npartitions = count;
+  pthread_rwlock_init(&client->lock, NULL);
+  pthread_mutex_init(&client->rebalance_lock, NULL);
+  pthread_mutex_init(&client->migration_lock, NULL);
+  pthread_cond_init(&client->migration_changed, NULL);
+  return client;
+}
+
+void partition_client_destroy(partition_client_t *client)
+{
+  if (!client) {
+    return;
+  }
+  for (size_t i = 0; i < client->npartitions; i++) {
+    free_partition(&client->partitions[i], client->connections);
+  }
+  free(client->partitions);
+  partition_ring_destroy(client->ring);
+  pthread_rwlock_destroy(&client->lock);
+  pthread_mutex_destroy(&client->rebalance_lock);
+  pthread_mutex_destroy(&client->migration_lock);
+  pthread_cond_destroy(&client->migration_changed);
+  free(client);
+}
+
+bool partition_client_lookup(partition_client_t *client, const char *userid, account_t *acc)
+{
+  userid_key_t key;
+  return userid_key_init(&key, userid) && partition_client_lookup_key(client, &key, acc);
+}
+
+bool partition_client_lookup_key(partition_client_t *client, const userid_key_t *key,
+                                 account_t *acc)
+{
+  if (!client || !key || !acc) {
+    return false;
+  }
+  request_t req = { .op = PARTITION_OP_LOOKUP, .userid = key->str, .result = acc };
+  run(client, &req, 1);
+  return req.status == PARTITION_FOUND;
+}
+
+bool partition_client_lookup_many(partition_client_t *client, const char *const *userids,
+                                  size_t count, account_t *accs, bool *found)
+{
+  if (!client || !userids || !accs || !found) {
+    return false;
+  }
+  request_t *reqs = calloc(count ? count : 1, sizeof(*reqs));
+  if (!reqs) {
+    log_message(LOG_ERROR, "Out of memory looking up %zu accounts", count);
+    return false;
+  }
+  // userids no account can have are not sent
+  size_t *index = malloc((count ? count : 1) * sizeof(*index));
+  if (!index) {
+    log_message(LOG_ERROR, "Out of memory looking up %zu accounts", count);
+    free(reqs);
+    return false;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    userid_key_t key;
+    found[i] = false;
+    if (userid_key_init(&key, userids[i])) {
+      reqs[n] = (request_t) { .op = PARTITION_OP_LOOKUP, .userid = userids[i],
+                              .result = &accs[i] };
+      index[n++] = i;
+    }
+  }
+  bool ok = run(client, reqs, n);
+  for (size_t j = 0; j < n; j++) {
+    found[index[j]] = reqs[j].status == PARTITION_FOUND;
+  }
+  free(index);
+  free(reqs);
+  return ok;
+}
+
+bool partition_client_put(partition_client_t *client, const account_t *acc)
+{
+  return acc && partition_client_put_many(client, acc, 1);
+}
+
+bool partition_client_put_many(partition_client_t *client, const account_t *accs,
+                               size_t count)
+{
+  if (!client || (!accs && count > 0)) {
+    return false;
+  }
+  request_t *reqs = calloc(count ? count : 1, sizeof(*reqs));
+  if (!reqs) {
+    log_message(LOG_ERROR, "Out of memory storing %zu accounts", count);
+    return false;
+  }
+  size_t n = 0;
+  bool ok = true;
+  for (size_t i = 0; i < count; i++) {
+    userid_key_t key;
+    if (userid_key_init(&key, accs[i].userid)) {
+      reqs[n++] = (request_t) { .op = PARTITION_OP_PUT, .acc = &accs[i] };
+    } else {
+      log_message(LOG_ERROR, "Account to store has no valid userid");
+      ok = false;
+    }
+  }
+  ok = run(client, reqs, n) && ok;
+  for (size_t j = 0; j < n; j++) {
+    if (reqs[j].status == PARTITION_ERROR) {
+      log_message(LOG_ERROR, "Partition refused account %s", reqs[j].acc->userid);
+      ok = false;
+    } else {
+      userid_filter_add(reqs[j].acc->userid);
+    }
+  }
+  free(reqs);
+  return ok;
+}
+
+bool partition_client_remove(partition_client_t *client, const char *userid)
+{
+  userid_key_t key;
+  if (!client || !userid_key_init(&key, userid)) {
+    return false;
+  }
+  request_t req = { .op = PARTITION_OP_REMOVE, .userid = userid };
+  run(client, &req, 1);
+  return req.status == PARTITION_OK;
+}
+
+bool partition_client_record_login(partition_client_t *client, const account_t *acc)
+{
+  userid_key_t key;
+  if (!client || !acc || !userid_key_init(&key, acc->userid)) {
+    return false;
+  }
+  request_t req = { .op = PARTITION_OP_RECORD_LOGIN, .acc = acc };
+  run(client, &req, 1);
+  return req.status == PARTITION_OK;
+}
+
+bool partition_client_counts(partition_client_t *client, uint64_t *counts)
+{
+  if (!client || !counts) {
+    return false;
+  }
+  pthread_rwlock_rdlock(&client->lock);
+  request_t *reqs = calloc(client->count, sizeof(*reqs));
+  bool ok = reqs != NULL;
+  for (size_t p = 0; ok && p < client->count; p++) {
+    reqs[p] = (request_t) { .op = PARTITION_OP_COUNT, .partition = p };
+  }
+  ok = ok && run_batch(client, client->partitions, client->npartitions, reqs, client->count);
+  for (size_t p = 0; reqs && p < client->count; p++) {
+    counts[p] = reqs[p].status == PARTITION_OK ? reqs[p].count : 0;
+  }
+  pthread_rwlock_unlock(&client->lock);
+  free(reqs);
+  return ok;
+}
+
+size_t partition_client_partitions(partition_client_t *client)
+{
+  pthread_rwlock_rdlock(&client->lock);
+  size_t count = client->count;
+  pthread_rwlock_unlock(&client->lock);
+  return count;
+}
+
+// called with each page of accounts scanned from partition from; returns
+// false to stop the scan
+typedef bool (*scan_page_fn)(partition_client_t *client, size_t from, const account_t *accs,
+                             size_t count, void *ctx);
+
+/**
+ * Scans one store shard of partition from a page at a time, passing each
+ * page's accounts to fn. Call with client->lock held. Returns false (after
+ * logging) if the partition could not be scanned, or if fn stopped the
+ * scan.
+ */
+static bool scan_shard(partition_client_t *client, size_t from, uint64_t shard,
+                       scan_page_fn fn, void *ctx)
+{
+  buffer_t scanned = { NULL, 0, 0 };
+  account_t *accs = NULL;
+  size_t allocated = 0;
+  request_t scan = { .op = PARTITION_OP_SCAN, .partition = from, .shard = shard,
+                     .limit = client->scan_page, .reply = &scanned, .more = true };
+  bool ok = true;
+  while (ok && scan.more) {
+    scanned.len = 0;
+    if (!run_batch(client, client->partitions, client->npartitions, &scan, 1)
+        || scan.status != PARTITION_OK) {
+      log_message(LOG_ERROR, "Failed to scan partition %s", client->partitions[from].path);
+      ok = false;
+      break;
+    }
+    size_t count = 0;
+    for (size_t pos = 0; ok && pos < scanned.len; count++) {
+      if (count == allocated) {
+        size_t more = allocated ? allocated * 2 : 256;
+        account_t *more_accs = realloc(accs, more * sizeof(*accs));
+        accs = more_accs ? more_accs : accs;
+        allocated = more_accs ? more : allocated;
+        ok = more_accs != NULL;
+      }
+      size_t used = ok ? account_codec_decode(scanned.data + pos, scanned.len - pos,
+                                              &accs[count])
+                       : 0;
+      ok = used > 0;
+      pos += used;
+    }
+    if (!ok) {
+      log_message(LOG_ERROR, "Failed to read accounts scanned from partition %s",
+                  client->partitions[from].path);
+      break;
+    }
+    ok = fn(client, from, accs, count, ctx);
+    scan.start = scan.next;
+  }
+  free(scanned.data);
+  free(accs);
+  return ok;
+}
+
+/**
+ * Moves the accounts of a page scanned from partition from whose owner on
+ * the client's ring is another partition: each is put on its new owner
+ * and, once that has succeeded, removed from from. Failures are counted in
+ * the report (ctx).
+ */
+static bool move_page(partition_client_t *client, size_t from, const account_t *accs,
+                      size_t count, void *ctx)
+{
+  partition_rebalance_report_t *report = ctx;
+  request_t *reqs = calloc(count ? count : 1, sizeof(*reqs));
+  if (!reqs) {
+    log_message(LOG_ERROR, "Out of memory moving accounts from partition %s",
+                client->partitions[from].path);
+    return false;
+  }
+  size_t moving = 0;
+  for (size_t i = 0; i < count; i++) {
+    userid_key_t key;
+    if (userid_key_init(&key, accs[i].userid)) {
+      report->scanned++;
+      size_t owner = partition_ring_owner(client->ring, key.hash);
+      if (owner != from) {
+        reqs[moving++] = (request_t) { .op = PARTITION_OP_PUT, .partition = owner,
+                                       .acc = &accs[i] };
+      }
+    }
+  }
+  run_batch(client, client->partitions, client->npartitions, reqs, moving);
+  size_t removing = 0;
+  for (size_t i = 0; i < moving; i++) {
+    if (reqs[i].status == PARTITION_OK) {
+      const char *userid = reqs[i].acc->userid;
+      reqs[removing++] = (request_t) { .op = PARTITION_OP_REMOVE, .userid = userid,
+                                       .partition = from };
+    } else {
+      report->failed++;
+    }
+  }
+  run_batch(client, client->partitions, client->npartitions, reqs, removing);
+  // an old copy left behind would be moved back over the new one by a
+  // later rebalance, so it counts as a failure
+  for (size_t i = 0; i < removing; i++) {
+    if (reqs[i].status == PARTITION_OK) {
+      report->moved++;
+    } else {
+      report->failed++;
+    }
+  }
+  free(reqs);
+  return true;
+}
+
+/**
+ * Makes paths the client's partitions, routed by ring, keeping the current
+ * ones with those paths and, after them, those being dropped, and starts
+ * routing by both rings. Returns false if memory runs out, leaving the
+ * client unchanged. Call with client->lock write-held.
+ */
+static bool begin_rebalance(partition_client_t *client, const char *const *paths, size_t count,
+                            partition_ring_t *ring)
+{
+  partition_t *partitions = calloc(count + client->npartitions, sizeof(*partitions));
+  size_t *where = calloc(client->npartitions, sizeof(*where));
+  bool *kept = calloc(client->npartitions, sizeof(*kept));
+  bool *fresh = calloc(count, sizeof(*fresh));
+  bool ok = partitions && where && kept && fresh;
+  for (size_t i = 0; ok && i < count; i++) {
+    size_t j = 0;
+    while (j < client->npartitions
+           && (kept[j] || strcmp(client->partitions[j].path, paths[i]) != 0)) {
+      j++;
+    }
+    if (j < client->npartitions) {
+      partitions[i] = client->partitions[j];
+      kept[j] = true;
+      where[j] = i;
+    } else {
+      ok = fresh[i] = init_partition(&partitions[i], paths[i], client->connections);
+    }
+  }
+  if (!ok) {
+    for (size_t i = 0; fresh && i < count; i++) {
+      if (fresh[i]) {
+        free_partition(&partitions[i], client->connections);
+      }
+    }
+    free(partitions);
+    free(where);
+    free(kept);
+    free(fresh);
+    return false;
+  }
+  size_t npartitions = count;
+  for (size_t j = 0; j < client->npartitions; j++) {
+    if (!kept[j]) {
+      where[j] = npartitions;
+      partitions[npartitions++] = client->partitions[j];
+    }
+  }
+  free(kept);
+  free(fresh);
+
+  free(client->partitions);
+  pthread_mutex_lock(&client->migration_lock);
+  client->old_ring = client->ring;
+  client->old_index = where;
+  client->next_shard = 0;
+  client->moving = false;
+  pthread_mutex_unlock(&client->migration_lock);
+  client->partitions = partitions;
+  client->count = count;
+  client->npartitions = npartitions;
+  client->ring = ring;
+  return true;
+}
+
+/**
+ * Stops routing by the old ring and frees the dropped partitions that
+ * have been emptied (none, if emptied is NULL). Call with client->lock
+ * write-held.
+ */
+static void end_rebalance(partition_client_t *client, const bool *emptied)
+{
+  pthread_mutex_lock(&client->migration_lock);
+  partition_ring_destroy(client->old_ring);
+  free(client->old_index);
+  client->old_ring = NULL;
+  client->old_index = NULL;
+  pthread_mutex_unlock(&client->migration_lock);
+  size_t npartitions = client->count;
+  for (size_t p = client->count; p < client->npartitions; p++) {
+    if (emptied && emptied[p - client->count]) {
+      free_partition(&client->partitions[p], client->connections);
+    } else {
+      client->partitions[npartitions++] = client->partitions[p];
+    }
+  }
+  client->npartitions = npartitions;
+}
+
+bool partition_client_rebalance(partition_client_t *client, const char *const *paths,
+                                size_t count, partition_rebalance_report_t *report)
+{
+  partition_rebalance_report_t ignored;
+  if (!report) {
+    report = &ignored;
+  }
+  memset(report, 0, sizeof(*report));
+  if (!client || !paths || count == 0) {
+    log_message(LOG_ERROR, "Partitions to rebalance onto are missing");
+    return false;
+  }
+  pthread_mutex_lock(&client->rebalance_lock);
+  partition_ring_t *ring = partition_ring_create(paths, count, client->ring_points);
+  pthread_rwlock_wrlock(&client->lock);
+  bool ok = ring && begin_rebalance(client, paths, count, ring);
+  pthread_rwlock_unlock(&client->lock);
+  if (!ok) {
+    log_message(LOG_ERROR, "Out of memory rebalancing partitions");
+    partition_ring_destroy(ring);
+    pthread_mutex_unlock(&client->rebalance_lock);
+    return false;
+  }
+
+  // move a store shard at a time, once the calls that went to its old
+  // owners are done; the client's other calls carry on meanwhile
+  pthread_rwlock_rdlock(&client->lock);
+  for (size_t shard = 0; shard < ACCOUNT_STORE_SHARDS; shard++) {
+    pthread_mutex_lock(&client->migration_lock);
+    client->next_shard = shard;
+    client->moving = true;
+    while (client->in_flight[shard] > 0) {
+      pthread_cond_wait(&client->migration_changed, &client->migration_lock);
+    }
+    pthread_mutex_unlock(&client->migration_lock);
+    for (size_t p = 0; p < client->npartitions; p++) {
+      ok = scan_shard(client, p, shard, move_page, report) && ok;
+    }
+    pthread_mutex_lock(&client->migration_lock);
+    client->next_shard = shard + 1;
+    client->moving = false;
+    pthread_cond_broadcast(&client->migration_changed);
+    pthread_mutex_unlock(&client->migration_lock);
+  }
+  ok = ok && report->failed == 0;
+
+  // dropped partitions are kept until they are empty, so that a retry can
+  // move what is left on them
+  size_t dropped = client->npartitions - client->count;
+  request_t *counts = calloc(dropped ? dropped : 1, sizeof(*counts));
+  bool *emptied = calloc(dropped ? dropped : 1, sizeof(*emptied));
+  for (size_t i = 0; counts && i < dropped; i++) {
+    counts[i] = (request_t) { .op = PARTITION_OP_COUNT, .partition = client->count + i };
+  }
+  if (counts && emptied) {
+    run_batch(client, client->partitions, client->npartitions, counts, dropped);
+  }
+  for (size_t i = 0; counts && emptied && i < dropped; i++) {
+    emptied[i] = counts[i].status == PARTITION_OK && counts[i].count == 0;
+  }
+  pthread_rwlock_unlock(&client->lock);
+
+  pthread_rwlock_wrlock(&client->lock);
+  end_rebalance(client, emptied);
+  pthread_rwlock_unlock(&client->lock);
+  pthread_mutex_unlock(&client->rebalance_lock);
+  free(counts);
+  free(emptied);
+  if (!ok) {
+    log_message(LOG_ERROR, "Rebalancing left %" PRIu64 " accounts on their old partitions",
+                report->failed);
+  }
+  return ok;
+}
+
+void partition_client_get_stats(partition_client_t *client, partition_client_stats_t *stats)
+{
+  if (!client || !stats) {
+    return;
+  }
+  stats->requests = atomic_load(&client->requests);
+  stats->round_trips = atomic_load(&client->round_trips);
+  stats->reconnects = atomic_load(&client->reconnects);
+}
+
+static bool backend_lookup(void *arg, const userid_key_t *key, account_t *acc)
+{
+  return partition_client_lookup_key(arg, key, acc);
+}
+
+static void backend_record_login(void *arg, const account_t *acc)
+{
+  if (!partition_client_record_login(arg, acc)) {
+    log_message(LOG_ERROR, "Failed to record login for partitioned account %s", acc->userid);
+  }
+}
+
+typedef struct {
+  db_userid_fn fn;
+  void *ctx;
+} userid_walk_t;
+
+static bool list_page(partition_client_t *client, size_t from, const account_t *accs,
+                      size_t count, void *ctx)
+{
+  (void) client;
+  (void) from;
+  userid_walk_t *walk = ctx;
+  for (size_t i = 0; i < count; i++) {
+    if (!walk->fn(accs[i].userid, walk->ctx)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Scans every shard of every partition, including dropped ones that still
+ * hold accounts, passing each account's userid to fn. Rebalancing waits
+ * meanwhile, so no account is missed by moving.
+ */
+static bool backend_foreach_userid(void *arg, db_userid_fn fn, void *ctx)
+{
+  partition_client_t *client = arg;
+  userid_walk_t walk = { fn, ctx };
+  bool complete = true;
+  pthread_mutex_lock(&client->rebalance_lock);
+  pthread_rwlock_rdlock(&client->lock);
+  for (size_t p = 0; complete && p < client->npartitions; p++) {
+    for (uint64_t shard = 0; complete && shard < ACCOUNT_STORE_SHARDS; shard++) {
+      complete = scan_shard(client, p, shard, list_page, &walk);
+    }
+  }
+  pthread_rwlock_unlock(&client->lock);
+  pthread_mutex_unlock(&client->rebalance_lock);
+  return complete;
+}
+
+void partition_client_backend(partition_client_t *client, db_backend_t *backend)
+{
+  if (backend) {
+    backend->lookup = backend_lookup;
+    backend->record_login = backend_record_login;
+    backend->lookup_async = NULL;
+    backend->foreach_userid = backend_foreach_userid;
+    backend->arg = client;
+  }
+}
+
+#ifdef PARTITION_BENCH_MAIN
+
+#include <stdio.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define LOAD_BATCH 1000
+
+typedef struct {
+  partition_client_t *client;
+  unsigned long lookups;
+  unsigned long accounts;
+  unsigned int batch;            // 0 = one lookup at a time
+  unsigned int seed;
+  unsigned long found;
+} bench_worker_t;
+
+static double seconds_since(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Forks a process serving a partition at path. It says it is ready by
+ * writing a byte to ready[1], and exits once quit[0] reaches end of file,
+ * which happens when the parent closes quit[1] or dies.
+ */
+static pid_t spawn_partition(const char *path, const int ready[2], const int quit[2])
+{
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+  close(ready[0]);
+  close(quit[1]);
+  int ready_fd = ready[1];
+  int quit_fd = quit[0];
+  partition_server_t *server = partition_server_start(path);
+  char byte = server ? 1 : 0;
+  if (write(ready_fd, &byte, 1) != 1 || !server) {
+    _exit(1);
+  }
+  while (read(quit_fd, &byte, 1) != 0) {
+    continue;
+  }
+  partition_server_stop(server);
+  _exit(0);
+}
+
+static void *bench_worker(void *arg)
+{
+  bench_worker_t *w = arg;
+  unsigned int batch = w->batch ? w->batch : 1;
+  char (*userids)[32] = calloc(batch, sizeof(*userids));
+  const char **ptrs = calloc(batch, sizeof(*ptrs));
+  account_t *accs = calloc(batch, sizeof(*accs));
+  bool *found = calloc(batch, sizeof(*found));
+  if (!userids || !ptrs || !accs || !found) {
+    return NULL;
+  }
+  for (unsigned long done = 0; done < w->lookups; done += batch) {
+    unsigned int n = w->lookups - done < batch ? (unsigned int) (w->lookups - done) : batch;
+    for (unsigned int i = 0; i < n; i++) {
+      w->seed = w->seed * 1103515245u + 12345u;
+      snprintf(userids[i], sizeof(userids[i]), "user%lu", (unsigned long) w->seed % w->accounts);
+      ptrs[i] = userids[i];
+    }
+    if (w->batch) {
+      partition_client_lookup_many(w->client, ptrs, n, accs, found);
+      for (unsigned int i = 0; i < n; i++) {
+        w->found += found[i];
+      }
+    } else {
+      w->found += partition_client_lookup(w->client, ptrs[0], &accs[0]);
+    }
+  }
+  free(userids);
+  free(ptrs);
+  free(accs);
+  free(found);
+  return NULL;
+}
+
+static double run_lookups(partition_client_t *client, unsigned int threads, unsigned long lookups,
+                          unsigned long accounts, unsigned int batch, unsigned long *found)
+{
+  pthread_t *tids = calloc(threads, sizeof(*tids));
+  bench_worker_t *workers = calloc(threads, sizeof(*workers));
+  if (!tids || !workers) {
+    return 0;
+  }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned int t = 0; t < threads; t++) {
+    workers[t] = (bench_worker_t) {
+      .client = client, .lookups = lookups / threads + (t < lookups % threads),
+      .accounts = accounts, .batch = batch, .seed = t + 1
+    };
+    pthread_create(&tids[t], NULL, bench_worker, &workers[t]);
+  }
+  *found = 0;
+  for (unsigned int t = 0; t < threads; t++) {
+    pthread_join(tids[t], NULL);
+    *found += workers[t].found;
+  }
+  double seconds = seconds_since(&start);
+  free(tids);
+  free(workers);
+  return seconds;
+}
+
+static void print_counts(partition_client_t *client, const char *when)
+{
+  uint64_t counts[64];
+  size_t n = partition_client_partitions(client);
+  if (n <= 64 && partition_client_counts(client, counts)) {
+    dprintf(STDOUT_FILENO, "accounts per partition %s:", when);
+    for (size_t p = 0; p < n; p++) {
+      dprintf(STDOUT_FILENO, " %" PRIu64, counts[p]);
+    }
+    dprintf(STDOUT_FILENO, "\n");
+  }
+}
+
+/**
+ * Partitioned account service benchmark.
+ *
+ * Usage: app PARTITIONS ACCOUNTS LOOKUPS [THREADS [BATCH]]
+ *
+ * Starts PARTITIONS partition server processes (and one spare), each with
+ * its socket in a fresh directory under /tmp, and stores ACCOUNTS accounts
+ * (user0 onwards) across them. Then times LOOKUPS lookups of random
+ * accounts on THREADS threads (default 1), first one at a time and then
+ * pipelined in batches of BATCH (default PARTITION_CLIENT_DEFAULT_PIPELINE_DEPTH),
+ * and finally rebalances onto the spare partition as well, reporting how
+ * many accounts moved.
+ */
+int main(int argc, char **argv)
+{
+  if (argc < 4) {
+    dprintf(STDERR_FILENO, "usage: %s PARTITIONS ACCOUNTS LOOKUPS [THREADS [BATCH]]\n", argv[0]);
+    return 2;
+  }
+  unsigned long partitions = strtoul(argv[1], NULL, 10);
+  unsigned long accounts = strtoul(argv[2], NULL, 10);
+  unsigned long lookups = strtoul(argv[3], NULL, 10);
+  unsigned int threads = argc > 4 ? (unsigned int) strtoul(argv[4], NULL, 10) : 1;
+  unsigned int batch = argc > 5 ? (unsigned int) strtoul(argv[5], NULL, 10)
+                                : PARTITION_CLIENT_DEFAULT_PIPELINE_DEPTH;
+  if (partitions == 0 || partitions > 63 || accounts == 0 || threads == 0 || batch == 0) {
+    dprintf(STDERR_FILENO, "%s: PARTITIONS must be 1 to 63, and ACCOUNTS, THREADS and BATCH "
+            "positive\n", argv[0]);
+    return 2;
+  }
+
+  char dir[] = "/tmp/partition-bench-XXXXXX";
+  int ready[2];
+  int quit[2];
+  if (!mkdtemp(dir) || pipe(ready) != 0 || pipe(quit) != 0) {
+    dprintf(STDERR_FILENO, "%s: failed to set up: %s\n", argv[0], strerror(errno));
+    return 1;
+  }
+  // the servers are forked before this process starts any threads
+  char paths[64][64];
+  const char *path_ptrs[64];
+  pid_t pids[64];
+  for (unsigned long p = 0; p <= partitions; p++) {
+    snprintf(paths[p], sizeof(paths[p]), "%s/p%lu.sock", dir, p);
+    path_ptrs[p] = paths[p];
+    pids[p] = spawn_partition(paths[p], ready, quit);
+  }
+  close(quit[0]);
+  close(ready[1]);
+  bool started = true;
+  for (unsigned long p = 0; p <= partitions; p++) {
+    char byte = 0;
+    started = read(ready[0], &byte, 1) == 1 && byte && started;
+  }
+
+  partition_client_options_t opts = { .connections = threads };
+  partition_client_t *client = started ? partition_client_create(path_ptrs, partitions, &opts)
+                                       : NULL;
+  account_t *model = account_create("bench", "password", "bench@example.com", "2000-01-01");
+  account_t *batch_accs = calloc(LOAD_BATCH, sizeof(*batch_accs));
+  if (!client || !model || !batch_accs) {
+    dprintf(STDERR_FILENO, "%s: failed to set up\n", argv[0]);
+    return 1;
+  }
+
+  // the password is hashed once and the hash shared
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned long i = 0; i < accounts; i += LOAD_BATCH) {
+    size_t n = accounts - i < LOAD_BATCH ? accounts - i : LOAD_BATCH;
+    for (size_t j = 0; j < n; j++) {
+      batch_accs[j] = *model;
+      batch_accs[j].account_id = (int64_t) (i + j) + 1;
+      snprintf(batch_accs[j].userid, sizeof(batch_accs[j].userid), "user%lu", i + j);
+      snprintf(batch_accs[j].email, sizeof(batch_accs[j].email), "user%lu@example.com", i + j);
+    }
+    if (!partition_client_put_many(client, batch_accs, n)) {
+      return 1;
+    }
+  }
+  double seconds = seconds_since(&start);
+  dprintf(STDOUT_FILENO, "stored %lu accounts on %lu partitions in %.2f s (%.0f/s)\n", accounts,
+          partitions, seconds, (double) accounts / seconds);
+  print_counts(client, "before rebalancing");
+
+  unsigned long found;
+  seconds = run_lookups(client, threads, lookups, accounts, 0, &found);
+  dprintf(STDOUT_FILENO, "%lu lookups one at a time on %u threads: %.2f s (%.0f/s), %lu found\n",
+          lookups, threads, seconds, (double) lookups / seconds, found);
+  seconds = run_lookups(client, threads, lookups, accounts, batch, &found);
+  dprintf(STDOUT_FILENO, "%lu lookups in batches of %u on %u threads: %.2f s (%.0f/s), %lu found\n",
+          lookups, batch, threads, seconds, (double) lookups / seconds, found);
+
+  partition_rebalance_report_t report;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  bool ok = partition_client_rebalance(client, path_ptrs, partitions + 1, &report);
+  seconds = seconds_since(&start);
+  dprintf(STDOUT_FILENO, "rebalanced onto %lu partitions in %.2f s: %" PRIu64 " accounts moved "
+          "(%.1f%%), %" PRIu64 " failed\n", partitions + 1, seconds, report.moved,
+          100.0 * (double) report.moved / (double) accounts, report.failed);
+  print_counts(client, "after rebalancing");
+  seconds = run_lookups(client, threads, lookups, accounts, batch, &found);
+  dprintf(STDOUT_FILENO, "%lu lookups in batches after rebalancing: %.2f s (%.0f/s), %lu found\n",
+          lookups, seconds, (double) lookups / seconds, found);
+
+  partition_client_destroy(client);
+  close(quit[1]);
+  for (unsigned long p = 0; p <= partitions; p++) {
+    waitpid(pids[p], NULL, 0);
+  }
+  rmdir(dir);
+  account_free(model);
+  free(batch_accs);
+  return ok && found == lookups ? 0 : 1;
+}
+
+#endif // PARTITION_BENCH_MAIN
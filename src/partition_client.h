@@ -0,0 +1,154 @@
+#ifndef PARTITION_CLIENT_H
+#define PARTITION_CLIENT_H
+
+/**
+ * @file partition_client.h
+ * @brief Client for accounts partitioned across partition server processes.
+ *
+ * A client is given the socket paths of the partition servers (see
+ * partition_server.h) and routes each request to the partition that owns
+ * its userid on a consistent-hash ring of those paths (see
+ * partition_ring.h). The single-account calls make one round trip; the
+ * _many calls pipeline, sending up to pipeline_depth requests to every
+ * partition they involve before reading any replies, so a batch costs
+ * about one round trip per pipeline_depth requests, not one per request.
+ *
+ * Each partition gets a few connections, each serving one call at a time;
+ * a thread keeps to the same one, so concurrent threads mostly use
+ * different connections. A connection that fails is reopened on its next
+ * use; the calls using it when it failed report failure.
+ *
+ * partition_client_rebalance() changes the set of partitions, moving the
+ * accounts whose owner changes one store shard (see account_store.h) at a
+ * time. The client's other calls carry on meanwhile: those for accounts
+ * yet to move go to their old owners, and hold their shard back until
+ * they finish; changes to accounts in the shard being moved wait for it,
+ * and lookups of them try the new owner, then the old one. Other clients
+ * of the same servers are not told; they must be recreated with the new
+ * paths once it returns.
+ *
+ * handle_login() can be served from the partitions by installing the
+ * client as the backend; account lookups and the login counters it
+ * records then go to the owning partition:
+ *
+ *   db_backend_t backend;
+ *   partition_client_backend(client, &backend);
+ *   db_backend_set(&backend);
+ *
+ * Built with -DPARTITION_BENCH_MAIN, partition_client.c has a main() that
+ * benchmarks partitions in separate processes on this machine (see
+ * README.md).
+ */
+
+#include "account.h"
+#include "db_backend.h"
+#include "partition_ring.h"
+#include "userid_key.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PARTITION_CLIENT_DEFAULT_CONNECTIONS 4
+#define PARTITION_CLIENT_DEFAULT_PIPELINE_DEPTH 64
+#define PARTITION_CLIENT_MAX_PIPELINE_DEPTH 1024
+#define PARTITION_CLIENT_DEFAULT_SCAN_PAGE 16384
+
+typedef struct partition_client partition_client_t;
+
+typedef struct {
+  unsigned int connections;    // per partition (0 = the default)
+  unsigned int pipeline_depth; // requests in flight per partition in a
+                               // batch, at most
+                               // PARTITION_CLIENT_MAX_PIPELINE_DEPTH, so
+                               // that a window's requests and replies fit
+                               // in the sockets' buffers (0 = the default)
+  unsigned int ring_points;    // see partition_ring_create() (0 = default)
+  unsigned int scan_page;      // accounts per SCAN reply when rebalancing or
+                               // listing userids, at most
+                               // PARTITION_MAX_SCAN_PAGE (0 = the default)
+} partition_client_options_t;
+
+typedef struct {
+  uint64_t requests;
+  uint64_t round_trips;        // writes of one or more requests
+  uint64_t reconnects;         // connections reopened after failing
+} partition_client_stats_t;
+
+typedef struct {
+  uint64_t scanned;            // accounts looked at (again on their new
+                               // partition, for some that moved)
+  uint64_t moved;              // to their new owners
+  uint64_t failed;             // that could not be moved, and stayed put,
+                               // or whose old copy could not be removed
+} partition_rebalance_report_t;
+
+// make a client for the partition servers at the count socket paths
+// (copied). opts may be NULL. connections are opened as they are needed.
+// returns NULL (after logging) if count is 0, pipeline_depth or scan_page
+// is too large or memory runs out.
+partition_client_t *partition_client_create(const char *const *paths, size_t count,
+                                            const partition_client_options_t *opts);
+
+// close the client's connections and free it. NULL is ignored. client
+// must no longer be the installed backend.
+void partition_client_destroy(partition_client_t *client);
+
+// look userid up on its partition. returns false if there is no such
+// account, or (after logging) if its partition cannot be reached.
+bool partition_client_lookup(partition_client_t *client, const char *userid, account_t *acc);
+
+// as partition_client_lookup(), for a userid already made into a key
+bool partition_client_lookup_key(partition_client_t *client, const userid_key_t *key,
+                                 account_t *acc);
+
+// look up count userids, pipelined. found[i] is set to whether accs[i] was
+// filled in. returns false (after logging) if a partition could not be
+// reached, though the other lookups are still made.
+bool partition_client_lookup_many(partition_client_t *client, const char *const *userids,
+                                  size_t count, account_t *accs, bool *found);
+
+// store acc on its partition, replacing any account with its userid.
+// returns false (after logging) if the partition refuses it (e.g. another
+// of its accounts has acc's email) or cannot be reached.
+bool partition_client_put(partition_client_t *client, const account_t *acc);
+
+// store count accounts, pipelined. returns false (after logging) if any
+// could not be stored; the others still are.
+bool partition_client_put_many(partition_client_t *client, const account_t *accs,
+                               size_t count);
+
+// remove the account with the given userid. returns false if there is no
+// such account or its partition cannot be reached.
+bool partition_client_remove(partition_client_t *client, const char *userid);
+
+// keep acc's login counters (count, fail count, last login time and IP) in
+// the stored account with its userid
+bool partition_client_record_login(partition_client_t *client, const account_t *acc);
+
+// fill counts (one per partition, in the order of the paths) with how many
+// accounts each holds. returns false (after logging) if a partition cannot
+// be reached.
+bool partition_client_counts(partition_client_t *client, uint64_t *counts);
+
+// number of partitions
+size_t partition_client_partitions(partition_client_t *client);
+
+// change the partitions to the servers at the count socket paths (which
+// may include the current ones), moving every account whose owner changes
+// to its new partition. the client then routes by the new paths. returns
+// false (after logging) if memory runs out before anything has moved,
+// leaving the client unchanged, or if a partition could not be scanned or
+// some accounts could not be moved. the client keeps dropped partitions
+// that still hold accounts, and calling again with the same paths retries
+// moving them.
+bool partition_client_rebalance(partition_client_t *client, const char *const *paths,
+                                size_t count, partition_rebalance_report_t *report);
+
+void partition_client_get_stats(partition_client_t *client, partition_client_stats_t *stats);
+
+// fill in backend to look accounts up through client, and record logins
+// on their partitions
+void partition_client_backend(partition_client_t *client, db_backend_t *backend);
+
+#endif // PARTITION_CLIENT_H
@@ -0,0 +1,95 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "partition_ring.h"
+#include "logging.h"
+#include "userid_key.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+  uint64_t hash;
+  size_t partition;
+} point_t;
+
+struct partition_ring {
+  point_t *points;                   // sorted by hash
+  size_t npoints;
+  size_t count;
+};
+
+static int compare_points(const void *a, const void *b)
+{
+  const point_t *x = a;
+  const point_t *y = b;
+  if (x->hash != y->hash) {
+    return x->hash < y->hash ? -1 : 1;
+  }
+  return (x->partition > y->partition) - (x->partition < y->partition);
+}
+
+partition_ring_t *partition_ring_create(const char *const *names, size_t count,
+                                        unsigned int points)
+{
+  if (!names || count == 0) {
+    log_message(LOG_ERROR, "A partition ring needs at least one partition");
+    return NULL;
+  }
+  if (points == 0) {
+    points = PARTITION_RING_DEFAULT_POINTS;
+  }
+  if (count > SIZE_MAX / sizeof(point_t) / points) {
+    log_message(LOG_ERROR, "A partition ring of %zu partitions at %u points is too large",
+                count, points);
+    return NULL;
+  }
+  partition_ring_t *ring = calloc(1, sizeof(*ring));
+  if (!ring || !(ring->points = calloc(count * points, sizeof(*ring->points)))) {
+    log_message(LOG_ERROR, "Out of memory making a partition ring");
+    free(ring);
+    return NULL;
+  }
+  ring->count = count;
+  char label[512];
+  for (size_t p = 0; p < count; p++) {
+    for (unsigned int i = 0; i < points; i++) {
+      int len = snprintf(label, sizeof(label), "%s#%u", names[p], i);
+      point_t *point = &ring->points[ring->npoints++];
+      point->hash = userid_key_hash(label, len < (int) sizeof(label) ? (size_t) len
+                                                                     : sizeof(label) - 1);
+      point->partition = p;
+    }
+  }
+  qsort(ring->points, ring->npoints, sizeof(*ring->points), compare_points);
+  return ring;
+}
+
+void partition_ring_destroy(partition_ring_t *ring)
+{
+  if (ring) {
+    free(ring->points);
+    free(ring);
+  }
+}
+
+size_t partition_ring_owner(const partition_ring_t *ring, uint64_t hash)
+{
+  // the first point at or after hash
+  size_t lo = 0;
+  size_t hi = ring->npoints;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ring->points[mid].hash < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return ring->points[lo == ring->npoints ? 0 : lo].partition;
+}
+
+size_t partition_ring_size(const partition_ring_t *ring)
+{
+  return ring->count;
+}
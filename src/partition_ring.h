@@ -0,0 +1,45 @@
+#ifndef PARTITION_RING_H
+#define PARTITION_RING_H
+
+/**
+ * @file partition_ring.h
+ * @brief Consistent hashing of userids onto partitions.
+ *
+ * Each partition is placed at a number of points on a ring of 64-bit
+ * hashes, derived from its name alone; a userid belongs to the partition
+ * at the first point at or after its userid_key_hash(), wrapping round.
+ * Because a partition's points do not depend on which other partitions
+ * there are, adding or removing one moves only the userids between its
+ * points and their neighbours' (about 1/n of them), and every userid that
+ * moves moves to or from that partition. The more points per partition,
+ * the more evenly userids are spread.
+ *
+ * A ring is immutable once made, so any number of threads may use it.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PARTITION_RING_DEFAULT_POINTS 128
+
+typedef struct partition_ring partition_ring_t;
+
+// make a ring of count partitions (count > 0), each at points points
+// (0 = PARTITION_RING_DEFAULT_POINTS). partitions are known by their index
+// in names, and placed by the names themselves, which must differ.
+// returns NULL (after logging) if memory runs out or count * points is too
+// many to address.
+partition_ring_t *partition_ring_create(const char *const *names, size_t count,
+                                        unsigned int points);
+
+// free a ring. NULL is ignored.
+void partition_ring_destroy(partition_ring_t *ring);
+
+// index of the partition that owns a userid with the given hash
+size_t partition_ring_owner(const partition_ring_t *ring, uint64_t hash);
+
+// number of partitions
+size_t partition_ring_size(const partition_ring_t *ring);
+
+#endif // PARTITION_RING_H
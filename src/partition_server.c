@@ -0,0 +1,515 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "partition_server.h"
+#include "account_alloc.h"
+#include "account_codec.h"
+#include "account_store.h"
+#include "logging.h"
+#include "userid_key.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// requests are read into a buffer of this size, which always has room for
+// at least one whole request
+#define READ_BUFFER_SIZE (64 * 1024)
+// reply buffers grown beyond this (by a scan) are freed once written
+#define KEEP_REPLY_BUFFER (1024 * 1024)
+
+typedef struct {
+  unsigned char *data;
+  size_t len;
+  size_t cap;
+} buffer_t;
+
+typedef struct connection {
+  int fd;
+  pthread_t thread;
+  atomic_bool done;                  // the thread has finished with fd
+  struct partition_server *server;
+  struct connection *next;
+} connection_t;
+
+struct partition_server {
+  int listen_fd;
+  char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+  pthread_t accept_thread;
+  pthread_mutex_t lock;              // guards connections and stopping
+  connection_t *connections;
+  bool stopping;
+  _Atomic uint64_t accepted;
+  _Atomic uint64_t requests;
+  _Atomic uint64_t batches;
+};
+
+static bool reserve(buffer_t *buf, size_t more)
+{
+  if (buf->cap - buf->len >= more) {
+    return true;
+  }
+  size_t cap = buf->cap ? buf->cap : 4096;
+  while (cap - buf->len < more) {
+    cap *= 2;
+  }
+  unsigned char *data = realloc(buf->data, cap);
+  if (!data) {
+    return false;
+  }
+  buf->data = data;
+  buf->cap = cap;
+  return true;
+}
+
+static bool send_all(int fd, const unsigned char *data, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= (size_t) n;
+  }
+  return true;
+}
+
+/**
+ * Copies a userid argument into a null-terminated buffer of
+ * USER_ID_LENGTH bytes. Returns false if it cannot be a userid.
+ */
+static bool userid_arg(const unsigned char *arg, size_t len, char *userid)
+{
+  if (len == 0 || len >= USER_ID_LENGTH || memchr(arg, '\0', len)) {
+    return false;
+  }
+  memcpy(userid, arg, len);
+  userid[len] = '\0';
+  return true;
+}
+
+static bool account_arg(const unsigned char *arg, size_t len, account_t *acc)
+{
+  return len > 0 && account_codec_decode(arg, len, acc) == len;
+}
+
+static partition_status_t put_account(const account_t *acc)
+{
+  if (account_store_update(acc)) {
+    return PARTITION_OK;
+  }
+  if (account_store_contains(acc->userid)) {
+    // refused: its new email is another account's
+    return PARTITION_ERROR;
+  }
+  account_t *stored = account_alloc();
+  if (!stored) {
+    return PARTITION_ERROR;
+  }
+  *stored = *acc;
+  if (!account_store_insert(stored)) {
+    account_release(stored);
+    return PARTITION_ERROR;
+  }
+  return PARTITION_OK;
+}
+
+static bool keep_login_counters(account_t *stored, void *arg)
+{
+  const account_t *acc = arg;
+  stored->login_count = acc->login_count;
+  stored->login_fail_count = acc->login_fail_count;
+  stored->last_login_time = acc->last_login_time;
+  stored->last_ip = acc->last_ip;
+  return true;
+}
+
+// a full page still fits a reply, with room for accounts added mid-scan
+_Static_assert(PARTITION_MAX_SCAN_PAGE * ACCOUNT_CODEC_MAX_SIZE * 2 <= PARTITION_MAX_REPLY,
+               "SCAN page size");
+
+typedef struct {
+  uint64_t start;                    // the page's first hash
+  uint64_t end;                      // ... and last, once chosen
+  uint64_t *hashes;                  // of the accounts from start on
+  size_t count;
+  size_t cap;
+  buffer_t *out;
+  bool failed;
+} scan_page_t;
+
+static uint64_t hash_of(const account_t *acc)
+{
+  return userid_key_hash(acc->userid, strnlen(acc->userid, USER_ID_LENGTH));
+}
+
+static int compare_hashes(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+static bool collect_hash(const account_t *acc, void *arg)
+{
+  scan_page_t *page = arg;
+  uint64_t hash = hash_of(acc);
+  if (hash < page->start) {
+    return true;
+  }
+  if (page->count == page->cap) {
+    size_t cap = page->cap ? page->cap * 2 : 1024;
+    uint64_t *hashes = realloc(page->hashes, cap * sizeof(*hashes));
+    if (!hashes) {
+      page->failed = true;
+      return false;
+    }
+    page->hashes = hashes;
+    page->cap = cap;
+  }
+  page->hashes[page->count++] = hash;
+  return true;
+}
+
+static bool encode_in_page(const account_t *acc, void *arg)
+{
+  scan_page_t *page = arg;
+  uint64_t hash = hash_of(acc);
+  if (hash < page->start || hash > page->end) {
+    return true;
+  }
+  buffer_t *out = page->out;
+  if (out->len >= PARTITION_MAX_REPLY - ACCOUNT_CODEC_MAX_SIZE
+      || !reserve(out, ACCOUNT_CODEC_MAX_SIZE)) {
+    page->failed = true;
+    return false;
+  }
+  out->len += account_codec_encode(acc, out->data + out->len);
+  return true;
+}
+
+/**
+ * Appends to out the accounts in shard whose userid hashes are start or
+ * more, in pages of about limit: whether there are more, where the next
+ * page starts, then the accounts. A page ends at a hash, so an account
+ * that is in the shard throughout a paged scan is sent exactly once.
+ */
+static partition_status_t scan_shard(size_t shard, uint64_t start, uint32_t limit,
+                                     buffer_t *out)
+{
+  scan_page_t page = { .start = start, .out = out };
+  if (!account_store_foreach_in_shard(shard, collect_hash, &page)) {
+    free(page.hashes);
+    return PARTITION_ERROR;
+  }
+  bool more = page.count > limit;
+  page.end = UINT64_MAX;
+  if (more) {
+    qsort(page.hashes, page.count, sizeof(*page.hashes), compare_hashes);
+    page.end = page.hashes[limit - 1];
+    more = page.end != UINT64_MAX;
+  }
+  free(page.hashes);
+  if (!reserve(out, 1 + sizeof(uint64_t))) {
+    return PARTITION_ERROR;
+  }
+  uint64_t next = more ? page.end + 1 : 0;
+  out->data[out->len] = more;
+  memcpy(out->data + out->len + 1, &next, sizeof(next));
+  out->len += 1 + sizeof(next);
+  // accounts added since they were counted may be sent too
+  if (!account_store_foreach_in_shard(shard, encode_in_page, &page) || page.failed) {
+    return PARTITION_ERROR;
+  }
+  return PARTITION_OK;
+}
+
+/**
+ * Handles one request, appending its reply frame to out. Returns false
+ * only if there is no memory for the reply.
+ */
+static bool handle_request(const unsigned char *req, size_t len, buffer_t *out)
+{
+  if (!reserve(out, 5 + ACCOUNT_CODEC_MAX_SIZE)) {
+    return false;
+  }
+  size_t start = out->len;
+  out->len += 5;
+  const unsigned char *arg = req + 1;
+  size_t arg_len = len - 1;
+  partition_status_t status = PARTITION_ERROR;
+  char userid[USER_ID_LENGTH];
+  account_t acc;
+
+  switch ((partition_op_t) req[0]) {
+  case PARTITION_OP_LOOKUP:
+    if (userid_arg(arg, arg_len, userid)) {
+      status = PARTITION_NOT_FOUND;
+      if (account_store_lookup(userid, &acc)) {
+        out->len += account_codec_encode(&acc, out->data + out->len);
+        status = PARTITION_FOUND;
+      }
+    }
+    break;
+  case PARTITION_OP_PUT:
+    if (account_arg(arg, arg_len, &acc)) {
+      status = put_account(&acc);
+    }
+    break;
+  case PARTITION_OP_RECORD_LOGIN:
+    if (account_arg(arg, arg_len, &acc)) {
+      status = account_store_modify(acc.userid, keep_login_counters, &acc)
+                   ? PARTITION_OK : PARTITION_NOT_FOUND;
+    }
+    break;
+  case PARTITION_OP_REMOVE:
+    if (userid_arg(arg, arg_len, userid)) {
+      status = account_store_remove(userid) ? PARTITION_OK : PARTITION_NOT_FOUND;
+    }
+    break;
+  case PARTITION_OP_SCAN: {
+    uint64_t shard;
+    uint64_t first;
+    uint32_t limit;
+    if (arg_len == sizeof(shard) + sizeof(first) + sizeof(limit)) {
+      memcpy(&shard, arg, sizeof(shard));
+      memcpy(&first, arg + sizeof(shard), sizeof(first));
+      memcpy(&limit, arg + sizeof(shard) + sizeof(first), sizeof(limit));
+      if (shard < ACCOUNT_STORE_SHARDS && limit > 0) {
+        status = scan_shard((size_t) shard, first,
+                            limit < PARTITION_MAX_SCAN_PAGE ? limit : PARTITION_MAX_SCAN_PAGE,
+                            out);
+      }
+    }
+    if (status != PARTITION_OK) {
+      out->len = start + 5;
+    }
+    break;
+  }
+  case PARTITION_OP_COUNT: {
+    uint64_t count = account_store_count();
+    memcpy(out->data + out->len, &count, sizeof(count));
+    out->len += sizeof(count);
+    status = PARTITION_OK;
+    break;
+  }
+  }
+
+  uint32_t body = (uint32_t) (out->len - start - 4);
+  memcpy(out->data + start, &body, sizeof(body));
+  out->data[start + 4] = (unsigned char) status;
+  return true;
+}
+
+/**
+ * Serves one connection: reads what requests have arrived, handles every
+ * whole one and writes their replies together, until the client goes away
+ * or sends something malformed.
+ */
+static void *serve_connection(void *arg)
+{
+  connection_t *conn = arg;
+  partition_server_t *server = conn->server;
+  unsigned char *in = malloc(READ_BUFFER_SIZE);
+  size_t in_len = 0;
+  buffer_t out = { NULL, 0, 0 };
+  bool ok = in != NULL;
+
+  while (ok) {
+    ssize_t n = recv(conn->fd, in + in_len, READ_BUFFER_SIZE - in_len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    in_len += (size_t) n;
+
+    size_t pos = 0;
+    uint64_t handled = 0;
+    while (ok && in_len - pos >= 4) {
+      uint32_t body;
+      memcpy(&body, in + pos, sizeof(body));
+      if (body == 0 || body > PARTITION_MAX_REQUEST) {
+        log_message(LOG_ERROR, "Malformed request on partition socket %s", server->path);
+        ok = false;
+      } else if (in_len - pos - 4 < body) {
+        break;
+      } else {
+        ok = handle_request(in + pos + 4, body, &out);
+        pos += 4 + body;
+        handled++;
+      }
+    }
+    memmove(in, in + pos, in_len - pos);
+    in_len -= pos;
+    if (handled) {
+      atomic_fetch_add_explicit(&server->requests, handled, memory_order_relaxed);
+      atomic_fetch_add_explicit(&server->batches, 1, memory_order_relaxed);
+    }
+    if (ok && out.len > 0) {
+      ok = send_all(conn->fd, out.data, out.len);
+      out.len = 0;
+      if (out.cap > KEEP_REPLY_BUFFER) {
+        free(out.data);
+        out = (buffer_t) { NULL, 0, 0 };
+      }
+    }
+  }
+  free(in);
+  free(out.data);
+  shutdown(conn->fd, SHUT_RDWR);
+  atomic_store(&conn->done, true);
+  return NULL;
+}
+
+static void finish_connection(connection_t *conn)
+{
+  pthread_join(conn->thread, NULL);
+  close(conn->fd);
+  free(conn);
+}
+
+/**
+ * Joins and frees the connections whose clients have gone. Call with
+ * server->lock held.
+ */
+static void reap_connections(partition_server_t *server)
+{
+  connection_t **link = &server->connections;
+  while (*link) {
+    connection_t *conn = *link;
+    if (atomic_load(&conn->done)) {
+      *link = conn->next;
+      finish_connection(conn);
+    } else {
+      link = &conn->next;
+    }
+  }
+}
+
+static void *accept_loop(void *arg)
+{
+  partition_server_t *server = arg;
+  for (;;) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+    pthread_mutex_lock(&server->lock);
+    if (server->stopping) {
+      pthread_mutex_unlock(&server->lock);
+      if (fd >= 0) {
+        close(fd);
+      }
+      return NULL;
+    }
+    reap_connections(server);
+    connection_t *conn = fd >= 0 ? calloc(1, sizeof(*conn)) : NULL;
+    if (conn) {
+      conn->fd = fd;
+      conn->server = server;
+      if (pthread_create(&conn->thread, NULL, serve_connection, conn) == 0) {
+        conn->next = server->connections;
+        server->connections = conn;
+        atomic_fetch_add_explicit(&server->accepted, 1, memory_order_relaxed);
+      } else {
+        free(conn);
+        conn = NULL;
+      }
+    }
+    pthread_mutex_unlock(&server->lock);
+    if (fd >= 0 && !conn) {
+      log_message(LOG_ERROR, "Failed to serve a connection on partition socket %s",
+                  server->path);
+      close(fd);
+    } else if (fd < 0 && errno != EINTR && errno != ECONNABORTED) {
+      log_message(LOG_ERROR, "Failed to accept on partition socket %s: %s", server->path,
+                  strerror(errno));
+      // e.g. out of descriptors: give connections a moment to close
+      struct timespec pause = { 0, 10 * 1000 * 1000 };
+      nanosleep(&pause, NULL);
+    }
+  }
+}
+
+partition_server_t *partition_server_start(const char *path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+    log_message(LOG_ERROR, "Partition socket path is missing or too long");
+    return NULL;
+  }
+  strcpy(addr.sun_path, path);
+
+  partition_server_t *server = calloc(1, sizeof(*server));
+  if (!server) {
+    log_message(LOG_ERROR, "Out of memory starting partition server");
+    return NULL;
+  }
+  strcpy(server->path, path);
+  pthread_mutex_init(&server->lock, NULL);
+  server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (server->listen_fd < 0
+      || bind(server->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+      || listen(server->listen_fd, SOMAXCONN) != 0) {
+    log_message(LOG_ERROR, "Failed to listen on partition socket %s: %s", path,
+                strerror(errno));
+  } else if (pthread_create(&server->accept_thread, NULL, accept_loop, server) != 0) {
+    log_message(LOG_ERROR, "Failed to start partition server thread");
+    unlink(path);
+  } else {
+    return server;
+  }
+  if (server->listen_fd >= 0) {
+    close(server->listen_fd);
+  }
+  pthread_mutex_destroy(&server->lock);
+  free(server);
+  return NULL;
+}
+
+void partition_server_stop(partition_server_t *server)
+{
+  if (!server) {
+    return;
+  }
+  pthread_mutex_lock(&server->lock);
+  server->stopping = true;
+  // wakes the accept thread
+  shutdown(server->listen_fd, SHUT_RDWR);
+  pthread_mutex_unlock(&server->lock);
+  pthread_join(server->accept_thread, NULL);
+  close(server->listen_fd);
+  unlink(server->path);
+
+  // no new connections can appear now
+  while (server->connections) {
+    connection_t *conn = server->connections;
+    server->connections = conn->next;
+    shutdown(conn->fd, SHUT_RDWR);
+    finish_connection(conn);
+  }
+  pthread_mutex_destroy(&server->lock);
+  free(server);
+}
+
+void partition_server_get_stats(partition_server_t *server, partition_server_stats_t *stats)
+{
+  if (!server || !stats) {
+    return;
+  }
+  stats->connections = atomic_load(&server->accepted);
+  stats->requests = atomic_load(&server->requests);
+  stats->batches = atomic_load(&server->batches);
+}
@@ -0,0 +1,90 @@
+#ifndef PARTITION_SERVER_H
+#define PARTITION_SERVER_H
+
+/**
+ * @file partition_server.h
+ * @brief Serves this process's account store as one partition, over a Unix socket.
+ *
+ * When the accounts do not fit in one process, they are split into
+ * partitions by consistent hashing of their userids (see partition_ring.h),
+ * each held in the account store of its own process, which runs a
+ * partition server. Clients (see partition_client.h) route each request to
+ * the partition that owns its userid.
+ *
+ * A server answers each connection's requests in order, on a thread per
+ * connection. It reads whatever requests have arrived, handles them all
+ * and writes all their replies at once, so a client that sends many
+ * requests before reading any replies (pipelining) pays for one round trip
+ * and a few system calls, not one per request.
+ *
+ * Messages are frames: a 32-bit length, then that many bytes of body. A
+ * request body is an operation byte and its argument; a reply body is a
+ * status byte and its result. Accounts travel in the account_codec.h
+ * encoding. Numbers are in host byte order, as both ends are on one host.
+ *
+ *   operation                  argument         reply on success
+ *   PARTITION_OP_LOOKUP        userid           FOUND, account
+ *   PARTITION_OP_PUT           account          OK
+ *   PARTITION_OP_RECORD_LOGIN  account          OK
+ *   PARTITION_OP_REMOVE        userid           OK
+ *   PARTITION_OP_SCAN          8-byte shard,    OK, more byte, 8-byte next
+ *                              8-byte start,    start, accounts
+ *                              4-byte limit
+ *   PARTITION_OP_COUNT         (none)           OK, 8-byte count
+ *
+ * PUT inserts the account, or replaces the one with its userid; its email
+ * need only be unique within the partition. RECORD_LOGIN keeps the
+ * account's login counters in the stored one. SCAN returns a page of the
+ * accounts in one of the store's ACCOUNT_STORE_SHARDS shards, for
+ * rebalancing: about limit (at most PARTITION_MAX_SCAN_PAGE) of those whose
+ * userid hashes (userid_key_hash()) are start or more, taking the lowest
+ * hashes. If more is set, the next page is asked for with next start; an
+ * account that stays in the shard throughout is in exactly one page. A
+ * missing account is NOT_FOUND, a request the store refuses ERROR.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PARTITION_MAX_REQUEST 1024
+#define PARTITION_MAX_REPLY (256 * 1024 * 1024)
+// most accounts a SCAN reply is asked for (larger limits are cut to this)
+#define PARTITION_MAX_SCAN_PAGE (256 * 1024)
+
+typedef enum {
+  PARTITION_OP_LOOKUP = 1,
+  PARTITION_OP_PUT,
+  PARTITION_OP_RECORD_LOGIN,
+  PARTITION_OP_REMOVE,
+  PARTITION_OP_SCAN,
+  PARTITION_OP_COUNT
+} partition_op_t;
+
+typedef enum {
+  PARTITION_OK = 0,
+  PARTITION_FOUND,
+  PARTITION_NOT_FOUND,
+  PARTITION_ERROR
+} partition_status_t;
+
+typedef struct partition_server partition_server_t;
+
+typedef struct {
+  uint64_t connections;        // accepted
+  uint64_t requests;
+  uint64_t batches;            // reads that brought in at least one request
+} partition_server_stats_t;
+
+// listen on the Unix socket at path (replacing any stale socket file
+// there) and serve the account store to whoever connects. returns NULL
+// (after logging) if the socket cannot be set up.
+partition_server_t *partition_server_start(const char *path);
+
+// stop listening, close every connection, remove the socket file and free
+// server. NULL is ignored.
+void partition_server_stop(partition_server_t *server);
+
+void partition_server_get_stats(partition_server_t *server, partition_server_stats_t *stats);
+
+#endif // PARTITION_SERVER_H
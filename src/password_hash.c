@@ -0,0 +1,486 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "password_hash.h"
+#include "hash_arena.h"
+#include "logging.h"
+#include "login_span.h"
+#include "rand_pool.h"
+#include "scrypt.h"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SALT_BYTES 16
+#define DIGEST_BYTES 16
+#define HEX_LENGTH (2 * SALT_BYTES)
+#define CALIBRATION_MIN_NS 20000000u   // time at least this much hashing per measurement
+#define CALIBRATION_RUNS 3
+
+static atomic_uint cost = PASSWORD_HASH_LEGACY_ITERATIONS;
+// scrypt parameters for new hashes, packed as log2_n << 48 | r << 24 | p
+// (0 = use PBKDF2); scrypt_memory() bounds r and p below 2^24
+static _Atomic uint64_t scrypt_params = 0;
+
+static int hex_digit(char c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/**
+ * Decodes exactly 2 * n hex digits at hex into out. Returns false if any of
+ * them is not a hex digit.
+ */
+static bool decode_hex(const char *hex, unsigned char *out, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    int hi = hex_digit(hex[2 * i]);
+    int lo = hex_digit(hex[2 * i + 1]);
+    if (hi < 0 || lo < 0) {
+      return false;
+    }
+    out[i] = (unsigned char) (hi << 4 | lo);
+  }
+  return true;
+}
+
+static void encode_hex(const unsigned char *bytes, size_t n, char *out)
+{
+  static const char digits[] = "0123456789abcdef";
+  for (size_t i = 0; i < n; i++) {
+    out[2 * i] = digits[bytes[i] >> 4];
+    out[2 * i + 1] = digits[bytes[i] & 0xf];
+  }
+}
+
+/**
+ * Parses "<salt hex>:<hash hex>" followed by the end of the string.
+ */
+static bool parse_salt_and_digest(const char *s, unsigned char *salt, unsigned char *digest)
+{
+  if (strnlen(s, 2 * HEX_LENGTH + 2) != 2 * HEX_LENGTH + 1 || s[HEX_LENGTH] != ':') {
+    return false;
+  }
+  return decode_hex(s, salt, SALT_BYTES) && decode_hex(s + HEX_LENGTH + 1, digest, DIGEST_BYTES);
+}
+
+/**
+ * Parses "<decimal>$" at p: 1 to 10 digits, with a value from 1 to
+ * INT32_MAX. Returns a pointer past the '$' and sets *value, or returns
+ * NULL if p does not start with such a field.
+ */
+static const char *parse_field(const char *p, unsigned int *value)
+{
+  unsigned long n = 0;
+  const char *digits = p;
+  while (*p >= '0' && *p <= '9' && p - digits < 10) {
+    n = n * 10 + (unsigned long) (*p - '0');
+    p++;
+  }
+  if (p == digits || *p != '$' || n == 0 || n > INT32_MAX) {
+    return NULL;
+  }
+  *value = (unsigned int) n;
+  return p + 1;
+}
+
+/**
+ * Parses the "<prefix><iterations>$" header of a wrapped or $p2$ hash.
+ * Returns a pointer to the "<salt hex>:<hex>" part after it and sets
+ * *iterations, or returns NULL if stored does not start with such a header.
+ */
+static const char *parse_header(const char *stored, const char *prefix, unsigned int *iterations)
+{
+  size_t prefix_len = strlen(prefix);
+  if (!stored || strncmp(stored, prefix, prefix_len) != 0) {
+    return NULL;
+  }
+  return parse_field(stored + prefix_len, iterations);
+}
+
+/**
+ * Writes "<prefix><iterations>$<salt hex>:<digest hex>" to out, or just
+ * "<salt hex>:<digest hex>" if prefix is NULL.
+ */
+static bool format_hash(const char *prefix, unsigned int iterations, const unsigned char *salt,
+                        const unsigned char *digest, char *out, size_t out_len)
+{
+  char salt_hex[HEX_LENGTH + 1];
+  char digest_hex[HEX_LENGTH + 1];
+  encode_hex(salt, SALT_BYTES, salt_hex);
+  encode_hex(digest, DIGEST_BYTES, digest_hex);
+  salt_hex[HEX_LENGTH] = '\0';
+  digest_hex[HEX_LENGTH] = '\0';
+  int written = prefix
+                ? snprintf(out, out_len, "%s%u$%s:%s", prefix, iterations, salt_hex, digest_hex)
+                : snprintf(out, out_len, "%s:%s", salt_hex, digest_hex);
+  return written > 0 && (size_t) written < out_len;
+}
+
+bool password_hash_is_wrapped(const char *stored)
+{
+  return password_hash_wrapped_iterations(stored) != 0;
+}
+
+unsigned int password_hash_wrapped_iterations(const char *stored)
+{
+  unsigned int iterations = 0;
+  return parse_header(stored, PASSWORD_HASH_WRAPPED_PREFIX, &iterations) ? iterations : 0;
+}
+
+bool password_hash_wrap(const char *legacy, unsigned int iterations, char *out, size_t out_len)
+{
+  unsigned char salt[SALT_BYTES];
+  unsigned char inner[DIGEST_BYTES];
+  unsigned char outer[DIGEST_BYTES];
+
+  if (!legacy || iterations == 0 || iterations > INT32_MAX
+      || !parse_salt_and_digest(legacy, salt, inner)) {
+    return false;
+  }
+  bool ok = PKCS5_PBKDF2_HMAC((const char *) inner, sizeof(inner), salt, sizeof(salt),
+                              (int) iterations, EVP_sha256(), sizeof(outer), outer) == 1;
+  OPENSSL_cleanse(inner, sizeof(inner));
+  if (!ok) {
+    log_message(LOG_ERROR, "Failed to wrap password hash.");
+    return false;
+  }
+
+  return format_hash(PASSWORD_HASH_WRAPPED_PREFIX, iterations, salt, outer, out, out_len);
+}
+
+bool password_hash_verify_wrapped(const char *stored, const char *plaintext_password)
+{
+  unsigned int iterations;
+  unsigned char salt[SALT_BYTES];
+  unsigned char expected[DIGEST_BYTES];
+  unsigned char inner[DIGEST_BYTES];
+  unsigned char outer[DIGEST_BYTES];
+
+  const char *rest = parse_header(stored, PASSWORD_HASH_WRAPPED_PREFIX, &iterations);
+  if (!rest || !plaintext_password || !parse_salt_and_digest(rest, salt, expected)) {
+    log_message(LOG_DEBUG, "[ password_hash_verify_wrapped() ] malformed wrapped hash\n");
+    return false;
+  }
+
+  uint64_t span_start = login_span_start();
+  bool ok = PKCS5_PBKDF2_HMAC(plaintext_password, (int) strlen(plaintext_password), salt,
+                              sizeof(salt), PASSWORD_HASH_LEGACY_ITERATIONS, EVP_sha256(),
+                              sizeof(inner), inner) == 1
+            && PKCS5_PBKDF2_HMAC((const char *) inner, sizeof(inner), salt, sizeof(salt),
+                                 (int) iterations, EVP_sha256(), sizeof(outer), outer) == 1;
+  login_span_end("pbkdf2", span_start);
+  OPENSSL_cleanse(inner, sizeof(inner));
+  if (!ok) {
+    log_message(LOG_ERROR, "Failed to hash password.");
+    return false;
+  }
+  return CRYPTO_memcmp(expected, outer, sizeof(outer)) == 0;
+}
+
+unsigned int password_hash_cost(void)
+{
+  return atomic_load_explicit(&cost, memory_order_relaxed);
+}
+
+void password_hash_set_cost(unsigned int iterations)
+{
+  if (iterations == 0) {
+    iterations = PASSWORD_HASH_LEGACY_ITERATIONS;
+  }
+  if (iterations > PASSWORD_HASH_MAX_ITERATIONS) {
+    iterations = PASSWORD_HASH_MAX_ITERATIONS;
+  }
+  atomic_store_explicit(&cost, iterations, memory_order_relaxed);
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Returns the shortest of CALIBRATION_RUNS timings (in nanoseconds, at
+ * least 1) of one hash with the given number of iterations.
+ */
+static uint64_t time_hash(unsigned int iterations)
+{
+  static const char password[] = "calibration password";
+  unsigned char salt[SALT_BYTES] = { 0 };
+  unsigned char digest[DIGEST_BYTES];
+  uint64_t best = UINT64_MAX;
+  for (int run = 0; run < CALIBRATION_RUNS; run++) {
+    uint64_t start = now_ns();
+    PKCS5_PBKDF2_HMAC(password, sizeof(password) - 1, salt, sizeof(salt), (int) iterations,
+                      EVP_sha256(), sizeof(digest), digest);
+    uint64_t elapsed = now_ns() - start;
+    if (elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return best ? best : 1;
+}
+
+unsigned int password_hash_calibrate(const password_hash_budget_t *budget)
+{
+  if (!budget) {
+    return 0;
+  }
+  // the per-hash time the budget allows
+  double allowed_ns = budget->target_ms ? budget->target_ms * 1e6 : 0;
+  if (budget->hashes_per_second > 0) {
+    double threads = budget->threads ? budget->threads : 1;
+    double throughput_ns = threads * 1e9 / budget->hashes_per_second;
+    if (allowed_ns == 0 || throughput_ns < allowed_ns) {
+      allowed_ns = throughput_ns;
+    }
+  }
+  if (allowed_ns <= 0) {
+    log_message(LOG_ERROR, "Password hash calibration needs a latency or throughput budget");
+    return 0;
+  }
+  unsigned int floor = budget->min_iterations ? budget->min_iterations
+                                              : PASSWORD_HASH_LEGACY_ITERATIONS;
+  unsigned int ceiling = budget->max_iterations && budget->max_iterations < PASSWORD_HASH_MAX_ITERATIONS
+                         ? budget->max_iterations : PASSWORD_HASH_MAX_ITERATIONS;
+
+  // time enough iterations for the clock and start-up costs not to matter,
+  // then scale: PBKDF2's time is linear in its iterations
+  unsigned int probe = PASSWORD_HASH_LEGACY_ITERATIONS;
+  uint64_t elapsed = time_hash(probe);
+  while (elapsed < CALIBRATION_MIN_NS && probe <= PASSWORD_HASH_MAX_ITERATIONS / 2
+         && probe < ceiling) {
+    probe *= 2;
+    elapsed = time_hash(probe);
+  }
+  double fitted = (double) probe * allowed_ns / (double) elapsed;
+  unsigned int iterations = fitted >= ceiling ? ceiling : (unsigned int) fitted;
+  if (iterations < floor) {
+    log_message(LOG_WARN, "Password hashes at the minimum of %u iterations will take %.1f ms, "
+                "over the %.1f ms budget", floor, (double) elapsed * floor / probe / 1e6,
+                allowed_ns / 1e6);
+    iterations = floor;
+  }
+  password_hash_set_cost(iterations);
+  log_message(LOG_INFO, "Password hash cost calibrated to %u iterations (about %.1f ms per hash)",
+              iterations, (double) elapsed * iterations / probe / 1e6);
+  return iterations;
+}
+
+/**
+ * scrypt of plaintext_password and salt into digest, working in memory
+ * borrowed from the hash arenas.
+ */
+static bool scrypt_hash(const char *plaintext_password, const unsigned char *salt,
+                        unsigned int log2_n, unsigned int r, unsigned int p,
+                        unsigned char *digest)
+{
+  size_t bytes = scrypt_memory(log2_n, r, p);
+  hash_arena_t arena;
+  uint64_t span_start = login_span_start();
+  if (bytes == 0 || !hash_arena_borrow(bytes, &arena)) {
+    return false;
+  }
+  span_start = login_span_end("arena", span_start);
+  bool ok = scrypt_derive(plaintext_password, strlen(plaintext_password), salt, SALT_BYTES,
+                          log2_n, r, p, arena.memory, bytes, digest, DIGEST_BYTES);
+  login_span_end("scrypt", span_start);
+  hash_arena_return(&arena);
+  return ok;
+}
+
+bool password_hash_use_scrypt(const password_hash_scrypt_t *params)
+{
+  if (!params) {
+    atomic_store(&scrypt_params, 0);
+    return true;
+  }
+  unsigned int log2_n = params->log2_n ? params->log2_n : PASSWORD_HASH_SCRYPT_DEFAULT_LOG2_N;
+  unsigned int r = params->r ? params->r : PASSWORD_HASH_SCRYPT_DEFAULT_R;
+  unsigned int p = params->p ? params->p : PASSWORD_HASH_SCRYPT_DEFAULT_P;
+  size_t bytes = scrypt_memory(log2_n, r, p);
+  if (bytes == 0 || bytes > PASSWORD_HASH_SCRYPT_MAX_BYTES) {
+    log_message(LOG_ERROR, "Invalid scrypt parameters: N = 2^%u, r = %u, p = %u", log2_n, r, p);
+    return false;
+  }
+  atomic_store(&scrypt_params, (uint64_t) log2_n << 48 | (uint64_t) r << 24 | p);
+  return true;
+}
+
+bool password_hash_create(const char *plaintext_password, char *out, size_t out_len)
+{
+  unsigned char salt[SALT_BYTES];
+  unsigned char digest[DIGEST_BYTES];
+  unsigned int iterations = password_hash_cost();
+  uint64_t scrypt_setting = atomic_load(&scrypt_params);
+
+  if (!plaintext_password || !out) {
+    return false;
+  }
+  // a random salt makes every hash unique, defeating precomputed tables
+  if (!rand_pool_bytes(salt, sizeof(salt))) {
+    log_message(LOG_ERROR, "Failed to generate random salt.");
+    return false;
+  }
+
+  bool formatted;
+  if (scrypt_setting) {
+    unsigned int log2_n = (unsigned int) (scrypt_setting >> 48);
+    unsigned int r = (unsigned int) (scrypt_setting >> 24) & 0xffffff;
+    unsigned int p = (unsigned int) scrypt_setting & 0xffffff;
+    if (!scrypt_hash(plaintext_password, salt, log2_n, r, p, digest)) {
+      log_message(LOG_ERROR, "Failed to hash password.");
+      return false;
+    }
+    // "$s1$<log2 N>$<r>$" is the prefix, and p takes the place of the iterations
+    char prefix[48];
+    snprintf(prefix, sizeof(prefix), "%s%u$%u$", PASSWORD_HASH_SCRYPT_PREFIX, log2_n, r);
+    formatted = format_hash(prefix, p, salt, digest, out, out_len);
+  }
+  else {
+    if (PKCS5_PBKDF2_HMAC(plaintext_password, (int) strlen(plaintext_password), salt,
+                          sizeof(salt), (int) iterations, EVP_sha256(), sizeof(digest),
+                          digest) != 1) {
+      log_message(LOG_ERROR, "Failed to hash password.");
+      return false;
+    }
+    const char *prefix = iterations == PASSWORD_HASH_LEGACY_ITERATIONS
+                         ? NULL : PASSWORD_HASH_PBKDF2_PREFIX;
+    formatted = format_hash(prefix, iterations, salt, digest, out, out_len);
+  }
+  if (!formatted) {
+    log_message(LOG_ERROR, "Password hash exceeds hash buffer size");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Parses the header of an scrypt hash, returning a pointer to the
+ * "<salt hex>:<hash hex>" part after it, or NULL if stored does not start
+ * with a well-formed header or its parameters are out of bounds.
+ */
+static const char *parse_scrypt_header(const char *stored, unsigned int *log2_n,
+                                       unsigned int *r, unsigned int *p)
+{
+  const char *rest = parse_header(stored, PASSWORD_HASH_SCRYPT_PREFIX, log2_n);
+  rest = rest ? parse_field(rest, r) : NULL;
+  rest = rest ? parse_field(rest, p) : NULL;
+  if (!rest) {
+    return NULL;
+  }
+  // a corrupt (or planted) hash must not make a login allocate gigabytes
+  size_t bytes = scrypt_memory(*log2_n, *r, *p);
+  return bytes != 0 && bytes <= PASSWORD_HASH_SCRYPT_MAX_BYTES ? rest : NULL;
+}
+
+bool password_hash_is_scrypt(const char *stored)
+{
+  unsigned int log2_n, r, p;
+  return parse_scrypt_header(stored, &log2_n, &r, &p) != NULL;
+}
+
+bool password_hash_verify_scrypt(const char *stored, const char *plaintext_password)
+{
+  unsigned int log2_n, r, p;
+  unsigned char salt[SALT_BYTES];
+  unsigned char expected[DIGEST_BYTES];
+  unsigned char digest[DIGEST_BYTES];
+
+  const char *rest = parse_scrypt_header(stored, &log2_n, &r, &p);
+  if (!rest || !plaintext_password || !parse_salt_and_digest(rest, salt, expected)) {
+    log_message(LOG_DEBUG, "[ password_hash_verify_scrypt() ] malformed hash\n");
+    return false;
+  }
+  if (!scrypt_hash(plaintext_password, salt, log2_n, r, p, digest)) {
+    log_message(LOG_ERROR, "Failed to hash password.");
+    return false;
+  }
+  return CRYPTO_memcmp(expected, digest, sizeof(digest)) == 0;
+}
+
+bool password_hash_is_pbkdf2(const char *stored)
+{
+  return password_hash_pbkdf2_iterations(stored) != 0;
+}
+
+unsigned int password_hash_pbkdf2_iterations(const char *stored)
+{
+  unsigned int iterations = 0;
+  return parse_header(stored, PASSWORD_HASH_PBKDF2_PREFIX, &iterations) ? iterations : 0;
+}
+
+bool password_hash_verify_pbkdf2(const char *stored, const char *plaintext_password)
+{
+  unsigned int iterations;
+  unsigned char salt[SALT_BYTES];
+  unsigned char expected[DIGEST_BYTES];
+  unsigned char digest[DIGEST_BYTES];
+
+  const char *rest = parse_header(stored, PASSWORD_HASH_PBKDF2_PREFIX, &iterations);
+  if (!rest || !plaintext_password || !parse_salt_and_digest(rest, salt, expected)) {
+    log_message(LOG_DEBUG, "[ password_hash_verify_pbkdf2() ] malformed hash\n");
+    return false;
+  }
+  uint64_t span_start = login_span_start();
+  bool ok = PKCS5_PBKDF2_HMAC(plaintext_password, (int) strlen(plaintext_password), salt,
+                              sizeof(salt), (int) iterations, EVP_sha256(), sizeof(digest),
+                              digest) == 1;
+  login_span_end("pbkdf2", span_start);
+  if (!ok) {
+    log_message(LOG_ERROR, "Failed to hash password.");
+    return false;
+  }
+  return CRYPTO_memcmp(expected, digest, sizeof(digest)) == 0;
+}
+
+#ifdef PASSWORD_CALIBRATE_MAIN
+
+#include <unistd.h>
+
+/**
+ * Calibration tool.
+ *
+ * Usage: app TARGET_MS [HASHES_PER_SECOND [THREADS]]
+ *
+ * Prints the PBKDF2 iteration count password_hash_calibrate() picks on this
+ * machine for the given budget (TARGET_MS 0 for a throughput budget only).
+ */
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    dprintf(STDERR_FILENO, "usage: %s TARGET_MS [HASHES_PER_SECOND [THREADS]]\n", argv[0]);
+    return 2;
+  }
+  password_hash_budget_t budget = {
+    .target_ms = (unsigned int) strtoul(argv[1], NULL, 10),
+    .hashes_per_second = argc > 2 ? strtod(argv[2], NULL) : 0.0,
+    .threads = argc > 3 ? (unsigned int) strtoul(argv[3], NULL, 10) : 1
+  };
+  unsigned int iterations = password_hash_calibrate(&budget);
+  if (iterations == 0) {
+    return 1;
+  }
+  uint64_t elapsed = time_hash(iterations);
+  dprintf(STDOUT_FILENO, "%u iterations, %.2f ms per hash\n", iterations, (double) elapsed / 1e6);
+  return 0;
+}
+
+#endif // PASSWORD_CALIBRATE_MAIN
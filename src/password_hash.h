@@ -0,0 +1,135 @@
+#ifndef PASSWORD_HASH_H
+#define PASSWORD_HASH_H
+
+/**
+ * @file password_hash.h
+ * @brief Password hash formats stored in account_t.password_hash.
+ *
+ * Four formats are understood:
+ *
+ * - legacy, as written by account_create() and account_update_password()
+ *   at the default cost:
+ *
+ *     <salt hex>:<hash hex>
+ *
+ *   where hash = PBKDF2-HMAC-SHA256(password, salt, 1000 iterations).
+ *
+ * - PBKDF2 with its cost recorded, as written at any other cost:
+ *
+ *     $p2$<iterations>$<salt hex>:<hash hex>
+ *
+ *   where hash = PBKDF2-HMAC-SHA256(password, salt, iterations).
+ *
+ * - scrypt, as written when password_hash_use_scrypt() has been called:
+ *
+ *     $s1$<log2 N>$<r>$<p>$<salt hex>:<hash hex>
+ *
+ *   where hash = scrypt(password, salt, N, r, p), in working memory
+ *   borrowed from the hash arenas (see hash_arena.h).
+ *
+ * - wrapped ("onion"), produced from a legacy hash without knowing the
+ *   password:
+ *
+ *     $w1$<iterations>$<salt hex>:<outer hex>
+ *
+ *   where outer = PBKDF2-HMAC-SHA256(hash, salt, iterations) and hash is the
+ *   legacy hash above. Checking a password costs the legacy 1000 iterations
+ *   plus the outer ones.
+ *
+ * Salts and hashes are 16 bytes.
+ *
+ * New hashes are made at the cost set by password_hash_set_cost(), which
+ * password_hash_calibrate() can choose at startup by timing PBKDF2 on the
+ * machine against a latency or throughput budget. Since each hash records
+ * its own cost, hashes made on machines calibrated differently (or before
+ * a recalibration) keep verifying. scrypt, once chosen, takes the place of
+ * PBKDF2 for new hashes; existing hashes of every format keep verifying.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PASSWORD_HASH_LEGACY_ITERATIONS 1000
+#define PASSWORD_HASH_WRAPPED_PREFIX "$w1$"
+#define PASSWORD_HASH_PBKDF2_PREFIX "$p2$"
+#define PASSWORD_HASH_MAX_ITERATIONS 100000000u
+#define PASSWORD_HASH_SCRYPT_PREFIX "$s1$"
+#define PASSWORD_HASH_SCRYPT_DEFAULT_LOG2_N 15
+#define PASSWORD_HASH_SCRYPT_DEFAULT_R 8
+#define PASSWORD_HASH_SCRYPT_DEFAULT_P 1
+// the most working memory a hash may need: larger parameters are refused
+// when set and treated as malformed in stored hashes
+#define PASSWORD_HASH_SCRYPT_MAX_BYTES ((size_t) 1 << 30)
+
+typedef struct {
+  unsigned int target_ms;        // longest a hash may take (0 = no limit)
+  double hashes_per_second;      // hashes the machine must sustain (0 = no requirement)
+  unsigned int threads;          // hashing in parallel towards hashes_per_second (0 = 1)
+  unsigned int min_iterations;   // floor (0 = PASSWORD_HASH_LEGACY_ITERATIONS)
+  unsigned int max_iterations;   // ceiling (0 = PASSWORD_HASH_MAX_ITERATIONS)
+} password_hash_budget_t;
+
+typedef struct {
+  unsigned int log2_n;           // CPU and memory cost, as log2 N
+                                 // (0 = PASSWORD_HASH_SCRYPT_DEFAULT_LOG2_N)
+  unsigned int r;                // block size (0 = PASSWORD_HASH_SCRYPT_DEFAULT_R)
+  unsigned int p;                // parallelism (0 = PASSWORD_HASH_SCRYPT_DEFAULT_P)
+} password_hash_scrypt_t;
+
+// PBKDF2 iterations for new hashes (PASSWORD_HASH_LEGACY_ITERATIONS unless set)
+unsigned int password_hash_cost(void);
+
+// make new hashes with the given number of iterations (0 = the default),
+// capped at PASSWORD_HASH_MAX_ITERATIONS
+void password_hash_set_cost(unsigned int iterations);
+
+// time PBKDF2 on this machine and set the cost to the most iterations that
+// fit the budget (both limits, if both are given), within its floor and
+// ceiling. returns the cost chosen, or 0 (after logging, leaving the cost
+// unchanged) if the budget sets no limit.
+unsigned int password_hash_calibrate(const password_hash_budget_t *budget);
+
+// hash plaintext_password with a fresh salt, writing the hash to out: with
+// scrypt if it has been chosen, else with PBKDF2 at the current cost, in
+// the legacy format at the legacy cost and otherwise in the $p2$ format.
+// returns false (after logging) on failure.
+bool password_hash_create(const char *plaintext_password, char *out, size_t out_len);
+
+// whether stored is in the $p2$ format
+bool password_hash_is_pbkdf2(const char *stored);
+
+// the iteration count of a $p2$ hash, or 0 if stored is not one
+unsigned int password_hash_pbkdf2_iterations(const char *stored);
+
+// check plaintext_password against a $p2$ hash. returns false if it does
+// not match or stored is not a well-formed $p2$ hash.
+bool password_hash_verify_pbkdf2(const char *stored, const char *plaintext_password);
+
+// make new hashes with scrypt at params, or with PBKDF2 again if params is
+// NULL. returns false (after logging, leaving the choice unchanged) if the
+// parameters are invalid or need more than PASSWORD_HASH_SCRYPT_MAX_BYTES.
+bool password_hash_use_scrypt(const password_hash_scrypt_t *params);
+
+// whether stored is in the scrypt format
+bool password_hash_is_scrypt(const char *stored);
+
+// check plaintext_password against an scrypt hash. returns false if it does
+// not match or stored is not a well-formed scrypt hash.
+bool password_hash_verify_scrypt(const char *stored, const char *plaintext_password);
+
+// whether stored is in the wrapped format
+bool password_hash_is_wrapped(const char *stored);
+
+// the outer iteration count of a wrapped hash, or 0 if stored is not one
+unsigned int password_hash_wrapped_iterations(const char *stored);
+
+// wrap the legacy hash legacy in an outer layer of iterations PBKDF2
+// iterations, writing the wrapped hash to out. returns false if legacy is
+// not a well-formed legacy hash or out is too small.
+bool password_hash_wrap(const char *legacy, unsigned int iterations, char *out, size_t out_len);
+
+// check plaintext_password against a wrapped hash. returns false if it does
+// not match or stored is not a well-formed wrapped hash.
+bool password_hash_verify_wrapped(const char *stored, const char *plaintext_password);
+
+#endif // PASSWORD_HASH_H
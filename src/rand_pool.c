@@ -0,0 +1,210 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "rand_pool.h"
+#include "logging.h"
+
+#include <limits.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * One thread's random bytes. Only the owning thread touches buffer and
+ * the offsets, except a fork child's handler, which runs alone.
+ */
+typedef struct rand_block {
+  unsigned char *buffer;
+  size_t size;                   // bytes allocated for buffer
+  size_t next;                   // first unused byte
+  size_t end;                    // end of the bytes fetched
+  atomic_bool in_use;            // owned by a live thread
+  struct rand_block *next_block; // immutable once published
+} rand_block_t;
+
+// 0 = pass requests straight to OpenSSL
+static _Atomic size_t refill_bytes = RAND_POOL_DEFAULT_REFILL;
+static _Atomic(rand_block_t *) block_list = NULL;
+static _Thread_local rand_block_t *local_block = NULL;
+static pthread_key_t block_key;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static _Atomic uint64_t refills = 0;
+static _Atomic uint64_t direct = 0;
+static _Atomic uint64_t fork_wipes = 0;
+
+static void wipe_block(rand_block_t *block)
+{
+  if (block->buffer) {
+    OPENSSL_cleanse(block->buffer + block->next, block->end - block->next);
+  }
+  block->next = 0;
+  block->end = 0;
+}
+
+/**
+ * Thread exit: wipe what is left of the block and hand it back for reuse
+ * by a later thread.
+ */
+static void release_block(void *arg)
+{
+  rand_block_t *block = arg;
+  wipe_block(block);
+  atomic_store_explicit(&block->in_use, false, memory_order_release);
+}
+
+/**
+ * Runs in a fork child, before fork() returns there. Only the forking
+ * thread survives, so every other thread's block is free again; all of
+ * them, its own included, are wiped, as the parent will hand out the same
+ * bytes.
+ */
+static void wipe_after_fork(void)
+{
+  rand_block_t *block = atomic_load_explicit(&block_list, memory_order_acquire);
+  for (; block; block = block->next_block) {
+    if (block->end > block->next) {
+      atomic_fetch_add_explicit(&fork_wipes, 1, memory_order_relaxed);
+    }
+    wipe_block(block);
+    if (block != local_block) {
+      atomic_store_explicit(&block->in_use, false, memory_order_relaxed);
+    }
+  }
+}
+
+static void init_pools(void)
+{
+  pthread_key_create(&block_key, release_block);
+  pthread_atfork(NULL, NULL, wipe_after_fork);
+}
+
+/**
+ * Returns this thread's block, claiming a released block or allocating
+ * and publishing a new one on first use. Returns NULL if memory is
+ * exhausted.
+ */
+static rand_block_t *thread_block(void)
+{
+  if (local_block) {
+    return local_block;
+  }
+  pthread_once(&init_once, init_pools);
+
+  rand_block_t *block = atomic_load_explicit(&block_list, memory_order_acquire);
+  for (; block; block = block->next_block) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&block->in_use, &expected, true)) {
+      break;
+    }
+  }
+  if (!block) {
+    block = calloc(1, sizeof(*block));
+    if (!block) {
+      return NULL;
+    }
+    atomic_store_explicit(&block->in_use, true, memory_order_relaxed);
+    block->next_block = atomic_load_explicit(&block_list, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&block_list, &block->next_block, block,
+                                                  memory_order_release,
+                                                  memory_order_relaxed)) {
+      continue;
+    }
+  }
+  pthread_setspecific(block_key, block);
+  local_block = block;
+  return block;
+}
+
+/**
+ * Refills an empty block with size fresh bytes, reallocating its buffer if
+ * the refill size has changed.
+ */
+static bool refill(rand_block_t *block, size_t size)
+{
+  if (block->size != size) {
+    unsigned char *buffer = malloc(size);
+    if (!buffer) {
+      return false;
+    }
+    free(block->buffer);
+    block->buffer = buffer;
+    block->size = size;
+  }
+  if (RAND_priv_bytes(block->buffer, (int) size) != 1) {
+    OPENSSL_cleanse(block->buffer, size);
+    return false;
+  }
+  block->next = 0;
+  block->end = size;
+  atomic_fetch_add_explicit(&refills, 1, memory_order_relaxed);
+  return true;
+}
+
+static bool fetch_direct(void *out, size_t n)
+{
+  atomic_fetch_add_explicit(&direct, 1, memory_order_relaxed);
+  if (n > INT_MAX || RAND_priv_bytes(out, (int) n) != 1) {
+    log_message(LOG_ERROR, "Failed to generate %zu random bytes", n);
+    return false;
+  }
+  return true;
+}
+
+bool rand_pool_bytes(void *out, size_t n)
+{
+  if (!out) {
+    return false;
+  }
+  size_t size = atomic_load_explicit(&refill_bytes, memory_order_relaxed);
+  // requests of more than a few percent of a block would waste much of it
+  rand_block_t *block = size && n <= size / 16 ? thread_block() : NULL;
+  if (!block) {
+    return fetch_direct(out, n);
+  }
+  if (block->end - block->next < n) {
+    // what is left is too little to be worth keeping
+    wipe_block(block);
+    if (!refill(block, size)) {
+      return fetch_direct(out, n);
+    }
+  }
+  unsigned char *bytes = block->buffer + block->next;
+  memcpy(out, bytes, n);
+  OPENSSL_cleanse(bytes, n);
+  block->next += n;
+  return true;
+}
+
+bool rand_pool_configure(const rand_pool_options_t *opts)
+{
+  size_t size = 0;
+  if (opts) {
+    size = opts->refill_bytes ? opts->refill_bytes : RAND_POOL_DEFAULT_REFILL;
+    if (size > RAND_POOL_MAX_REFILL) {
+      log_message(LOG_ERROR, "Random pool refill of %zu bytes is over the limit of %d", size,
+                  RAND_POOL_MAX_REFILL);
+      return false;
+    }
+  }
+  // pools take the new size at their next refill
+  atomic_store(&refill_bytes, size);
+  return true;
+}
+
+void rand_pool_get_stats(rand_pool_stats_t *stats)
+{
+  if (!stats) {
+    return;
+  }
+  stats->refills = atomic_load(&refills);
+  stats->direct = atomic_load(&direct);
+  stats->fork_wipes = atomic_load(&fork_wipes);
+  stats->pools = 0;
+  rand_block_t *block = atomic_load_explicit(&block_list, memory_order_acquire);
+  for (; block; block = block->next_block) {
+    stats->pools++;
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef RAND_POOL_H
+#define RAND_POOL_H
+
+/**
+ * @file rand_pool.h
+ * @brief Per-thread pools of random bytes, for salts and tokens.
+ *
+ * Every RAND_bytes() call goes through OpenSSL's shared DRBG, taking its
+ * lock; during a signup or password-reset wave the salts alone make
+ * thousands of such calls a second. Each thread instead keeps a buffer of
+ * random bytes, refilled a block at a time from RAND_priv_bytes() (the
+ * DRBG for private data, which reseeds itself and after a fork), and
+ * hands out small requests from it with no lock or library call.
+ *
+ * Bytes are wiped from the buffer as soon as they are handed out, and a
+ * thread's whole buffer when it exits. A fork child wipes every buffer it
+ * inherits before anything can use them, so a child never hands out bytes
+ * its parent will also hand out.
+ *
+ * Pooling is on from the start, refilling RAND_POOL_DEFAULT_REFILL bytes
+ * at a time.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RAND_POOL_DEFAULT_REFILL 4096
+#define RAND_POOL_MAX_REFILL (1024 * 1024)
+
+typedef struct {
+  size_t refill_bytes;         // bytes fetched per refill, at most
+                               // RAND_POOL_MAX_REFILL (0 = the default)
+} rand_pool_options_t;
+
+typedef struct {
+  uint64_t refills;            // blocks fetched into pools
+  uint64_t direct;             // requests passed straight to OpenSSL
+  uint64_t fork_wipes;         // pools wiped in fork children
+  size_t pools;                // allocated: the most threads that have
+                               // held one at once
+} rand_pool_stats_t;
+
+// pool with opts from now on, or pass every request straight to
+// RAND_priv_bytes() if opts is NULL. returns false (after logging) if
+// refill_bytes is too large, leaving the setting unchanged.
+bool rand_pool_configure(const rand_pool_options_t *opts);
+
+// fill out with n cryptographically secure random bytes, from this
+// thread's pool if n is small next to a refill. returns false (after
+// logging) if OpenSSL cannot supply them.
+bool rand_pool_bytes(void *out, size_t n);
+
+void rand_pool_get_stats(rand_pool_stats_t *stats);
+
+#endif // RAND_POOL_H
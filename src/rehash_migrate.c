@@ -0,0 +1,368 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "rehash_migrate.h"
+#include "account_store.h"
+#include "logging.h"
+#include "password_hash.h"
+#include "thread_pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHECKPOINT_VERSION 1
+#define MIN_SLEEP_NS 1000000    // don't bother sleeping for less than 1ms
+
+typedef struct {
+  char userid[USER_ID_LENGTH];
+  char hash[HASH_LENGTH];
+} pending_t;
+
+typedef struct {
+  atomic_uint_fast64_t scanned;
+  atomic_uint_fast64_t migrated;
+  atomic_uint_fast64_t skipped;
+  atomic_uint_fast64_t failed;
+} counters_t;
+
+typedef struct {
+  pending_t *items;
+  size_t count;
+  size_t capacity;
+  bool out_of_memory;
+  counters_t *counters;
+} shard_scan_t;
+
+typedef struct {
+  const pending_t *items;
+  size_t count;
+  unsigned int iterations;
+  unsigned int duty_cycle;
+  counters_t *counters;
+} chunk_task_t;
+
+typedef struct {
+  const char *expected;
+  const char *replacement;
+} hash_swap_t;
+
+static atomic_bool stop_requested = false;
+
+static pthread_mutex_t background_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool background_started = false;
+static pthread_t background_thread;
+static rehash_options_t background_opts;
+static rehash_report_t background_report;
+static bool background_ok;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+  struct timespec ts = { (time_t) (ns / 1000000000u), (long) (ns % 1000000000u) };
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    continue;
+  }
+}
+
+static bool collect_legacy(const account_t *acc, void *arg)
+{
+  shard_scan_t *scan = arg;
+  atomic_fetch_add(&scan->counters->scanned, 1);
+  // wrapped already, made at a calibrated cost, or memory-hard
+  if (password_hash_is_wrapped(acc->password_hash)
+      || password_hash_is_pbkdf2(acc->password_hash)
+      || password_hash_is_scrypt(acc->password_hash)) {
+    atomic_fetch_add(&scan->counters->skipped, 1);
+    return true;
+  }
+  if (scan->count == scan->capacity) {
+    size_t capacity = scan->capacity ? scan->capacity * 2 : 64;
+    pending_t *items = realloc(scan->items, capacity * sizeof(*items));
+    if (!items) {
+      scan->out_of_memory = true;
+      return false;
+    }
+    scan->items = items;
+    scan->capacity = capacity;
+  }
+  pending_t *item = &scan->items[scan->count++];
+  memcpy(item->userid, acc->userid, USER_ID_LENGTH);
+  memcpy(item->hash, acc->password_hash, HASH_LENGTH);
+  return true;
+}
+
+static bool swap_if_unchanged(account_t *acc, void *arg)
+{
+  const hash_swap_t *swap = arg;
+  if (strncmp(acc->password_hash, swap->expected, HASH_LENGTH) != 0) {
+    return false;
+  }
+  strncpy(acc->password_hash, swap->replacement, HASH_LENGTH - 1);
+  acc->password_hash[HASH_LENGTH - 1] = '\0';
+  return true;
+}
+
+static void migrate_chunk(void *arg)
+{
+  chunk_task_t *task = arg;
+  uint64_t owed_ns = 0;
+  for (size_t i = 0; i < task->count && !atomic_load(&stop_requested); i++) {
+    const pending_t *item = &task->items[i];
+    uint64_t start = now_ns();
+    char wrapped[HASH_LENGTH];
+    if (!password_hash_wrap(item->hash, task->iterations, wrapped, sizeof(wrapped))) {
+      log_message(LOG_WARN, "Rehash: cannot wrap the password hash of user %s", item->userid);
+      atomic_fetch_add(&task->counters->failed, 1);
+    }
+    else {
+      hash_swap_t swap = { item->hash, wrapped };
+      if (account_store_modify(item->userid, swap_if_unchanged, &swap)) {
+        atomic_fetch_add(&task->counters->migrated, 1);
+      }
+      else {
+        atomic_fetch_add(&task->counters->skipped, 1);
+      }
+    }
+
+    // throttle: idle (100 - duty_cycle) / duty_cycle times as long as we hashed
+    owed_ns += (now_ns() - start) * (100 - task->duty_cycle) / task->duty_cycle;
+    if (owed_ns >= MIN_SLEEP_NS) {
+      sleep_ns(owed_ns);
+      owed_ns = 0;
+    }
+  }
+}
+
+/**
+ * Reads the next shard to migrate from the checkpoint at path into
+ * *next_shard. A missing checkpoint, or one for a different iteration count,
+ * means starting from the first shard. Returns false if the checkpoint
+ * cannot be read.
+ */
+static bool load_checkpoint(const char *path, unsigned int iterations, unsigned int *next_shard)
+{
+  *next_shard = 0;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT) {
+      return true;
+    }
+    log_message(LOG_ERROR, "Failed to open rehash checkpoint %s: %s", path, strerror(errno));
+    return false;
+  }
+  char text[128];
+  ssize_t len = read(fd, text, sizeof(text) - 1);
+  close(fd);
+  text[len > 0 ? len : 0] = '\0';
+  unsigned int version, saved_iterations, saved_shard;
+  int fields = sscanf(text, "rehash-checkpoint %u iterations=%u next_shard=%u",
+                      &version, &saved_iterations, &saved_shard);
+  if (fields != 3 || version != CHECKPOINT_VERSION || saved_shard > ACCOUNT_STORE_SHARDS) {
+    log_message(LOG_ERROR, "Rehash checkpoint %s is malformed", path);
+    return false;
+  }
+  if (saved_iterations != iterations) {
+    log_message(LOG_WARN, "Rehash checkpoint %s is for %u iterations, not %u; starting over",
+                path, saved_iterations, iterations);
+    return true;
+  }
+  *next_shard = saved_shard;
+  return true;
+}
+
+/**
+ * Replaces the checkpoint at path by writing a temporary file next to it
+ * and renaming it into place, so a crash leaves either the old or the new one.
+ */
+static bool save_checkpoint(const char *path, unsigned int iterations, unsigned int next_shard)
+{
+  char tmp_path[4096];
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) {
+    log_message(LOG_ERROR, "Rehash checkpoint path is too long");
+    return false;
+  }
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    log_message(LOG_ERROR, "Failed to create %s: %s", tmp_path, strerror(errno));
+    return false;
+  }
+  bool ok = dprintf(fd, "rehash-checkpoint %d iterations=%u next_shard=%u\n",
+                    CHECKPOINT_VERSION, iterations, next_shard) > 0
+            && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(tmp_path, path) == -1) {
+    log_message(LOG_ERROR, "Failed to write rehash checkpoint %s: %s", path, strerror(errno));
+    unlink(tmp_path);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Wraps the legacy hashes found in one shard. Returns false if the shard
+ * could not be finished for lack of memory.
+ */
+static bool migrate_shard(thread_pool_t *pool, size_t shard, const rehash_options_t *opts,
+                          counters_t *counters)
+{
+  shard_scan_t scan = { NULL, 0, 0, false, counters };
+  account_store_foreach_in_shard(shard, collect_legacy, &scan);
+  if (scan.out_of_memory) {
+    log_message(LOG_ERROR, "Memory allocation for rehash of shard %zu has failed", shard);
+    free(scan.items);
+    return false;
+  }
+
+  size_t ntasks = (scan.count + opts->chunk_size - 1) / opts->chunk_size;
+  chunk_task_t *tasks = ntasks ? calloc(ntasks, sizeof(*tasks)) : NULL;
+  if (ntasks && !tasks) {
+    log_message(LOG_ERROR, "Memory allocation for rehash of shard %zu has failed", shard);
+    free(scan.items);
+    return false;
+  }
+  bool ok = true;
+  thread_pool_group_t group;
+  thread_pool_group_init(&group);
+  for (size_t i = 0; i < ntasks; i++) {
+    size_t first = i * opts->chunk_size;
+    tasks[i].items = scan.items + first;
+    tasks[i].count = scan.count - first < opts->chunk_size ? scan.count - first : opts->chunk_size;
+    tasks[i].iterations = opts->iterations;
+    tasks[i].duty_cycle = opts->duty_cycle;
+    tasks[i].counters = counters;
+    ok = thread_pool_submit(pool, &group, migrate_chunk, &tasks[i]) && ok;
+  }
+  thread_pool_group_wait(&group);
+  thread_pool_group_destroy(&group);
+  free(tasks);
+  free(scan.items);
+  return ok;
+}
+
+bool rehash_migrate_run(const rehash_options_t *opts, rehash_report_t *report)
+{
+  rehash_options_t o = opts ? *opts : (rehash_options_t) { 0 };
+  if (o.iterations == 0) {
+    o.iterations = REHASH_DEFAULT_ITERATIONS;
+  }
+  if (o.threads == 0) {
+    o.threads = 1;
+  }
+  if (o.duty_cycle == 0) {
+    o.duty_cycle = REHASH_DEFAULT_DUTY_CYCLE;
+  }
+  if (o.duty_cycle > 100) {
+    o.duty_cycle = 100;
+  }
+  if (o.chunk_size == 0) {
+    o.chunk_size = REHASH_DEFAULT_CHUNK;
+  }
+  if (!report) {
+    return false;
+  }
+  memset(report, 0, sizeof(*report));
+
+  unsigned int shard = 0;
+  if (o.checkpoint_path && !load_checkpoint(o.checkpoint_path, o.iterations, &shard)) {
+    return false;
+  }
+  report->next_shard = shard;
+  thread_pool_t *pool = thread_pool_create(o.threads);
+  if (!pool) {
+    return false;
+  }
+
+  counters_t counters;
+  atomic_init(&counters.scanned, 0);
+  atomic_init(&counters.migrated, 0);
+  atomic_init(&counters.skipped, 0);
+  atomic_init(&counters.failed, 0);
+  bool ok = true;
+  for (; shard < ACCOUNT_STORE_SHARDS && ok && !atomic_load(&stop_requested); shard++) {
+    ok = migrate_shard(pool, shard, &o, &counters);
+    if (!ok || atomic_load(&stop_requested)) {
+      break;
+    }
+    report->next_shard = shard + 1;
+    if (o.checkpoint_path) {
+      ok = save_checkpoint(o.checkpoint_path, o.iterations, shard + 1);
+    }
+  }
+  thread_pool_destroy(pool);
+
+  report->scanned = atomic_load(&counters.scanned);
+  report->migrated = atomic_load(&counters.migrated);
+  report->skipped = atomic_load(&counters.skipped);
+  report->failed = atomic_load(&counters.failed);
+  report->complete = report->next_shard == ACCOUNT_STORE_SHARDS;
+  log_message(LOG_INFO, "Rehash to %u iterations: %llu scanned, %llu migrated, %llu skipped, "
+              "%llu failed, %s", o.iterations,
+              (unsigned long long) report->scanned, (unsigned long long) report->migrated,
+              (unsigned long long) report->skipped, (unsigned long long) report->failed,
+              report->complete ? "complete" : "stopped");
+  return ok;
+}
+
+static void *background_main(void *arg)
+{
+  (void) arg;
+  background_ok = rehash_migrate_run(&background_opts, &background_report);
+  return NULL;
+}
+
+bool rehash_migrate_start(const rehash_options_t *opts)
+{
+  pthread_mutex_lock(&background_mutex);
+  if (background_started) {
+    pthread_mutex_unlock(&background_mutex);
+    log_message(LOG_WARN, "Rehash migration is already running");
+    return false;
+  }
+  background_opts = opts ? *opts : (rehash_options_t) { 0 };
+  atomic_store(&stop_requested, false);
+  if (pthread_create(&background_thread, NULL, background_main, NULL) != 0) {
+    pthread_mutex_unlock(&background_mutex);
+    log_message(LOG_ERROR, "Failed to start rehash migration thread");
+    return false;
+  }
+  background_started = true;
+  pthread_mutex_unlock(&background_mutex);
+  return true;
+}
+
+bool rehash_migrate_join(rehash_report_t *report)
+{
+  pthread_mutex_lock(&background_mutex);
+  if (!background_started) {
+    atomic_store(&stop_requested, false);
+    pthread_mutex_unlock(&background_mutex);
+    return false;
+  }
+  pthread_join(background_thread, NULL);
+  background_started = false;
+  atomic_store(&stop_requested, false);
+  if (report) {
+    *report = background_report;
+  }
+  bool ok = background_ok;
+  pthread_mutex_unlock(&background_mutex);
+  return ok;
+}
+
+bool rehash_migrate_stop(rehash_report_t *report)
+{
+  atomic_store(&stop_requested, true);
+  return rehash_migrate_join(report);
+}
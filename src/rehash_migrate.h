@@ -0,0 +1,73 @@
+#ifndef REHASH_MIGRATE_H
+#define REHASH_MIGRATE_H
+
+/**
+ * @file rehash_migrate.h
+ * @brief Background migration of stored password hashes to a higher cost.
+ *
+ * Raising the PBKDF2 iteration count only helps accounts whose owners log
+ * in again, since a new hash needs the plaintext. This migration instead
+ * wraps every legacy hash in the account store in an outer PBKDF2 layer
+ * (see password_hash.h), which needs only the old hash, and
+ * account_validate_password() accepts both forms.
+ *
+ * The store is walked one shard at a time. Hashes to migrate are copied out
+ * under the shard's read lock, wrapped on a thread pool with no lock held,
+ * and written back one account at a time under a brief write lock, only if
+ * the stored hash has not changed meanwhile (e.g. a password update). Each
+ * worker sleeps in proportion to the time it spends hashing so that it uses
+ * at most duty_cycle percent of a CPU, leaving room for logins.
+ *
+ * After each shard a checkpoint is written (atomically, by rename), so an
+ * interrupted migration resumes where it left off. Hashes that are already
+ * wrapped are left alone, which makes re-running a shard harmless, as are
+ * $p2$ hashes, which record a cost chosen by password_hash_calibrate(),
+ * and scrypt hashes.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define REHASH_DEFAULT_ITERATIONS 10000
+#define REHASH_DEFAULT_DUTY_CYCLE 25
+#define REHASH_DEFAULT_CHUNK 64
+
+typedef struct {
+  unsigned int iterations;       // outer PBKDF2 iterations (0 = REHASH_DEFAULT_ITERATIONS)
+  unsigned int threads;          // hashing threads (0 = 1)
+  unsigned int duty_cycle;       // max percent of each thread's time spent hashing, 1-100
+                                 // (0 = REHASH_DEFAULT_DUTY_CYCLE)
+  size_t chunk_size;             // accounts per pool task (0 = REHASH_DEFAULT_CHUNK)
+  const char *checkpoint_path;   // resume from and record progress here (NULL = don't)
+} rehash_options_t;
+
+typedef struct {
+  uint64_t scanned;              // accounts examined
+  uint64_t migrated;             // hashes wrapped and written back
+  uint64_t skipped;              // already wrapped, $p2$ or scrypt, or changed meanwhile
+  uint64_t failed;               // hashes that could not be parsed or wrapped
+  unsigned int next_shard;       // first shard not yet finished
+  bool complete;                 // every shard has been finished
+} rehash_report_t;
+
+// run the migration on the calling thread until it completes or
+// rehash_migrate_stop() is called. returns false on error (e.g. the
+// checkpoint cannot be written); report is filled in either way.
+bool rehash_migrate_run(const rehash_options_t *opts, rehash_report_t *report);
+
+// start rehash_migrate_run() on a background thread. opts is copied, but
+// opts->checkpoint_path must stay valid until the migration is joined.
+// returns false if a background migration is already running.
+bool rehash_migrate_start(const rehash_options_t *opts);
+
+// wait for the background migration to finish and fill in report (may be
+// NULL). returns false if none was started or it failed.
+bool rehash_migrate_join(rehash_report_t *report);
+
+// ask the running migration to stop after the accounts in progress, then
+// join it as rehash_migrate_join() does. the checkpoint covers only
+// finished shards.
+bool rehash_migrate_stop(rehash_report_t *report);
+
+#endif // REHASH_MIGRATE_H
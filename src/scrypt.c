@@ -0,0 +1,155 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "scrypt.h"
+
+#include <limits.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BLOCK_WORDS 16           // a Salsa20 block: 64 bytes
+#define ROTL(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+
+static uint32_t load_le32(const unsigned char *p)
+{
+  return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void store_le32(unsigned char *p, uint32_t v)
+{
+  p[0] = (unsigned char) v;
+  p[1] = (unsigned char) (v >> 8);
+  p[2] = (unsigned char) (v >> 16);
+  p[3] = (unsigned char) (v >> 24);
+}
+
+/**
+ * Salsa20/8 core, in place.
+ */
+static void salsa20_8(uint32_t b[BLOCK_WORDS])
+{
+  uint32_t x[BLOCK_WORDS];
+  memcpy(x, b, sizeof(x));
+  for (int i = 0; i < 8; i += 2) {
+    // columns
+    x[4] ^= ROTL(x[0] + x[12], 7);   x[8] ^= ROTL(x[4] + x[0], 9);
+    x[12] ^= ROTL(x[8] + x[4], 13);  x[0] ^= ROTL(x[12] + x[8], 18);
+    x[9] ^= ROTL(x[5] + x[1], 7);    x[13] ^= ROTL(x[9] + x[5], 9);
+    x[1] ^= ROTL(x[13] + x[9], 13);  x[5] ^= ROTL(x[1] + x[13], 18);
+    x[14] ^= ROTL(x[10] + x[6], 7);  x[2] ^= ROTL(x[14] + x[10], 9);
+    x[6] ^= ROTL(x[2] + x[14], 13);  x[10] ^= ROTL(x[6] + x[2], 18);
+    x[3] ^= ROTL(x[15] + x[11], 7);  x[7] ^= ROTL(x[3] + x[15], 9);
+    x[11] ^= ROTL(x[7] + x[3], 13);  x[15] ^= ROTL(x[11] + x[7], 18);
+    // rows
+    x[1] ^= ROTL(x[0] + x[3], 7);    x[2] ^= ROTL(x[1] + x[0], 9);
+    x[3] ^= ROTL(x[2] + x[1], 13);   x[0] ^= ROTL(x[3] + x[2], 18);
+    x[6] ^= ROTL(x[5] + x[4], 7);    x[7] ^= ROTL(x[6] + x[5], 9);
+    x[4] ^= ROTL(x[7] + x[6], 13);   x[5] ^= ROTL(x[4] + x[7], 18);
+    x[11] ^= ROTL(x[10] + x[9], 7);  x[8] ^= ROTL(x[11] + x[10], 9);
+    x[9] ^= ROTL(x[8] + x[11], 13);  x[10] ^= ROTL(x[9] + x[8], 18);
+    x[12] ^= ROTL(x[15] + x[14], 7); x[13] ^= ROTL(x[12] + x[15], 9);
+    x[14] ^= ROTL(x[13] + x[12], 13); x[15] ^= ROTL(x[14] + x[13], 18);
+  }
+  for (int i = 0; i < BLOCK_WORDS; i++) {
+    b[i] += x[i];
+  }
+}
+
+/**
+ * scryptBlockMix of the 2r blocks at b into y: the even-numbered outputs
+ * go to y's first half and the odd-numbered ones to its second.
+ */
+static void block_mix(const uint32_t *b, uint32_t *y, size_t r)
+{
+  uint32_t x[BLOCK_WORDS];
+  memcpy(x, &b[(2 * r - 1) * BLOCK_WORDS], sizeof(x));
+  for (size_t i = 0; i < 2 * r; i++) {
+    for (int j = 0; j < BLOCK_WORDS; j++) {
+      x[j] ^= b[i * BLOCK_WORDS + j];
+    }
+    salsa20_8(x);
+    memcpy(&y[(i / 2 + (i & 1) * r) * BLOCK_WORDS], x, sizeof(x));
+  }
+}
+
+/**
+ * scryptROMix of the 128 * r bytes at b, in place, with v (n blocks of
+ * 32 * r words) and xy (64 * r words) as scratch.
+ */
+static void ro_mix(unsigned char *b, size_t r, uint64_t n, uint32_t *v, uint32_t *xy)
+{
+  size_t words = 32 * r;
+  uint32_t *x = xy;
+  uint32_t *y = xy + words;
+
+  for (size_t k = 0; k < words; k++) {
+    x[k] = load_le32(&b[4 * k]);
+  }
+  for (uint64_t i = 0; i < n; i++) {
+    memcpy(&v[i * words], x, words * sizeof(uint32_t));
+    block_mix(x, y, r);
+    uint32_t *t = x; x = y; y = t;
+  }
+  for (uint64_t i = 0; i < n; i++) {
+    // Integerify: the first word of the last block; n is a power of 2
+    uint64_t j = x[(2 * r - 1) * BLOCK_WORDS] & (n - 1);
+    const uint32_t *vj = &v[j * words];
+    for (size_t k = 0; k < words; k++) {
+      x[k] ^= vj[k];
+    }
+    block_mix(x, y, r);
+    uint32_t *t = x; x = y; y = t;
+  }
+  for (size_t k = 0; k < words; k++) {
+    store_le32(&b[4 * k], x[k]);
+  }
+}
+
+size_t scrypt_memory(unsigned int log2_n, unsigned int r, unsigned int p)
+{
+  if (log2_n == 0 || log2_n >= 8 * sizeof(size_t) - 1 || r == 0 || p == 0) {
+    return 0;
+  }
+  size_t n = (size_t) 1 << log2_n;
+  size_t block = (size_t) 128 * r;
+  if (block / 128 != r || (uint64_t) p * block > INT_MAX) {
+    return 0;
+  }
+  // B (p blocks), V (n blocks) and the two halves of XY (2 blocks)
+  size_t blocks = n + p + 2;
+  if (blocks < n || blocks > SIZE_MAX / block) {
+    return 0;
+  }
+  return blocks * block;
+}
+
+bool scrypt_derive(const char *password, size_t password_len, const unsigned char *salt,
+                   size_t salt_len, unsigned int log2_n, unsigned int r, unsigned int p,
+                   void *work, size_t work_len, unsigned char *out, size_t out_len)
+{
+  size_t needed = scrypt_memory(log2_n, r, p);
+  if (needed == 0 || !work || work_len < needed || password_len > INT_MAX
+      || salt_len > INT_MAX || out_len > INT_MAX) {
+    return false;
+  }
+  size_t block = (size_t) 128 * r;
+  uint64_t n = UINT64_C(1) << log2_n;
+  unsigned char *b = work;
+  uint32_t *v = (uint32_t *) (b + p * block);
+  uint32_t *xy = v + n * (block / 4);
+
+  if (PKCS5_PBKDF2_HMAC(password, (int) password_len, salt, (int) salt_len, 1, EVP_sha256(),
+                        (int) (p * block), b) != 1) {
+    return false;
+  }
+  for (unsigned int i = 0; i < p; i++) {
+    ro_mix(b + i * block, r, n, v, xy);
+  }
+  bool ok = PKCS5_PBKDF2_HMAC(password, (int) password_len, b, (int) (p * block), 1, EVP_sha256(),
+                              (int) out_len, out) == 1;
+  // V is left as is: wiping megabytes per hash would cost as much as filling them
+  OPENSSL_cleanse(b, p * block);
+  OPENSSL_cleanse(xy, 2 * block);
+  return ok;
+}
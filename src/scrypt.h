@@ -0,0 +1,32 @@
+#ifndef SCRYPT_H
+#define SCRYPT_H
+
+/**
+ * @file scrypt.h
+ * @brief scrypt (RFC 7914) over caller-supplied working memory.
+ *
+ * OpenSSL's EVP_PBE_scrypt() allocates (and frees) its N * r * 128 bytes
+ * of working memory on every call, megabytes per login. scrypt_derive()
+ * instead works in memory the caller provides, so that password hashing
+ * can reuse preallocated arenas (see hash_arena.h). PBKDF2-HMAC-SHA256
+ * still comes from OpenSSL; only the memory-hard ROMix step is here.
+ *
+ * N is given as its base-2 logarithm, log2_n.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// bytes of working memory scrypt_derive() needs for the given parameters,
+// or 0 if they are invalid or the amount would overflow
+size_t scrypt_memory(unsigned int log2_n, unsigned int r, unsigned int p);
+
+// derive out_len bytes from password and salt into out, using work (of at
+// least scrypt_memory(log2_n, r, p) bytes, aligned for uint32_t) as
+// working memory. returns false if the parameters are invalid, work is too
+// small, or PBKDF2 fails.
+bool scrypt_derive(const char *password, size_t password_len, const unsigned char *salt,
+                   size_t salt_len, unsigned int log2_n, unsigned int r, unsigned int p,
+                   void *work, size_t work_len, unsigned char *out, size_t out_len);
+
+#endif // SCRYPT_H
@@ -0,0 +1,635 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "shm_store.h"
+#include "logging.h"
+#include "userid_filter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_STORE_MAGIC 0x53484d53u   // "SHMS"
+#define SHM_STORE_VERSION 1u
+
+// index slot values other than record number + 1
+#define SLOT_EMPTY 0u
+#define SLOT_REMOVED UINT32_MAX
+
+// no record being modified
+#define NO_RECORD UINT64_MAX
+
+// a reader that sees a record mid-change this many times in a row checks
+// whether its writer died (see read_record())
+#define STALL_SPINS 1000
+
+// how long shm_store_open() waits for another process to finish creating
+// the segment
+#define ATTACH_WAIT_MS 2000
+
+/**
+ * One account. The account's login state is held in the atomic fields, and
+ * the copy in acc is only kept up to date under the mutex (for
+ * shm_store_modify() and recovery); everything else in acc is written only
+ * under the mutex, with seq odd, and the userid never changes.
+ */
+typedef struct {
+  _Atomic uint32_t seq;            // odd while acc is being written
+  uint32_t pad;
+  uint64_t hash;                   // userid_key_hash() of acc.userid
+  account_t acc;
+  _Atomic int64_t unban_time;
+  _Atomic int64_t last_login_time;
+  _Atomic uint32_t login_count;
+  _Atomic uint32_t login_fail_count;
+  _Atomic uint32_t last_ip;
+} shm_record_t;
+
+/**
+ * The start of the segment, followed by the index (buckets slots, each
+ * SLOT_EMPTY, SLOT_REMOVED or a record number + 1) and then the records.
+ * The geometry is fixed when the segment is created.
+ */
+typedef struct {
+  _Atomic uint32_t magic;          // stored last by the creator
+  uint32_t version;
+  uint64_t capacity;
+  uint64_t buckets;                // a power of two, at least 2 * capacity
+  uint64_t record_size;            // sizeof(shm_record_t) in the creator
+  pthread_mutex_t mutex;           // robust and process-shared: serialises writers
+  _Atomic uint64_t used;           // records handed out (removed ones are not reused)
+  _Atomic uint64_t live;
+  _Atomic uint64_t recoveries;
+  // the change in progress, if any, so that it can be undone if its
+  // writer dies: the record (or NO_RECORD) and its contents beforehand
+  uint64_t undo_record;
+  account_t undo;
+} shm_header_t;
+
+struct shm_store {
+  shm_header_t *header;
+  _Atomic uint32_t *index;
+  shm_record_t *records;
+  size_t mapped;
+  _Atomic uint64_t lookups;
+  _Atomic uint64_t retries;
+};
+
+static size_t index_offset(void)
+{
+  return (sizeof(shm_header_t) + 63) & ~(size_t) 63;
+}
+
+static size_t records_offset(uint64_t buckets)
+{
+  return (index_offset() + buckets * sizeof(uint32_t) + 63) & ~(size_t) 63;
+}
+
+static size_t segment_size(uint64_t capacity, uint64_t buckets)
+{
+  return records_offset(buckets) + capacity * sizeof(shm_record_t);
+}
+
+static void sleep_ms(long ms)
+{
+  struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    continue;
+  }
+}
+
+/**
+ * Copies the login state from r's atomic fields into r->acc, or back.
+ */
+static void load_login_state(shm_record_t *r, account_t *acc)
+{
+  acc->unban_time = (time_t) atomic_load_explicit(&r->unban_time, memory_order_relaxed);
+  acc->last_login_time = (time_t) atomic_load_explicit(&r->last_login_time, memory_order_relaxed);
+  acc->login_count = atomic_load_explicit(&r->login_count, memory_order_relaxed);
+  acc->login_fail_count = atomic_load_explicit(&r->login_fail_count, memory_order_relaxed);
+  acc->last_ip = atomic_load_explicit(&r->last_ip, memory_order_relaxed);
+}
+
+static void store_login_state(shm_record_t *r, const account_t *acc)
+{
+  atomic_store_explicit(&r->unban_time, (int64_t) acc->unban_time, memory_order_relaxed);
+  atomic_store_explicit(&r->last_login_time, (int64_t) acc->last_login_time,
+                        memory_order_relaxed);
+  atomic_store_explicit(&r->login_count, acc->login_count, memory_order_relaxed);
+  atomic_store_explicit(&r->login_fail_count, acc->login_fail_count, memory_order_relaxed);
+  atomic_store_explicit(&r->last_ip, acc->last_ip, memory_order_relaxed);
+}
+
+/**
+ * Undoes the change a dead writer left in progress: puts back the record
+ * it saved, login state included, and leaves its seq even (and changed,
+ * so that readers copying it mid-change retry). Called with the mutex
+ * held.
+ */
+static void recover(shm_store_t *store)
+{
+  shm_header_t *h = store->header;
+  uint64_t i = h->undo_record;
+  if (i < h->capacity) {
+    shm_record_t *r = &store->records[i];
+    uint32_t seq = atomic_load_explicit(&r->seq, memory_order_relaxed);
+    atomic_store_explicit(&r->seq, seq | 1u, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&r->acc, &h->undo, sizeof(r->acc));
+    store_login_state(r, &h->undo);
+    atomic_store_explicit(&r->seq, (seq | 1u) + 1u, memory_order_release);
+  }
+  h->undo_record = NO_RECORD;
+
+  // an insert or removal may have died between its index and count updates
+  uint64_t live = 0;
+  for (uint64_t b = 0; b < h->buckets; b++) {
+    uint32_t slot = atomic_load_explicit(&store->index[b], memory_order_relaxed);
+    live += slot != SLOT_EMPTY && slot != SLOT_REMOVED;
+  }
+  atomic_store(&h->live, live);
+  atomic_fetch_add(&h->recoveries, 1);
+}
+
+/**
+ * Takes the segment's mutex, first recovering from its last holder's death
+ * if need be. Returns false and logs on failure.
+ */
+static bool lock_segment(shm_store_t *store)
+{
+  pthread_mutex_t *mutex = &store->header->mutex;
+  int err = pthread_mutex_lock(mutex);
+  if (err == EOWNERDEAD) {
+    log_message(LOG_WARN, "Shared account store writer died mid-change; undoing it");
+    recover(store);
+    err = pthread_mutex_consistent(mutex);
+  }
+  if (err != 0) {
+    log_message(LOG_ERROR, "Failed to lock shared account store: %s", strerror(err));
+    return false;
+  }
+  return true;
+}
+
+static void unlock_segment(shm_store_t *store)
+{
+  pthread_mutex_unlock(&store->header->mutex);
+}
+
+/**
+ * Finds key in the index: returns the index slot holding it, or, if it is
+ * absent, sets *free_slot (if not NULL) to where it should go and returns
+ * -1.
+ */
+static long long find_slot(shm_store_t *store, const userid_key_t *key, long long *free_slot)
+{
+  uint64_t mask = store->header->buckets - 1;
+  long long first_removed = -1;
+  for (uint64_t probe = 0, b = key->hash & mask; probe <= mask; probe++, b = (b + 1) & mask) {
+    uint32_t slot = atomic_load_explicit(&store->index[b], memory_order_acquire);
+    if (slot == SLOT_EMPTY) {
+      if (free_slot) {
+        *free_slot = first_removed >= 0 ? first_removed : (long long) b;
+      }
+      return -1;
+    }
+    if (slot == SLOT_REMOVED) {
+      if (first_removed < 0) {
+        first_removed = (long long) b;
+      }
+      continue;
+    }
+    shm_record_t *r = &store->records[slot - 1];
+    if (r->hash == key->hash && userid_key_matches(key, r->acc.userid)) {
+      return (long long) b;
+    }
+  }
+  if (free_slot) {
+    *free_slot = first_removed;
+  }
+  return -1;
+}
+
+static shm_record_t *find_record(shm_store_t *store, const userid_key_t *key)
+{
+  long long b = find_slot(store, key, NULL);
+  if (b < 0) {
+    return NULL;
+  }
+  uint32_t slot = atomic_load_explicit(&store->index[b], memory_order_acquire);
+  return slot != SLOT_EMPTY && slot != SLOT_REMOVED ? &store->records[slot - 1] : NULL;
+}
+
+/**
+ * Copies r into acc without locking, retrying while a writer changes it.
+ * A record that stays mid-change may have lost its writer, so after a
+ * while the reader takes the mutex, which waits for a live writer and
+ * undoes a dead one's change.
+ */
+static void read_record(shm_store_t *store, shm_record_t *r, account_t *acc)
+{
+  unsigned int spins = 0;
+  for (;;) {
+    uint32_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+    if ((seq & 1u) == 0) {
+      memcpy(acc, &r->acc, sizeof(*acc));
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&r->seq, memory_order_relaxed) == seq) {
+        break;
+      }
+    }
+    atomic_fetch_add_explicit(&store->retries, 1, memory_order_relaxed);
+    if (++spins < STALL_SPINS) {
+      sched_yield();
+      continue;
+    }
+    if (lock_segment(store)) {
+      unlock_segment(store);
+    }
+    spins = 0;
+  }
+  load_login_state(r, acc);
+}
+
+/**
+ * Sets up a segment this process has just created and sized.
+ */
+static void init_segment(shm_header_t *h, uint64_t capacity, uint64_t buckets)
+{
+  h->version = SHM_STORE_VERSION;
+  h->capacity = capacity;
+  h->buckets = buckets;
+  h->record_size = sizeof(shm_record_t);
+  h->undo_record = NO_RECORD;
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&h->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  atomic_store_explicit(&h->magic, SHM_STORE_MAGIC, memory_order_release);
+}
+
+/**
+ * Waits for whoever created the segment open on fd to finish setting it
+ * up, then returns its size, or 0 (after logging) if it is not a usable
+ * store.
+ */
+static size_t await_segment(int fd, const char *name)
+{
+  for (long waited = 0;; waited++) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      log_message(LOG_ERROR, "fstat(%s) failed: %s", name, strerror(errno));
+      return 0;
+    }
+    if ((size_t) st.st_size >= sizeof(shm_header_t)) {
+      shm_header_t *h = mmap(NULL, sizeof(*h), PROT_READ, MAP_SHARED, fd, 0);
+      if (h == MAP_FAILED) {
+        log_message(LOG_ERROR, "mmap(%s) failed: %s", name, strerror(errno));
+        return 0;
+      }
+      size_t size = 0;
+      bool ready = atomic_load_explicit(&h->magic, memory_order_acquire) == SHM_STORE_MAGIC;
+      if (ready) {
+        if (h->version != SHM_STORE_VERSION || h->record_size != sizeof(shm_record_t)) {
+          log_message(LOG_ERROR, "Shared account store %s has an incompatible layout", name);
+        }
+        else if ((size_t) st.st_size < segment_size(h->capacity, h->buckets)) {
+          log_message(LOG_ERROR, "Shared account store %s is truncated", name);
+        }
+        else {
+          size = segment_size(h->capacity, h->buckets);
+        }
+      }
+      munmap(h, sizeof(*h));
+      if (ready) {
+        return size;
+      }
+    }
+    if (waited >= ATTACH_WAIT_MS) {
+      log_message(LOG_ERROR, "Shared account store %s was never set up", name);
+      return 0;
+    }
+    sleep_ms(1);
+  }
+}
+
+shm_store_t *shm_store_open(const char *name, const shm_store_options_t *opts)
+{
+  size_t capacity = opts ? opts->capacity : 0;
+  if (capacity >= SLOT_REMOVED - 1) {
+    log_message(LOG_ERROR, "Shared account store capacity %zu is too large", capacity);
+    return NULL;
+  }
+  shm_store_t *store = calloc(1, sizeof(*store));
+  if (!store) {
+    log_message(LOG_ERROR, "Memory allocation for shared account store has failed");
+    return NULL;
+  }
+
+  bool created = false;
+  int fd = -1;
+  if (capacity > 0) {
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    created = fd != -1;
+  }
+  if (fd == -1 && (capacity == 0 || errno == EEXIST)) {
+    fd = shm_open(name, O_RDWR, 0);
+  }
+  if (fd == -1) {
+    log_message(LOG_ERROR, "shm_open(%s) failed: %s", name, strerror(errno));
+    free(store);
+    return NULL;
+  }
+
+  uint64_t buckets = 1;
+  while (buckets < 2 * (uint64_t) capacity) {
+    buckets <<= 1;
+  }
+  size_t size = created ? segment_size(capacity, buckets) : await_segment(fd, name);
+  if (size == 0 || (created && ftruncate(fd, (off_t) size) == -1)) {
+    if (created) {
+      log_message(LOG_ERROR, "ftruncate(%s) failed: %s", name, strerror(errno));
+      shm_unlink(name);
+    }
+    close(fd);
+    free(store);
+    return NULL;
+  }
+  void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    log_message(LOG_ERROR, "mmap(%s) failed: %s", name, strerror(errno));
+    if (created) {
+      shm_unlink(name);
+    }
+    free(store);
+    return NULL;
+  }
+  store->header = mapping;
+  store->mapped = size;
+  if (created) {
+    init_segment(store->header, capacity, buckets);
+  }
+  store->index = (_Atomic uint32_t *) ((char *) mapping + index_offset());
+  store->records = (shm_record_t *) ((char *) mapping + records_offset(store->header->buckets));
+  return store;
+}
+
+void shm_store_close(shm_store_t *store)
+{
+  if (!store) {
+    return;
+  }
+  munmap(store->header, store->mapped);
+  free(store);
+}
+
+bool shm_store_unlink(const char *name)
+{
+  if (shm_unlink(name) == -1) {
+    log_message(LOG_ERROR, "shm_unlink(%s) failed: %s", name, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool shm_store_insert(shm_store_t *store, const account_t *acc)
+{
+  userid_key_t key;
+  if (!store || !acc || !userid_key_init(&key, acc->userid)) {
+    return false;
+  }
+  if (!lock_segment(store)) {
+    return false;
+  }
+  shm_header_t *h = store->header;
+  long long free_slot = -1;
+  bool ok = false;
+  if (find_slot(store, &key, &free_slot) >= 0) {
+    log_message(LOG_ERROR, "Shared account store already has user %s", acc->userid);
+  }
+  else if (free_slot < 0 || atomic_load(&h->used) >= h->capacity) {
+    log_message(LOG_ERROR, "Shared account store is full");
+  }
+  else {
+    // the record is claimed before it is filled in, so a writer dying here
+    // wastes it rather than leaving it to be handed out twice
+    uint64_t i = atomic_fetch_add(&h->used, 1);
+    shm_record_t *r = &store->records[i];
+    atomic_store_explicit(&r->seq, 0, memory_order_relaxed);
+    r->hash = key.hash;
+    memcpy(&r->acc, acc, sizeof(r->acc));
+    store_login_state(r, acc);
+    // readers reach the record only through the index, once it is complete
+    atomic_store_explicit(&store->index[free_slot], (uint32_t) (i + 1), memory_order_release);
+    atomic_fetch_add(&h->live, 1);
+    ok = true;
+  }
+  unlock_segment(store);
+  if (ok) {
+    userid_filter_add(acc->userid);
+  }
+  return ok;
+}
+
+bool shm_store_lookup_key(shm_store_t *store, const userid_key_t *key, account_t *acc)
+{
+  if (!store || !key || !acc) {
+    return false;
+  }
+  atomic_fetch_add_explicit(&store->lookups, 1, memory_order_relaxed);
+  shm_record_t *r = find_record(store, key);
+  if (!r) {
+    return false;
+  }
+  read_record(store, r, acc);
+  return true;
+}
+
+bool shm_store_lookup(shm_store_t *store, const char *userid, account_t *acc)
+{
+  userid_key_t key;
+  return userid_key_init(&key, userid) && shm_store_lookup_key(store, &key, acc);
+}
+
+bool shm_store_modify(shm_store_t *store, const char *userid, shm_store_modify_fn fn,
+                      void *arg)
+{
+  userid_key_t key;
+  if (!store || !fn || !userid_key_init(&key, userid)) {
+    return false;
+  }
+  if (!lock_segment(store)) {
+    return false;
+  }
+  shm_record_t *r = find_record(store, &key);
+  bool changed = false;
+  if (r) {
+    shm_header_t *h = store->header;
+    load_login_state(r, &r->acc);
+    memcpy(&h->undo, &r->acc, sizeof(h->undo));
+    atomic_thread_fence(memory_order_release);
+    h->undo_record = (uint64_t) (r - store->records);
+
+    uint32_t seq = atomic_load_explicit(&r->seq, memory_order_relaxed);
+    atomic_store_explicit(&r->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    changed = fn(&r->acc, arg);
+    if (changed) {
+      memcpy(r->acc.userid, h->undo.userid, sizeof(r->acc.userid));
+      // only the fields fn changed, so as not to lose logins recorded
+      // meanwhile
+      const account_t *before = &h->undo;
+      if (r->acc.unban_time != before->unban_time) {
+        atomic_store(&r->unban_time, (int64_t) r->acc.unban_time);
+      }
+      if (r->acc.last_login_time != before->last_login_time) {
+        atomic_store(&r->last_login_time, (int64_t) r->acc.last_login_time);
+      }
+      if (r->acc.login_count != before->login_count) {
+        atomic_store(&r->login_count, r->acc.login_count);
+      }
+      if (r->acc.login_fail_count != before->login_fail_count) {
+        atomic_store(&r->login_fail_count, r->acc.login_fail_count);
+      }
+      if (r->acc.last_ip != before->last_ip) {
+        atomic_store(&r->last_ip, r->acc.last_ip);
+      }
+    }
+    else {
+      memcpy(&r->acc, &h->undo, sizeof(r->acc));
+    }
+    atomic_store_explicit(&r->seq, seq + 2, memory_order_release);
+    h->undo_record = NO_RECORD;
+  }
+  unlock_segment(store);
+  return changed;
+}
+
+static bool replace_account(account_t *acc, void *arg)
+{
+  memcpy(acc, arg, sizeof(*acc));
+  return true;
+}
+
+bool shm_store_update(shm_store_t *store, const account_t *acc)
+{
+  return acc && shm_store_modify(store, acc->userid, replace_account, (void *) acc);
+}
+
+bool shm_store_remove(shm_store_t *store, const char *userid)
+{
+  userid_key_t key;
+  if (!store || !userid_key_init(&key, userid)) {
+    return false;
+  }
+  if (!lock_segment(store)) {
+    return false;
+  }
+  long long b = find_slot(store, &key, NULL);
+  if (b >= 0) {
+    // the slot stays a tombstone so that probes for other keys go past it
+    atomic_store_explicit(&store->index[b], SLOT_REMOVED, memory_order_release);
+    atomic_fetch_sub(&store->header->live, 1);
+  }
+  unlock_segment(store);
+  return b >= 0;
+}
+
+bool shm_store_record_login(shm_store_t *store, const userid_key_t *key, bool success,
+                            ip4_addr_t ip, time_t when)
+{
+  shm_record_t *r = store && key ? find_record(store, key) : NULL;
+  if (!r) {
+    return false;
+  }
+  if (success) {
+    atomic_fetch_add(&r->login_count, 1);
+    atomic_store(&r->login_fail_count, 0);
+    atomic_store(&r->last_login_time, (int64_t) when);
+    atomic_store(&r->last_ip, ip);
+  }
+  else {
+    atomic_fetch_add(&r->login_fail_count, 1);
+    atomic_store(&r->login_count, 0);
+  }
+  return true;
+}
+
+bool shm_store_set_unban_time(shm_store_t *store, const char *userid, time_t unban_time)
+{
+  userid_key_t key;
+  shm_record_t *r = store && userid_key_init(&key, userid) ? find_record(store, &key) : NULL;
+  if (!r) {
+    return false;
+  }
+  atomic_store(&r->unban_time, (int64_t) unban_time);
+  return true;
+}
+
+void shm_store_get_stats(shm_store_t *store, shm_store_stats_t *stats)
+{
+  if (!store || !stats) {
+    return;
+  }
+  stats->lookups = atomic_load(&store->lookups);
+  stats->retries = atomic_load(&store->retries);
+  stats->recoveries = atomic_load(&store->header->recoveries);
+  stats->count = (size_t) atomic_load(&store->header->live);
+  stats->capacity = (size_t) store->header->capacity;
+}
+
+static bool backend_lookup(void *arg, const userid_key_t *key, account_t *acc)
+{
+  return shm_store_lookup_key(arg, key, acc);
+}
+
+/**
+ * handle_login() passes the account after applying the attempt to its own
+ * copy; the attempt is applied again here, as increments, so that attempts
+ * made at once by several processes all count.
+ */
+static void backend_record_login(void *arg, const account_t *acc)
+{
+  userid_key_t key;
+  if (userid_key_init(&key, acc->userid)) {
+    // a success clears the failure count, which a failure leaves positive
+    shm_store_record_login(arg, &key, acc->login_fail_count == 0, acc->last_ip,
+                           acc->last_login_time);
+  }
+}
+
+static bool backend_foreach_userid(void *arg, db_userid_fn fn, void *ctx)
+{
+  shm_store_t *store = arg;
+  bool complete = true;
+  for (uint64_t b = 0; complete && b < store->header->buckets; b++) {
+    uint32_t slot = atomic_load_explicit(&store->index[b], memory_order_acquire);
+    if (slot != SLOT_EMPTY && slot != SLOT_REMOVED) {
+      account_t acc;
+      read_record(store, &store->records[slot - 1], &acc);
+      complete = fn(acc.userid, ctx);
+    }
+  }
+  return complete;
+}
+
+void shm_store_backend(shm_store_t *store, db_backend_t *backend)
+{
+  if (backend) {
+    backend->lookup = backend_lookup;
+    backend->record_login = backend_record_login;
+    backend->lookup_async = NULL;
+    backend->foreach_userid = backend_foreach_userid;
+    backend->arg = store;
+  }
+}
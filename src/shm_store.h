@@ -0,0 +1,118 @@
+#ifndef SHM_STORE_H
+#define SHM_STORE_H
+
+/**
+ * @file shm_store.h
+ * @brief Account store in shared memory, for several server processes.
+ *
+ * Every login server process on a host maps the same POSIX shared-memory
+ * segment, so the accounts are held once and all processes see the same
+ * bans and failed-attempt counts.
+ *
+ * The segment holds a fixed number of account records and an open-
+ * addressed index of them by userid hash. Lookups take no lock and make
+ * no system call: they probe the index and copy the record, retrying if a
+ * writer changed it meanwhile (a per-record seqlock), so they cost about
+ * what an in-process lookup does.
+ *
+ * The login state (login_count, login_fail_count, last_login_time,
+ * last_ip and unban_time) is kept in separate atomic words, updated
+ * without locking: each field is always whole, and concurrent logins from
+ * different processes add to the counters rather than overwrite each
+ * other. Other changes (inserts, removals and shm_store_modify()) are
+ * serialised by a process-shared robust mutex. If a process dies holding
+ * it, the next process to take it restores the record being modified from
+ * a copy saved before the change began, so a torn record is never seen;
+ * readers that find a record stuck mid-change take the mutex to trigger
+ * this.
+ *
+ * Install it as the backend to serve handle_login() through db.h-style
+ * lookups:
+ *
+ *   db_backend_t backend;
+ *   shm_store_backend(store, &backend);
+ *   db_backend_set(&backend);
+ *
+ * The backend's record_login applies each login as an increment, so the
+ * counts stay right however the processes interleave. Per-process caches
+ * (see account_cache.h) do not see other processes' changes, so should be
+ * left off, or given a short TTL, in front of a shared store.
+ */
+
+#include "account.h"
+#include "db_backend.h"
+#include "userid_key.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct shm_store shm_store_t;
+
+typedef struct {
+  size_t capacity;           // accounts, if the segment is created here
+                             // (0 = only attach to an existing segment)
+} shm_store_options_t;
+
+typedef struct {
+  uint64_t lookups;          // by this process
+  uint64_t retries;          // lookups that raced with a writer and copied again
+  uint64_t recoveries;       // by any process: changes rolled back after a death
+  size_t count;              // accounts in the store
+  size_t capacity;
+} shm_store_stats_t;
+
+// change an account in place (see shm_store_modify()); return whether
+// it changed it
+typedef bool (*shm_store_modify_fn)(account_t *acc, void *arg);
+
+// map the segment called name (e.g. "/logins"), creating it with room
+// for opts->capacity accounts if it does not exist. returns NULL (after
+// logging) on failure.
+shm_store_t *shm_store_open(const char *name, const shm_store_options_t *opts);
+
+// unmap the segment, which lives on until shm_store_unlink(). NULL is
+// ignored.
+void shm_store_close(shm_store_t *store);
+
+// remove the segment called name once every process has closed it
+bool shm_store_unlink(const char *name);
+
+// add a copy of acc. returns false if its userid is already present or
+// the store is full.
+bool shm_store_insert(shm_store_t *store, const account_t *acc);
+
+// copy the account with the given userid into acc
+bool shm_store_lookup(shm_store_t *store, const char *userid, account_t *acc);
+
+// as shm_store_lookup(), for a userid already made into a key
+bool shm_store_lookup_key(shm_store_t *store, const userid_key_t *key, account_t *acc);
+
+// call fn on the account with the given userid, holding the store's
+// mutex, and keep what it does (all of the account but its userid) if
+// it returns true. returns false if there is no such account or fn
+// returned false.
+bool shm_store_modify(shm_store_t *store, const char *userid, shm_store_modify_fn fn,
+                      void *arg);
+
+// replace the stored copy of acc (by userid) with acc
+bool shm_store_update(shm_store_t *store, const account_t *acc);
+
+bool shm_store_remove(shm_store_t *store, const char *userid);
+
+// apply a login attempt to the account's login state, atomically: on
+// success login_count is incremented, login_fail_count cleared and the
+// time and address recorded; on failure login_fail_count is incremented
+// and login_count cleared
+bool shm_store_record_login(shm_store_t *store, const userid_key_t *key, bool success,
+                            ip4_addr_t ip, time_t when);
+
+bool shm_store_set_unban_time(shm_store_t *store, const char *userid, time_t unban_time);
+
+void shm_store_get_stats(shm_store_t *store, shm_store_stats_t *stats);
+
+// fill in backend to look accounts up in, and record logins to, store
+void shm_store_backend(shm_store_t *store, db_backend_t *backend);
+
+#endif // SHM_STORE_H
@@ -0,0 +1,305 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "slab.h"
+#include "logging.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAGAZINE_SIZE 64
+// objects moved between a magazine and the shared free list at a time
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)
+
+// free objects are chained through their own first bytes
+typedef struct free_object {
+  struct free_object *next;
+} free_object_t;
+
+typedef struct slab {
+  struct slab *next;
+} slab_t;
+
+struct slab_cache {
+  char name[32];
+  unsigned int id;             // index into each thread's magazines
+  uint64_t generation;         // unique to this cache, even if its id and address are reused
+  size_t object_size;
+  size_t objects_per_slab;
+  size_t slab_header;          // bytes before the first object in a slab
+  pthread_mutex_t mutex;       // protects everything below
+  free_object_t *free_list;
+  slab_t *slabs;
+  slab_cache_stats_t stats;
+};
+
+typedef struct {
+  slab_cache_t *cache;         // cache the magazine belongs to (NULL = unused)
+  uint64_t generation;         // that cache's generation
+  size_t count;
+  void *objects[MAGAZINE_SIZE];
+} magazine_t;
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static slab_cache_t *registry[SLAB_MAX_CACHES];
+static uint64_t next_generation = 1;  // protected by registry_mutex
+
+static _Thread_local magazine_t magazines[SLAB_MAX_CACHES];
+static pthread_key_t magazine_key;
+static pthread_once_t magazine_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Pushes n objects onto the shared free list. Caller holds cache->mutex.
+ */
+static void push_free_locked(slab_cache_t *cache, void **objects, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    if (!objects[i]) {
+      continue;
+    }
+    free_object_t *object = objects[i];
+    object->next = cache->free_list;
+    cache->free_list = object;
+    cache->stats.objects_free++;
+  }
+}
+
+/**
+ * Allocates a new slab and threads its objects onto the free list. Caller
+ * holds cache->mutex. Returns false if memory is exhausted.
+ */
+static bool grow_locked(slab_cache_t *cache)
+{
+  size_t bytes = cache->slab_header + cache->object_size * cache->objects_per_slab;
+  unsigned char *memory = aligned_alloc(alignof(max_align_t),
+                                        (bytes + alignof(max_align_t) - 1)
+                                        / alignof(max_align_t) * alignof(max_align_t));
+  if (!memory) {
+    log_message(LOG_ERROR, "Slab allocation for cache %s has failed", cache->name);
+    return false;
+  }
+  slab_t *slab = (slab_t *) memory;
+  slab->next = cache->slabs;
+  cache->slabs = slab;
+
+  // thread in reverse so objects are handed out in address order
+  unsigned char *first = memory + cache->slab_header;
+  for (size_t i = cache->objects_per_slab; i-- > 0;) {
+    free_object_t *object = (free_object_t *) (first + i * cache->object_size);
+    object->next = cache->free_list;
+    cache->free_list = object;
+  }
+  cache->stats.slabs++;
+  cache->stats.objects_total += cache->objects_per_slab;
+  cache->stats.objects_free += cache->objects_per_slab;
+  cache->stats.bytes_reserved += bytes;
+  return true;
+}
+
+/**
+ * Pops up to n objects off the shared free list (growing the cache if it is
+ * empty) into objects[]. Caller holds cache->mutex. Returns the number popped.
+ */
+static size_t pop_free_locked(slab_cache_t *cache, void **objects, size_t n)
+{
+  size_t popped = 0;
+  while (popped < n) {
+    if (!cache->free_list && !grow_locked(cache)) {
+      break;
+    }
+    free_object_t *object = cache->free_list;
+    cache->free_list = object->next;
+    cache->stats.objects_free--;
+    objects[popped++] = object;
+  }
+  return popped;
+}
+
+/**
+ * Thread exit: return every magazine's objects to its cache.
+ */
+static void flush_magazines(void *unused)
+{
+  (void) unused;
+  pthread_mutex_lock(&registry_mutex);
+  for (size_t i = 0; i < SLAB_MAX_CACHES; i++) {
+    magazine_t *magazine = &magazines[i];
+    // skip magazines whose cache has since been destroyed, even if another
+    // cache has taken its place (and perhaps its address)
+    if (registry[i] && registry[i]->generation == magazine->generation
+        && magazine->count > 0) {
+      pthread_mutex_lock(&magazine->cache->mutex);
+      push_free_locked(magazine->cache, magazine->objects, magazine->count);
+      pthread_mutex_unlock(&magazine->cache->mutex);
+    }
+    magazine->count = 0;
+    magazine->cache = NULL;
+  }
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+static void create_magazine_key(void)
+{
+  pthread_key_create(&magazine_key, flush_magazines);
+}
+
+/**
+ * Returns this thread's magazine for cache, registering the thread-exit
+ * flush the first time the thread touches any magazine.
+ *
+ * A magazine left over from a destroyed cache holds objects from its freed
+ * slabs. The generation check discards it, even when the cache in hand was
+ * given the same id and address.
+ */
+static magazine_t *thread_magazine(slab_cache_t *cache)
+{
+  magazine_t *magazine = &magazines[cache->id];
+  if (magazine->cache != cache || magazine->generation != cache->generation) {
+    pthread_once(&magazine_key_once, create_magazine_key);
+    // any non-NULL value makes the destructor run at thread exit
+    pthread_setspecific(magazine_key, magazines);
+    magazine->cache = cache;
+    magazine->generation = cache->generation;
+    magazine->count = 0;
+  }
+  return magazine;
+}
+
+slab_cache_t *slab_cache_create(const char *name, size_t object_size, size_t objects_per_slab)
+{
+  if (object_size == 0 || objects_per_slab == 0) {
+    return NULL;
+  }
+  slab_cache_t *cache = calloc(1, sizeof(*cache));
+  if (!cache) {
+    log_message(LOG_ERROR, "Memory allocation for slab cache has failed");
+    return NULL;
+  }
+
+  pthread_mutex_lock(&registry_mutex);
+  size_t id = 0;
+  while (id < SLAB_MAX_CACHES && registry[id]) {
+    id++;
+  }
+  if (id == SLAB_MAX_CACHES) {
+    pthread_mutex_unlock(&registry_mutex);
+    log_message(LOG_ERROR, "Too many slab caches (maximum %d)", SLAB_MAX_CACHES);
+    free(cache);
+    return NULL;
+  }
+  registry[id] = cache;
+  cache->generation = next_generation++;
+  pthread_mutex_unlock(&registry_mutex);
+
+  const size_t align = alignof(max_align_t);
+  if (object_size < sizeof(free_object_t)) {
+    object_size = sizeof(free_object_t);
+  }
+  cache->id = (unsigned int) id;
+  cache->object_size = (object_size + align - 1) / align * align;
+  cache->objects_per_slab = objects_per_slab;
+  cache->slab_header = (sizeof(slab_t) + align - 1) / align * align;
+  cache->stats.object_size = cache->object_size;
+  snprintf(cache->name, sizeof(cache->name), "%s", name ? name : "slab");
+  pthread_mutex_init(&cache->mutex, NULL);
+  return cache;
+}
+
+void slab_cache_destroy(slab_cache_t *cache)
+{
+  if (!cache) {
+    return;
+  }
+  // drop the calling thread's magazine. Other threads' magazines are
+  // discarded when they next use this id, as their generation is stale.
+  if (magazines[cache->id].generation == cache->generation) {
+    magazines[cache->id].cache = NULL;
+    magazines[cache->id].count = 0;
+  }
+  pthread_mutex_lock(&registry_mutex);
+  registry[cache->id] = NULL;
+  pthread_mutex_unlock(&registry_mutex);
+
+  slab_t *slab = cache->slabs;
+  while (slab) {
+    slab_t *next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  pthread_mutex_destroy(&cache->mutex);
+  free(cache);
+}
+
+void *slab_alloc(slab_cache_t *cache)
+{
+  magazine_t *magazine = thread_magazine(cache);
+  if (magazine->count == 0) {
+    pthread_mutex_lock(&cache->mutex);
+    magazine->count = pop_free_locked(cache, magazine->objects, MAGAZINE_BATCH);
+    pthread_mutex_unlock(&cache->mutex);
+    if (magazine->count == 0) {
+      return NULL;
+    }
+  }
+  return magazine->objects[--magazine->count];
+}
+
+void slab_free(slab_cache_t *cache, void *object)
+{
+  if (!object) {
+    return;
+  }
+  magazine_t *magazine = thread_magazine(cache);
+  if (magazine->count == MAGAZINE_SIZE) {
+    // hand the older half back so a free/alloc pattern doesn't thrash the lock
+    pthread_mutex_lock(&cache->mutex);
+    push_free_locked(cache, magazine->objects, MAGAZINE_BATCH);
+    pthread_mutex_unlock(&cache->mutex);
+    memmove(magazine->objects, magazine->objects + MAGAZINE_BATCH,
+            (MAGAZINE_SIZE - MAGAZINE_BATCH) * sizeof(void *));
+    magazine->count -= MAGAZINE_BATCH;
+  }
+  magazine->objects[magazine->count++] = object;
+}
+
+size_t slab_alloc_bulk(slab_cache_t *cache, void **objects, size_t n)
+{
+  magazine_t *magazine = thread_magazine(cache);
+  size_t done = 0;
+  while (done < n && magazine->count > 0) {
+    objects[done++] = magazine->objects[--magazine->count];
+  }
+  if (done < n) {
+    pthread_mutex_lock(&cache->mutex);
+    done += pop_free_locked(cache, objects + done, n - done);
+    pthread_mutex_unlock(&cache->mutex);
+  }
+  return done;
+}
+
+void slab_free_bulk(slab_cache_t *cache, void **objects, size_t n)
+{
+  magazine_t *magazine = thread_magazine(cache);
+  size_t done = 0;
+  while (done < n && magazine->count < MAGAZINE_SIZE) {
+    if (objects[done]) {
+      magazine->objects[magazine->count++] = objects[done];
+    }
+    done++;
+  }
+  if (done < n) {
+    pthread_mutex_lock(&cache->mutex);
+    push_free_locked(cache, objects + done, n - done);
+    pthread_mutex_unlock(&cache->mutex);
+  }
+}
+
+void slab_cache_get_stats(slab_cache_t *cache, slab_cache_stats_t *stats)
+{
+  pthread_mutex_lock(&cache->mutex);
+  *stats = cache->stats;
+  pthread_mutex_unlock(&cache->mutex);
+}
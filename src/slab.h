@@ -0,0 +1,65 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+/**
+ * @file slab.h
+ * @brief Fixed-size object caches carved out of large slabs.
+ *
+ * A slab cache hands out objects of one size class. Objects are packed
+ * back to back in large slabs (no per-object allocator header), and freed
+ * objects are kept on free lists for reuse rather than returned to malloc,
+ * so allocation and free cost a few instructions in the common case.
+ *
+ * Each thread keeps a small magazine of free objects per cache; only when a
+ * magazine runs empty or overflows does a thread take the cache's lock to
+ * move a batch of objects to or from the shared free list. Magazines are
+ * returned to the shared list when their thread exits.
+ *
+ * Memory held by a cache is only given back to the system by
+ * slab_cache_destroy().
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SLAB_MAX_CACHES 16
+
+typedef struct slab_cache slab_cache_t;
+
+typedef struct {
+  size_t object_size;     // size of each object, after rounding for alignment
+  size_t slabs;           // slabs allocated
+  size_t objects_total;   // objects carved out of all slabs
+  size_t objects_free;    // objects on the shared free list (excludes thread magazines)
+  size_t bytes_reserved;  // bytes allocated for slabs
+} slab_cache_stats_t;
+
+// create a cache of objects of object_size bytes, allocated objects_per_slab
+// at a time. returns NULL (after logging) on failure, or if SLAB_MAX_CACHES
+// caches already exist.
+slab_cache_t *slab_cache_create(const char *name, size_t object_size, size_t objects_per_slab);
+
+// release all memory held by a cache. Every object must have been freed, and
+// no other thread may use the cache concurrently or afterwards. Objects left
+// in other threads' magazines are dropped with it; a cache created later is
+// never handed them, even if it reuses this one's id and address.
+void slab_cache_destroy(slab_cache_t *cache);
+
+// allocate one object (uninitialised). returns NULL if memory is exhausted.
+void *slab_alloc(slab_cache_t *cache);
+
+// return an object obtained from slab_alloc on the same cache. NULL is ignored.
+void slab_free(slab_cache_t *cache, void *object);
+
+// allocate up to n objects into objects[]; returns how many were allocated
+// (fewer than n only if memory is exhausted).
+size_t slab_alloc_bulk(slab_cache_t *cache, void **objects, size_t n);
+
+// free n objects at once, taking the cache lock at most once. NULL entries
+// are ignored.
+void slab_free_bulk(slab_cache_t *cache, void **objects, size_t n);
+
+// fill in usage statistics for a cache
+void slab_cache_get_stats(slab_cache_t *cache, slab_cache_stats_t *stats);
+
+#endif // SLAB_H
@@ -0,0 +1,282 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "thread_pool.h"
+#include "logging.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define INITIAL_DEQUE_CAPACITY 64
+
+typedef struct {
+  thread_pool_task_fn fn;
+  void *arg;
+  thread_pool_group_t *group;
+} task_t;
+
+/**
+ * Ring-buffer deque. The owner pushes and pops at the bottom (newest end);
+ * thieves take from the top (oldest end).
+ */
+typedef struct {
+  pthread_mutex_t mutex;
+  task_t *tasks;
+  size_t capacity;
+  size_t top;     // index of the oldest task
+  size_t count;
+} deque_t;
+
+typedef struct {
+  thread_pool_t *pool;
+  unsigned int index;
+} worker_arg_t;
+
+struct thread_pool {
+  unsigned int nthreads;         // workers running
+  unsigned int ndeques;          // deques allocated (>= nthreads); workers only read this
+  deque_t *deques;
+  pthread_t *threads;
+  worker_arg_t *worker_args;
+  atomic_size_t queued;          // tasks sitting in deques
+  atomic_uint next_deque;        // round-robin target for external submissions
+  pthread_mutex_t sleep_mutex;
+  pthread_cond_t wake;
+  bool stopping;                 // protected by sleep_mutex
+};
+
+// the pool and deque index of the current thread, if it is a pool worker
+static _Thread_local thread_pool_t *current_pool = NULL;
+static _Thread_local unsigned int current_index = 0;
+
+static bool deque_push(deque_t *deque, task_t task)
+{
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->count == deque->capacity) {
+    size_t capacity = deque->capacity ? deque->capacity * 2 : INITIAL_DEQUE_CAPACITY;
+    task_t *tasks = malloc(capacity * sizeof(task_t));
+    if (!tasks) {
+      pthread_mutex_unlock(&deque->mutex);
+      return false;
+    }
+    for (size_t i = 0; i < deque->count; i++) {
+      tasks[i] = deque->tasks[(deque->top + i) % deque->capacity];
+    }
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->capacity = capacity;
+    deque->top = 0;
+  }
+  deque->tasks[(deque->top + deque->count) % deque->capacity] = task;
+  deque->count++;
+  pthread_mutex_unlock(&deque->mutex);
+  return true;
+}
+
+static bool deque_pop_bottom(deque_t *deque, task_t *task)
+{
+  pthread_mutex_lock(&deque->mutex);
+  bool found = deque->count > 0;
+  if (found) {
+    deque->count--;
+    *task = deque->tasks[(deque->top + deque->count) % deque->capacity];
+  }
+  pthread_mutex_unlock(&deque->mutex);
+  return found;
+}
+
+static bool deque_steal_top(deque_t *deque, task_t *task)
+{
+  pthread_mutex_lock(&deque->mutex);
+  bool found = deque->count > 0;
+  if (found) {
+    *task = deque->tasks[deque->top];
+    deque->top = (deque->top + 1) % deque->capacity;
+    deque->count--;
+  }
+  pthread_mutex_unlock(&deque->mutex);
+  return found;
+}
+
+/**
+ * Takes a task from the worker's own deque, or steals one from another
+ * worker, starting with its neighbour. Returns false if every deque is empty.
+ */
+static bool find_task(thread_pool_t *pool, unsigned int self, task_t *task)
+{
+  if (deque_pop_bottom(&pool->deques[self], task)) {
+    return true;
+  }
+  for (unsigned int i = 1; i < pool->ndeques; i++) {
+    if (deque_steal_top(&pool->deques[(self + i) % pool->ndeques], task)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void group_finish(thread_pool_group_t *group)
+{
+  pthread_mutex_lock(&group->mutex);
+  if (--group->pending == 0) {
+    pthread_cond_broadcast(&group->done);
+  }
+  pthread_mutex_unlock(&group->mutex);
+}
+
+static void *worker_main(void *arg)
+{
+  worker_arg_t *worker = arg;
+  thread_pool_t *pool = worker->pool;
+  current_pool = pool;
+  current_index = worker->index;
+
+  for (;;) {
+    task_t task;
+    if (find_task(pool, worker->index, &task)) {
+      atomic_fetch_sub(&pool->queued, 1);
+      task.fn(task.arg);
+      group_finish(task.group);
+      continue;
+    }
+    pthread_mutex_lock(&pool->sleep_mutex);
+    while (atomic_load(&pool->queued) == 0 && !pool->stopping) {
+      pthread_cond_wait(&pool->wake, &pool->sleep_mutex);
+    }
+    bool done = pool->stopping && atomic_load(&pool->queued) == 0;
+    pthread_mutex_unlock(&pool->sleep_mutex);
+    if (done) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+unsigned int thread_pool_cpu_count(void)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? (unsigned int) cpus : 1;
+}
+
+thread_pool_t *thread_pool_create(unsigned int nthreads)
+{
+  if (nthreads == 0) {
+    nthreads = thread_pool_cpu_count();
+  }
+  thread_pool_t *pool = calloc(1, sizeof(*pool));
+  if (!pool) {
+    log_message(LOG_ERROR, "Memory allocation for thread pool has failed");
+    return NULL;
+  }
+  pool->deques = calloc(nthreads, sizeof(deque_t));
+  pool->threads = calloc(nthreads, sizeof(pthread_t));
+  pool->worker_args = calloc(nthreads, sizeof(worker_arg_t));
+  if (!pool->deques || !pool->threads || !pool->worker_args) {
+    log_message(LOG_ERROR, "Memory allocation for thread pool has failed");
+    free(pool->deques);
+    free(pool->threads);
+    free(pool->worker_args);
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->sleep_mutex, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  atomic_init(&pool->queued, 0);
+  atomic_init(&pool->next_deque, 0);
+  pool->ndeques = nthreads;
+  for (unsigned int i = 0; i < nthreads; i++) {
+    pthread_mutex_init(&pool->deques[i].mutex, NULL);
+  }
+
+  for (unsigned int i = 0; i < nthreads; i++) {
+    pool->worker_args[i].pool = pool;
+    pool->worker_args[i].index = i;
+    if (pthread_create(&pool->threads[i], NULL, worker_main, &pool->worker_args[i]) != 0) {
+      log_message(LOG_ERROR, "Failed to start thread pool worker %u", i);
+      // run with the workers we have; they steal from the missing ones' deques
+      break;
+    }
+    pool->nthreads = i + 1;
+  }
+  if (pool->nthreads == 0) {
+    thread_pool_destroy(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+void thread_pool_destroy(thread_pool_t *pool)
+{
+  if (!pool) {
+    return;
+  }
+  pthread_mutex_lock(&pool->sleep_mutex);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->sleep_mutex);
+  for (unsigned int i = 0; i < pool->nthreads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  for (unsigned int i = 0; i < pool->ndeques; i++) {
+    free(pool->deques[i].tasks);
+    pthread_mutex_destroy(&pool->deques[i].mutex);
+  }
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->sleep_mutex);
+  free(pool->deques);
+  free(pool->threads);
+  free(pool->worker_args);
+  free(pool);
+}
+
+unsigned int thread_pool_size(const thread_pool_t *pool)
+{
+  return pool->nthreads;
+}
+
+void thread_pool_group_init(thread_pool_group_t *group)
+{
+  group->pending = 0;
+  pthread_mutex_init(&group->mutex, NULL);
+  pthread_cond_init(&group->done, NULL);
+}
+
+void thread_pool_group_destroy(thread_pool_group_t *group)
+{
+  pthread_cond_destroy(&group->done);
+  pthread_mutex_destroy(&group->mutex);
+}
+
+bool thread_pool_submit(thread_pool_t *pool, thread_pool_group_t *group,
+                        thread_pool_task_fn fn, void *arg)
+{
+  unsigned int target = current_pool == pool
+                        ? current_index
+                        : atomic_fetch_add(&pool->next_deque, 1) % pool->ndeques;
+
+  pthread_mutex_lock(&group->mutex);
+  group->pending++;
+  pthread_mutex_unlock(&group->mutex);
+
+  task_t task = { fn, arg, group };
+  if (!deque_push(&pool->deques[target], task)) {
+    log_message(LOG_ERROR, "Memory allocation for thread pool task has failed");
+    group_finish(group);
+    return false;
+  }
+  atomic_fetch_add(&pool->queued, 1);
+
+  pthread_mutex_lock(&pool->sleep_mutex);
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->sleep_mutex);
+  return true;
+}
+
+void thread_pool_group_wait(thread_pool_group_t *group)
+{
+  pthread_mutex_lock(&group->mutex);
+  while (group->pending > 0) {
+    pthread_cond_wait(&group->done, &group->mutex);
+  }
+  pthread_mutex_unlock(&group->mutex);
+}
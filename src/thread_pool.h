@@ -0,0 +1,61 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+/**
+ * @file thread_pool.h
+ * @brief Work-stealing thread pool for CPU-bound tasks.
+ *
+ * Each worker owns a deque of tasks. Tasks submitted from a worker go on
+ * that worker's own deque and are run newest-first (good cache locality for
+ * recursively split work); tasks submitted from other threads are spread
+ * round-robin over the workers. An idle worker steals the oldest task from
+ * another worker's deque before going to sleep, so uneven task costs still
+ * keep every core busy.
+ *
+ * Completion is tracked with task groups: every task belongs to a group,
+ * and thread_pool_group_wait() blocks until all of a group's tasks are done.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct thread_pool thread_pool_t;
+
+typedef void (*thread_pool_task_fn)(void *arg);
+
+/**
+ * A set of tasks that can be waited on together. Initialise with
+ * thread_pool_group_init() before use; a group can be reused once waited on.
+ */
+typedef struct {
+  size_t pending;
+  pthread_mutex_t mutex;
+  pthread_cond_t done;
+} thread_pool_group_t;
+
+// create a pool of nthreads workers (0 = number of online CPUs).
+// returns NULL (after logging) on failure.
+thread_pool_t *thread_pool_create(unsigned int nthreads);
+
+// wait for all submitted tasks to finish, then stop and free the pool
+void thread_pool_destroy(thread_pool_t *pool);
+
+// number of worker threads
+unsigned int thread_pool_size(const thread_pool_t *pool);
+
+// number of online CPUs (at least 1)
+unsigned int thread_pool_cpu_count(void);
+
+void thread_pool_group_init(thread_pool_group_t *group);
+void thread_pool_group_destroy(thread_pool_group_t *group);
+
+// queue fn(arg) to run on the pool as part of group. returns false (after
+// logging) if memory is exhausted, in which case the task is not queued.
+bool thread_pool_submit(thread_pool_t *pool, thread_pool_group_t *group,
+                        thread_pool_task_fn fn, void *arg);
+
+// block until every task submitted to group has finished
+void thread_pool_group_wait(thread_pool_group_t *group);
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,363 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "userid_filter.h"
+#include "account.h"
+#include "account_store.h"
+#include "db_backend.h"
+#include "logging.h"
+#include "userid_key.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_WORDS 8                     // 512 bits: one cache line per block
+#define BLOCK_BITS (BLOCK_WORDS * 64)
+#define MIN_CAPACITY 1024
+#define MAX_HASHES 16
+#define MAX_BLOCKS ((size_t) 1 << 32)     // block index is taken from 32 hash bits
+#define BLOCKED_OVERHEAD 1.15             // extra bits a blocked filter needs for the same rate
+
+typedef struct {
+  _Atomic uint64_t *words;
+  size_t nblocks;
+  unsigned int hashes;
+  size_t capacity;
+  atomic_size_t inserted;
+  atomic_size_t removed;
+} filter_t;
+
+/*
+ * Two filters: the one in use, and a spare that the next rebuild fills.
+ * Readers announce themselves in readers[] before using a slot (and back
+ * off if it stopped being current meanwhile), so a rebuild can wait until
+ * the spare has no readers left before it frees and reuses it.
+ */
+static filter_t slots[2];
+static atomic_int current = -1;   // slot answering queries, or -1 if disabled
+static atomic_int building = -1;  // slot being filled by a rebuild, or -1
+static atomic_uint readers[2];
+static pthread_mutex_t rebuild_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool hook_added = false;   // guarded by rebuild_mutex
+static _Atomic uint64_t queries = 0;
+static _Atomic uint64_t rejected = 0;
+
+static filter_t *acquire(atomic_int *which, int *slot)
+{
+  for (;;) {
+    int s = atomic_load(which);
+    if (s < 0) {
+      return NULL;
+    }
+    atomic_fetch_add(&readers[s], 1);
+    if (atomic_load(which) == s) {
+      *slot = s;
+      return &slots[s];
+    }
+    atomic_fetch_sub(&readers[s], 1);
+  }
+}
+
+static void release(int slot)
+{
+  atomic_fetch_sub(&readers[slot], 1);
+}
+
+static void wait_for_readers(int slot)
+{
+  while (atomic_load(&readers[slot]) != 0) {
+    sched_yield();
+  }
+}
+
+/**
+ * Finds the block for key in f and the bits to test or set in it.
+ */
+static size_t locate(const filter_t *f, const userid_key_t *key, uint64_t mask[BLOCK_WORDS])
+{
+  size_t block = (size_t) (((key->hash >> 32) * f->nblocks) >> 32);
+  // bit positions by double hashing from the fingerprint and the low half
+  // of the hash
+  uint32_t pos = key->fingerprint;
+  uint32_t step = (uint32_t) key->hash | 1;
+  memset(mask, 0, BLOCK_WORDS * sizeof(mask[0]));
+  for (unsigned int i = 0; i < f->hashes; i++) {
+    unsigned int bit = pos % BLOCK_BITS;
+    mask[bit / 64] |= (uint64_t) 1 << (bit % 64);
+    pos += step;
+  }
+  return block;
+}
+
+static void filter_add(filter_t *f, const userid_key_t *key)
+{
+  uint64_t mask[BLOCK_WORDS];
+  _Atomic uint64_t *words = f->words + locate(f, key, mask) * BLOCK_WORDS;
+  for (int w = 0; w < BLOCK_WORDS; w++) {
+    if (mask[w]) {
+      atomic_fetch_or_explicit(&words[w], mask[w], memory_order_relaxed);
+    }
+  }
+  atomic_fetch_add_explicit(&f->inserted, 1, memory_order_relaxed);
+}
+
+static bool filter_test(const filter_t *f, const userid_key_t *key)
+{
+  uint64_t mask[BLOCK_WORDS];
+  _Atomic uint64_t *words = f->words + locate(f, key, mask) * BLOCK_WORDS;
+  for (int w = 0; w < BLOCK_WORDS; w++) {
+    if ((atomic_load_explicit(&words[w], memory_order_relaxed) & mask[w]) != mask[w]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void add_to(atomic_int *which, const userid_key_t *key)
+{
+  int slot;
+  filter_t *f = acquire(which, &slot);
+  if (f) {
+    filter_add(f, key);
+    release(slot);
+  }
+}
+
+/**
+ * log2(x) for x >= 1, without needing libm.
+ */
+static double log2_of(double x)
+{
+  double result = 0;
+  while (x >= 2) {
+    x /= 2;
+    result += 1;
+  }
+  double bit = 1;
+  for (int i = 0; i < 24; i++) {
+    x *= x;
+    bit /= 2;
+    if (x >= 2) {
+      x /= 2;
+      result += bit;
+    }
+  }
+  return result;
+}
+
+/**
+ * Sizes and allocates f for capacity user IDs at fp_rate. An ideal Bloom
+ * filter needs log2(1/p) / ln 2 bits and log2(1/p) hashes per key; keeping
+ * each key's bits in one block costs a little more space for the same rate.
+ */
+static bool filter_init(filter_t *f, size_t capacity, double fp_rate)
+{
+  double log2_inverse = log2_of(1 / fp_rate);
+  double bits_per_key = log2_inverse * 1.4427 * BLOCKED_OVERHEAD;
+  double bits = bits_per_key * (double) capacity;
+  size_t nblocks = (size_t) (bits / BLOCK_BITS) + 1;
+  if (nblocks > MAX_BLOCKS) {
+    nblocks = MAX_BLOCKS;
+  }
+  unsigned int hashes = (unsigned int) (log2_inverse + 0.5);
+  hashes = hashes < 1 ? 1 : hashes > MAX_HASHES ? MAX_HASHES : hashes;
+
+  size_t bytes = nblocks * BLOCK_WORDS * sizeof(uint64_t);
+  _Atomic uint64_t *words = aligned_alloc(BLOCK_WORDS * sizeof(uint64_t), bytes);
+  if (!words) {
+    log_message(LOG_ERROR, "Memory allocation for user ID filter (%zu bytes) has failed", bytes);
+    return false;
+  }
+  for (size_t i = 0; i < nblocks * BLOCK_WORDS; i++) {
+    atomic_init(&words[i], 0);
+  }
+  f->words = words;
+  f->nblocks = nblocks;
+  f->hashes = hashes;
+  f->capacity = capacity;
+  atomic_store(&f->inserted, 0);
+  atomic_store(&f->removed, 0);
+  return true;
+}
+
+static void filter_free(filter_t *f)
+{
+  free(f->words);
+  f->words = NULL;
+  f->nblocks = 0;
+}
+
+static void track_change(account_store_op_t op, uint64_t sequence, const account_t *acc,
+                         void *arg)
+{
+  (void) sequence;
+  (void) arg;
+  if (op == ACCOUNT_STORE_INSERT) {
+    userid_key_t key;
+    userid_key_init(&key, acc->userid);
+    add_to(&current, &key);
+    add_to(&building, &key);
+  }
+  else if (op == ACCOUNT_STORE_REMOVE) {
+    int slot;
+    filter_t *f = acquire(&current, &slot);
+    if (f) {
+      atomic_fetch_add_explicit(&f->removed, 1, memory_order_relaxed);
+      release(slot);
+    }
+  }
+}
+
+static bool add_userid(const char *userid, void *ctx)
+{
+  userid_key_t key;
+  if (userid_key_init(&key, userid)) {
+    filter_add(ctx, &key);
+  }
+  return true;
+}
+
+static bool count_userid(const char *userid, void *ctx)
+{
+  (void) userid;
+  (*(size_t *) ctx)++;
+  return true;
+}
+
+bool userid_filter_rebuild(size_t capacity, double fp_rate)
+{
+  if (fp_rate <= 0) {
+    fp_rate = USERID_FILTER_DEFAULT_FP_RATE;
+  }
+  if (fp_rate >= 1) {
+    log_message(LOG_ERROR, "User ID filter false-positive rate must be below 1");
+    return false;
+  }
+  if (capacity == 0) {
+    size_t count = 0;
+    if (!db_backend_foreach_userid(count_userid, &count)) {
+      log_message(LOG_ERROR, "The account backend cannot list its user IDs to filter");
+      return false;
+    }
+    capacity = count + count / 2;
+  }
+  if (capacity < MIN_CAPACITY) {
+    capacity = MIN_CAPACITY;
+  }
+
+  pthread_mutex_lock(&rebuild_mutex);
+  if (!hook_added) {
+    hook_added = account_store_add_hook(track_change, NULL);
+    if (!hook_added) {
+      pthread_mutex_unlock(&rebuild_mutex);
+      return false;
+    }
+  }
+  // fill the spare slot, then make it current; the old filter keeps
+  // answering until then, and becomes the spare
+  int slot = atomic_load(&current) == 0 ? 1 : 0;
+  wait_for_readers(slot);
+  filter_t *f = &slots[slot];
+  filter_free(f);
+  if (!filter_init(f, capacity, fp_rate)) {
+    pthread_mutex_unlock(&rebuild_mutex);
+    return false;
+  }
+  // accounts added from here on (by track_change() or by backends calling
+  // userid_filter_add()) go into this slot too, so none is missed whether
+  // or not the walk below sees it
+  atomic_store(&building, slot);
+  bool complete = db_backend_foreach_userid(add_userid, f);
+  if (complete) {
+    atomic_store(&current, slot);
+  }
+  atomic_store(&building, -1);
+  pthread_mutex_unlock(&rebuild_mutex);
+  if (!complete) {
+    log_message(LOG_ERROR, "Failed to list the backend's user IDs; keeping the previous filter");
+  }
+  return complete;
+}
+
+void userid_filter_disable(void)
+{
+  pthread_mutex_lock(&rebuild_mutex);
+  if (hook_added) {
+    account_store_remove_hook(track_change, NULL);
+    hook_added = false;
+  }
+  atomic_store(&current, -1);
+  atomic_store(&building, -1);
+  for (int slot = 0; slot < 2; slot++) {
+    wait_for_readers(slot);
+    filter_free(&slots[slot]);
+  }
+  pthread_mutex_unlock(&rebuild_mutex);
+}
+
+bool userid_filter_may_contain(const char *userid)
+{
+  userid_key_t key;
+  return !userid_key_init(&key, userid) || userid_filter_may_contain_key(&key);
+}
+
+bool userid_filter_may_contain_key(const userid_key_t *key)
+{
+  int slot;
+  filter_t *f = key ? acquire(&current, &slot) : NULL;
+  if (!f) {
+    return true;
+  }
+  bool present = filter_test(f, key);
+  release(slot);
+  atomic_fetch_add_explicit(&queries, 1, memory_order_relaxed);
+  if (!present) {
+    atomic_fetch_add_explicit(&rejected, 1, memory_order_relaxed);
+  }
+  return present;
+}
+
+void userid_filter_add(const char *userid)
+{
+  userid_key_t key;
+  if (userid_key_init(&key, userid)) {
+    add_to(&current, &key);
+    add_to(&building, &key);
+  }
+}
+
+bool userid_filter_needs_rebuild(void)
+{
+  int slot;
+  filter_t *f = acquire(&current, &slot);
+  if (!f) {
+    return false;
+  }
+  bool needed = atomic_load(&f->inserted) > f->capacity
+                || atomic_load(&f->removed) > f->capacity / 4;
+  release(slot);
+  return needed;
+}
+
+void userid_filter_get_stats(userid_filter_stats_t *stats)
+{
+  if (!stats) {
+    return;
+  }
+  memset(stats, 0, sizeof(*stats));
+  stats->queries = atomic_load(&queries);
+  stats->rejected = atomic_load(&rejected);
+  int slot;
+  filter_t *f = acquire(&current, &slot);
+  if (f) {
+    stats->enabled = true;
+    stats->capacity = f->capacity;
+    stats->bytes = f->nblocks * BLOCK_WORDS * sizeof(uint64_t);
+    stats->hashes = f->hashes;
+    stats->inserted = atomic_load(&f->inserted);
+    stats->removed = atomic_load(&f->removed);
+    release(slot);
+  }
+}
@@ -0,0 +1,75 @@
+#ifndef USERID_FILTER_H
+#define USERID_FILTER_H
+
+/**
+ * @file userid_filter.h
+ * @brief Negative-lookup filter over the user IDs in the account backend.
+ *
+ * A blocked Bloom filter: each user ID sets a few bits within a single
+ * 64-byte block chosen by its hash, so a query touches one cache line. A
+ * "no" is definite, and handle_login() uses it to answer logins for
+ * unknown user IDs without a backend lookup; a "maybe" is wrong for about
+ * the target false-positive rate of absent IDs.
+ *
+ * Until the filter is first built with userid_filter_rebuild() it answers
+ * "maybe" for everything. A rebuild lists the user IDs of the installed
+ * backend (see db_backend.h) and fails if the backend cannot list them, as
+ * the default one, which falls back to db.h, cannot. Afterwards the filter follows the
+ * account store through a mutation hook, and the other backends in this
+ * tree call userid_filter_add() as they store accounts: added accounts are
+ * added as they are created, while removed ones (which a Bloom filter
+ * cannot forget) are only counted. Accounts that another process adds to a
+ * shared backend (shm_store.h, partition_client.h) are only seen after the
+ * next rebuild. When the insertions outgrow the filter or the removals
+ * leave too many stale bits, userid_filter_needs_rebuild() says so, and a
+ * rebuild can run while logins continue: readers keep using the old filter
+ * until the new one is complete and swapped in.
+ */
+
+#include "userid_key.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define USERID_FILTER_DEFAULT_FP_RATE 0.01
+
+typedef struct {
+  bool enabled;
+  size_t capacity;          // user IDs the filter was sized for
+  size_t bytes;             // memory used by the filter's bits
+  unsigned int hashes;      // bits set per user ID
+  size_t inserted;          // user IDs added since the last rebuild, including it
+  size_t removed;           // accounts removed since the last rebuild
+  uint64_t queries;         // userid_filter_may_contain() calls while enabled
+  uint64_t rejected;        // ... that answered "definitely not present"
+} userid_filter_stats_t;
+
+// (re)build the filter from the installed backend, sized for capacity user
+// IDs (0 = the backend's size plus room to grow) at the given
+// false-positive rate (0 = USERID_FILTER_DEFAULT_FP_RATE), and swap it in.
+// lookups carry on meanwhile. returns false (after logging) if out of
+// memory or if the backend's user IDs cannot all be listed, leaving the
+// previous filter in place.
+bool userid_filter_rebuild(size_t capacity, double fp_rate);
+
+// stop filtering and free the filter
+void userid_filter_disable(void);
+
+// false if no account with userid exists; true if one may (or if the
+// filter is not built)
+bool userid_filter_may_contain(const char *userid);
+
+// as userid_filter_may_contain(), for a userid already made into a key
+bool userid_filter_may_contain_key(const userid_key_t *key);
+
+// add userid to the filter (for an account a backend other than the store
+// has just gained)
+void userid_filter_add(const char *userid);
+
+// whether the filter has filled up or gone stale enough to be worth rebuilding
+bool userid_filter_needs_rebuild(void);
+
+void userid_filter_get_stats(userid_filter_stats_t *stats);
+
+#endif // USERID_FILTER_H
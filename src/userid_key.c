@@ -0,0 +1,57 @@
+#include "userid_key.h"
+
+#include <string.h>
+
+uint64_t userid_key_hash(const char *userid, size_t len)
+{
+  // MurmurHash64A
+  const uint64_t m = UINT64_C(0xc6a4a7935bd1e995);
+  const int r = 47;
+  uint64_t h = UINT64_C(0x9747b28c) ^ (len * m);
+  const unsigned char *data = (const unsigned char *) userid;
+  size_t blocks = len / 8;
+  for (size_t i = 0; i < blocks; i++) {
+    uint64_t k;
+    memcpy(&k, data + i * 8, sizeof(k));
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  const unsigned char *tail = data + blocks * 8;
+  switch (len & 7) {
+    case 7: h ^= (uint64_t) tail[6] << 48; // fall through
+    case 6: h ^= (uint64_t) tail[5] << 40; // fall through
+    case 5: h ^= (uint64_t) tail[4] << 32; // fall through
+    case 4: h ^= (uint64_t) tail[3] << 24; // fall through
+    case 3: h ^= (uint64_t) tail[2] << 16; // fall through
+    case 2: h ^= (uint64_t) tail[1] << 8;  // fall through
+    case 1: h ^= (uint64_t) tail[0];
+            h *= m;
+  }
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+bool userid_key_init(userid_key_t *key, const char *userid)
+{
+  bool valid = userid != NULL;
+  key->str = valid ? userid : "";
+  const char *end = memchr(key->str, '\0', USER_ID_LENGTH);
+  key->len = end ? (size_t) (end - key->str) : USER_ID_LENGTH;
+  valid = valid && end != NULL;
+  key->hash = userid_key_hash(key->str, key->len);
+  // Fibonacci hashing: the high bits of the product depend on every bit
+  // of the hash
+  key->fingerprint = (uint32_t) ((key->hash * UINT64_C(0x9e3779b97f4a7c15)) >> 32);
+  return valid;
+}
+
+bool userid_key_matches(const userid_key_t *key, const char *userid)
+{
+  // the terminator is compared too, so a longer userid doesn't match
+  return key->len < USER_ID_LENGTH && memcmp(userid, key->str, key->len + 1) == 0;
+}
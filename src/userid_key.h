@@ -0,0 +1,43 @@
+#ifndef USERID_KEY_H
+#define USERID_KEY_H
+
+/**
+ * @file userid_key.h
+ * @brief A userid measured and hashed once, for the login path.
+ *
+ * handle_login() makes a key from the userid it is given, and the userid
+ * filter, account cache, account store and database backend all take the
+ * key, so none of them scans or hashes the string again. Stored userids
+ * are compared against it with a single memcmp() of known length.
+ *
+ * The hash places userids in the store's and cache's shards and buckets;
+ * the fingerprint is a second 32 bits mixed from it, for structures (such
+ * as the userid filter) that need more independent bits than one hash.
+ */
+
+#include "account.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  const char *str;        // the userid, not copied: must outlive the key
+  size_t len;             // bytes before its terminator, at most USER_ID_LENGTH
+  uint64_t hash;          // userid_key_hash(str, len)
+  uint32_t fingerprint;
+} userid_key_t;
+
+// hash of the first len bytes of userid (MurmurHash64A)
+uint64_t userid_key_hash(const char *userid, size_t len);
+
+// make the key for userid. returns false if userid is NULL (making the key
+// for "") or not null-terminated within USER_ID_LENGTH bytes (len is then
+// USER_ID_LENGTH), as no account can have such a userid.
+bool userid_key_init(userid_key_t *key, const char *userid);
+
+// whether userid, in a buffer of at least USER_ID_LENGTH bytes (such as
+// an account's), is the key's userid
+bool userid_key_matches(const userid_key_t *key, const char *userid);
+
+#endif // USERID_KEY_H
@@ -0,0 +1,243 @@
+#define CITS3007_PERMISSIVE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "account.h"
+#include "account_cache.h"
+#include "account_store.h"
+#include "db_backend.h"
+#include "test_fixtures.h"
+
+#define ACCOUNTS 2000
+#define HOT 20
+#define THREADS 4
+
+static void lookup(int i, account_t *acc)
+{
+  char userid[32];
+  snprintf(userid, sizeof(userid), "user%d", i);
+  ck_assert(account_cache_lookup(userid, acc));
+  ck_assert_str_eq(acc->userid, userid);
+}
+
+static void configure(size_t max_bytes, unsigned int ttl_ms)
+{
+  account_cache_options_t opts = { .max_bytes = max_bytes, .ttl_ms = ttl_ms };
+  ck_assert(account_cache_configure(&opts));
+}
+
+static atomic_bool stop_threads;
+
+static void *lookup_loop(void *arg)
+{
+  unsigned int seed = (unsigned int) (size_t) arg;
+  while (!atomic_load(&stop_threads)) {
+    char userid[32];
+    seed = seed * 1103515245u + 12345u;
+    snprintf(userid, sizeof(userid), "user%u", (seed >> 16) % 200);
+    account_t acc;
+    if (account_cache_lookup(userid, &acc) && strcmp(acc.userid, userid) != 0) {
+      return arg;
+    }
+  }
+  return NULL;
+}
+
+// a backend holding one account of its own, outside the store
+static account_t held;
+
+static bool held_lookup(void *arg, const userid_key_t *key, account_t *acc)
+{
+  (void) arg;
+  if (strcmp(key->str, held.userid) != 0) {
+    return false;
+  }
+  *acc = held;
+  return true;
+}
+
+static void held_record_login(void *arg, const account_t *acc)
+{
+  (void) arg;
+  held.login_count = acc->login_count;
+  held.login_fail_count = acc->login_fail_count;
+  held.last_ip = acc->last_ip;
+}
+
+#suite account_cache_suite
+
+#tcase account_cache_test_case
+
+#test test_disabled_cache_passes_through
+  fixture_fill_store(10, NULL);
+  ck_assert(account_cache_configure(NULL));
+  account_cache_stats_t before, after;
+  account_cache_get_stats(&before);
+  account_t acc;
+  lookup(3, &acc);
+  lookup(3, &acc);
+  ck_assert(!account_cache_lookup("nobody", &acc));
+  account_cache_get_stats(&after);
+  ck_assert_uint_eq(after.hits, before.hits);
+  ck_assert_uint_eq(after.misses, before.misses);
+  ck_assert_uint_eq(after.entries, 0);
+  account_store_clear();
+
+#test test_hits_and_invalidation
+  fixture_fill_store(10, NULL);
+  configure(1 << 20, 0);
+  account_cache_stats_t before, after;
+  account_cache_get_stats(&before);
+  account_t acc;
+  lookup(1, &acc);
+  lookup(1, &acc);
+  lookup(1, &acc);
+  ck_assert(!account_cache_lookup("nobody", &acc));
+  account_cache_get_stats(&after);
+  ck_assert_uint_eq(after.hits - before.hits, 2);
+  ck_assert_uint_eq(after.misses - before.misses, 2);
+  ck_assert_uint_eq(after.entries, 1);
+
+  // a change through the store is seen at once
+  acc.login_count = 42;
+  ck_assert(account_store_update(&acc));
+  lookup(1, &acc);
+  ck_assert_uint_eq(acc.login_count, 42);
+
+  // as are changes made with the account.c setters
+  account_set_email(&acc, "new@example.com");
+  account_cache_get_stats(&before);
+  ck_assert_uint_eq(before.invalidations - after.invalidations, 2);
+  ck_assert(account_store_update(&acc));
+  lookup(1, &acc);
+  ck_assert_str_eq(acc.email, "new@example.com");
+  account_record_login_success(&acc, 0x7f000001);
+  account_set_unban_time(&acc, 10);
+  account_set_expiration_time(&acc, 10);
+  ck_assert(account_update_password(&acc, "newpw"));
+  account_cache_get_stats(&after);
+  ck_assert_uint_eq(after.invalidations - before.invalidations, 1);
+
+  ck_assert(account_store_remove("user1"));
+  ck_assert(!account_cache_lookup("user1", &acc));
+  account_cache_clear();
+  account_cache_get_stats(&after);
+  ck_assert_uint_eq(after.entries, 0);
+  ck_assert_uint_eq(after.bytes, 0);
+  ck_assert(account_cache_configure(NULL));
+  account_store_clear();
+
+#test test_recorded_logins_are_not_served_stale
+  fixture_fill_store(10, NULL);
+  configure(1 << 20, 0);
+  account_t acc;
+  lookup(4, &acc);
+  account_record_login_failure(&acc);
+  account_record_login_failure(&acc);
+  db_backend_record_login(&acc);
+  lookup(4, &acc);
+  ck_assert_uint_eq(acc.login_fail_count, 2);
+
+  // the cache sees no store change for other backends' accounts
+  held = fixture_account("user4", 4);
+  db_backend_t backend = { .lookup = held_lookup, .record_login = held_record_login };
+  db_backend_set(&backend);
+  account_cache_clear();
+  lookup(4, &acc);
+  account_record_login_success(&acc, 0x7f000001);
+  db_backend_record_login(&acc);
+  lookup(4, &acc);
+  ck_assert_uint_eq(acc.login_count, 1);
+  ck_assert_uint_eq(acc.login_fail_count, 0);
+  ck_assert_uint_eq(acc.last_ip, 0x7f000001);
+  db_backend_set(NULL);
+  ck_assert(account_cache_configure(NULL));
+  account_store_clear();
+
+#test test_entries_expire
+  fixture_fill_store(10, NULL);
+  configure(1 << 20, 30);
+  account_cache_stats_t before, after;
+  account_t acc;
+  lookup(2, &acc);
+  account_cache_get_stats(&before);
+  lookup(2, &acc);
+  struct timespec pause = { 0, 60 * 1000000 };
+  nanosleep(&pause, NULL);
+  lookup(2, &acc);
+  account_cache_get_stats(&after);
+  ck_assert_uint_eq(after.hits - before.hits, 1);
+  ck_assert_uint_eq(after.expired - before.expired, 1);
+  ck_assert_uint_eq(after.misses - before.misses, 1);
+  ck_assert(account_cache_configure(NULL));
+  account_store_clear();
+
+#test test_budget_and_scan_resistance
+  fixture_fill_store(ACCOUNTS, NULL);
+  // room for about 200 accounts
+  size_t budget = 200 * (sizeof(account_t) + 64);
+  configure(budget, 0);
+  account_t acc;
+  for (int round = 0; round < 5; round++) {
+    for (int i = 0; i < HOT; i++) {
+      lookup(i, &acc);
+    }
+  }
+  // a long scan of accounts seen only once
+  for (int i = HOT; i < ACCOUNTS; i++) {
+    lookup(i, &acc);
+    if (i % 50 == 0) {
+      for (int h = 0; h < HOT; h++) {
+        lookup(h, &acc);
+      }
+    }
+  }
+  account_cache_stats_t before, after;
+  account_cache_get_stats(&before);
+  ck_assert_uint_le(before.bytes, budget);
+  ck_assert_uint_gt(before.evictions, 0);
+  for (int i = 0; i < HOT; i++) {
+    lookup(i, &acc);
+  }
+  account_cache_get_stats(&after);
+  ck_assert_uint_ge(after.hits - before.hits, HOT * 9 / 10);
+  ck_assert(account_cache_configure(NULL));
+  account_store_clear();
+
+#test test_concurrent_lookups_and_updates
+  fixture_fill_store(200, NULL);
+  configure(100 * (sizeof(account_t) + 64), 0);
+  atomic_store(&stop_threads, false);
+  pthread_t threads[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, lookup_loop, (void *) (size_t) (i + 1)), 0);
+  }
+  for (int i = 0; i < 2000; i++) {
+    account_t acc;
+    char userid[32];
+    snprintf(userid, sizeof(userid), "user%d", i % 200);
+    ck_assert(account_store_lookup(userid, &acc));
+    acc.login_count = (unsigned int) i;
+    ck_assert(account_store_update(&acc));
+  }
+  atomic_store(&stop_threads, true);
+  for (int i = 0; i < THREADS; i++) {
+    void *result;
+    pthread_join(threads[i], &result);
+    ck_assert_ptr_null(result);
+  }
+  // every cached copy reflects the last update
+  for (int i = 0; i < 200; i++) {
+    account_t acc;
+    lookup(i, &acc);
+    ck_assert_uint_eq(acc.login_count, 1800 + (unsigned int) i);
+  }
+  ck_assert(account_cache_configure(NULL));
+  account_store_clear();
+
+// vim: syntax=c :
@@ -0,0 +1,294 @@
+#define CITS3007_PERMISSIVE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "account_checkpoint.h"
+#include "account_codec.h"
+#include "account_journal.h"
+#include "account_store.h"
+#include "crc32.h"
+#include "test_fixtures.h"
+
+#define CHECKPOINT_PATH "account_checkpoint_test.ckpt"
+#define JOURNAL_PATH "account_checkpoint_test.journal"
+#define ACCOUNTS 2000
+
+static void set_history(account_t *acc, int i)
+{
+  acc->login_count = (unsigned int) i;
+  acc->last_ip = (ip4_addr_t) (0x0a000000u + (unsigned int) i);
+}
+
+static bool set_login_count(account_t *acc, void *arg)
+{
+  acc->login_count = *(unsigned int *) arg;
+  return true;
+}
+
+typedef struct {
+  int seen;
+  unsigned long long login_total;
+  bool saw_user5;
+  bool saw_newcomer;
+} census_t;
+
+static bool count_account(const account_t *acc, void *arg)
+{
+  census_t *census = arg;
+  census->seen++;
+  census->login_total += acc->login_count;
+  census->saw_user5 |= strcmp(acc->userid, "user5") == 0;
+  census->saw_newcomer |= strcmp(acc->userid, "newcomer") == 0;
+  return true;
+}
+
+static unsigned long long expected_login_total(int n)
+{
+  return (unsigned long long) n * (unsigned long long) (n - 1) / 2;
+}
+
+static void flip_byte(const char *path, off_t offset)
+{
+  int fd = open(path, O_RDWR);
+  ck_assert_int_ne(fd, -1);
+  unsigned char byte;
+  ck_assert_int_eq(pread(fd, &byte, 1, offset), 1);
+  byte ^= 0x40;
+  ck_assert_int_eq(pwrite(fd, &byte, 1, offset), 1);
+  close(fd);
+}
+
+#define ROUNDS 20
+
+// bumps the login count of every other account, starting at *arg, ROUNDS times
+static void *bump_accounts(void *arg)
+{
+  int first = *(int *) arg;
+  for (unsigned int round = 1; round <= ROUNDS; round++) {
+    for (int i = first; i < ACCOUNTS; i += 2) {
+      char userid[32];
+      snprintf(userid, sizeof(userid), "user%d", i);
+      unsigned int count = round;
+      ck_assert(account_store_modify(userid, set_login_count, &count));
+    }
+  }
+  return NULL;
+}
+
+#suite account_checkpoint_suite
+
+#tcase account_checkpoint_test_case
+
+#test test_crc32_known_values
+  ck_assert_uint_eq(crc32_compute("", 0), 0);
+  ck_assert_uint_eq(crc32_compute("123456789", 9), 0xcbf43926u);
+  const char *text = "The quick brown fox jumps over the lazy dog";
+  ck_assert_uint_eq(crc32_compute(text, strlen(text)), 0x414fa339u);
+  ck_assert_uint_eq(crc32_update(crc32_compute(text, 10), text + 10, strlen(text) - 10),
+                    0x414fa339u);
+
+#test test_codec_round_trip
+  account_t *acc = account_create("alice", "hunter2", "alice@example.com", "1990-01-01");
+  memcpy(acc->birthdate, "1990-01-01", BIRTHDATE_LENGTH);
+  acc->account_id = -42;
+  acc->unban_time = -1;
+  acc->expiration_time = 4102444800;
+  acc->login_count = 4294967295u;
+  acc->last_ip = 0xc0a80001u;
+  unsigned char encoded[ACCOUNT_CODEC_MAX_SIZE];
+  size_t len = account_codec_encode(acc, encoded);
+  ck_assert_uint_lt(len, sizeof(encoded));
+  account_t decoded;
+  ck_assert_uint_eq(account_codec_decode(encoded, len, &decoded), len);
+  ck_assert_int_eq(memcmp(&decoded, acc, sizeof(decoded)), 0);
+  for (size_t cut = 0; cut < len; cut++) {
+    ck_assert_uint_eq(account_codec_decode(encoded, cut, &decoded), 0);
+  }
+  account_free(acc);
+
+#test test_snapshot_isolated_from_later_changes
+  fixture_fill_store(100, set_history);
+  uint64_t sequence;
+  ck_assert(account_store_snapshot_begin(&sequence));
+  ck_assert_uint_eq(sequence, account_store_sequence());
+  ck_assert(!account_store_snapshot_begin(NULL));
+
+  unsigned int count = 1000000;
+  ck_assert(account_store_modify("user7", set_login_count, &count));
+  account_t acc;
+  ck_assert(account_store_lookup("user8", &acc));
+  acc.login_count = 2000000;
+  ck_assert(account_store_update(&acc));
+  ck_assert(account_store_update(&acc));
+  ck_assert(account_store_remove("user5"));
+  ck_assert(account_store_insert(account_create("newcomer", "pw", "n@example.com",
+                                                "2000-01-01")));
+  ck_assert_uint_gt(account_store_sequence(), sequence);
+
+  census_t census = { 0 };
+  ck_assert(account_store_snapshot_foreach(count_account, &census));
+  ck_assert_int_eq(census.seen, 100);
+  ck_assert_uint_eq(census.login_total, expected_login_total(100));
+  ck_assert(census.saw_user5);
+  ck_assert(!census.saw_newcomer);
+  ck_assert(account_store_snapshot_end());
+  ck_assert(!account_store_snapshot_foreach(count_account, &census));
+  ck_assert(!account_store_snapshot_end());
+
+  // the live store has the changes
+  ck_assert(account_store_lookup("user7", &acc));
+  ck_assert_uint_eq(acc.login_count, 1000000);
+  ck_assert(!account_store_contains("user5"));
+  ck_assert(account_store_contains("newcomer"));
+  account_store_clear();
+
+#test test_checkpoint_round_trip
+  fixture_fill_store(ACCOUNTS, set_history);
+  uint64_t written;
+  ck_assert(account_checkpoint_write(CHECKPOINT_PATH, &written));
+  ck_assert_uint_eq(written, account_store_sequence());
+  ck_assert(access(CHECKPOINT_PATH ".tmp", F_OK) != 0);
+
+  account_t before;
+  ck_assert(account_store_lookup("user1234", &before));
+  ck_assert(!account_checkpoint_load(CHECKPOINT_PATH, 1, NULL));   // store not empty
+  account_store_clear();
+
+  for (unsigned int threads = 1; threads <= 4; threads += 3) {
+    uint64_t loaded;
+    ck_assert(account_checkpoint_load(CHECKPOINT_PATH, threads, &loaded));
+    ck_assert_uint_eq(loaded, written);
+    ck_assert_uint_ge(account_store_sequence(), written);
+    ck_assert_uint_eq(account_store_count(), ACCOUNTS);
+    account_t after;
+    ck_assert(account_store_lookup("user1234", &after));
+    ck_assert_int_eq(memcmp(&before, &after, sizeof(before)), 0);
+    ck_assert(account_validate_password(&after, FIXTURE_PASSWORD));
+    account_store_clear();
+  }
+
+  // an empty store makes a valid, empty checkpoint
+  ck_assert(account_checkpoint_write(CHECKPOINT_PATH, NULL));
+  ck_assert(account_checkpoint_load(CHECKPOINT_PATH, 0, NULL));
+  ck_assert_uint_eq(account_store_count(), 0);
+  unlink(CHECKPOINT_PATH);
+
+#test test_checkpoint_corruption_detected
+  fixture_fill_store(ACCOUNTS, set_history);
+  ck_assert(account_checkpoint_write(CHECKPOINT_PATH, NULL));
+  account_store_clear();
+  off_t offsets[] = { 2, 12, 32 + 12 + 50, 40000 };
+  for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+    flip_byte(CHECKPOINT_PATH, offsets[i]);
+    ck_assert(!account_checkpoint_load(CHECKPOINT_PATH, 2, NULL));
+    ck_assert_uint_eq(account_store_count(), 0);
+    flip_byte(CHECKPOINT_PATH, offsets[i]);
+  }
+  ck_assert(account_checkpoint_load(CHECKPOINT_PATH, 2, NULL));
+  ck_assert_uint_eq(account_store_count(), ACCOUNTS);
+  account_store_clear();
+
+  ck_assert_int_eq(truncate(CHECKPOINT_PATH, 40000), 0);
+  ck_assert(!account_checkpoint_load(CHECKPOINT_PATH, 2, NULL));
+  ck_assert_uint_eq(account_store_count(), 0);
+  unlink(CHECKPOINT_PATH);
+  ck_assert(!account_checkpoint_load(CHECKPOINT_PATH, 2, NULL));
+
+#test test_checkpoint_and_journal_restart
+  unlink(JOURNAL_PATH);
+  fixture_fill_store(ACCOUNTS, set_history);
+  ck_assert(account_journal_open(JOURNAL_PATH));
+  ck_assert(!account_journal_open(JOURNAL_PATH));
+  unsigned int count = 77;
+  ck_assert(account_store_modify("user1", set_login_count, &count));
+  uint64_t checkpoint_sequence;
+  ck_assert(account_checkpoint_write(CHECKPOINT_PATH, &checkpoint_sequence));
+
+  // changes after the checkpoint live only in the journal
+  count = 99;
+  ck_assert(account_store_modify("user2", set_login_count, &count));
+  ck_assert(account_store_remove("user3"));
+  ck_assert(account_store_insert(account_create("newcomer", "pw", "n@example.com",
+                                                "2000-01-01")));
+  ck_assert(account_journal_compact(checkpoint_sequence));
+  count = 100;
+  ck_assert(account_store_modify("user2", set_login_count, &count));
+  ck_assert(account_journal_close());
+  uint64_t final_sequence = account_store_sequence();
+
+  // restart: load the checkpoint, then replay the journal past it
+  account_store_clear();
+  uint64_t loaded;
+  ck_assert(account_checkpoint_load(CHECKPOINT_PATH, 0, &loaded));
+  ck_assert_uint_eq(loaded, checkpoint_sequence);
+  ck_assert(account_store_contains("user3"));
+  uint64_t applied;
+  ck_assert(account_journal_replay(JOURNAL_PATH, loaded, &applied));
+  ck_assert_uint_eq(applied, 4);
+  ck_assert_uint_ge(account_store_sequence(), final_sequence);
+
+  account_t acc;
+  ck_assert(account_store_lookup("user1", &acc));
+  ck_assert_uint_eq(acc.login_count, 77);
+  ck_assert(account_store_lookup("user2", &acc));
+  ck_assert_uint_eq(acc.login_count, 100);
+  ck_assert(!account_store_contains("user3"));
+  ck_assert(account_store_lookup("newcomer", &acc));
+  ck_assert(account_validate_password(&acc, FIXTURE_PASSWORD));
+  ck_assert_uint_eq(account_store_count(), ACCOUNTS);
+
+  // a torn record at the end is ignored by replay and dropped by open
+  int fd = open(JOURNAL_PATH, O_WRONLY | O_APPEND);
+  ck_assert_int_ne(fd, -1);
+  ck_assert_int_eq(write(fd, "\x40\x00\x00\x00torn", 8), 8);
+  close(fd);
+  account_store_clear();
+  ck_assert(account_checkpoint_load(CHECKPOINT_PATH, 0, NULL));
+  ck_assert(account_journal_replay(JOURNAL_PATH, loaded, &applied));
+  ck_assert_uint_eq(applied, 4);
+  ck_assert(account_journal_open(JOURNAL_PATH));
+  ck_assert(account_journal_close());
+  ck_assert(account_journal_replay(JOURNAL_PATH, loaded, &applied));
+  ck_assert_uint_eq(applied, 4);
+  account_store_clear();
+  unlink(CHECKPOINT_PATH);
+  unlink(JOURNAL_PATH);
+
+#test test_journal_keeps_up_with_concurrent_changes
+  unlink(JOURNAL_PATH);
+  fixture_fill_store(ACCOUNTS, NULL);
+  ck_assert(account_journal_open(JOURNAL_PATH));
+  uint64_t start = account_store_sequence();
+  // syncs and compactions run while the changes are recorded
+  pthread_t threads[2];
+  int firsts[2] = { 0, 1 };
+  for (int t = 0; t < 2; t++) {
+    ck_assert_int_eq(pthread_create(&threads[t], NULL, bump_accounts, &firsts[t]), 0);
+  }
+  for (int i = 0; i < 10; i++) {
+    ck_assert(account_journal_sync());
+    ck_assert(account_journal_compact(start));
+  }
+  for (int t = 0; t < 2; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  ck_assert(account_journal_close());
+
+  account_store_clear();
+  uint64_t applied;
+  ck_assert(account_journal_replay(JOURNAL_PATH, start, &applied));
+  ck_assert_uint_eq(applied, (uint64_t) ACCOUNTS * ROUNDS);
+  census_t census = { 0 };
+  ck_assert(account_store_foreach(count_account, &census));
+  ck_assert_int_eq(census.seen, ACCOUNTS);
+  ck_assert_uint_eq(census.login_total, (unsigned long long) ACCOUNTS * ROUNDS);
+  account_store_clear();
+  unlink(JOURNAL_PATH);
+
+// vim: syntax=c :
@@ -0,0 +1,218 @@
+#define CITS3007_PERMISSIVE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "account_dataset.h"
+#include "db_backend.h"
+#include "login.h"
+#include "test_fixtures.h"
+
+#define CLIENT_IP 0x0a000001
+#define MANY_ACCOUNTS 5000
+#define READERS 4
+#define RELOADS 20
+#define RELOAD_ACCOUNTS 500
+
+static atomic_bool stop_readers;
+static atomic_int misses;
+
+static void *lookup_loop(void *arg)
+{
+  (void) arg;
+  char userid[32];
+  account_t acc;
+  for (unsigned int i = 0; !atomic_load(&stop_readers); i++) {
+    snprintf(userid, sizeof(userid), "reload%u", i % RELOAD_ACCOUNTS);
+    if (!account_dataset_lookup(userid, &acc) || strcmp(acc.userid, userid) != 0) {
+      atomic_fetch_add(&misses, 1);
+    }
+  }
+  return NULL;
+}
+
+#suite account_dataset_suite
+
+#tcase account_dataset_test_case
+
+#test test_update_lookup_remove
+  char userid[32];
+  for (int i = 0; i < MANY_ACCOUNTS; i++) {
+    snprintf(userid, sizeof(userid), "user%d", i);
+    account_t acc = fixture_account(userid, i);
+    ck_assert(account_dataset_update(&acc));
+  }
+  ck_assert_uint_eq(account_dataset_count(), MANY_ACCOUNTS);
+
+  account_t acc;
+  ck_assert(account_dataset_lookup("user1234", &acc));
+  ck_assert_int_eq(acc.account_id, 1234);
+  acc.login_count = 77;
+  acc.unban_time = 5;
+  ck_assert(account_dataset_update(&acc));
+  ck_assert_uint_eq(account_dataset_count(), MANY_ACCOUNTS);
+
+  // recording a login keeps the counters, not the rest of the account
+  acc.login_count = 78;
+  acc.unban_time = 0;
+  acc.last_ip = CLIENT_IP;
+  account_dataset_record_login(&acc);
+  ck_assert(account_dataset_lookup("user1234", &acc));
+  ck_assert_uint_eq(acc.login_count, 78);
+  ck_assert_uint_eq(acc.last_ip, CLIENT_IP);
+  ck_assert_int_eq(acc.unban_time, 5);
+
+  for (int i = 0; i < MANY_ACCOUNTS; i += 2) {
+    snprintf(userid, sizeof(userid), "user%d", i);
+    ck_assert(account_dataset_remove(userid));
+  }
+  ck_assert(!account_dataset_remove("user0"));
+  ck_assert(!account_dataset_lookup("user0", &acc));
+  ck_assert_uint_eq(account_dataset_count(), MANY_ACCOUNTS / 2);
+  for (int i = 1; i < MANY_ACCOUNTS; i += 2) {
+    snprintf(userid, sizeof(userid), "user%d", i);
+    ck_assert(account_dataset_lookup(userid, &acc));
+    ck_assert_int_eq(acc.account_id, i);
+  }
+
+  // with no lookups in progress, everything retired can be freed
+  account_dataset_reclaim();
+  account_dataset_stats_t stats;
+  account_dataset_get_stats(&stats);
+  ck_assert_uint_gt(stats.retired, MANY_ACCOUNTS / 2);
+  ck_assert_uint_eq(stats.reclaimed, stats.retired);
+
+#test test_reload_carries_changes
+  account_t alice = fixture_account("alice", 1);
+  account_t bob = fixture_account("bob", 2);
+  ck_assert(account_dataset_update(&alice));
+  ck_assert(account_dataset_update(&bob));
+  account_dataset_stats_t before;
+  account_dataset_get_stats(&before);
+
+  // the new dataset bans alice and adds carol
+  account_dataset_build_t *build = account_dataset_build_begin(3);
+  ck_assert_ptr_nonnull(build);
+  ck_assert_ptr_null(account_dataset_build_begin(0));
+  account_t banned = alice;
+  banned.unban_time = time(NULL) + 3600;
+  account_t carol = fixture_account("carol", 3);
+  ck_assert(account_dataset_build_add(build, &banned));
+  ck_assert(account_dataset_build_add(build, &bob));
+  ck_assert(account_dataset_build_add(build, &carol));
+
+  // meanwhile, the live dataset changes
+  alice.login_count = 5;
+  alice.last_login_time = time(NULL);
+  account_dataset_record_login(&alice);
+  ck_assert(account_dataset_remove("bob"));
+  account_t dave = fixture_account("dave", 4);
+  ck_assert(account_dataset_update(&dave));
+  account_t acc;
+  ck_assert(!account_dataset_lookup("carol", &acc));
+
+  ck_assert(account_dataset_build_commit(build));
+  ck_assert(account_dataset_lookup("alice", &acc));
+  ck_assert_int_eq(acc.unban_time, banned.unban_time);
+  ck_assert_uint_eq(acc.login_count, 5);
+  ck_assert_int_eq(acc.last_login_time, alice.last_login_time);
+  ck_assert(!account_dataset_lookup("bob", &acc));
+  ck_assert(account_dataset_lookup("carol", &acc));
+  ck_assert(account_dataset_lookup("dave", &acc));
+  ck_assert_uint_eq(account_dataset_count(), 3);
+
+  account_dataset_stats_t after;
+  account_dataset_get_stats(&after);
+  ck_assert_uint_eq(after.version, before.version + 1);
+  ck_assert_uint_eq(after.reloads, before.reloads + 1);
+  ck_assert_uint_eq(after.carried, before.carried + 3);
+
+  // an aborted build changes nothing
+  build = account_dataset_build_begin(0);
+  ck_assert_ptr_nonnull(build);
+  account_dataset_build_abort(build);
+  ck_assert(account_dataset_lookup("dave", &acc));
+  account_dataset_get_stats(&before);
+  ck_assert_uint_eq(before.version, after.version);
+
+#test test_lookups_during_reloads
+  char userid[32];
+  for (int i = 0; i < RELOAD_ACCOUNTS; i++) {
+    snprintf(userid, sizeof(userid), "reload%d", i);
+    account_t acc = fixture_account(userid, i);
+    ck_assert(account_dataset_update(&acc));
+  }
+  atomic_store(&stop_readers, false);
+  atomic_store(&misses, 0);
+  pthread_t threads[READERS];
+  for (int i = 0; i < READERS; i++) {
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, lookup_loop, NULL), 0);
+  }
+
+  for (int r = 0; r < RELOADS; r++) {
+    account_dataset_build_t *build = account_dataset_build_begin(RELOAD_ACCOUNTS);
+    ck_assert_ptr_nonnull(build);
+    for (int i = 0; i < RELOAD_ACCOUNTS; i++) {
+      snprintf(userid, sizeof(userid), "reload%d", i);
+      account_t acc = fixture_account(userid, i);
+      acc.login_fail_count = (unsigned int) r;
+      ck_assert(account_dataset_build_add(build, &acc));
+      if (i % 50 == 0) {
+        // a login recorded against the old dataset as the new one fills
+        acc.login_count = (unsigned int) r + 1;
+        account_dataset_record_login(&acc);
+      }
+    }
+    ck_assert(account_dataset_build_commit(build));
+  }
+  atomic_store(&stop_readers, true);
+  for (int i = 0; i < READERS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  ck_assert_int_eq(atomic_load(&misses), 0);
+
+  account_t acc;
+  ck_assert(account_dataset_lookup("reload100", &acc));
+  ck_assert_uint_eq(acc.login_count, RELOADS);
+  ck_assert(account_dataset_lookup("reload101", &acc));
+  ck_assert_uint_eq(acc.login_count, 0);
+
+  account_dataset_reclaim();
+  account_dataset_stats_t stats;
+  account_dataset_get_stats(&stats);
+  ck_assert_uint_eq(stats.reclaimed, stats.retired);
+  ck_assert_uint_ge(stats.readers, READERS);
+
+#test test_backend
+  account_t *erin = account_create("erin", "pw", "erin@example.com", "2000-01-01");
+  ck_assert_ptr_nonnull(erin);
+  ck_assert(account_dataset_update(erin));
+  account_free(erin);
+
+  db_backend_t backend;
+  account_dataset_backend(&backend);
+  db_backend_set(&backend);
+  int fd = open("/dev/null", O_WRONLY);
+  login_session_data_t session;
+  ck_assert_int_eq(handle_login("erin", "wrong", CLIENT_IP, time(NULL), fd, &session),
+                   LOGIN_FAIL_BAD_PASSWORD);
+  account_t acc;
+  ck_assert(account_dataset_lookup("erin", &acc));
+  ck_assert_uint_eq(acc.login_fail_count, 1);
+  ck_assert_int_eq(handle_login("erin", "pw", CLIENT_IP, time(NULL), fd, &session),
+                   LOGIN_SUCCESS);
+  ck_assert(account_dataset_lookup("erin", &acc));
+  ck_assert_uint_eq(acc.login_fail_count, 0);
+  ck_assert_uint_eq(acc.login_count, 1);
+  ck_assert_uint_eq(acc.last_ip, CLIENT_IP);
+  ck_assert_int_eq(handle_login("nobody", "pw", CLIENT_IP, time(NULL), fd, &session),
+                   LOGIN_FAIL_USER_NOT_FOUND);
+  db_backend_set(NULL);
+  close(fd);
@@ -0,0 +1,199 @@
+#define CITS3007_PERMISSIVE
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "account_export.h"
+#include "account_store.h"
+
+#define EXPORT_PATH "account_export_test.out"
+#define EXPECTED_PATH "account_export_test.expected"
+#define MANY 3000
+
+static void make_account(account_t *acc, const char *userid, const char *email,
+                         time_t last_login, ip4_addr_t ip)
+{
+  memset(acc, 0, sizeof(*acc));
+  strcpy(acc->userid, userid);
+  strcpy(acc->email, email);
+  memcpy(acc->birthdate, "2001-02-03", BIRTHDATE_LENGTH);
+  acc->last_login_time = last_login;
+  acc->last_ip = ip;
+}
+
+static char *read_file(const char *path)
+{
+  static char contents[4 * 1024 * 1024];
+  int fd = open(path, O_RDONLY);
+  ck_assert_int_ne(fd, -1);
+  size_t len = 0;
+  ssize_t n;
+  while ((n = read(fd, contents + len, sizeof(contents) - 1 - len)) > 0) {
+    len += (size_t) n;
+  }
+  close(fd);
+  contents[len] = '\0';
+  return contents;
+}
+
+static int open_output(const char *path)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  ck_assert_int_ne(fd, -1);
+  return fd;
+}
+
+static bool even_ids(const account_t *acc, void *arg)
+{
+  (void) arg;
+  return acc->account_id % 2 == 0;
+}
+
+#suite account_export_suite
+
+#tcase account_export_test_case
+
+#test test_summary_matches_print_summary
+  // US Eastern, with DST, without needing zoneinfo files
+  setenv("TZ", "EST5EDT,M3.2.0,M11.1.0", 1);
+  tzset();
+  time_t times[] = {
+    0, 1, 86399, 1700000000, 1615705199, 1615705200, 1636264799, 1636264800,
+    -1, -86401, 951782400, 4102444800, (time_t) 253402300799LL, (time_t) 253402300800LL
+  };
+  size_t n = sizeof(times) / sizeof(times[0]);
+  account_t accounts[32];
+  int expected_fd = open_output(EXPECTED_PATH);
+  for (size_t i = 0; i < n; i++) {
+    char userid[32];
+    snprintf(userid, sizeof(userid), "user%zu", i);
+    make_account(&accounts[i], userid, "someone@example.com", times[i],
+                 (ip4_addr_t) (0x01020304u * (uint32_t) i + 0xff));
+    accounts[i].login_count = (unsigned int) i * 1000;
+    accounts[i].login_fail_count = 4294967295u - (unsigned int) i;
+    ck_assert(account_print_summary(&accounts[i], expected_fd));
+  }
+  close(expected_fd);
+
+  int fd = open_output(EXPORT_PATH);
+  uint64_t exported;
+  ck_assert(account_export_array(accounts, n, fd, NULL, &exported));
+  close(fd);
+  ck_assert_uint_eq(exported, n);
+  char *expected = strdup(read_file(EXPECTED_PATH));
+  ck_assert_str_eq(read_file(EXPORT_PATH), expected);
+  free(expected);
+  unlink(EXPECTED_PATH);
+  unlink(EXPORT_PATH);
+  unsetenv("TZ");
+  tzset();
+
+#test test_csv_and_json_escape_fields
+  setenv("TZ", "UTC0", 1);
+  tzset();
+  account_t accounts[2];
+  make_account(&accounts[0], "plain", "plain@example.com", 86400, 0x0100007f);
+  make_account(&accounts[1], "has,comma \"and\" quote", "a\"b@example.com", 0, 0);
+  accounts[1].userid[3] = '\\';
+  accounts[0].account_id = 7;
+  accounts[1].account_id = -2;
+
+  account_export_options_t opts = { .format = ACCOUNT_EXPORT_CSV };
+  int fd = open_output(EXPORT_PATH);
+  ck_assert(account_export_array(accounts, 2, fd, &opts, NULL));
+  close(fd);
+  ck_assert_str_eq(read_file(EXPORT_PATH),
+    "userid,email,birthdate,account_id,login_count,login_fail_count,last_login_time,last_ip\n"
+    "plain,plain@example.com,2001-02-03,7,0,0,1970-01-02 00:00:00,127.0.0.1\n"
+    "\"has\\comma \"\"and\"\" quote\",\"a\"\"b@example.com\",2001-02-03,-2,0,0,"
+    "1970-01-01 00:00:00,0.0.0.0\n");
+
+  opts.format = ACCOUNT_EXPORT_JSON;
+  fd = open_output(EXPORT_PATH);
+  ck_assert(account_export_array(accounts, 2, fd, &opts, NULL));
+  close(fd);
+  ck_assert_str_eq(read_file(EXPORT_PATH),
+    "[\n"
+    "  {\"userid\": \"plain\", \"email\": \"plain@example.com\", \"birthdate\": \"2001-02-03\", "
+    "\"account_id\": 7, \"login_count\": 0, \"login_fail_count\": 0, "
+    "\"last_login_time\": \"1970-01-02 00:00:00\", \"last_ip\": \"127.0.0.1\"},\n"
+    "  {\"userid\": \"has\\\\comma \\\"and\\\" quote\", \"email\": \"a\\\"b@example.com\", "
+    "\"birthdate\": \"2001-02-03\", \"account_id\": -2, \"login_count\": 0, "
+    "\"login_fail_count\": 0, \"last_login_time\": \"1970-01-01 00:00:00\", "
+    "\"last_ip\": \"0.0.0.0\"}\n"
+    "]\n");
+
+  fd = open_output(EXPORT_PATH);
+  ck_assert(account_export_array(accounts, 0, fd, &opts, NULL));
+  close(fd);
+  ck_assert_str_eq(read_file(EXPORT_PATH), "[]\n");
+  unlink(EXPORT_PATH);
+  unsetenv("TZ");
+  tzset();
+
+#test test_parallel_output_matches_sequential
+  static account_t accounts[MANY];
+  for (int i = 0; i < MANY; i++) {
+    char userid[32];
+    snprintf(userid, sizeof(userid), "user%d", i);
+    make_account(&accounts[i], userid, "u@example.com", (time_t) i * 86317, (ip4_addr_t) i);
+    accounts[i].account_id = i;
+  }
+  for (int format = ACCOUNT_EXPORT_SUMMARY; format <= ACCOUNT_EXPORT_JSON; format++) {
+    account_export_options_t opts = { .format = (account_export_format_t) format,
+                                      .filter = even_ids };
+    int fd = open_output(EXPECTED_PATH);
+    uint64_t exported;
+    ck_assert(account_export_array(accounts, MANY, fd, &opts, &exported));
+    close(fd);
+    ck_assert_uint_eq(exported, MANY / 2);
+
+    opts.threads = 4;
+    fd = open_output(EXPORT_PATH);
+    ck_assert(account_export_array(accounts, MANY, fd, &opts, &exported));
+    close(fd);
+    ck_assert_uint_eq(exported, MANY / 2);
+    char *expected = strdup(read_file(EXPECTED_PATH));
+    ck_assert_str_eq(read_file(EXPORT_PATH), expected);
+    free(expected);
+  }
+  unlink(EXPECTED_PATH);
+  unlink(EXPORT_PATH);
+
+#test test_store_export
+  account_store_clear();
+  for (int i = 0; i < 100; i++) {
+    account_t *acc = account_create("placeholder", "pw", "u@example.com", "2000-01-01");
+    snprintf(acc->userid, sizeof(acc->userid), "user%d", i);
+    snprintf(acc->email, sizeof(acc->email), "user%d@example.com", i);
+    ck_assert(account_store_insert(acc));
+  }
+  account_export_options_t opts = { .format = ACCOUNT_EXPORT_CSV, .threads = 2 };
+  int fd = open_output(EXPORT_PATH);
+  uint64_t exported;
+  ck_assert(account_export_store(fd, &opts, &exported));
+  close(fd);
+  ck_assert_uint_eq(exported, 100);
+  size_t lines = 0;
+  for (const char *p = read_file(EXPORT_PATH); *p; p++) {
+    lines += *p == '\n';
+  }
+  ck_assert_uint_eq(lines, 101);
+  ck_assert(strstr(read_file(EXPORT_PATH), "\nuser42,") != NULL);
+  ck_assert(strstr(read_file(EXPORT_PATH), "$w1$") == NULL);
+
+  opts.filter = even_ids;
+  fd = open_output(EXPORT_PATH);
+  ck_assert(account_export_store(fd, &opts, &exported));
+  close(fd);
+  ck_assert_uint_eq(exported, 50);
+  unlink(EXPORT_PATH);
+  account_store_clear();
+
+// vim: syntax=c :
@@ -0,0 +1,157 @@
+#define CITS3007_PERMISSIVE
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "account_packed.h"
+#include "db_backend.h"
+#include "login.h"
+#include "userid_filter.h"
+#include "test_fixtures.h"
+
+#define CLIENT_IP 0x0a000001
+#define MANY_ACCOUNTS 5000
+
+static void assert_round_trip(account_packed_t *table, const account_t *acc)
+{
+  account_t decoded;
+  ck_assert(account_packed_put(table, acc));
+  ck_assert(account_packed_get(table, acc->userid, &decoded));
+  ck_assert_mem_eq(&decoded, acc, sizeof(decoded));
+}
+
+static bool count_visit(const account_t *acc, void *arg)
+{
+  (void) acc;
+  (*(size_t *) arg)++;
+  return true;
+}
+
+#suite account_packed_suite
+
+#tcase account_packed_test_case
+
+#test test_round_trip
+  account_packed_t *table = account_packed_create(NULL);
+  ck_assert_ptr_nonnull(table);
+
+  account_t acc = fixture_account("alice", 42);
+  snprintf(acc.password_hash, sizeof(acc.password_hash), "%s",
+           "$p2$120000$00112233445566778899aabbccddeeff:"
+           "ffeeddccbbaa99887766554433221100");
+  acc.login_count = 3;
+  acc.last_login_time = time(NULL) - 60;
+  acc.last_ip = CLIENT_IP;
+  assert_round_trip(table, &acc);
+
+  // every optional field empty, and fields that cannot be packed
+  account_t odd;
+  memset(&odd, 0, sizeof(odd));
+  strcpy(odd.userid, "odd");
+  strcpy(odd.email, "no-at-sign");
+  strcpy(odd.password_hash, "00112233445566778899AABBCCDDEEFF:ffeeddccbbaa99887766554433221100");
+  memcpy(odd.birthdate, "0000-00-00", BIRTHDATE_LENGTH);
+  odd.account_id = -7;
+  assert_round_trip(table, &odd);
+
+  // a legacy hash, full-length strings, times on both sides of the epoch
+  account_t full = acc;
+  memset(full.userid, 'u', USER_ID_LENGTH - 1);
+  memset(full.email, 'e', EMAIL_LENGTH);
+  full.email[40] = '@';
+  full.email[70] = '@';
+  memset(full.password_hash, 0, sizeof(full.password_hash));
+  strcpy(full.password_hash, "00112233445566778899aabbccddeeff:ffeeddccbbaa99887766554433221100");
+  memcpy(full.birthdate, "2004-12-31", BIRTHDATE_LENGTH);
+  full.unban_time = 1;
+  full.expiration_time = time(NULL) + 86400 * 365;
+  full.login_fail_count = 4000000000u;
+  full.login_count = 0;
+  assert_round_trip(table, &full);
+
+  account_packed_stats_t stats;
+  account_packed_get_stats(table, &stats);
+  ck_assert_uint_eq(stats.count, 3);
+  ck_assert_uint_eq(stats.verbatim_hashes, 1);
+  // example.com and the tail of full's email
+  ck_assert_uint_eq(stats.domains, 2);
+  account_packed_destroy(table);
+
+#test test_put_replace_remove
+  account_packed_options_t opts = { .capacity = 10 };
+  account_packed_t *table = account_packed_create(&opts);
+  char userid[32];
+  for (int i = 0; i < MANY_ACCOUNTS; i++) {
+    snprintf(userid, sizeof(userid), "user%d", i);
+    account_t acc = fixture_account(userid, i);
+    ck_assert(account_packed_put(table, &acc));
+  }
+  ck_assert_uint_eq(account_packed_count(table), MANY_ACCOUNTS);
+
+  account_t acc;
+  ck_assert(account_packed_get(table, "user1234", &acc));
+  ck_assert_int_eq(acc.account_id, 1234);
+  acc.login_count = 77;
+  ck_assert(account_packed_put(table, &acc));
+  ck_assert_uint_eq(account_packed_count(table), MANY_ACCOUNTS);
+  ck_assert(account_packed_get(table, "user1234", &acc));
+  ck_assert_uint_eq(acc.login_count, 77);
+
+  for (int i = 0; i < MANY_ACCOUNTS; i += 2) {
+    snprintf(userid, sizeof(userid), "user%d", i);
+    ck_assert(account_packed_remove(table, userid));
+  }
+  ck_assert(!account_packed_remove(table, "user0"));
+  ck_assert(!account_packed_get(table, "user0", &acc));
+  for (int i = 1; i < MANY_ACCOUNTS; i += 2) {
+    snprintf(userid, sizeof(userid), "user%d", i);
+    ck_assert(account_packed_get(table, userid, &acc));
+    ck_assert_int_eq(acc.account_id, i);
+  }
+  size_t visited = 0;
+  ck_assert(account_packed_foreach(table, count_visit, &visited));
+  ck_assert_uint_eq(visited, MANY_ACCOUNTS / 2);
+
+  // several times smaller than the account_t structures themselves
+  account_packed_stats_t stats;
+  account_packed_get_stats(table, &stats);
+  size_t total = stats.record_bytes + stats.index_bytes + stats.dictionary_bytes;
+  ck_assert_uint_lt(total * 3, stats.count * sizeof(account_t));
+  account_packed_destroy(table);
+
+#test test_backend
+  account_packed_t *table = account_packed_create(NULL);
+  account_t *carol = account_create("carol", "pw", "carol@example.com", "2000-01-01");
+  ck_assert_ptr_nonnull(carol);
+  ck_assert(account_packed_put(table, carol));
+  account_free(carol);
+
+  db_backend_t backend;
+  account_packed_backend(table, &backend);
+  db_backend_set(&backend);
+  ck_assert(userid_filter_rebuild(0, 0));
+  ck_assert(userid_filter_may_contain("carol"));
+  int fd = open("/dev/null", O_WRONLY);
+  login_session_data_t session;
+  ck_assert_int_eq(handle_login("carol", "wrong", CLIENT_IP, time(NULL), fd, &session),
+                   LOGIN_FAIL_BAD_PASSWORD);
+  account_t acc;
+  ck_assert(account_packed_get(table, "carol", &acc));
+  ck_assert_uint_eq(acc.login_fail_count, 1);
+  ck_assert_int_eq(handle_login("carol", "pw", CLIENT_IP, time(NULL), fd, &session),
+                   LOGIN_SUCCESS);
+  ck_assert(account_packed_get(table, "carol", &acc));
+  ck_assert_uint_eq(acc.login_fail_count, 0);
+  ck_assert_uint_eq(acc.login_count, 1);
+  ck_assert_uint_eq(acc.last_ip, CLIENT_IP);
+  ck_assert_int_eq(handle_login("nobody", "pw", CLIENT_IP, time(NULL), fd, &session),
+                   LOGIN_FAIL_USER_NOT_FOUND);
+  userid_filter_disable();
+  db_backend_set(NULL);
+  close(fd);
+  account_packed_destroy(table);
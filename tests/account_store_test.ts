@@ -0,0 +1,262 @@
+#define CITS3007_PERMISSIVE
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "account_import.h"
+#include "account_store.h"
+#include "db_backend.h"
+#include "thread_pool.h"
+#include "userid_key.h"
+
+#define IMPORT_PATH "account_import_test.csv"
+#define REJECT_PATH "account_import_rejects.txt"
+
+static void write_file(const char *path, const char *contents)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  ck_assert_int_ne(fd, -1);
+  ck_assert_int_eq(write(fd, contents, strlen(contents)), (ssize_t) strlen(contents));
+  close(fd);
+}
+
+static bool count_visit(const account_t *acc, void *arg)
+{
+  (void) acc;
+  (*(size_t *) arg)++;
+  return true;
+}
+
+static bool take_email(account_t *acc, void *arg)
+{
+  strcpy(acc->email, arg);
+  acc->login_count = 99;
+  return true;
+}
+
+#suite account_store_suite
+
+#tcase account_store_test_case
+
+#test test_insert_lookup_update_remove
+  account_store_clear();
+  account_t *acc = account_create("alice", "pw1", "alice@example.com", "1990-01-01");
+  ck_assert(account_store_insert(acc));
+  ck_assert_int_ne(acc->account_id, 0);
+  int64_t id = acc->account_id;
+
+  account_t copy;
+  ck_assert(account_store_lookup("alice", &copy));
+  ck_assert_str_eq(copy.email, "alice@example.com");
+  ck_assert_int_eq(copy.account_id, id);
+  // the default backend looks in the store
+  ck_assert(db_backend_lookup("alice", &copy));
+  ck_assert(!account_store_lookup("alicia", &copy));
+
+  copy.login_count = 7;
+  ck_assert(account_store_update(&copy));
+  account_t again;
+  ck_assert(account_store_lookup("alice", &again));
+  ck_assert_uint_eq(again.login_count, 7);
+
+  account_t *dup = account_create("alice", "pw2", "other@example.com", "1990-01-01");
+  ck_assert(!account_store_insert(dup));
+  account_free(dup);
+
+  ck_assert_uint_eq(account_store_count(), 1);
+  ck_assert(account_store_remove("alice"));
+  ck_assert(!account_store_contains("alice"));
+  ck_assert_uint_eq(account_store_count(), 0);
+
+#test test_lookup_by_key
+  account_store_clear();
+  account_t *acc = account_create("carol", "pw", "carol@example.com", "1990-01-01");
+  ck_assert(account_store_insert(acc));
+
+  userid_key_t key;
+  ck_assert(userid_key_init(&key, "carol"));
+  ck_assert_uint_eq(key.len, 5);
+  ck_assert(key.hash == userid_key_hash("carol", 5));
+  ck_assert(userid_key_matches(&key, acc->userid));
+  account_t copy;
+  ck_assert(account_store_lookup_key(&key, &copy));
+  ck_assert_str_eq(copy.email, "carol@example.com");
+
+  // a prefix or extension of the userid is a different key
+  userid_key_t prefix;
+  ck_assert(userid_key_init(&prefix, "caro"));
+  ck_assert(!userid_key_matches(&prefix, acc->userid));
+  ck_assert(!account_store_lookup_key(&prefix, &copy));
+
+  char long_userid[USER_ID_LENGTH + 1];
+  memset(long_userid, 'x', USER_ID_LENGTH);
+  long_userid[USER_ID_LENGTH] = '\0';
+  ck_assert(!userid_key_init(&key, long_userid));
+  ck_assert_uint_eq(key.len, USER_ID_LENGTH);
+  ck_assert(!account_store_lookup_key(&key, &copy));
+  ck_assert(!userid_key_init(&key, NULL));
+  ck_assert_uint_eq(key.len, 0);
+  account_store_clear();
+
+#test test_store_grows
+  account_store_clear();
+  char userid[32];
+  for (int i = 0; i < 5000; i++) {
+    account_t *acc = account_create("placeholder", "pw", "u@example.com", "2000-01-01");
+    snprintf(acc->userid, sizeof(acc->userid), "user%d", i);
+    snprintf(acc->email, sizeof(acc->email), "user%d@example.com", i);
+    ck_assert(account_store_insert(acc));
+  }
+  ck_assert_uint_eq(account_store_count(), 5000);
+  for (int i = 0; i < 5000; i += 97) {
+    snprintf(userid, sizeof(userid), "user%d", i);
+    ck_assert(account_store_contains(userid));
+  }
+  size_t visited = 0;
+  ck_assert(account_store_foreach(count_visit, &visited));
+  ck_assert_uint_eq(visited, 5000);
+  account_store_clear();
+  ck_assert_uint_eq(account_store_count(), 0);
+
+#test test_email_index
+  account_store_clear();
+  ck_assert(account_store_insert(account_create("alice", "pw", "Alice@Example.com",
+                                                "1990-01-01")));
+  account_t *bob = account_create("bob", "pw", "bob@example.com", "1990-01-01");
+  ck_assert(account_store_insert(bob));
+
+  // found by email in any case
+  account_t copy;
+  ck_assert(account_store_lookup_email("alice@example.COM", &copy));
+  ck_assert_str_eq(copy.userid, "alice");
+  ck_assert(account_store_email_in_use("ALICE@example.com"));
+  ck_assert(!account_store_email_in_use("carol@example.com"));
+  ck_assert(!account_store_lookup_email("carol@example.com", &copy));
+
+  // no second account may have it
+  ck_assert_ptr_null(account_create("carol", "pw", "alice@example.com", "1990-01-01"));
+  account_t *carol = account_create("carol", "pw", "carol@example.com", "1990-01-01");
+  ck_assert_ptr_nonnull(carol);
+  strcpy(carol->email, "ALICE@example.com");
+  ck_assert(!account_store_insert(carol));
+  account_free(carol);
+
+  ck_assert(account_store_lookup("bob", &copy));
+  account_set_email(&copy, "alice@example.com");
+  ck_assert_str_eq(copy.email, "bob@example.com");
+  strcpy(copy.email, "alice@example.com");
+  ck_assert(!account_store_update(&copy));
+  ck_assert(!account_store_modify("bob", take_email, "alice@example.com"));
+  ck_assert(account_store_lookup("bob", &copy));
+  ck_assert_str_eq(copy.email, "bob@example.com");
+  ck_assert_uint_eq(copy.login_count, 0);
+
+  // changes move the index entry
+  account_set_email(&copy, "robert@example.com");
+  ck_assert(account_store_update(&copy));
+  ck_assert(!account_store_email_in_use("bob@example.com"));
+  ck_assert(account_store_lookup_email("robert@example.com", &copy));
+  ck_assert_str_eq(copy.userid, "bob");
+  ck_assert(account_store_modify("bob", take_email, "Robert@example.com"));
+  ck_assert(account_store_email_in_use("robert@example.com"));
+
+  // changes go through a copy; the stored account itself is refused
+  account_t *dave = account_create("dave", "pw", "dave@example.com", "1990-01-01");
+  ck_assert_ptr_nonnull(dave);
+  ck_assert(account_store_insert(dave));
+  ck_assert(!account_store_update(dave));
+  ck_assert(account_store_lookup("dave", &copy));
+  strcpy(copy.email, "david@example.com");
+  ck_assert(account_store_update(&copy));
+  ck_assert(!account_store_email_in_use("dave@example.com"));
+  ck_assert(account_store_lookup_email("david@example.com", &copy));
+  ck_assert_str_eq(copy.userid, "dave");
+
+  ck_assert(account_store_remove("alice"));
+  ck_assert(!account_store_email_in_use("alice@example.com"));
+  ck_assert(account_store_insert(account_create("carol", "pw", "alice@example.com",
+                                                "1990-01-01")));
+  account_store_clear();
+  ck_assert(!account_store_email_in_use("robert@example.com"));
+
+#tcase thread_pool_test_case
+
+static atomic_int task_runs;
+
+static void count_task(void *arg)
+{
+  (void) arg;
+  atomic_fetch_add(&task_runs, 1);
+}
+
+#test test_pool_runs_every_task
+  thread_pool_t *pool = thread_pool_create(3);
+  ck_assert_ptr_nonnull(pool);
+  thread_pool_group_t group;
+  thread_pool_group_init(&group);
+  atomic_store(&task_runs, 0);
+  for (int i = 0; i < 1000; i++) {
+    ck_assert(thread_pool_submit(pool, &group, count_task, NULL));
+  }
+  thread_pool_group_wait(&group);
+  ck_assert_int_eq(atomic_load(&task_runs), 1000);
+  thread_pool_group_destroy(&group);
+  thread_pool_destroy(pool);
+
+#tcase account_import_test_case
+
+#test test_import_reports_rejects_in_order
+  account_store_clear();
+  write_file(IMPORT_PATH,
+    "# userid,password,email,birthdate\n"
+    "ann,secret,ann@example.com,1980-02-03\n"
+    "ben,pass,with,commas,ben@example.com,1981-04-05\n"
+    "cat,pw,bad email@example.com,1982-06-07\n"
+    "\n"
+    "dan,pw,dan@example.com,1983-13\n"
+    "ann,again,ann2@example.com,1984-01-01\n"
+    "not enough fields\n"
+    "eve,pw,eve@example.com,1985-08-09\r\n"
+    "fay,pw,ANN@example.com,1986-10-11\n");
+  int reject_fd = open(REJECT_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  account_import_options_t opts = { .threads = 2, .batch_size = 2, .reject_fd = reject_fd };
+  account_import_report_t report;
+  ck_assert(account_import_file(IMPORT_PATH, &opts, &report));
+  close(reject_fd);
+
+  ck_assert_uint_eq(report.lines, 10);
+  ck_assert_uint_eq(report.imported, 3);
+  ck_assert_uint_eq(report.rejected, 5);
+  ck_assert(account_store_contains("ann"));
+  ck_assert(account_store_contains("ben"));
+  ck_assert(account_store_contains("eve"));
+  ck_assert(!account_store_contains("cat"));
+
+  // the first "ann" wins, and the comma-containing password was kept whole
+  account_t acc;
+  ck_assert(account_store_lookup("ann", &acc));
+  ck_assert_str_eq(acc.email, "ann@example.com");
+  ck_assert(account_validate_password(&acc, "secret"));
+  ck_assert(account_store_lookup("ben", &acc));
+  ck_assert(account_validate_password(&acc, "pass,with,commas"));
+
+  char rejects[512] = { 0 };
+  int fd = open(REJECT_PATH, O_RDONLY);
+  ck_assert_int_gt(read(fd, rejects, sizeof(rejects) - 1), 0);
+  close(fd);
+  ck_assert_str_eq(rejects,
+    "line 4: invalid email\n"
+    "line 6: invalid birthdate\n"
+    "line 7: duplicate userid\n"
+    "line 8: expected userid,password,email,birthdate\n"
+    "line 10: duplicate email\n");
+  unlink(IMPORT_PATH);
+  unlink(REJECT_PATH);
+  account_store_clear();
+
+// vim: syntax=c :
@@ -0,0 +1,97 @@
+#define CITS3007_PERMISSIVE
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "account.h"
+#include "account_validate.h"
+
+// the byte-at-a-time rules that account.c used to apply
+static bool reference_email(const char *email)
+{
+  if (strlen(email) >= EMAIL_LENGTH) {
+    return false;
+  }
+  for (size_t i = 0; email[i] != '\0'; i++) {
+    if (email[i] < 32 || email[i] > 126 || email[i] == ' ') {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool reference_birthdate(const char *birthdate)
+{
+  if (strlen(birthdate) != BIRTHDATE_LENGTH || birthdate[4] != '-' || birthdate[7] != '-') {
+    return false;
+  }
+  for (int i = 0; i < 10; i++) {
+    if (i != 4 && i != 7 && !isdigit((unsigned char) birthdate[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#suite account_validate_suite
+
+#tcase account_validate_test_case
+
+#test test_email_matches_reference_for_every_byte
+  // every byte value at every position of strings of every length
+  char email[EMAIL_LENGTH + 2];
+  for (size_t len = 1; len <= EMAIL_LENGTH; len++) {
+    memset(email, 'a', len);
+    email[len] = '\0';
+    ck_assert_int_eq(validate_email(email), reference_email(email));
+    for (size_t pos = 0; pos < len; pos += 7) {
+      for (int c = 1; c < 256; c++) {
+        email[pos] = (char) c;
+        ck_assert_int_eq(validate_email(email), reference_email(email));
+        ck_assert_int_eq(validate_email_span(email, len), reference_email(email));
+      }
+      email[pos] = 'a';
+    }
+  }
+  ck_assert(validate_email(""));
+  ck_assert(!validate_email_span("a\0b", 3));
+
+#test test_birthdate_matches_reference_for_every_byte
+  char date[16];
+  strcpy(date, "1999-12-31");
+  ck_assert(validate_birthdate(date));
+  for (size_t pos = 0; pos < BIRTHDATE_LENGTH; pos++) {
+    for (int c = 1; c < 256; c++) {
+      date[pos] = (char) c;
+      ck_assert_int_eq(validate_birthdate(date), reference_birthdate(date));
+      ck_assert_int_eq(validate_birthdate_span(date, BIRTHDATE_LENGTH), reference_birthdate(date));
+    }
+    date[pos] = "1999-12-31"[pos];
+  }
+  ck_assert(!validate_birthdate("1999-12-3"));
+  ck_assert(!validate_birthdate("1999-12-311"));
+  ck_assert(!validate_birthdate("1999/12/31"));
+  ck_assert(!validate_birthdate_span("1999-12-31", 9));
+
+#test test_batch_reports_each_invalid_field
+  char long_userid[USER_ID_LENGTH + 1];
+  memset(long_userid, 'u', USER_ID_LENGTH);
+  long_userid[USER_ID_LENGTH] = '\0';
+  account_fields_t records[] = {
+    { "alice", "alice@example.com", "1990-01-01" },
+    { long_userid, "bob@example.com", "1990-01-01" },
+    { "carol", "carol at example.com", "1990-1-01" },
+    { "dave", NULL, "1990-01-01" },
+    { "erin", "erin@example.com", "2000-02-29" },
+  };
+  unsigned char invalid[5];
+  ck_assert_uint_eq(validate_account_fields_batch(records, 5, invalid), 2);
+  ck_assert_int_eq(invalid[0], 0);
+  ck_assert_int_eq(invalid[1], ACCOUNT_FIELD_USERID);
+  ck_assert_int_eq(invalid[2], ACCOUNT_FIELD_EMAIL | ACCOUNT_FIELD_BIRTHDATE);
+  ck_assert_int_eq(invalid[3], ACCOUNT_FIELD_EMAIL);
+  ck_assert_int_eq(invalid[4], 0);
+
+// vim: syntax=c :
@@ -0,0 +1,225 @@
+#define CITS3007_PERMISSIVE
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "account_store.h"
+#include "audit_log.h"
+#include "login.h"
+
+#define AUDIT_DIR "audit_log_test.d"
+#define THREADS 4
+#define EVENTS_PER_THREAD 1000
+#define DAY (24 * 60 * 60)
+
+typedef struct {
+  size_t count;
+  time_t last_time;
+  bool in_order;
+  login_result_t last_result;
+} tally_t;
+
+static void clear_dir(void)
+{
+  DIR *d = opendir(AUDIT_DIR);
+  if (!d) {
+    return;
+  }
+  struct dirent *entry;
+  char path[512];
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      snprintf(path, sizeof(path), "%s/%s", AUDIT_DIR, entry->d_name);
+      unlink(path);
+    }
+  }
+  closedir(d);
+  rmdir(AUDIT_DIR);
+}
+
+static ip4_addr_t addr(const char *text)
+{
+  struct in_addr in;
+  ck_assert_int_eq(inet_pton(AF_INET, text, &in), 1);
+  return in.s_addr;
+}
+
+static bool tally(const audit_event_t *event, void *arg)
+{
+  tally_t *t = arg;
+  if (t->count > 0 && event->time < t->last_time) {
+    t->in_order = false;
+  }
+  t->count++;
+  t->last_time = event->time;
+  t->last_result = event->result;
+  return true;
+}
+
+static size_t count_matching(const audit_query_t *query)
+{
+  tally_t t = { .in_order = true };
+  ck_assert(audit_log_query(AUDIT_DIR, query, tally, &t));
+  ck_assert(t.in_order);
+  return t.count;
+}
+
+static void *record_events(void *arg)
+{
+  char userid[32];
+  snprintf(userid, sizeof(userid), "thread%d", *(int *) arg);
+  // recent, or sealing would expire them at once
+  time_t now = time(NULL);
+  for (int i = 0; i < EVENTS_PER_THREAD; i++) {
+    audit_log_record(userid, LOGIN_SUCCESS, addr("10.0.0.1"), now + i);
+  }
+  return NULL;
+}
+
+#suite audit_log_suite
+
+#tcase audit_log_test_case
+
+#test test_append_and_query
+  clear_dir();
+  audit_log_options_t opts = { .segment_events = 64 };
+  ck_assert(audit_log_open(AUDIT_DIR, &opts));
+  ck_assert(!audit_log_open(AUDIT_DIR, &opts));
+  time_t now = time(NULL);
+  char userid[32];
+  char ip[32];
+  for (int i = 0; i < 300; i++) {
+    snprintf(userid, sizeof(userid), "user%d", i % 10);
+    snprintf(ip, sizeof(ip), "192.168.%d.%d", i % 3, i % 7);
+    audit_log_record(userid, i % 4 == 0 ? LOGIN_FAIL_BAD_PASSWORD : LOGIN_SUCCESS, addr(ip),
+                     now + i);
+  }
+  ck_assert(audit_log_sync());
+  // the unsealed current segment is scanned; sealed ones use their indexes
+  audit_query_t all = { 0 };
+  ck_assert_uint_eq(count_matching(&all), 300);
+  ck_assert(audit_log_close());
+  ck_assert(!audit_log_close());
+
+  audit_log_stats_t stats;
+  audit_log_get_stats(&stats);
+  ck_assert_uint_ge(stats.sealed, 5);
+  ck_assert_uint_eq(stats.dropped, 0);
+
+  ck_assert_uint_eq(count_matching(&all), 300);
+  audit_query_t by_user = { .userid = "user3" };
+  ck_assert_uint_eq(count_matching(&by_user), 30);
+  audit_query_t nobody = { .userid = "user33" };
+  ck_assert_uint_eq(count_matching(&nobody), 0);
+  audit_query_t by_ip = { .ip = addr("192.168.1.5"), .ip_prefix_len = 32 };
+  size_t expected = 0;
+  for (int i = 0; i < 300; i++) {
+    expected += i % 3 == 1 && i % 7 == 5;
+  }
+  ck_assert_uint_eq(count_matching(&by_ip), expected);
+  audit_query_t by_block = { .ip = addr("192.168.2.0"), .ip_prefix_len = 24 };
+  ck_assert_uint_eq(count_matching(&by_block), 100);
+  audit_query_t window = { .userid = "user3", .from = now + 100, .to = now + 199 };
+  ck_assert_uint_eq(count_matching(&window), 10);
+  audit_query_t elsewhere = { .ip = addr("10.0.0.0"), .ip_prefix_len = 8 };
+  ck_assert_uint_eq(count_matching(&elsewhere), 0);
+  clear_dir();
+
+#test test_threads_append_without_loss
+  clear_dir();
+  audit_log_options_t opts = { .segment_events = 256 };
+  audit_log_stats_t before;
+  audit_log_get_stats(&before);
+  ck_assert(audit_log_open(AUDIT_DIR, &opts));
+  pthread_t threads[THREADS];
+  int ids[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    ids[i] = i;
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, record_events, &ids[i]), 0);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  ck_assert(audit_log_close());
+  audit_log_stats_t after;
+  audit_log_get_stats(&after);
+  ck_assert_uint_eq(after.appended - before.appended, THREADS * EVENTS_PER_THREAD);
+  ck_assert_uint_eq(after.dropped, before.dropped);
+  audit_query_t all = { 0 };
+  tally_t t = { .in_order = true };
+  ck_assert(audit_log_query(AUDIT_DIR, &all, tally, &t));
+  ck_assert_uint_eq(t.count, THREADS * EVENTS_PER_THREAD);
+  audit_query_t one = { .userid = "thread2" };
+  ck_assert_uint_eq(count_matching(&one), EVENTS_PER_THREAD);
+  clear_dir();
+
+#test test_handle_login_is_audited
+  clear_dir();
+  account_store_clear();
+  account_t *acc = account_create("dana", "pw", "dana@example.com", "1990-01-01");
+  ck_assert(account_store_insert(acc));
+  ck_assert(audit_log_open(AUDIT_DIR, NULL));
+  int fd = open("/dev/null", O_WRONLY);
+  login_session_data_t session;
+  time_t now = time(NULL);
+  handle_login("dana", "wrong", addr("10.1.1.1"), now, fd, &session);
+  handle_login("dana", "pw", addr("10.1.1.1"), now, fd, &session);
+  handle_login("erin", "pw", addr("10.1.1.2"), now, fd, &session);
+  close(fd);
+  ck_assert(audit_log_close());
+  // a closed log records nothing
+  audit_log_record("dana", LOGIN_SUCCESS, addr("10.1.1.1"), now);
+
+  audit_query_t dana = { .userid = "dana" };
+  tally_t t = { .in_order = true };
+  ck_assert(audit_log_query(AUDIT_DIR, &dana, tally, &t));
+  ck_assert_uint_eq(t.count, 2);
+  ck_assert_int_eq(t.last_result, LOGIN_SUCCESS);
+  audit_query_t subnet = { .ip = addr("10.1.1.0"), .ip_prefix_len = 30 };
+  ck_assert_uint_eq(count_matching(&subnet), 3);
+  account_store_clear();
+  clear_dir();
+
+#test test_recovery_and_expiry
+  clear_dir();
+  time_t now = time(NULL);
+  pid_t child = fork();
+  ck_assert_int_ne(child, -1);
+  if (child == 0) {
+    // dies with its segment unsealed
+    audit_log_open(AUDIT_DIR, NULL);
+    for (int i = 0; i < 10; i++) {
+      audit_log_record("old", LOGIN_SUCCESS, addr("10.2.0.1"), now - 100 * DAY + i);
+    }
+    _exit(0);
+  }
+  int status;
+  ck_assert_int_eq(waitpid(child, &status, 0), child);
+  audit_query_t old = { .userid = "old" };
+  ck_assert_uint_eq(count_matching(&old), 10);
+
+  // opening seals the crashed segment, then deletes it as too old
+  audit_log_stats_t before;
+  audit_log_get_stats(&before);
+  ck_assert(audit_log_open(AUDIT_DIR, NULL));
+  audit_log_record("new", LOGIN_SUCCESS, addr("10.2.0.1"), now);
+  ck_assert(audit_log_close());
+  audit_log_stats_t after;
+  audit_log_get_stats(&after);
+  ck_assert_uint_ge(after.sealed - before.sealed, 2);
+  ck_assert_uint_eq(after.expired - before.expired, 1);
+  ck_assert_uint_eq(count_matching(&old), 0);
+  audit_query_t all = { 0 };
+  ck_assert_uint_eq(count_matching(&all), 1);
+  ck_assert_uint_eq(audit_log_expire(AUDIT_DIR, now + 1), 1);
+  ck_assert_uint_eq(count_matching(&all), 0);
+  clear_dir();
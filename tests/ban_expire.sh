@@ -5,8 +5,11 @@ echo "Generating C test file from ban_expire.ts..."
 checkmk ban_expire.ts > ban_expire.c
 
 echo "Compiling test program..."
-gcc ban_expire.c ../src/account.c ../src/stubs.c -I../src \
-    -o ban_expire \
+gcc ban_expire.c ../src/account.c ../src/account_cache.c ../src/db_backend.c \
+    ../src/account_validate.c ../src/password_hash.c ../src/rand_pool.c \
+    ../src/ip_index.c ../src/login_span.c ../src/scrypt.c ../src/hash_arena.c \
+    ../src/thread_pool.c ../src/account_alloc.c ../src/slab.c ../src/account_store.c \
+    ../src/userid_key.c ../src/stubs.c -I../src -o ban_expire \
     -lcheck -lsubunit -lssl -lcrypto -lm -pthread
 
 echo "Running unit tests..."
@@ -0,0 +1,167 @@
+#define CITS3007_PERMISSIVE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "db_backend.h"
+#include "db_sqlite.h"
+#include "login.h"
+#include "userid_filter.h"
+
+#define ACCOUNTS 500
+#define THREADS 4
+
+static char db_path[] = "/tmp/db_sqlite_test_XXXXXX";
+
+static void remove_db(void)
+{
+  char path[sizeof(db_path) + sizeof("-wal")];
+  unlink(db_path);
+  snprintf(path, sizeof(path), "%s-wal", db_path);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s-shm", db_path);
+  unlink(path);
+}
+
+static db_sqlite_t *open_seeded(unsigned int connections, unsigned int batch_size)
+{
+  strcpy(db_path, "/tmp/db_sqlite_test_XXXXXX");
+  int fd = mkstemp(db_path);
+  ck_assert_int_ge(fd, 0);
+  close(fd);
+  db_sqlite_options_t opts = { .connections = connections, .batch_size = batch_size };
+  db_sqlite_t *db = db_sqlite_open(db_path, &opts);
+  ck_assert_ptr_nonnull(db);
+
+  account_t *model = account_create("model", "pw", "u@example.com", "2000-01-01");
+  ck_assert_ptr_nonnull(model);
+  account_t *accounts = calloc(ACCOUNTS, sizeof(*accounts));
+  for (int i = 0; i < ACCOUNTS; i++) {
+    accounts[i] = *model;
+    accounts[i].account_id = i + 1;
+    memcpy(accounts[i].birthdate, "2000-01-01", BIRTHDATE_LENGTH);
+    snprintf(accounts[i].userid, sizeof(accounts[i].userid), "user%d", i);
+  }
+  ck_assert(db_sqlite_insert(db, accounts, ACCOUNTS));
+  free(accounts);
+  account_free(model);
+  return db;
+}
+
+static void *lookup_loop(void *arg)
+{
+  db_sqlite_t *db = arg;
+  for (int i = 0; i < 2000; i++) {
+    char userid[32];
+    snprintf(userid, sizeof(userid), "user%d", (i * 7) % ACCOUNTS);
+    account_t acc;
+    if (!db_sqlite_lookup(db, userid, &acc) || strcmp(acc.userid, userid) != 0) {
+      return arg;
+    }
+  }
+  return NULL;
+}
+
+#suite db_sqlite_suite
+
+#tcase db_sqlite_test_case
+
+#test test_insert_and_lookup
+  db_sqlite_t *db = open_seeded(1, 0);
+  ck_assert_int_eq(db_sqlite_count(db), ACCOUNTS);
+  account_t acc;
+  ck_assert(db_sqlite_lookup(db, "user42", &acc));
+  ck_assert_str_eq(acc.userid, "user42");
+  ck_assert_int_eq(acc.account_id, 43);
+  ck_assert_str_eq(acc.email, "u@example.com");
+  ck_assert(memcmp(acc.birthdate, "2000-01-01", BIRTHDATE_LENGTH) == 0);
+  ck_assert(account_validate_password(&acc, "pw"));
+  ck_assert(!db_sqlite_lookup(db, "nobody", &acc));
+  db_sqlite_stats_t stats;
+  db_sqlite_get_stats(db, &stats);
+  ck_assert_uint_eq(stats.lookups, 2);
+  ck_assert_uint_eq(stats.found, 1);
+  ck_assert(db_sqlite_close(db));
+  remove_db();
+
+#test test_login_updates_are_batched_and_persist
+  db_sqlite_t *db = open_seeded(1, 4);
+  account_t acc;
+  ck_assert(db_sqlite_lookup(db, "user1", &acc));
+  for (unsigned int i = 1; i <= 5; i++) {
+    acc.login_count = i;
+    acc.last_ip = 0x0a000001;
+    acc.last_login_time = 1700000000 + i;
+    db_sqlite_record_login(db, &acc);
+  }
+  // the fourth update filled a batch; the fifth is still queued
+  db_sqlite_stats_t stats;
+  db_sqlite_get_stats(db, &stats);
+  ck_assert_uint_eq(stats.logins_recorded, 5);
+  ck_assert_uint_eq(stats.logins_written, 4);
+  ck_assert_uint_eq(stats.batches_written, 1);
+  // lookups see the queued update before it is written
+  ck_assert(db_sqlite_lookup(db, "user1", &acc));
+  ck_assert_uint_eq(acc.login_count, 5);
+  ck_assert(db_sqlite_close(db));
+
+  db_sqlite_options_t opts = { .connections = 2, .flush_interval_ms = 5 };
+  db = db_sqlite_open(db_path, &opts);
+  ck_assert_ptr_nonnull(db);
+  ck_assert(db_sqlite_lookup(db, "user1", &acc));
+  ck_assert_uint_eq(acc.login_count, 5);
+  ck_assert_uint_eq(acc.last_ip, 0x0a000001);
+  ck_assert_int_eq(acc.last_login_time, 1700000005);
+  ck_assert(db_sqlite_close(db));
+  remove_db();
+
+#test test_concurrent_lookups_share_the_pool
+  db_sqlite_t *db = open_seeded(2, 0);
+  pthread_t threads[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, lookup_loop, db), 0);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    void *result;
+    pthread_join(threads[i], &result);
+    ck_assert_ptr_null(result);
+  }
+  db_sqlite_stats_t stats;
+  db_sqlite_get_stats(db, &stats);
+  ck_assert_uint_eq(stats.found, THREADS * 2000);
+  ck_assert(db_sqlite_close(db));
+  remove_db();
+
+#test test_handle_login_uses_backend
+  db_sqlite_t *db = open_seeded(2, 0);
+  db_backend_t backend;
+  db_sqlite_backend(db, &backend);
+  db_backend_set(&backend);
+  ck_assert(userid_filter_rebuild(0, 0));
+  ck_assert(userid_filter_may_contain("user7"));
+
+  int devnull = open("/dev/null", O_WRONLY);
+  login_session_data_t session = { 0 };
+  ck_assert_int_eq(handle_login("user7", "pw", 0x0a000002, 1700000000, devnull, &session),
+                   LOGIN_SUCCESS);
+  ck_assert_int_eq(handle_login("user7", "wrong", 0x0a000002, 1700000001, devnull, &session),
+                   LOGIN_FAIL_BAD_PASSWORD);
+  ck_assert_int_eq(handle_login("nobody", "pw", 0x0a000002, 1700000002, devnull, &session),
+                   LOGIN_FAIL_USER_NOT_FOUND);
+  close(devnull);
+  userid_filter_disable();
+  db_backend_set(NULL);
+
+  ck_assert(db_sqlite_flush(db));
+  account_t acc;
+  ck_assert(db_sqlite_lookup(db, "user7", &acc));
+  ck_assert_uint_eq(acc.login_count, 0);
+  ck_assert_uint_eq(acc.login_fail_count, 1);
+  ck_assert_uint_eq(acc.last_ip, 0x0a000002);
+  ck_assert(db_sqlite_close(db));
+  remove_db();
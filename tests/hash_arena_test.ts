@@ -0,0 +1,168 @@
+#define CITS3007_PERMISSIVE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "account.h"
+#include "hash_arena.h"
+#include "password_hash.h"
+#include "scrypt.h"
+
+#define ARENA_BYTES ((size_t) 2 << 20)
+
+static void sleep_ms(long ms)
+{
+  struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+  nanosleep(&ts, NULL);
+}
+
+static void configure(unsigned int arenas)
+{
+  hash_arena_options_t opts = { .arena_bytes = ARENA_BYTES, .arenas = arenas,
+                                .no_huge_pages = true };
+  ck_assert(hash_arena_configure(&opts));
+}
+
+static atomic_bool borrowed_late;
+
+static void *borrow_one(void *arg)
+{
+  (void) arg;
+  hash_arena_t arena;
+  ck_assert(hash_arena_borrow(ARENA_BYTES, &arena));
+  atomic_store(&borrowed_late, true);
+  hash_arena_return(&arena);
+  return NULL;
+}
+
+#suite hash_arena_suite
+
+#tcase scrypt_test_case
+
+#test test_scrypt_matches_rfc_7914
+  static const unsigned char empty[16] = {
+    0x77, 0xd6, 0x57, 0x62, 0x38, 0x65, 0x7b, 0x20, 0x3b, 0x19, 0xca, 0x42, 0xc1, 0x8a, 0x04, 0x97
+  };
+  static const unsigned char nacl[16] = {
+    0xfd, 0xba, 0xbe, 0x1c, 0x9d, 0x34, 0x72, 0x00, 0x78, 0x56, 0xe7, 0x19, 0x0d, 0x01, 0xe9, 0xfe
+  };
+  unsigned char out[16];
+  size_t bytes = scrypt_memory(10, 8, 16);
+  ck_assert_uint_eq(bytes, (size_t) 128 * 8 * (1024 + 16 + 2));
+  void *work = malloc(bytes);
+  ck_assert_ptr_nonnull(work);
+
+  ck_assert(scrypt_derive("", 0, (const unsigned char *) "", 0, 4, 1, 1, work, bytes, out,
+                          sizeof(out)));
+  ck_assert(memcmp(out, empty, sizeof(out)) == 0);
+  ck_assert(scrypt_derive("password", 8, (const unsigned char *) "NaCl", 4, 10, 8, 16, work,
+                          bytes, out, sizeof(out)));
+  ck_assert(memcmp(out, nacl, sizeof(out)) == 0);
+
+  // too little working memory, or nonsense parameters
+  ck_assert(!scrypt_derive("password", 8, (const unsigned char *) "NaCl", 4, 10, 8, 16, work,
+                           bytes - 1, out, sizeof(out)));
+  ck_assert_uint_eq(scrypt_memory(0, 8, 1), 0);
+  ck_assert_uint_eq(scrypt_memory(10, 0, 1), 0);
+  ck_assert_uint_eq(scrypt_memory(10, 8, 0), 0);
+  free(work);
+
+#tcase hash_arena_test_case
+
+#test test_arenas_are_reused_and_capped
+  configure(2);
+  hash_arena_stats_t before, stats;
+  hash_arena_get_stats(&before);
+  stats = before;
+  ck_assert_uint_eq(stats.arenas, 2);
+  ck_assert_uint_ge(stats.arena_bytes, ARENA_BYTES);
+  ck_assert_uint_eq(stats.bytes_mapped, 2 * stats.arena_bytes);
+
+  // a thread gets back the arena it used last
+  hash_arena_t a, b;
+  ck_assert(hash_arena_borrow(ARENA_BYTES, &a));
+  void *first = a.memory;
+  hash_arena_return(&a);
+  ck_assert(hash_arena_borrow(ARENA_BYTES, &a));
+  ck_assert_ptr_eq(a.memory, first);
+
+  // with every arena lent out, borrowing waits for one to come back
+  ck_assert(hash_arena_borrow(ARENA_BYTES / 2, &b));
+  ck_assert_ptr_ne(a.memory, b.memory);
+  atomic_store(&borrowed_late, false);
+  pthread_t thread;
+  pthread_create(&thread, NULL, borrow_one, NULL);
+  sleep_ms(50);
+  ck_assert(!atomic_load(&borrowed_late));
+  hash_arena_return(&b);
+  pthread_join(thread, NULL);
+  ck_assert(atomic_load(&borrowed_late));
+
+  hash_arena_get_stats(&stats);
+  ck_assert_uint_eq(stats.borrowed - before.borrowed, 4);
+  ck_assert_uint_eq(stats.waits - before.waits, 1);
+  ck_assert_uint_eq(stats.in_use, 1);
+  ck_assert_uint_eq(stats.unpooled - before.unpooled, 0);
+  hash_arena_return(&a);
+
+  // more than an arena holds: memory of its own, but still an arena's turn
+  ck_assert(hash_arena_borrow(4 * ARENA_BYTES, &a));
+  ck_assert_int_ge(a.slot, 0);
+  memset(a.memory, 1, 4 * ARENA_BYTES);
+  hash_arena_get_stats(&stats);
+  ck_assert_uint_eq(stats.in_use, 1);
+  ck_assert_uint_eq(stats.unpooled - before.unpooled, 1);
+  hash_arena_return(&a);
+
+  // without arenas, every borrowing allocates
+  ck_assert(hash_arena_configure(NULL));
+  ck_assert(hash_arena_borrow(ARENA_BYTES, &a));
+  ck_assert_int_eq(a.slot, -1);
+  hash_arena_return(&a);
+  hash_arena_get_stats(&stats);
+  ck_assert_uint_eq(stats.arenas, 0);
+  ck_assert_uint_eq(stats.bytes_mapped, 0);
+
+#test test_scrypt_password_hashes
+  configure(2);
+  hash_arena_stats_t before, stats;
+  hash_arena_get_stats(&before);
+  password_hash_scrypt_t params = { .log2_n = 10, .r = 8, .p = 1 };
+  ck_assert(password_hash_use_scrypt(&params));
+  account_t *acc = account_create("carol", "correct horse", "carol@example.com", "1985-05-05");
+  ck_assert_ptr_nonnull(acc);
+  ck_assert(strncmp(acc->password_hash, "$s1$10$8$1$", 11) == 0);
+  ck_assert(password_hash_is_scrypt(acc->password_hash));
+  ck_assert(account_validate_password(acc, "correct horse"));
+  ck_assert(!account_validate_password(acc, "battery staple"));
+
+  hash_arena_get_stats(&stats);
+  ck_assert_uint_eq(stats.borrowed - before.borrowed, 3);
+  ck_assert_uint_eq(stats.unpooled - before.unpooled, 0);
+  ck_assert_uint_eq(stats.in_use, 0);
+
+  // back to PBKDF2 for new hashes; the scrypt hash keeps verifying
+  char scrypt_hash[HASH_LENGTH];
+  strcpy(scrypt_hash, acc->password_hash);
+  ck_assert(password_hash_use_scrypt(NULL));
+  ck_assert(account_update_password(acc, "tr0ub4dor"));
+  ck_assert(!password_hash_is_scrypt(acc->password_hash));
+  ck_assert(account_validate_password(acc, "tr0ub4dor"));
+  strcpy(acc->password_hash, scrypt_hash);
+  ck_assert(account_validate_password(acc, "correct horse"));
+  account_free(acc);
+
+  // parameters needing too much memory are refused, and stored hashes
+  // asking for them are malformed
+  password_hash_scrypt_t huge = { .log2_n = 30, .r = 8, .p = 1 };
+  ck_assert(!password_hash_use_scrypt(&huge));
+  ck_assert(!password_hash_is_scrypt("$s1$30$8$1$00000000000000000000000000000000:"
+                                     "00000000000000000000000000000000"));
+  ck_assert(!password_hash_verify_scrypt("$s1$30$8$1$00000000000000000000000000000000:"
+                                         "00000000000000000000000000000000", "pw"));
+  ck_assert(!password_hash_is_scrypt("$s1$10$8$$00:00"));
+  ck_assert(hash_arena_configure(NULL));
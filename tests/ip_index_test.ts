@@ -0,0 +1,171 @@
+#define CITS3007_PERMISSIVE
+
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "account.h"
+#include "account_store.h"
+#include "ip_index.h"
+
+#define RANDOM_ACCOUNTS 500
+
+static ip4_addr_t addr(const char *text)
+{
+  struct in_addr in;
+  ck_assert_int_eq(inet_pton(AF_INET, text, &in), 1);
+  return in.s_addr;
+}
+
+static size_t count_cidr(const char *cidr)
+{
+  ip4_addr_t prefix;
+  unsigned int len;
+  ck_assert(ip_index_parse_cidr(cidr, &prefix, &len));
+  return ip_index_count(prefix, len);
+}
+
+static account_t *stored_account(const char *userid, ip4_addr_t ip)
+{
+  char email[64];
+  snprintf(email, sizeof(email), "%s@example.com", userid);
+  account_t *acc = account_create(userid, "pw", email, "1990-01-01");
+  ck_assert_ptr_nonnull(acc);
+  acc->last_ip = ip;
+  ck_assert(account_store_insert(acc));
+  return acc;
+}
+
+static bool stop_after_one(const char *userid, ip4_addr_t ip, void *arg)
+{
+  (void) userid;
+  (void) ip;
+  (*(int *) arg)++;
+  return false;
+}
+
+static bool find_userid(const char *userid, ip4_addr_t ip, void *arg)
+{
+  (void) ip;
+  return strcmp(userid, arg) != 0;
+}
+
+#suite ip_index_suite
+
+#tcase ip_index_test_case
+
+#test test_prefix_queries
+  account_store_clear();
+  stored_account("a", addr("10.1.2.3"));
+  stored_account("b", addr("10.1.2.3"));
+  stored_account("c", addr("10.1.2.200"));
+  stored_account("d", addr("10.1.9.1"));
+  stored_account("e", addr("192.168.0.1"));
+  stored_account("f", 0);
+  ck_assert(ip_index_enable());
+
+  ck_assert_uint_eq(count_cidr("10.1.2.3"), 2);
+  ck_assert_uint_eq(count_cidr("10.1.2.4"), 0);
+  ck_assert_uint_eq(count_cidr("10.1.2.0/24"), 3);
+  ck_assert_uint_eq(count_cidr("10.1.0.0/16"), 4);
+  ck_assert_uint_eq(count_cidr("10.0.0.0/8"), 4);
+  ck_assert_uint_eq(count_cidr("11.0.0.0/8"), 0);
+  ck_assert_uint_eq(count_cidr("0.0.0.0/0"), 5);
+  // bits past the prefix length are ignored
+  ck_assert_uint_eq(count_cidr("10.1.2.77/24"), 3);
+  ck_assert(!ip_index_query(addr("192.168.0.1"), 32, find_userid, "e"));
+  int visits = 0;
+  ck_assert(!ip_index_query(0, 0, stop_after_one, &visits));
+  ck_assert_int_eq(visits, 1);
+  ck_assert(!ip_index_query(0, 33, stop_after_one, &visits));
+
+  ip_index_stats_t stats;
+  ip_index_get_stats(&stats);
+  ck_assert(stats.enabled);
+  ck_assert_uint_eq(stats.accounts, 5);
+  ck_assert_uint_eq(stats.addresses, 4);
+  ip_index_disable();
+  account_store_clear();
+
+#test test_follows_logins_and_store
+  account_store_clear();
+  ck_assert(ip_index_enable());
+  account_t *acc = stored_account("mover", addr("10.0.0.1"));
+  ck_assert_uint_eq(count_cidr("10.0.0.1"), 1);
+
+  account_record_login_success(acc, addr("172.16.5.5"));
+  ck_assert_uint_eq(count_cidr("10.0.0.0/8"), 0);
+  ck_assert_uint_eq(count_cidr("172.16.0.0/12"), 1);
+  ip_index_stats_t stats;
+  ip_index_get_stats(&stats);
+  ck_assert_uint_eq(stats.moves, 1);
+  ck_assert_uint_eq(stats.addresses, 1);
+
+  account_t copy;
+  ck_assert(account_store_lookup("mover", &copy));
+  copy.last_ip = addr("8.8.8.8");
+  ck_assert(account_store_update(&copy));
+  ck_assert_uint_eq(count_cidr("8.8.8.8/32"), 1);
+  ck_assert_uint_eq(count_cidr("172.16.0.0/12"), 0);
+
+  ck_assert(account_store_remove("mover"));
+  ck_assert_uint_eq(count_cidr("0.0.0.0/0"), 0);
+  ip_index_get_stats(&stats);
+  ck_assert_uint_eq(stats.accounts, 0);
+  ck_assert_uint_eq(stats.addresses, 0);
+
+  ip_index_disable();
+  ip_index_get_stats(&stats);
+  ck_assert(!stats.enabled);
+  ck_assert_uint_eq(count_cidr("0.0.0.0/0"), 0);
+  account_store_clear();
+
+#test test_parse_cidr
+  ip4_addr_t prefix;
+  unsigned int len;
+  ck_assert(ip_index_parse_cidr("192.168.1.0/24", &prefix, &len));
+  ck_assert(prefix == addr("192.168.1.0"));
+  ck_assert_uint_eq(len, 24);
+  ck_assert(ip_index_parse_cidr("1.2.3.4", &prefix, &len));
+  ck_assert_uint_eq(len, 32);
+  ck_assert(ip_index_parse_cidr("0.0.0.0/0", &prefix, &len));
+  ck_assert_uint_eq(len, 0);
+  ck_assert(!ip_index_parse_cidr("1.2.3.4/33", &prefix, &len));
+  ck_assert(!ip_index_parse_cidr("1.2.3.4/", &prefix, &len));
+  ck_assert(!ip_index_parse_cidr("1.2.3.4/2x", &prefix, &len));
+  ck_assert(!ip_index_parse_cidr("1.2.3/8", &prefix, &len));
+  ck_assert(!ip_index_parse_cidr("::1/128", &prefix, &len));
+
+#test test_matches_scan
+  account_store_clear();
+  srand(3007);
+  static ip4_addr_t ips[RANDOM_ACCOUNTS];
+  account_t *accounts[RANDOM_ACCOUNTS];
+  char userid[32];
+  for (int i = 0; i < RANDOM_ACCOUNTS; i++) {
+    // a few /16s, so that prefixes share long runs of bits
+    uint32_t host = (10u << 24) | ((uint32_t) (rand() % 4) << 16) | (uint32_t) (rand() % 4096);
+    ips[i] = htonl(host);
+    snprintf(userid, sizeof(userid), "user%d", i);
+    accounts[i] = stored_account(userid, ips[i]);
+  }
+  ck_assert(ip_index_enable());
+  // move some accounts after the index is built
+  for (int i = 0; i < RANDOM_ACCOUNTS; i += 7) {
+    ips[i] = htonl((10u << 24) | (uint32_t) (rand() % 65536));
+    account_record_login_success(accounts[i], ips[i]);
+  }
+  for (int q = 0; q < 200; q++) {
+    unsigned int len = (unsigned int) (rand() % 33);
+    ip4_addr_t prefix = ips[rand() % RANDOM_ACCOUNTS] ^ htonl((uint32_t) rand() % 64);
+    uint32_t mask = len ? UINT32_MAX << (32 - len) : 0;
+    size_t expected = 0;
+    for (int i = 0; i < RANDOM_ACCOUNTS; i++) {
+      expected += ((ntohl(ips[i]) ^ ntohl(prefix)) & mask) == 0;
+    }
+    ck_assert_uint_eq(ip_index_count(prefix, len), expected);
+  }
+  ip_index_disable();
+  account_store_clear();
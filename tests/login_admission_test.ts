@@ -0,0 +1,177 @@
+#define CITS3007_PERMISSIVE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "account_store.h"
+#include "login.h"
+#include "login_admission.h"
+
+#define NORMAL_IP 0x0a000001
+#define PRIORITY_IP 0x0a000002
+#define STANDING 6
+
+static void sleep_ms(long ms)
+{
+  struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+  nanosleep(&ts, NULL);
+}
+
+static void wait_for_waiting(unsigned int n)
+{
+  login_admission_stats_t stats;
+  for (int i = 0; i < 5000; i++) {
+    login_admission_get_stats(&stats);
+    if (stats.waiting == n) {
+      return;
+    }
+    sleep_ms(1);
+  }
+  ck_abort_msg("expected %u waiting logins, have %u", n, stats.waiting);
+}
+
+static void configure(unsigned int max_queue, unsigned int target_ms, unsigned int interval_ms)
+{
+  login_admission_options_t opts = {
+    .max_concurrent = 1,
+    .max_queue = max_queue,
+    .target_ms = target_ms,
+    .interval_ms = interval_ms
+  };
+  ck_assert(login_admission_configure(&opts));
+}
+
+static atomic_int admission_order;
+
+typedef struct {
+  ip4_addr_t ip;
+  long hold_ms;
+  bool admitted;
+  int order;
+} client_t;
+
+static void *client_main(void *arg)
+{
+  client_t *client = arg;
+  client->admitted = login_admission_enter(client->ip);
+  if (client->admitted) {
+    client->order = atomic_fetch_add(&admission_order, 1);
+    sleep_ms(client->hold_ms);
+    login_admission_leave();
+  }
+  return NULL;
+}
+
+#suite login_admission_suite
+
+#tcase login_admission_test_case
+
+#test test_disabled_admits_everyone
+  ck_assert(login_admission_configure(NULL));
+  for (int i = 0; i < 100; i++) {
+    ck_assert(login_admission_enter(NORMAL_IP));
+  }
+  for (int i = 0; i < 100; i++) {
+    login_admission_leave();
+  }
+  login_admission_options_t bad = { .target_ms = 100, .interval_ms = 10 };
+  ck_assert(!login_admission_configure(&bad));
+
+#test test_full_queue_sheds_at_once
+  configure(1, 50, 10000);
+  login_admission_stats_t before, after;
+  login_admission_get_stats(&before);
+  ck_assert(login_admission_enter(NORMAL_IP));
+  client_t queued = { .ip = NORMAL_IP };
+  pthread_t thread;
+  ck_assert_int_eq(pthread_create(&thread, NULL, client_main, &queued), 0);
+  wait_for_waiting(1);
+  ck_assert(!login_admission_enter(NORMAL_IP));
+  login_admission_leave();
+  pthread_join(thread, NULL);
+  ck_assert(queued.admitted);
+  login_admission_get_stats(&after);
+  ck_assert_uint_eq(after.shed_queue_full - before.shed_queue_full, 1);
+  ck_assert_uint_eq(after.queued - before.queued, 1);
+  ck_assert_uint_eq(after.in_flight, 0);
+  ck_assert(login_admission_configure(NULL));
+
+#test test_recent_success_is_served_first
+  configure(8, 50, 10000);
+  login_admission_note_success(PRIORITY_IP);
+  atomic_store(&admission_order, 0);
+  ck_assert(login_admission_enter(NORMAL_IP));
+  client_t normal = { .ip = NORMAL_IP, .hold_ms = 1 };
+  client_t priority = { .ip = PRIORITY_IP, .hold_ms = 1 };
+  pthread_t threads[2];
+  ck_assert_int_eq(pthread_create(&threads[0], NULL, client_main, &normal), 0);
+  wait_for_waiting(1);
+  ck_assert_int_eq(pthread_create(&threads[1], NULL, client_main, &priority), 0);
+  wait_for_waiting(2);
+  login_admission_leave();
+  pthread_join(threads[0], NULL);
+  pthread_join(threads[1], NULL);
+  ck_assert(normal.admitted && priority.admitted);
+  ck_assert_int_lt(priority.order, normal.order);
+  ck_assert(login_admission_configure(NULL));
+
+#test test_standing_queue_is_shed
+  configure(16, 1, 5);
+  login_admission_stats_t before, after;
+  login_admission_get_stats(&before);
+  ck_assert(login_admission_enter(NORMAL_IP));
+  client_t clients[STANDING];
+  pthread_t threads[STANDING];
+  for (int i = 0; i < STANDING; i++) {
+    clients[i] = (client_t) { .ip = NORMAL_IP, .hold_ms = 10 };
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, client_main, &clients[i]), 0);
+  }
+  wait_for_waiting(STANDING);
+  // every waiter is now well over the target
+  sleep_ms(20);
+  login_admission_leave();
+  int admitted = 0;
+  for (int i = 0; i < STANDING; i++) {
+    pthread_join(threads[i], NULL);
+    admitted += clients[i].admitted;
+  }
+  login_admission_get_stats(&after);
+  ck_assert_int_gt(admitted, 0);
+  ck_assert_int_lt(admitted, STANDING);
+  ck_assert_uint_eq(after.shed_delay - before.shed_delay, (uint64_t) (STANDING - admitted));
+  ck_assert_uint_eq(after.waiting, 0);
+  ck_assert(login_admission_configure(NULL));
+
+#test test_handle_login_reports_busy
+  account_store_clear();
+  account_t *acc = account_create("dave", "pw", "dave@example.com", "1990-01-01");
+  ck_assert(account_store_insert(acc));
+  configure(1, 50, 10000);
+  ck_assert(login_admission_enter(NORMAL_IP));
+  client_t queued = { .ip = NORMAL_IP };
+  pthread_t thread;
+  ck_assert_int_eq(pthread_create(&thread, NULL, client_main, &queued), 0);
+  wait_for_waiting(1);
+
+  int fds[2];
+  ck_assert_int_eq(pipe(fds), 0);
+  login_session_data_t session = { 0 };
+  ck_assert_int_eq(handle_login("dave", "pw", PRIORITY_IP, 1700000000, fds[1], &session),
+                   LOGIN_FAIL_INTERNAL_ERROR);
+  char reply[128] = { 0 };
+  ck_assert_int_gt(read(fds[0], reply, sizeof(reply) - 1), 0);
+  ck_assert_ptr_nonnull(strstr(reply, "try again later"));
+
+  login_admission_leave();
+  pthread_join(thread, NULL);
+  ck_assert_int_eq(handle_login("dave", "pw", PRIORITY_IP, 1700000000, fds[1], &session),
+                   LOGIN_SUCCESS);
+  close(fds[0]);
+  close(fds[1]);
+  ck_assert(login_admission_configure(NULL));
+  account_store_clear();
@@ -0,0 +1,207 @@
+#define CITS3007_PERMISSIVE
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "account_cache.h"
+#include "account_store.h"
+#include "db_backend.h"
+#include "db_sim.h"
+#include "login.h"
+#include "login_async.h"
+
+#define CLIENT_IP 0x0a000001
+#define LOGIN_TIME 1700000000
+
+typedef struct {
+  login_result_t result;
+  bool done;
+  login_session_data_t session;
+} outcome_t;
+
+static void record_outcome(void *ctx, login_result_t result)
+{
+  outcome_t *outcome = ctx;
+  outcome->result = result;
+  outcome->done = true;
+}
+
+static void add_account(const char *userid, const char *password)
+{
+  char email[EMAIL_LENGTH];
+  snprintf(email, sizeof(email), "%s@example.com", userid);
+  account_t *acc = account_create(userid, password, email, "2000-01-01");
+  ck_assert_ptr_nonnull(acc);
+  ck_assert(account_store_insert(acc));
+}
+
+static double elapsed_s(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static db_sim_t *install_sim(unsigned int latency_us)
+{
+  db_sim_options_t opts = { .latency_us = latency_us };
+  db_sim_t *sim = db_sim_create(&opts);
+  ck_assert_ptr_nonnull(sim);
+  db_backend_t backend;
+  db_sim_backend(sim, &backend);
+  db_backend_set(&backend);
+  return sim;
+}
+
+static void uninstall_sim(db_sim_t *sim)
+{
+  db_backend_set(NULL);
+  db_sim_destroy(sim);
+}
+
+static void run_until_done(login_async_t *la)
+{
+  while (login_async_in_flight(la) > 0) {
+    login_async_poll(la, -1);
+  }
+}
+
+#suite login_async_suite
+
+#tcase login_async_test_case
+
+#test test_async_results_match_handle_login
+  account_store_clear();
+  add_account("alice", "pw-alice");
+  add_account("bob", "pw-bob");
+  account_t banned;
+  ck_assert(account_store_lookup("bob", &banned));
+  account_set_unban_time(&banned, time(NULL) + 3600);
+  ck_assert(account_store_update(&banned));
+  int fd = open("/dev/null", O_WRONLY);
+  db_sim_t *sim = install_sim(2000);
+
+  login_async_t *la = login_async_create(NULL);
+  ck_assert_ptr_nonnull(la);
+  outcome_t ok = { 0 }, wrong = { 0 }, unknown = { 0 }, ban = { 0 };
+  ck_assert(login_async_submit(la, "alice", "pw-alice", CLIENT_IP, LOGIN_TIME, fd, &ok.session,
+                               record_outcome, &ok));
+  ck_assert(login_async_submit(la, "alice", "nope", CLIENT_IP, LOGIN_TIME, fd, &wrong.session,
+                               record_outcome, &wrong));
+  ck_assert(login_async_submit(la, "mallory", "pw", CLIENT_IP, LOGIN_TIME, fd,
+                               &unknown.session, record_outcome, &unknown));
+  ck_assert(login_async_submit(la, "bob", "pw-bob", CLIENT_IP, LOGIN_TIME, fd, &ban.session,
+                               record_outcome, &ban));
+  ck_assert_uint_eq(login_async_in_flight(la), 4);
+  // nothing is done until the lookups complete and the logins are polled
+  ck_assert(!ok.done);
+  run_until_done(la);
+
+  ck_assert(ok.done && wrong.done && unknown.done && ban.done);
+  ck_assert_int_eq(ok.result, LOGIN_SUCCESS);
+  ck_assert_int_eq(ok.session.session_start, LOGIN_TIME);
+  ck_assert_int_eq(wrong.result, LOGIN_FAIL_BAD_PASSWORD);
+  ck_assert_int_eq(unknown.result, LOGIN_FAIL_USER_NOT_FOUND);
+  ck_assert_int_eq(ban.result, LOGIN_FAIL_ACCOUNT_BANNED);
+
+  db_sim_stats_t stats;
+  db_sim_get_stats(sim, &stats);
+  ck_assert_uint_eq(stats.async_lookups, 4);
+  ck_assert_uint_eq(stats.lookups, 0);
+  ck_assert_uint_eq(stats.max_in_flight, 4);
+  login_async_stats_t la_stats;
+  login_async_get_stats(la, &la_stats);
+  ck_assert_uint_eq(la_stats.submitted, 4);
+  ck_assert_uint_eq(la_stats.completed, 4);
+
+  login_async_destroy(la);
+  uninstall_sim(sim);
+  close(fd);
+
+#test test_lookups_overlap
+  account_store_clear();
+  add_account("carol", "pw");
+  int fd = open("/dev/null", O_WRONLY);
+  db_sim_t *sim = install_sim(50000);
+  login_async_options_t opts = { .max_in_flight = 32 };
+  login_async_t *la = login_async_create(&opts);
+  ck_assert_ptr_nonnull(la);
+
+  outcome_t outcomes[33];
+  memset(outcomes, 0, sizeof(outcomes));
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < 32; i++) {
+    ck_assert(login_async_submit(la, "carol", "pw", CLIENT_IP, LOGIN_TIME, fd,
+                                 &outcomes[i].session, record_outcome, &outcomes[i]));
+  }
+  // full: the caller must poll to make room
+  ck_assert(!login_async_submit(la, "carol", "pw", CLIENT_IP, LOGIN_TIME, fd,
+                                &outcomes[32].session, record_outcome, &outcomes[32]));
+  run_until_done(la);
+  // 32 lookups of 50 ms each, waited for together rather than in turn
+  ck_assert(elapsed_s(&start) < 0.8);
+  for (int i = 0; i < 32; i++) {
+    ck_assert(outcomes[i].done);
+  }
+  ck_assert(!outcomes[32].done);
+  login_async_stats_t stats;
+  login_async_get_stats(la, &stats);
+  ck_assert_uint_eq(stats.rejected, 1);
+
+  // polling with nothing in flight returns at once
+  ck_assert_uint_eq(login_async_poll(la, -1), 0);
+  login_async_destroy(la);
+  uninstall_sim(sim);
+  close(fd);
+
+#test test_cache_hits_skip_the_backend
+  account_store_clear();
+  add_account("dave", "pw");
+  account_cache_options_t cache = { .max_bytes = 1 << 20 };
+  ck_assert(account_cache_configure(&cache));
+  int fd = open("/dev/null", O_WRONLY);
+  db_sim_t *sim = install_sim(1000);
+  login_async_t *la = login_async_create(NULL);
+
+  // a miss fetches and keeps the account
+  account_t acc;
+  ck_assert(account_cache_lookup("dave", &acc));
+  db_sim_stats_t before, after;
+  db_sim_get_stats(sim, &before);
+  ck_assert_uint_eq(before.lookups, 1);
+
+  outcome_t outcome = { 0 };
+  ck_assert(login_async_submit(la, "dave", "pw", CLIENT_IP, LOGIN_TIME, fd, &outcome.session,
+                               record_outcome, &outcome));
+  // answered from the cache, so ready without waiting on the backend
+  ck_assert_uint_eq(login_async_poll(la, 0), 1);
+  ck_assert_int_eq(outcome.result, LOGIN_SUCCESS);
+  db_sim_get_stats(sim, &after);
+  ck_assert_uint_eq(after.async_lookups, before.async_lookups);
+  ck_assert_uint_eq(after.lookups, before.lookups);
+
+  login_async_destroy(la);
+  uninstall_sim(sim);
+  ck_assert(account_cache_configure(&(account_cache_options_t) { 0 }));
+  close(fd);
+
+#test test_synchronous_backend
+  account_store_clear();
+  add_account("erin", "pw");
+  int fd = open("/dev/null", O_WRONLY);
+  db_backend_set(NULL);
+  login_async_t *la = login_async_create(NULL);
+  outcome_t outcome = { 0 };
+  ck_assert(login_async_submit(la, "erin", "pw", CLIENT_IP, LOGIN_TIME, fd, &outcome.session,
+                               record_outcome, &outcome));
+  ck_assert_uint_eq(login_async_poll(la, 0), 1);
+  ck_assert(outcome.done);
+  ck_assert_int_eq(outcome.result, LOGIN_SUCCESS);
+  login_async_destroy(la);
+  close(fd);
@@ -0,0 +1,131 @@
+#define CITS3007_PERMISSIVE
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "account_store.h"
+#include "db_backend.h"
+#include "login.h"
+#include "login_span.h"
+
+#define CLIENT_IP 0x0a000001
+
+static char exported[1 << 16];
+
+static void add_account(const char *userid, const char *password)
+{
+  account_t *acc = account_create(userid, password, "u@example.com", "2000-01-01");
+  ck_assert_ptr_nonnull(acc);
+  ck_assert(account_store_insert(acc));
+}
+
+static login_result_t login(const char *userid, const char *password)
+{
+  int fd = open("/dev/null", O_WRONLY);
+  login_session_data_t session;
+  login_result_t result = handle_login(userid, password, CLIENT_IP, time(NULL), fd, &session);
+  close(fd);
+  return result;
+}
+
+// export [from_ns, to_ns] into exported
+static void export_window(uint64_t from_ns, uint64_t to_ns)
+{
+  char path[] = "/tmp/login_span_testXXXXXX";
+  int fd = mkstemp(path);
+  ck_assert_int_ne(fd, -1);
+  unlink(path);
+  ck_assert(login_span_export(fd, from_ns, to_ns));
+  ck_assert_int_eq(lseek(fd, 0, SEEK_SET), 0);
+  ssize_t n = read(fd, exported, sizeof(exported) - 1);
+  ck_assert_int_gt(n, 0);
+  exported[n] = '\0';
+  close(fd);
+}
+
+#suite login_span_suite
+
+#tcase login_span_test_case
+
+#test test_sampled_login_has_its_stages
+  account_store_clear();
+  db_backend_set(NULL);
+  add_account("alice", "pw");
+  login_span_options_t opts = { .sample_every = 1 };
+  ck_assert(login_span_configure(&opts));
+  login_span_stats_t before, after;
+  login_span_get_stats(&before);
+  uint64_t start = login_span_now();
+
+  ck_assert_int_eq(login("alice", "pw"), LOGIN_SUCCESS);
+  login_span_get_stats(&after);
+  ck_assert_uint_eq(after.sampled, before.sampled + 1);
+  ck_assert_uint_gt(after.recorded, before.recorded);
+
+  export_window(start, 0);
+  ck_assert_ptr_nonnull(strstr(exported, "{\"traceEvents\":["));
+  // the stages, and the steps inside them
+  ck_assert_ptr_nonnull(strstr(exported, "\"name\":\"lookup\""));
+  ck_assert_ptr_nonnull(strstr(exported, "\"name\":\"hash\""));
+  ck_assert_ptr_nonnull(strstr(exported, "\"name\":\"pbkdf2\""));
+  ck_assert_ptr_nonnull(strstr(exported, "\"name\":\"write\""));
+  ck_assert_ptr_nonnull(strstr(exported, "\"name\":\"respond\""));
+  ck_assert_ptr_nonnull(strstr(exported, "\"name\":\"total\""));
+  ck_assert_ptr_nonnull(strstr(exported, "\"ph\":\"X\""));
+  ck_assert_ptr_nonnull(strstr(exported, "],\"displayTimeUnit\":\"ms\"}"));
+  ck_assert(login_span_configure(NULL));
+
+#test test_sampling_rate
+  account_store_clear();
+  db_backend_set(NULL);
+  add_account("bob", "pw");
+  login_span_options_t opts = { .sample_every = 4 };
+  ck_assert(login_span_configure(&opts));
+  login_span_stats_t before, after;
+  login_span_get_stats(&before);
+  for (int i = 0; i < 8; i++) {
+    ck_assert_int_eq(login("bob", i % 2 ? "pw" : "wrong"), i % 2 ? LOGIN_SUCCESS
+                                                                 : LOGIN_FAIL_BAD_PASSWORD);
+  }
+  login_span_get_stats(&after);
+  ck_assert_uint_eq(after.sampled, before.sampled + 2);
+
+  // with sampling off, nothing is recorded
+  ck_assert(login_span_configure(NULL));
+  login_span_get_stats(&before);
+  ck_assert_int_eq(login("bob", "pw"), LOGIN_SUCCESS);
+  login_span_get_stats(&after);
+  ck_assert_uint_eq(after.sampled, before.sampled);
+  ck_assert_uint_eq(after.recorded, before.recorded);
+
+#test test_window_and_ring
+  login_span_options_t opts = { .sample_every = 1, .buffer_spans = 4 };
+  ck_assert(login_span_configure(&opts));
+  // changing the buffer size drops what was recorded
+  export_window(0, 0);
+  ck_assert_ptr_null(strstr(exported, "\"name\""));
+
+  login_span_record(7, "early", 1000, 2000);
+  login_span_record(7, "late", 5000, 6500);
+  export_window(4000, 7000);
+  ck_assert_ptr_null(strstr(exported, "\"name\":\"early\""));
+  ck_assert_ptr_nonnull(strstr(exported, "{\"name\":\"late\",\"cat\":\"login\",\"ph\":\"X\","
+                                         "\"ts\":5.000,\"dur\":1.500,"));
+  ck_assert_ptr_nonnull(strstr(exported, "\"args\":{\"login\":7}"));
+
+  // the oldest spans make way for new ones
+  login_span_stats_t before, after;
+  login_span_get_stats(&before);
+  for (int i = 0; i < 4; i++) {
+    login_span_record(8, "filler", 10000, 11000);
+  }
+  login_span_get_stats(&after);
+  ck_assert_uint_eq(after.overwritten, before.overwritten + 2);
+  export_window(0, 0);
+  ck_assert_ptr_null(strstr(exported, "\"name\":\"late\""));
+  ck_assert(login_span_configure(NULL));
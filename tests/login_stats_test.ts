@@ -0,0 +1,99 @@
+#define CITS3007_PERMISSIVE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "account_store.h"
+#include "login.h"
+#include "login_stats.h"
+
+#suite login_stats_suite
+
+#tcase login_stats_test_case
+
+static void *record_from_thread(void *arg)
+{
+  (void) arg;
+  for (int i = 0; i < 1000; i++) {
+    login_stats_record_result(LOGIN_FAIL_ACCOUNT_BANNED);
+  }
+  return NULL;
+}
+
+#test test_results_aggregate_across_threads
+  login_stats_snapshot_t *before = malloc(sizeof(*before));
+  login_stats_snapshot_t *after = malloc(sizeof(*after));
+  login_stats_aggregate(before);
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, record_from_thread, NULL);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  login_stats_aggregate(after);
+  ck_assert_uint_eq(after->results[LOGIN_FAIL_ACCOUNT_BANNED]
+                    - before->results[LOGIN_FAIL_ACCOUNT_BANNED], 4000);
+  free(before);
+  free(after);
+
+#test test_handle_login_records_stages
+  int devnull = open("/dev/null", O_WRONLY);
+  login_stats_snapshot_t *stats = malloc(sizeof(*stats));
+  login_stats_aggregate(stats);
+  uint64_t lookups = stats->stage_count[LOGIN_STAGE_LOOKUP];
+  uint64_t checks = stats->stage_count[LOGIN_STAGE_CHECKS];
+  uint64_t totals = stats->stage_count[LOGIN_STAGE_TOTAL];
+  uint64_t not_found = stats->results[LOGIN_FAIL_USER_NOT_FOUND];
+
+  login_session_data_t session = { 0 };
+  handle_login("no-such-user", "pw", 0, 0, devnull, &session);
+
+  login_stats_aggregate(stats);
+  ck_assert_uint_eq(stats->stage_count[LOGIN_STAGE_LOOKUP], lookups + 1);
+  // an account that is not found still closes the checks stage
+  ck_assert_uint_eq(stats->stage_count[LOGIN_STAGE_CHECKS], checks + 1);
+  ck_assert_uint_eq(stats->stage_count[LOGIN_STAGE_TOTAL], totals + 1);
+  ck_assert_uint_eq(stats->results[LOGIN_FAIL_USER_NOT_FOUND], not_found + 1);
+  ck_assert(login_stats_dump(devnull));
+  free(stats);
+  close(devnull);
+
+#test test_disabled_records_nothing
+  login_stats_snapshot_t *stats = malloc(sizeof(*stats));
+  login_stats_set_enabled(false);
+  login_stats_aggregate(stats);
+  uint64_t banned = stats->results[LOGIN_FAIL_ACCOUNT_BANNED];
+  ck_assert_uint_eq(login_stats_now(), 0);
+  login_stats_record_result(LOGIN_FAIL_ACCOUNT_BANNED);
+  login_stats_aggregate(stats);
+  ck_assert_uint_eq(stats->results[LOGIN_FAIL_ACCOUNT_BANNED], banned);
+  login_stats_set_enabled(true);
+  free(stats);
+
+#test test_store_account_locks_out
+  int devnull = open("/dev/null", O_WRONLY);
+  account_store_clear();
+  account_t *acc = account_create("erin", "pw-erin", "erin@example.com", "1990-01-01");
+  ck_assert_ptr_nonnull(acc);
+  ck_assert(account_store_insert(acc));
+  login_session_data_t session = { 0 };
+  // the failure count has to persist between attempts to reach the limit
+  for (int i = 0; i < 11; i++) {
+    ck_assert_int_eq(handle_login("erin", "wrong", 0, 0, devnull, &session),
+                     LOGIN_FAIL_BAD_PASSWORD);
+  }
+  account_t stored;
+  ck_assert(account_store_lookup("erin", &stored));
+  ck_assert_uint_eq(stored.login_fail_count, 11);
+  ck_assert_int_eq(handle_login("erin", "pw-erin", 0, 0, devnull, &session),
+                   LOGIN_FAIL_IP_BANNED);
+  account_store_clear();
+  close(devnull);
+
+// vim: syntax=c :
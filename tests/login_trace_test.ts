@@ -0,0 +1,138 @@
+#define CITS3007_PERMISSIVE
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "latency_histogram.h"
+#include "login.h"
+#include "login_replay.h"
+#include "login_trace.h"
+
+#define TRACE_PATH "login_trace_test.trace"
+
+#suite login_trace_suite
+
+#tcase latency_histogram_test_case
+
+#test test_histogram_buckets_cover_values
+  // every value must land in a bucket whose bounds contain it
+  uint64_t values[] = { 0, 1, 127, 128, 129, 255, 256, 1000, 123456789, UINT64_MAX };
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    size_t index = latency_histogram_bucket_index(values[i]);
+    ck_assert_uint_lt(index, LATENCY_HISTOGRAM_BUCKETS);
+    ck_assert_uint_le(latency_histogram_bucket_low(index), values[i]);
+    ck_assert_uint_ge(latency_histogram_bucket_high(index), values[i]);
+  }
+
+#test test_histogram_percentiles
+  latency_histogram_t *h = malloc(sizeof(*h));
+  latency_histogram_init(h);
+  for (uint64_t v = 1; v <= 1000; v++) {
+    latency_histogram_record(h, v * 1000);
+  }
+  ck_assert_uint_eq(h->total_count, 1000);
+  ck_assert_uint_eq(h->min, 1000);
+  ck_assert_uint_eq(h->max, 1000000);
+  // within 1% of the exact answer
+  uint64_t p50 = latency_histogram_percentile(h, 50.0);
+  ck_assert_uint_ge(p50, 500000);
+  ck_assert_uint_le(p50, 505000);
+  uint64_t p99 = latency_histogram_percentile(h, 99.0);
+  ck_assert_uint_ge(p99, 990000);
+  ck_assert_uint_le(p99, 1000000);
+  ck_assert_uint_eq(latency_histogram_percentile(h, 100.0), 1000000);
+  free(h);
+
+#tcase login_trace_test_case
+
+#test test_trace_round_trip
+  int devnull = open("/dev/null", O_WRONLY);
+  ck_assert_int_ne(devnull, -1);
+  ck_assert(login_trace_start(TRACE_PATH));
+  ck_assert(login_trace_is_active());
+  login_session_data_t session = { 0 };
+  login_result_t result = handle_login("no-such-user", "pw", 0x0a000001, 1700000000, devnull, &session);
+  ck_assert_int_eq(result, LOGIN_FAIL_USER_NOT_FOUND);
+  // arrived 50ms after the first login
+  login_trace_record("carol", LOGIN_FAIL_BAD_PASSWORD, 0x7f000001, 1600000000,
+                     login_trace_now() + 50000000);
+  ck_assert(login_trace_stop());
+  ck_assert(!login_trace_is_active());
+  close(devnull);
+
+  login_trace_reader_t *reader = malloc(sizeof(*reader));
+  login_trace_record_t record;
+  ck_assert(login_trace_reader_open(reader, TRACE_PATH));
+  ck_assert_int_eq(login_trace_reader_next(reader, &record), 1);
+  ck_assert_str_eq(record.userid, "no-such-user");
+  ck_assert_uint_eq(record.ip, 0x0a000001);
+  ck_assert_int_eq(record.login_time, 1700000000);
+  ck_assert_int_eq(record.result, LOGIN_FAIL_USER_NOT_FOUND);
+  ck_assert_int_eq(record.password_class, LOGIN_TRACE_PASSWORD_UNCHECKED);
+  uint64_t first_arrival_us = record.arrival_us;
+  ck_assert_int_eq(login_trace_reader_next(reader, &record), 1);
+  ck_assert_str_eq(record.userid, "carol");
+  ck_assert_uint_ge(record.arrival_us - first_arrival_us, 50000);
+  ck_assert_int_eq(record.login_time, 1600000000);
+  ck_assert_int_eq(record.password_class, LOGIN_TRACE_PASSWORD_WRONG);
+  ck_assert_int_eq(login_trace_reader_next(reader, &record), 0);
+  login_trace_reader_close(reader);
+  free(reader);
+
+#test test_replay_reports_by_result
+  int devnull = open("/dev/null", O_WRONLY);
+  ck_assert(login_trace_start(TRACE_PATH));
+  for (int i = 0; i < 20; i++) {
+    login_session_data_t session = { 0 };
+    handle_login("no-such-user", "pw", 0x0a000001, 1700000000, devnull, &session);
+  }
+  ck_assert(login_trace_stop());
+
+  login_replay_options_t opts = {
+    .speed = 0, .threads = 2, .correct_password = "pw", .wrong_password = "bad",
+    .client_output_fd = devnull
+  };
+  login_replay_report_t *report = malloc(sizeof(*report));
+  ck_assert(login_replay_run(TRACE_PATH, &opts, report));
+  ck_assert_uint_eq(report->requests, 20);
+  ck_assert_uint_eq(report->mismatches, 0);
+  ck_assert_uint_eq(report->by_result[LOGIN_FAIL_USER_NOT_FOUND].total_count, 20);
+  ck_assert_uint_eq(report->by_result[LOGIN_SUCCESS].total_count, 0);
+  free(report);
+  close(devnull);
+  unlink(TRACE_PATH);
+
+#test test_replay_keeps_recorded_gaps
+  int devnull = open("/dev/null", O_WRONLY);
+  ck_assert(login_trace_start(TRACE_PATH));
+  // a burst of two, then one 200ms later; completion order differs from arrival order
+  uint64_t arrival = login_trace_now();
+  login_trace_record("no-such-user", LOGIN_FAIL_USER_NOT_FOUND, 0x0a000001, 1700000000,
+                     arrival + 1000000);
+  login_trace_record("no-such-user", LOGIN_FAIL_USER_NOT_FOUND, 0x0a000001, 1700000000, arrival);
+  login_trace_record("no-such-user", LOGIN_FAIL_USER_NOT_FOUND, 0x0a000001, 1700000000,
+                     arrival + 200000000);
+  ck_assert(login_trace_stop());
+
+  login_replay_options_t opts = {
+    .speed = 1, .threads = 2, .correct_password = "pw", .wrong_password = "bad",
+    .client_output_fd = devnull
+  };
+  login_replay_report_t *report = malloc(sizeof(*report));
+  ck_assert(login_replay_run(TRACE_PATH, &opts, report));
+  ck_assert_uint_eq(report->requests, 3);
+  ck_assert_uint_eq(report->mismatches, 0);
+  ck_assert_uint_ge(report->elapsed_ns, 199000000);
+  // twice as fast halves the gap
+  opts.speed = 2;
+  ck_assert(login_replay_run(TRACE_PATH, &opts, report));
+  ck_assert_uint_ge(report->elapsed_ns, 99000000);
+  ck_assert_uint_lt(report->elapsed_ns, 199000000);
+  free(report);
+  close(devnull);
+  unlink(TRACE_PATH);
+
+// vim: syntax=c :
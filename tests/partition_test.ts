@@ -0,0 +1,390 @@
+#define CITS3007_PERMISSIVE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "account_store.h"
+#include "db_backend.h"
+#include "login.h"
+#include "partition_client.h"
+#include "partition_ring.h"
+#include "partition_server.h"
+#include "userid_filter.h"
+#include "userid_key.h"
+#include "test_fixtures.h"
+
+#define CLIENT_IP 0x0a000001
+#define RING_KEYS 20000
+#define ACCOUNTS 2000
+#define SERVERS 3
+
+static uint64_t hash_of(unsigned int i)
+{
+  char userid[32];
+  int len = snprintf(userid, sizeof(userid), "user%u", i);
+  return userid_key_hash(userid, (size_t) len);
+}
+
+/**
+ * Partition server processes, each with its socket in dir, exiting when
+ * quit_fd is closed.
+ */
+typedef struct {
+  char dir[32];
+  char paths[SERVERS][64];
+  const char *path_ptrs[SERVERS];
+  pid_t pids[SERVERS];
+  int quit_fd;
+} servers_t;
+
+static void start_servers(servers_t *s)
+{
+  strcpy(s->dir, "/tmp/partition_test-XXXXXX");
+  ck_assert_ptr_nonnull(mkdtemp(s->dir));
+  int ready[2];
+  int quit[2];
+  ck_assert_int_eq(pipe(ready), 0);
+  ck_assert_int_eq(pipe(quit), 0);
+  for (int i = 0; i < SERVERS; i++) {
+    snprintf(s->paths[i], sizeof(s->paths[i]), "%s/%d.sock", s->dir, i);
+    s->path_ptrs[i] = s->paths[i];
+    s->pids[i] = fork();
+    if (s->pids[i] == 0) {
+      close(ready[0]);
+      close(quit[1]);
+      // not what this process's earlier tests stored
+      account_store_clear();
+      partition_server_t *server = partition_server_start(s->paths[i]);
+      char byte = server != NULL;
+      if (write(ready[1], &byte, 1) != 1 || !server) {
+        _exit(1);
+      }
+      while (read(quit[0], &byte, 1) != 0) {
+        continue;
+      }
+      partition_server_stop(server);
+      _exit(0);
+    }
+  }
+  close(ready[1]);
+  close(quit[0]);
+  for (int i = 0; i < SERVERS; i++) {
+    char byte = 0;
+    ck_assert_int_eq(read(ready[0], &byte, 1), 1);
+    ck_assert(byte);
+  }
+  close(ready[0]);
+  s->quit_fd = quit[1];
+}
+
+static void stop_servers(servers_t *s)
+{
+  close(s->quit_fd);
+  for (int i = 0; i < SERVERS; i++) {
+    int status;
+    ck_assert_int_eq(waitpid(s->pids[i], &status, 0), s->pids[i]);
+    ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  ck_assert_int_eq(rmdir(s->dir), 0);
+}
+
+static uint64_t total(const uint64_t *counts, size_t n)
+{
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += counts[i];
+  }
+  return sum;
+}
+
+static void assert_all_found(partition_client_t *client)
+{
+  static const char *userids[ACCOUNTS];
+  static char names[ACCOUNTS][32];
+  static account_t accs[ACCOUNTS];
+  static bool found[ACCOUNTS];
+  for (unsigned int i = 0; i < ACCOUNTS; i++) {
+    snprintf(names[i], sizeof(names[i]), "user%u", i);
+    userids[i] = names[i];
+  }
+  ck_assert(partition_client_lookup_many(client, userids, ACCOUNTS, accs, found));
+  for (unsigned int i = 0; i < ACCOUNTS; i++) {
+    ck_assert(found[i]);
+    ck_assert_int_eq(accs[i].account_id, (int64_t) i + 1);
+  }
+}
+
+typedef struct {
+  partition_client_t *client;
+  atomic_bool stop;
+  atomic_uint missing;
+  atomic_uint rounds;
+} looker_t;
+
+// looks every account up, one at a time, until told to stop
+static void *look_up_all(void *arg)
+{
+  looker_t *looker = arg;
+  while (!atomic_load(&looker->stop)) {
+    for (unsigned int i = 0; i < ACCOUNTS; i++) {
+      char userid[32];
+      snprintf(userid, sizeof(userid), "user%u", i);
+      account_t acc;
+      if (!partition_client_lookup(looker->client, userid, &acc)) {
+        atomic_fetch_add(&looker->missing, 1);
+      }
+    }
+    atomic_fetch_add(&looker->rounds, 1);
+  }
+  return NULL;
+}
+
+#suite partition_suite
+
+#tcase partition_test_case
+
+#test test_ring_spreads_and_moves_little
+  const char *names[] = { "a.sock", "b.sock", "c.sock", "d.sock", "e.sock" };
+  partition_ring_t *four = partition_ring_create(names, 4, 0);
+  partition_ring_t *five = partition_ring_create(names, 5, 0);
+  ck_assert_ptr_nonnull(four);
+  ck_assert_ptr_nonnull(five);
+  ck_assert_uint_eq(partition_ring_size(five), 5);
+
+  size_t owned[4] = { 0 };
+  size_t moved = 0;
+  for (unsigned int i = 0; i < RING_KEYS; i++) {
+    size_t before = partition_ring_owner(four, hash_of(i));
+    size_t after = partition_ring_owner(five, hash_of(i));
+    owned[before]++;
+    if (after != before) {
+      // only ever to the partition added
+      ck_assert_uint_eq(after, 4);
+      moved++;
+    }
+  }
+  for (int p = 0; p < 4; p++) {
+    ck_assert_uint_gt(owned[p], RING_KEYS * 15 / 100);
+    ck_assert_uint_lt(owned[p], RING_KEYS * 35 / 100);
+  }
+  ck_assert_uint_gt(moved, RING_KEYS / 10);
+  ck_assert_uint_lt(moved, RING_KEYS * 3 / 10);
+  partition_ring_destroy(four);
+  partition_ring_destroy(five);
+  // a ring whose points cannot be counted in a size_t is refused up front
+  ck_assert_ptr_null(partition_ring_create(names, SIZE_MAX / 2, 1000));
+
+#test test_server_serves_local_store
+  char dir[] = "/tmp/partition_test-XXXXXX";
+  ck_assert_ptr_nonnull(mkdtemp(dir));
+  char path[64];
+  snprintf(path, sizeof(path), "%s/local.sock", dir);
+  partition_server_t *server = partition_server_start(path);
+  ck_assert_ptr_nonnull(server);
+  const char *paths[] = { path };
+  partition_client_t *client = partition_client_create(paths, 1, NULL);
+  ck_assert_ptr_nonnull(client);
+
+  account_t acc = fixture_account("user7", 8);
+  ck_assert(partition_client_put(client, &acc));
+  account_t stored;
+  ck_assert(account_store_lookup("user7", &stored));
+  ck_assert_str_eq(stored.email, "user7@example.com");
+
+  // a second account with the same email is refused
+  account_t clash = fixture_account("user8", 9);
+  strcpy(clash.email, acc.email);
+  ck_assert(!partition_client_put(client, &clash));
+  ck_assert(!account_store_contains("user8"));
+
+  partition_server_stats_t stats;
+  partition_server_get_stats(server, &stats);
+  ck_assert_uint_eq(stats.connections, 1);
+  ck_assert_uint_eq(stats.requests, 2);
+
+  partition_server_stop(server);
+  ck_assert(!partition_client_lookup(client, "user7", &stored));
+  partition_client_destroy(client);
+  ck_assert_int_eq(rmdir(dir), 0);
+
+#test test_client_routes_pipelines_and_rebalances
+  servers_t s;
+  start_servers(&s);
+  // small pages, so that every shard is scanned in several
+  partition_client_options_t opts = { .scan_page = 5 };
+  partition_client_t *client = partition_client_create(s.path_ptrs, 2, &opts);
+  ck_assert_ptr_nonnull(client);
+
+  static account_t accs[ACCOUNTS];
+  for (unsigned int i = 0; i < ACCOUNTS; i++) {
+    char userid[32];
+    snprintf(userid, sizeof(userid), "user%u", i);
+    accs[i] = fixture_account(userid, (int64_t) i + 1);
+  }
+  ck_assert(partition_client_put_many(client, accs, ACCOUNTS));
+  uint64_t counts[SERVERS];
+  ck_assert(partition_client_counts(client, counts));
+  ck_assert_uint_eq(total(counts, 2), ACCOUNTS);
+  ck_assert_uint_gt(counts[0], 0);
+  ck_assert_uint_gt(counts[1], 0);
+  assert_all_found(client);
+
+  // replies come back in batches, not one round trip each
+  partition_client_stats_t stats;
+  partition_client_get_stats(client, &stats);
+  ck_assert_uint_lt(stats.round_trips * 10, stats.requests);
+
+  const char *userids[] = { "user5", "nobody", "", "user6" };
+  account_t found_accs[4];
+  bool found[4];
+  ck_assert(partition_client_lookup_many(client, userids, 4, found_accs, found));
+  ck_assert(found[0] && !found[1] && !found[2] && found[3]);
+  ck_assert_str_eq(found_accs[3].userid, "user6");
+
+  account_t acc = accs[5];
+  acc.login_count = 9;
+  acc.last_ip = CLIENT_IP;
+  acc.unban_time = 12345;
+  ck_assert(partition_client_record_login(client, &acc));
+  ck_assert(partition_client_lookup(client, "user5", &acc));
+  ck_assert_uint_eq(acc.login_count, 9);
+  ck_assert_uint_eq(acc.last_ip, CLIENT_IP);
+  ck_assert_int_eq(acc.unban_time, 0);
+
+  // onto a third partition, then off the first, while lookups carry on
+  looker_t looker = { .client = client };
+  pthread_t thread;
+  ck_assert_int_eq(pthread_create(&thread, NULL, look_up_all, &looker), 0);
+  partition_rebalance_report_t report;
+  ck_assert(partition_client_rebalance(client, s.path_ptrs, 3, &report));
+  atomic_store(&looker.stop, true);
+  pthread_join(thread, NULL);
+  ck_assert_uint_eq(atomic_load(&looker.missing), 0);
+  ck_assert_uint_eq(partition_client_partitions(client), 3);
+  ck_assert_uint_gt(report.moved, 0);
+  ck_assert_uint_lt(report.moved, ACCOUNTS / 2);
+  ck_assert_uint_eq(report.failed, 0);
+  ck_assert(partition_client_counts(client, counts));
+  ck_assert_uint_eq(counts[2], report.moved);
+  ck_assert_uint_eq(total(counts, 3), ACCOUNTS);
+  assert_all_found(client);
+  ck_assert(partition_client_lookup(client, "user5", &acc));
+  ck_assert_uint_eq(acc.login_count, 9);
+
+  const char *last_two[] = { s.paths[1], s.paths[2] };
+  uint64_t first = counts[0];
+  ck_assert(partition_client_rebalance(client, last_two, 2, &report));
+  ck_assert_uint_eq(report.moved, first);
+  ck_assert(partition_client_counts(client, counts));
+  ck_assert_uint_eq(total(counts, 2), ACCOUNTS);
+  assert_all_found(client);
+
+  ck_assert(partition_client_remove(client, "user5"));
+  ck_assert(!partition_client_remove(client, "user5"));
+  ck_assert(!partition_client_lookup(client, "user5", &acc));
+  partition_client_destroy(client);
+  stop_servers(&s);
+
+#test test_dropped_partition_kept_until_empty
+  servers_t s;
+  start_servers(&s);
+  partition_client_t *client = partition_client_create(s.path_ptrs, 2, NULL);
+  ck_assert_ptr_nonnull(client);
+  static account_t accs[ACCOUNTS];
+  for (unsigned int i = 0; i < ACCOUNTS; i++) {
+    char userid[32];
+    snprintf(userid, sizeof(userid), "user%u", i);
+    accs[i] = fixture_account(userid, (int64_t) i + 1);
+  }
+  ck_assert(partition_client_put_many(client, accs, ACCOUNTS));
+
+  // block the move of an account on the first partition: its new owner
+  // already has an account with its email
+  const char *last_two[] = { s.paths[1], s.paths[2] };
+  partition_ring_t *before = partition_ring_create(s.path_ptrs, 2, 0);
+  partition_ring_t *after = partition_ring_create(last_two, 2, 0);
+  unsigned int i = 0;
+  while (partition_ring_owner(before, hash_of(i)) != 0) {
+    i++;
+  }
+  size_t owner = partition_ring_owner(after, hash_of(i));
+  // and the blocking account must not be moved itself
+  char blocker_id[32];
+  for (unsigned int b = 0;; b++) {
+    int len = snprintf(blocker_id, sizeof(blocker_id), "blocker%u", b);
+    if (partition_ring_owner(after, userid_key_hash(blocker_id, (size_t) len)) == owner) {
+      break;
+    }
+  }
+  partition_ring_destroy(before);
+  partition_ring_destroy(after);
+  partition_client_t *direct = partition_client_create(&last_two[owner], 1, NULL);
+  ck_assert_ptr_nonnull(direct);
+  account_t blocker = fixture_account(blocker_id, ACCOUNTS + 1);
+  strcpy(blocker.email, accs[i].email);
+  ck_assert(partition_client_put(direct, &blocker));
+
+  partition_rebalance_report_t report;
+  ck_assert(!partition_client_rebalance(client, last_two, 2, &report));
+  ck_assert_uint_eq(report.failed, 1);
+  account_t acc;
+  ck_assert(!partition_client_lookup(client, accs[i].userid, &acc));
+
+  // the first partition was kept, so a retry finds what is left on it
+  ck_assert(partition_client_remove(direct, blocker_id));
+  ck_assert(partition_client_rebalance(client, last_two, 2, &report));
+  ck_assert_uint_eq(report.moved, 1);
+  ck_assert_uint_eq(report.failed, 0);
+  ck_assert(partition_client_lookup(client, accs[i].userid, &acc));
+  uint64_t counts[2];
+  ck_assert(partition_client_counts(client, counts));
+  ck_assert_uint_eq(total(counts, 2), ACCOUNTS);
+  partition_client_destroy(direct);
+  partition_client_destroy(client);
+  stop_servers(&s);
+
+#test test_backend
+  servers_t s;
+  start_servers(&s);
+  partition_client_t *client = partition_client_create(s.path_ptrs, SERVERS, NULL);
+  ck_assert_ptr_nonnull(client);
+  account_t *carol = account_create("carol", "pw", "carol@example.com", "2000-01-01");
+  ck_assert_ptr_nonnull(carol);
+  ck_assert(partition_client_put(client, carol));
+  account_free(carol);
+
+  db_backend_t backend;
+  partition_client_backend(client, &backend);
+  db_backend_set(&backend);
+  ck_assert(userid_filter_rebuild(0, 0));
+  ck_assert(userid_filter_may_contain("carol"));
+  int fd = open("/dev/null", O_WRONLY);
+  login_session_data_t session;
+  ck_assert_int_eq(handle_login("carol", "wrong", CLIENT_IP, time(NULL), fd, &session),
+                   LOGIN_FAIL_BAD_PASSWORD);
+  account_t acc;
+  ck_assert(partition_client_lookup(client, "carol", &acc));
+  ck_assert_uint_eq(acc.login_fail_count, 1);
+  ck_assert_int_eq(handle_login("carol", "pw", CLIENT_IP, time(NULL), fd, &session),
+                   LOGIN_SUCCESS);
+  ck_assert(partition_client_lookup(client, "carol", &acc));
+  ck_assert_uint_eq(acc.login_fail_count, 0);
+  ck_assert_uint_eq(acc.login_count, 1);
+  ck_assert_uint_eq(acc.last_ip, CLIENT_IP);
+  ck_assert_int_eq(handle_login("nobody", "pw", CLIENT_IP, time(NULL), fd, &session),
+                   LOGIN_FAIL_USER_NOT_FOUND);
+  userid_filter_disable();
+  db_backend_set(NULL);
+  close(fd);
+  partition_client_destroy(client);
+  stop_servers(&s);
@@ -0,0 +1,105 @@
+#define CITS3007_PERMISSIVE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "rand_pool.h"
+
+#define THREADS 4
+#define DRAWS_PER_THREAD 1000
+#define SALT_BYTES 16
+
+static void *draw_salts(void *arg)
+{
+  unsigned char previous[SALT_BYTES] = { 0 };
+  for (int i = 0; i < DRAWS_PER_THREAD; i++) {
+    unsigned char salt[SALT_BYTES];
+    if (!rand_pool_bytes(salt, sizeof(salt)) || memcmp(salt, previous, sizeof(salt)) == 0) {
+      *(bool *) arg = false;
+    }
+    memcpy(previous, salt, sizeof(salt));
+  }
+  return NULL;
+}
+
+#suite rand_pool_suite
+
+#tcase rand_pool_test_case
+
+#test test_pooled_draws
+  rand_pool_options_t opts = { .refill_bytes = 1024 };
+  ck_assert(rand_pool_configure(&opts));
+  rand_pool_stats_t before;
+  rand_pool_get_stats(&before);
+  unsigned char a[SALT_BYTES];
+  unsigned char b[SALT_BYTES];
+  ck_assert(rand_pool_bytes(a, sizeof(a)));
+  ck_assert(rand_pool_bytes(b, sizeof(b)));
+  ck_assert(memcmp(a, b, sizeof(a)) != 0);
+  // one refill serves 1024 / 16 salts
+  for (int i = 0; i < 62; i++) {
+    ck_assert(rand_pool_bytes(a, sizeof(a)));
+  }
+  rand_pool_stats_t after;
+  rand_pool_get_stats(&after);
+  ck_assert_uint_le(after.refills - before.refills, 1);
+  ck_assert_uint_eq(after.direct, before.direct);
+
+  // too large for the pool, or pooling off: straight to OpenSSL
+  unsigned char big[512];
+  ck_assert(rand_pool_bytes(big, sizeof(big)));
+  ck_assert(rand_pool_configure(NULL));
+  ck_assert(rand_pool_bytes(a, sizeof(a)));
+  rand_pool_get_stats(&after);
+  ck_assert_uint_eq(after.direct, before.direct + 2);
+
+  opts.refill_bytes = RAND_POOL_MAX_REFILL + 1;
+  ck_assert(!rand_pool_configure(&opts));
+  ck_assert(rand_pool_configure(&(rand_pool_options_t) { 0 }));
+
+#test test_threads
+  bool ok = true;
+  pthread_t threads[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, draw_salts, &ok), 0);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  ck_assert(ok);
+  rand_pool_stats_t stats;
+  rand_pool_get_stats(&stats);
+  ck_assert_uint_ge(stats.pools, 1);
+  ck_assert_uint_le(stats.pools, THREADS + 1);
+
+#test test_fork_child_draws_fresh_bytes
+  ck_assert(rand_pool_configure(&(rand_pool_options_t) { 0 }));
+  unsigned char salt[SALT_BYTES];
+  ck_assert(rand_pool_bytes(salt, sizeof(salt)));
+
+  int fds[2];
+  ck_assert_int_eq(pipe(fds), 0);
+  pid_t child = fork();
+  ck_assert_int_ne(child, -1);
+  if (child == 0) {
+    close(fds[0]);
+    rand_pool_stats_t stats;
+    rand_pool_get_stats(&stats);
+    bool drew = rand_pool_bytes(salt, sizeof(salt));
+    ssize_t written = write(fds[1], salt, sizeof(salt));
+    _exit(drew && written == (ssize_t) sizeof(salt) && stats.fork_wipes >= 1 ? 0 : 1);
+  }
+  close(fds[1]);
+  unsigned char parent_salt[SALT_BYTES];
+  unsigned char child_salt[SALT_BYTES];
+  ck_assert(rand_pool_bytes(parent_salt, sizeof(parent_salt)));
+  ck_assert_int_eq(read(fds[0], child_salt, sizeof(child_salt)), sizeof(child_salt));
+  close(fds[0]);
+  int status;
+  ck_assert_int_eq(waitpid(child, &status, 0), child);
+  ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  // without the wipe, the child would hand out the parent's next bytes
+  ck_assert(memcmp(parent_salt, child_salt, sizeof(parent_salt)) != 0);
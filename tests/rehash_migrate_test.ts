@@ -0,0 +1,192 @@
+#define CITS3007_PERMISSIVE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "account_store.h"
+#include "userid_key.h"
+#include "password_hash.h"
+#include "rehash_migrate.h"
+#include "test_fixtures.h"
+
+#define CHECKPOINT_PATH "rehash_test.checkpoint"
+#define ACCOUNTS 200
+#define ITERATIONS 1500
+
+static size_t shard_of(const char *userid)
+{
+  return (size_t) (userid_key_hash(userid, strlen(userid)) >> 58);
+}
+
+// checks every password still validates; returns how many hashes are wrapped
+static int check_passwords(void)
+{
+  int wrapped = 0;
+  for (int i = 0; i < ACCOUNTS; i++) {
+    char userid[32];
+    snprintf(userid, sizeof(userid), "user%d", i);
+    account_t acc;
+    ck_assert(account_store_lookup(userid, &acc));
+    ck_assert(account_validate_password(&acc, FIXTURE_PASSWORD));
+    ck_assert(!account_validate_password(&acc, "wrong"));
+    wrapped += password_hash_is_wrapped(acc.password_hash);
+  }
+  return wrapped;
+}
+
+#suite rehash_migrate_suite
+
+#tcase password_hash_test_case
+
+#test test_wrapped_hash_verifies
+  account_t *acc = account_create("alice", "hunter2", "alice@example.com", "1990-01-01");
+  ck_assert(!password_hash_is_wrapped(acc->password_hash));
+  char legacy[HASH_LENGTH];
+  strcpy(legacy, acc->password_hash);
+
+  char wrapped[HASH_LENGTH];
+  ck_assert(password_hash_wrap(legacy, 2000, wrapped, sizeof(wrapped)));
+  ck_assert(strncmp(wrapped, "$w1$2000$", 9) == 0);
+  ck_assert_uint_eq(password_hash_wrapped_iterations(wrapped), 2000);
+  // the salt is kept
+  ck_assert(strncmp(wrapped + 9, legacy, 33) == 0);
+  ck_assert(password_hash_verify_wrapped(wrapped, "hunter2"));
+  ck_assert(!password_hash_verify_wrapped(wrapped, "hunter3"));
+
+  strcpy(acc->password_hash, wrapped);
+  ck_assert(account_validate_password(acc, "hunter2"));
+  ck_assert(!account_validate_password(acc, "hunter3"));
+  account_free(acc);
+
+#test test_malformed_hashes_are_rejected
+  char out[HASH_LENGTH];
+  ck_assert(!password_hash_wrap("", 2000, out, sizeof(out)));
+  ck_assert(!password_hash_wrap("zz:zz", 2000, out, sizeof(out)));
+  ck_assert(!password_hash_is_wrapped("$w1$$00:00"));
+  ck_assert(!password_hash_is_wrapped("$w1$0$00:00"));
+  ck_assert(!password_hash_verify_wrapped("$w1$10$00:00", "pw"));
+
+#test test_new_hashes_record_their_cost
+  password_hash_set_cost(1500);
+  ck_assert_uint_eq(password_hash_cost(), 1500);
+  account_t *acc = account_create("bob", "s3cret", "bob@example.com", "1990-01-01");
+  ck_assert_ptr_nonnull(acc);
+  ck_assert(strncmp(acc->password_hash, "$p2$1500$", 9) == 0);
+  ck_assert_uint_eq(password_hash_pbkdf2_iterations(acc->password_hash), 1500);
+  ck_assert(account_validate_password(acc, "s3cret"));
+  ck_assert(!account_validate_password(acc, "s3cret!"));
+
+  // hashes made at an earlier cost keep verifying after the cost changes
+  char old[HASH_LENGTH];
+  strcpy(old, acc->password_hash);
+  password_hash_set_cost(0);
+  ck_assert_uint_eq(password_hash_cost(), PASSWORD_HASH_LEGACY_ITERATIONS);
+  ck_assert(account_update_password(acc, "n3w"));
+  ck_assert(!password_hash_is_pbkdf2(acc->password_hash));
+  ck_assert(account_validate_password(acc, "n3w"));
+  strcpy(acc->password_hash, old);
+  ck_assert(account_validate_password(acc, "s3cret"));
+  account_free(acc);
+
+  ck_assert(!password_hash_is_pbkdf2("$p2$$00:00"));
+  ck_assert(!password_hash_verify_pbkdf2("$p2$10$00:00", "pw"));
+
+#test test_calibration_respects_budget
+  password_hash_budget_t budget = { .target_ms = 5 };
+  unsigned int cost = password_hash_calibrate(&budget);
+  ck_assert_uint_ge(cost, PASSWORD_HASH_LEGACY_ITERATIONS);
+  ck_assert_uint_eq(password_hash_cost(), cost);
+
+  // a throughput no machine can meet clamps to the floor
+  password_hash_budget_t busy = { .hashes_per_second = 1e12, .min_iterations = 1200 };
+  ck_assert_uint_eq(password_hash_calibrate(&busy), 1200);
+  ck_assert_uint_eq(password_hash_cost(), 1200);
+
+  // no limit leaves the cost alone
+  password_hash_budget_t none = { 0 };
+  ck_assert_uint_eq(password_hash_calibrate(&none), 0);
+  ck_assert_uint_eq(password_hash_calibrate(NULL), 0);
+  ck_assert_uint_eq(password_hash_cost(), 1200);
+  password_hash_set_cost(0);
+
+#tcase rehash_migrate_test_case
+
+#test test_migration_wraps_every_hash
+  fixture_fill_store(ACCOUNTS, NULL);
+  unlink(CHECKPOINT_PATH);
+  rehash_options_t opts = {
+    .iterations = ITERATIONS, .threads = 2, .duty_cycle = 100, .chunk_size = 7,
+    .checkpoint_path = CHECKPOINT_PATH
+  };
+  rehash_report_t report;
+  ck_assert(rehash_migrate_run(&opts, &report));
+  ck_assert(report.complete);
+  ck_assert_uint_eq(report.scanned, ACCOUNTS);
+  ck_assert_uint_eq(report.migrated, ACCOUNTS);
+  ck_assert_int_eq(check_passwords(), ACCOUNTS);
+
+  // the checkpoint says we are done
+  ck_assert(rehash_migrate_run(&opts, &report));
+  ck_assert(report.complete);
+  ck_assert_uint_eq(report.scanned, 0);
+
+  // without it, everything is seen but left alone
+  opts.checkpoint_path = NULL;
+  ck_assert(rehash_migrate_run(&opts, &report));
+  ck_assert_uint_eq(report.scanned, ACCOUNTS);
+  ck_assert_uint_eq(report.migrated, 0);
+  ck_assert_uint_eq(report.skipped, ACCOUNTS);
+  unlink(CHECKPOINT_PATH);
+  account_store_clear();
+
+#test test_migration_resumes_from_checkpoint
+  fixture_fill_store(ACCOUNTS, NULL);
+  FILE *file = fopen(CHECKPOINT_PATH, "w");
+  fprintf(file, "rehash-checkpoint 1 iterations=%d next_shard=32\n", ITERATIONS);
+  fclose(file);
+
+  rehash_options_t opts = { .iterations = ITERATIONS, .duty_cycle = 100,
+                            .checkpoint_path = CHECKPOINT_PATH };
+  rehash_report_t report;
+  ck_assert(rehash_migrate_run(&opts, &report));
+  ck_assert(report.complete);
+  for (int i = 0; i < ACCOUNTS; i++) {
+    char userid[32];
+    snprintf(userid, sizeof(userid), "user%d", i);
+    account_t acc;
+    ck_assert(account_store_lookup(userid, &acc));
+    ck_assert_int_eq(password_hash_is_wrapped(acc.password_hash), shard_of(userid) >= 32);
+  }
+  check_passwords();
+
+  // a checkpoint for another cost starts over
+  opts.iterations = ITERATIONS + 1;
+  ck_assert(rehash_migrate_run(&opts, &report));
+  ck_assert_uint_eq(report.scanned, ACCOUNTS);
+  ck_assert_int_eq(check_passwords(), ACCOUNTS);
+  unlink(CHECKPOINT_PATH);
+  account_store_clear();
+
+#test test_background_migration_can_be_stopped_and_resumed
+  fixture_fill_store(ACCOUNTS, NULL);
+  unlink(CHECKPOINT_PATH);
+  rehash_options_t opts = { .iterations = ITERATIONS, .duty_cycle = 50,
+                            .checkpoint_path = CHECKPOINT_PATH };
+  ck_assert(rehash_migrate_start(&opts));
+  ck_assert(!rehash_migrate_start(&opts));
+  rehash_report_t report;
+  ck_assert(rehash_migrate_stop(&report));
+  ck_assert(!rehash_migrate_join(&report));
+  check_passwords();
+
+  ck_assert(rehash_migrate_start(&opts));
+  ck_assert(rehash_migrate_join(&report));
+  ck_assert(report.complete);
+  ck_assert_int_eq(check_passwords(), ACCOUNTS);
+  unlink(CHECKPOINT_PATH);
+  account_store_clear();
+
+// vim: syntax=c :
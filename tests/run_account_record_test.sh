@@ -5,7 +5,11 @@ echo "Generating C test file from account_record_test.ts..."
 checkmk account_record_test.ts > account_record_test.c
 
 echo "Compiling test program..."
-gcc -o test_account_record account_record_test.c ../src/account.c ../src/stubs.c -I../src \
+gcc -o test_account_record account_record_test.c ../src/account.c ../src/account_cache.c \
+    ../src/db_backend.c ../src/account_validate.c ../src/password_hash.c \
+    ../src/rand_pool.c ../src/ip_index.c ../src/login_span.c ../src/scrypt.c \
+    ../src/hash_arena.c ../src/thread_pool.c ../src/account_alloc.c ../src/slab.c \
+    ../src/account_store.c ../src/userid_key.c ../src/stubs.c -I../src \
     -lcheck -lsubunit -lssl -lcrypto -lm -pthread -lrt
 
 
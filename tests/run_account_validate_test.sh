@@ -0,0 +1,16 @@
+# Exit immediately if a command exits with a non-zero status.
+set -e
+
+echo "Generating C test file from account_validate_test.ts..."
+checkmk account_validate_test.ts > account_validate_test.c
+
+echo "Compiling test program..."
+gcc -o test_account_validate account_validate_test.c ../src/account_validate.c \
+    ../src/account.c ../src/account_cache.c ../src/db_backend.c ../src/password_hash.c \
+    ../src/rand_pool.c ../src/ip_index.c ../src/login_span.c ../src/scrypt.c \
+    ../src/hash_arena.c ../src/thread_pool.c ../src/account_alloc.c ../src/slab.c \
+    ../src/account_store.c ../src/userid_key.c ../src/stubs.c -I../src \
+    -lcheck -lsubunit -lssl -lcrypto -lm -pthread -lrt
+
+echo "Running unit tests..."
+./test_account_validate
@@ -0,0 +1,19 @@
+# Exit immediately if a command exits with a non-zero status.
+set -e
+
+echo "Generating C test file from db_sqlite_test.ts..."
+checkmk db_sqlite_test.ts > db_sqlite_test.c
+
+echo "Compiling test program..."
+gcc -o test_db_sqlite db_sqlite_test.c ../src/db_sqlite.c ../src/db_backend.c \
+    ../src/login.c ../src/audit_log.c ../src/crc32.c ../src/login_admission.c \
+    ../src/login_stats.c ../src/login_trace.c ../src/userid_filter.c \
+    ../src/account_cache.c ../src/account.c ../src/account_validate.c \
+    ../src/password_hash.c ../src/rand_pool.c ../src/ip_index.c ../src/login_span.c \
+    ../src/scrypt.c ../src/hash_arena.c ../src/account_alloc.c ../src/slab.c \
+    ../src/account_store.c ../src/userid_key.c ../src/thread_pool.c ../src/stubs.c \
+    -I../src \
+    -lcheck -lsubunit -lsqlite3 -lssl -lcrypto -lm -pthread -lrt
+
+echo "Running unit tests..."
+./test_db_sqlite
@@ -0,0 +1,180 @@
+#define CITS3007_PERMISSIVE
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "db_backend.h"
+#include "login.h"
+#include "shm_store.h"
+#include "userid_filter.h"
+
+#define CLIENT_IP 0x0a000001
+#define CHILDREN 4
+#define LOGINS_PER_CHILD 1000
+
+static char segment[64];
+
+static shm_store_t *create_store(size_t capacity)
+{
+  snprintf(segment, sizeof(segment), "/shm_store_test_%ld", (long) getpid());
+  shm_unlink(segment);
+  shm_store_options_t opts = { .capacity = capacity };
+  shm_store_t *store = shm_store_open(segment, &opts);
+  ck_assert_ptr_nonnull(store);
+  return store;
+}
+
+static void add_account(shm_store_t *store, const char *userid, const char *password)
+{
+  account_t *acc = account_create(userid, password, "u@example.com", "2000-01-01");
+  ck_assert_ptr_nonnull(acc);
+  ck_assert(shm_store_insert(store, acc));
+  account_free(acc);
+}
+
+static void wait_for_children(int children)
+{
+  for (int i = 0; i < children; i++) {
+    int status;
+    ck_assert_int_ne(wait(&status), -1);
+    ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+}
+
+// dies half-way through rewriting the account, holding the store's mutex
+static bool die_mid_change(account_t *acc, void *arg)
+{
+  (void) arg;
+  memset(acc->email, 'x', sizeof(acc->email));
+  acc->login_fail_count = 99;
+  _exit(0);
+}
+
+static bool set_email(account_t *acc, void *arg)
+{
+  snprintf(acc->email, sizeof(acc->email), "%s", (const char *) arg);
+  return true;
+}
+
+#suite shm_store_suite
+
+#tcase shm_store_test_case
+
+#test test_insert_lookup_and_attach
+  shm_store_t *store = create_store(16);
+  add_account(store, "alice", "pw");
+  account_t acc;
+  ck_assert(shm_store_lookup(store, "alice", &acc));
+  ck_assert_str_eq(acc.userid, "alice");
+  ck_assert(!shm_store_lookup(store, "bob", &acc));
+  ck_assert(!shm_store_insert(store, &acc));
+
+  // a second mapping, as another process would have, sees the same accounts
+  shm_store_t *other = shm_store_open(segment, NULL);
+  ck_assert_ptr_nonnull(other);
+  ck_assert(shm_store_modify(other, "alice", set_email, "alice@example.com"));
+  ck_assert(shm_store_set_unban_time(other, "alice", 1234));
+  ck_assert(shm_store_lookup(store, "alice", &acc));
+  ck_assert_str_eq(acc.email, "alice@example.com");
+  ck_assert_int_eq(acc.unban_time, 1234);
+
+  ck_assert(shm_store_remove(store, "alice"));
+  ck_assert(!shm_store_lookup(other, "alice", &acc));
+  add_account(store, "alice", "pw2");
+  ck_assert(shm_store_lookup(other, "alice", &acc));
+  ck_assert_int_eq(acc.unban_time, 0);
+  shm_store_stats_t stats;
+  shm_store_get_stats(other, &stats);
+  ck_assert_uint_eq(stats.count, 1);
+  ck_assert_uint_eq(stats.capacity, 16);
+
+  shm_store_close(other);
+  shm_store_close(store);
+  ck_assert(shm_store_unlink(segment));
+
+#test test_logins_from_many_processes
+  shm_store_t *store = create_store(16);
+  add_account(store, "carol", "pw");
+  userid_key_t key;
+  ck_assert(userid_key_init(&key, "carol"));
+
+  for (int c = 0; c < CHILDREN; c++) {
+    if (fork() == 0) {
+      shm_store_t *mine = shm_store_open(segment, NULL);
+      for (int i = 0; mine && i < LOGINS_PER_CHILD; i++) {
+        shm_store_record_login(mine, &key, true, CLIENT_IP, 1700000000);
+      }
+      _exit(mine ? 0 : 1);
+    }
+  }
+  wait_for_children(CHILDREN);
+  account_t acc;
+  ck_assert(shm_store_lookup(store, "carol", &acc));
+  // increments from every process, none lost
+  ck_assert_uint_eq(acc.login_count, CHILDREN * LOGINS_PER_CHILD);
+  ck_assert_uint_eq(acc.last_ip, CLIENT_IP);
+
+  // handle_login records through the backend the same way
+  db_backend_t backend;
+  shm_store_backend(store, &backend);
+  db_backend_set(&backend);
+  ck_assert(userid_filter_rebuild(0, 0));
+  ck_assert(userid_filter_may_contain("carol"));
+  int fd = open("/dev/null", O_WRONLY);
+  login_session_data_t session;
+  ck_assert_int_eq(handle_login("carol", "wrong", CLIENT_IP, time(NULL), fd, &session),
+                   LOGIN_FAIL_BAD_PASSWORD);
+  ck_assert(shm_store_lookup(store, "carol", &acc));
+  ck_assert_uint_eq(acc.login_fail_count, 1);
+  ck_assert_uint_eq(acc.login_count, 0);
+  ck_assert_int_eq(handle_login("carol", "pw", CLIENT_IP, time(NULL), fd, &session),
+                   LOGIN_SUCCESS);
+  ck_assert(shm_store_lookup(store, "carol", &acc));
+  ck_assert_uint_eq(acc.login_fail_count, 0);
+  ck_assert_uint_eq(acc.login_count, 1);
+  userid_filter_disable();
+  db_backend_set(NULL);
+  close(fd);
+
+  shm_store_close(store);
+  ck_assert(shm_store_unlink(segment));
+
+#test test_writer_death_is_undone
+  shm_store_t *store = create_store(16);
+  add_account(store, "dave", "pw");
+  ck_assert(shm_store_modify(store, "dave", set_email, "dave@example.com"));
+
+  if (fork() == 0) {
+    shm_store_t *mine = shm_store_open(segment, NULL);
+    if (mine) {
+      shm_store_modify(mine, "dave", die_mid_change, NULL);
+    }
+    _exit(1);
+  }
+  wait_for_children(1);
+
+  // the reader finds the record stuck mid-change, and taking the dead
+  // writer's mutex puts it back as it was
+  account_t acc;
+  ck_assert(shm_store_lookup(store, "dave", &acc));
+  ck_assert_str_eq(acc.email, "dave@example.com");
+  ck_assert_uint_eq(acc.login_fail_count, 0);
+  shm_store_stats_t stats;
+  shm_store_get_stats(store, &stats);
+  ck_assert_uint_eq(stats.recoveries, 1);
+  ck_assert_uint_eq(stats.count, 1);
+
+  // and the store carries on
+  ck_assert(shm_store_modify(store, "dave", set_email, "dave@example.org"));
+  ck_assert(shm_store_lookup(store, "dave", &acc));
+  ck_assert_str_eq(acc.email, "dave@example.org");
+
+  shm_store_close(store);
+  ck_assert(shm_store_unlink(segment));
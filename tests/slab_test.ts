@@ -0,0 +1,168 @@
+#define CITS3007_PERMISSIVE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "account.h"
+#include "account_alloc.h"
+#include "slab.h"
+
+#suite slab_suite
+
+#tcase slab_cache_test_case
+
+// the steps of test_destroy_discards_other_threads_magazines
+static pthread_mutex_t step_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t step_changed = PTHREAD_COND_INITIALIZER;
+static int step;
+static slab_cache_t *shared_cache;
+
+static void step_to(int next)
+{
+  pthread_mutex_lock(&step_mutex);
+  step = next;
+  pthread_cond_broadcast(&step_changed);
+  pthread_mutex_unlock(&step_mutex);
+}
+
+static void wait_for_step(int wanted)
+{
+  pthread_mutex_lock(&step_mutex);
+  while (step != wanted) {
+    pthread_cond_wait(&step_changed, &step_mutex);
+  }
+  pthread_mutex_unlock(&step_mutex);
+}
+
+static void *use_shared_cache_twice(void *arg)
+{
+  (void) arg;
+  // leave objects of the first cache in this thread's magazine
+  wait_for_step(1);
+  slab_free(shared_cache, slab_alloc(shared_cache));
+  step_to(2);
+  // by now the first cache is gone and shared_cache is a new one
+  wait_for_step(3);
+  slab_free(shared_cache, slab_alloc(shared_cache));
+  step_to(4);
+  return NULL;
+}
+
+#test test_objects_are_distinct_and_aligned
+  slab_cache_t *cache = slab_cache_create("test", 40, 8);
+  ck_assert_ptr_nonnull(cache);
+  void *objects[20];
+  for (int i = 0; i < 20; i++) {
+    objects[i] = slab_alloc(cache);
+    ck_assert_ptr_nonnull(objects[i]);
+    ck_assert_uint_eq((uintptr_t) objects[i] % 16, 0);
+    memset(objects[i], i, 40);
+  }
+  for (int i = 0; i < 20; i++) {
+    for (int j = i + 1; j < 20; j++) {
+      ck_assert_ptr_ne(objects[i], objects[j]);
+    }
+    ck_assert_int_eq(((unsigned char *) objects[i])[39], i);
+  }
+  slab_cache_stats_t stats;
+  slab_cache_get_stats(cache, &stats);
+  ck_assert_uint_eq(stats.object_size, 48);
+  ck_assert_uint_ge(stats.objects_total, 20);
+  for (int i = 0; i < 20; i++) {
+    slab_free(cache, objects[i]);
+  }
+  slab_cache_destroy(cache);
+
+#test test_freed_objects_are_reused
+  slab_cache_t *cache = slab_cache_create("reuse", 64, 16);
+  void *first = slab_alloc(cache);
+  slab_free(cache, first);
+  void *second = slab_alloc(cache);
+  ck_assert_ptr_eq(first, second);
+  slab_free(cache, second);
+  slab_cache_destroy(cache);
+
+#test test_bulk_alloc_and_free
+  slab_cache_t *cache = slab_cache_create("bulk", 32, 100);
+  void *objects[500];
+  ck_assert_uint_eq(slab_alloc_bulk(cache, objects, 500), 500);
+  slab_cache_stats_t stats;
+  slab_cache_get_stats(cache, &stats);
+  ck_assert_uint_eq(stats.slabs, 5);
+  slab_free_bulk(cache, objects, 500);
+  // freed objects satisfy the next allocations without new slabs
+  ck_assert_uint_eq(slab_alloc_bulk(cache, objects, 500), 500);
+  slab_cache_get_stats(cache, &stats);
+  ck_assert_uint_eq(stats.slabs, 5);
+  slab_free_bulk(cache, objects, 500);
+  slab_cache_destroy(cache);
+
+#test test_destroy_discards_other_threads_magazines
+  step = 0;
+  pthread_t thread;
+  pthread_create(&thread, NULL, use_shared_cache_twice, NULL);
+  shared_cache = slab_cache_create("first", 64, 64);
+  step_to(1);
+  wait_for_step(2);
+  slab_cache_destroy(shared_cache);
+  // it gets the first cache's id, and may get its address too
+  shared_cache = slab_cache_create("second", 64, 64);
+  step_to(3);
+  wait_for_step(4);
+  pthread_join(thread, NULL);
+  // the thread's allocation came from a slab of the new cache, and only the
+  // new cache's objects were returned to it when the thread exited
+  slab_cache_stats_t stats;
+  slab_cache_get_stats(shared_cache, &stats);
+  ck_assert_uint_eq(stats.slabs, 1);
+  ck_assert_uint_eq(stats.objects_free, stats.objects_total);
+  slab_cache_destroy(shared_cache);
+
+#tcase account_alloc_test_case
+
+static void *churn_accounts(void *arg)
+{
+  (void) arg;
+  account_t *accounts[200];
+  for (int round = 0; round < 50; round++) {
+    for (int i = 0; i < 200; i++) {
+      accounts[i] = account_alloc();
+      if (!accounts[i]) {
+        return (void *) 1;
+      }
+      accounts[i]->account_id = i;
+    }
+    for (int i = 0; i < 200; i++) {
+      if (accounts[i]->account_id != i) {
+        return (void *) 1;
+      }
+      account_release(accounts[i]);
+    }
+  }
+  return NULL;
+}
+
+#test test_account_alloc_threads
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, churn_accounts, NULL);
+  }
+  for (int i = 0; i < 4; i++) {
+    void *result;
+    pthread_join(threads[i], &result);
+    ck_assert_ptr_null(result);
+  }
+
+#test test_account_create_uses_allocator
+  account_t *acc = account_create("slabuser", "pw", "s@example.com", "2000-01-01");
+  ck_assert_ptr_nonnull(acc);
+  ck_assert_int_eq(acc->account_id, 0);
+  account_free(acc);
+  account_t *batch[10];
+  ck_assert_uint_eq(account_alloc_bulk(batch, 10), 10);
+  account_release_bulk(batch, 10);
+
+// vim: syntax=c :
@@ -0,0 +1,37 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "test_fixtures.h"
+#include "account_alloc.h"
+#include "account_store.h"
+
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+
+account_t fixture_account(const char *userid, int64_t id)
+{
+  account_t acc;
+  memset(&acc, 0, sizeof(acc));
+  acc.account_id = id;
+  snprintf(acc.userid, sizeof(acc.userid), "%s", userid);
+  snprintf(acc.email, sizeof(acc.email), "%s@example.com", userid);
+  strcpy(acc.password_hash, FIXTURE_PASSWORD_HASH);
+  memcpy(acc.birthdate, "1990-02-28", BIRTHDATE_LENGTH);
+  return acc;
+}
+
+void fixture_fill_store(int n, fixture_setup_fn setup)
+{
+  account_store_clear();
+  for (int i = 0; i < n; i++) {
+    char userid[32];
+    snprintf(userid, sizeof(userid), "user%d", i);
+    account_t *acc = account_alloc();
+    ck_assert_ptr_nonnull(acc);
+    *acc = fixture_account(userid, 0);
+    if (setup) {
+      setup(acc, i);
+    }
+    ck_assert(account_store_insert(acc));
+  }
+}
@@ -0,0 +1,33 @@
+#ifndef TEST_FIXTURES_H
+#define TEST_FIXTURES_H
+
+/**
+ * @file test_fixtures.h
+ * @brief Accounts shared by the unit tests.
+ *
+ * Fixture accounts are filled in directly rather than by account_create(),
+ * so a test can make thousands of them without hashing a password for
+ * each: they all have FIXTURE_PASSWORD, hashed ahead of time in the legacy
+ * format (see password_hash.h).
+ */
+
+#include "account.h"
+
+#define FIXTURE_PASSWORD "pw"
+// PBKDF2-HMAC-SHA256 of FIXTURE_PASSWORD, 1000 iterations, salt 0x10..0x1f
+#define FIXTURE_PASSWORD_HASH \
+  "101112131415161718191a1b1c1d1e1f:20f404af3dcf67d4db13b2e3f0aed28b"
+
+// an account for userid with the given account_id, email
+// <userid>@example.com and FIXTURE_PASSWORD; the rest is zero
+account_t fixture_account(const char *userid, int64_t id);
+
+// called by fixture_fill_store() on each account before it is inserted
+typedef void (*fixture_setup_fn)(account_t *acc, int i);
+
+// empty the account store and insert n accounts, user0 to user<n-1>, with
+// emails user<i>@example.com and FIXTURE_PASSWORD. setup (if not NULL) can
+// change each one first.
+void fixture_fill_store(int n, fixture_setup_fn setup);
+
+#endif // TEST_FIXTURES_H
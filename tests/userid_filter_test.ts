@@ -0,0 +1,225 @@
+#define CITS3007_PERMISSIVE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "account.h"
+#include "account_dataset.h"
+#include "account_store.h"
+#include "db_backend.h"
+#include "db_sim.h"
+#include "login.h"
+#include "userid_filter.h"
+#include "test_fixtures.h"
+
+#define PRESENT 10000
+#define ABSENT 100000
+#define READERS 4
+
+static atomic_bool stop_readers;
+static atomic_int false_negatives;
+
+static void *query_present(void *arg)
+{
+  (void) arg;
+  char userid[32];
+  for (int i = 0; !atomic_load(&stop_readers); i = (i + 1) % PRESENT) {
+    snprintf(userid, sizeof(userid), "user%d", i);
+    if (!userid_filter_may_contain(userid)) {
+      atomic_fetch_add(&false_negatives, 1);
+    }
+  }
+  return NULL;
+}
+
+// the default backend falls back to db.h and so cannot be listed; these
+// tests serve the store alone through a simulated backend with no latency
+static db_sim_t *install_store_backend(void)
+{
+  db_sim_options_t opts = { 0 };
+  db_sim_t *sim = db_sim_create(&opts);
+  ck_assert_ptr_nonnull(sim);
+  db_backend_t backend;
+  db_sim_backend(sim, &backend);
+  db_backend_set(&backend);
+  return sim;
+}
+
+static void uninstall_store_backend(db_sim_t *sim)
+{
+  db_backend_set(NULL);
+  db_sim_destroy(sim);
+}
+
+#suite userid_filter_suite
+
+#tcase userid_filter_test_case
+
+#test test_disabled_filter_passes_everything
+  userid_filter_disable();
+  ck_assert(userid_filter_may_contain("anyone"));
+  ck_assert(!userid_filter_needs_rebuild());
+  userid_filter_stats_t stats;
+  userid_filter_get_stats(&stats);
+  ck_assert(!stats.enabled);
+
+#test test_no_false_negatives_and_bounded_false_positives
+  fixture_fill_store(PRESENT, NULL);
+  db_sim_t *sim = install_store_backend();
+  ck_assert(userid_filter_rebuild(0, 0.01));
+  char userid[32];
+  for (int i = 0; i < PRESENT; i++) {
+    snprintf(userid, sizeof(userid), "user%d", i);
+    ck_assert(userid_filter_may_contain(userid));
+  }
+  int false_positives = 0;
+  for (int i = 0; i < ABSENT; i++) {
+    snprintf(userid, sizeof(userid), "nobody%d", i);
+    false_positives += userid_filter_may_contain(userid);
+  }
+  // sized for 1.5x the store, so the rate should be well under the target
+  ck_assert_int_lt(false_positives, ABSENT / 100);
+
+  userid_filter_stats_t stats;
+  userid_filter_get_stats(&stats);
+  ck_assert(stats.enabled);
+  ck_assert_uint_eq(stats.capacity, PRESENT + PRESENT / 2);
+  ck_assert_uint_eq(stats.inserted, PRESENT);
+  ck_assert_uint_eq(stats.hashes, 7);
+  ck_assert_uint_eq(stats.bytes % 64, 0);
+  ck_assert_uint_lt(stats.bytes, stats.capacity * 2);
+  uninstall_store_backend(sim);
+  userid_filter_disable();
+  account_store_clear();
+
+#test test_follows_store_changes
+  fixture_fill_store(100, NULL);
+  db_sim_t *sim = install_store_backend();
+  ck_assert(userid_filter_rebuild(2000, 0.001));
+  ck_assert(!userid_filter_needs_rebuild());
+  account_t *acc = account_create("latecomer", "pw", "l@example.com", "2000-01-01");
+  ck_assert(account_store_insert(acc));
+  ck_assert(userid_filter_may_contain("latecomer"));
+  userid_filter_add("outside-store");
+  ck_assert(userid_filter_may_contain("outside-store"));
+
+  for (int i = 0; i < 100; i++) {
+    char userid[32];
+    snprintf(userid, sizeof(userid), "user%d", i);
+    ck_assert(account_store_remove(userid));
+  }
+  userid_filter_stats_t stats;
+  userid_filter_get_stats(&stats);
+  ck_assert_uint_eq(stats.removed, 100);
+  ck_assert(!userid_filter_needs_rebuild());
+  for (int i = 0; i < 500; i++) {
+    char userid[32];
+    snprintf(userid, sizeof(userid), "extra%d", i);
+    // each is removed before the next is created, so may share an email
+    ck_assert(account_store_insert(account_create(userid, "pw", "e@example.com",
+                                                  "2000-01-01")));
+    ck_assert(account_store_remove(userid));
+  }
+  ck_assert(userid_filter_needs_rebuild());
+
+  ck_assert(userid_filter_rebuild(0, 0));
+  ck_assert(!userid_filter_needs_rebuild());
+  ck_assert(userid_filter_may_contain("latecomer"));
+  userid_filter_get_stats(&stats);
+  ck_assert_uint_eq(stats.inserted, 1);
+  ck_assert_uint_eq(stats.removed, 0);
+  ck_assert(!userid_filter_rebuild(0, 1.5));
+  uninstall_store_backend(sim);
+  userid_filter_disable();
+  account_store_clear();
+
+#test test_rebuild_lists_installed_backend
+  fixture_fill_store(10, NULL);
+  account_t *outsider = account_create("outsider", "pw", "o@example.com", "2000-01-01");
+  ck_assert_ptr_nonnull(outsider);
+  account_dataset_build_t *build = account_dataset_build_begin(1);
+  ck_assert(account_dataset_build_add(build, outsider));
+  ck_assert(account_dataset_build_commit(build));
+
+  db_backend_t backend;
+  account_dataset_backend(&backend);
+  db_backend_set(&backend);
+  ck_assert(userid_filter_rebuild(0, 0));
+  ck_assert(userid_filter_may_contain("outsider"));
+  userid_filter_stats_t stats;
+  userid_filter_get_stats(&stats);
+  ck_assert_uint_eq(stats.inserted, 1);
+
+  // accounts the backend gains after the rebuild are added as they come
+  strcpy(outsider->userid, "latecomer");
+  ck_assert(account_dataset_update(outsider));
+  ck_assert(userid_filter_may_contain("latecomer"));
+  account_free(outsider);
+  db_backend_set(NULL);
+  userid_filter_disable();
+  account_store_clear();
+
+#test test_default_backend_is_not_listed
+  fixture_fill_store(10, NULL);
+  // the default backend finds db.h's "bob", which the store doesn't list
+  ck_assert(!userid_filter_rebuild(0, 0));
+  userid_filter_stats_t stats;
+  userid_filter_get_stats(&stats);
+  ck_assert(!stats.enabled);
+  ck_assert(userid_filter_may_contain("bob"));
+  int devnull = open("/dev/null", O_WRONLY);
+  login_session_data_t session;
+  ck_assert_int_ne(handle_login("bob", "pw", 0, 0, devnull, &session),
+                   LOGIN_FAIL_USER_NOT_FOUND);
+  close(devnull);
+  account_store_clear();
+
+#test test_rebuild_while_querying
+  fixture_fill_store(PRESENT, NULL);
+  db_sim_t *sim = install_store_backend();
+  ck_assert(userid_filter_rebuild(0, 0));
+  atomic_store(&stop_readers, false);
+  atomic_store(&false_negatives, 0);
+  pthread_t threads[READERS];
+  for (int i = 0; i < READERS; i++) {
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, query_present, NULL), 0);
+  }
+  for (int round = 0; round < 10; round++) {
+    ck_assert(userid_filter_rebuild(0, round % 2 ? 0.05 : 0.001));
+  }
+  atomic_store(&stop_readers, true);
+  for (int i = 0; i < READERS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  ck_assert_int_eq(atomic_load(&false_negatives), 0);
+  uninstall_store_backend(sim);
+  userid_filter_disable();
+  account_store_clear();
+
+#test test_handle_login_skips_lookup_for_filtered_user
+  fixture_fill_store(10, NULL);
+  db_sim_t *sim = install_store_backend();
+  ck_assert(userid_filter_rebuild(0, 0));
+  int devnull = open("/dev/null", O_WRONLY);
+  ck_assert_int_ne(devnull, -1);
+  login_session_data_t session;
+  userid_filter_stats_t before, after;
+  userid_filter_get_stats(&before);
+  ck_assert_int_eq(handle_login("no-such-user", "pw", 0, 0, devnull, &session),
+                   LOGIN_FAIL_USER_NOT_FOUND);
+  ck_assert_int_eq(handle_login("user3", FIXTURE_PASSWORD, 0, 0, devnull, &session),
+                   LOGIN_SUCCESS);
+  userid_filter_get_stats(&after);
+  ck_assert_uint_eq(after.queries - before.queries, 2);
+  ck_assert_uint_eq(after.rejected - before.rejected, 1);
+  close(devnull);
+  uninstall_store_backend(sim);
+  userid_filter_disable();
+  account_store_clear();
+
+// vim: syntax=c :